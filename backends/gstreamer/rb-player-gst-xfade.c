@@ -52,6 +52,13 @@
  * - rb_player_play():  -> PREROLL_PLAY
  * - preroll finishes:  -> WAITING
  *
+ * a stream can be opened well before it is played (rb_player_open_ahead()),
+ * so it can decode ahead (see the predecode-time property).  such a stream
+ * goes at the end of the stream list, and rb_player_play() skips it, so the
+ * current stream can still be paused and resumed.  opening the same uri again
+ * while it is PREROLLING or WAITING moves it to the front of the list;
+ * opening anything else discards it.
+ *
  * from WAITING:
  *
  * - rb_player_play(), _AFTER_EOS, other stream playing:  -> WAITING_EOS
@@ -139,6 +146,7 @@
 
 #include "config.h"
 #include <math.h>
+#include <time.h>
 
 #include <glib/gi18n.h>
 #include <gst/gst.h>
@@ -215,10 +223,17 @@ G_DEFINE_TYPE_WITH_CODE(RBPlayerGstXFade, rb_player_gst_xfade, G_TYPE_OBJECT,
 
 #define PAUSE_FADE_LENGTH	(GST_SECOND / 2)
 
+/* the mixer runs at this rate unless native rate mixing is enabled */
+#define DEFAULT_MIX_RATE		44100
+#define DEFAULT_RESAMPLE_QUALITY	4
+
 enum
 {
 	PROP_0,
-	PROP_BUS
+	PROP_BUS,
+	PROP_NATIVE_RATE_MIXING,
+	PROP_RESAMPLE_QUALITY,
+	PROP_PREDECODE_TIME
 };
 
 enum
@@ -247,6 +262,8 @@ struct _RBPlayerGstXFadePrivate
 	GstElement *silencebin;
 	GstElement *adder;
 	GstElement *capsfilter;
+	GstElement *outputcapsfilter;
+	GstElement *silencecapsfilter;
 	GstElement *volume;
 	GstElement *sink;
 	GstElement *tee;
@@ -261,6 +278,17 @@ struct _RBPlayerGstXFadePrivate
 	} sink_state;
 	GRecMutex sink_lock;
 
+	/* mixer format: target_caps is what new streams are converted to,
+	 * mixer_caps is what the adder is currently running with.  these only
+	 * differ while the mixer is idle.  both are protected by the sink lock.
+	 */
+	gboolean native_rate_mixing;
+	int resample_quality;
+	gint64 predecode_time;
+	GstCaps *target_caps;
+	GstCaps *mixer_caps;
+	guint cpu_report_ticks;
+
 	GList *waiting_tees;
 	GList *waiting_filters;
 
@@ -339,6 +367,7 @@ typedef struct
 	GstElement *capsfilter;
 	GstElement *preroll;
 	GstElement *identity;
+	GstCaps *caps;
 	gboolean decoder_linked;
 	gboolean emitted_playing;
 	gboolean emitted_image;
@@ -361,6 +390,7 @@ typedef struct
 	gboolean fading;
 	gboolean starting_eos;
 	gboolean use_buffering;
+	gboolean opened_ahead;
 
 	gulong adjust_probe_id;
 	gulong block_probe_id;
@@ -375,6 +405,15 @@ typedef struct
 	gulong  emit_missing_plugins_id;
 
 	GList *tags;
+
+	/* cpu time spent converting the decoded audio to the mixer format,
+	 * and the amount of audio converted, both in microseconds.
+	 */
+	gint64 convert_start;
+	volatile gint convert_cpu;
+	volatile gint convert_audio;
+	guint reported_cpu;
+	guint reported_audio;
 } RBXFadeStream;
 
 #define RB_TYPE_XFADE_STREAM 	(rb_xfade_stream_get_type ())
@@ -383,6 +422,7 @@ typedef struct
 
 static void adjust_stream_base_time (RBXFadeStream *stream);
 static gboolean actually_start_stream (RBXFadeStream *stream, GError **error);
+static void negotiate_mixer_caps (RBPlayerGstXFade *player, RBXFadeStream *stream);
 
 static void rb_xfade_stream_class_init (RBXFadeStreamClass *klass);
 
@@ -477,6 +517,10 @@ rb_xfade_stream_finalize (GObject *object)
 	
 	g_free (sd->uri);
 
+	if (sd->caps != NULL) {
+		gst_caps_unref (sd->caps);
+	}
+
 	if (sd->error != NULL) {
 		g_error_free (sd->error);
 	}
@@ -619,6 +663,15 @@ rb_player_gst_xfade_get_property (GObject *object,
 			gst_object_unref (bus);
 		}
 		break;
+	case PROP_NATIVE_RATE_MIXING:
+		g_value_set_boolean (value, player->priv->native_rate_mixing);
+		break;
+	case PROP_RESAMPLE_QUALITY:
+		g_value_set_int (value, player->priv->resample_quality);
+		break;
+	case PROP_PREDECODE_TIME:
+		g_value_set_double (value, (double) player->priv->predecode_time / GST_SECOND);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -631,9 +684,21 @@ rb_player_gst_xfade_set_property (GObject *object,
 				  const GValue *value,
 				  GParamSpec *pspec)
 {
-	/*RBPlayerGstXFade *player = RB_PLAYER_GST_XFADE (object);*/
+	RBPlayerGstXFade *player = RB_PLAYER_GST_XFADE (object);
 
 	switch (prop_id) {
+	case PROP_NATIVE_RATE_MIXING:
+		/* takes effect the next time the mixer is idle */
+		player->priv->native_rate_mixing = g_value_get_boolean (value);
+		break;
+	case PROP_RESAMPLE_QUALITY:
+		/* takes effect for streams created after this */
+		player->priv->resample_quality = g_value_get_int (value);
+		break;
+	case PROP_PREDECODE_TIME:
+		/* takes effect for streams created after this */
+		player->priv->predecode_time = (gint64) (g_value_get_double (value) * GST_SECOND);
+		break;
 	default:
 		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
 		break;
@@ -657,6 +722,50 @@ rb_player_gst_xfade_class_init (RBPlayerGstXFadeClass *klass)
 							      "GStreamer message bus",
 							      GST_TYPE_BUS,
 							      G_PARAM_READABLE));
+	/**
+	 * RBPlayerGstXFade:native-rate-mixing:
+	 *
+	 * If %TRUE, streams are mixed as 32 bit floating point samples at
+	 * the rate of the first stream played after the mixer has been idle,
+	 * or the nearest rate the output device supports.  Otherwise, streams
+	 * are mixed as 16 bit integers at 44100Hz.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_NATIVE_RATE_MIXING,
+					 g_param_spec_boolean ("native-rate-mixing",
+							       "native-rate-mixing",
+							       "whether to mix at the native sample rate",
+							       FALSE,
+							       G_PARAM_READWRITE));
+	/**
+	 * RBPlayerGstXFade:resample-quality:
+	 *
+	 * Quality setting for the resampler used to convert each stream to the
+	 * mixer sample rate, from 0 (fastest) to 10 (best).
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_RESAMPLE_QUALITY,
+					 g_param_spec_int ("resample-quality",
+							   "resample-quality",
+							   "resampler quality",
+							   0, 10, DEFAULT_RESAMPLE_QUALITY,
+							   G_PARAM_READWRITE));
+	/**
+	 * RBPlayerGstXFade:predecode-time:
+	 *
+	 * Amount of decoded audio, in seconds, to keep buffered ahead of
+	 * each stream.  A stream opened before the previous stream finishes
+	 * decodes this much of itself while it waits to start, so it can
+	 * start on time even if reading the file stalls.  If 0, only about
+	 * a second is decoded ahead.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_PREDECODE_TIME,
+					 g_param_spec_double ("predecode-time",
+							      "predecode-time",
+							      "seconds of audio to decode in advance",
+							      0.0, 60.0, 0.0,
+							      G_PARAM_READWRITE));
 
 	signals[PREPARE_SOURCE] =
 		g_signal_new ("prepare-source",
@@ -727,6 +836,7 @@ rb_player_init (RBPlayerIface *iface)
 	iface->set_time = rb_player_gst_xfade_set_time;
 	iface->get_time = rb_player_gst_xfade_get_time;
 	iface->multiple_open = (RBPlayerFeatureFunc) rb_true_function;
+	iface->open_ahead = rb_player_gst_xfade_open_ahead;
 }
 
 static void
@@ -752,6 +862,7 @@ rb_player_gst_xfade_init (RBPlayerGstXFade *player)
 	g_rec_mutex_init (&player->priv->stream_list_lock);
 	g_rec_mutex_init (&player->priv->sink_lock);
 	player->priv->cur_volume = 1.0f;
+	player->priv->resample_quality = DEFAULT_RESAMPLE_QUALITY;
 }
 
 static void
@@ -821,6 +932,13 @@ rb_player_gst_xfade_finalize (GObject *object)
 	}
 	g_list_free (player->priv->waiting_filters);
 
+	if (player->priv->target_caps != NULL) {
+		gst_caps_unref (player->priv->target_caps);
+	}
+	if (player->priv->mixer_caps != NULL) {
+		gst_caps_unref (player->priv->mixer_caps);
+	}
+
 	G_OBJECT_CLASS (rb_player_gst_xfade_parent_class)->finalize (object);
 }
 
@@ -1081,7 +1199,8 @@ link_and_unblock_stream (RBXFadeStream *stream, GError **error)
 	GstStateChangeReturn scr;
 	RBPlayerGstXFade *player = stream->player;
 	gboolean result;
-	
+
+	negotiate_mixer_caps (player, stream);
 	if (start_sink (player, error) == FALSE) {
 		rb_debug ("sink didn't start, so we're not going to link the stream");
 		return FALSE;
@@ -2022,6 +2141,117 @@ stream_source_setup_cb (GstElement *decoder, GstElement *source, RBXFadeStream *
 	g_signal_emit (stream->player, signals[PREPARE_SOURCE], 0, stream->uri, source);
 }
 
+static GstCaps *
+create_mix_caps (gboolean native_rate_mixing, int rate)
+{
+	return gst_caps_new_simple ("audio/x-raw",
+				    "format",   G_TYPE_STRING, native_rate_mixing ? "F32LE" : "S16LE",
+				    "channels", G_TYPE_INT, 2,
+				    "layout",	G_TYPE_STRING, "interleaved",
+				    "rate",	G_TYPE_INT, rate,
+				    NULL);
+}
+
+static int
+get_caps_rate (GstCaps *caps)
+{
+	int rate = 0;
+
+	if (caps != NULL && gst_caps_get_size (caps) > 0) {
+		gst_structure_get_int (gst_caps_get_structure (caps, 0), "rate", &rate);
+	}
+	return rate;
+}
+
+/* finds the rate closest to the one given that the output device prefers */
+static int
+choose_mix_rate (RBPlayerGstXFade *player, int rate)
+{
+	GstStructure *structure;
+	GstCaps *caps;
+	GstPad *pad;
+	int chosen;
+
+	pad = gst_element_get_static_pad (player->priv->sink, "sink");
+	if (pad == NULL)
+		return rate;
+
+	caps = gst_pad_query_caps (pad, NULL);
+	gst_object_unref (pad);
+
+	chosen = rate;
+	if (gst_caps_is_any (caps) == FALSE && gst_caps_is_empty (caps) == FALSE) {
+		/* the first structure is the device's preferred format */
+		caps = gst_caps_truncate (caps);
+		structure = gst_caps_get_structure (caps, 0);
+		if (gst_structure_has_field (structure, "rate")) {
+			gst_structure_fixate_field_nearest_int (structure, "rate", rate);
+			gst_structure_get_int (structure, "rate", &chosen);
+		}
+	}
+	gst_caps_unref (caps);
+
+	if (chosen != rate) {
+		rb_debug ("output device doesn't like %dHz, mixing at %dHz instead", rate, chosen);
+	}
+	return chosen;
+}
+
+/* takes ownership of the caps */
+static void
+set_stream_caps (RBXFadeStream *stream, GstCaps *caps)
+{
+	if (stream->caps != NULL) {
+		gst_caps_unref (stream->caps);
+	}
+	stream->caps = caps;
+	g_object_set (stream->capsfilter, "caps", caps, NULL);
+}
+
+/*
+ * picks the format a stream is converted to for mixing, once its decoded
+ * format is known.  if no other stream is playing or waiting to play, the
+ * mixer is idle, so the stream gets to pick the mixer format.  otherwise it
+ * has to use whatever the mixer is (or is about to be) running with.
+ */
+static void
+choose_stream_caps (RBXFadeStream *stream, GstCaps *decoded)
+{
+	RBPlayerGstXFade *player = stream->player;
+	gboolean idle;
+	GList *l;
+	int rate;
+
+	g_rec_mutex_lock (&player->priv->sink_lock);
+
+	idle = (g_atomic_int_get (&player->priv->linked_streams) == 0);
+	g_rec_mutex_lock (&player->priv->stream_list_lock);
+	for (l = player->priv->streams; idle && l != NULL; l = l->next) {
+		RBXFadeStream *pstream = (RBXFadeStream *)l->data;
+		if (pstream != stream && pstream->state != PENDING_REMOVE)
+			idle = FALSE;
+	}
+	g_rec_mutex_unlock (&player->priv->stream_list_lock);
+
+	if (idle) {
+		GstCaps *caps;
+
+		rate = DEFAULT_MIX_RATE;
+		if (player->priv->native_rate_mixing) {
+			rate = get_caps_rate (decoded);
+			rate = choose_mix_rate (player, (rate > 0) ? rate : DEFAULT_MIX_RATE);
+		}
+
+		caps = create_mix_caps (player->priv->native_rate_mixing, rate);
+		gst_caps_replace (&player->priv->target_caps, caps);
+		gst_caps_unref (caps);
+	}
+
+	rb_debug ("stream %s will be mixed at %dHz", stream->uri, get_caps_rate (player->priv->target_caps));
+	set_stream_caps (stream, gst_caps_ref (player->priv->target_caps));
+	g_rec_mutex_unlock (&player->priv->sink_lock);
+}
+
 /* links uridecodebin src pads to the rest of the output pipeline */
 static void
 stream_pad_added_cb (GstElement *decoder, GstPad *pad, RBXFadeStream *stream)
@@ -2051,7 +2281,14 @@ stream_pad_added_cb (GstElement *decoder, GstPad *pad, RBXFadeStream *stream)
 		/* probably should never happen */
 		rb_debug ("hmm, decoder is already linked");
 	} else {
+		GstCaps *decoded;
+
 		rb_debug ("got decoded audio pad for stream %s", stream->uri);
+		decoded = gst_pad_get_current_caps (pad);
+		choose_stream_caps (stream, decoded ? decoded : caps);
+		if (decoded != NULL)
+			gst_caps_unref (decoded);
+
 		vpad = gst_element_get_static_pad (stream->identity, "sink");
 		gst_pad_link (pad, vpad);
 		gst_object_unref (vpad);
@@ -2145,11 +2382,81 @@ stream_src_event_cb (GstPad *pad, GstPadProbeInfo *info, RBXFadeStream *stream)
 	return GST_PAD_PROBE_OK;
 }
 
+static gint64
+thread_cpu_time (void)
+{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+	struct timespec ts;
+
+	if (clock_gettime (CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+		return (((gint64) ts.tv_sec) * G_USEC_PER_SEC) + (ts.tv_nsec / 1000);
+#endif
+	return g_get_monotonic_time ();
+}
+
+/* buffers are pushed from the decoder through the conversion elements to the
+ * preroll queue on a single streaming thread, so the thread cpu time between
+ * these two probes is the cost of converting the buffer for mixing.
+ */
+static GstPadProbeReturn
+convert_start_probe_cb (GstPad *pad, GstPadProbeInfo *info, RBXFadeStream *stream)
+{
+	stream->convert_start = thread_cpu_time ();
+	return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+convert_done_probe_cb (GstPad *pad, GstPadProbeInfo *info, RBXFadeStream *stream)
+{
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+
+	if (stream->convert_start != 0) {
+		g_atomic_int_add (&stream->convert_cpu, (gint) (thread_cpu_time () - stream->convert_start));
+		stream->convert_start = 0;
+	}
+	if (GST_BUFFER_DURATION_IS_VALID (buffer)) {
+		g_atomic_int_add (&stream->convert_audio, (gint) (GST_BUFFER_DURATION (buffer) / GST_USECOND));
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+/* decode at least a second during prerolling, to hopefully avoid underruns.
+ * we clear this when prerolling is finished.  bump the max buffer count up
+ * a bit (from 200) as with some formats it often takes more buffers to
+ * make up a whole second.  don't really want to remove it altogether, though.
+ *
+ * with a predecode time set, the queue is limited only by time, so a stream
+ * opened ahead of time keeps decoding into it while it waits to be started,
+ * and it stays that far ahead of playback afterwards.
+ */
+static void
+set_preroll_limits (RBXFadeStream *stream, gboolean prerolling)
+{
+	gint64 predecode = stream->player->priv->predecode_time;
+
+	if (predecode > 0) {
+		g_object_set (stream->preroll,
+			      "min-threshold-time", prerolling ? GST_SECOND : G_GINT64_CONSTANT (0),
+			      "max-size-time", MAX (predecode, GST_SECOND),
+			      "max-size-buffers", 0,
+			      "max-size-bytes", 0,
+			      NULL);
+	} else {
+		g_object_set (stream->preroll,
+			      "min-threshold-time", prerolling ? GST_SECOND : G_GINT64_CONSTANT (0),
+			      "max-size-buffers", prerolling ? 1000 : 200,
+			      NULL);
+	}
+}
+
 /*
  * stream playback bin:
  *
  * src [ ! queue ] ! decodebin ! audioconvert ! audioresample ! caps ! queue ! volume
  *
+ * caps is the mixer format: S16LE at 44100Hz, or with native rate mixing,
+ * F32LE at the rate picked when the mixer was last idle.
+ *
  * the first queue is only added for non-local streams.  the thresholds
  * and such are probably going to be configurable at some point,
  * since people seem to get all whiny if they don't have a buffer
@@ -2161,9 +2468,9 @@ static RBXFadeStream *
 create_stream (RBPlayerGstXFade *player, const char *uri, gpointer stream_data, GDestroyNotify stream_data_destroy)
 {
 	RBXFadeStream *stream;
-	GstCaps *caps;
 	GArray *stream_filters = NULL;
 	GstElement *tail;
+	GstPad *pad;
 	gint i;
 
 	rb_debug ("creating new stream for %s (stream data %p)", uri, stream_data);
@@ -2233,6 +2540,7 @@ create_stream (RBPlayerGstXFade *player, const char *uri, gpointer stream_data,
 		return NULL;
 	}
 	gst_object_ref (stream->audioresample);
+	g_object_set (stream->audioresample, "quality", player->priv->resample_quality, NULL);
 
 	stream->capsfilter = gst_element_factory_make ("capsfilter", NULL);
 	if (stream->capsfilter == NULL) {
@@ -2242,14 +2550,10 @@ create_stream (RBPlayerGstXFade *player, const char *uri, gpointer stream_data,
 	}
 	gst_object_ref (stream->capsfilter);
 
-	caps = gst_caps_new_simple ("audio/x-raw",
-				    "format",   G_TYPE_STRING, "S16LE",			/* appropriate? */
-				    "channels", G_TYPE_INT, 2,
-				    "layout",	G_TYPE_STRING, "interleaved",
-				    "rate",	G_TYPE_INT, 44100,
-				    NULL);
-	g_object_set (stream->capsfilter, "caps", caps, NULL);
-	gst_caps_unref (caps);
+	/* this gets updated once we know the decoded format */
+	g_rec_mutex_lock (&player->priv->sink_lock);
+	set_stream_caps (stream, gst_caps_ref (player->priv->target_caps));
+	g_rec_mutex_unlock (&player->priv->sink_lock);
 
 	stream->volume = gst_element_factory_make ("volume", NULL);
 	if (stream->volume == NULL) {
@@ -2277,15 +2581,7 @@ create_stream (RBPlayerGstXFade *player, const char *uri, gpointer stream_data,
 		g_object_unref (stream);
 		return NULL;
 	}
-	/* decode at least a second during prerolling, to hopefully avoid underruns.
-	 * we clear this when prerolling is finished.  bump the max buffer count up
-	 * a bit (from 200) as with some formats it often takes more buffers to
-	 * make up a whole second.  don't really want to remove it altogether, though.
-	 */
-	g_object_set (stream->preroll,
-		      "min-threshold-time", GST_SECOND,
-		      "max-size-buffers", 1000,
-		      NULL);
+	set_preroll_limits (stream, TRUE);
 
 	gst_bin_add_many (GST_BIN (stream),
 			  stream->decoder,
@@ -2338,6 +2634,17 @@ create_stream (RBPlayerGstXFade *player, const char *uri, gpointer stream_data,
 	}
 	gst_element_link (tail, stream->audioconvert);
 
+	/* only measure conversion costs if someone's going to see them */
+	if (rb_debug_matches ("report_stream_cpu", __FILE__)) {
+		pad = gst_element_get_static_pad (stream->identity, "sink");
+		gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback) convert_start_probe_cb, stream, NULL);
+		gst_object_unref (pad);
+
+		pad = gst_element_get_static_pad (stream->preroll, "sink");
+		gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, (GstPadProbeCallback) convert_done_probe_cb, stream, NULL);
+		gst_object_unref (pad);
+	}
+
 	/* ghost the stream src pad up to the bin */
 	stream->ghost_pad = gst_ghost_pad_new ("src", stream->src_pad);
 	gst_element_add_pad (GST_ELEMENT (stream), stream->ghost_pad);
@@ -2558,10 +2865,7 @@ stream_src_blocked_cb (GstPad *pad, GstPadProbeInfo *info, RBXFadeStream *stream
 	}
 	stream->src_blocked = TRUE;
 
-	g_object_set (stream->preroll,
-		      "min-threshold-time", G_GINT64_CONSTANT (0),
-		      "max-size-buffers", 200,		/* back to normal value */
-		      NULL);
+	set_preroll_limits (stream, FALSE);
 
 	g_object_get (stream->decoder, "source", &src, NULL);
 	query = gst_query_new_scheduling ();
@@ -2759,6 +3063,38 @@ get_times_and_stream (RBPlayerGstXFade *player, RBXFadeStream **pstream, gint64
 	return got_time;
 }
 
+static void
+report_stream_cpu (RBPlayerGstXFade *player)
+{
+	GList *l;
+
+	if (rb_debug_here () == FALSE)
+		return;
+
+	g_rec_mutex_lock (&player->priv->stream_list_lock);
+	for (l = player->priv->streams; l != NULL; l = l->next) {
+		RBXFadeStream *stream = (RBXFadeStream *)l->data;
+		guint cpu;
+		guint audio;
+		guint dcpu;
+		guint daudio;
+
+		cpu = (guint) g_atomic_int_get (&stream->convert_cpu);
+		audio = (guint) g_atomic_int_get (&stream->convert_audio);
+		dcpu = cpu - stream->reported_cpu;
+		daudio = audio - stream->reported_audio;
+		stream->reported_cpu = cpu;
+		stream->reported_audio = audio;
+		if (daudio == 0)
+			continue;
+
+		rb_debug ("stream %s: %u us cpu converting %u us of audio to %dHz (%.2f%%)",
+			  stream->uri, dcpu, daudio, get_caps_rate (stream->caps),
+			  ((double) dcpu * 100.0) / daudio);
+	}
+	g_rec_mutex_unlock (&player->priv->stream_list_lock);
+}
+
 static gboolean
 tick_timeout (RBPlayerGstXFade *player)
 {
@@ -2771,6 +3107,11 @@ tick_timeout (RBPlayerGstXFade *player)
 		g_object_unref (stream);
 	}
 
+	if (++player->priv->cpu_report_ticks >= RB_PLAYER_GST_XFADE_TICK_HZ) {
+		player->priv->cpu_report_ticks = 0;
+		report_stream_cpu (player);
+	}
+
 	return TRUE;
 }
 
@@ -2801,13 +3142,92 @@ stream_volume_changed (GObject *element, GParamSpec *pspec, RBPlayerGstXFade *pl
 	g_idle_add ((GSourceFunc) emit_volume_changed_idle, player);
 }
 
+/* caller must hold the sink lock */
+static void
+set_mixer_caps_locked (RBPlayerGstXFade *player, GstCaps *caps)
+{
+	GstStructure *structure;
+	GstCaps *outputcaps;
+
+	g_object_set (player->priv->silencesrc, "caps", caps, NULL);
+	g_object_set (player->priv->silencecapsfilter, "caps", caps, NULL);
+	g_object_set (player->priv->capsfilter, "caps", caps, NULL);
+
+	/* when mixing in floating point, let the sink pick the output
+	 * sample format rather than making audioconvert truncate it.
+	 */
+	outputcaps = gst_caps_copy (caps);
+	structure = gst_caps_get_structure (outputcaps, 0);
+	if (g_strcmp0 (gst_structure_get_string (structure, "format"), "F32LE") == 0) {
+		gst_structure_remove_field (structure, "format");
+	}
+	g_object_set (player->priv->outputcapsfilter, "caps", outputcaps, NULL);
+	gst_caps_unref (outputcaps);
+
+	gst_caps_replace (&player->priv->mixer_caps, caps);
+}
+
+/*
+ * called before linking a stream to the adder.  streams only pick a new
+ * format when the mixer is idle, so if the stream's format differs from
+ * the mixer's, nothing is linked to the adder and the output can be taken
+ * down without interrupting anything.  it's started again in the new format
+ * when the stream is linked.
+ */
+static void
+negotiate_mixer_caps (RBPlayerGstXFade *player, RBXFadeStream *stream)
+{
+	char *str;
+
+	g_rec_mutex_lock (&player->priv->sink_lock);
+	if (stream->caps == NULL || gst_caps_is_equal (stream->caps, player->priv->mixer_caps)) {
+		g_rec_mutex_unlock (&player->priv->sink_lock);
+		return;
+	}
+
+	if (g_atomic_int_get (&player->priv->linked_streams) != 0) {
+		g_warning ("Stream %s doesn't match the mixer format", stream->uri);
+		g_rec_mutex_unlock (&player->priv->sink_lock);
+		return;
+	}
+
+	str = gst_caps_to_string (stream->caps);
+	rb_debug ("changing mixer format to %s", str);
+	g_free (str);
+
+	if (player->priv->sink_state == SINK_PLAYING) {
+		gst_element_set_state (player->priv->outputbin, GST_STATE_READY);
+		gst_element_set_state (player->priv->adder, GST_STATE_READY);
+		gst_element_set_state (player->priv->silencebin, GST_STATE_READY);
+
+		if (player->priv->volume_handler) {
+			g_signal_handlers_disconnect_by_func (player->priv->volume_handler,
+							      G_CALLBACK (stream_volume_changed),
+							      player);
+			g_object_unref (player->priv->volume_handler);
+			player->priv->volume_handler = NULL;
+		}
+
+		/* so the pipeline selects a clock again when the sink starts */
+		gst_element_set_state (player->priv->pipeline, GST_STATE_READY);
+		player->priv->sink_state = SINK_STOPPED;
+	}
+
+	set_mixer_caps_locked (player, stream->caps);
+	g_rec_mutex_unlock (&player->priv->sink_lock);
+}
+
 /*
  * output sink + adder pipeline:
  *
  * outputcaps = audio/x-raw,channels=2,rate=44100,format=S16LE
- * outputbin = outputcaps ! volume ! filterbin ! audioconvert ! audioresample ! tee ! queue ! audiosink
+ * outputbin = outputcaps ! volume ! filterbin ! audioconvert ! audioresample ! outputcaps ! tee ! queue ! audiosink
  * silencebin = appsrc ! outputcaps
  *
+ * with native rate mixing, outputcaps is F32LE at a rate the sink accepts
+ * (see choose_mix_rate), so the output audioconvert and audioresample only
+ * have work to do if filters change the format.
+ *
  * pipeline = silencebin ! adder ! outputbin
  *
  * the tee in output bin has branches attached to it using the
@@ -3185,17 +3605,13 @@ create_sink (RBPlayerGstXFade *player, GError **error)
 		return TRUE;
 
 	/* set filter caps.
-	 * 44100Hz is about the most reasonable thing to use;
+	 * 44100Hz is about the most reasonable thing to use
+	 * until we know what we're playing;
 	 * we have audioconvert+audioresample afterwards in
 	 * case the output device doesn't actually support
 	 * that rate.
 	 */
-	caps = gst_caps_new_simple ("audio/x-raw",
-				    "format" ,  G_TYPE_STRING, "S16LE",
-				    "channels", G_TYPE_INT, 2,
-				    "rate",	G_TYPE_INT, 44100,
-				    "layout",	G_TYPE_STRING, "interleaved",
-				    NULL);
+	caps = create_mix_caps (player->priv->native_rate_mixing, DEFAULT_MIX_RATE);
 
 	player->priv->pipeline = gst_pipeline_new ("rbplayer");
 	add_bus_watch (player);
@@ -3212,6 +3628,7 @@ create_sink (RBPlayerGstXFade *player, GError **error)
 	player->priv->volume = gst_element_factory_make ("volume", "outputvolume");
 	player->priv->filterbin = rb_gst_create_filter_bin ();
 	capsfilter = gst_element_factory_make ("capsfilter", NULL);
+	player->priv->outputcapsfilter = capsfilter;
 	if (player->priv->pipeline == NULL ||
 	    player->priv->adder == NULL ||
 	    player->priv->capsfilter == NULL ||
@@ -3242,8 +3659,7 @@ create_sink (RBPlayerGstXFade *player, GError **error)
 		return FALSE;
 	}
 
-	g_object_set (player->priv->capsfilter, "caps", caps, NULL);
-	g_object_set (capsfilter, "caps", caps, NULL);
+	g_object_set (audioresample, "quality", player->priv->resample_quality, NULL);
 
 	g_object_set (queue, "max-size-buffers", 10, NULL);
 
@@ -3292,19 +3708,14 @@ create_sink (RBPlayerGstXFade *player, GError **error)
 	 * to get around this, for now we produce silence using an appsrc instead.
 	 */
 	player->priv->silencesrc = gst_element_factory_make ("appsrc", "silencesrc");
-	g_object_set (player->priv->silencesrc, "caps", caps, "format", GST_FORMAT_TIME, NULL);
-
-	g_signal_connect (player->priv->silencesrc, "need-data", G_CALLBACK (silencesrc_need_data_cb), player);
-
 	audioconvert = gst_element_factory_make ("audioconvert", "silenceconvert");
-
 	capsfilter = gst_element_factory_make ("capsfilter", "silencecapsfilter");
-	g_object_set (capsfilter, "caps", caps, NULL);
-	gst_caps_unref (caps);
+	player->priv->silencecapsfilter = capsfilter;
 
 	if (player->priv->silencesrc == NULL ||
 	    audioconvert == NULL ||
 	    capsfilter == NULL) {
+		gst_caps_unref (caps);
 		g_set_error (error,
 			     RB_PLAYER_ERROR,
 			     RB_PLAYER_ERROR_GENERAL,
@@ -3312,6 +3723,16 @@ create_sink (RBPlayerGstXFade *player, GError **error)
 		return FALSE;
 	}
 
+	g_object_set (player->priv->silencesrc, "format", GST_FORMAT_TIME, NULL);
+	g_signal_connect (player->priv->silencesrc, "need-data", G_CALLBACK (silencesrc_need_data_cb), player);
+
+	/* the silence buffer is all zeroes, which is silence in either mixer format */
+	g_rec_mutex_lock (&player->priv->sink_lock);
+	gst_caps_replace (&player->priv->target_caps, caps);
+	set_mixer_caps_locked (player, caps);
+	g_rec_mutex_unlock (&player->priv->sink_lock);
+	gst_caps_unref (caps);
+
 	gst_bin_add_many (GST_BIN (player->priv->silencebin),
 			  player->priv->silencesrc,
 			  audioconvert,
@@ -3396,14 +3817,16 @@ create_sink (RBPlayerGstXFade *player, GError **error)
 
 
 static gboolean
-rb_player_gst_xfade_open (RBPlayer *iplayer,
-			  const char *uri,
-			  gpointer stream_data,
-			  GDestroyNotify stream_data_destroy,
-			  GError **error)
+open_stream (RBPlayerGstXFade *player,
+	     const char *uri,
+	     gpointer stream_data,
+	     GDestroyNotify stream_data_destroy,
+	     gboolean ahead,
+	     GError **error)
 {
 	RBXFadeStream *stream;
-	RBPlayerGstXFade *player = RB_PLAYER_GST_XFADE (iplayer);
+	RBXFadeStream *predecoded = NULL;
+	gboolean need_reap = FALSE;
 	gboolean reused = FALSE;
 	GList *t;
 
@@ -3411,9 +3834,62 @@ rb_player_gst_xfade_open (RBPlayer *iplayer,
 	if (create_sink (player, error) == FALSE)
 		return FALSE;
 
-	/* see if anyone wants us to reuse an existing stream */
+	/* if the stream was opened in advance, it's already decoding, so use it.
+	 * any other stream that was opened but never played isn't wanted now.
+	 * opening ahead again only replaces streams that were opened ahead.
+	 */
 	g_rec_mutex_lock (&player->priv->stream_list_lock);
 	for (t = player->priv->streams; t != NULL; t = t->next) {
+		RBXFadeStream *pstream = (RBXFadeStream *)t->data;
+
+		if (pstream->state != PREROLLING && pstream->state != WAITING)
+			continue;
+		if (ahead && pstream->opened_ahead == FALSE)
+			continue;
+
+		if (predecoded == NULL && strcmp (pstream->uri, uri) == 0) {
+			predecoded = pstream;
+		} else {
+			rb_debug ("stream %s was opened but not played -> PENDING_REMOVE", pstream->uri);
+			pstream->state = PENDING_REMOVE;
+			need_reap = TRUE;
+		}
+	}
+
+	if (predecoded != NULL) {
+		gpointer old_data;
+		GDestroyNotify old_data_destroy;
+
+		rb_debug ("using predecoded stream for %s", uri);
+		g_mutex_lock (&predecoded->lock);
+		old_data = predecoded->stream_data;
+		old_data_destroy = predecoded->stream_data_destroy;
+		predecoded->stream_data = stream_data;
+		predecoded->stream_data_destroy = stream_data_destroy;
+		g_mutex_unlock (&predecoded->lock);
+		if (old_data_destroy != NULL && old_data != NULL)
+			old_data_destroy (old_data);
+
+		/* _play starts the stream at the front of the list */
+		if (ahead == FALSE) {
+			predecoded->opened_ahead = FALSE;
+			player->priv->streams = g_list_remove (player->priv->streams, predecoded);
+			player->priv->streams = g_list_prepend (player->priv->streams, predecoded);
+		}
+		dump_stream_list (player);
+	}
+	g_rec_mutex_unlock (&player->priv->stream_list_lock);
+
+	if (need_reap)
+		schedule_stream_reap (player);
+	if (predecoded != NULL)
+		return TRUE;
+
+	/* see if anyone wants us to reuse an existing stream.  a stream
+	 * opened ahead can't take over a stream that's still playing.
+	 */
+	g_rec_mutex_lock (&player->priv->stream_list_lock);
+	for (t = ahead ? NULL : player->priv->streams; t != NULL; t = t->next) {
 		RBXFadeStream *stream = (RBXFadeStream *)t->data;
 
 		switch (stream->state) {
@@ -3472,8 +3948,16 @@ rb_player_gst_xfade_open (RBPlayer *iplayer,
 		return FALSE;
 	}
 
+	/* a stream opened ahead stays behind the current stream until it's
+	 * opened again, so _play doesn't start it.
+	 */
 	g_rec_mutex_lock (&player->priv->stream_list_lock);
-	player->priv->streams = g_list_prepend (player->priv->streams, stream);
+	if (ahead) {
+		stream->opened_ahead = TRUE;
+		player->priv->streams = g_list_append (player->priv->streams, stream);
+	} else {
+		player->priv->streams = g_list_prepend (player->priv->streams, stream);
+	}
 	dump_stream_list (player);
 	g_rec_mutex_unlock (&player->priv->stream_list_lock);
 
@@ -3483,6 +3967,26 @@ rb_player_gst_xfade_open (RBPlayer *iplayer,
 	return TRUE;
 }
 
+static gboolean
+rb_player_gst_xfade_open (RBPlayer *iplayer,
+			  const char *uri,
+			  gpointer stream_data,
+			  GDestroyNotify stream_data_destroy,
+			  GError **error)
+{
+	return open_stream (RB_PLAYER_GST_XFADE (iplayer), uri, stream_data, stream_data_destroy, FALSE, error);
+}
+
+static gboolean
+rb_player_gst_xfade_open_ahead (RBPlayer *iplayer,
+				const char *uri,
+				gpointer stream_data,
+				GDestroyNotify stream_data_destroy,
+				GError **error)
+{
+	return open_stream (RB_PLAYER_GST_XFADE (iplayer), uri, stream_data, stream_data_destroy, TRUE, error);
+}
+
 static gboolean
 stop_sink_later (RBPlayerGstXFade *player)
 {
@@ -3584,15 +4088,24 @@ rb_player_gst_xfade_play (RBPlayer *iplayer,
 			  gint64 crossfade,
 			  GError **error)
 {
-	RBXFadeStream *stream;
+	RBXFadeStream *stream = NULL;
 	int stream_state;
 	RBPlayerGstXFade *player = RB_PLAYER_GST_XFADE (iplayer);
 	gboolean ret = TRUE;
+	GList *l;
 
 	g_rec_mutex_lock (&player->priv->stream_list_lock);
 
+	/* streams opened ahead only get played once they're opened properly */
+	for (l = player->priv->streams; l != NULL; l = l->next) {
+		if (((RBXFadeStream *)l->data)->opened_ahead == FALSE) {
+			stream = l->data;
+			break;
+		}
+	}
+
 	/* is there anything to play? */
-	if (player->priv->streams == NULL) {
+	if (stream == NULL) {
 		g_set_error (error,
 			     RB_PLAYER_ERROR,
 			     RB_PLAYER_ERROR_GENERAL,
@@ -3601,8 +4114,7 @@ rb_player_gst_xfade_play (RBPlayer *iplayer,
 		g_rec_mutex_unlock (&player->priv->stream_list_lock);
 		return FALSE;
 	}
-	
-	stream = g_list_first (player->priv->streams)->data;
+
 	g_object_ref (stream);
 	g_rec_mutex_unlock (&player->priv->stream_list_lock);
 
@@ -0,0 +1,658 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+#include "rb-player-gst-analysis.h"
+#include "rb-player-gst-tee.h"
+#include "rb-debug.h"
+
+/**
+ * SECTION:rb-player-gst-analysis
+ * @short_description: shared spectrum and level analysis of the playback output
+ * @include: rb-player-gst-analysis.h
+ *
+ * Attaches a single branch to the player's output tee (see #RBPlayerGstTee)
+ * and analyses the output using #RBAudioAnalyser, so visualisations and
+ * level meters don't each need their own copy of the audio and their own
+ * analysis elements.  The analysis runs in the branch's streaming thread,
+ * not the thread feeding the audio sink.
+ *
+ * In-process consumers call rb_player_gst_analysis_add_consumer and connect
+ * to the 'frame' signal, which is emitted on the main thread with the most
+ * recent analysis frame; frames produced while the main thread is busy are
+ * skipped rather than queued.  External programs can read every frame from
+ * a ring in shared memory (see #RBPlayerGstAnalysisShmHeader), which is
+ * enabled with the 'export-shm' property.  The branch is only attached to
+ * the pipeline while there are consumers or the ring is enabled.
+ */
+
+#define ANALYSIS_CAPS	"audio/x-raw,format=" GST_AUDIO_NE (F32) ",layout=interleaved"
+#define SHM_FILE_NAME	"rhythmbox-analysis"
+
+enum
+{
+	PROP_0,
+	PROP_PLAYER,
+	PROP_FRAME_RATE,
+	PROP_BANDS,
+	PROP_EXPORT_SHM,
+	PROP_SHM_PATH
+};
+
+enum
+{
+	FRAME,
+	LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+struct _RBPlayerGstAnalysisPrivate
+{
+	RBPlayer *player;
+	GstElement *bin;
+	gboolean attached;
+	gint consumers;
+
+	gint frame_rate;
+	gint n_bands;
+	gboolean export_shm;
+
+	/* protects the analyser and the shared memory ring, which are
+	 * used by the streaming thread and replaced by property changes.
+	 */
+	GMutex stream_lock;
+	RBAudioAnalyser *analyser;
+	GstCaps *analyser_caps;
+	guint analyser_rate;
+	guint analyser_channels;
+	GstClockTime buffer_time;
+
+	char *shm_path;
+	RBPlayerGstAnalysisShmHeader *shm;
+	gsize shm_size;
+
+	/* protects the latest frame for in-process consumers */
+	GMutex frame_lock;
+	RBAudioAnalysisFrame latest;
+	guint frame_idle_id;
+};
+
+G_DEFINE_TYPE (RBPlayerGstAnalysis, rb_player_gst_analysis, G_TYPE_OBJECT)
+
+static gboolean
+emit_frame_idle (RBPlayerGstAnalysis *analysis)
+{
+	RBAudioAnalysisFrame frame;
+
+	g_mutex_lock (&analysis->priv->frame_lock);
+	frame = analysis->priv->latest;
+	analysis->priv->frame_idle_id = 0;
+	g_mutex_unlock (&analysis->priv->frame_lock);
+
+	if (analysis->priv->consumers > 0)
+		g_signal_emit (analysis, signals[FRAME], 0, &frame);
+	return FALSE;
+}
+
+/* called with the stream lock held */
+static void
+write_shm_frame (RBPlayerGstAnalysis *analysis, RBAudioAnalysisFrame *frame)
+{
+	RBPlayerGstAnalysisShmHeader *header = analysis->priv->shm;
+	gint count;
+	guint8 *slot;
+
+	count = header->write_count;
+	slot = ((guint8 *) header) + header->header_size + ((guint) count % header->n_slots) * header->frame_size;
+	memcpy (slot, frame, sizeof (RBAudioAnalysisFrame));
+	g_atomic_int_set (&header->write_count, count + 1);
+}
+
+/* called with the stream lock held */
+static void
+analysis_frame_cb (RBAudioAnalysisFrame *frame, gsize offset, RBPlayerGstAnalysis *analysis)
+{
+	if (GST_CLOCK_TIME_IS_VALID (analysis->priv->buffer_time)) {
+		frame->position = analysis->priv->buffer_time +
+			gst_util_uint64_scale (offset, GST_SECOND, analysis->priv->analyser_rate);
+	}
+
+	if (analysis->priv->shm != NULL)
+		write_shm_frame (analysis, frame);
+
+	if (g_atomic_int_get (&analysis->priv->consumers) > 0) {
+		g_mutex_lock (&analysis->priv->frame_lock);
+		analysis->priv->latest = *frame;
+		if (analysis->priv->frame_idle_id == 0) {
+			analysis->priv->frame_idle_id =
+				g_idle_add_full (G_PRIORITY_HIGH_IDLE,
+						 (GSourceFunc) emit_frame_idle,
+						 g_object_ref (analysis),
+						 g_object_unref);
+		}
+		g_mutex_unlock (&analysis->priv->frame_lock);
+	}
+}
+
+/* called with the stream lock held */
+static void
+reset_analyser (RBPlayerGstAnalysis *analysis)
+{
+	rb_audio_analyser_free (analysis->priv->analyser);
+	analysis->priv->analyser = NULL;
+	if (analysis->priv->analyser_caps != NULL) {
+		gst_caps_unref (analysis->priv->analyser_caps);
+		analysis->priv->analyser_caps = NULL;
+	}
+}
+
+/* called with the stream lock held */
+static gboolean
+update_analyser (RBPlayerGstAnalysis *analysis, GstPad *pad)
+{
+	GstAudioInfo info;
+	GstCaps *caps;
+
+	caps = gst_pad_get_current_caps (pad);
+	if (caps == NULL)
+		return (analysis->priv->analyser != NULL);
+
+	if (analysis->priv->analyser != NULL &&
+	    analysis->priv->analyser_caps != NULL &&
+	    gst_caps_is_equal (caps, analysis->priv->analyser_caps)) {
+		gst_caps_unref (caps);
+		return TRUE;
+	}
+
+	reset_analyser (analysis);
+	analysis->priv->analyser_caps = caps;
+
+	if (gst_audio_info_from_caps (&info, caps) == FALSE) {
+		char *str = gst_caps_to_string (caps);
+		rb_debug ("unable to analyse audio with caps %s", str);
+		g_free (str);
+		return FALSE;
+	}
+
+	analysis->priv->analyser_rate = GST_AUDIO_INFO_RATE (&info);
+	analysis->priv->analyser_channels = GST_AUDIO_INFO_CHANNELS (&info);
+	analysis->priv->analyser = rb_audio_analyser_new (GST_AUDIO_INFO_RATE (&info),
+							  GST_AUDIO_INFO_CHANNELS (&info),
+							  analysis->priv->n_bands,
+							  MAX (GST_AUDIO_INFO_RATE (&info) / analysis->priv->frame_rate, 1));
+	rb_debug ("analysing %d channels at %d Hz, %d frames per second",
+		  GST_AUDIO_INFO_CHANNELS (&info),
+		  GST_AUDIO_INFO_RATE (&info),
+		  analysis->priv->frame_rate);
+	return TRUE;
+}
+
+static void
+handoff_cb (GstElement *sink, GstBuffer *buffer, GstPad *pad, RBPlayerGstAnalysis *analysis)
+{
+	GstMapInfo info;
+
+	g_mutex_lock (&analysis->priv->stream_lock);
+	if (update_analyser (analysis, pad) &&
+	    gst_buffer_map (buffer, &info, GST_MAP_READ)) {
+		analysis->priv->buffer_time = GST_BUFFER_PTS (buffer);
+		rb_audio_analyser_add_frames (analysis->priv->analyser,
+					      (const float *) info.data,
+					      info.size / (sizeof (float) * analysis->priv->analyser_channels),
+					      (RBAudioAnalyserFunc) analysis_frame_cb,
+					      analysis);
+		gst_buffer_unmap (buffer, &info);
+	}
+	g_mutex_unlock (&analysis->priv->stream_lock);
+}
+
+/* called with the stream lock held */
+static void
+close_shm (RBPlayerGstAnalysis *analysis)
+{
+	if (analysis->priv->shm == NULL)
+		return;
+
+	munmap (analysis->priv->shm, analysis->priv->shm_size);
+	analysis->priv->shm = NULL;
+	g_unlink (analysis->priv->shm_path);
+	g_free (analysis->priv->shm_path);
+	analysis->priv->shm_path = NULL;
+}
+
+/* called with the stream lock held */
+static void
+open_shm (RBPlayerGstAnalysis *analysis)
+{
+	RBPlayerGstAnalysisShmHeader *header;
+	char *path;
+	gsize size;
+	void *map;
+	int fd;
+
+	path = g_build_filename (g_get_user_runtime_dir (), SHM_FILE_NAME, NULL);
+	size = sizeof (RBPlayerGstAnalysisShmHeader) +
+		RB_PLAYER_GST_ANALYSIS_SHM_SLOTS * sizeof (RBAudioAnalysisFrame);
+
+	fd = g_open (path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		g_warning ("unable to create analysis ring %s: %s", path, g_strerror (errno));
+		g_free (path);
+		return;
+	}
+
+	if (ftruncate (fd, size) == -1) {
+		g_warning ("unable to size analysis ring %s: %s", path, g_strerror (errno));
+		close (fd);
+		g_unlink (path);
+		g_free (path);
+		return;
+	}
+
+	map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED) {
+		g_warning ("unable to map analysis ring %s: %s", path, g_strerror (errno));
+		g_unlink (path);
+		g_free (path);
+		return;
+	}
+
+	header = map;
+	header->version = RB_PLAYER_GST_ANALYSIS_SHM_VERSION;
+	header->header_size = sizeof (RBPlayerGstAnalysisShmHeader);
+	header->frame_size = sizeof (RBAudioAnalysisFrame);
+	header->n_slots = RB_PLAYER_GST_ANALYSIS_SHM_SLOTS;
+	header->frame_rate = analysis->priv->frame_rate;
+	header->write_count = 0;
+	/* set the magic number last so readers don't see a partial header */
+	g_atomic_int_set ((gint *) &header->magic, RB_PLAYER_GST_ANALYSIS_SHM_MAGIC);
+
+	rb_debug ("exporting analysis frames to %s", path);
+	analysis->priv->shm = header;
+	analysis->priv->shm_size = size;
+	analysis->priv->shm_path = path;
+}
+
+static void
+update_attachment (RBPlayerGstAnalysis *analysis)
+{
+	gboolean needed;
+
+	if (analysis->priv->player == NULL)
+		return;
+
+	needed = (analysis->priv->consumers > 0 || analysis->priv->export_shm);
+	if (needed == analysis->priv->attached)
+		return;
+
+	if (needed) {
+		rb_debug ("attaching analysis branch");
+		rb_player_gst_tee_add_tee (RB_PLAYER_GST_TEE (analysis->priv->player), analysis->priv->bin);
+	} else {
+		rb_debug ("detaching analysis branch");
+		rb_player_gst_tee_remove_tee (RB_PLAYER_GST_TEE (analysis->priv->player), analysis->priv->bin);
+	}
+	analysis->priv->attached = needed;
+}
+
+/**
+ * rb_player_gst_analysis_add_consumer:
+ * @analysis: the #RBPlayerGstAnalysis
+ *
+ * Registers interest in the 'frame' signal.  The output is only analysed
+ * while there is at least one consumer (or the shared memory ring is
+ * enabled), and adding more consumers doesn't add any more work on the
+ * streaming thread.
+ */
+void
+rb_player_gst_analysis_add_consumer (RBPlayerGstAnalysis *analysis)
+{
+	g_atomic_int_inc (&analysis->priv->consumers);
+	update_attachment (analysis);
+}
+
+/**
+ * rb_player_gst_analysis_remove_consumer:
+ * @analysis: the #RBPlayerGstAnalysis
+ *
+ * Removes a consumer added with rb_player_gst_analysis_add_consumer.
+ */
+void
+rb_player_gst_analysis_remove_consumer (RBPlayerGstAnalysis *analysis)
+{
+	g_return_if_fail (analysis->priv->consumers > 0);
+
+	g_atomic_int_add (&analysis->priv->consumers, -1);
+	update_attachment (analysis);
+}
+
+/**
+ * rb_player_gst_analysis_get_shm_path:
+ * @analysis: the #RBPlayerGstAnalysis
+ *
+ * Returns the path of the file holding the shared memory ring, if it is
+ * enabled.
+ *
+ * Return value: path of the ring, or %NULL
+ */
+const char *
+rb_player_gst_analysis_get_shm_path (RBPlayerGstAnalysis *analysis)
+{
+	return analysis->priv->shm_path;
+}
+
+static GstElement *
+create_bin (RBPlayerGstAnalysis *analysis)
+{
+	GstElement *bin;
+	GstElement *capsfilter;
+	GstElement *sink;
+	GstCaps *caps;
+	GstPad *pad;
+
+	bin = gst_bin_new ("analysisbin");
+	capsfilter = gst_element_factory_make ("capsfilter", NULL);
+	sink = gst_element_factory_make ("fakesink", NULL);
+	if (capsfilter == NULL || sink == NULL) {
+		g_warning ("unable to create output analysis elements");
+		if (capsfilter != NULL)
+			gst_object_unref (capsfilter);
+		if (sink != NULL)
+			gst_object_unref (sink);
+		gst_object_unref (bin);
+		return NULL;
+	}
+
+	caps = gst_caps_from_string (ANALYSIS_CAPS);
+	g_object_set (capsfilter, "caps", caps, NULL);
+	gst_caps_unref (caps);
+
+	/* sync so frames are produced as the audio is heard */
+	g_object_set (sink,
+		      "sync", TRUE,
+		      "async", FALSE,
+		      "qos", FALSE,
+		      "signal-handoffs", TRUE,
+		      NULL);
+	g_signal_connect (sink, "handoff", G_CALLBACK (handoff_cb), analysis);
+
+	gst_bin_add_many (GST_BIN (bin), capsfilter, sink, NULL);
+	gst_element_link (capsfilter, sink);
+
+	pad = gst_element_get_static_pad (capsfilter, "sink");
+	gst_element_add_pad (bin, gst_ghost_pad_new ("sink", pad));
+	gst_object_unref (pad);
+
+	return gst_object_ref_sink (bin);
+}
+
+/**
+ * rb_player_gst_analysis_new:
+ * @player: a player implementing #RBPlayerGstTee
+ *
+ * Creates the output analysis for a player.  The shell player creates one
+ * of these for its player, which plugins can get using
+ * rb_shell_player_get_analysis.
+ *
+ * Return value: (transfer full): new #RBPlayerGstAnalysis
+ */
+RBPlayerGstAnalysis *
+rb_player_gst_analysis_new (RBPlayer *player)
+{
+	return RB_PLAYER_GST_ANALYSIS (g_object_new (RB_TYPE_PLAYER_GST_ANALYSIS, "player", player, NULL));
+}
+
+static void
+impl_constructed (GObject *object)
+{
+	RBPlayerGstAnalysis *analysis = RB_PLAYER_GST_ANALYSIS (object);
+
+	G_OBJECT_CLASS (rb_player_gst_analysis_parent_class)->constructed (object);
+
+	analysis->priv->bin = create_bin (analysis);
+	if (analysis->priv->bin == NULL) {
+		g_clear_object (&analysis->priv->player);
+	}
+}
+
+static void
+impl_set_property (GObject *object, guint prop_id, const GValue *value, GParamSpec *pspec)
+{
+	RBPlayerGstAnalysis *analysis = RB_PLAYER_GST_ANALYSIS (object);
+
+	switch (prop_id) {
+	case PROP_PLAYER:
+		analysis->priv->player = g_value_dup_object (value);
+		break;
+	case PROP_FRAME_RATE:
+		g_mutex_lock (&analysis->priv->stream_lock);
+		analysis->priv->frame_rate = g_value_get_int (value);
+		reset_analyser (analysis);
+		if (analysis->priv->shm != NULL)
+			analysis->priv->shm->frame_rate = analysis->priv->frame_rate;
+		g_mutex_unlock (&analysis->priv->stream_lock);
+		break;
+	case PROP_BANDS:
+		g_mutex_lock (&analysis->priv->stream_lock);
+		analysis->priv->n_bands = g_value_get_int (value);
+		reset_analyser (analysis);
+		g_mutex_unlock (&analysis->priv->stream_lock);
+		break;
+	case PROP_EXPORT_SHM:
+		analysis->priv->export_shm = g_value_get_boolean (value);
+		g_mutex_lock (&analysis->priv->stream_lock);
+		if (analysis->priv->export_shm && analysis->priv->shm == NULL)
+			open_shm (analysis);
+		else if (analysis->priv->export_shm == FALSE)
+			close_shm (analysis);
+		g_mutex_unlock (&analysis->priv->stream_lock);
+		update_attachment (analysis);
+		g_object_notify (object, "shm-path");
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+impl_get_property (GObject *object, guint prop_id, GValue *value, GParamSpec *pspec)
+{
+	RBPlayerGstAnalysis *analysis = RB_PLAYER_GST_ANALYSIS (object);
+
+	switch (prop_id) {
+	case PROP_PLAYER:
+		g_value_set_object (value, analysis->priv->player);
+		break;
+	case PROP_FRAME_RATE:
+		g_value_set_int (value, analysis->priv->frame_rate);
+		break;
+	case PROP_BANDS:
+		g_value_set_int (value, analysis->priv->n_bands);
+		break;
+	case PROP_EXPORT_SHM:
+		g_value_set_boolean (value, analysis->priv->export_shm);
+		break;
+	case PROP_SHM_PATH:
+		g_value_set_string (value, analysis->priv->shm_path);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+impl_dispose (GObject *object)
+{
+	RBPlayerGstAnalysis *analysis = RB_PLAYER_GST_ANALYSIS (object);
+
+	if (analysis->priv->attached) {
+		analysis->priv->consumers = 0;
+		analysis->priv->export_shm = FALSE;
+		update_attachment (analysis);
+	}
+
+	g_clear_object (&analysis->priv->player);
+
+	if (analysis->priv->bin != NULL) {
+		gst_object_unref (analysis->priv->bin);
+		analysis->priv->bin = NULL;
+	}
+
+	G_OBJECT_CLASS (rb_player_gst_analysis_parent_class)->dispose (object);
+}
+
+static void
+impl_finalize (GObject *object)
+{
+	RBPlayerGstAnalysis *analysis = RB_PLAYER_GST_ANALYSIS (object);
+
+	reset_analyser (analysis);
+	close_shm (analysis);
+	g_mutex_clear (&analysis->priv->stream_lock);
+	g_mutex_clear (&analysis->priv->frame_lock);
+
+	G_OBJECT_CLASS (rb_player_gst_analysis_parent_class)->finalize (object);
+}
+
+static void
+rb_player_gst_analysis_init (RBPlayerGstAnalysis *analysis)
+{
+	analysis->priv = G_TYPE_INSTANCE_GET_PRIVATE (analysis, RB_TYPE_PLAYER_GST_ANALYSIS, RBPlayerGstAnalysisPrivate);
+
+	g_mutex_init (&analysis->priv->stream_lock);
+	g_mutex_init (&analysis->priv->frame_lock);
+	analysis->priv->buffer_time = GST_CLOCK_TIME_NONE;
+}
+
+static void
+rb_player_gst_analysis_class_init (RBPlayerGstAnalysisClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+	object_class->constructed = impl_constructed;
+	object_class->dispose = impl_dispose;
+	object_class->finalize = impl_finalize;
+	object_class->set_property = impl_set_property;
+	object_class->get_property = impl_get_property;
+
+	/**
+	 * RBPlayerGstAnalysis:player:
+	 *
+	 * The player whose output is analysed.  This must implement
+	 * #RBPlayerGstTee.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_PLAYER,
+					 g_param_spec_object ("player",
+							      "player",
+							      "player",
+							      RB_TYPE_PLAYER_GST_TEE,
+							      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+	/**
+	 * RBPlayerGstAnalysis:frame-rate:
+	 *
+	 * Number of analysis frames to produce per second.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_FRAME_RATE,
+					 g_param_spec_int ("frame-rate",
+							   "frame rate",
+							   "analysis frames per second",
+							   1, 60, 30,
+							   G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+	/**
+	 * RBPlayerGstAnalysis:bands:
+	 *
+	 * Number of spectrum bands in each analysis frame.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_BANDS,
+					 g_param_spec_int ("bands",
+							   "bands",
+							   "number of spectrum bands",
+							   1, RB_AUDIO_ANALYSIS_MAX_BANDS, 32,
+							   G_PARAM_READWRITE | G_PARAM_CONSTRUCT));
+	/**
+	 * RBPlayerGstAnalysis:export-shm:
+	 *
+	 * If %TRUE, every analysis frame is written to a ring in shared
+	 * memory for use by other programs.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_EXPORT_SHM,
+					 g_param_spec_boolean ("export-shm",
+							       "export shm",
+							       "whether to export frames to shared memory",
+							       FALSE,
+							       G_PARAM_READWRITE));
+	/**
+	 * RBPlayerGstAnalysis:shm-path:
+	 *
+	 * Path of the file holding the shared memory ring, or %NULL if it
+	 * isn't enabled.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_SHM_PATH,
+					 g_param_spec_string ("shm-path",
+							      "shm path",
+							      "path of the shared memory ring",
+							      NULL,
+							      G_PARAM_READABLE));
+
+	/**
+	 * RBPlayerGstAnalysis::frame:
+	 * @analysis: the #RBPlayerGstAnalysis
+	 * @frame: the most recent analysis frame
+	 *
+	 * Emitted on the main thread with the most recent analysis frame,
+	 * while there are consumers.
+	 */
+	signals[FRAME] =
+		g_signal_new ("frame",
+			      G_OBJECT_CLASS_TYPE (object_class),
+			      G_SIGNAL_RUN_LAST,
+			      G_STRUCT_OFFSET (RBPlayerGstAnalysisClass, frame),
+			      NULL, NULL, NULL,
+			      G_TYPE_NONE,
+			      1, RB_TYPE_AUDIO_ANALYSIS_FRAME | G_SIGNAL_TYPE_STATIC_SCOPE);
+
+	g_type_class_add_private (klass, sizeof (RBPlayerGstAnalysisPrivate));
+}
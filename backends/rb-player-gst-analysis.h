@@ -0,0 +1,95 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef __RB_PLAYER_GST_ANALYSIS_H
+#define __RB_PLAYER_GST_ANALYSIS_H
+
+#include <glib-object.h>
+
+#include <backends/rb-player.h>
+#include <lib/rb-audio-analyser.h>
+
+G_BEGIN_DECLS
+
+#define RB_TYPE_PLAYER_GST_ANALYSIS		(rb_player_gst_analysis_get_type ())
+#define RB_PLAYER_GST_ANALYSIS(o)		(G_TYPE_CHECK_INSTANCE_CAST ((o), RB_TYPE_PLAYER_GST_ANALYSIS, RBPlayerGstAnalysis))
+#define RB_PLAYER_GST_ANALYSIS_CLASS(k)		(G_TYPE_CHECK_CLASS_CAST((k), RB_TYPE_PLAYER_GST_ANALYSIS, RBPlayerGstAnalysisClass))
+#define RB_IS_PLAYER_GST_ANALYSIS(o)		(G_TYPE_CHECK_INSTANCE_TYPE ((o), RB_TYPE_PLAYER_GST_ANALYSIS))
+#define RB_IS_PLAYER_GST_ANALYSIS_CLASS(k)	(G_TYPE_CHECK_CLASS_TYPE ((k), RB_TYPE_PLAYER_GST_ANALYSIS))
+#define RB_PLAYER_GST_ANALYSIS_GET_CLASS(o)	(G_TYPE_INSTANCE_GET_CLASS ((o), RB_TYPE_PLAYER_GST_ANALYSIS, RBPlayerGstAnalysisClass))
+
+typedef struct _RBPlayerGstAnalysis RBPlayerGstAnalysis;
+typedef struct _RBPlayerGstAnalysisClass RBPlayerGstAnalysisClass;
+typedef struct _RBPlayerGstAnalysisPrivate RBPlayerGstAnalysisPrivate;
+
+struct _RBPlayerGstAnalysis
+{
+	GObject parent;
+
+	RBPlayerGstAnalysisPrivate *priv;
+};
+
+struct _RBPlayerGstAnalysisClass
+{
+	GObjectClass parent_class;
+
+	/* signals */
+	void	(*frame)	(RBPlayerGstAnalysis *analysis, RBAudioAnalysisFrame *frame);
+};
+
+/*
+ * Layout of the shared memory ring.  The header is followed by n_slots
+ * frames of frame_size bytes, starting header_size bytes into the file.
+ * Frame n (counting from 0) is written to slot n % n_slots, and then
+ * write_count is set to n + 1.  Readers should read write_count, copy
+ * the frame they want, and read write_count again; if it has moved on by
+ * n_slots or more, the frame may have been overwritten while it was copied.
+ */
+#define RB_PLAYER_GST_ANALYSIS_SHM_MAGIC	0x4e414252	/* "RBAN" */
+#define RB_PLAYER_GST_ANALYSIS_SHM_VERSION	1
+#define RB_PLAYER_GST_ANALYSIS_SHM_SLOTS	64
+
+typedef struct {
+	guint32 magic;
+	guint32 version;
+	guint32 header_size;
+	guint32 frame_size;
+	guint32 n_slots;
+	guint32 frame_rate;
+	volatile gint write_count;
+	guint32 reserved;
+} RBPlayerGstAnalysisShmHeader;
+
+GType			rb_player_gst_analysis_get_type		(void);
+
+RBPlayerGstAnalysis *	rb_player_gst_analysis_new		(RBPlayer *player);
+
+void			rb_player_gst_analysis_add_consumer	(RBPlayerGstAnalysis *analysis);
+void			rb_player_gst_analysis_remove_consumer	(RBPlayerGstAnalysis *analysis);
+
+const char *		rb_player_gst_analysis_get_shm_path	(RBPlayerGstAnalysis *analysis);
+
+G_END_DECLS
+
+#endif /* __RB_PLAYER_GST_ANALYSIS_H */
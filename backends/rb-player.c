@@ -566,6 +566,39 @@ rb_player_multiple_open (RBPlayer *player)
 		return FALSE;
 }
 
+/**
+ * rb_player_open_ahead:
+ * @player:	a #RBPlayer
+ * @uri:	URI to open
+ * @stream_data: arbitrary data to associate with the stream
+ * @stream_data_destroy: function to call to destroy the stream data
+ * @error:	returns error information
+ *
+ * Prepares a stream that is expected to be played next, without
+ * affecting the current stream.  Calling #rb_player_play does not start
+ * a stream opened this way; it has to be opened again with #rb_player_open
+ * first, at which point the player can use the work already done on it.
+ * Players that don't support multiple open streams do nothing here.
+ *
+ * Return value: TRUE if the stream preparation was not unsuccessful
+ */
+gboolean
+rb_player_open_ahead (RBPlayer *player,
+		      const char *uri,
+		      gpointer stream_data,
+		      GDestroyNotify stream_data_destroy,
+		      GError **error)
+{
+	RBPlayerIface *iface = RB_PLAYER_GET_IFACE (player);
+
+	if (iface->open_ahead)
+		return iface->open_ahead (player, uri, stream_data, stream_data_destroy, error);
+
+	if (stream_data && stream_data_destroy)
+		stream_data_destroy (stream_data);
+	return TRUE;
+}
+
 /**
  * rb_player_new:
  * @want_crossfade: if TRUE, try to use a backend that supports
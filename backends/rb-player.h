@@ -101,6 +101,11 @@ struct _RBPlayerIface
 						 gint64 newtime);
 	gint64		(*get_time)		(RBPlayer *player);
 	gboolean	(*multiple_open)	(RBPlayer *player);
+	gboolean	(*open_ahead)		(RBPlayer *player,
+						 const char *uri,
+						 gpointer stream_data,
+						 GDestroyNotify stream_data_destroy,
+						 GError **error);
 
 
 	/* signals */
@@ -165,6 +170,11 @@ void		rb_player_set_time   (RBPlayer *player, gint64 newtime);
 gint64		rb_player_get_time   (RBPlayer *player);
 
 gboolean	rb_player_multiple_open (RBPlayer *player);
+gboolean	rb_player_open_ahead (RBPlayer *player,
+				      const char *uri,
+				      gpointer stream_data,
+				      GDestroyNotify stream_data_destroy,
+				      GError **error);
 
 /* only to be used by subclasses */
 void	_rb_player_emit_eos (RBPlayer *player, gpointer stream_data, gboolean early);
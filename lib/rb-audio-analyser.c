@@ -0,0 +1,402 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#include "config.h"
+
+#include <math.h>
+
+#include "rb-audio-analyser.h"
+
+/**
+ * SECTION:rb-audio-analyser
+ * @short_description: spectrum and level analysis for visualisations
+ *
+ * Reduces a stream of float samples to a series of analysis frames, each
+ * holding the peak and RMS level of each channel since the previous frame,
+ * and the spectrum of the most recent #RB_AUDIO_ANALYSIS_FFT_SIZE samples
+ * (mixed down to mono) grouped into logarithmically spaced bands.
+ *
+ * The FFT works on separate arrays of real and imaginary parts, with a
+ * contiguous table of twiddle factors for each stage, so the compiler can
+ * vectorise the butterfly loop.
+ */
+
+#define FFT_SIZE		RB_AUDIO_ANALYSIS_FFT_SIZE
+#define LOWEST_FREQUENCY	40.0
+
+struct _RBAudioAnalyser {
+	guint rate;
+	guint channels;
+	guint n_bands;
+	guint interval_frames;
+
+	/* mono mix of the most recent samples, as a circular buffer */
+	float history[FFT_SIZE];
+	guint history_pos;
+
+	/* levels for the current interval */
+	guint interval_pos;
+	float peak[RB_AUDIO_ANALYSIS_MAX_CHANNELS];
+	double energy[RB_AUDIO_ANALYSIS_MAX_CHANNELS];
+
+	/* transform working space and tables */
+	float re[FFT_SIZE];
+	float im[FFT_SIZE];
+	float power[FFT_SIZE / 2];
+	float window[FFT_SIZE];
+	float twiddle_re[FFT_SIZE];	/* for each stage of size 2h, h entries at offset h-1 */
+	float twiddle_im[FFT_SIZE];
+	guint bitrev[FFT_SIZE];
+	double power_scale;
+
+	guint band_start[RB_AUDIO_ANALYSIS_MAX_BANDS + 1];
+};
+
+static RBAudioAnalysisFrame *
+frame_copy (RBAudioAnalysisFrame *frame)
+{
+	return g_slice_dup (RBAudioAnalysisFrame, frame);
+}
+
+/**
+ * rb_audio_analysis_frame_copy:
+ * @frame: an analysis frame
+ *
+ * Copies an analysis frame.
+ *
+ * Return value: (transfer full): copy of the frame
+ */
+RBAudioAnalysisFrame *
+rb_audio_analysis_frame_copy (const RBAudioAnalysisFrame *frame)
+{
+	return frame_copy ((RBAudioAnalysisFrame *) frame);
+}
+
+/**
+ * rb_audio_analysis_frame_free:
+ * @frame: an analysis frame
+ *
+ * Frees a copied analysis frame.
+ */
+void
+rb_audio_analysis_frame_free (RBAudioAnalysisFrame *frame)
+{
+	g_slice_free (RBAudioAnalysisFrame, frame);
+}
+
+G_DEFINE_BOXED_TYPE (RBAudioAnalysisFrame, rb_audio_analysis_frame, frame_copy, rb_audio_analysis_frame_free)
+
+static void
+init_tables (RBAudioAnalyser *analyser)
+{
+	double window_energy = 0.0;
+	guint half;
+	guint bits;
+	guint i;
+
+	for (bits = 0; (1u << bits) < FFT_SIZE; bits++)
+		;
+	for (i = 0; i < FFT_SIZE; i++) {
+		guint r = 0;
+		guint b;
+
+		for (b = 0; b < bits; b++) {
+			if (i & (1u << b))
+				r |= 1u << (bits - 1 - b);
+		}
+		analyser->bitrev[i] = r;
+
+		analyser->window[i] = 0.5 - 0.5 * cos (2.0 * G_PI * i / FFT_SIZE);
+		window_energy += analyser->window[i] * analyser->window[i];
+	}
+
+	for (half = 1; half < FFT_SIZE; half <<= 1) {
+		for (i = 0; i < half; i++) {
+			analyser->twiddle_re[half - 1 + i] = cos (-G_PI * i / half);
+			analyser->twiddle_im[half - 1 + i] = sin (-G_PI * i / half);
+		}
+	}
+
+	/* by Parseval's theorem, a sine of amplitude A puts A^2 * N * E / 4
+	 * into the positive frequency bins, where E is the window energy.
+	 */
+	analyser->power_scale = 4.0 / (FFT_SIZE * window_energy);
+}
+
+static void
+init_bands (RBAudioAnalyser *analyser)
+{
+	double lowest;
+	double highest;
+	guint last_bin = FFT_SIZE / 2;
+	guint i;
+
+	lowest = MAX (LOWEST_FREQUENCY, (double) analyser->rate / FFT_SIZE);
+	highest = analyser->rate / 2.0;
+
+	for (i = 0; i <= analyser->n_bands; i++) {
+		double edge;
+		guint bin;
+
+		edge = lowest * pow (highest / lowest, (double) i / analyser->n_bands);
+		bin = (guint) (edge * FFT_SIZE / analyser->rate + 0.5);
+		if (bin < 1)
+			bin = 1;
+
+		/* every band gets at least one bin of its own */
+		if (i > 0 && bin <= analyser->band_start[i - 1])
+			bin = analyser->band_start[i - 1] + 1;
+		analyser->band_start[i] = bin;
+	}
+
+	/* make the bands end at the nyquist frequency, pulling the top
+	 * bands down if the bottom ones pushed them too far up.
+	 */
+	analyser->band_start[analyser->n_bands] = last_bin;
+	for (i = analyser->n_bands; i > 0; i--) {
+		if (analyser->band_start[i - 1] > last_bin - (analyser->n_bands - i + 1))
+			analyser->band_start[i - 1] = last_bin - (analyser->n_bands - i + 1);
+	}
+}
+
+/**
+ * rb_audio_analyser_new:
+ * @rate: sample rate of the audio
+ * @channels: number of interleaved channels
+ * @n_bands: number of spectrum bands, at most #RB_AUDIO_ANALYSIS_MAX_BANDS
+ * @interval_frames: number of frames between analysis frames
+ *
+ * Creates a new analyser.  Levels are only reported for the first
+ * #RB_AUDIO_ANALYSIS_MAX_CHANNELS channels, but all channels are included
+ * in the spectrum.
+ *
+ * Return value: new analyser, free with rb_audio_analyser_free
+ */
+RBAudioAnalyser *
+rb_audio_analyser_new (guint rate, guint channels, guint n_bands, guint interval_frames)
+{
+	RBAudioAnalyser *analyser;
+
+	g_return_val_if_fail (rate > 0, NULL);
+	g_return_val_if_fail (channels > 0, NULL);
+	g_return_val_if_fail (n_bands > 0 && n_bands <= RB_AUDIO_ANALYSIS_MAX_BANDS, NULL);
+	g_return_val_if_fail (interval_frames > 0, NULL);
+
+	analyser = g_new0 (RBAudioAnalyser, 1);
+	analyser->rate = rate;
+	analyser->channels = channels;
+	analyser->n_bands = n_bands;
+	analyser->interval_frames = interval_frames;
+
+	init_tables (analyser);
+	init_bands (analyser);
+	return analyser;
+}
+
+/**
+ * rb_audio_analyser_free:
+ * @analyser: an analyser
+ *
+ * Frees an analyser.
+ */
+void
+rb_audio_analyser_free (RBAudioAnalyser *analyser)
+{
+	g_free (analyser);
+}
+
+/**
+ * rb_audio_analyser_get_band_frequency:
+ * @analyser: an analyser
+ * @band: band index
+ *
+ * Returns the centre frequency of a spectrum band.
+ *
+ * Return value: frequency in Hz
+ */
+double
+rb_audio_analyser_get_band_frequency (RBAudioAnalyser *analyser, guint band)
+{
+	g_return_val_if_fail (band < analyser->n_bands, 0.0);
+
+	return (analyser->band_start[band] + analyser->band_start[band + 1]) * 0.5 * analyser->rate / FFT_SIZE;
+}
+
+static void
+fft (float * restrict re, float * restrict im, const float * restrict twiddle_re, const float * restrict twiddle_im)
+{
+	guint half;
+	guint start;
+	guint k;
+
+	for (half = 1; half < FFT_SIZE; half <<= 1) {
+		const float *wr = twiddle_re + half - 1;
+		const float *wi = twiddle_im + half - 1;
+
+		for (start = 0; start < FFT_SIZE; start += half * 2) {
+			float * restrict ar = re + start;
+			float * restrict ai = im + start;
+			float * restrict br = re + start + half;
+			float * restrict bi = im + start + half;
+
+			for (k = 0; k < half; k++) {
+				float tr = br[k] * wr[k] - bi[k] * wi[k];
+				float ti = br[k] * wi[k] + bi[k] * wr[k];
+
+				br[k] = ar[k] - tr;
+				bi[k] = ai[k] - ti;
+				ar[k] = ar[k] + tr;
+				ai[k] = ai[k] + ti;
+			}
+		}
+	}
+}
+
+static void
+compute_spectrum (RBAudioAnalyser *analyser, float *bands)
+{
+	guint i;
+	guint b;
+
+	/* window the history, oldest sample first, into bit reversed order */
+	for (i = 0; i < FFT_SIZE; i++) {
+		guint src = (analyser->history_pos + i) & (FFT_SIZE - 1);
+		analyser->re[analyser->bitrev[i]] = analyser->history[src] * analyser->window[i];
+		analyser->im[i] = 0.0f;
+	}
+
+	fft (analyser->re, analyser->im, analyser->twiddle_re, analyser->twiddle_im);
+
+	for (i = 0; i < FFT_SIZE / 2; i++) {
+		analyser->power[i] = analyser->re[i] * analyser->re[i] + analyser->im[i] * analyser->im[i];
+	}
+
+	for (b = 0; b < analyser->n_bands; b++) {
+		double sum = 0.0;
+
+		for (i = analyser->band_start[b]; i < analyser->band_start[b + 1]; i++)
+			sum += analyser->power[i];
+
+		sum *= analyser->power_scale;
+		if (sum > 0.0)
+			bands[b] = MAX (10.0 * log10 (sum), RB_AUDIO_ANALYSIS_FLOOR);
+		else
+			bands[b] = RB_AUDIO_ANALYSIS_FLOOR;
+	}
+}
+
+static void
+accumulate (RBAudioAnalyser *analyser, const float *samples, gsize frames)
+{
+	float scale = 1.0f / analyser->channels;
+	guint level_channels = MIN (analyser->channels, RB_AUDIO_ANALYSIS_MAX_CHANNELS);
+	gsize f;
+	guint c;
+
+	for (f = 0; f < frames; f++) {
+		const float *s = samples + f * analyser->channels;
+		float sum = 0.0f;
+
+		for (c = 0; c < level_channels; c++) {
+			float x = s[c];
+
+			if (fabsf (x) > analyser->peak[c])
+				analyser->peak[c] = fabsf (x);
+			analyser->energy[c] += x * x;
+			sum += x;
+		}
+		for (; c < analyser->channels; c++)
+			sum += s[c];
+
+		analyser->history[analyser->history_pos] = sum * scale;
+		analyser->history_pos = (analyser->history_pos + 1) & (FFT_SIZE - 1);
+	}
+}
+
+static void
+finish_interval (RBAudioAnalyser *analyser, RBAudioAnalysisFrame *frame)
+{
+	guint c;
+
+	frame->position = 0;
+	frame->channels = MIN (analyser->channels, RB_AUDIO_ANALYSIS_MAX_CHANNELS);
+	frame->n_bands = analyser->n_bands;
+	for (c = 0; c < RB_AUDIO_ANALYSIS_MAX_CHANNELS; c++) {
+		if (c < frame->channels) {
+			frame->peak[c] = analyser->peak[c];
+			frame->rms[c] = sqrt (analyser->energy[c] / analyser->interval_frames);
+		} else {
+			frame->peak[c] = 0.0f;
+			frame->rms[c] = 0.0f;
+		}
+		analyser->peak[c] = 0.0f;
+		analyser->energy[c] = 0.0;
+	}
+
+	compute_spectrum (analyser, frame->bands);
+	for (c = analyser->n_bands; c < RB_AUDIO_ANALYSIS_MAX_BANDS; c++)
+		frame->bands[c] = RB_AUDIO_ANALYSIS_FLOOR;
+
+	analyser->interval_pos = 0;
+}
+
+/**
+ * rb_audio_analyser_add_frames:
+ * @analyser: an analyser
+ * @samples: interleaved float samples
+ * @frames: number of frames in @samples
+ * @func: (scope call): function to call with each completed analysis frame
+ * @user_data: data to pass to @func
+ *
+ * Feeds audio into the analyser.  @func is called for each analysis frame
+ * completed by the new audio, along with the offset (in frames) into
+ * @samples at which it was completed.
+ */
+void
+rb_audio_analyser_add_frames (RBAudioAnalyser *analyser,
+			      const float *samples,
+			      gsize frames,
+			      RBAudioAnalyserFunc func,
+			      gpointer user_data)
+{
+	gsize done = 0;
+
+	while (done < frames) {
+		gsize n;
+
+		n = MIN (frames - done, analyser->interval_frames - analyser->interval_pos);
+		accumulate (analyser, samples + done * analyser->channels, n);
+		done += n;
+		analyser->interval_pos += n;
+
+		if (analyser->interval_pos == analyser->interval_frames) {
+			RBAudioAnalysisFrame frame;
+
+			finish_interval (analyser, &frame);
+			func (&frame, done, user_data);
+		}
+	}
+}
@@ -0,0 +1,80 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#ifndef RB_AUDIO_ANALYSER_H
+#define RB_AUDIO_ANALYSER_H
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define RB_AUDIO_ANALYSIS_MAX_CHANNELS	8
+#define RB_AUDIO_ANALYSIS_MAX_BANDS	64
+#define RB_AUDIO_ANALYSIS_FFT_SIZE	1024
+
+/* level reported for bands with no energy at all */
+#define RB_AUDIO_ANALYSIS_FLOOR		(-120.0f)
+
+/*
+ * This is also the layout of the frames in the shared memory ring
+ * (see #RBPlayerGstAnalysis), so it must only contain fixed size fields.
+ */
+typedef struct {
+	guint64 position;				/* output timestamp of the end of the frame, in ns */
+	guint32 channels;
+	guint32 n_bands;
+	float peak[RB_AUDIO_ANALYSIS_MAX_CHANNELS];	/* 1.0 is full scale */
+	float rms[RB_AUDIO_ANALYSIS_MAX_CHANNELS];
+	float bands[RB_AUDIO_ANALYSIS_MAX_BANDS];	/* dB relative to a full scale sine */
+} RBAudioAnalysisFrame;
+
+#define RB_TYPE_AUDIO_ANALYSIS_FRAME	(rb_audio_analysis_frame_get_type ())
+
+GType		rb_audio_analysis_frame_get_type (void);
+RBAudioAnalysisFrame *rb_audio_analysis_frame_copy (const RBAudioAnalysisFrame *frame);
+void		rb_audio_analysis_frame_free	(RBAudioAnalysisFrame *frame);
+
+typedef struct _RBAudioAnalyser RBAudioAnalyser;
+
+typedef void (*RBAudioAnalyserFunc) (RBAudioAnalysisFrame *frame, gsize offset, gpointer user_data);
+
+RBAudioAnalyser *rb_audio_analyser_new		(guint rate,
+						 guint channels,
+						 guint n_bands,
+						 guint interval_frames);
+void		rb_audio_analyser_free		(RBAudioAnalyser *analyser);
+
+void		rb_audio_analyser_add_frames	(RBAudioAnalyser *analyser,
+						 const float *samples,
+						 gsize frames,
+						 RBAudioAnalyserFunc func,
+						 gpointer user_data);
+
+double		rb_audio_analyser_get_band_frequency (RBAudioAnalyser *analyser, guint band);
+
+G_END_DECLS
+
+#endif /* RB_AUDIO_ANALYSER_H */
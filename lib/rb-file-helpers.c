@@ -52,10 +52,11 @@
 #include "rb-util.h"
 
 typedef struct _RBUriHandleRecursivelyAsyncData RBUriHandleRecursivelyAsyncData;
+typedef struct _RBUriHandleRecursivelyDir RBUriHandleRecursivelyDir;
 
 static void _uri_handle_recursively_free (RBUriHandleRecursivelyAsyncData *data);
-static void _uri_handle_recursively_next_dir (RBUriHandleRecursivelyAsyncData *data);
-static void _uri_handle_recursively_next_files (RBUriHandleRecursivelyAsyncData *data);
+static void _uri_handle_recursively_start_dirs (RBUriHandleRecursivelyAsyncData *data);
+static void _uri_handle_recursively_next_files (RBUriHandleRecursivelyDir *dir);
 
 static GHashTable *files = NULL;
 
@@ -85,7 +86,8 @@ static const char *recurse_attributes =
 		G_FILE_ATTRIBUTE_STANDARD_IS_HIDDEN ","
 		G_FILE_ATTRIBUTE_ID_FILE ","
 		G_FILE_ATTRIBUTE_ACCESS_CAN_READ ","
-		G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK;
+		G_FILE_ATTRIBUTE_STANDARD_IS_SYMLINK ","
+		G_FILE_ATTRIBUTE_TIME_MODIFIED;
 
 /**
  * rb_locale_dir:
@@ -893,17 +895,34 @@ rb_uri_handle_recursively (const char *uri,
 	g_object_unref (file);
 }
 
+/* how many directories the async walk enumerates at once, and how many
+ * files it asks for in each request.  on network filesystems, most of
+ * the time is spent waiting for replies, so we want several outstanding.
+ */
+#define RB_URI_RECURSE_MAX_DIRS		(8)
+#define RB_URI_RECURSE_FILES_PER_REQUEST	(64)
+
 struct _RBUriHandleRecursivelyAsyncData {
 	GCancellable *cancel;
+	RBUriRecurseDirFunc dir_func;
 	RBUriRecurseFunc func;
+	RBUriRecurseDirDoneFunc dir_done_func;
 	gpointer user_data;
 	GDestroyNotify data_destroy;
 
 	GHashTable *handled;
 
 	GQueue *dirs_left;
-	GFile *current;
+	guint active;
+	guint files;
+	GTimer *timer;
+};
+
+struct _RBUriHandleRecursivelyDir {
+	RBUriHandleRecursivelyAsyncData *data;
+	GFile *dir;
 	GFileEnumerator *enumerator;
+	gboolean listing;
 };
 
 
@@ -912,14 +931,29 @@ _uri_handle_recursively_free (RBUriHandleRecursivelyAsyncData *data)
 {
 	if (data->data_destroy)
 		data->data_destroy (data->user_data);
-	g_clear_object (&data->current);
-	g_clear_object (&data->enumerator);
 	g_clear_object (&data->cancel);
 	g_hash_table_destroy (data->handled);
 	g_queue_free_full (data->dirs_left, g_object_unref);
+	g_timer_destroy (data->timer);
 	g_free (data);
 }
 
+static void
+_uri_handle_recursively_dir_done (RBUriHandleRecursivelyDir *dir, gboolean complete)
+{
+	RBUriHandleRecursivelyAsyncData *data = dir->data;
+
+	if (dir->listing && data->dir_done_func != NULL)
+		(data->dir_done_func) (dir->dir, complete, data->user_data);
+
+	g_clear_object (&dir->dir);
+	g_clear_object (&dir->enumerator);
+	g_free (dir);
+
+	data->active--;
+	_uri_handle_recursively_start_dirs (data);
+}
+
 static void
 _uri_handle_recursively_process_files (GObject *src, GAsyncResult *result, gpointer ptr)
 {
@@ -927,25 +961,27 @@ _uri_handle_recursively_process_files (GObject *src, GAsyncResult *result, gpoin
 	GList *l;
 	GFile *descend;
 	GError *error = NULL;
-	RBUriHandleRecursivelyAsyncData *data = ptr;
+	RBUriHandleRecursivelyDir *dir = ptr;
+	RBUriHandleRecursivelyAsyncData *data = dir->data;
 
 	files = g_file_enumerator_next_files_finish (G_FILE_ENUMERATOR (src), result, &error);
 	if (error != NULL) {
 		rb_debug ("error enumerating files: %s", error->message);
-		_uri_handle_recursively_next_dir (data);
+		_uri_handle_recursively_dir_done (dir, FALSE);
 		g_clear_error (&error);
 		return;
 	}
 
 	if (files == NULL) {
-		_uri_handle_recursively_next_dir (data);
+		_uri_handle_recursively_dir_done (dir, TRUE);
 		return;
 	}
 
 	rb_debug ("got %d file(s)", g_list_length (files));
 	for (l = files; l != NULL; l = l->next) {
 		descend = NULL;
-		if (_uri_handle_file (data->current, l->data, data->handled, data->func, data->user_data, &descend) == FALSE) {
+		data->files++;
+		if (_uri_handle_file (dir->dir, l->data, data->handled, data->func, data->user_data, &descend) == FALSE) {
 			rb_debug ("callback returned false");
 			g_cancellable_cancel (data->cancel);
 			break;
@@ -958,27 +994,31 @@ _uri_handle_recursively_process_files (GObject *src, GAsyncResult *result, gpoin
 	}
 
 	g_list_free_full (files, g_object_unref);
-	_uri_handle_recursively_next_files (data);
+
+	/* start on any directories we just found while waiting for more files */
+	_uri_handle_recursively_start_dirs (data);
+	_uri_handle_recursively_next_files (dir);
 }
 
 static void
-_uri_handle_recursively_next_files (RBUriHandleRecursivelyAsyncData *data)
+_uri_handle_recursively_next_files (RBUriHandleRecursivelyDir *dir)
 {
-	g_file_enumerator_next_files_async (data->enumerator,
-					    16,		/* or something */
+	g_file_enumerator_next_files_async (dir->enumerator,
+					    RB_URI_RECURSE_FILES_PER_REQUEST,
 					    G_PRIORITY_DEFAULT,
-					    data->cancel,
+					    dir->data->cancel,
 					    _uri_handle_recursively_process_files,
-					    data);
+					    dir);
 }
 
 static void
 _uri_handle_recursively_enum_files (GObject *src, GAsyncResult *result, gpointer ptr)
 {
 	GError *error = NULL;
-	RBUriHandleRecursivelyAsyncData *data = ptr;
+	RBUriHandleRecursivelyDir *dir = ptr;
+	RBUriHandleRecursivelyAsyncData *data = dir->data;
 
-	data->enumerator = g_file_enumerate_children_finish (G_FILE (src), result, &error);
+	dir->enumerator = g_file_enumerate_children_finish (G_FILE (src), result, &error);
 	if (error != NULL) {
 		if (error->code == G_IO_ERROR_NOT_DIRECTORY) {
 			GFileInfo *info;
@@ -987,6 +1027,7 @@ _uri_handle_recursively_enum_files (GObject *src, GAsyncResult *result, gpointer
 			info = g_file_query_info (G_FILE (src), recurse_attributes, G_FILE_QUERY_INFO_NONE, data->cancel, &error);
 			if (error == NULL) {
 				if (_should_process (info)) {
+					data->files++;
 					(data->func) (G_FILE (src), info, data->user_data);
 				}
 				g_object_unref (info);
@@ -995,28 +1036,117 @@ _uri_handle_recursively_enum_files (GObject *src, GAsyncResult *result, gpointer
 			rb_debug ("error enumerating folder: %s", error->message);
 		}
 		g_clear_error (&error);
-		_uri_handle_recursively_next_dir (data);
+		_uri_handle_recursively_dir_done (dir, FALSE);
 	} else {
-		_uri_handle_recursively_next_files (data);
+		_uri_handle_recursively_next_files (dir);
+	}
+}
+
+static void
+_uri_handle_recursively_enum_dir (RBUriHandleRecursivelyDir *dir)
+{
+	g_file_enumerate_children_async (dir->dir,
+					 recurse_attributes,
+					 G_FILE_QUERY_INFO_NONE,
+					 G_PRIORITY_DEFAULT,
+					 dir->data->cancel,
+					 _uri_handle_recursively_enum_files,
+					 dir);
+}
+
+static void
+_uri_handle_recursively_dir_info (GObject *src, GAsyncResult *result, gpointer ptr)
+{
+	GError *error = NULL;
+	RBUriHandleRecursivelyDir *dir = ptr;
+	RBUriHandleRecursivelyAsyncData *data = dir->data;
+	GFileInfo *info;
+	const char *file_id;
+	char **subdirs = NULL;
+	int i;
+
+	info = g_file_query_info_finish (G_FILE (src), result, &error);
+	if (error != NULL) {
+		rb_debug ("error checking folder: %s", error->message);
+		g_clear_error (&error);
+		_uri_handle_recursively_dir_done (dir, FALSE);
+		return;
+	}
+
+	/* handle the case where we're given a single file to process */
+	switch (g_file_info_get_file_type (info)) {
+	case G_FILE_TYPE_DIRECTORY:
+	case G_FILE_TYPE_MOUNTABLE:
+		break;
+	default:
+		if (_should_process (info)) {
+			data->files++;
+			(data->func) (dir->dir, info, data->user_data);
+		}
+		g_object_unref (info);
+		_uri_handle_recursively_dir_done (dir, FALSE);
+		return;
+	}
+
+	/* directories we get to without enumerating the parent haven't been
+	 * through _uri_handle_file, so make sure symlinks don't lead back here.
+	 */
+	file_id = g_file_info_get_attribute_string (info, G_FILE_ATTRIBUTE_ID_FILE);
+	if (file_id != NULL) {
+		g_hash_table_replace (data->handled, g_strdup (file_id), GINT_TO_POINTER (1));
+	}
+
+	if ((data->dir_func) (dir->dir, info, &subdirs, data->user_data) == FALSE) {
+		for (i = 0; subdirs != NULL && subdirs[i] != NULL; i++) {
+			g_queue_push_tail (data->dirs_left, g_file_get_child (dir->dir, subdirs[i]));
+		}
+		g_strfreev (subdirs);
+		g_object_unref (info);
+		_uri_handle_recursively_dir_done (dir, FALSE);
+		return;
 	}
+	g_object_unref (info);
+
+	dir->listing = TRUE;
+	_uri_handle_recursively_enum_dir (dir);
 }
 
 static void
-_uri_handle_recursively_next_dir (RBUriHandleRecursivelyAsyncData *data)
+_uri_handle_recursively_start_dirs (RBUriHandleRecursivelyAsyncData *data)
 {
-	g_clear_object (&data->current);
-	g_clear_object (&data->enumerator);
-	data->current = g_queue_pop_head (data->dirs_left);
-	if (data->current != NULL) {
-		g_file_enumerate_children_async (data->current,
+	GFile *file;
+
+	if (g_cancellable_is_cancelled (data->cancel)) {
+		while ((file = g_queue_pop_head (data->dirs_left)) != NULL)
+			g_object_unref (file);
+	}
+
+	while (data->active < RB_URI_RECURSE_MAX_DIRS &&
+	       (file = g_queue_pop_head (data->dirs_left)) != NULL) {
+		RBUriHandleRecursivelyDir *dir;
+
+		dir = g_new0 (RBUriHandleRecursivelyDir, 1);
+		dir->data = data;
+		dir->dir = file;
+		data->active++;
+		if (data->dir_func != NULL) {
+			g_file_query_info_async (dir->dir,
 						 recurse_attributes,
 						 G_FILE_QUERY_INFO_NONE,
 						 G_PRIORITY_DEFAULT,
 						 data->cancel,
-						 _uri_handle_recursively_enum_files,
-						 data);
-	} else {
-		rb_debug ("nothing more to do");
+						 _uri_handle_recursively_dir_info,
+						 dir);
+		} else {
+			_uri_handle_recursively_enum_dir (dir);
+		}
+	}
+
+	if (data->active == 0) {
+		double elapsed = g_timer_elapsed (data->timer, NULL);
+
+		rb_debug ("nothing more to do: %u files in %.1f seconds (%.0f files/sec)",
+			  data->files, elapsed, elapsed > 0.0 ? data->files / elapsed : 0.0);
 		_uri_handle_recursively_free (data);
 	}
 }
@@ -1032,7 +1162,8 @@ _uri_handle_recursively_next_dir (RBUriHandleRecursivelyAsyncData *data)
  *
  * Calls @func for each file found under the directory identified
  * by @uri, or if @uri identifies a file, calls it once
- * with that.
+ * with that.  Several directories are enumerated at once, so files
+ * are not necessarily visited in directory order.
  *
  * If non-NULL, @destroy_data will be called once all files have been
  * processed, or when the operation is cancelled.
@@ -1043,6 +1174,39 @@ rb_uri_handle_recursively_async (const char *uri,
 			         RBUriRecurseFunc func,
 			         gpointer user_data,
 				 GDestroyNotify data_destroy)
+{
+	rb_uri_handle_recursively_async_full (uri, cancel, NULL, func, NULL, user_data, data_destroy);
+}
+
+/**
+ * rb_uri_handle_recursively_async_full:
+ * @uri: the URI to visit
+ * @cancel: a #GCancellable to allow cancellation
+ * @dir_func: (allow-none): callback function for directories
+ * @func: callback function for files
+ * @dir_done_func: (allow-none): callback function for finished directories
+ * @user_data: data to pass to callbacks
+ * @data_destroy: function to call to free @user_data
+ *
+ * Like #rb_uri_handle_recursively_async, but if @dir_func is non-NULL,
+ * it is called for each directory before it is enumerated, with
+ * the directory's #GFileInfo.  If it returns FALSE, the directory is
+ * not enumerated, and the walk continues with any subdirectory names
+ * it returns in a NULL-terminated array, which is freed afterwards.
+ *
+ * If @dir_done_func is non-NULL, it is called for each directory @dir_func
+ * allowed to be enumerated, once all the files in it have been passed
+ * to @func.  It is told whether the whole directory was enumerated
+ * without errors.
+ */
+void
+rb_uri_handle_recursively_async_full (const char *uri,
+				      GCancellable *cancel,
+				      RBUriRecurseDirFunc dir_func,
+				      RBUriRecurseFunc func,
+				      RBUriRecurseDirDoneFunc dir_done_func,
+				      gpointer user_data,
+				      GDestroyNotify data_destroy)
 {
 	RBUriHandleRecursivelyAsyncData *data = g_new0 (RBUriHandleRecursivelyAsyncData, 1);
 	
@@ -1053,14 +1217,18 @@ rb_uri_handle_recursively_async (const char *uri,
 		data->cancel = g_cancellable_new ();
 	}
 
+	data->dir_func = dir_func;
 	data->func = func;
+	data->dir_done_func = dir_done_func;
 	data->user_data = user_data;
 	data->data_destroy = data_destroy;
 	data->handled = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
+	data->timer = g_timer_new ();
+
 	data->dirs_left = g_queue_new ();
 	g_queue_push_tail (data->dirs_left, g_file_new_for_uri (uri));
-	_uri_handle_recursively_next_dir (data);
+	_uri_handle_recursively_start_dirs (data);
 }
 
 /**
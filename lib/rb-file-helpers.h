@@ -69,6 +69,12 @@ char *		rb_uri_get_mount_point  (const char *uri);
 /* return TRUE to recurse further, FALSE to stop */
 typedef gboolean (*RBUriRecurseFunc) (GFile *file, GFileInfo *info, gpointer data);
 
+/* return TRUE to enumerate the directory, FALSE to skip it and visit *subdirs instead */
+typedef gboolean (*RBUriRecurseDirFunc) (GFile *dir, GFileInfo *info, char ***subdirs, gpointer data);
+
+/* called once an enumerated directory is finished with */
+typedef void (*RBUriRecurseDirDoneFunc) (GFile *dir, gboolean complete, gpointer data);
+
 void		rb_uri_handle_recursively(const char *uri,
 					  GCancellable *cancel,
 					  RBUriRecurseFunc func,
@@ -79,6 +85,13 @@ void		rb_uri_handle_recursively_async(const char *uri,
 						RBUriRecurseFunc func,
 						gpointer user_data,
 						GDestroyNotify data_destroy);
+void		rb_uri_handle_recursively_async_full(const char *uri,
+						GCancellable *cancel,
+						RBUriRecurseDirFunc dir_func,
+						RBUriRecurseFunc func,
+						RBUriRecurseDirDoneFunc dir_done_func,
+						gpointer user_data,
+						GDestroyNotify data_destroy);
 
 char*		rb_uri_append_path	(const char *uri,
 					 const char *path);
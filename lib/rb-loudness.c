@@ -0,0 +1,356 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#include "config.h"
+
+#include <math.h>
+
+#include "rb-loudness.h"
+
+/**
+ * SECTION:rb-loudness
+ * @short_description: integrated loudness measurement
+ *
+ * Measures the integrated loudness of a stream of float samples as described
+ * in ITU-R BS.1770 and EBU R128: the signal is K-weighted, the mean square
+ * of each channel is measured over 400ms blocks overlapping by 75%, and
+ * blocks quieter than -70 LUFS, then blocks more than 10 LU below the
+ * loudness of the remaining blocks, are left out.
+ *
+ * A meter is not thread-safe, but separate meters can be fed from separate
+ * threads.
+ */
+
+#define BLOCK_STEPS		4		/* 100ms steps per 400ms block */
+#define ABSOLUTE_GATE		(-70.0)
+#define RELATIVE_GATE		(-10.0)
+
+typedef struct {
+	double b0, b1, b2;
+	double a1, a2;
+} Biquad;
+
+struct _RBLoudness {
+	guint rate;
+	guint channels;
+
+	Biquad shelf;
+	Biquad highpass;
+	double *state;			/* 4 per channel: shelf z1, z2, highpass z1, z2 */
+	double *weights;
+
+	guint step_frames;
+	guint step_pos;
+	double step_energy;
+	double steps[BLOCK_STEPS];
+	guint64 n_steps;
+
+	GArray *blocks;			/* mean square of each gating block */
+	double peak;
+};
+
+static double
+energy_to_loudness (double energy)
+{
+	return -0.691 + 10.0 * log10 (energy);
+}
+
+static double
+loudness_to_energy (double loudness)
+{
+	return pow (10.0, (loudness + 0.691) / 10.0);
+}
+
+static void
+init_filters (RBLoudness *meter)
+{
+	double f0, g, q, k, vh, vb, a0;
+
+	/* high shelf modelling the acoustic effect of the head */
+	f0 = 1681.974450955533;
+	g = 3.999843853973347;
+	q = 0.7071752369554196;
+	k = tan (G_PI * f0 / meter->rate);
+	vh = pow (10.0, g / 20.0);
+	vb = pow (vh, 0.4996667741545416);
+	a0 = 1.0 + k / q + k * k;
+	meter->shelf.b0 = (vh + vb * k / q + k * k) / a0;
+	meter->shelf.b1 = 2.0 * (k * k - vh) / a0;
+	meter->shelf.b2 = (vh - vb * k / q + k * k) / a0;
+	meter->shelf.a1 = 2.0 * (k * k - 1.0) / a0;
+	meter->shelf.a2 = (1.0 - k / q + k * k) / a0;
+
+	/* revised low-frequency B-weighting high pass */
+	f0 = 38.13547087602444;
+	q = 0.5003270373238773;
+	k = tan (G_PI * f0 / meter->rate);
+	a0 = 1.0 + k / q + k * k;
+	meter->highpass.b0 = 1.0;
+	meter->highpass.b1 = -2.0;
+	meter->highpass.b2 = 1.0;
+	meter->highpass.a1 = 2.0 * (k * k - 1.0) / a0;
+	meter->highpass.a2 = (1.0 - k / q + k * k) / a0;
+}
+
+static inline double
+biquad_process (const Biquad *f, double *z, double x)
+{
+	double y;
+
+	y = f->b0 * x + z[0];
+	z[0] = f->b1 * x - f->a1 * y + z[1];
+	z[1] = f->b2 * x - f->a2 * y;
+	return y;
+}
+
+/**
+ * rb_loudness_new:
+ * @rate: sample rate of the audio to be measured
+ * @channels: number of interleaved channels
+ *
+ * Creates a new loudness meter.  With five or more channels, the channels
+ * are assumed to be in the usual order (left, right, centre, LFE, left
+ * surround, right surround), so the LFE channel is ignored and the
+ * surround channels are weighted as BS.1770 requires.
+ *
+ * Return value: new loudness meter, free with rb_loudness_free
+ */
+RBLoudness *
+rb_loudness_new (guint rate, guint channels)
+{
+	RBLoudness *meter;
+	guint i;
+
+	g_return_val_if_fail (rate > 0, NULL);
+	g_return_val_if_fail (channels > 0, NULL);
+
+	meter = g_new0 (RBLoudness, 1);
+	meter->rate = rate;
+	meter->channels = channels;
+	meter->state = g_new0 (double, channels * 4);
+	meter->weights = g_new (double, channels);
+	for (i = 0; i < channels; i++) {
+		if (channels >= 5 && i == 3)
+			meter->weights[i] = 0.0;
+		else if (channels >= 5 && (i == 4 || i == 5))
+			meter->weights[i] = 1.41;
+		else
+			meter->weights[i] = 1.0;
+	}
+
+	meter->step_frames = rate / 10;
+	meter->blocks = g_array_new (FALSE, FALSE, sizeof (double));
+	init_filters (meter);
+	return meter;
+}
+
+/**
+ * rb_loudness_free:
+ * @meter: a loudness meter
+ *
+ * Frees a loudness meter.
+ */
+void
+rb_loudness_free (RBLoudness *meter)
+{
+	if (meter == NULL)
+		return;
+
+	g_array_free (meter->blocks, TRUE);
+	g_free (meter->state);
+	g_free (meter->weights);
+	g_free (meter);
+}
+
+/**
+ * rb_loudness_add_frames:
+ * @meter: a loudness meter
+ * @samples: interleaved float samples
+ * @frames: number of frames in @samples
+ *
+ * Feeds audio into the meter.
+ */
+void
+rb_loudness_add_frames (RBLoudness *meter, const float *samples, gsize frames)
+{
+	gsize f;
+	guint c;
+
+	for (f = 0; f < frames; f++) {
+		double sum = 0.0;
+
+		for (c = 0; c < meter->channels; c++) {
+			double *z = meter->state + (c * 4);
+			double x;
+
+			x = samples[f * meter->channels + c];
+			if (fabs (x) > meter->peak)
+				meter->peak = fabs (x);
+
+			x = biquad_process (&meter->shelf, z, x);
+			x = biquad_process (&meter->highpass, z + 2, x);
+			sum += meter->weights[c] * x * x;
+		}
+		meter->step_energy += sum;
+
+		if (++meter->step_pos == meter->step_frames) {
+			meter->steps[meter->n_steps % BLOCK_STEPS] = meter->step_energy;
+			meter->n_steps++;
+			meter->step_energy = 0.0;
+			meter->step_pos = 0;
+
+			if (meter->n_steps >= BLOCK_STEPS) {
+				double block = 0.0;
+				int i;
+
+				for (i = 0; i < BLOCK_STEPS; i++)
+					block += meter->steps[i];
+				block /= (double) (meter->step_frames * BLOCK_STEPS);
+				g_array_append_val (meter->blocks, block);
+			}
+		}
+	}
+
+	/* keep the filters out of denormal territory after silence */
+	for (c = 0; c < meter->channels * 4; c++) {
+		if (fabs (meter->state[c]) < 1e-30)
+			meter->state[c] = 0.0;
+	}
+}
+
+static double
+gated_loudness (RBLoudness **meters, guint n_meters)
+{
+	double absolute;
+	double relative;
+	double total;
+	guint64 count;
+	guint m;
+	guint i;
+
+	/* first pass: mean of the blocks above the absolute gate */
+	absolute = loudness_to_energy (ABSOLUTE_GATE);
+	total = 0.0;
+	count = 0;
+	for (m = 0; m < n_meters; m++) {
+		GArray *blocks = meters[m]->blocks;
+		for (i = 0; i < blocks->len; i++) {
+			double e = g_array_index (blocks, double, i);
+			if (e > absolute) {
+				total += e;
+				count++;
+			}
+		}
+	}
+	if (count == 0)
+		return -HUGE_VAL;
+
+	/* second pass: mean of the blocks above both gates */
+	relative = loudness_to_energy (energy_to_loudness (total / count) + RELATIVE_GATE);
+	if (relative < absolute)
+		relative = absolute;
+	total = 0.0;
+	count = 0;
+	for (m = 0; m < n_meters; m++) {
+		GArray *blocks = meters[m]->blocks;
+		for (i = 0; i < blocks->len; i++) {
+			double e = g_array_index (blocks, double, i);
+			if (e > relative) {
+				total += e;
+				count++;
+			}
+		}
+	}
+	if (count == 0)
+		return -HUGE_VAL;
+
+	return energy_to_loudness (total / count);
+}
+
+/**
+ * rb_loudness_get_loudness:
+ * @meter: a loudness meter
+ *
+ * Returns the integrated loudness of the audio fed into the meter so far.
+ *
+ * Return value: loudness in LUFS, or -HUGE_VAL if the audio was silent or
+ *   shorter than a single 400ms block
+ */
+double
+rb_loudness_get_loudness (RBLoudness *meter)
+{
+	return gated_loudness (&meter, 1);
+}
+
+/**
+ * rb_loudness_get_peak:
+ * @meter: a loudness meter
+ *
+ * Returns the highest absolute sample value fed into the meter so far.
+ *
+ * Return value: sample peak, where 1.0 is full scale
+ */
+double
+rb_loudness_get_peak (RBLoudness *meter)
+{
+	return meter->peak;
+}
+
+/**
+ * rb_loudness_get_album_loudness:
+ * @meters: (array length=n_meters): loudness meters
+ * @n_meters: number of meters
+ *
+ * Returns the integrated loudness of the audio fed into all of the meters,
+ * as if it had all been fed into a single meter.  The gates are applied
+ * across the whole set, so this is not the same as averaging the loudness
+ * of each meter.
+ *
+ * Return value: loudness in LUFS, or -HUGE_VAL
+ */
+double
+rb_loudness_get_album_loudness (RBLoudness **meters, guint n_meters)
+{
+	return gated_loudness (meters, n_meters);
+}
+
+/**
+ * rb_loudness_to_gain:
+ * @loudness: integrated loudness in LUFS
+ *
+ * Converts a loudness measurement into a ReplayGain 2.0 gain value,
+ * which brings the audio to the -18 LUFS reference level.
+ *
+ * Return value: gain in dB
+ */
+double
+rb_loudness_to_gain (double loudness)
+{
+	if (isinf (loudness))
+		return 0.0;
+
+	return RB_LOUDNESS_REFERENCE - loudness;
+}
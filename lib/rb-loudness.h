@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#ifndef RB_LOUDNESS_H
+#define RB_LOUDNESS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* ReplayGain 2.0 reference level, in LUFS */
+#define RB_LOUDNESS_REFERENCE		(-18.0)
+
+typedef struct _RBLoudness RBLoudness;
+
+RBLoudness *	rb_loudness_new			(guint rate, guint channels);
+void		rb_loudness_free		(RBLoudness *meter);
+
+void		rb_loudness_add_frames		(RBLoudness *meter, const float *samples, gsize frames);
+
+double		rb_loudness_get_loudness	(RBLoudness *meter);
+double		rb_loudness_get_peak		(RBLoudness *meter);
+double		rb_loudness_get_album_loudness	(RBLoudness **meters, guint n_meters);
+
+double		rb_loudness_to_gain		(double loudness);
+
+G_END_DECLS
+
+#endif /* RB_LOUDNESS_H */
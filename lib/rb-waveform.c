@@ -0,0 +1,273 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#include "config.h"
+
+#include <math.h>
+
+#include "rb-waveform.h"
+
+/**
+ * SECTION:rb-waveform
+ * @short_description: compact peak/RMS envelopes of audio streams
+ *
+ * Reduces a stream of float samples to a short envelope suitable for drawing
+ * a waveform, for example in a seek bar.  The audio is summarised in 50ms
+ * blocks as it is fed in, and the blocks are merged into the requested number
+ * of bins once the whole stream has been seen.
+ *
+ * An envelope is a #GBytes holding a pair of bytes for each bin: the sample
+ * peak and the RMS level of the bin, both scaled so that 255 is full scale.
+ * Envelopes don't depend on the length or format of the audio, so they can
+ * be drawn at any size without knowing anything else about the stream.
+ */
+
+#define BLOCKS_PER_SECOND	20
+
+typedef struct {
+	float peak;
+	float mean_square;
+} Block;
+
+struct _RBWaveform {
+	guint channels;
+	guint block_frames;
+
+	guint block_pos;
+	float block_peak;
+	double block_energy;
+
+	GArray *blocks;
+};
+
+/**
+ * rb_waveform_new:
+ * @rate: sample rate of the audio
+ * @channels: number of interleaved channels
+ *
+ * Creates a new envelope builder.
+ *
+ * Return value: new envelope builder, free with rb_waveform_free
+ */
+RBWaveform *
+rb_waveform_new (guint rate, guint channels)
+{
+	RBWaveform *waveform;
+
+	g_return_val_if_fail (rate > 0, NULL);
+	g_return_val_if_fail (channels > 0, NULL);
+
+	waveform = g_new0 (RBWaveform, 1);
+	waveform->channels = channels;
+	waveform->block_frames = MAX (rate / BLOCKS_PER_SECOND, 1);
+	waveform->blocks = g_array_sized_new (FALSE, FALSE, sizeof (Block), 300 * BLOCKS_PER_SECOND);
+	return waveform;
+}
+
+/**
+ * rb_waveform_free:
+ * @waveform: an envelope builder
+ *
+ * Frees an envelope builder.
+ */
+void
+rb_waveform_free (RBWaveform *waveform)
+{
+	if (waveform == NULL)
+		return;
+
+	g_array_free (waveform->blocks, TRUE);
+	g_free (waveform);
+}
+
+static void
+finish_block (RBWaveform *waveform)
+{
+	Block block;
+
+	block.peak = waveform->block_peak;
+	block.mean_square = waveform->block_energy / (waveform->block_pos * waveform->channels);
+	g_array_append_val (waveform->blocks, block);
+
+	waveform->block_pos = 0;
+	waveform->block_peak = 0.0f;
+	waveform->block_energy = 0.0;
+}
+
+/**
+ * rb_waveform_add_frames:
+ * @waveform: an envelope builder
+ * @samples: interleaved float samples
+ * @frames: number of frames in @samples
+ *
+ * Feeds audio into the envelope builder.
+ */
+void
+rb_waveform_add_frames (RBWaveform *waveform, const float *samples, gsize frames)
+{
+	gsize f;
+	guint c;
+
+	for (f = 0; f < frames; f++) {
+		for (c = 0; c < waveform->channels; c++) {
+			float x = samples[f * waveform->channels + c];
+
+			if (fabsf (x) > waveform->block_peak)
+				waveform->block_peak = fabsf (x);
+			waveform->block_energy += x * x;
+		}
+
+		if (++waveform->block_pos == waveform->block_frames)
+			finish_block (waveform);
+	}
+}
+
+static guint8
+scale_level (double level)
+{
+	if (level >= 1.0)
+		return 255;
+	if (level <= 0.0)
+		return 0;
+	return (guint8) (level * 255.0 + 0.5);
+}
+
+/**
+ * rb_waveform_get_envelope:
+ * @waveform: an envelope builder
+ * @n_bins: number of bins in the envelope
+ *
+ * Summarises the audio fed into the builder so far into an envelope with
+ * @n_bins bins, each covering an equal part of the stream.  If the stream
+ * is shorter than @n_bins 50ms blocks, blocks are repeated across bins.
+ *
+ * Return value: (transfer full): the envelope, or %NULL if no audio has
+ *   been fed into the builder
+ */
+GBytes *
+rb_waveform_get_envelope (RBWaveform *waveform, guint n_bins)
+{
+	guint8 *data;
+	guint n_blocks;
+	guint i;
+
+	g_return_val_if_fail (n_bins > 0, NULL);
+
+	if (waveform->block_pos > 0)
+		finish_block (waveform);
+
+	n_blocks = waveform->blocks->len;
+	if (n_blocks == 0)
+		return NULL;
+
+	data = g_new (guint8, n_bins * 2);
+	for (i = 0; i < n_bins; i++) {
+		guint first;
+		guint last;
+		guint b;
+		float peak = 0.0f;
+		double energy = 0.0;
+
+		first = ((guint64) i * n_blocks) / n_bins;
+		last = ((guint64) (i + 1) * n_blocks) / n_bins;
+		if (last <= first)
+			last = first + 1;
+
+		for (b = first; b < last; b++) {
+			Block *block = &g_array_index (waveform->blocks, Block, b);
+			if (block->peak > peak)
+				peak = block->peak;
+			energy += block->mean_square;
+		}
+
+		data[i * 2] = scale_level (peak);
+		data[i * 2 + 1] = scale_level (sqrt (energy / (last - first)));
+	}
+
+	return g_bytes_new_take (data, n_bins * 2);
+}
+
+/**
+ * rb_waveform_envelope_get_n_bins:
+ * @envelope: an envelope
+ *
+ * Returns the number of bins in an envelope.
+ *
+ * Return value: number of bins
+ */
+guint
+rb_waveform_envelope_get_n_bins (GBytes *envelope)
+{
+	return g_bytes_get_size (envelope) / 2;
+}
+
+/**
+ * rb_waveform_envelope_get_range:
+ * @envelope: an envelope
+ * @start: start of the range, as a fraction of the stream length
+ * @end: end of the range, as a fraction of the stream length
+ * @peak: (out): returns the peak level in the range
+ * @rms: (out): returns the highest RMS level in the range
+ *
+ * Returns the levels of the part of the stream between @start and @end,
+ * where 1.0 is full scale.  This is intended for drawing an envelope
+ * at a different resolution to the one it was built at: each pixel column
+ * covers whichever bins fall inside it.
+ *
+ * Return value: %TRUE if the range covers any of the envelope
+ */
+gboolean
+rb_waveform_envelope_get_range (GBytes *envelope, double start, double end, float *peak, float *rms)
+{
+	const guint8 *data;
+	guint n_bins;
+	guint first;
+	guint last;
+	guint i;
+	guint8 max_peak = 0;
+	guint8 max_rms = 0;
+
+	n_bins = rb_waveform_envelope_get_n_bins (envelope);
+	if (n_bins == 0 || end <= 0.0 || start >= 1.0 || end <= start)
+		return FALSE;
+
+	start = MAX (start, 0.0);
+	end = MIN (end, 1.0);
+	first = MIN ((guint) (start * n_bins), n_bins - 1);
+	last = (guint) ceil (end * n_bins);
+	if (last <= first)
+		last = first + 1;
+
+	data = g_bytes_get_data (envelope, NULL);
+	for (i = first; i < last; i++) {
+		max_peak = MAX (max_peak, data[i * 2]);
+		max_rms = MAX (max_rms, data[i * 2 + 1]);
+	}
+
+	*peak = max_peak / 255.0f;
+	*rms = max_rms / 255.0f;
+	return TRUE;
+}
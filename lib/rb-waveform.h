@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#ifndef RB_WAVEFORM_H
+#define RB_WAVEFORM_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* number of bins in envelopes stored in the waveform cache */
+#define RB_WAVEFORM_DEFAULT_BINS	1024
+
+typedef struct _RBWaveform RBWaveform;
+
+RBWaveform *	rb_waveform_new			(guint rate, guint channels);
+void		rb_waveform_free		(RBWaveform *waveform);
+
+void		rb_waveform_add_frames		(RBWaveform *waveform, const float *samples, gsize frames);
+
+GBytes *	rb_waveform_get_envelope	(RBWaveform *waveform, guint n_bins);
+
+guint		rb_waveform_envelope_get_n_bins	(GBytes *envelope);
+gboolean	rb_waveform_envelope_get_range	(GBytes *envelope,
+						 double start,
+						 double end,
+						 float *peak,
+						 float *rms);
+
+G_END_DECLS
+
+#endif /* RB_WAVEFORM_H */
@@ -34,6 +34,8 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
 #include <metadata/rb-ext-db.h>
 #include <lib/rb-file-helpers.h>
 #include <lib/rb-debug.h>
@@ -50,8 +52,15 @@
  * A metadata requestor calls rb_ext_db_request and specifies a callback,
  * or alternatively connects to a signal to receive all metadata as it is
  * stored.
+ *
+ * Recently loaded items are kept in memory in their converted form, so
+ * requesting the same item again doesn't need to read and convert the
+ * file again.
  */
 
+/* maximum (approximate) size of converted values kept in memory */
+#define RB_EXT_DB_CACHE_SIZE	(32 * 1024 * 1024)
+
 enum
 {
 	PROP_0,
@@ -71,10 +80,16 @@ static guint signals[LAST_SIGNAL] = { 0 };
 
 static GList *instances = NULL;
 
+/* loads stored items and converts them, most recent requests first */
+static GThreadPool *load_pool = NULL;
+static guint64 load_serial = 0;
+
 static void rb_ext_db_class_init (RBExtDBClass *klass);
 static void rb_ext_db_init (RBExtDB *store);
 
 static void maybe_start_store_request (RBExtDB *store);
+static void load_thread_main (GSimpleAsyncResult *result, gpointer unused);
+static int compare_load_requests (GSimpleAsyncResult *a, GSimpleAsyncResult *b, gpointer unused);
 
 struct _RBExtDBPrivate
 {
@@ -85,8 +100,22 @@ struct _RBExtDBPrivate
 	GList *requests;
 	GAsyncQueue *store_queue;
 	GSimpleAsyncResult *store_op;
+
+	GMutex cache_lock;
+	GHashTable *cache;		/* filename -> link in cache_lru */
+	GQueue cache_lru;		/* most recently used first */
+	gsize cache_size;
+	guint cache_generation;
+
+	GHashTable *loading;		/* filename -> GPtrArray of requests waiting for the load */
 };
 
+typedef struct {
+	char *filename;
+	GValue value;
+	gsize size;
+} RBExtDBCacheItem;
+
 typedef struct {
 	RBExtDBKey *key;
 	RBExtDBRequestCallback callback;
@@ -96,6 +125,9 @@ typedef struct {
 	RBExtDBKey *store_key;
 	char *filename;
 	GValue *data;
+
+	guint64 serial;
+	guint generation;
 } RBExtDBRequest;
 
 typedef struct {
@@ -141,6 +173,13 @@ answer_request (RBExtDBRequest *request,
 	free_request (request);
 }
 
+static void
+free_waiting_requests (GPtrArray *waiting)
+{
+	g_ptr_array_foreach (waiting, (GFunc) free_request, NULL);
+	g_ptr_array_free (waiting, TRUE);
+}
+
 static RBExtDBRequest *
 create_request (RBExtDBKey *key,
 		RBExtDBRequestCallback callback,
@@ -156,6 +195,128 @@ create_request (RBExtDBKey *key,
 }
 
 
+static gsize
+value_size (const GValue *value)
+{
+	if (G_VALUE_HOLDS (value, GDK_TYPE_PIXBUF)) {
+		GdkPixbuf *pixbuf = g_value_get_object (value);
+		if (pixbuf != NULL)
+			return gdk_pixbuf_get_rowstride (pixbuf) * gdk_pixbuf_get_height (pixbuf);
+	} else if (G_VALUE_HOLDS (value, G_TYPE_GSTRING)) {
+		GString *str = g_value_get_boxed (value);
+		if (str != NULL)
+			return str->len;
+	} else if (G_VALUE_HOLDS (value, G_TYPE_BYTE_ARRAY)) {
+		GByteArray *bytes = g_value_get_boxed (value);
+		if (bytes != NULL)
+			return bytes->len;
+	} else if (G_VALUE_HOLDS (value, G_TYPE_BYTES)) {
+		GBytes *bytes = g_value_get_boxed (value);
+		if (bytes != NULL)
+			return g_bytes_get_size (bytes);
+	} else if (G_VALUE_HOLDS_STRING (value)) {
+		const char *str = g_value_get_string (value);
+		if (str != NULL)
+			return strlen (str);
+	}
+	return sizeof (GValue);
+}
+
+static void
+free_cache_item (RBExtDBCacheItem *item)
+{
+	g_value_unset (&item->value);
+	g_free (item->filename);
+	g_slice_free (RBExtDBCacheItem, item);
+}
+
+/* call with the cache lock held */
+static void
+cache_remove_link (RBExtDB *store, GList *link)
+{
+	RBExtDBCacheItem *item = link->data;
+
+	g_hash_table_remove (store->priv->cache, item->filename);
+	g_queue_delete_link (&store->priv->cache_lru, link);
+	store->priv->cache_size -= item->size;
+	free_cache_item (item);
+}
+
+static GValue *
+cache_lookup (RBExtDB *store, const char *filename)
+{
+	RBExtDBCacheItem *item;
+	GValue *value = NULL;
+	GList *link;
+
+	g_mutex_lock (&store->priv->cache_lock);
+	link = g_hash_table_lookup (store->priv->cache, filename);
+	if (link != NULL) {
+		g_queue_unlink (&store->priv->cache_lru, link);
+		g_queue_push_head_link (&store->priv->cache_lru, link);
+
+		item = link->data;
+		value = g_new0 (GValue, 1);
+		g_value_init (value, G_VALUE_TYPE (&item->value));
+		g_value_copy (&item->value, value);
+	}
+	g_mutex_unlock (&store->priv->cache_lock);
+	return value;
+}
+
+static void
+cache_insert (RBExtDB *store, const char *filename, const GValue *value, guint generation)
+{
+	RBExtDBCacheItem *item;
+	GList *link;
+	gsize size;
+
+	/* don't let one huge item push everything else out */
+	size = value_size (value);
+	if (size > RB_EXT_DB_CACHE_SIZE / 4)
+		return;
+
+	g_mutex_lock (&store->priv->cache_lock);
+
+	/* the file may have been replaced while we were loading it */
+	if (generation != store->priv->cache_generation) {
+		g_mutex_unlock (&store->priv->cache_lock);
+		return;
+	}
+
+	link = g_hash_table_lookup (store->priv->cache, filename);
+	if (link != NULL)
+		cache_remove_link (store, link);
+
+	item = g_slice_new0 (RBExtDBCacheItem);
+	item->filename = g_strdup (filename);
+	item->size = size;
+	g_value_init (&item->value, G_VALUE_TYPE (value));
+	g_value_copy (value, &item->value);
+
+	g_queue_push_head (&store->priv->cache_lru, item);
+	g_hash_table_insert (store->priv->cache, item->filename, store->priv->cache_lru.head);
+	store->priv->cache_size += size;
+
+	while (store->priv->cache_size > RB_EXT_DB_CACHE_SIZE) {
+		cache_remove_link (store, store->priv->cache_lru.tail);
+	}
+	g_mutex_unlock (&store->priv->cache_lock);
+}
+
+static void
+cache_invalidate (RBExtDB *store, const char *filename)
+{
+	GList *link;
+
+	g_mutex_lock (&store->priv->cache_lock);
+	store->priv->cache_generation++;
+	link = g_hash_table_lookup (store->priv->cache, filename);
+	if (link != NULL)
+		cache_remove_link (store, link);
+	g_mutex_unlock (&store->priv->cache_lock);
+}
+
 static RBExtDBStoreRequest *
 create_store_request (RBExtDBKey *key,
 		      RBExtDBSourceType source_type,
@@ -394,6 +555,12 @@ impl_finalize (GObject *object)
 		tdb_close (store->priv->tdb_context);
 	}
 
+	g_hash_table_destroy (store->priv->cache);
+	g_queue_foreach (&store->priv->cache_lru, (GFunc) free_cache_item, NULL);
+	g_queue_clear (&store->priv->cache_lru);
+	g_mutex_clear (&store->priv->cache_lock);
+	g_hash_table_destroy (store->priv->loading);
+
 	instances = g_list_remove (instances, store);
 
 	G_OBJECT_CLASS (rb_ext_db_parent_class)->finalize (object);
@@ -405,6 +572,11 @@ rb_ext_db_init (RBExtDB *store)
 	store->priv = G_TYPE_INSTANCE_GET_PRIVATE (store, RB_TYPE_EXT_DB, RBExtDBPrivate);
 
 	store->priv->store_queue = g_async_queue_new ();
+
+	g_mutex_init (&store->priv->cache_lock);
+	store->priv->cache = g_hash_table_new (g_str_hash, g_str_equal);
+	g_queue_init (&store->priv->cache_lru);
+	store->priv->loading = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) free_waiting_requests);
 }
 
 static void
@@ -420,6 +592,13 @@ rb_ext_db_class_init (RBExtDBClass *klass)
 	klass->load = default_load;
 	klass->store = default_store;
 
+	load_pool = g_thread_pool_new ((GFunc) load_thread_main,
+				       NULL,
+				       g_get_num_processors (),
+				       FALSE,
+				       NULL);
+	g_thread_pool_set_sort_function (load_pool, (GCompareDataFunc) compare_load_requests, NULL);
+
 	/**
 	 * RBExtDB:name:
 	 *
@@ -619,11 +798,33 @@ static void
 load_request_cb (RBExtDB *store, GAsyncResult *result, gpointer data)
 {
 	RBExtDBRequest *req;
+	GPtrArray *waiting = NULL;
+	gpointer loading_key;
+	guint i;
+
 	req = g_simple_async_result_get_op_res_gpointer (G_SIMPLE_ASYNC_RESULT (result));
 
 	rb_debug ("finished loading %s", req->filename);
+	if (req->data != NULL)
+		cache_insert (store, req->filename, req->data, req->generation);
+
+	if (g_hash_table_lookup_extended (store->priv->loading, req->filename, &loading_key, (gpointer *)&waiting)) {
+		g_hash_table_steal (store->priv->loading, req->filename);
+		g_free (loading_key);
+	}
+
 	req->callback (req->key, req->store_key, req->filename, req->data, req->user_data);
 
+	/* answer any other requests for the same item */
+	if (waiting != NULL) {
+		for (i = 0; i < waiting->len; i++) {
+			RBExtDBRequest *w = g_ptr_array_index (waiting, i);
+			w->callback (w->key, w->store_key, w->filename, req->data, w->user_data);
+			free_request (w);
+		}
+		g_ptr_array_free (waiting, TRUE);
+	}
+
 	g_object_unref (result);
 }
 
@@ -673,6 +874,42 @@ do_load_request (GSimpleAsyncResult *result, GObject *object, GCancellable *canc
 	g_object_unref (f);
 }
 
+static void
+load_thread_main (GSimpleAsyncResult *result, gpointer unused)
+{
+	GObject *store;
+
+	store = g_async_result_get_source_object (G_ASYNC_RESULT (result));
+	do_load_request (result, store, NULL);
+	g_object_unref (store);
+
+	g_simple_async_result_complete_in_idle (result);
+}
+
+static int
+compare_load_requests (GSimpleAsyncResult *a, GSimpleAsyncResult *b, gpointer unused)
+{
+	RBExtDBRequest *ra = g_simple_async_result_get_op_res_gpointer (a);
+	RBExtDBRequest *rb = g_simple_async_result_get_op_res_gpointer (b);
+
+	/* newest first: when scrolling through a list of albums, the
+	 * most recently requested items are the ones still visible.
+	 */
+	if (ra->serial > rb->serial)
+		return -1;
+	else if (ra->serial < rb->serial)
+		return 1;
+	return 0;
+}
+
+
+static gboolean
+answer_cached_request (RBExtDBRequest *req)
+{
+	req->callback (req->key, req->store_key, req->filename, req->data, req->user_data);
+	free_request (req);
+	return FALSE;
+}
 
 /**
  * rb_ext_db_request:
@@ -682,8 +919,9 @@ do_load_request (GSimpleAsyncResult *result, GObject *object, GCancellable *canc
  * @user_data: user data to pass to the callback
  * @destroy: destroy function for @user_data
  *
- * Requests a metadata item.  If the item is cached, the callback will be called
- * synchronously.  Otherwise, metadata providers will provide results asynchronously.
+ * Requests a metadata item.  If the item is known to be unavailable, the callback
+ * will be called synchronously.  Otherwise, results are provided asynchronously,
+ * even if the item is already loaded.
  *
  * Return value: %TRUE if results may be provided after returning
  */
@@ -703,6 +941,8 @@ rb_ext_db_request (RBExtDB *store,
 	GList *l;
 	gboolean emit_request = TRUE;
 	RBExtDBKey *store_key = NULL;
+	GPtrArray *waiting;
+	GValue *value;
 
 	rb_debug ("starting metadata request");
 
@@ -728,20 +968,40 @@ rb_ext_db_request (RBExtDB *store,
 			rb_debug ("found cached match %s under key %s", filename, str);
 			g_free (str);
 		}
-		load_op = g_simple_async_result_new (G_OBJECT (store),
-						     (GAsyncReadyCallback) load_request_cb,
-						     NULL,
-						     rb_ext_db_request);
 
 		req = create_request (key, callback, user_data, destroy);
 		req->filename = filename;
 		req->store_key = store_key;
-		g_simple_async_result_set_op_res_gpointer (load_op, req, (GDestroyNotify) free_request);
 
-		g_simple_async_result_run_in_thread (load_op,
-						     do_load_request,
-						     G_PRIORITY_DEFAULT,
-						     NULL);	/* no cancel? */
+		/* already loaded?  callers expect the callback after we return */
+		value = cache_lookup (store, filename);
+		if (value != NULL) {
+			rb_debug ("using converted value of type %s from memory", G_VALUE_TYPE_NAME (value));
+			req->data = value;
+			g_idle_add ((GSourceFunc) answer_cached_request, req);
+			return FALSE;
+		}
+
+		/* being loaded already? */
+		waiting = g_hash_table_lookup (store->priv->loading, filename);
+		if (waiting != NULL) {
+			rb_debug ("waiting for existing load of %s", filename);
+			g_ptr_array_add (waiting, req);
+			return FALSE;
+		}
+		g_hash_table_insert (store->priv->loading, g_strdup (filename), g_ptr_array_new ());
+
+		g_mutex_lock (&store->priv->cache_lock);
+		req->generation = store->priv->cache_generation;
+		g_mutex_unlock (&store->priv->cache_lock);
+		req->serial = ++load_serial;
+
+		load_op = g_simple_async_result_new (G_OBJECT (store),
+						     (GAsyncReadyCallback) load_request_cb,
+						     NULL,
+						     rb_ext_db_request);
+		g_simple_async_result_set_op_res_gpointer (load_op, req, (GDestroyNotify) free_request);
+		g_thread_pool_push (load_pool, load_op, NULL);
 		return FALSE;
 	}
 
@@ -801,7 +1061,6 @@ delete_file (RBExtDB *store, const char *filename)
 
 	fullname = g_build_filename (rb_user_cache_dir (), store->priv->name, filename, NULL);
 	f = g_file_new_for_path (fullname);
-	g_free (fullname);
 
 	g_file_delete (f, NULL, &error);
 	if (error) {
@@ -810,7 +1069,9 @@ delete_file (RBExtDB *store, const char *filename)
 	} else {
 		rb_debug ("deleted %s from %s", filename, store->priv->name);
 	}
-
+	cache_invalidate (store, fullname);
+	g_free (fullname);
+	g_object_unref (f);
 }
 
 
@@ -1043,6 +1304,7 @@ do_store_request (GSimpleAsyncResult *result, GObject *object, GCancellable *can
 		} else {
 			req->stored = TRUE;
 		}
+		cache_invalidate (store, req->filename);
 
 		g_free (basename);
 		g_free (subdir);
@@ -44,6 +44,12 @@
  * child is still capable of handling messages, and it ensures the child
  * doesn't time out between when we check the child is still running and when
  * we actually send it the request.
+ *
+ * To allow several files to be read at once, there is a pool of metadata
+ * helpers, each used by one request at a time.  Requests use an idle
+ * helper if there is one, start a new helper if the pool isn't full yet, and
+ * otherwise wait for a helper to become idle.  If one helper crashes or
+ * hangs, only the request it was handling fails.
  */
 
 /**
@@ -74,12 +80,24 @@ static void rb_metadata_class_init (RBMetaDataClass *klass);
 static void rb_metadata_init (RBMetaData *md);
 static void rb_metadata_finalize (GObject *object);
 
+struct _RBMetaDataService
+{
+	GDBusConnection *connection;
+	GPid child;
+	int child_stdout;
+	guint registry_serial;
+	gboolean busy;
+};
+
 static gboolean tried_env_address = FALSE;
-static GDBusConnection *dbus_connection = NULL;
-static GPid metadata_child = 0;
-static int metadata_stdout = -1;
 static GMainContext *main_context = NULL;
-static GMutex conn_mutex;
+
+/* protects everything below */
+static GMutex services_mutex;
+static GCond services_cond;
+static GPtrArray *services = NULL;
+static guint max_services = 0;
+static guint registry_serial = 0;
 static char **saveable_types = NULL;
 
 struct RBMetaDataPrivate
@@ -140,48 +158,141 @@ rb_metadata_new (void)
 	return RB_METADATA (g_object_new (RB_TYPE_METADATA, NULL));
 }
 
+static guint
+get_max_services (void)
+{
+	if (max_services > 0)
+		return max_services;
+	else
+		return g_get_num_processors ();
+}
+
+/*
+ * Finds a metadata helper for a request to use, waiting for one
+ * to become idle if the pool is full.  The helper isn't necessarily
+ * running yet.
+ */
+RBMetaDataService *
+_rb_metadata_acquire_service (void)
+{
+	RBMetaDataService *service = NULL;
+	guint i;
+
+	g_mutex_lock (&services_mutex);
+	if (services == NULL)
+		services = g_ptr_array_new ();
+
+	while (service == NULL) {
+		/* prefer idle helpers that are already running */
+		for (i = 0; i < services->len; i++) {
+			RBMetaDataService *s = g_ptr_array_index (services, i);
+			if (s->busy)
+				continue;
+
+			if (service == NULL || (service->connection == NULL && s->connection != NULL))
+				service = s;
+		}
+
+		if (service == NULL && services->len < get_max_services ()) {
+			service = g_new0 (RBMetaDataService, 1);
+			service->child_stdout = -1;
+			g_ptr_array_add (services, service);
+			rb_debug ("adding metadata helper %d to the pool", services->len);
+		}
+
+		if (service == NULL)
+			g_cond_wait (&services_cond, &services_mutex);
+	}
+
+	service->busy = TRUE;
+	g_mutex_unlock (&services_mutex);
+	return service;
+}
+
+static void kill_metadata_service (RBMetaDataService *service);
+
+void
+_rb_metadata_release_service (RBMetaDataService *service)
+{
+	gboolean remove = FALSE;
+
+	g_mutex_lock (&services_mutex);
+	service->busy = FALSE;
+
+	/* shrink the pool if the limit has been lowered */
+	if (services->len > get_max_services ()) {
+		rb_debug ("removing metadata helper from the pool");
+		g_ptr_array_remove (services, service);
+		remove = TRUE;
+	}
+
+	g_cond_signal (&services_cond);
+	g_mutex_unlock (&services_mutex);
+
+	/* stopping the helper can block, so don't hold up other requests */
+	if (remove) {
+		kill_metadata_service (service);
+		g_free (service);
+	}
+}
+
+/*
+ * Returns the number of metadata helpers in the pool, running or not.
+ */
+guint
+_rb_metadata_get_n_services (void)
+{
+	guint n;
+
+	g_mutex_lock (&services_mutex);
+	n = (services != NULL) ? services->len : 0;
+	g_mutex_unlock (&services_mutex);
+
+	return n;
+}
+
 static void
-kill_metadata_service (void)
+kill_metadata_service (RBMetaDataService *service)
 {
-	if (dbus_connection) {
-		if (g_dbus_connection_is_closed (dbus_connection) == FALSE) {
+	if (service->connection) {
+		if (g_dbus_connection_is_closed (service->connection) == FALSE) {
 			rb_debug ("closing dbus connection");
-			g_dbus_connection_close_sync (dbus_connection, NULL, NULL);
+			g_dbus_connection_close_sync (service->connection, NULL, NULL);
 		} else {
 			rb_debug ("dbus connection already closed");
 		}
-		g_object_unref (dbus_connection);
-		dbus_connection = NULL;
+		g_object_unref (service->connection);
+		service->connection = NULL;
 	}
 
-	if (metadata_child) {
+	if (service->child) {
 		rb_debug ("killing child process");
-		kill (metadata_child, SIGINT);
-		g_spawn_close_pid (metadata_child);
-		metadata_child = 0;
+		kill (service->child, SIGINT);
+		g_spawn_close_pid (service->child);
+		service->child = 0;
 	}
 
-	if (metadata_stdout != -1) {
+	if (service->child_stdout != -1) {
 		rb_debug ("closing metadata child process stdout pipe");
-		close (metadata_stdout);
-		metadata_stdout = -1;
+		close (service->child_stdout);
+		service->child_stdout = -1;
 	}
 }
 
 static gboolean
-ping_metadata_service (GError **error)
+ping_metadata_service (RBMetaDataService *service, GError **error)
 {
 	GDBusMessage *message;
 	GDBusMessage *response;
 
-	if (g_dbus_connection_is_closed (dbus_connection))
+	if (g_dbus_connection_is_closed (service->connection))
 		return FALSE;
 
 	message = g_dbus_message_new_method_call (RB_METADATA_DBUS_NAME,
 						  RB_METADATA_DBUS_OBJECT_PATH,
 						  RB_METADATA_DBUS_INTERFACE,
 						  "ping");
-	response = g_dbus_connection_send_message_with_reply_sync (dbus_connection,
+	response = g_dbus_connection_send_message_with_reply_sync (service->connection,
 								   message,
 								   G_DBUS_MESSAGE_FLAGS_NONE,
 								   RB_METADATA_DBUS_TIMEOUT,
@@ -202,36 +313,49 @@ ping_metadata_service (GError **error)
 }
 
 static gboolean
-start_metadata_service (GError **error)
+start_metadata_service (RBMetaDataService *service, GError **error)
 {
 	GIOChannel *stdout_channel;
 	GIOStatus status;
 	gchar *dbus_address = NULL;
 	char *saveable_type_list;
 	GVariant *response_body;
+	char **types;
+	guint serial;
+
+	g_mutex_lock (&services_mutex);
+	serial = registry_serial;
+	g_mutex_unlock (&services_mutex);
+
+	if (service->connection && service->registry_serial != serial) {
+		rb_debug ("plugin registry has changed; restarting metadata service");
+		kill_metadata_service (service);
+	}
 
-	if (dbus_connection) {
-		if (ping_metadata_service (error))
+	if (service->connection) {
+		if (ping_metadata_service (service, error))
 			return TRUE;
 
 		/* Metadata service is broken.  Kill it, and if we haven't run
 		 * into any errors yet, we can try to restart it.
 		 */
-		kill_metadata_service ();
+		kill_metadata_service (service);
 
 		if (*error)
 			return FALSE;
 	}
 
+	g_mutex_lock (&services_mutex);
 	if (!tried_env_address) {
 		const char *addr = g_getenv ("RB_DBUS_METADATA_ADDRESS");
 		tried_env_address = TRUE;
 		if (addr) {
 			rb_debug ("trying metadata service address %s (from environment)", addr);
 			dbus_address = g_strdup (addr);
-			metadata_child = 0;
+			service->child = 0;
 		}
 	}
+	g_mutex_unlock (&services_mutex);
 
 	if (dbus_address == NULL) {
 		GPtrArray *argv;
@@ -267,9 +391,9 @@ start_metadata_service (GError **error)
 						NULL,
 						0,
 						NULL, NULL,
-						&metadata_child,
+						&service->child,
 						NULL,
-						&metadata_stdout,
+						&service->child_stdout,
 						NULL,
 						&local_error);
 		g_ptr_array_free (argv, TRUE);
@@ -280,11 +404,11 @@ start_metadata_service (GError **error)
 			return FALSE;
 		}
 
-		stdout_channel = g_io_channel_unix_new (metadata_stdout);
+		stdout_channel = g_io_channel_unix_new (service->child_stdout);
 		status = g_io_channel_read_line (stdout_channel, &dbus_address, NULL, NULL, error);
 		g_io_channel_unref (stdout_channel);
 		if (status != G_IO_STATUS_NORMAL) {
-			kill_metadata_service ();
+			kill_metadata_service (service);
 			return FALSE;
 		}
 
@@ -292,27 +416,24 @@ start_metadata_service (GError **error)
 		rb_debug ("Got metadata helper D-BUS address %s", dbus_address);
 	}
 
-	dbus_connection = g_dbus_connection_new_for_address_sync (dbus_address,
-								  G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
-								  NULL,
-								  NULL,
-								  error);
+	service->connection = g_dbus_connection_new_for_address_sync (dbus_address,
+								      G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+								      NULL,
+								      NULL,
+								      error);
 	g_free (dbus_address);
 	if (*error != NULL) {
-		kill_metadata_service ();
+		kill_metadata_service (service);
 		return FALSE;
 	}
 
-	g_dbus_connection_set_exit_on_close (dbus_connection, FALSE);
+	g_dbus_connection_set_exit_on_close (service->connection, FALSE);
+	service->registry_serial = serial;
 
-	rb_debug ("Metadata process %d started", metadata_child);
+	rb_debug ("Metadata process %d started", service->child);
 
 	/* now ask it what types it can re-tag */
-	if (saveable_types != NULL) {
-		g_strfreev (saveable_types);
-	}
-
-	response_body = g_dbus_connection_call_sync (dbus_connection,
+	response_body = g_dbus_connection_call_sync (service->connection,
 						     RB_METADATA_DBUS_NAME,
 						     RB_METADATA_DBUS_OBJECT_PATH,
 						     RB_METADATA_DBUS_INTERFACE,
@@ -328,9 +449,9 @@ start_metadata_service (GError **error)
 		return FALSE;
 	}
 
-	g_variant_get (response_body, "(^as)", &saveable_types);
-	if (saveable_types != NULL) {
-		saveable_type_list = g_strjoinv (", ", saveable_types);
+	g_variant_get (response_body, "(^as)", &types);
+	if (types != NULL) {
+		saveable_type_list = g_strjoinv (", ", types);
 		rb_debug ("saveable types from metadata helper: %s", saveable_type_list);
 		g_free (saveable_type_list);
 	} else {
@@ -338,6 +459,11 @@ start_metadata_service (GError **error)
 	}
 	g_variant_unref (response_body);
 
+	g_mutex_lock (&services_mutex);
+	g_strfreev (saveable_types);
+	saveable_types = types;
+	g_mutex_unlock (&services_mutex);
+
 	return TRUE;
 }
 
@@ -362,6 +488,80 @@ rb_metadata_reset (RBMetaData *md)
 						    (GDestroyNotify)rb_value_free);
 }
 
+static void
+read_load_response (RBMetaData *md, GVariant *response, GError **error)
+{
+	GVariantIter *metadata;
+	gboolean ok = FALSE;
+	int error_code;
+	char *error_string = NULL;
+
+	g_variant_get (response,
+		       "(^as^asbbbsbisa{iv})",
+		       &md->priv->missing_plugins,
+		       &md->priv->plugin_descriptions,
+		       &md->priv->has_audio,
+		       &md->priv->has_video,
+		       &md->priv->has_other_data,
+		       &md->priv->media_type,
+		       &ok,
+		       &error_code,
+		       &error_string,
+		       &metadata);
+
+	if (ok) {
+		guint32 key;
+		GVariant *value;
+
+		while (g_variant_iter_next (metadata, "{iv}", &key, &value)) {
+			GValue *val = g_slice_new0 (GValue);
+
+			switch (rb_metadata_get_field_type (key)) {
+			case G_TYPE_STRING:
+				g_value_init (val, G_TYPE_STRING);
+				g_value_set_string (val, g_variant_get_string (value, NULL));
+				break;
+			case G_TYPE_ULONG:
+				g_value_init (val, G_TYPE_ULONG);
+				g_value_set_ulong (val, g_variant_get_uint32 (value));
+				break;
+			case G_TYPE_DOUBLE:
+				g_value_init (val, G_TYPE_DOUBLE);
+				g_value_set_double (val, g_variant_get_double (value));
+				break;
+			default:
+				g_assert_not_reached ();
+				break;
+			}
+			g_hash_table_insert (md->priv->metadata, GINT_TO_POINTER (key), val);
+			g_variant_unref (value);
+		}
+
+	} else {
+		g_set_error (error, RB_METADATA_ERROR,
+			     error_code,
+			     "%s", error_string);
+	}
+	g_variant_iter_free (metadata);
+	g_free (error_string);
+}
+
+static void
+missing_plugins_reload (RBMetaDataService *service)
+{
+	/* if we're missing some plugins, we'll need to make sure the
+	 * metadata helpers reread the registry before the next load.
+	 * the easiest way to do this is to kill them, which the
+	 * other helpers do when they next notice the serial change.
+	 */
+	rb_debug ("missing plugins; killing metadata service to force registry reload");
+	kill_metadata_service (service);
+
+	g_mutex_lock (&services_mutex);
+	registry_serial++;
+	g_mutex_unlock (&services_mutex);
+}
+
 /**
  * rb_metadata_load:
  * @md: a #RBMetaData
@@ -378,7 +578,8 @@ rb_metadata_load (RBMetaData *md,
 		  const char *uri,
 		  GError **error)
 {
-	GVariant *response;
+	RBMetaDataService *service;
+	GVariant *response = NULL;
 	GError *fake_error = NULL;
 
 	if (error == NULL)
@@ -387,13 +588,14 @@ rb_metadata_load (RBMetaData *md,
 	rb_metadata_reset (md);
 	if (uri == NULL)
 		return;
-	g_mutex_lock (&conn_mutex);
 
-	start_metadata_service (error);
+	service = _rb_metadata_acquire_service ();
+
+	start_metadata_service (service, error);
 
 	if (*error == NULL) {
 		rb_debug ("sending metadata load request: %s", uri);
-		response = g_dbus_connection_call_sync (dbus_connection,
+		response = g_dbus_connection_call_sync (service->connection,
 							RB_METADATA_DBUS_NAME,
 							RB_METADATA_DBUS_OBJECT_PATH,
 							RB_METADATA_DBUS_INTERFACE,
@@ -407,72 +609,234 @@ rb_metadata_load (RBMetaData *md,
 	}
 
 	if (*error == NULL) {
-		GVariantIter *metadata;
-		gboolean ok = FALSE;
-		int error_code;
-		char *error_string = NULL;
-
-		g_variant_get (response,
-			       "(^as^asbbbsbisa{iv})",
-			       &md->priv->missing_plugins,
-			       &md->priv->plugin_descriptions,
-			       &md->priv->has_audio,
-			       &md->priv->has_video,
-			       &md->priv->has_other_data,
-			       &md->priv->media_type,
-			       &ok,
-			       &error_code,
-			       &error_string,
-			       &metadata);
-
-		if (ok) {
-			guint32 key;
-			GVariant *value;
-
-			while (g_variant_iter_next (metadata, "{iv}", &key, &value)) {
-				GValue *val = g_slice_new0 (GValue);
-
-				switch (rb_metadata_get_field_type (key)) {
-				case G_TYPE_STRING:
-					g_value_init (val, G_TYPE_STRING);
-					g_value_set_string (val, g_variant_get_string (value, NULL));
-					break;
-				case G_TYPE_ULONG:
-					g_value_init (val, G_TYPE_ULONG);
-					g_value_set_ulong (val, g_variant_get_uint32 (value));
-					break;
-				case G_TYPE_DOUBLE:
-					g_value_init (val, G_TYPE_DOUBLE);
-					g_value_set_double (val, g_variant_get_double (value));
-					break;
-				default:
-					g_assert_not_reached ();
-					break;
-				}
-				g_hash_table_insert (md->priv->metadata, GINT_TO_POINTER (key), val);
-				g_variant_unref (value);
-			}
+		read_load_response (md, response, error);
 
-		} else {
-			g_set_error (error, RB_METADATA_ERROR,
-				     error_code,
-				     "%s", error_string);
-		}
-		g_variant_iter_free (metadata);
+		if (*error == NULL && g_strv_length (md->priv->missing_plugins) > 0)
+			missing_plugins_reload (service);
+	}
+	if (response)
+		g_variant_unref (response);
+	if (fake_error)
+		g_error_free (fake_error);
 
-		/* if we're missing some plugins, we'll need to make sure the
-		 * metadata helper rereads the registry before the next load.
-		 * the easiest way to do this is to kill it.
+	_rb_metadata_release_service (service);
+}
+
+typedef struct {
+	RBMetaData **md;
+	guint n_uris;
+	gboolean *loaded;
+	gboolean missing_plugins;
+	RBMetaDataLoadCallback callback;
+	gpointer data;
+	GError *error;
+	gboolean done;
+
+	GMainContext *context;
+	GCancellable *cancel;
+	GSource *timeout;
+} LoadManyData;
+
+static gboolean
+load_many_timeout_cb (LoadManyData *batch)
+{
+	rb_debug ("no metadata results for %d ms; giving up on the batch", RB_METADATA_DBUS_TIMEOUT);
+	g_cancellable_cancel (batch->cancel);
+	return FALSE;
+}
+
+/* (re)starts the timer that cancels the batch if the helper stops sending
+ * results, however many files are left to read.
+ */
+static void
+load_many_reset_timeout (LoadManyData *batch)
+{
+	if (batch->timeout != NULL) {
+		g_source_destroy (batch->timeout);
+		g_source_unref (batch->timeout);
+	}
+
+	batch->timeout = g_timeout_source_new (RB_METADATA_DBUS_TIMEOUT);
+	g_source_set_callback (batch->timeout, (GSourceFunc) load_many_timeout_cb, batch, NULL);
+	g_source_attach (batch->timeout, batch->context);
+}
+
+static void
+load_many_result_cb (GDBusConnection *connection,
+		     const char *sender_name,
+		     const char *object_path,
+		     const char *interface_name,
+		     const char *signal_name,
+		     GVariant *parameters,
+		     LoadManyData *batch)
+{
+	GVariant *result;
+	GError *error = NULL;
+	guint32 index;
+
+	g_variant_get (parameters, "(u@(asasbbbsbisa{iv}))", &index, &result);
+	if (index >= batch->n_uris || batch->loaded[index]) {
+		rb_debug ("ignoring unexpected metadata result %u", index);
+		g_variant_unref (result);
+		return;
+	}
+
+	read_load_response (batch->md[index], result, &error);
+	g_variant_unref (result);
+
+	if (error == NULL && g_strv_length (batch->md[index]->priv->missing_plugins) > 0)
+		batch->missing_plugins = TRUE;
+
+	batch->loaded[index] = TRUE;
+	batch->callback (batch->md[index], index, error, batch->data);
+
+	if (batch->done == FALSE)
+		load_many_reset_timeout (batch);
+}
+
+static void
+load_many_done_cb (GDBusConnection *connection, GAsyncResult *result, LoadManyData *batch)
+{
+	GVariant *response;
+
+	response = g_dbus_connection_call_finish (connection, result, &batch->error);
+	if (response != NULL)
+		g_variant_unref (response);
+	batch->done = TRUE;
+}
+
+/**
+ * rb_metadata_load_many:
+ * @md: (array length=n_uris): #RBMetaData instances to load metadata into
+ * @uris: (array length=n_uris): URIs from which to load metadata
+ * @n_uris: number of URIs
+ * @callback: (scope call): called with the result for each URI
+ * @data: data to pass to @callback
+ *
+ * Reads metadata information from several URIs using a single request to
+ * a metadata helper.  The helper sends each result back as soon as it has
+ * read it, and @callback is called (in the calling thread) once for each
+ * URI, with the #RBMetaData it was loaded into and the error, if any.
+ * The callback takes ownership of the error.
+ *
+ * Any URIs the helper doesn't return results for, because it crashed or
+ * stopped responding or is too old to support batch requests, are loaded
+ * individually as if by rb_metadata_load.  The helper is considered to have
+ * stopped responding if it doesn't return a result for as long as a single
+ * rb_metadata_load would wait for one, regardless of the size of the batch.
+ *
+ * This returns once @callback has been called for every URI.
+ */
+void
+rb_metadata_load_many (RBMetaData **md,
+		       const char **uris,
+		       guint n_uris,
+		       RBMetaDataLoadCallback callback,
+		       gpointer data)
+{
+	RBMetaDataService *service;
+	LoadManyData batch = {0,};
+	GError *error = NULL;
+	guint i;
+
+	if (n_uris == 0)
+		return;
+
+	batch.md = md;
+	batch.n_uris = n_uris;
+	batch.loaded = g_new0 (gboolean, n_uris);
+	batch.callback = callback;
+	batch.data = data;
+
+	for (i = 0; i < n_uris; i++)
+		rb_metadata_reset (md[i]);
+
+	service = _rb_metadata_acquire_service ();
+
+	if (start_metadata_service (service, &error)) {
+		guint subscription;
+
+		/* the results arrive as signals, which are dispatched in the
+		 * thread-default main context, so we need one of our own.
 		 */
-		if (*error == NULL && g_strv_length (md->priv->missing_plugins) > 0) {
-			rb_debug ("missing plugins; killing metadata service to force registry reload");
-			kill_metadata_service ();
+		batch.context = g_main_context_new ();
+		batch.cancel = g_cancellable_new ();
+		g_main_context_push_thread_default (batch.context);
+
+		subscription = g_dbus_connection_signal_subscribe (service->connection,
+								   NULL,
+								   RB_METADATA_DBUS_INTERFACE,
+								   "loaded",
+								   RB_METADATA_DBUS_OBJECT_PATH,
+								   NULL,
+								   G_DBUS_SIGNAL_FLAGS_NONE,
+								   (GDBusSignalCallback) load_many_result_cb,
+								   &batch,
+								   NULL);
+
+		rb_debug ("sending metadata load request for %u uris", n_uris);
+		g_dbus_connection_call (service->connection,
+					RB_METADATA_DBUS_NAME,
+					RB_METADATA_DBUS_OBJECT_PATH,
+					RB_METADATA_DBUS_INTERFACE,
+					"loadMany",
+					g_variant_new ("(@as)", g_variant_new_strv (uris, n_uris)),
+					G_VARIANT_TYPE ("(u)"),
+					G_DBUS_CALL_FLAGS_NONE,
+					G_MAXINT,
+					batch.cancel,
+					(GAsyncReadyCallback) load_many_done_cb,
+					&batch);
+		load_many_reset_timeout (&batch);
+
+		while (batch.done == FALSE)
+			g_main_context_iteration (batch.context, TRUE);
+
+		g_source_destroy (batch.timeout);
+		g_source_unref (batch.timeout);
+
+		/* results received before the reply may still be queued */
+		while (g_main_context_iteration (batch.context, FALSE))
+			;
+
+		g_dbus_connection_signal_unsubscribe (service->connection, subscription);
+		g_main_context_pop_thread_default (batch.context);
+		g_main_context_unref (batch.context);
+		g_object_unref (batch.cancel);
+
+		if (batch.error != NULL) {
+			if (g_error_matches (batch.error, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD)) {
+				rb_debug ("metadata service doesn't support batch requests");
+			} else if (g_error_matches (batch.error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+				rb_debug ("metadata service stopped responding to the batch request");
+				kill_metadata_service (service);
+			} else {
+				rb_debug ("metadata batch request failed: %s", batch.error->message);
+				kill_metadata_service (service);
+			}
+			g_clear_error (&batch.error);
+		} else if (batch.missing_plugins) {
+			missing_plugins_reload (service);
 		}
+	} else {
+		g_clear_error (&error);
 	}
-	if (fake_error)
-		g_error_free (fake_error);
 
-	g_mutex_unlock (&conn_mutex);
+	_rb_metadata_release_service (service);
+
+	/* load anything the batch didn't return one at a time, so a file
+	 * that crashes the metadata helper only fails itself.
+	 */
+	for (i = 0; i < n_uris; i++) {
+		if (batch.loaded[i])
+			continue;
+
+		rb_metadata_load (md[i], uris[i], &error);
+		callback (md[i], i, error, data);
+		error = NULL;
+	}
+
+	g_free (batch.loaded);
 }
 
 /**
@@ -607,19 +971,25 @@ rb_metadata_set (RBMetaData *md, RBMetaDataField field,
 gboolean
 rb_metadata_can_save (RBMetaData *md, const char *media_type)
 {
+	RBMetaDataService *service;
 	GError *error = NULL;
 	gboolean result = FALSE;
 	int i = 0;
 
-	g_mutex_lock (&conn_mutex);
-
+	g_mutex_lock (&services_mutex);
 	if (saveable_types == NULL) {
-		if (start_metadata_service (&error) == FALSE) {
+		g_mutex_unlock (&services_mutex);
+
+		service = _rb_metadata_acquire_service ();
+		if (start_metadata_service (service, &error) == FALSE) {
 			g_warning ("unable to start metadata service: %s", error->message);
-			g_mutex_unlock (&conn_mutex);
+			_rb_metadata_release_service (service);
 			g_error_free (error);
 			return FALSE;
 		}
+		_rb_metadata_release_service (service);
+
+		g_mutex_lock (&services_mutex);
 	}
 
 	if (saveable_types != NULL) {
@@ -631,7 +1001,7 @@ rb_metadata_can_save (RBMetaData *md, const char *media_type)
 		}
 	}
 
-	g_mutex_unlock (&conn_mutex);
+	g_mutex_unlock (&services_mutex);
 	return result;
 }
 
@@ -648,7 +1018,13 @@ rb_metadata_can_save (RBMetaData *md, const char *media_type)
 char **
 rb_metadata_get_saveable_types (RBMetaData *md)
 {
-	return g_strdupv (saveable_types);
+	char **types;
+
+	g_mutex_lock (&services_mutex);
+	types = g_strdupv (saveable_types);
+	g_mutex_unlock (&services_mutex);
+
+	return types;
 }
 
 /**
@@ -663,18 +1039,19 @@ rb_metadata_get_saveable_types (RBMetaData *md)
 void
 rb_metadata_save (RBMetaData *md, const char *uri, GError **error)
 {
+	RBMetaDataService *service;
 	GVariant *response;
 	GError *fake_error = NULL;
 
 	if (error == NULL)
 		error = &fake_error;
 
-	g_mutex_lock (&conn_mutex);
+	service = _rb_metadata_acquire_service ();
 
-	start_metadata_service (error);
+	start_metadata_service (service, error);
 
 	if (*error == NULL) {
-		response = g_dbus_connection_call_sync (dbus_connection,
+		response = g_dbus_connection_call_sync (service->connection,
 							RB_METADATA_DBUS_NAME,
 							RB_METADATA_DBUS_OBJECT_PATH,
 							RB_METADATA_DBUS_INTERFACE,
@@ -707,7 +1084,46 @@ rb_metadata_save (RBMetaData *md, const char *uri, GError **error)
 	if (fake_error)
 		g_error_free (fake_error);
 
-	g_mutex_unlock (&conn_mutex);
+	_rb_metadata_release_service (service);
+}
+
+/**
+ * rb_metadata_set_max_services:
+ * @max: maximum number of metadata helper processes, or 0
+ *
+ * Sets the maximum number of metadata helper processes that can be
+ * used at once.  Each helper handles one request at a time, so this
+ * limits the number of files that can be read at once.  If @max is
+ * 0, one helper per processor is allowed.
+ */
+void
+rb_metadata_set_max_services (guint max)
+{
+	g_mutex_lock (&services_mutex);
+	max_services = max;
+	/* requests waiting for a helper may be able to start a new one now */
+	g_cond_broadcast (&services_cond);
+	g_mutex_unlock (&services_mutex);
+}
+
+/**
+ * rb_metadata_get_max_services:
+ *
+ * Returns the maximum number of metadata helper processes that can be
+ * used at once.
+ *
+ * Return value: maximum number of helper processes
+ */
+guint
+rb_metadata_get_max_services (void)
+{
+	guint max;
+
+	g_mutex_lock (&services_mutex);
+	max = get_max_services ();
+	g_mutex_unlock (&services_mutex);
+
+	return max;
 }
 
 gboolean
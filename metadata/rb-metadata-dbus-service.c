@@ -56,12 +56,9 @@ typedef struct {
 	gboolean external;
 } ServiceData;
 
-static void
-rb_metadata_dbus_load (GVariant *parameters,
-		       GDBusMethodInvocation *invocation,
-		       ServiceData *svc)
+static GVariant *
+rb_metadata_dbus_load_uri (const char *uri, ServiceData *svc)
 {
-	const char *uri;
 	GError *error = NULL;
 	GVariant *response;
 	const char *nothing[] = { NULL };
@@ -69,8 +66,6 @@ rb_metadata_dbus_load (GVariant *parameters,
 	char **plugin_descriptions = NULL;
 	const char *mediatype;
 
-	g_variant_get (parameters, "(&s)", &uri);
-
 	rb_debug ("loading metadata from %s", uri);
 	rb_metadata_load (svc->metadata, uri, &error);
 	mediatype = rb_metadata_get_media_type (svc->metadata);
@@ -91,8 +86,58 @@ rb_metadata_dbus_load (GVariant *parameters,
 				  rb_metadata_dbus_get_variant_builder (svc->metadata));
 	g_strfreev (missing_plugins);
 	g_strfreev (plugin_descriptions);
+	g_clear_error (&error);
+
+	return response;
+}
+
+static void
+rb_metadata_dbus_load (GVariant *parameters,
+		       GDBusMethodInvocation *invocation,
+		       ServiceData *svc)
+{
+	const char *uri;
+
+	g_variant_get (parameters, "(&s)", &uri);
+	g_dbus_method_invocation_return_value (invocation, rb_metadata_dbus_load_uri (uri, svc));
+}
+
+/*
+ * Loads metadata from several URIs, sending each result back as a
+ * 'loaded' signal as soon as it's available.  The method returns once
+ * all the results have been sent, so the client knows when it's done.
+ */
+static void
+rb_metadata_dbus_load_many (GVariant *parameters,
+			    GDBusMethodInvocation *invocation,
+			    ServiceData *svc)
+{
+	const char **uris;
+	GError *error = NULL;
+	guint32 i;
+
+	g_variant_get (parameters, "(^a&s)", &uris);
+
+	for (i = 0; uris[i] != NULL; i++) {
+		GVariant *result;
+
+		result = rb_metadata_dbus_load_uri (uris[i], svc);
+		g_dbus_connection_emit_signal (g_dbus_method_invocation_get_connection (invocation),
+					       NULL,
+					       RB_METADATA_DBUS_OBJECT_PATH,
+					       RB_METADATA_DBUS_INTERFACE,
+					       "loaded",
+					       g_variant_new ("(u@(asasbbbsbisa{iv}))", i, result),
+					       &error);
+		if (error != NULL) {
+			rb_debug ("unable to send metadata for %s: %s", uris[i], error->message);
+			g_clear_error (&error);
+		}
+		svc->last_active = time (NULL);
+	}
 
-	g_dbus_method_invocation_return_value (invocation, response);
+	g_dbus_method_invocation_return_value (invocation, g_variant_new ("(u)", i));
+	g_free (uris);
 }
 
 static void
@@ -195,6 +240,8 @@ handle_method_call (GDBusConnection *connection,
 		rb_metadata_dbus_ping (parameters, invocation, svc);
 	} else if (g_strcmp0 (method_name, "load") == 0) {
 		rb_metadata_dbus_load (parameters, invocation, svc);
+	} else if (g_strcmp0 (method_name, "loadMany") == 0) {
+		rb_metadata_dbus_load_many (parameters, invocation, svc);
 	} else if (g_strcmp0 (method_name, "getSaveableTypes") == 0) {
 		rb_metadata_dbus_get_saveable_types (parameters, invocation, svc);
 	} else if (g_strcmp0 (method_name, "save") == 0) {
@@ -55,6 +55,14 @@ const char *rb_metadata_iface_xml =
 "      <arg direction='out' type='s' name='errorString'/>	"
 "      <arg direction='out' type='a{iv}' name='metadata'/>	"
 "    </method>							"
+"    <method name='loadMany'>					"
+"      <arg direction='in' type='as' name='uris'/>		"
+"      <arg direction='out' type='u' name='count'/>		"
+"    </method>							"
+"    <signal name='loaded'>					"
+"      <arg type='u' name='index'/>				"
+"      <arg type='(asasbbbsbisa{iv})' name='result'/>		"
+"    </signal>							"
 "    <method name='getSaveableTypes'>				"
 "      <arg direction='out' type='as' name='types'/>		"
 "    </method>							"
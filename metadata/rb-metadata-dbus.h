@@ -50,6 +50,13 @@ extern const char *rb_metadata_iface_xml;
 
 GVariantBuilder *rb_metadata_dbus_get_variant_builder (RBMetaData *md);
 
+/* metadata helper pool used by the client, exposed for the tests */
+typedef struct _RBMetaDataService RBMetaDataService;
+
+RBMetaDataService *	_rb_metadata_acquire_service (void);
+void			_rb_metadata_release_service (RBMetaDataService *service);
+guint			_rb_metadata_get_n_services (void);
+
 G_END_DECLS
 
 #endif /* __RB_METADATA_DBUS_H */
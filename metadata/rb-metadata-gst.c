@@ -38,6 +38,7 @@
 
 #include "rb-metadata.h"
 #include "rb-metadata-gst-common.h"
+#include "rb-metadata-native.h"
 #include "rb-gst-media-types.h"
 #include "rb-debug.h"
 #include "rb-file-helpers.h"
@@ -57,6 +58,11 @@ struct RBMetaDataPrivate
 {
 	GstDiscovererInfo *info;
 
+	/* set instead of info when the file was read without gstreamer */
+	GstTagList *native_tags;
+	GstClockTime native_duration;
+	GHashTable *decodable_types;
+
 	char *mediatype;
 	gboolean has_audio;
 	gboolean has_non_audio;
@@ -84,12 +90,18 @@ rb_metadata_reset (RBMetaData *md)
 		gst_discoverer_info_unref (md->priv->info);
 		md->priv->info = NULL;
 	}
+	if (md->priv->native_tags != NULL) {
+		gst_tag_list_unref (md->priv->native_tags);
+		md->priv->native_tags = NULL;
+	}
+	md->priv->native_duration = 0;
 	g_free (md->priv->mediatype);
 	md->priv->mediatype = NULL;
 
 	md->priv->has_audio = FALSE;
 	md->priv->has_non_audio = FALSE;
 	md->priv->has_video = FALSE;
+	md->priv->audio_bitrate = 0;
 }
 
 static void
@@ -161,6 +173,64 @@ run_typefind (RBMetaData *md, const char *uri)
 	}
 }
 
+static gboolean
+can_decode_media_type (RBMetaData *md, const char *media_type)
+{
+	GList *factories;
+	GList *decoders;
+	GstCaps *caps;
+	gpointer result;
+
+	if (g_hash_table_lookup_extended (md->priv->decodable_types, media_type, NULL, &result))
+		return GPOINTER_TO_INT (result);
+
+	caps = rb_gst_media_type_to_caps (media_type);
+	factories = gst_element_factory_list_get_elements (GST_ELEMENT_FACTORY_TYPE_DECODER |
+							   GST_ELEMENT_FACTORY_TYPE_MEDIA_AUDIO,
+							   GST_RANK_MARGINAL);
+	decoders = gst_element_factory_list_filter (factories, caps, GST_PAD_SINK, FALSE);
+	result = GINT_TO_POINTER (decoders != NULL);
+	rb_debug ("%s decoder for %s", decoders ? "found" : "no", media_type);
+
+	gst_plugin_feature_list_free (decoders);
+	gst_plugin_feature_list_free (factories);
+	gst_caps_unref (caps);
+
+	g_hash_table_insert (md->priv->decodable_types, g_strdup (media_type), result);
+	return GPOINTER_TO_INT (result);
+}
+
+static gboolean
+load_native (RBMetaData *md, const char *uri)
+{
+	RBMetaDataNativeInfo info;
+
+	if (rb_metadata_native_load (uri, &info) == FALSE)
+		return FALSE;
+
+	/* if we can't play it, let the discoverer report the missing plugins */
+	if (can_decode_media_type (md, info.media_type) == FALSE) {
+		rb_metadata_native_info_clear (&info);
+		return FALSE;
+	}
+
+	md->priv->mediatype = info.media_type;
+	md->priv->native_tags = info.tags;
+	md->priv->native_duration = info.duration;
+	md->priv->audio_bitrate = info.bitrate;
+	md->priv->has_audio = TRUE;
+	return TRUE;
+}
+
+static const GstTagList *
+get_tags (RBMetaData *md)
+{
+	if (md->priv->native_tags != NULL)
+		return md->priv->native_tags;
+
+	return gst_discoverer_info_get_tags (md->priv->info);
+}
+
 void
 rb_metadata_load (RBMetaData *md, const char *uri, GError **error)
 {
@@ -172,6 +242,10 @@ rb_metadata_load (RBMetaData *md, const char *uri, GError **error)
 
 	rb_metadata_reset (md);
 
+	/* most files can be read without setting up a pipeline */
+	if (load_native (md, uri))
+		return;
+
 	discoverer = gst_discoverer_new (30 * GST_SECOND, error);
 	if (*error != NULL)
 		return;
@@ -838,13 +912,16 @@ rb_metadata_get (RBMetaData *md, RBMetaDataField field, GValue *ret)
 	const char *v;
 	int i;
 
-	if (md->priv->info == NULL)
+	if (md->priv->info == NULL && md->priv->native_tags == NULL)
 		return FALSE;
 
 	/* special cases: mostly duration */
 	switch (field) {
 	case RB_METADATA_FIELD_DURATION:
-		duration = gst_discoverer_info_get_duration (md->priv->info);
+		if (md->priv->native_tags != NULL)
+			duration = md->priv->native_duration;
+		else
+			duration = gst_discoverer_info_get_duration (md->priv->info);
 		if (duration != 0) {
 			g_value_init (ret, G_TYPE_ULONG);
 			g_value_set_ulong (ret, duration / (1000 * 1000 * 1000));
@@ -866,7 +943,7 @@ rb_metadata_get (RBMetaData *md, RBMetaDataField field, GValue *ret)
 		break;
 
 	case RB_METADATA_FIELD_DATE:
-		tags = gst_discoverer_info_get_tags (md->priv->info);
+		tags = get_tags (md);
 		if (tags == NULL)
 			return FALSE;
 
@@ -895,7 +972,7 @@ rb_metadata_get (RBMetaData *md, RBMetaDataField field, GValue *ret)
 			return FALSE;
 		}
 	case RB_METADATA_FIELD_COMMENT:
-		tags = gst_discoverer_info_get_tags (md->priv->info);
+		tags = get_tags (md);
 		if (tags == NULL)
 			return FALSE;
 
@@ -929,7 +1006,7 @@ rb_metadata_get (RBMetaData *md, RBMetaDataField field, GValue *ret)
 		break;
 	}
 
-	tags = gst_discoverer_info_get_tags (md->priv->info);
+	tags = get_tags (md);
 	if (tags == NULL) {
 		return FALSE;
 	}
@@ -1047,6 +1124,7 @@ rb_metadata_finalize (GObject *object)
 	RBMetaData *md;
 	md = RB_METADATA (object);
 	rb_metadata_reset (md);
+	g_hash_table_destroy (md->priv->decodable_types);
 
 	G_OBJECT_CLASS (rb_metadata_parent_class)->finalize (object);
 }
@@ -1057,6 +1135,7 @@ rb_metadata_init (RBMetaData *md)
 	md->priv = (G_TYPE_INSTANCE_GET_PRIVATE ((md), RB_TYPE_METADATA, RBMetaDataPrivate));
 
 	md->priv->taggers = g_hash_table_new (g_str_hash, g_str_equal);
+	md->priv->decodable_types = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
 	if (gst_element_factory_find ("giostreamsink") == FALSE) {
 		rb_debug ("giostreamsink not found, can't tag anything");
@@ -0,0 +1,1017 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Reads tags and stream information from the most common audio file
+ * formats (MP3, FLAC, Ogg Vorbis and Opus, and MP4 audio) without
+ * building a GStreamer pipeline.  Only the headers are read, and the
+ * tag payloads are handed to the GStreamer tag library so the results
+ * match what the demuxers would produce.
+ *
+ * Anything that doesn't look exactly like what we expect is left for
+ * GstDiscoverer to deal with.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <gst/gst.h>
+#include <gst/tag/tag.h>
+
+#include "rb-metadata-native.h"
+#include "rb-debug.h"
+
+/* largest tag we'll read into memory */
+#define NATIVE_MAX_TAG_SIZE	(32 * 1024 * 1024)
+
+/* how far into the audio data to look for the first mp3 frame */
+#define NATIVE_MP3_SYNC_WINDOW	(8192)
+
+/* how far from the end of an ogg file to look for the last page */
+#define NATIVE_OGG_TAIL_SIZE	(128 * 1024)
+
+/* largest mp4 metadata item we'll look at (skipping cover art) */
+#define NATIVE_MP4_MAX_ITEM_SIZE (64 * 1024)
+
+#define NATIVE_MP4_MAX_DEPTH	(8)
+
+#define MP4_TYPE(a,b,c,d)	(((guint32)(guint8)(a) << 24) | ((guint32)(guint8)(b) << 16) | \
+				 ((guint32)(guint8)(c) << 8) | (guint32)(guint8)(d))
+
+typedef struct {
+	FILE *fp;
+	goffset size;
+} NativeFile;
+
+static gboolean
+native_read (NativeFile *file, goffset offset, gpointer data, gsize length)
+{
+	if (offset < 0 || offset > file->size || length > file->size - offset)
+		return FALSE;
+
+	if (fseeko (file->fp, offset, SEEK_SET) != 0)
+		return FALSE;
+
+	return (fread (data, 1, length, file->fp) == length);
+}
+
+static guint8 *
+native_read_alloc (NativeFile *file, goffset offset, gsize length)
+{
+	guint8 *data;
+
+	if (length == 0 || length > NATIVE_MAX_TAG_SIZE)
+		return NULL;
+
+	data = g_malloc (length);
+	if (native_read (file, offset, data, length) == FALSE) {
+		g_free (data);
+		return NULL;
+	}
+	return data;
+}
+
+/* ID3v2 */
+
+static gboolean
+read_id3v2_tag (NativeFile *file, goffset *audio_start, GstTagList **tags)
+{
+	guint8 header[10];
+	guint8 *data;
+	GstBuffer *buffer;
+	gsize size;
+
+	*audio_start = 0;
+	*tags = NULL;
+	if (native_read (file, 0, header, sizeof (header)) == FALSE ||
+	    memcmp (header, "ID3", 3) != 0)
+		return TRUE;
+
+	/* the size is a 'syncsafe' integer, 7 bits per byte */
+	if ((header[6] | header[7] | header[8] | header[9]) & 0x80)
+		return FALSE;
+
+	size = ((header[6] << 21) | (header[7] << 14) | (header[8] << 7) | header[9]) + sizeof (header);
+	if (header[5] & 0x10)
+		size += 10;		/* footer */
+
+	data = native_read_alloc (file, 0, size);
+	if (data == NULL)
+		return FALSE;
+
+	buffer = gst_buffer_new_wrapped (data, size);
+	*tags = gst_tag_list_from_id3v2_tag (buffer);
+	gst_buffer_unref (buffer);
+
+	*audio_start = size;
+	return TRUE;
+}
+
+/* MP3 */
+
+typedef struct {
+	gboolean mpeg1;
+	gboolean mono;
+	guint bitrate;		/* kbps */
+	guint rate;
+	guint samples;
+	guint length;
+} MPEGFrame;
+
+static gboolean
+parse_mpeg_frame (const guint8 *data, MPEGFrame *frame)
+{
+	static const guint bitrates[2][16] = {
+		{ 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0 },
+		{ 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0 }
+	};
+	static const guint rates[3][3] = {
+		{ 44100, 48000, 32000 },
+		{ 22050, 24000, 16000 },
+		{ 11025, 12000, 8000 }
+	};
+	guint32 header;
+	guint version;
+	guint bitrate_index;
+	guint rate_index;
+
+	header = GST_READ_UINT32_BE (data);
+	if ((header & 0xffe00000) != 0xffe00000)
+		return FALSE;
+
+	/* 3 is mpeg 1, 2 is mpeg 2, 0 is mpeg 2.5; we only handle layer 3 */
+	version = (header >> 19) & 3;
+	if (version == 1 || ((header >> 17) & 3) != 1)
+		return FALSE;
+
+	bitrate_index = (header >> 12) & 0xf;
+	rate_index = (header >> 10) & 3;
+	if (bitrate_index == 0 || bitrate_index == 15 || rate_index == 3)
+		return FALSE;
+
+	frame->mpeg1 = (version == 3);
+	frame->mono = (((header >> 6) & 3) == 3);
+	frame->bitrate = bitrates[frame->mpeg1 ? 0 : 1][bitrate_index];
+	frame->rate = rates[version == 3 ? 0 : (version == 2 ? 1 : 2)][rate_index];
+	frame->samples = frame->mpeg1 ? 1152 : 576;
+	frame->length = ((frame->samples / 8) * frame->bitrate * 1000) / frame->rate + ((header >> 9) & 1);
+	return TRUE;
+}
+
+static gboolean
+load_mp3 (NativeFile *file, goffset audio_start, RBMetaDataNativeInfo *info)
+{
+	guint8 window[NATIVE_MP3_SYNC_WINDOW];
+	guint8 trailer[128];
+	gsize window_size;
+	gsize search;
+	gsize i;
+	gsize side_info;
+	gboolean found = FALSE;
+	MPEGFrame frame;
+	goffset audio_end;
+	goffset first_frame;
+	guint64 frames = 0;
+	guint64 bytes = 0;
+
+	if (file->size - audio_start < 4)
+		return FALSE;
+	window_size = MIN (sizeof (window), file->size - audio_start);
+	if (native_read (file, audio_start, window, window_size) == FALSE)
+		return FALSE;
+
+	/* if there's no id3v2 tag, the file must start with a frame,
+	 * otherwise we'd be guessing whether random data is mp3.
+	 * after a tag, there may be some padding before the first frame.
+	 */
+	search = (audio_start > 0) ? window_size - 4 : 0;
+	for (i = 0; i <= search; i++) {
+		MPEGFrame next;
+
+		if (parse_mpeg_frame (window + i, &frame) == FALSE)
+			continue;
+
+		/* make sure the next frame is where it should be */
+		if (i + frame.length + 4 > window_size)
+			break;
+		if (parse_mpeg_frame (window + i + frame.length, &next) &&
+		    next.mpeg1 == frame.mpeg1 &&
+		    next.rate == frame.rate) {
+			found = TRUE;
+			break;
+		}
+	}
+	if (found == FALSE)
+		return FALSE;
+
+	first_frame = audio_start + i;
+
+	/* VBR files have a Xing (or Info) header in the first frame,
+	 * after the side information, or a VBRI header at a fixed offset.
+	 */
+	side_info = frame.mpeg1 ? (frame.mono ? 17 : 32) : (frame.mono ? 9 : 17);
+	if (i + 4 + side_info + 16 <= window_size &&
+	    (memcmp (window + i + 4 + side_info, "Xing", 4) == 0 ||
+	     memcmp (window + i + 4 + side_info, "Info", 4) == 0)) {
+		const guint8 *xing = window + i + 4 + side_info;
+		guint32 flags;
+
+		flags = GST_READ_UINT32_BE (xing + 4);
+		xing += 8;
+		if (flags & 0x1) {
+			frames = GST_READ_UINT32_BE (xing);
+			xing += 4;
+		}
+		if (flags & 0x2)
+			bytes = GST_READ_UINT32_BE (xing);
+	} else if (i + 36 + 18 <= window_size &&
+		   memcmp (window + i + 36, "VBRI", 4) == 0) {
+		bytes = GST_READ_UINT32_BE (window + i + 36 + 10);
+		frames = GST_READ_UINT32_BE (window + i + 36 + 14);
+	}
+
+	/* id3v1 tags at the end are still fairly common; APE tags aren't,
+	 * so let the demuxers deal with those.
+	 */
+	audio_end = file->size;
+	if (audio_end - first_frame >= 128 &&
+	    native_read (file, audio_end - 128, trailer, 128) &&
+	    memcmp (trailer, "TAG", 3) == 0) {
+		info->tags = gst_tag_list_new_from_id3v1 (trailer);
+		audio_end -= 128;
+	}
+	if (audio_end - first_frame >= 32 &&
+	    native_read (file, audio_end - 32, trailer, 8) &&
+	    memcmp (trailer, "APETAGEX", 8) == 0) {
+		rb_debug ("found APE tag, not handling this file");
+		return FALSE;
+	}
+
+	if (frames > 0) {
+		info->duration = gst_util_uint64_scale (frames * frame.samples, GST_SECOND, frame.rate);
+		if (bytes == 0)
+			bytes = audio_end - first_frame;
+		if (info->duration > 0)
+			info->bitrate = gst_util_uint64_scale (bytes, 8 * GST_SECOND, info->duration);
+	} else {
+		info->bitrate = frame.bitrate * 1000;
+		info->duration = gst_util_uint64_scale (audio_end - first_frame, 8 * GST_SECOND, info->bitrate);
+	}
+
+	info->media_type = g_strdup ("audio/mpeg");
+	return TRUE;
+}
+
+/* FLAC */
+
+static gboolean
+load_flac (NativeFile *file, goffset offset, RBMetaDataNativeInfo *info)
+{
+	guint8 header[4];
+	guint8 streaminfo[34];
+	guint64 total_samples = 0;
+	guint rate = 0;
+	gboolean last = FALSE;
+
+	if (native_read (file, offset, header, sizeof (header)) == FALSE ||
+	    memcmp (header, "fLaC", 4) != 0)
+		return FALSE;
+	offset += sizeof (header);
+
+	while (last == FALSE) {
+		guint8 *data;
+		gsize length;
+
+		if (native_read (file, offset, header, sizeof (header)) == FALSE)
+			return FALSE;
+
+		last = (header[0] & 0x80) != 0;
+		length = GST_READ_UINT24_BE (header + 1);
+		offset += sizeof (header);
+
+		switch (header[0] & 0x7f) {
+		case 0:		/* STREAMINFO */
+			if (length < sizeof (streaminfo) ||
+			    native_read (file, offset, streaminfo, sizeof (streaminfo)) == FALSE)
+				return FALSE;
+
+			rate = (streaminfo[10] << 12) | (streaminfo[11] << 4) | (streaminfo[12] >> 4);
+			total_samples = ((guint64) (streaminfo[13] & 0x0f) << 32) | GST_READ_UINT32_BE (streaminfo + 14);
+			break;
+
+		case 4:		/* VORBIS_COMMENT */
+			if (info->tags != NULL || length == 0)
+				break;
+
+			data = native_read_alloc (file, offset, length);
+			if (data == NULL)
+				return FALSE;
+			info->tags = gst_tag_list_from_vorbiscomment (data, length, NULL, 0, NULL);
+			g_free (data);
+			break;
+
+		case 127:	/* invalid */
+			return FALSE;
+
+		default:
+			break;
+		}
+		offset += length;
+	}
+
+	if (rate == 0 || total_samples == 0)
+		return FALSE;
+
+	info->media_type = g_strdup ("audio/x-flac");
+	info->duration = gst_util_uint64_scale (total_samples, GST_SECOND, rate);
+	if (offset < file->size)
+		info->bitrate = gst_util_uint64_scale (file->size - offset, 8 * GST_SECOND, info->duration);
+	return TRUE;
+}
+
+/* Ogg */
+
+typedef struct {
+	NativeFile *file;
+	goffset offset;
+	guint pages;
+	guint32 serial;
+
+	guint8 segments[255];
+	guint n_segments;
+	guint segment;
+	guint8 *data;
+	gsize data_pos;
+} OggReader;
+
+static gboolean
+ogg_read_page (OggReader *reader)
+{
+	guint8 header[27];
+	gsize length = 0;
+	guint32 serial;
+	guint i;
+
+	if (native_read (reader->file, reader->offset, header, sizeof (header)) == FALSE ||
+	    memcmp (header, "OggS", 4) != 0 ||
+	    header[4] != 0)
+		return FALSE;
+
+	/* we only handle files with a single logical stream */
+	serial = GST_READ_UINT32_LE (header + 14);
+	if (reader->pages == 0)
+		reader->serial = serial;
+	else if (serial != reader->serial)
+		return FALSE;
+
+	reader->n_segments = header[26];
+	if (native_read (reader->file, reader->offset + sizeof (header), reader->segments, reader->n_segments) == FALSE)
+		return FALSE;
+
+	for (i = 0; i < reader->n_segments; i++)
+		length += reader->segments[i];
+
+	g_free (reader->data);
+	reader->data = g_malloc (length + 1);
+	if (native_read (reader->file, reader->offset + sizeof (header) + reader->n_segments, reader->data, length) == FALSE)
+		return FALSE;
+
+	reader->offset += sizeof (header) + reader->n_segments + length;
+	reader->pages++;
+	reader->segment = 0;
+	reader->data_pos = 0;
+	return TRUE;
+}
+
+static GByteArray *
+ogg_read_packet (OggReader *reader)
+{
+	GByteArray *packet;
+
+	packet = g_byte_array_new ();
+	while (TRUE) {
+		while (reader->segment < reader->n_segments) {
+			guint length = reader->segments[reader->segment++];
+
+			g_byte_array_append (packet, reader->data + reader->data_pos, length);
+			reader->data_pos += length;
+			if (length < 255)
+				return packet;
+		}
+
+		if (packet->len > NATIVE_MAX_TAG_SIZE || ogg_read_page (reader) == FALSE) {
+			g_byte_array_unref (packet);
+			return NULL;
+		}
+	}
+}
+
+static gint64
+ogg_last_granule (NativeFile *file, guint32 serial)
+{
+	guint8 *tail;
+	gsize length;
+	gint64 granule = -1;
+	gsize i;
+
+	length = MIN (file->size, NATIVE_OGG_TAIL_SIZE);
+	if (length < 27)
+		return -1;
+
+	tail = native_read_alloc (file, file->size - length, length);
+	if (tail == NULL)
+		return -1;
+
+	for (i = length - 27 + 1; i > 0; i--) {
+		const guint8 *page = tail + i - 1;
+
+		if (memcmp (page, "OggS", 4) == 0 &&
+		    page[4] == 0 &&
+		    GST_READ_UINT32_LE (page + 14) == serial) {
+			granule = GST_READ_UINT64_LE (page + 6);
+			if (granule != -1)
+				break;
+		}
+	}
+
+	g_free (tail);
+	return granule;
+}
+
+static gboolean
+load_ogg (NativeFile *file, RBMetaDataNativeInfo *info)
+{
+	OggReader reader = {0,};
+	GByteArray *id = NULL;
+	GByteArray *comments = NULL;
+	gboolean ret = FALSE;
+	gint64 granule;
+	guint64 pre_skip = 0;
+	guint rate = 0;
+	gint32 nominal_bitrate = 0;
+
+	reader.file = file;
+	id = ogg_read_packet (&reader);
+	if (id != NULL)
+		comments = ogg_read_packet (&reader);
+	if (comments == NULL)
+		goto out;
+
+	if (id->len >= 30 && memcmp (id->data, "\001vorbis", 7) == 0) {
+		if (comments->len < 7 || memcmp (comments->data, "\003vorbis", 7) != 0)
+			goto out;
+
+		rate = GST_READ_UINT32_LE (id->data + 12);
+		nominal_bitrate = GST_READ_UINT32_LE (id->data + 20);
+		info->tags = gst_tag_list_from_vorbiscomment (comments->data, comments->len,
+							       (const guint8 *) "\003vorbis", 7, NULL);
+		info->media_type = g_strdup ("audio/x-vorbis");
+	} else if (id->len >= 19 && memcmp (id->data, "OpusHead", 8) == 0) {
+		if (comments->len < 8 || memcmp (comments->data, "OpusTags", 8) != 0)
+			goto out;
+
+		/* opus granule positions are always at 48kHz */
+		rate = 48000;
+		pre_skip = GST_READ_UINT16_LE (id->data + 10);
+		info->tags = gst_tag_list_from_vorbiscomment (comments->data, comments->len,
+							       (const guint8 *) "OpusTags", 8, NULL);
+		info->media_type = g_strdup ("audio/x-opus");
+	} else {
+		goto out;
+	}
+
+	granule = ogg_last_granule (file, reader.serial);
+	if (rate == 0 || granule <= (gint64) pre_skip)
+		goto out;
+
+	info->duration = gst_util_uint64_scale (granule - pre_skip, GST_SECOND, rate);
+	if (nominal_bitrate > 0)
+		info->bitrate = nominal_bitrate;
+	else if (info->duration > 0)
+		info->bitrate = gst_util_uint64_scale (file->size, 8 * GST_SECOND, info->duration);
+	ret = TRUE;
+out:
+	if (id != NULL)
+		g_byte_array_unref (id);
+	if (comments != NULL)
+		g_byte_array_unref (comments);
+	g_free (reader.data);
+	return ret;
+}
+
+/* MP4 */
+
+typedef struct {
+	NativeFile *file;
+	GstTagList *tags;
+
+	/* the track being parsed */
+	guint32 handler;
+	guint32 codec;
+	guint32 timescale;
+	guint64 duration;
+
+	/* the first audio track */
+	guint32 audio_codec;
+	guint32 audio_timescale;
+	guint64 audio_duration;
+
+	guint32 movie_timescale;
+	guint64 movie_duration;
+	guint64 media_size;
+	gboolean has_video;
+} MP4Parser;
+
+static const struct {
+	guint32 type;
+	const char *tag;
+} mp4_string_items[] = {
+	{ MP4_TYPE ('\251', 'n', 'a', 'm'), GST_TAG_TITLE },
+	{ MP4_TYPE ('\251', 'A', 'R', 'T'), GST_TAG_ARTIST },
+	{ MP4_TYPE ('a', 'A', 'R', 'T'), GST_TAG_ALBUM_ARTIST },
+	{ MP4_TYPE ('\251', 'a', 'l', 'b'), GST_TAG_ALBUM },
+	{ MP4_TYPE ('\251', 'w', 'r', 't'), GST_TAG_COMPOSER },
+	{ MP4_TYPE ('\251', 'g', 'e', 'n'), GST_TAG_GENRE },
+	{ MP4_TYPE ('\251', 'c', 'm', 't'), GST_TAG_COMMENT },
+	{ MP4_TYPE ('c', 'p', 'r', 't'), GST_TAG_COPYRIGHT },
+	{ MP4_TYPE ('s', 'o', 'n', 'm'), GST_TAG_TITLE_SORTNAME },
+	{ MP4_TYPE ('s', 'o', 'a', 'r'), GST_TAG_ARTIST_SORTNAME },
+	{ MP4_TYPE ('s', 'o', 'a', 'a'), GST_TAG_ALBUM_ARTIST_SORTNAME },
+	{ MP4_TYPE ('s', 'o', 'a', 'l'), GST_TAG_ALBUM_SORTNAME },
+	{ MP4_TYPE ('s', 'o', 'c', 'o'), GST_TAG_COMPOSER_SORTNAME },
+};
+
+static const struct {
+	const char *name;
+	const char *tag;
+} mp4_freeform_items[] = {
+	{ "MusicBrainz Track Id", GST_TAG_MUSICBRAINZ_TRACKID },
+	{ "MusicBrainz Artist Id", GST_TAG_MUSICBRAINZ_ARTISTID },
+	{ "MusicBrainz Album Id", GST_TAG_MUSICBRAINZ_ALBUMID },
+	{ "MusicBrainz Album Artist Id", GST_TAG_MUSICBRAINZ_ALBUMARTISTID },
+	{ "replaygain_track_gain", GST_TAG_TRACK_GAIN },
+	{ "replaygain_track_peak", GST_TAG_TRACK_PEAK },
+	{ "replaygain_album_gain", GST_TAG_ALBUM_GAIN },
+	{ "replaygain_album_peak", GST_TAG_ALBUM_PEAK },
+};
+
+static gboolean
+mp4_box_header (NativeFile *file, goffset offset, goffset end, guint32 *type, goffset *size, guint *header_size)
+{
+	guint8 header[16];
+	guint64 box_size;
+
+	if (end - offset < 8 || native_read (file, offset, header, 8) == FALSE)
+		return FALSE;
+
+	box_size = GST_READ_UINT32_BE (header);
+	*type = GST_READ_UINT32_BE (header + 4);
+	*header_size = 8;
+	if (box_size == 1) {
+		if (end - offset < 16 || native_read (file, offset + 8, header + 8, 8) == FALSE)
+			return FALSE;
+		box_size = GST_READ_UINT64_BE (header + 8);
+		*header_size = 16;
+	} else if (box_size == 0) {
+		/* extends to the end of the file */
+		box_size = end - offset;
+	}
+
+	if (box_size < *header_size || box_size > end - offset)
+		return FALSE;
+
+	*size = box_size;
+	return TRUE;
+}
+
+static void
+mp4_add_item_value (MP4Parser *parser, guint32 type, const char *name, guint32 data_class, const guint8 *value, gsize length)
+{
+	GstDateTime *datetime;
+	char *str;
+	guint number;
+	guint count;
+	guint i;
+
+	switch (type) {
+	case MP4_TYPE ('t', 'r', 'k', 'n'):
+	case MP4_TYPE ('d', 'i', 's', 'k'):
+		if (length < 6)
+			break;
+
+		number = GST_READ_UINT16_BE (value + 2);
+		count = GST_READ_UINT16_BE (value + 4);
+		if (number > 0) {
+			gst_tag_list_add (parser->tags, GST_TAG_MERGE_APPEND,
+					  (type == MP4_TYPE ('t', 'r', 'k', 'n')) ? GST_TAG_TRACK_NUMBER : GST_TAG_ALBUM_VOLUME_NUMBER,
+					  number, NULL);
+		}
+		if (count > 0) {
+			gst_tag_list_add (parser->tags, GST_TAG_MERGE_APPEND,
+					  (type == MP4_TYPE ('t', 'r', 'k', 'n')) ? GST_TAG_TRACK_COUNT : GST_TAG_ALBUM_VOLUME_COUNT,
+					  count, NULL);
+		}
+		return;
+
+	case MP4_TYPE ('g', 'n', 'r', 'e'):
+		/* id3v1 genre number, plus one */
+		if (length >= 2 && GST_READ_UINT16_BE (value) > 0) {
+			const char *genre;
+
+			genre = gst_tag_id3_genre_get (GST_READ_UINT16_BE (value) - 1);
+			if (genre != NULL)
+				gst_tag_list_add (parser->tags, GST_TAG_MERGE_APPEND, GST_TAG_GENRE, genre, NULL);
+		}
+		return;
+
+	case MP4_TYPE ('t', 'm', 'p', 'o'):
+		if (length >= 2 && GST_READ_UINT16_BE (value) > 0) {
+			gst_tag_list_add (parser->tags, GST_TAG_MERGE_APPEND, GST_TAG_BEATS_PER_MINUTE,
+					  (double) GST_READ_UINT16_BE (value), NULL);
+		}
+		return;
+
+	default:
+		break;
+	}
+
+	/* everything else is a utf-8 string */
+	if (data_class != 1 || length == 0)
+		return;
+
+	str = g_strndup ((const char *) value, length);
+	if (g_utf8_validate (str, -1, NULL) == FALSE) {
+		g_free (str);
+		return;
+	}
+
+	if (type == MP4_TYPE ('\251', 'd', 'a', 'y')) {
+		datetime = gst_date_time_new_from_iso8601_string (str);
+		if (datetime != NULL) {
+			gst_tag_list_add (parser->tags, GST_TAG_MERGE_APPEND, GST_TAG_DATE_TIME, datetime, NULL);
+			gst_date_time_unref (datetime);
+		}
+	} else if (type == MP4_TYPE ('-', '-', '-', '-')) {
+		for (i = 0; name != NULL && i < G_N_ELEMENTS (mp4_freeform_items); i++) {
+			if (g_ascii_strcasecmp (name, mp4_freeform_items[i].name) != 0)
+				continue;
+
+			if (gst_tag_get_type (mp4_freeform_items[i].tag) == G_TYPE_DOUBLE) {
+				gst_tag_list_add (parser->tags, GST_TAG_MERGE_APPEND, mp4_freeform_items[i].tag,
+						  g_ascii_strtod (str, NULL), NULL);
+			} else {
+				gst_tag_list_add (parser->tags, GST_TAG_MERGE_APPEND, mp4_freeform_items[i].tag,
+						  str, NULL);
+			}
+			break;
+		}
+	} else {
+		for (i = 0; i < G_N_ELEMENTS (mp4_string_items); i++) {
+			if (mp4_string_items[i].type == type) {
+				gst_tag_list_add (parser->tags, GST_TAG_MERGE_APPEND, mp4_string_items[i].tag, str, NULL);
+				break;
+			}
+		}
+	}
+	g_free (str);
+}
+
+static void
+mp4_parse_item (MP4Parser *parser, guint32 type, const guint8 *data, gsize length)
+{
+	char *name = NULL;
+	gsize pos = 0;
+
+	/* items contain a 'data' box, and freeform items also have 'mean' and 'name' */
+	while (pos + 8 <= length) {
+		guint32 size = GST_READ_UINT32_BE (data + pos);
+		guint32 child = GST_READ_UINT32_BE (data + pos + 4);
+
+		if (size < 8 || size > length - pos)
+			break;
+
+		if (child == MP4_TYPE ('n', 'a', 'm', 'e') && size > 12 && name == NULL) {
+			name = g_strndup ((const char *) data + pos + 12, size - 12);
+		} else if (child == MP4_TYPE ('d', 'a', 't', 'a') && size >= 16) {
+			mp4_add_item_value (parser, type, name,
+					    GST_READ_UINT32_BE (data + pos + 8) & 0xffffff,
+					    data + pos + 16, size - 16);
+		}
+		pos += size;
+	}
+
+	g_free (name);
+}
+
+static gboolean
+mp4_parse_ilst (MP4Parser *parser, goffset offset, goffset end)
+{
+	while (offset < end) {
+		guint32 type;
+		goffset size;
+		guint header_size;
+		guint8 *data;
+
+		if (mp4_box_header (parser->file, offset, end, &type, &size, &header_size) == FALSE)
+			return FALSE;
+
+		if (type != MP4_TYPE ('c', 'o', 'v', 'r') &&
+		    size > header_size &&
+		    size - header_size <= NATIVE_MP4_MAX_ITEM_SIZE) {
+			data = native_read_alloc (parser->file, offset + header_size, size - header_size);
+			if (data == NULL)
+				return FALSE;
+			mp4_parse_item (parser, type, data, size - header_size);
+			g_free (data);
+		}
+		offset += size;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+mp4_parse_boxes (MP4Parser *parser, goffset offset, goffset end, int depth)
+{
+	if (depth > NATIVE_MP4_MAX_DEPTH)
+		return FALSE;
+
+	while (offset < end) {
+		guint8 data[32];
+		guint32 type;
+		goffset size;
+		goffset start;
+		guint header_size;
+		gsize length;
+
+		if (mp4_box_header (parser->file, offset, end, &type, &size, &header_size) == FALSE)
+			return FALSE;
+
+		start = offset + header_size;
+		length = MIN (size - header_size, sizeof (data));
+
+		switch (type) {
+		case MP4_TYPE ('m', 'o', 'o', 'v'):
+		case MP4_TYPE ('u', 'd', 't', 'a'):
+		case MP4_TYPE ('m', 'd', 'i', 'a'):
+		case MP4_TYPE ('m', 'i', 'n', 'f'):
+		case MP4_TYPE ('s', 't', 'b', 'l'):
+			if (mp4_parse_boxes (parser, start, offset + size, depth + 1) == FALSE)
+				return FALSE;
+			break;
+
+		case MP4_TYPE ('t', 'r', 'a', 'k'):
+			parser->handler = 0;
+			parser->codec = 0;
+			parser->timescale = 0;
+			parser->duration = 0;
+			if (mp4_parse_boxes (parser, start, offset + size, depth + 1) == FALSE)
+				return FALSE;
+
+			if (parser->handler == MP4_TYPE ('s', 'o', 'u', 'n') && parser->audio_codec == 0) {
+				parser->audio_codec = parser->codec;
+				parser->audio_timescale = parser->timescale;
+				parser->audio_duration = parser->duration;
+			} else if (parser->handler == MP4_TYPE ('v', 'i', 'd', 'e')) {
+				parser->has_video = TRUE;
+			}
+			break;
+
+		case MP4_TYPE ('m', 'e', 't', 'a'):
+			/* itunes writes this as a full box, quicktime doesn't */
+			if (length < 4 || native_read (parser->file, start, data, 4) == FALSE)
+				return FALSE;
+			if (GST_READ_UINT32_BE (data) == 0)
+				start += 4;
+			if (mp4_parse_boxes (parser, start, offset + size, depth + 1) == FALSE)
+				return FALSE;
+			break;
+
+		case MP4_TYPE ('i', 'l', 's', 't'):
+			if (mp4_parse_ilst (parser, start, offset + size) == FALSE)
+				return FALSE;
+			break;
+
+		case MP4_TYPE ('m', 'v', 'h', 'd'):
+		case MP4_TYPE ('m', 'd', 'h', 'd'):
+			if (length < 20 || native_read (parser->file, start, data, length) == FALSE)
+				return FALSE;
+
+			if (data[0] == 1) {
+				if (length < 32)
+					return FALSE;
+				parser->timescale = GST_READ_UINT32_BE (data + 20);
+				parser->duration = GST_READ_UINT64_BE (data + 24);
+			} else {
+				parser->timescale = GST_READ_UINT32_BE (data + 12);
+				parser->duration = GST_READ_UINT32_BE (data + 16);
+			}
+
+			if (type == MP4_TYPE ('m', 'v', 'h', 'd')) {
+				parser->movie_timescale = parser->timescale;
+				parser->movie_duration = parser->duration;
+			}
+			break;
+
+		case MP4_TYPE ('h', 'd', 'l', 'r'):
+			if (length < 12 || native_read (parser->file, start, data, 12) == FALSE)
+				return FALSE;
+			parser->handler = GST_READ_UINT32_BE (data + 8);
+			break;
+
+		case MP4_TYPE ('s', 't', 's', 'd'):
+			/* the codec is the type of the first sample description */
+			if (length < 16 || native_read (parser->file, start, data, 16) == FALSE)
+				return FALSE;
+			if (GST_READ_UINT32_BE (data + 4) > 0)
+				parser->codec = GST_READ_UINT32_BE (data + 12);
+			break;
+
+		case MP4_TYPE ('m', 'd', 'a', 't'):
+			parser->media_size += size - header_size;
+			break;
+
+		default:
+			break;
+		}
+
+		offset += size;
+	}
+
+	return TRUE;
+}
+
+static gboolean
+load_mp4 (NativeFile *file, RBMetaDataNativeInfo *info)
+{
+	MP4Parser parser = {0,};
+	guint32 type;
+	goffset size;
+	guint header_size;
+	guint32 timescale;
+	guint64 duration;
+
+	if (mp4_box_header (file, 0, file->size, &type, &size, &header_size) == FALSE ||
+	    type != MP4_TYPE ('f', 't', 'y', 'p'))
+		return FALSE;
+
+	gst_tag_register_musicbrainz_tags ();
+
+	parser.file = file;
+	parser.tags = gst_tag_list_new_empty ();
+	info->tags = parser.tags;
+	if (mp4_parse_boxes (&parser, 0, file->size, 0) == FALSE)
+		return FALSE;
+
+	/* leave anything with video in it to the demuxers */
+	if (parser.has_video)
+		return FALSE;
+
+	switch (parser.audio_codec) {
+	case MP4_TYPE ('m', 'p', '4', 'a'):
+		info->media_type = g_strdup ("audio/x-aac");
+		break;
+	case MP4_TYPE ('a', 'l', 'a', 'c'):
+		info->media_type = g_strdup ("audio/x-alac");
+		break;
+	default:
+		return FALSE;
+	}
+
+	if (parser.audio_timescale != 0 && parser.audio_duration != 0) {
+		timescale = parser.audio_timescale;
+		duration = parser.audio_duration;
+	} else {
+		timescale = parser.movie_timescale;
+		duration = parser.movie_duration;
+	}
+	if (timescale == 0 || duration == 0)
+		return FALSE;
+
+	info->duration = gst_util_uint64_scale (duration, GST_SECOND, timescale);
+	if (parser.media_size > 0)
+		info->bitrate = gst_util_uint64_scale (parser.media_size, 8 * GST_SECOND, info->duration);
+	return TRUE;
+}
+
+/**
+ * rb_metadata_native_load:
+ * @uri: URI of the file to read
+ * @info: returns the stream information and tags
+ *
+ * Tries to read tags and stream information from a local file without
+ * using GStreamer elements.  This only succeeds for files in one of the
+ * formats handled here, and only if everything in the file looks as
+ * expected.
+ *
+ * Return value: %TRUE if @info was filled in
+ */
+gboolean
+rb_metadata_native_load (const char *uri, RBMetaDataNativeInfo *info)
+{
+	NativeFile file;
+	GstTagList *id3v2 = NULL;
+	goffset audio_start;
+	struct stat s;
+	guint8 magic[8];
+	char *filename;
+	gboolean ret = FALSE;
+
+	memset (info, 0, sizeof (*info));
+
+	filename = g_filename_from_uri (uri, NULL, NULL);
+	if (filename == NULL)
+		return FALSE;
+
+	file.fp = fopen (filename, "rb");
+	g_free (filename);
+	if (file.fp == NULL)
+		return FALSE;
+
+	if (fstat (fileno (file.fp), &s) != 0 || S_ISREG (s.st_mode) == FALSE) {
+		fclose (file.fp);
+		return FALSE;
+	}
+	file.size = s.st_size;
+
+	if (read_id3v2_tag (&file, &audio_start, &id3v2) &&
+	    native_read (&file, audio_start, magic, sizeof (magic))) {
+		if (memcmp (magic, "fLaC", 4) == 0) {
+			ret = load_flac (&file, audio_start, info);
+		} else if (audio_start == 0 && memcmp (magic, "OggS", 4) == 0) {
+			ret = load_ogg (&file, info);
+		} else if (audio_start == 0 && memcmp (magic + 4, "ftyp", 4) == 0) {
+			ret = load_mp4 (&file, info);
+		} else {
+			ret = load_mp3 (&file, audio_start, info);
+		}
+	}
+	fclose (file.fp);
+
+	if (ret == FALSE) {
+		if (id3v2 != NULL)
+			gst_tag_list_unref (id3v2);
+		rb_metadata_native_info_clear (info);
+		return FALSE;
+	}
+
+	/* id3v2 tags take precedence over anything else in the file */
+	if (id3v2 != NULL && info->tags != NULL) {
+		GstTagList *merged;
+
+		merged = gst_tag_list_merge (id3v2, info->tags, GST_TAG_MERGE_KEEP);
+		gst_tag_list_unref (id3v2);
+		gst_tag_list_unref (info->tags);
+		info->tags = merged;
+	} else if (id3v2 != NULL) {
+		info->tags = id3v2;
+	} else if (info->tags == NULL) {
+		info->tags = gst_tag_list_new_empty ();
+	}
+
+	rb_debug ("read %s natively: media type %s, duration %" GST_TIME_FORMAT ", bitrate %u",
+		  uri, info->media_type, GST_TIME_ARGS (info->duration), info->bitrate);
+	return TRUE;
+}
+
+/**
+ * rb_metadata_native_info_clear:
+ * @info: a #RBMetaDataNativeInfo
+ *
+ * Frees the contents of @info.
+ */
+void
+rb_metadata_native_info_clear (RBMetaDataNativeInfo *info)
+{
+	g_free (info->media_type);
+	if (info->tags != NULL)
+		gst_tag_list_unref (info->tags);
+	memset (info, 0, sizeof (*info));
+}
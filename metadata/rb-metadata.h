@@ -105,6 +105,8 @@ typedef struct _RBMetaDataClass RBMetaDataClass;
 
 typedef struct RBMetaDataPrivate RBMetaDataPrivate;
 
+typedef void (*RBMetaDataLoadCallback) (RBMetaData *md, guint index, GError *error, gpointer data);
+
 struct _RBMetaData
 {
 	GObject parent;
@@ -137,6 +139,12 @@ void		rb_metadata_load	(RBMetaData *md,
 					 const char *uri,
 					 GError **error);
 
+void		rb_metadata_load_many	(RBMetaData **md,
+					 const char **uris,
+					 guint n_uris,
+					 RBMetaDataLoadCallback callback,
+					 gpointer data);
+
 void		rb_metadata_save	(RBMetaData *md,
 					 const char *uri,
 					 GError **error);
@@ -158,6 +166,9 @@ gboolean	rb_metadata_get		(RBMetaData *md, RBMetaDataField field,
 gboolean	rb_metadata_set		(RBMetaData *md, RBMetaDataField field,
 					 const GValue *val);
 
+void		rb_metadata_set_max_services (guint max);
+guint		rb_metadata_get_max_services (void);
+
 G_END_DECLS
 
 #endif /* __RB_METADATA_H */
@@ -0,0 +1,538 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+#include <metadata/rb-waveform-cache.h>
+#include <metadata/rb-ext-db.h>
+#include <lib/rb-waveform.h>
+#include <lib/rb-debug.h>
+
+/**
+ * SECTION:rb-waveform-cache
+ * @short_description: store for waveform envelopes of local files
+ *
+ * Keeps a compact peak/RMS envelope (see #RBWaveform) for each file that
+ * has been analysed, so a waveform can be drawn without decoding the file.
+ * Envelopes are kept in an #RBExtDB store named "waveform", keyed by the
+ * location and modification time of the file, so modifying a file causes
+ * it to be analysed again.
+ *
+ * Files are analysed one at a time in a background thread, either when an
+ * envelope is requested for a file that hasn't been analysed yet, or when
+ * a file is explicitly queued.  Files that can't be decoded are remembered
+ * and not retried until they change.
+ */
+
+#define ANALYSIS_PIPELINE						\
+	"uridecodebin name=decoder ! audioconvert ! "			\
+	"audio/x-raw,format=" GST_AUDIO_NE (F32) ",layout=interleaved ! "	\
+	"fakesink name=sink signal-handoffs=true sync=false"
+
+struct _RBWaveformCachePrivate
+{
+	RBExtDB *store;
+	GThreadPool *analysis_pool;
+	GHashTable *pending;		/* uri\tmtime, for analyses queued or running */
+};
+
+typedef struct {
+	RBWaveformCache *cache;
+	char *uri;
+	guint64 mtime;
+	RBWaveform *waveform;
+	guint channels;
+	GBytes *envelope;
+} WaveformAnalysis;
+
+typedef struct {
+	RBWaveformCacheCallback callback;
+	gpointer user_data;
+	GDestroyNotify destroy;
+} WaveformRequest;
+
+static RBWaveformCache *instance = NULL;
+
+G_DEFINE_TYPE (RBWaveformCache, rb_waveform_cache, G_TYPE_OBJECT);
+
+static RBExtDBKey *
+create_key (const char *uri, guint64 mtime, gboolean lookup)
+{
+	RBExtDBKey *key;
+	char *mtime_str;
+
+	if (lookup)
+		key = rb_ext_db_key_create_lookup ("location", uri);
+	else
+		key = rb_ext_db_key_create_storage ("location", uri);
+
+	mtime_str = g_strdup_printf ("%" G_GUINT64_FORMAT, mtime);
+	rb_ext_db_key_add_field (key, "mtime", mtime_str);
+	g_free (mtime_str);
+	return key;
+}
+
+static char *
+pending_key (const char *uri, guint64 mtime)
+{
+	return g_strdup_printf ("%s\t%" G_GUINT64_FORMAT, uri, mtime);
+}
+
+static void
+waveform_analysis_free (WaveformAnalysis *analysis)
+{
+	g_object_unref (analysis->cache);
+	g_free (analysis->uri);
+	rb_waveform_free (analysis->waveform);
+	if (analysis->envelope != NULL)
+		g_bytes_unref (analysis->envelope);
+	g_free (analysis);
+}
+
+static gboolean
+analysis_done_idle (WaveformAnalysis *analysis)
+{
+	RBWaveformCache *cache = analysis->cache;
+	RBExtDBKey *key;
+	char *pkey;
+
+	key = create_key (analysis->uri, analysis->mtime, FALSE);
+	if (analysis->envelope != NULL) {
+		GValue v = G_VALUE_INIT;
+
+		rb_debug ("storing %" G_GSIZE_FORMAT " byte envelope for %s",
+			  g_bytes_get_size (analysis->envelope), analysis->uri);
+		g_value_init (&v, G_TYPE_BYTES);
+		g_value_set_boxed (&v, analysis->envelope);
+		rb_ext_db_store (cache->priv->store, key, RB_EXT_DB_SOURCE_EMBEDDED, &v);
+		g_value_unset (&v);
+	} else {
+		/* remember that we tried, and answer anyone waiting */
+		rb_ext_db_store (cache->priv->store, key, RB_EXT_DB_SOURCE_NONE, NULL);
+	}
+	rb_ext_db_key_free (key);
+
+	pkey = pending_key (analysis->uri, analysis->mtime);
+	g_hash_table_remove (cache->priv->pending, pkey);
+	g_free (pkey);
+
+	waveform_analysis_free (analysis);
+	return FALSE;
+}
+
+static void
+handoff_cb (GstElement *sink, GstBuffer *buffer, GstPad *pad, WaveformAnalysis *analysis)
+{
+	GstMapInfo info;
+
+	if (analysis->waveform == NULL) {
+		GstAudioInfo audio_info;
+		GstCaps *caps;
+
+		caps = gst_pad_get_current_caps (pad);
+		if (caps == NULL)
+			return;
+
+		if (gst_audio_info_from_caps (&audio_info, caps)) {
+			analysis->channels = GST_AUDIO_INFO_CHANNELS (&audio_info);
+			analysis->waveform = rb_waveform_new (GST_AUDIO_INFO_RATE (&audio_info), analysis->channels);
+		}
+		gst_caps_unref (caps);
+		if (analysis->waveform == NULL)
+			return;
+	}
+
+	if (gst_buffer_map (buffer, &info, GST_MAP_READ)) {
+		rb_waveform_add_frames (analysis->waveform,
+					(const float *) info.data,
+					info.size / (sizeof (float) * analysis->channels));
+		gst_buffer_unmap (buffer, &info);
+	}
+}
+
+static void
+analyse_file (WaveformAnalysis *analysis, gpointer unused)
+{
+	GstElement *pipeline;
+	GstElement *element;
+	GstMessage *message;
+	GstBus *bus;
+	GError *error = NULL;
+	gboolean failed = FALSE;
+
+	pipeline = gst_parse_launch (ANALYSIS_PIPELINE, &error);
+	if (pipeline == NULL) {
+		g_warning ("unable to create waveform analysis pipeline: %s", error->message);
+		g_clear_error (&error);
+		g_idle_add ((GSourceFunc) analysis_done_idle, analysis);
+		return;
+	}
+
+	element = gst_bin_get_by_name (GST_BIN (pipeline), "decoder");
+	g_object_set (element, "uri", analysis->uri, NULL);
+	gst_object_unref (element);
+
+	element = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+	g_signal_connect (element, "handoff", G_CALLBACK (handoff_cb), analysis);
+	gst_object_unref (element);
+
+	rb_debug ("analysing waveform of %s", analysis->uri);
+	bus = gst_element_get_bus (pipeline);
+	gst_element_set_state (pipeline, GST_STATE_PLAYING);
+	message = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+	if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR) {
+		char *debug;
+
+		gst_message_parse_error (message, &error, &debug);
+		rb_debug ("unable to analyse %s: %s (%s)", analysis->uri, error->message, debug);
+		g_clear_error (&error);
+		g_free (debug);
+		failed = TRUE;
+	}
+	gst_message_unref (message);
+
+	gst_element_set_state (pipeline, GST_STATE_NULL);
+	gst_object_unref (bus);
+	gst_object_unref (pipeline);
+
+	if (failed == FALSE && analysis->waveform != NULL)
+		analysis->envelope = rb_waveform_get_envelope (analysis->waveform, RB_WAVEFORM_DEFAULT_BINS);
+
+	g_idle_add ((GSourceFunc) analysis_done_idle, analysis);
+}
+
+static void
+queue_analysis (RBWaveformCache *cache, const char *uri, guint64 mtime)
+{
+	WaveformAnalysis *analysis;
+	char *pkey;
+
+	pkey = pending_key (uri, mtime);
+	if (g_hash_table_contains (cache->priv->pending, pkey)) {
+		rb_debug ("already analysing %s", uri);
+		g_free (pkey);
+		return;
+	}
+	g_hash_table_add (cache->priv->pending, pkey);
+
+	analysis = g_new0 (WaveformAnalysis, 1);
+	analysis->cache = g_object_ref (cache);
+	analysis->uri = g_strdup (uri);
+	analysis->mtime = mtime;
+	g_thread_pool_push (cache->priv->analysis_pool, analysis, NULL);
+}
+
+static gboolean
+request_cb (RBExtDB *store, RBExtDBKey *key, gulong last_time, RBWaveformCache *cache)
+{
+	const char *uri;
+	const char *mtime_str;
+	guint64 mtime;
+
+	uri = rb_ext_db_key_get_field (key, "location");
+	mtime_str = rb_ext_db_key_get_field (key, "mtime");
+	if (uri == NULL || mtime_str == NULL)
+		return FALSE;
+	mtime = g_ascii_strtoull (mtime_str, NULL, 10);
+
+	if (last_time != 0) {
+		RBExtDBKey *store_key;
+
+		/* we've seen this version of the file before and couldn't
+		 * analyse it, so just answer the request again.
+		 */
+		rb_debug ("not analysing %s again", uri);
+		store_key = create_key (uri, mtime, FALSE);
+		rb_ext_db_store (store, store_key, RB_EXT_DB_SOURCE_NONE, NULL);
+		rb_ext_db_key_free (store_key);
+		return TRUE;
+	}
+
+	queue_analysis (cache, uri, mtime);
+	return TRUE;
+}
+
+static GValue *
+load_cb (RBExtDB *store, GValue *data, RBWaveformCache *cache)
+{
+	GValue *v;
+	GBytes *bytes;
+
+	if (G_VALUE_HOLDS (data, G_TYPE_GSTRING)) {
+		GString *str = g_value_get_boxed (data);
+		bytes = g_bytes_new (str->str, str->len);
+	} else if (G_VALUE_HOLDS (data, G_TYPE_BYTE_ARRAY)) {
+		GByteArray *array = g_value_get_boxed (data);
+		bytes = g_bytes_new (array->data, array->len);
+	} else {
+		rb_debug ("unable to load envelopes from values of type %s", G_VALUE_TYPE_NAME (data));
+		return NULL;
+	}
+
+	v = g_new0 (GValue, 1);
+	g_value_init (v, G_TYPE_BYTES);
+	g_value_take_boxed (v, bytes);
+	return v;
+}
+
+static GValue *
+store_cb (RBExtDB *store, GValue *value, RBWaveformCache *cache)
+{
+	GValue *v;
+	GBytes *bytes;
+	GByteArray *array;
+	gsize size;
+	gconstpointer data;
+
+	if (G_VALUE_HOLDS (value, G_TYPE_BYTES) == FALSE) {
+		rb_debug ("can't store values of type %s", G_VALUE_TYPE_NAME (value));
+		return NULL;
+	}
+
+	bytes = g_value_get_boxed (value);
+	data = g_bytes_get_data (bytes, &size);
+	array = g_byte_array_sized_new (size);
+	g_byte_array_append (array, data, size);
+
+	v = g_new0 (GValue, 1);
+	g_value_init (v, G_TYPE_BYTE_ARRAY);
+	g_value_take_boxed (v, array);
+	return v;
+}
+
+static void
+waveform_request_free (WaveformRequest *req)
+{
+	if (req->destroy)
+		req->destroy (req->user_data);
+	g_free (req);
+}
+
+static void
+request_done_cb (RBExtDBKey *key, RBExtDBKey *store_key, const char *filename, GValue *data, WaveformRequest *req)
+{
+	GBytes *envelope = NULL;
+
+	if (data != NULL && G_VALUE_HOLDS (data, G_TYPE_BYTES))
+		envelope = g_value_get_boxed (data);
+
+	req->callback (rb_ext_db_key_get_field (key, "location"), envelope, req->user_data);
+}
+
+/**
+ * rb_waveform_cache_request:
+ * @cache: the #RBWaveformCache
+ * @uri: location of the file
+ * @mtime: modification time of the file
+ * @callback: (scope notified): callback to call with the envelope
+ * @user_data: data to pass to @callback
+ * @destroy: destroy function for @user_data
+ *
+ * Requests the envelope for a file.  If the file has already been analysed,
+ * the callback is called once the stored envelope is loaded, otherwise the
+ * file is queued for analysis and the callback is called when it finishes.
+ * The envelope passed to the callback is %NULL if the file couldn't be
+ * analysed.  The callback is only called before this returns if an earlier
+ * analysis of the file failed.
+ *
+ * Return value: %TRUE if the callback may be called after returning
+ */
+gboolean
+rb_waveform_cache_request (RBWaveformCache *cache,
+			   const char *uri,
+			   guint64 mtime,
+			   RBWaveformCacheCallback callback,
+			   gpointer user_data,
+			   GDestroyNotify destroy)
+{
+	WaveformRequest *req;
+	RBExtDBKey *key;
+	gboolean result;
+
+	req = g_new0 (WaveformRequest, 1);
+	req->callback = callback;
+	req->user_data = user_data;
+	req->destroy = destroy;
+
+	key = create_key (uri, mtime, TRUE);
+	result = rb_ext_db_request (cache->priv->store,
+				    key,
+				    (RBExtDBRequestCallback) request_done_cb,
+				    req,
+				    (GDestroyNotify) waveform_request_free);
+	rb_ext_db_key_free (key);
+	return result;
+}
+
+/**
+ * rb_waveform_cache_queue:
+ * @cache: the #RBWaveformCache
+ * @uri: location of the file
+ * @mtime: modification time of the file
+ *
+ * Queues a file for analysis if it hasn't already been analysed, so its
+ * envelope will be available without waiting when it is requested.  This
+ * is intended for use when importing files.
+ */
+void
+rb_waveform_cache_queue (RBWaveformCache *cache, const char *uri, guint64 mtime)
+{
+	RBExtDBKey *key;
+	char *filename;
+
+	key = create_key (uri, mtime, TRUE);
+	filename = rb_ext_db_lookup (cache->priv->store, key, NULL);
+	rb_ext_db_key_free (key);
+
+	if (filename == NULL)
+		queue_analysis (cache, uri, mtime);
+	g_free (filename);
+}
+
+/**
+ * rb_waveform_cache_lookup_bulk:
+ * @cache: the #RBWaveformCache
+ * @uris: (array length=n_uris): locations of the files
+ * @mtimes: (array length=n_uris): modification times of the files
+ * @n_uris: number of files
+ *
+ * Looks up the envelopes for a set of files that have already been
+ * analysed.  Files that haven't been analysed are left out of the result
+ * and are not queued for analysis.  The envelopes are read from disk
+ * synchronously, but each is only a few kilobytes.
+ *
+ * Return value: (transfer full) (element-type utf8 GLib.Bytes): a hash
+ *   table mapping the location of each analysed file to its envelope
+ */
+GHashTable *
+rb_waveform_cache_lookup_bulk (RBWaveformCache *cache,
+			       const char **uris,
+			       const guint64 *mtimes,
+			       guint n_uris)
+{
+	GHashTable *envelopes;
+	guint i;
+
+	envelopes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) g_bytes_unref);
+	for (i = 0; i < n_uris; i++) {
+		RBExtDBKey *key;
+		char *filename;
+		char *data;
+		gsize size;
+
+		key = create_key (uris[i], mtimes[i], TRUE);
+		filename = rb_ext_db_lookup (cache->priv->store, key, NULL);
+		rb_ext_db_key_free (key);
+		if (filename == NULL)
+			continue;
+
+		if (g_file_get_contents (filename, &data, &size, NULL)) {
+			g_hash_table_insert (envelopes,
+					     g_strdup (uris[i]),
+					     g_bytes_new_take (data, size));
+		}
+		g_free (filename);
+	}
+
+	rb_debug ("found %u of %u envelopes", g_hash_table_size (envelopes), n_uris);
+	return envelopes;
+}
+
+static void
+impl_finalize (GObject *object)
+{
+	RBWaveformCache *cache = RB_WAVEFORM_CACHE (object);
+
+	g_thread_pool_free (cache->priv->analysis_pool, TRUE, FALSE);
+	g_hash_table_destroy (cache->priv->pending);
+
+	G_OBJECT_CLASS (rb_waveform_cache_parent_class)->finalize (object);
+}
+
+static void
+impl_dispose (GObject *object)
+{
+	RBWaveformCache *cache = RB_WAVEFORM_CACHE (object);
+
+	if (cache->priv->store != NULL) {
+		g_signal_handlers_disconnect_by_data (cache->priv->store, cache);
+		g_object_unref (cache->priv->store);
+		cache->priv->store = NULL;
+	}
+
+	G_OBJECT_CLASS (rb_waveform_cache_parent_class)->dispose (object);
+}
+
+static void
+rb_waveform_cache_init (RBWaveformCache *cache)
+{
+	cache->priv = G_TYPE_INSTANCE_GET_PRIVATE (cache, RB_TYPE_WAVEFORM_CACHE, RBWaveformCachePrivate);
+
+	cache->priv->pending = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+	/* one file at a time, so analysis doesn't compete with playback */
+	cache->priv->analysis_pool = g_thread_pool_new ((GFunc) analyse_file, NULL, 1, FALSE, NULL);
+
+	cache->priv->store = rb_ext_db_new ("waveform");
+	g_signal_connect (cache->priv->store, "request", G_CALLBACK (request_cb), cache);
+	g_signal_connect (cache->priv->store, "load", G_CALLBACK (load_cb), cache);
+	g_signal_connect (cache->priv->store, "store", G_CALLBACK (store_cb), cache);
+}
+
+static void
+rb_waveform_cache_class_init (RBWaveformCacheClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+	object_class->dispose = impl_dispose;
+	object_class->finalize = impl_finalize;
+
+	g_type_class_add_private (klass, sizeof (RBWaveformCachePrivate));
+}
+
+/**
+ * rb_waveform_cache_new:
+ *
+ * Provides access to the waveform cache.  There is only one instance,
+ * shared by everything that uses it.
+ *
+ * Return value: (transfer full): the #RBWaveformCache instance
+ */
+RBWaveformCache *
+rb_waveform_cache_new (void)
+{
+	if (instance != NULL)
+		return g_object_ref (instance);
+
+	instance = RB_WAVEFORM_CACHE (g_object_new (RB_TYPE_WAVEFORM_CACHE, NULL));
+	g_object_add_weak_pointer (G_OBJECT (instance), (gpointer *) &instance);
+	return instance;
+}
@@ -0,0 +1,81 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#ifndef RB_WAVEFORM_CACHE_H
+#define RB_WAVEFORM_CACHE_H
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef struct _RBWaveformCache RBWaveformCache;
+typedef struct _RBWaveformCacheClass RBWaveformCacheClass;
+typedef struct _RBWaveformCachePrivate RBWaveformCachePrivate;
+
+#define RB_TYPE_WAVEFORM_CACHE		(rb_waveform_cache_get_type ())
+#define RB_WAVEFORM_CACHE(o)		(G_TYPE_CHECK_INSTANCE_CAST ((o), RB_TYPE_WAVEFORM_CACHE, RBWaveformCache))
+#define RB_WAVEFORM_CACHE_CLASS(k)	(G_TYPE_CHECK_CLASS_CAST((k), RB_TYPE_WAVEFORM_CACHE, RBWaveformCacheClass))
+#define RB_IS_WAVEFORM_CACHE(o)		(G_TYPE_CHECK_INSTANCE_TYPE ((o), RB_TYPE_WAVEFORM_CACHE))
+#define RB_IS_WAVEFORM_CACHE_CLASS(k)	(G_TYPE_CHECK_CLASS_TYPE ((k), RB_TYPE_WAVEFORM_CACHE))
+#define RB_WAVEFORM_CACHE_GET_CLASS(o)	(G_TYPE_INSTANCE_GET_CLASS ((o), RB_TYPE_WAVEFORM_CACHE, RBWaveformCacheClass))
+
+struct _RBWaveformCache
+{
+	GObject parent;
+
+	RBWaveformCachePrivate *priv;
+};
+
+struct _RBWaveformCacheClass
+{
+	GObjectClass parent;
+};
+
+typedef void (*RBWaveformCacheCallback) (const char *uri, GBytes *envelope, gpointer user_data);
+
+GType			rb_waveform_cache_get_type	(void);
+
+RBWaveformCache *	rb_waveform_cache_new		(void);
+
+gboolean		rb_waveform_cache_request	(RBWaveformCache *cache,
+							 const char *uri,
+							 guint64 mtime,
+							 RBWaveformCacheCallback callback,
+							 gpointer user_data,
+							 GDestroyNotify destroy);
+
+void			rb_waveform_cache_queue		(RBWaveformCache *cache,
+							 const char *uri,
+							 guint64 mtime);
+
+GHashTable *		rb_waveform_cache_lookup_bulk	(RBWaveformCache *cache,
+							 const char **uris,
+							 const guint64 *mtimes,
+							 guint n_uris);
+
+G_END_DECLS
+
+#endif /* RB_WAVEFORM_CACHE_H */
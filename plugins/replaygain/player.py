@@ -125,6 +125,12 @@ class ReplayGainPlayer(object):
 	def playbin_target_gain_cb(self, rgvolume, pspec):
 		self.update_fallback_gain(rgvolume)
 
+	def playbin_song_changed_cb(self, shell_player, entry):
+		# the filter stays in place across streams, so reset it for each one
+		self.set_rgvolume(self.rgvolume)
+		if entry is not None:
+			self.set_analyzed_gain(self.rgvolume, entry)
+
 	def setup_playbin_mode(self):
 		print("using output filter for rgvolume and rglimiter")
 		self.rgfilter = Gst.Bin()
@@ -142,7 +148,11 @@ class ReplayGainPlayer(object):
 
 		self.player.add_filter(self.rgfilter)
 
+		self.song_changed_id = self.shell_player.connect("playing-song-changed", self.playbin_song_changed_cb)
+
 	def deactivate_playbin_mode(self):
+		self.shell_player.disconnect(self.song_changed_id)
+		self.song_changed_id = None
 		self.player.remove_filter(self.rgfilter)
 		self.rgfilter = None
 
@@ -159,8 +169,24 @@ class ReplayGainPlayer(object):
 		rgvolume = Gst.ElementFactory.make("rgvolume", None)
 		rgvolume.connect("notify::target-gain", self.xfade_target_gain_cb)
 		self.set_rgvolume(rgvolume)
+		entry = self.shell_player.props.db.entry_lookup_by_location(uri)
+		if entry is not None:
+			self.set_analyzed_gain(rgvolume, entry)
 		return [rgvolume]
 
+	def set_analyzed_gain(self, rgvolume, entry):
+		# use the loudness analysis results stored in the database for
+		# files that don't have replaygain tags
+		if entry.get_double(RB.RhythmDBPropType.TRACK_PEAK) == 0.0:
+			return
+
+		if self.settings['mode'] == config.REPLAYGAIN_MODE_ALBUM:
+			gain = entry.get_double(RB.RhythmDBPropType.ALBUM_GAIN)
+		else:
+			gain = entry.get_double(RB.RhythmDBPropType.TRACK_GAIN)
+		rgvolume.props.fallback_gain = gain
+		print("using analyzed gain %f for stream %s" % (gain, entry.get_string(RB.RhythmDBPropType.LOCATION)))
+
 	def limiter_changed_cb(self, settings, key):
 		if self.rglimiter is not None:
 			limiter = settings['limiter']
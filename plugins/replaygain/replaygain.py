@@ -26,12 +26,15 @@
 #
 
 import rb
-from gi.repository import GObject, Peas
+from gi.repository import GObject, Gio, Peas
 from gi.repository import RB
 
 from config import ReplayGainConfig
 from player import ReplayGainPlayer
 
+import gettext
+gettext.install('rhythmbox', RB.locale_dir())
+
 class ReplayGainPlugin(GObject.Object, Peas.Activatable):
 	__gtype_name__ = 'ReplayGainPlugin'
 	object = GObject.property (type=GObject.Object)
@@ -42,8 +45,45 @@ class ReplayGainPlugin(GObject.Object, Peas.Activatable):
 
 	def do_activate (self):
 		self.player = ReplayGainPlayer(self.object)
+		self.settings = Gio.Settings.new("org.gnome.rhythmbox.plugins.replaygain")
+
+		self.analyze_action = Gio.SimpleAction(name='replaygain-analyze')
+		self.analyze_action.connect('activate', self.analyze_selected)
+
+		app = Gio.Application.get_default()
+		app.add_action(self.analyze_action)
+
+		item = Gio.MenuItem()
+		item.set_label(_("Analyze Loudness"))
+		item.set_detailed_action('app.replaygain-analyze')
+		app.add_plugin_menu_item('edit', 'replaygain-analyze', item)
+		app.add_plugin_menu_item('browser-popup', 'replaygain-analyze', item)
 
 	def do_deactivate (self):
+		app = Gio.Application.get_default()
+		app.remove_action('replaygain-analyze')
+		app.remove_plugin_menu_item('edit', 'replaygain-analyze')
+		app.remove_plugin_menu_item('browser-popup', 'replaygain-analyze')
+		self.analyze_action = None
+		self.settings = None
+
 		self.config_dialog = None
 		self.player.deactivate()
 		self.player = None
+
+	def analyze_selected(self, action, data):
+		shell = self.object
+		page = shell.props.selected_page
+		if not hasattr(page, "get_entry_view"):
+			return
+
+		entries = page.get_entry_view().get_selected_entries()
+		if len(entries) == 0:
+			return
+
+		# the job analyzes the rest of each album too, for album gain
+		job = RB.RhythmDBReplayGainJob.new(shell.props.db, self.settings['write-tags'])
+		for entry in entries:
+			job.add_entry(entry)
+		shell.props.task_list.add_task(job)
+		job.start()
@@ -33,17 +33,37 @@
 #include "rb-cut-and-paste-code.h"
 #include "rb-refstring.h"
 
-GHashTable *rb_refstrings;
-GMutex rb_refstrings_mutex;
+/*
+ * The interning table is split into shards, each with its own lock, so
+ * threads creating and releasing different strings rarely contend.
+ * Must be a power of two.
+ */
+#define RB_REFSTRING_SHARDS	32
+
+typedef struct
+{
+	GMutex lock;
+	GHashTable *table;
+} RBRefStringShard;
+
+static RBRefStringShard rb_refstring_shards[RB_REFSTRING_SHARDS];
 
 struct RBRefString
 {
 	gint refcount;
+	guint hash;
 	gpointer folded;
 	gpointer sortkey;
 	char value[1];
 };
 
+static RBRefStringShard *
+rb_refstring_shard (guint hash)
+{
+	/* the hash table uses the low bits, so use the high bits here */
+	return &rb_refstring_shards[(hash >> 16 ^ hash >> 27) & (RB_REFSTRING_SHARDS - 1)];
+}
+
 static void
 rb_refstring_free (RBRefString *refstr)
 {
@@ -63,8 +83,12 @@ rb_refstring_free (RBRefString *refstr)
 void
 rb_refstring_system_init ()
 {
-	rb_refstrings = g_hash_table_new_full (g_str_hash, g_str_equal,
-					       NULL, (GDestroyNotify) rb_refstring_free);
+	int i;
+
+	for (i = 0; i < RB_REFSTRING_SHARDS; i++) {
+		rb_refstring_shards[i].table = g_hash_table_new_full (g_str_hash, g_str_equal,
+								      NULL, (GDestroyNotify) rb_refstring_free);
+	}
 }
 
 /**
@@ -80,26 +104,34 @@ rb_refstring_system_init ()
 RBRefString *
 rb_refstring_new (const char *init)
 {
+	RBRefStringShard *shard;
 	RBRefString *ret;
+	guint hash;
+	gsize len;
 
-	g_mutex_lock (&rb_refstrings_mutex);
-	ret = g_hash_table_lookup (rb_refstrings, init);
+	hash = g_str_hash (init);
+	shard = rb_refstring_shard (hash);
+
+	g_mutex_lock (&shard->lock);
+	ret = g_hash_table_lookup (shard->table, init);
 
 	if (ret) {
-		rb_refstring_ref (ret);
-		g_mutex_unlock (&rb_refstrings_mutex);
+		g_atomic_int_inc (&ret->refcount);
+		g_mutex_unlock (&shard->lock);
 		return ret;
 	}
 
-	ret = g_malloc (sizeof (RBRefString) + strlen (init));
+	len = strlen (init);
+	ret = g_malloc (sizeof (RBRefString) + len);
 
-	g_strlcpy (ret->value, init, strlen (init) + 1);
+	memcpy (ret->value, init, len + 1);
 	g_atomic_int_set (&ret->refcount, 1);
+	ret->hash = hash;
 	ret->folded = NULL;
 	ret->sortkey = NULL;
 
-	g_hash_table_insert (rb_refstrings, ret->value, ret);
-	g_mutex_unlock (&rb_refstrings_mutex);
+	g_hash_table_insert (shard->table, ret->value, ret);
+	g_mutex_unlock (&shard->lock);
 	return ret;
 }
 
@@ -116,15 +148,18 @@ rb_refstring_new (const char *init)
 RBRefString *
 rb_refstring_find (const char *init)
 {
+	RBRefStringShard *shard;
 	RBRefString *ret;
 
-	g_mutex_lock (&rb_refstrings_mutex);
-	ret = g_hash_table_lookup (rb_refstrings, init);
+	shard = rb_refstring_shard (g_str_hash (init));
+
+	g_mutex_lock (&shard->lock);
+	ret = g_hash_table_lookup (shard->table, init);
 
 	if (ret)
-		rb_refstring_ref (ret);
+		g_atomic_int_inc (&ret->refcount);
 
-	g_mutex_unlock (&rb_refstrings_mutex);
+	g_mutex_unlock (&shard->lock);
 	return ret;
 }
 
@@ -138,19 +173,33 @@ rb_refstring_find (const char *init)
 void
 rb_refstring_unref (RBRefString *val)
 {
+	RBRefStringShard *shard;
+	gint refcount;
+
 	if (val == NULL)
 		return;
 
 	g_return_if_fail (g_atomic_int_get (&val->refcount) > 0);
 
-	if (g_atomic_int_dec_and_test (&val->refcount)) {
-		g_mutex_lock (&rb_refstrings_mutex);
-		/* ensure it's still not referenced, as something may have called
-		 * rb_refstring_new since we decremented the count */
-		if (g_atomic_int_get (&val->refcount) == 0)
-			g_hash_table_remove (rb_refstrings, val->value);
-		g_mutex_unlock (&rb_refstrings_mutex);
-	}
+	/* dropping any reference but the last doesn't need the lock */
+	do {
+		refcount = g_atomic_int_get (&val->refcount);
+		if (refcount == 1)
+			break;
+	} while (!g_atomic_int_compare_and_exchange (&val->refcount, refcount, refcount - 1));
+
+	if (refcount > 1)
+		return;
+
+	/* new references to a string nobody else holds can only be taken
+	 * through the table, which can't happen while we hold the lock,
+	 * so if this is still the last reference it's safe to free it.
+	 */
+	shard = rb_refstring_shard (val->hash);
+	g_mutex_lock (&shard->lock);
+	if (g_atomic_int_dec_and_test (&val->refcount))
+		g_hash_table_remove (shard->table, val->value);
+	g_mutex_unlock (&shard->lock);
 }
 
 /**
@@ -162,7 +211,12 @@ rb_refstring_unref (RBRefString *val)
 void
 rb_refstring_system_shutdown (void)
 {
-	g_hash_table_destroy (rb_refstrings);
+	int i;
+
+	for (i = 0; i < RB_REFSTRING_SHARDS; i++) {
+		g_hash_table_destroy (rb_refstring_shards[i].table);
+		rb_refstring_shards[i].table = NULL;
+	}
 }
 
 /**
@@ -300,7 +354,7 @@ guint
 rb_refstring_hash (gconstpointer p)
 {
 	const RBRefString *ref = p;
-	return g_str_hash (rb_refstring_get (ref));
+	return ref->hash;
 }
 
 /**
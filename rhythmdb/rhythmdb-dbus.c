@@ -47,6 +47,9 @@ static const char *rhythmdb_dbus_spec =
 "      <arg name='uri' type='s'/>"
 "      <arg name='properties' type='a{sv}'/>"
 "    </method>"
+"    <method name='GetEventQueueStats'>"
+"      <arg name='stats' type='a{sv}' direction='out'/>"
+"    </method>"
 "  </interface>"
 "</node>";
 
@@ -60,6 +63,38 @@ return_entry_not_found (GDBusMethodInvocation *invocation, const char *uri)
 					       uri);
 }
 
+static GVariant *
+get_event_queue_stats (RhythmDB *db)
+{
+	GVariantBuilder *builder;
+	GVariant *v;
+	double mean = 0.0;
+
+	if (db->priv->events_processed > 0)
+		mean = ((double) db->priv->event_latency_total / db->priv->events_processed) / 1000.0;
+
+	/* latencies are in milliseconds */
+	builder = g_variant_builder_new (G_VARIANT_TYPE ("a{sv}"));
+	g_variant_builder_add (builder, "{sv}", "queue-length",
+			       g_variant_new_uint32 (g_async_queue_length (db->priv->event_queue)));
+	g_variant_builder_add (builder, "{sv}", "peak-queue-length",
+			       g_variant_new_uint32 (db->priv->event_queue_peak));
+	g_variant_builder_add (builder, "{sv}", "events-processed",
+			       g_variant_new_uint64 (db->priv->events_processed));
+	g_variant_builder_add (builder, "{sv}", "batches",
+			       g_variant_new_uint64 (db->priv->event_batches));
+	g_variant_builder_add (builder, "{sv}", "mean-latency",
+			       g_variant_new_double (mean));
+	g_variant_builder_add (builder, "{sv}", "max-latency",
+			       g_variant_new_double (db->priv->event_latency_max / 1000.0));
+	g_variant_builder_add (builder, "{sv}", "producer-waits",
+			       g_variant_new_uint32 (g_atomic_int_get (&db->priv->event_queue_waits)));
+
+	v = g_variant_new ("(a{sv})", builder);
+	g_variant_builder_unref (builder);
+	return v;
+}
+
 static void
 rhythmdb_method_call (GDBusConnection *connection,
 		      const char *sender,
@@ -194,6 +229,8 @@ rhythmdb_method_call (GDBusConnection *connection,
 		}
 
 		g_dbus_method_invocation_return_value (invocation, NULL);
+	} else if (g_strcmp0 (method_name, "GetEventQueueStats") == 0) {
+		g_dbus_method_invocation_return_value (invocation, get_event_queue_stats (db));
 	} else {
 		g_dbus_method_invocation_return_error (invocation,
 						       G_DBUS_ERROR,
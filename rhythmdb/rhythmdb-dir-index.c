@@ -0,0 +1,291 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * The directory index remembers what the library directories looked like
+ * the last time we went through them, so a rescan can skip the parts that
+ * haven't changed.  For each directory it records the directory's
+ * modification time and the names of its subdirectories.  If the
+ * directory's modification time still matches, the library walk can go
+ * straight to the subdirectories without enumerating it.
+ *
+ * Entries in the database are still checked individually by the stat
+ * thread, since editing a file in place doesn't change its directory's
+ * modification time.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+
+#include "rhythmdb-dir-index.h"
+#include "rb-debug.h"
+
+#define RHYTHMDB_DIR_INDEX_VERSION	(2)
+
+/* directories modified more recently than this may still be changing
+ * within the same second, so we don't record anything about them.
+ */
+#define RHYTHMDB_DIR_INDEX_SETTLE_TIME	(2)
+
+/* version, then dir uri -> (listing mtime, subdirs) */
+#define RHYTHMDB_DIR_INDEX_FORMAT	"(ua{s(tas)})"
+
+typedef struct {
+	guint64 listing_mtime;
+	char **subdirs;
+
+	gboolean seen;
+} RhythmDBDirIndexRecord;
+
+struct _RhythmDBDirIndex {
+	char *path;
+	GMutex lock;
+	GHashTable *dirs;
+	gboolean dirty;
+};
+
+static void
+record_free (RhythmDBDirIndexRecord *record)
+{
+	g_strfreev (record->subdirs);
+	g_slice_free (RhythmDBDirIndexRecord, record);
+}
+
+static guint64
+now (void)
+{
+	return g_get_real_time () / G_USEC_PER_SEC;
+}
+
+static void
+load_index (RhythmDBDirIndex *index)
+{
+	GVariant *v;
+	GVariantIter *iter;
+	GError *error = NULL;
+	char *data;
+	gsize length;
+	guint32 version;
+	const char *uri;
+	RhythmDBDirIndexRecord record;
+
+	if (g_file_get_contents (index->path, &data, &length, &error) == FALSE) {
+		rb_debug ("unable to read directory index %s: %s", index->path, error->message);
+		g_clear_error (&error);
+		return;
+	}
+
+	v = g_variant_new_from_data (G_VARIANT_TYPE (RHYTHMDB_DIR_INDEX_FORMAT), data, length, FALSE, g_free, data);
+	g_variant_get (v, RHYTHMDB_DIR_INDEX_FORMAT, &version, &iter);
+	if (version != RHYTHMDB_DIR_INDEX_VERSION) {
+		rb_debug ("ignoring directory index %s with version %u", index->path, version);
+	} else {
+		while (g_variant_iter_next (iter, "{&s(t^as)}",
+					    &uri,
+					    &record.listing_mtime,
+					    &record.subdirs)) {
+			RhythmDBDirIndexRecord *r;
+
+			r = g_slice_dup (RhythmDBDirIndexRecord, &record);
+			r->seen = FALSE;
+			g_hash_table_insert (index->dirs, g_strdup (uri), r);
+		}
+		rb_debug ("loaded %u directories from %s", g_hash_table_size (index->dirs), index->path);
+	}
+	g_variant_iter_free (iter);
+	g_variant_unref (v);
+}
+
+/* returns the record for a directory, creating it if @create is set.
+ * call with the lock held.
+ */
+static RhythmDBDirIndexRecord *
+get_record (RhythmDBDirIndex *index, const char *uri, gboolean create)
+{
+	RhythmDBDirIndexRecord *record;
+
+	record = g_hash_table_lookup (index->dirs, uri);
+	if (record == NULL && create) {
+		record = g_slice_new0 (RhythmDBDirIndexRecord);
+		g_hash_table_insert (index->dirs, g_strdup (uri), record);
+	}
+	if (record != NULL)
+		record->seen = TRUE;
+	return record;
+}
+
+/**
+ * rhythmdb_dir_index_new:
+ * @path: file to store the index in
+ *
+ * Creates a directory index, loading anything previously
+ * stored in @path.
+ *
+ * Return value: the new index
+ */
+RhythmDBDirIndex *
+rhythmdb_dir_index_new (const char *path)
+{
+	RhythmDBDirIndex *index;
+
+	index = g_new0 (RhythmDBDirIndex, 1);
+	index->path = g_strdup (path);
+	g_mutex_init (&index->lock);
+	index->dirs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) record_free);
+
+	load_index (index);
+	return index;
+}
+
+/**
+ * rhythmdb_dir_index_free:
+ * @index: a #RhythmDBDirIndex
+ *
+ * Frees the index without saving it.
+ */
+void
+rhythmdb_dir_index_free (RhythmDBDirIndex *index)
+{
+	g_hash_table_destroy (index->dirs);
+	g_mutex_clear (&index->lock);
+	g_free (index->path);
+	g_free (index);
+}
+
+/**
+ * rhythmdb_dir_index_save:
+ * @index: a #RhythmDBDirIndex
+ *
+ * Writes the index out if anything has changed.  Directories that
+ * haven't been looked at since the index was loaded are left out,
+ * so directories that are no longer in the library drop out of it.
+ */
+void
+rhythmdb_dir_index_save (RhythmDBDirIndex *index)
+{
+	GVariantBuilder builder;
+	GHashTableIter iter;
+	GVariant *v;
+	GError *error = NULL;
+	const char *uri;
+	RhythmDBDirIndexRecord *record;
+	char *dir;
+
+	g_mutex_lock (&index->lock);
+	if (index->dirty == FALSE) {
+		g_mutex_unlock (&index->lock);
+		return;
+	}
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{s(tas)}"));
+	g_hash_table_iter_init (&iter, index->dirs);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &uri, (gpointer *) &record)) {
+		const char * const empty[] = { NULL };
+
+		if (record->seen == FALSE)
+			continue;
+
+		g_variant_builder_add (&builder, "{s(t^as)}",
+				       uri,
+				       record->listing_mtime,
+				       record->subdirs ? (const char * const *) record->subdirs : empty);
+	}
+	v = g_variant_ref_sink (g_variant_new (RHYTHMDB_DIR_INDEX_FORMAT, RHYTHMDB_DIR_INDEX_VERSION, &builder));
+	index->dirty = FALSE;
+	g_mutex_unlock (&index->lock);
+
+	dir = g_path_get_dirname (index->path);
+	g_mkdir_with_parents (dir, 0700);
+	g_free (dir);
+
+	if (g_file_set_contents (index->path, g_variant_get_data (v), g_variant_get_size (v), &error) == FALSE) {
+		rb_debug ("unable to save directory index %s: %s", index->path, error->message);
+		g_clear_error (&error);
+	} else {
+		rb_debug ("saved directory index %s", index->path);
+	}
+	g_variant_unref (v);
+}
+
+/**
+ * rhythmdb_dir_index_get_subdirs:
+ * @index: a #RhythmDBDirIndex
+ * @uri: directory URI
+ * @mtime: current modification time of the directory
+ *
+ * If the listing recorded for the directory is still current,
+ * returns the names of its subdirectories.
+ *
+ * Return value: (transfer full): subdirectory names, or NULL if the
+ *  directory needs to be enumerated.
+ */
+char **
+rhythmdb_dir_index_get_subdirs (RhythmDBDirIndex *index, const char *uri, guint64 mtime)
+{
+	RhythmDBDirIndexRecord *record;
+	char **subdirs = NULL;
+
+	g_mutex_lock (&index->lock);
+	record = get_record (index, uri, FALSE);
+	if (record != NULL && record->listing_mtime != 0 && record->listing_mtime == mtime) {
+		if (record->subdirs != NULL) {
+			subdirs = g_strdupv (record->subdirs);
+		} else {
+			subdirs = g_new0 (char *, 1);
+		}
+	}
+	g_mutex_unlock (&index->lock);
+	return subdirs;
+}
+
+/**
+ * rhythmdb_dir_index_set_listing:
+ * @index: a #RhythmDBDirIndex
+ * @uri: directory URI
+ * @mtime: modification time of the directory before it was enumerated
+ * @subdirs: names of the subdirectories found
+ *
+ * Records the results of enumerating a directory.
+ */
+void
+rhythmdb_dir_index_set_listing (RhythmDBDirIndex *index,
+				const char *uri,
+				guint64 mtime,
+				const char * const *subdirs)
+{
+	RhythmDBDirIndexRecord *record;
+
+	if (mtime + RHYTHMDB_DIR_INDEX_SETTLE_TIME > now ())
+		return;
+
+	g_mutex_lock (&index->lock);
+	record = get_record (index, uri, TRUE);
+	record->listing_mtime = mtime;
+	g_strfreev (record->subdirs);
+	record->subdirs = g_strdupv ((char **) subdirs);
+	index->dirty = TRUE;
+	g_mutex_unlock (&index->lock);
+}
@@ -0,0 +1,47 @@
+/*
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#ifndef RHYTHMDB_DIR_INDEX_H
+#define RHYTHMDB_DIR_INDEX_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _RhythmDBDirIndex RhythmDBDirIndex;
+
+RhythmDBDirIndex *	rhythmdb_dir_index_new		(const char *path);
+void			rhythmdb_dir_index_free		(RhythmDBDirIndex *index);
+void			rhythmdb_dir_index_save		(RhythmDBDirIndex *index);
+
+char **			rhythmdb_dir_index_get_subdirs	(RhythmDBDirIndex *index, const char *uri, guint64 mtime);
+void			rhythmdb_dir_index_set_listing	(RhythmDBDirIndex *index,
+							 const char *uri,
+							 guint64 mtime,
+							 const char * const *subdirs);
+
+G_END_DECLS
+
+#endif /* RHYTHMDB_DIR_INDEX_H */
@@ -37,14 +37,16 @@
 #include "rb-debug.h"
 #include "rb-missing-plugins.h"
 #include "rb-task-progress.h"
+#include "rb-metadata.h"
 
 /* maximum number of new URIs in the rhythmdb action queue.
  * entries bounce around between different threads and processes a bit,
  * so having multiple in flight should help.  we also want to be able to
  * cancel import jobs quickly.  since we can't remove things from the
- * action queue, having fewer entries helps.
+ * action queue, having fewer entries helps.  we need at least a couple
+ * per metadata helper process to keep them all busy, though.
  */
-#define PROCESSING_LIMIT		20
+#define PROCESSING_LIMIT		(MAX (20, 2 * rb_metadata_get_max_services ()))
 
 enum
 {
@@ -91,6 +93,7 @@ struct _RhythmDBImportJobPrivate
 	GSList		*uri_list;
 	gboolean	started;
 	GCancellable    *cancel;
+	GTimer		*timer;
 
 	GSList		*retry_entries;
 	gboolean	retried;
@@ -294,7 +297,11 @@ emit_status_changed (RhythmDBImportJob *job)
 			}
 			g_closure_sink (retry);
 		} else {
-			rb_debug ("emitting job complete");
+			double elapsed = g_timer_elapsed (job->priv->timer, NULL);
+
+			rb_debug ("emitting job complete: %d files in %.1f seconds (%.0f files/sec)",
+				  job->priv->processed, elapsed,
+				  elapsed > 0.0 ? job->priv->processed / elapsed : 0.0);
 			job->priv->complete = TRUE;
 			g_signal_emit (job, signals[COMPLETE], 0, job->priv->total);
 			g_object_notify (G_OBJECT (job), "task-outcome");
@@ -375,7 +382,8 @@ uri_recurse_func (GFile *file, GFileInfo *info, RhythmDBImportJob *job)
 static gboolean
 emit_scan_complete_idle (RhythmDBImportJob *job)
 {
-	rb_debug ("emitting scan complete");
+	rb_debug ("emitting scan complete: found %d new files in %.1f seconds",
+		  job->priv->total, g_timer_elapsed (job->priv->timer, NULL));
 	g_signal_emit (job, signals[SCAN_COMPLETE], 0, job->priv->total);
 	emit_status_changed (job);
 	g_object_unref (job);
@@ -423,6 +431,7 @@ rhythmdb_import_job_start (RhythmDBImportJob *job)
 	rb_debug ("starting");
 	g_mutex_lock (&job->priv->lock);
 	job->priv->started = TRUE;
+	g_timer_start (job->priv->timer);
 	job->priv->uri_list = g_slist_reverse (job->priv->uri_list);
 	g_mutex_unlock (&job->priv->lock);
 	
@@ -584,6 +593,7 @@ rhythmdb_import_job_init (RhythmDBImportJob *job)
 	job->priv->processing = g_queue_new ();
 
 	job->priv->cancel = g_cancellable_new ();
+	job->priv->timer = g_timer_new ();
 }
 
 static void
@@ -661,7 +671,15 @@ impl_get_property (GObject *object,
 		break;
 	case PROP_TASK_DETAIL:
 		if (job->priv->scan_complete == FALSE) {
-			g_value_set_string (value, _("Scanning"));
+			if (job->priv->total > 0) {
+				g_value_take_string (value,
+						     g_strdup_printf (ngettext ("Scanning: %d new file found",
+										"Scanning: %d new files found",
+										job->priv->total),
+								      job->priv->total));
+			} else {
+				g_value_set_string (value, _("Scanning"));
+			}
 		} else if (job->priv->total > 0) {
 			g_value_take_string (value,
 					     g_strdup_printf (_("%d of %d"),
@@ -723,6 +741,7 @@ impl_finalize (GObject *object)
 
 	g_queue_free_full (job->priv->outstanding, g_free);
 	g_queue_free_full (job->priv->processing, g_free);
+	g_timer_destroy (job->priv->timer);
 
 	rb_slist_deep_free (job->priv->uri_list);
 
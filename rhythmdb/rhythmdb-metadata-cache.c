@@ -31,9 +31,13 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
 
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 
+/* only used to migrate old cache files */
 #include <tdb.h>
 
 #include "rhythmdb-metadata-cache.h"
@@ -41,9 +45,6 @@
 #include "rb-util.h"
 #include "rb-debug.h"
 
-/* is this enough? */
-#define CACHE_HASH_SIZE		4096
-
 static RhythmDBPropType cached_properties[] = {
 	/* items that get accessed before being applied to an entry go first */
 	RHYTHMDB_PROP_MTIME,
@@ -72,8 +73,40 @@ static RhythmDBPropType cached_properties[] = {
 	RHYTHMDB_PROP_BPM,
 	RHYTHMDB_PROP_COMPOSER,
 	RHYTHMDB_PROP_COMPOSER_SORTNAME,
+	RHYTHMDB_PROP_TRACK_GAIN,
+	RHYTHMDB_PROP_TRACK_PEAK,
+	RHYTHMDB_PROP_ALBUM_GAIN,
+	RHYTHMDB_PROP_ALBUM_PEAK,
 };
 
+/* cache file layout: a header, then a sequence of records.  each record is
+ *
+ *   guint32 length of the rest of the record
+ *   key, nul terminated
+ *   guint64 missing-since time
+ *   guint32 bitmask of the cached properties present, indexed by position
+ *           in cached_properties, or RECORD_DELETED
+ *   values of the properties present, in cached_properties order:
+ *     strings nul terminated, ulongs and uint64s as guint64, doubles as
+ *     IEEE 754 doubles, booleans as a single byte
+ *
+ * all integers are little endian.  new records are appended to the file,
+ * replacing earlier records with the same key, so the file is rewritten
+ * when it is opened if it has accumulated too many replaced records.
+ *
+ * only add new properties at the end of cached_properties, as the
+ * bitmask in existing records depends on their positions.
+ */
+#define CACHE_MAGIC		"RBMC"
+#define CACHE_VERSION		(1)
+#define CACHE_HEADER_SIZE	(12)
+#define RECORD_DELETED		(G_MAXUINT32)
+
+/* rewrite the file when less than half of it is in use */
+#define CACHE_COMPACT_MIN_SIZE	(1024 * 1024)
+
+G_STATIC_ASSERT (G_N_ELEMENTS (cached_properties) < 32);
+
 enum
 {
 	PROP_0,
@@ -89,10 +122,16 @@ struct _RhythmDBMetadataCachePrivate
 	RhythmDB *db;
 	char *name;
 
-	struct tdb_context *tdb_context;
+	GMutex lock;
+	char *path;
+	int fd;
+	gsize file_size;
+	GMappedFile *map;
+	const guint8 *map_start;
+	const guint8 *map_end;
 
-	const char *purge_prefix;
-	guint64 purge_age;
+	/* key (pointing into the record) -> record */
+	GHashTable *index;
 };
 
 G_DEFINE_TYPE (RhythmDBMetadataCache, rhythmdb_metadata_cache, G_TYPE_OBJECT);
@@ -126,7 +165,7 @@ rhythmdb_metadata_cache_get (RhythmDB *db, const char *name)
 	g_assert (rb_is_main_thread ());
 
 	if (instances == NULL)
-		instances = g_hash_table_new (g_str_hash, g_str_equal);
+		instances = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
 
 	obj = g_hash_table_lookup (instances, name);
 	if (obj)
@@ -140,49 +179,259 @@ rhythmdb_metadata_cache_get (RhythmDB *db, const char *name)
 	return RHYTHMDB_METADATA_CACHE (obj);
 }
 
+static guint32
+read_u32 (const guint8 *p)
+{
+	guint32 v;
+	memcpy (&v, p, sizeof (v));
+	return GUINT32_FROM_LE (v);
+}
+
+static guint64
+read_u64 (const guint8 *p)
+{
+	guint64 v;
+	memcpy (&v, p, sizeof (v));
+	return GUINT64_FROM_LE (v);
+}
+
 static void
-free_tdb_data(gpointer data)
+write_u32 (guint8 *p, guint32 v)
 {
-	free (data);
+	v = GUINT32_TO_LE (v);
+	memcpy (p, &v, sizeof (v));
 }
 
 static void
-parse_value (TDB_DATA data, guint64 *missing_since, GVariant **metadata)
+write_u64 (guint8 *p, guint64 v)
 {
-	GVariant *v;
+	v = GUINT64_TO_LE (v);
+	memcpy (p, &v, sizeof (v));
+}
 
-	v = g_variant_new_from_data (G_VARIANT_TYPE ("(ta{sv})"), data.dptr, data.dsize, FALSE, free_tdb_data, data.dptr);
+/* record accessors.  records have been checked by parse_record,
+ * or were built by us, so they're known to be well formed.
+ */
+static gsize
+record_size (const guint8 *record)
+{
+	return read_u32 (record) + 4;
+}
+
+static const char *
+record_key (const guint8 *record)
+{
+	return (const char *)record + 4;
+}
 
-	g_variant_get_child (v, 0, "t", missing_since);
-	*metadata = g_variant_get_child_value (v, 1);
+static const guint8 *
+record_fields (const guint8 *record)
+{
+	return record + 4 + strlen (record_key (record)) + 1;
+}
 
-	g_variant_unref (v);
+static guint64
+record_missing_since (const guint8 *record)
+{
+	return read_u64 (record_fields (record));
+}
+
+static guint32
+record_present (const guint8 *record)
+{
+	return read_u32 (record_fields (record) + 8);
 }
 
 static void
-store_value (struct tdb_context *tdb, const char *key, guint64 missing_since, GVariant *metadata)
+free_record (guint8 *record, RhythmDBMetadataCache *cache)
 {
-	GVariantBuilder b;
-	GVariant *v;
-	TDB_DATA tdbdata;
-	TDB_DATA tdbkey;
+	/* records in the mapped file don't need to be freed */
+	if (record < cache->priv->map_start || record >= cache->priv->map_end)
+		g_free (record);
+}
+
+static void
+index_replace (RhythmDBMetadataCache *cache, guint8 *record)
+{
+	guint8 *old;
 
-	g_variant_builder_init (&b, G_VARIANT_TYPE ("(ta{sv})"));
-	g_variant_builder_add (&b, "t", missing_since);
-	g_variant_builder_add_value (&b, metadata);
-	v = g_variant_builder_end (&b);
+	old = g_hash_table_lookup (cache->priv->index, record_key (record));
+	g_hash_table_steal (cache->priv->index, record_key (record));
+	if (old != NULL)
+		free_record (old, cache);
+	g_hash_table_insert (cache->priv->index, (gpointer) record_key (record), record);
+}
 
-	tdbdata.dsize = g_variant_get_size (v);
-	tdbdata.dptr = g_malloc0 (tdbdata.dsize);
-	g_variant_store (v, tdbdata.dptr);
-	g_variant_unref (v);
+static void
+index_remove (RhythmDBMetadataCache *cache, const char *key)
+{
+	guint8 *old;
 
-	tdbkey.dsize = strlen(key);
-	tdbkey.dptr = (unsigned char *)key;
+	old = g_hash_table_lookup (cache->priv->index, key);
+	if (old != NULL) {
+		g_hash_table_steal (cache->priv->index, key);
+		free_record (old, cache);
+	}
+}
 
-	tdb_store (tdb, tdbkey, tdbdata, 0);
+/* building records */
 
-	g_free (tdbdata.dptr);
+static GByteArray *
+record_begin (const char *key, guint64 missing_since)
+{
+	GByteArray *buf;
+	guint8 header[4];
+	guint8 fields[12];
+
+	buf = g_byte_array_new ();
+	g_byte_array_append (buf, header, 4);
+	g_byte_array_append (buf, (const guint8 *)key, strlen (key) + 1);
+	write_u64 (fields, missing_since);
+	write_u32 (fields + 8, 0);
+	g_byte_array_append (buf, fields, 12);
+	return buf;
+}
+
+static void
+record_add_value (GByteArray *buf, GType proptype, const GValue *value)
+{
+	guint8 data[8];
+	const char *str;
+	double d;
+
+	switch (proptype) {
+	case G_TYPE_STRING:
+		str = g_value_get_string (value);
+		g_byte_array_append (buf, (const guint8 *)str, strlen (str) + 1);
+		break;
+	case G_TYPE_ULONG:
+		write_u64 (data, g_value_get_ulong (value));
+		g_byte_array_append (buf, data, 8);
+		break;
+	case G_TYPE_UINT64:
+		write_u64 (data, g_value_get_uint64 (value));
+		g_byte_array_append (buf, data, 8);
+		break;
+	case G_TYPE_DOUBLE:
+		d = g_value_get_double (value);
+		memcpy (data, &d, 8);
+		g_byte_array_append (buf, data, 8);
+		break;
+	case G_TYPE_BOOLEAN:
+		data[0] = g_value_get_boolean (value) ? 1 : 0;
+		g_byte_array_append (buf, data, 1);
+		break;
+	default:
+		g_assert_not_reached ();
+	}
+}
+
+static guint8 *
+record_end (GByteArray *buf, guint32 present)
+{
+	gsize keylen;
+
+	write_u32 (buf->data, buf->len - 4);
+	keylen = strlen ((const char *)buf->data + 4) + 1;
+	write_u32 (buf->data + 4 + keylen + 8, present);
+	return g_byte_array_free (buf, FALSE);
+}
+
+static guint8 *
+record_copy_with_missing_since (const guint8 *record, guint64 missing_since)
+{
+	guint8 *copy;
+
+	copy = g_memdup (record, record_size (record));
+	write_u64 ((guint8 *)record_fields (copy), missing_since);
+	return copy;
+}
+
+/* checks that a record read from the file is well formed */
+static gboolean
+parse_record (RhythmDBMetadataCache *cache, const guint8 *record, gsize available)
+{
+	const guint8 *p;
+	const guint8 *end;
+	guint32 present;
+	int i;
+
+	if (available < 4 || read_u32 (record) > available - 4)
+		return FALSE;
+	end = record + record_size (record);
+
+	p = memchr (record + 4, '\0', end - (record + 4));
+	if (p == NULL || end - (p + 1) < 12)
+		return FALSE;
+	p++;
+
+	present = read_u32 (p + 8);
+	p += 12;
+	if (present == RECORD_DELETED)
+		return (p == end);
+
+	for (i = 0; i < 32; i++) {
+		if ((present & (1U << i)) == 0)
+			continue;
+		if (i >= G_N_ELEMENTS (cached_properties))
+			return FALSE;
+
+		switch (rhythmdb_get_property_type (cache->priv->db, cached_properties[i])) {
+		case G_TYPE_STRING:
+			p = memchr (p, '\0', end - p);
+			if (p == NULL)
+				return FALSE;
+			p++;
+			break;
+		case G_TYPE_BOOLEAN:
+			p += 1;
+			break;
+		default:
+			p += 8;
+			break;
+		}
+		if (p > end)
+			return FALSE;
+	}
+	return (p == end);
+}
+
+/* writing to the file.  call with the lock held. */
+
+static void
+append_record (RhythmDBMetadataCache *cache, const guint8 *record)
+{
+	gsize size = record_size (record);
+	gssize written;
+
+	if (cache->priv->fd == -1)
+		return;
+
+	written = write (cache->priv->fd, record, size);
+	if (written != (gssize) size) {
+		rb_debug ("unable to write to metadata cache %s: %s", cache->priv->path, strerror (errno));
+		return;
+	}
+	cache->priv->file_size += size;
+}
+
+static void
+store_record (RhythmDBMetadataCache *cache, guint8 *record)
+{
+	append_record (cache, record);
+	index_replace (cache, record);
+}
+
+static void
+delete_record (RhythmDBMetadataCache *cache, const char *key)
+{
+	guint8 *tombstone;
+
+	tombstone = record_end (record_begin (key, 0), RECORD_DELETED);
+	append_record (cache, tombstone);
+	g_free (tombstone);
+
+	index_remove (cache, key);
 }
 
 /**
@@ -200,79 +449,83 @@ rhythmdb_metadata_cache_load (RhythmDBMetadataCache *cache,
 			      const char *key,
 			      GArray *metadata)
 {
-	TDB_DATA tdbkey;
-	TDB_DATA tdbvalue;
-	GVariant *cached_metadata;
-	GVariantIter iter;
-	RhythmDBPropType prop;
+	const guint8 *record;
+	const guint8 *p;
 	RhythmDBEntryChange *fields;
-	GVariant *value;
-	guint64 missing_since;
+	RhythmDBPropType prop;
+	guint32 present;
 	GType proptype;
 	guint64 u64;
-	char *pkey;
+	double d;
 	int i;
+	int n;
 
-	tdbkey.dptr = (unsigned char *)key;
-	tdbkey.dsize = strlen(key);
-	tdbvalue = tdb_fetch (cache->priv->tdb_context, tdbkey);
-	if (tdbvalue.dptr == NULL)
+	g_mutex_lock (&cache->priv->lock);
+	record = g_hash_table_lookup (cache->priv->index, key);
+	if (record == NULL) {
+		g_mutex_unlock (&cache->priv->lock);
 		return FALSE;
-
-	parse_value (tdbvalue, &missing_since, &cached_metadata);
+	}
 
 	/* reset missing-since, if necessary */
-	if (missing_since != 0) {
-		store_value (cache->priv->tdb_context, key, 0, cached_metadata);
+	if (record_missing_since (record) != 0) {
+		guint8 *copy = record_copy_with_missing_since (record, 0);
+		store_record (cache, copy);
+		record = copy;
 	}
 
-	metadata->len = g_variant_n_children (cached_metadata);
-	fields = g_new0 (RhythmDBEntryChange, metadata->len);
-	metadata->data = (char *)fields;
+	present = record_present (record);
+	fields = g_new0 (RhythmDBEntryChange, G_N_ELEMENTS (cached_properties));
+	p = record_fields (record) + 12;
 
-	i = 0;
-	g_variant_iter_init (&iter, cached_metadata);
-	while (g_variant_iter_loop (&iter, "{sv}", &pkey, &value)) {
-		prop = rhythmdb_propid_from_nice_elt_name (cache->priv->db, (xmlChar *)pkey);
-		if (prop == -1) {
-			rb_debug ("unknown property %s found in cache", pkey);
+	n = 0;
+	for (i = 0; i < G_N_ELEMENTS (cached_properties); i++) {
+		if ((present & (1U << i)) == 0)
 			continue;
-		}
 
-		fields[i].prop = prop;
+		prop = cached_properties[i];
 		proptype = rhythmdb_get_property_type (cache->priv->db, prop);
-		g_value_init (&fields[i].new, proptype);
+		fields[n].prop = prop;
+		g_value_init (&fields[n].new, proptype);
 
 		switch (proptype) {
 		case G_TYPE_STRING:
-			g_value_set_string (&fields[i].new, g_variant_get_string (value, NULL));
+			g_value_set_string (&fields[n].new, (const char *)p);
+			p += strlen ((const char *)p) + 1;
 			break;
 		case G_TYPE_BOOLEAN:
-			g_value_set_boolean (&fields[i].new, g_variant_get_boolean (value));
+			g_value_set_boolean (&fields[n].new, p[0] != 0);
+			p += 1;
 			break;
 		case G_TYPE_ULONG:
 			/* we always store longs as uint64, so check for overflow */
-			u64 = g_variant_get_uint64 (value);
+			u64 = read_u64 (p);
 			if (u64 > G_MAXULONG) {
 				rb_debug ("value %" G_GUINT64_FORMAT " overflows", u64);
 				u64 = G_MAXULONG;
 			}
-			g_value_set_ulong (&fields[i].new, u64);
+			g_value_set_ulong (&fields[n].new, u64);
+			p += 8;
 			break;
 		case G_TYPE_UINT64:
-			g_value_set_uint64 (&fields[i].new, g_variant_get_uint64 (value));
+			g_value_set_uint64 (&fields[n].new, read_u64 (p));
+			p += 8;
 			break;
 		case G_TYPE_DOUBLE:
-			g_value_set_double (&fields[i].new, g_variant_get_double (value));
+			memcpy (&d, p, 8);
+			g_value_set_double (&fields[n].new, d);
+			p += 8;
 			break;
 		default:
 			g_assert_not_reached ();
 			break;
 		}
-		i++;
+		n++;
 	}
+	g_mutex_unlock (&cache->priv->lock);
 
-	g_variant_unref (cached_metadata);
+	metadata->len = n;
+	metadata->data = (char *)fields;
 	return TRUE;
 }
 
@@ -289,107 +542,73 @@ rhythmdb_metadata_cache_store (RhythmDBMetadataCache *cache,
 			       const char *key,
 			       RhythmDBEntry *entry)
 {
-	GVariantBuilder vb;
+	GByteArray *buf;
+	guint32 present = 0;
 	int i;
 
-	g_variant_builder_init (&vb, G_VARIANT_TYPE ("a{sv}"));
+	buf = record_begin (key, 0);
 	for (i = 0; i < G_N_ELEMENTS(cached_properties); i++) {
 		GType proptype;
+		GValue v = G_VALUE_INIT;
 		const char *str;
 		gulong ulong;
 		guint64 u64;
-		GVariant *v;
 
-		v = NULL;
 		proptype = rhythmdb_get_property_type (cache->priv->db, cached_properties[i]);
+		g_value_init (&v, proptype);
 		switch (proptype) {
 		case G_TYPE_STRING:
 			str = rhythmdb_entry_get_string (entry, cached_properties[i]);
 			if (str != NULL && str[0] != '\0' && g_str_equal (str, _("Unknown")) == FALSE) {
-				v = g_variant_new_string (str);
+				g_value_set_static_string (&v, str);
+				present |= (1U << i);
 			}
 			break;
 
 		case G_TYPE_ULONG:
 			ulong = rhythmdb_entry_get_ulong (entry, cached_properties[i]);
 			if (ulong != 0) {
-				/* use uint64 for longs, even on ilp32 */
-				v = g_variant_new_uint64 (ulong);
+				g_value_set_ulong (&v, ulong);
+				present |= (1U << i);
 			}
 			break;
 
 		case G_TYPE_UINT64:
 			u64 = rhythmdb_entry_get_uint64 (entry, cached_properties[i]);
 			if (u64 != 0) {
-				v = g_variant_new_uint64 (u64);
+				g_value_set_uint64 (&v, u64);
+				present |= (1U << i);
 			}
 			break;
 
 		case G_TYPE_BOOLEAN:
-			v = g_variant_new_boolean (rhythmdb_entry_get_boolean (entry, cached_properties[i]));
+			g_value_set_boolean (&v, rhythmdb_entry_get_boolean (entry, cached_properties[i]));
+			present |= (1U << i);
 			break;
 
 		case G_TYPE_DOUBLE:
-			v = g_variant_new_double (rhythmdb_entry_get_double (entry, cached_properties[i]));
+			g_value_set_double (&v, rhythmdb_entry_get_double (entry, cached_properties[i]));
+			present |= (1U << i);
 			break;
 
 		default:
 			g_assert_not_reached ();
 		}
 
-		if (v != NULL) {
-			const char *tag;
-
-			tag = (const char *)rhythmdb_nice_elt_name_from_propid (cache->priv->db, cached_properties[i]);
-			g_variant_builder_add (&vb, "{sv}", tag, v);
-		}
+		if (present & (1U << i))
+			record_add_value (buf, proptype, &v);
+		g_value_unset (&v);
 	}
 
-	store_value (cache->priv->tdb_context, key, 0, g_variant_builder_end (&vb));
+	g_mutex_lock (&cache->priv->lock);
+	store_record (cache, record_end (buf, present));
+	g_mutex_unlock (&cache->priv->lock);
 }
 
 typedef struct {
-	struct tdb_context *tdb;
-
-	const char *prefix;
-	guint64 time;
-	guint64 before;
-
-	RhythmDBMetadataCacheValidFunc valid_func;
-	gpointer valid_func_data;
-} RhythmDBMetadataCachePurge;
-
-static int
-purge_traverse_cb (struct tdb_context *tdb, TDB_DATA tdbkey, TDB_DATA tdbdata, RhythmDBMetadataCachePurge *purge)
-{
-	guint64 missing_since;
-	GVariant *metadata;
 	char *key;
-	TDB_DATA aligndata;
-
-	key = g_strndup ((const char *)tdbkey.dptr, tdbkey.dsize);
-	if (g_str_has_prefix (key, purge->prefix) == FALSE) {
-		g_free (key);
-		return 0;
-	}
-
-	aligndata.dptr = g_memdup (tdbdata.dptr, tdbdata.dsize);
-	aligndata.dsize = tdbdata.dsize;
-
-	parse_value (aligndata, &missing_since, &metadata);
-	if (missing_since == 0) {
-		if (purge->valid_func (key, purge->valid_func_data) == FALSE) {
-			store_value (purge->tdb, key, purge->time, metadata);
-		}
-	} else if (missing_since < purge->before) {
-		rb_debug ("entry %s is too old, deleting", key);
-		tdb_delete (tdb, tdbkey);
-	}
-	g_variant_unref (metadata); /* also frees aligndata.dptr */
-	g_free (key);
-
-	return 0;
-}
+	guint64 missing_since;
+} RhythmDBMetadataCachePurgeItem;
 
 /**
  * rhythmdb_metadata_cache_purge:
@@ -407,23 +626,345 @@ rhythmdb_metadata_cache_purge (RhythmDBMetadataCache *cache,
 			       gpointer cb_data,
 			       GDestroyNotify cb_data_destroy)
 {
-	RhythmDBMetadataCachePurge purge;
-
+	GHashTableIter iter;
+	GArray *items;
+	const char *key;
+	const guint8 *record;
+	guint64 before;
 	time_t now;
+	int i;
+
 	time (&now);
-	purge.time = now;
-	purge.before = now - max_age;
-	purge.prefix = prefix;
-	purge.valid_func = cb;
-	purge.valid_func_data = cb_data;
-	purge.tdb = cache->priv->tdb_context;
-	tdb_traverse (cache->priv->tdb_context, (tdb_traverse_func)purge_traverse_cb, &purge);
+	before = now - max_age;
+
+	/* find the keys under the prefix first, so the validity callback
+	 * (which looks up entries in the database) runs without the lock held.
+	 */
+	items = g_array_new (FALSE, FALSE, sizeof (RhythmDBMetadataCachePurgeItem));
+	g_mutex_lock (&cache->priv->lock);
+	g_hash_table_iter_init (&iter, cache->priv->index);
+	while (g_hash_table_iter_next (&iter, (gpointer *)&key, (gpointer *)&record)) {
+		RhythmDBMetadataCachePurgeItem item;
+
+		if (g_str_has_prefix (key, prefix) == FALSE)
+			continue;
+
+		item.key = g_strdup (key);
+		item.missing_since = record_missing_since (record);
+		g_array_append_val (items, item);
+	}
+	g_mutex_unlock (&cache->priv->lock);
+
+	for (i = 0; i < items->len; i++) {
+		RhythmDBMetadataCachePurgeItem *item = &g_array_index (items, RhythmDBMetadataCachePurgeItem, i);
+
+		if (item->missing_since == 0) {
+			if (cb (item->key, cb_data) == FALSE) {
+				g_mutex_lock (&cache->priv->lock);
+				record = g_hash_table_lookup (cache->priv->index, item->key);
+				if (record != NULL && record_missing_since (record) == 0)
+					store_record (cache, record_copy_with_missing_since (record, now));
+				g_mutex_unlock (&cache->priv->lock);
+			}
+		} else if (item->missing_since < before) {
+			rb_debug ("entry %s is too old, deleting", item->key);
+			g_mutex_lock (&cache->priv->lock);
+			delete_record (cache, item->key);
+			g_mutex_unlock (&cache->priv->lock);
+		}
+		g_free (item->key);
+	}
+	g_array_free (items, TRUE);
 
 	if (cb_data_destroy && cb_data)
 		cb_data_destroy (cb_data);
 }
 
+/* opening the cache file */
+
+static void
+fill_header (guint8 *header)
+{
+	memcpy (header, CACHE_MAGIC, 4);
+	write_u32 (header + 4, CACHE_VERSION);
+	write_u32 (header + 8, G_N_ELEMENTS (cached_properties));
+}
+
+/* maps the cache file and builds the index from it.
+ * returns the number of bytes of valid records.
+ */
+static gsize
+read_cache_file (RhythmDBMetadataCache *cache)
+{
+	GError *error = NULL;
+	const guint8 *p;
+	gsize length;
+	gsize valid;
+
+	cache->priv->map = g_mapped_file_new (cache->priv->path, FALSE, &error);
+	if (cache->priv->map == NULL) {
+		rb_debug ("unable to open metadata cache %s: %s", cache->priv->path, error->message);
+		g_clear_error (&error);
+		return 0;
+	}
+
+	p = (const guint8 *) g_mapped_file_get_contents (cache->priv->map);
+	length = g_mapped_file_get_length (cache->priv->map);
+	cache->priv->map_start = p;
+	cache->priv->map_end = p + length;
+
+	if (length < CACHE_HEADER_SIZE ||
+	    memcmp (p, CACHE_MAGIC, 4) != 0 ||
+	    read_u32 (p + 4) != CACHE_VERSION ||
+	    read_u32 (p + 8) > G_N_ELEMENTS (cached_properties)) {
+		rb_debug ("ignoring metadata cache %s with unknown format", cache->priv->path);
+		return 0;
+	}
+
+	valid = CACHE_HEADER_SIZE;
+	p += CACHE_HEADER_SIZE;
+	while (p < cache->priv->map_end) {
+		if (parse_record (cache, p, cache->priv->map_end - p) == FALSE) {
+			rb_debug ("metadata cache %s is damaged at offset %" G_GSIZE_FORMAT, cache->priv->path, valid);
+			break;
+		}
+
+		if (record_present (p) == RECORD_DELETED) {
+			index_remove (cache, record_key (p));
+		} else {
+			index_replace (cache, (guint8 *)p);
+		}
+		valid += record_size (p);
+		p += record_size (p);
+	}
+	return valid;
+}
+
+/* writes out a new cache file containing only the current records */
+static gboolean
+compact_cache_file (RhythmDBMetadataCache *cache)
+{
+	GHashTableIter iter;
+	GError *error = NULL;
+	GByteArray *contents;
+	guint8 header[CACHE_HEADER_SIZE];
+	const guint8 *record;
+	gboolean result;
+
+	fill_header (header);
+	contents = g_byte_array_new ();
+	g_byte_array_append (contents, header, CACHE_HEADER_SIZE);
+	g_hash_table_iter_init (&iter, cache->priv->index);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&record)) {
+		g_byte_array_append (contents, record, record_size (record));
+	}
 
+	result = g_file_set_contents (cache->priv->path, (const char *)contents->data, contents->len, &error);
+	if (result == FALSE) {
+		rb_debug ("unable to rewrite metadata cache %s: %s", cache->priv->path, error->message);
+		g_clear_error (&error);
+	} else {
+		rb_debug ("rewrote metadata cache %s: %u records, %u bytes",
+			  cache->priv->path, g_hash_table_size (cache->priv->index), contents->len);
+	}
+	g_byte_array_free (contents, TRUE);
+	return result;
+}
+
+static void
+close_cache_file (RhythmDBMetadataCache *cache)
+{
+	GHashTableIter iter;
+	guint8 *record;
+
+	g_hash_table_iter_init (&iter, cache->priv->index);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&record)) {
+		free_record (record, cache);
+		g_hash_table_iter_steal (&iter);
+	}
+
+	if (cache->priv->map != NULL) {
+		g_mapped_file_unref (cache->priv->map);
+		cache->priv->map = NULL;
+		cache->priv->map_start = NULL;
+		cache->priv->map_end = NULL;
+	}
+
+	if (cache->priv->fd != -1) {
+		close (cache->priv->fd);
+		cache->priv->fd = -1;
+	}
+}
+
+static void
+migrate_tdb_value (RhythmDBMetadataCache *cache, const char *key, TDB_DATA data)
+{
+	GVariant *v;
+	GVariant *props;
+	GVariant *values[G_N_ELEMENTS (cached_properties)] = { NULL, };
+	GVariant *value;
+	GVariantIter iter;
+	GByteArray *buf;
+	guint64 missing_since;
+	guint32 present = 0;
+	char *pkey;
+	int i;
+
+	v = g_variant_new_from_data (G_VARIANT_TYPE ("(ta{sv})"), data.dptr, data.dsize, FALSE, NULL, NULL);
+	g_variant_get_child (v, 0, "t", &missing_since);
+	props = g_variant_get_child_value (v, 1);
+	g_variant_iter_init (&iter, props);
+	while (g_variant_iter_next (&iter, "{sv}", &pkey, &value)) {
+		RhythmDBPropType prop;
+
+		prop = rhythmdb_propid_from_nice_elt_name (cache->priv->db, (xmlChar *)pkey);
+		for (i = 0; i < G_N_ELEMENTS (cached_properties); i++) {
+			if (cached_properties[i] == prop && values[i] == NULL) {
+				values[i] = g_variant_ref (value);
+				break;
+			}
+		}
+		g_variant_unref (value);
+		g_free (pkey);
+	}
+
+	buf = record_begin (key, missing_since);
+	for (i = 0; i < G_N_ELEMENTS (cached_properties); i++) {
+		GValue gv = G_VALUE_INIT;
+		GType proptype;
+
+		if (values[i] == NULL)
+			continue;
+
+		proptype = rhythmdb_get_property_type (cache->priv->db, cached_properties[i]);
+		g_value_init (&gv, proptype);
+		if (proptype == G_TYPE_STRING && g_variant_is_of_type (values[i], G_VARIANT_TYPE_STRING)) {
+			g_value_set_string (&gv, g_variant_get_string (values[i], NULL));
+		} else if ((proptype == G_TYPE_ULONG || proptype == G_TYPE_UINT64) &&
+			   g_variant_is_of_type (values[i], G_VARIANT_TYPE_UINT64)) {
+			if (proptype == G_TYPE_ULONG)
+				g_value_set_ulong (&gv, MIN (g_variant_get_uint64 (values[i]), G_MAXULONG));
+			else
+				g_value_set_uint64 (&gv, g_variant_get_uint64 (values[i]));
+		} else if (proptype == G_TYPE_DOUBLE && g_variant_is_of_type (values[i], G_VARIANT_TYPE_DOUBLE)) {
+			g_value_set_double (&gv, g_variant_get_double (values[i]));
+		} else if (proptype == G_TYPE_BOOLEAN && g_variant_is_of_type (values[i], G_VARIANT_TYPE_BOOLEAN)) {
+			g_value_set_boolean (&gv, g_variant_get_boolean (values[i]));
+		} else {
+			g_value_unset (&gv);
+			g_variant_unref (values[i]);
+			continue;
+		}
+
+		record_add_value (buf, proptype, &gv);
+		present |= (1U << i);
+		g_value_unset (&gv);
+		g_variant_unref (values[i]);
+	}
+	g_variant_unref (props);
+	g_variant_unref (v);
+
+	index_replace (cache, record_end (buf, present));
+}
+
+static int
+migrate_tdb_traverse_cb (struct tdb_context *tdb, TDB_DATA tdbkey, TDB_DATA tdbdata, RhythmDBMetadataCache *cache)
+{
+	char *key;
+	TDB_DATA aligndata;
+
+	key = g_strndup ((const char *)tdbkey.dptr, tdbkey.dsize);
+	aligndata.dptr = g_memdup (tdbdata.dptr, tdbdata.dsize);
+	aligndata.dsize = tdbdata.dsize;
+	migrate_tdb_value (cache, key, aligndata);
+	g_free (aligndata.dptr);
+	g_free (key);
+	return 0;
+}
+
+/* converts a cache from the TDB file used by earlier versions */
+static void
+migrate_tdb_file (RhythmDBMetadataCache *cache, const char *tdbpath)
+{
+	struct tdb_context *tdb;
+
+	tdb = tdb_open (tdbpath, 0, TDB_INCOMPATIBLE_HASH, O_RDONLY, 0600);
+	if (tdb == NULL) {
+		rb_debug ("unable to open old metadata cache %s: %s", tdbpath, strerror (errno));
+		return;
+	}
+
+	tdb_traverse (tdb, (tdb_traverse_func) migrate_tdb_traverse_cb, cache);
+	tdb_close (tdb);
+
+	rb_debug ("migrated %u records from %s", g_hash_table_size (cache->priv->index), tdbpath);
+	if (compact_cache_file (cache)) {
+		g_unlink (tdbpath);
+	}
+	close_cache_file (cache);
+}
+
+static void
+open_cache_file (RhythmDBMetadataCache *cache, const char *cachedir)
+{
+	char *tdbfile;
+	char *tdbpath;
+	gsize valid;
+	gsize live;
+	GHashTableIter iter;
+	const guint8 *record;
+
+	if (g_file_test (cache->priv->path, G_FILE_TEST_EXISTS) == FALSE) {
+		tdbfile = g_strdup_printf ("%s.tdb", cache->priv->name);
+		tdbpath = g_build_filename (cachedir, tdbfile, NULL);
+		if (g_file_test (tdbpath, G_FILE_TEST_EXISTS))
+			migrate_tdb_file (cache, tdbpath);
+		g_free (tdbfile);
+		g_free (tdbpath);
+	}
+
+	valid = read_cache_file (cache);
+
+	live = CACHE_HEADER_SIZE;
+	g_hash_table_iter_init (&iter, cache->priv->index);
+	while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&record)) {
+		live += record_size (record);
+	}
+	rb_debug ("metadata cache %s: %u records, %" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " bytes in use",
+		  cache->priv->path, g_hash_table_size (cache->priv->index), live,
+		  cache->priv->map ? g_mapped_file_get_length (cache->priv->map) : 0);
+
+	/* rewrite the file if it's damaged or mostly replaced records */
+	if (cache->priv->map == NULL ||
+	    valid != g_mapped_file_get_length (cache->priv->map) ||
+	    (valid > CACHE_COMPACT_MIN_SIZE && live < valid / 2)) {
+		if (cache->priv->map != NULL)
+			compact_cache_file (cache);
+		close_cache_file (cache);
+
+		if (g_file_test (cache->priv->path, G_FILE_TEST_EXISTS) == FALSE) {
+			guint8 header[CACHE_HEADER_SIZE];
+
+			fill_header (header);
+			if (g_file_set_contents (cache->priv->path, (const char *)header, CACHE_HEADER_SIZE, NULL) == FALSE)
+				rb_debug ("unable to create metadata cache %s", cache->priv->path);
+		}
+		valid = read_cache_file (cache);
+		if (cache->priv->map == NULL)
+			return;
+	}
+
+	cache->priv->fd = open (cache->priv->path, O_WRONLY | O_APPEND, 0600);
+	if (cache->priv->fd == -1) {
+		rb_debug ("unable to open metadata cache %s for writing: %s", cache->priv->path, strerror (errno));
+	} else if (valid != g_mapped_file_get_length (cache->priv->map)) {
+		/* drop anything we couldn't read, so new records follow on from valid ones */
+		if (ftruncate (cache->priv->fd, valid) != 0) {
+			rb_debug ("unable to truncate metadata cache %s: %s", cache->priv->path, strerror (errno));
+		}
+	}
+	cache->priv->file_size = valid;
+}
 
 static void
 rhythmdb_metadata_cache_init (RhythmDBMetadataCache *cache)
@@ -431,6 +972,10 @@ rhythmdb_metadata_cache_init (RhythmDBMetadataCache *cache)
 	cache->priv = G_TYPE_INSTANCE_GET_PRIVATE (cache,
 						   RHYTHMDB_TYPE_METADATA_CACHE,
 						   RhythmDBMetadataCachePrivate);
+
+	g_mutex_init (&cache->priv->lock);
+	cache->priv->fd = -1;
+	cache->priv->index = g_hash_table_new (g_str_hash, g_str_equal);
 }
 
 static void
@@ -480,8 +1025,7 @@ impl_constructed (GObject *object)
 {
 	RhythmDBMetadataCache *cache;
 	char *cachedir;
-	char *tdbfile;
-	char *tdbpath;
+	char *cachefile;
 
 	RB_CHAIN_GOBJECT_METHOD (rhythmdb_metadata_cache_parent_class, constructed, object);
 
@@ -490,14 +1034,10 @@ impl_constructed (GObject *object)
 	if (g_mkdir_with_parents (cachedir, 0700) != 0) {
 		rb_debug ("unable to create metadata cache directory %s", cachedir);
 	} else {
-		tdbfile = g_strdup_printf ("%s.tdb", cache->priv->name);
-		tdbpath = g_build_filename (cachedir, tdbfile, NULL);
-		cache->priv->tdb_context = tdb_open (tdbpath, CACHE_HASH_SIZE, TDB_INCOMPATIBLE_HASH, O_RDWR | O_CREAT, 0600);
-		if (cache->priv->tdb_context == NULL) {
-			rb_debug ("unable to open metadata cache %s: %s", tdbpath, strerror(errno));
-		}
-		g_free (tdbfile);
-		g_free (tdbpath);
+		cachefile = g_strdup_printf ("%s.cache", cache->priv->name);
+		cache->priv->path = g_build_filename (cachedir, cachefile, NULL);
+		open_cache_file (cache, cachedir);
+		g_free (cachefile);
 	}
 	g_free (cachedir);
 }
@@ -518,6 +1058,14 @@ impl_finalize (GObject *object)
 {
 	RhythmDBMetadataCache *cache = RHYTHMDB_METADATA_CACHE (object);
 
+	if (instances != NULL && g_hash_table_lookup (instances, cache->priv->name) == object)
+		g_hash_table_remove (instances, cache->priv->name);
+
+	close_cache_file (cache);
+	g_hash_table_destroy (cache->priv->index);
+	g_mutex_clear (&cache->priv->lock);
+
+	g_free (cache->priv->path);
 	g_free (cache->priv->name);
 
 	G_OBJECT_CLASS (rhythmdb_metadata_cache_parent_class)->finalize (object);
@@ -44,6 +44,12 @@
 
 #define RHYTHMDB_FILE_MODIFY_PROCESS_TIME 2
 
+/* how many monitors to set up in each idle callback */
+#define RHYTHMDB_MONITOR_BATCH_SIZE	(64)
+
+/* how often to report the directory event rate, in seconds */
+#define RHYTHMDB_MONITOR_STATS_INTERVAL	(10)
+
 static void rhythmdb_directory_change_cb (GFileMonitor *monitor,
 					  GFile *file,
 					  GFile *other_file,
@@ -56,6 +62,26 @@ static void rhythmdb_mount_removed_cb (GVolumeMonitor *monitor,
 				       GMount *mount,
 				       RhythmDB *db);
 
+static guint
+get_max_monitors (void)
+{
+	char *contents;
+	guint64 max = 0;
+
+	/* inotify watches are shared between all of the user's processes,
+	 * so leave half of them for everything else.  directories we can't
+	 * monitor are still checked when the library is rescanned.
+	 */
+	if (g_file_get_contents ("/proc/sys/fs/inotify/max_user_watches", &contents, NULL, NULL)) {
+		max = g_ascii_strtoull (contents, NULL, 10) / 2;
+		g_free (contents);
+	}
+
+	if (max == 0 || max > G_MAXUINT)
+		return G_MAXUINT;
+	return (guint) max;
+}
+
 void
 rhythmdb_init_monitoring (RhythmDB *db)
 {
@@ -67,6 +93,10 @@ rhythmdb_init_monitoring (RhythmDB *db)
 							 (GDestroyNotify) rb_refstring_unref,
 							 NULL);
 
+	db->priv->pending_monitors = g_queue_new ();
+	db->priv->max_monitors = get_max_monitors ();
+	rb_debug ("monitoring up to %u directories", db->priv->max_monitors);
+
 	db->priv->volume_monitor = g_volume_monitor_get ();
 	g_signal_connect (G_OBJECT (db->priv->volume_monitor),
 			  "mount-added",
@@ -91,6 +121,11 @@ rhythmdb_dispose_monitoring (RhythmDB *db)
 		db->priv->changed_files_id = 0;
 	}
 
+	if (db->priv->monitor_commit_id != 0) {
+		g_source_remove (db->priv->monitor_commit_id);
+		db->priv->monitor_commit_id = 0;
+	}
+
 	if (db->priv->volume_monitor != NULL) {
 		g_object_unref (db->priv->volume_monitor);
 		db->priv->volume_monitor = NULL;
@@ -104,14 +139,25 @@ rhythmdb_finalize_monitoring (RhythmDB *db)
 
 	g_hash_table_destroy (db->priv->monitored_directories);
 	g_hash_table_destroy (db->priv->changed_files);
+	g_queue_free (db->priv->pending_monitors);
 }
 
 void
 rhythmdb_stop_monitoring (RhythmDB *db)
 {
+	GFile *file;
+
+	if (db->priv->add_monitors_id != 0) {
+		g_source_remove (db->priv->add_monitors_id);
+		db->priv->add_monitors_id = 0;
+	}
+	while ((file = g_queue_pop_head (db->priv->pending_monitors)) != NULL)
+		g_object_unref (file);
+
 	g_hash_table_foreach_remove (db->priv->monitored_directories,
 				     (GHRFunc) rb_true_function,
 				     db);
+	db->priv->monitor_limit_reached = FALSE;
 }
 
 static void
@@ -130,6 +176,15 @@ actually_add_monitor (RhythmDB *db, GFile *directory, GError **error)
 		return;
 	}
 
+	if (g_hash_table_size (db->priv->monitored_directories) >= db->priv->max_monitors) {
+		if (db->priv->monitor_limit_reached == FALSE) {
+			g_warning ("Not monitoring more than %u library directories", db->priv->max_monitors);
+			db->priv->monitor_limit_reached = TRUE;
+		}
+		g_mutex_unlock (&db->priv->monitor_mutex);
+		return;
+	}
+
 	monitor = g_file_monitor_directory (directory, G_FILE_MONITOR_SEND_MOVED, db->priv->exiting, error);
 	if (monitor != NULL) {
 		g_signal_connect_object (G_OBJECT (monitor),
@@ -145,29 +200,182 @@ actually_add_monitor (RhythmDB *db, GFile *directory, GError **error)
 }
 
 static gboolean
-monitor_subdirectory (GFile *file, GFileInfo *info, RhythmDB *db)
+add_pending_monitors (RhythmDB *db)
+{
+	GFile *directory;
+	int i;
+
+	for (i = 0; i < RHYTHMDB_MONITOR_BATCH_SIZE; i++) {
+		directory = g_queue_pop_head (db->priv->pending_monitors);
+		if (directory == NULL) {
+			rb_debug ("%u directories monitored",
+				  g_hash_table_size (db->priv->monitored_directories));
+			db->priv->add_monitors_id = 0;
+			return FALSE;
+		}
+
+		actually_add_monitor (db, directory, NULL);
+		g_object_unref (directory);
+	}
+	return TRUE;
+}
+
+/* directories found by the library walk are monitored from an idle
+ * handler, a batch at a time, so setting up monitors for a large
+ * library doesn't hold up the walk.  only called from the main thread.
+ */
+static void
+queue_monitor (RhythmDB *db, GFile *directory)
+{
+	g_queue_push_tail (db->priv->pending_monitors, g_object_ref (directory));
+	if (db->priv->add_monitors_id == 0) {
+		db->priv->add_monitors_id = g_idle_add_full (G_PRIORITY_LOW,
+							     (GSourceFunc) add_pending_monitors,
+							     db,
+							     NULL);
+	}
+}
+
+static gboolean
+monitor_library_file (RhythmDB *db, GFile *file)
 {
+	RhythmDBEntry *entry;
 	char *uri;
 
+	/* add the file to the database if it's not already there */
 	uri = g_file_get_uri (file);
-	if (g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_STANDARD_TYPE) == G_FILE_TYPE_DIRECTORY) {
-		actually_add_monitor (db, file, NULL);
-	} else {
-		/* add the file to the database if it's not already there */
-		RhythmDBEntry *entry;
-
-		entry = rhythmdb_entry_lookup_by_location (db, uri);
-		if (entry == NULL) {
-			rhythmdb_add_uri (db, uri);
-		}
+	entry = rhythmdb_entry_lookup_by_location (db, uri);
+	if (entry == NULL) {
+		rhythmdb_add_uri (db, uri);
 	}
 	g_free (uri);
-	return TRUE;	
+	return (entry != NULL);
+}
+
+/* the library walk visits every directory under a library location,
+ * adding monitors for them and adding any files that aren't in the
+ * database yet.  directories whose listing in the directory index is
+ * still current aren't enumerated; we just move on to the subdirectories
+ * recorded there.  a listing is only recorded once all the files in the
+ * directory are in the database, so files we were still adding when we
+ * last exited get another chance.
+ */
+
+typedef struct {
+	RhythmDB *db;
+	GHashTable *dirs;
+	guint listed;
+	guint skipped;
+	GTimer *timer;
+} RhythmDBLibraryWalk;
+
+typedef struct {
+	guint64 mtime;
+	GPtrArray *subdirs;
+	gboolean complete;
+} RhythmDBLibraryWalkDir;
+
+static void
+library_walk_dir_free (RhythmDBLibraryWalkDir *dir)
+{
+	g_ptr_array_free (dir->subdirs, TRUE);
+	g_slice_free (RhythmDBLibraryWalkDir, dir);
+}
+
+static gboolean
+library_walk_dir_cb (GFile *file, GFileInfo *info, char ***subdirs, RhythmDBLibraryWalk *walk)
+{
+	RhythmDBLibraryWalkDir *dir;
+	guint64 mtime;
+	char *uri;
+
+	queue_monitor (walk->db, file);
+
+	mtime = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED);
+	uri = g_file_get_uri (file);
+	*subdirs = rhythmdb_dir_index_get_subdirs (walk->db->priv->dir_index, uri, mtime);
+	g_free (uri);
+	if (*subdirs != NULL) {
+		walk->skipped++;
+		return FALSE;
+	}
+
+	walk->listed++;
+	dir = g_slice_new0 (RhythmDBLibraryWalkDir);
+	dir->mtime = mtime;
+	dir->subdirs = g_ptr_array_new_with_free_func (g_free);
+	dir->complete = TRUE;
+	g_hash_table_insert (walk->dirs, g_object_ref (file), dir);
+	return TRUE;
+}
+
+static gboolean
+library_walk_file_cb (GFile *file, GFileInfo *info, RhythmDBLibraryWalk *walk)
+{
+	RhythmDBLibraryWalkDir *dir = NULL;
+	GFile *parent;
+
+	/* a library location can be a single file, which has no listing to update */
+	parent = g_file_get_parent (file);
+	if (parent != NULL) {
+		dir = g_hash_table_lookup (walk->dirs, parent);
+		g_object_unref (parent);
+	}
+
+	switch (g_file_info_get_file_type (info)) {
+	case G_FILE_TYPE_DIRECTORY:
+	case G_FILE_TYPE_MOUNTABLE:
+		if (dir != NULL)
+			g_ptr_array_add (dir->subdirs, g_strdup (g_file_info_get_name (info)));
+		break;
+	default:
+		if (monitor_library_file (walk->db, file) == FALSE && dir != NULL)
+			dir->complete = FALSE;
+		break;
+	}
+
+	/* returning FALSE would cancel db->priv->exiting */
+	return TRUE;
+}
+
+static void
+library_walk_dir_done_cb (GFile *file, gboolean complete, RhythmDBLibraryWalk *walk)
+{
+	RhythmDBLibraryWalkDir *dir;
+	char *uri;
+
+	dir = g_hash_table_lookup (walk->dirs, file);
+	if (complete && dir->complete) {
+		uri = g_file_get_uri (file);
+		g_ptr_array_add (dir->subdirs, NULL);
+		rhythmdb_dir_index_set_listing (walk->db->priv->dir_index,
+						uri,
+						dir->mtime,
+						(const char * const *) dir->subdirs->pdata);
+		g_free (uri);
+	}
+	g_hash_table_remove (walk->dirs, file);
+}
+
+static void
+library_walk_done (RhythmDBLibraryWalk *walk)
+{
+	rb_debug ("library walk done in %.1f seconds: %u directories enumerated, %u unchanged",
+		  g_timer_elapsed (walk->timer, NULL), walk->listed, walk->skipped);
+	rhythmdb_dir_index_save (walk->db->priv->dir_index);
+	walk->db->priv->library_walks--;
+
+	g_object_unref (walk->db);
+	g_hash_table_destroy (walk->dirs);
+	g_timer_destroy (walk->timer);
+	g_free (walk);
 }
 
 static void
 monitor_library_directory (const char *uri, RhythmDB *db)
 {
+	RhythmDBLibraryWalk *walk;
+
 	if ((strcmp (uri, "file:///") == 0) ||
 	    (strcmp (uri, "file://") == 0)) {
 		/* display an error to the user? */
@@ -176,11 +384,23 @@ monitor_library_directory (const char *uri, RhythmDB *db)
 
 	rb_debug ("beginning monitor of the library directory %s", uri);
 	rhythmdb_monitor_uri_path (db, uri, NULL);
-	rb_uri_handle_recursively_async (uri,
-					 NULL,
-					 (RBUriRecurseFunc) monitor_subdirectory,
-					 g_object_ref (db),
-					 (GDestroyNotify)g_object_unref);
+
+	walk = g_new0 (RhythmDBLibraryWalk, 1);
+	walk->db = g_object_ref (db);
+	walk->dirs = g_hash_table_new_full (g_file_hash,
+					    (GEqualFunc) g_file_equal,
+					    g_object_unref,
+					    (GDestroyNotify) library_walk_dir_free);
+	walk->timer = g_timer_new ();
+	db->priv->library_walks++;
+
+	rb_uri_handle_recursively_async_full (uri,
+					      db->priv->exiting,
+					      (RBUriRecurseDirFunc) library_walk_dir_cb,
+					      (RBUriRecurseFunc) library_walk_file_cb,
+					      (RBUriRecurseDirDoneFunc) library_walk_dir_done_cb,
+					      walk,
+					      (GDestroyNotify) library_walk_done);
 }
 
 static gboolean
@@ -248,6 +468,145 @@ add_changed_file (RhythmDB *db, const char *uri)
 	}
 }
 
+static gboolean
+rhythmdb_monitor_commit (RhythmDB *db)
+{
+	db->priv->monitor_commit_id = 0;
+	rhythmdb_commit (db);
+	return FALSE;
+}
+
+/* deleting or moving a directory produces an event for each file in it,
+ * so commit the resulting changes once the burst is over rather than
+ * after each event.
+ */
+static void
+queue_monitor_commit (RhythmDB *db)
+{
+	if (db->priv->monitor_commit_id == 0) {
+		db->priv->monitor_commit_id = g_idle_add ((GSourceFunc) rhythmdb_monitor_commit, db);
+	}
+}
+
+static void
+count_monitor_event (RhythmDB *db)
+{
+	gint64 now;
+	double elapsed;
+
+	now = g_get_monotonic_time ();
+	if (db->priv->monitor_events_start == 0)
+		db->priv->monitor_events_start = now;
+
+	db->priv->monitor_events++;
+	elapsed = (double) (now - db->priv->monitor_events_start) / G_USEC_PER_SEC;
+	if (elapsed >= RHYTHMDB_MONITOR_STATS_INTERVAL) {
+		rb_debug ("%u directory events in %.0f seconds (%.1f/sec), %u directories monitored",
+			  db->priv->monitor_events,
+			  elapsed,
+			  db->priv->monitor_events / elapsed,
+			  g_hash_table_size (db->priv->monitored_directories));
+		db->priv->monitor_events = 0;
+		db->priv->monitor_events_start = now;
+	}
+}
+
+static gboolean
+is_library_uri (RhythmDB *db, const char *uri)
+{
+	int i;
+
+	if (db->priv->library_locations == NULL)
+		return FALSE;
+
+	for (i = 0; db->priv->library_locations[i] != NULL; i++) {
+		if (g_str_has_prefix (uri, db->priv->library_locations[i]))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* returns the location @file ends up at when @from is moved to @to */
+static GFile *
+moved_location (GFile *file, GFile *from, GFile *to)
+{
+	GFile *moved;
+	char *path;
+
+	if (g_file_equal (file, from))
+		return g_object_ref (to);
+
+	path = g_file_get_relative_path (from, file);
+	if (path == NULL)
+		return NULL;
+
+	moved = g_file_resolve_relative_path (to, path);
+	g_free (path);
+	return moved;
+}
+
+/* monitors don't follow their directories when they move, so when a
+ * directory moves, drop the monitors for it and everything under it, and
+ * monitor the new locations instead, unless they're outside the library.
+ */
+static void
+move_monitors (RhythmDB *db, GFile *from, GFile *to)
+{
+	GHashTableIter iter;
+	GFile *directory;
+	GList *moved = NULL;
+	GList *link;
+	GList *next;
+	gboolean follow;
+	char *uri;
+
+	uri = g_file_get_uri (to);
+	follow = is_library_uri (db, uri);
+	g_free (uri);
+
+	g_mutex_lock (&db->priv->monitor_mutex);
+	g_hash_table_iter_init (&iter, db->priv->monitored_directories);
+	while (g_hash_table_iter_next (&iter, (gpointer *) &directory, NULL)) {
+		GFile *location;
+
+		location = moved_location (directory, from, to);
+		if (location == NULL)
+			continue;
+
+		if (follow)
+			moved = g_list_prepend (moved, location);
+		else
+			g_object_unref (location);
+		g_hash_table_iter_remove (&iter);
+	}
+	g_mutex_unlock (&db->priv->monitor_mutex);
+
+	/* directories still waiting to be monitored have moved too */
+	for (link = db->priv->pending_monitors->head; link != NULL; link = next) {
+		GFile *location;
+
+		next = link->next;
+		location = moved_location (link->data, from, to);
+		if (location == NULL)
+			continue;
+
+		g_object_unref (link->data);
+		g_queue_delete_link (db->priv->pending_monitors, link);
+		if (follow)
+			moved = g_list_prepend (moved, location);
+		else
+			g_object_unref (location);
+	}
+
+	if (moved != NULL)
+		rb_debug ("moving %u monitors", g_list_length (moved));
+	for (link = moved; link != NULL; link = link->next) {
+		queue_monitor (db, link->data);
+		g_object_unref (link->data);
+	}
+	g_list_free (moved);
+}
+
 static void
 rhythmdb_directory_change_cb (GFileMonitor *monitor,
 			      GFile *file,
@@ -265,30 +624,19 @@ rhythmdb_directory_change_cb (GFileMonitor *monitor,
 	}
 
 	rb_debug ("directory event %d for %s", event_type, canon_uri);
+	count_monitor_event (db);
 
 	switch (event_type) {
         case G_FILE_MONITOR_EVENT_CREATED:
-		{
-			gboolean in_library = FALSE;
-			int i;
-
-			if (!g_settings_get_boolean (db->priv->settings, "monitor-library"))
-				break;
-
-			if (rb_uri_is_hidden (canon_uri))
-				break;
-
-			/* ignore new files outside of the library locations */
-			for (i = 0; db->priv->library_locations[i] != NULL; i++) {
-				if (g_str_has_prefix (canon_uri, db->priv->library_locations[i])) {
-					in_library = TRUE;
-					break;
-				}
-			}
+		if (!g_settings_get_boolean (db->priv->settings, "monitor-library"))
+			break;
 
-			if (!in_library)
-				break;
-		}
+		if (rb_uri_is_hidden (canon_uri))
+			break;
+
+		/* ignore new files outside of the library locations */
+		if (!is_library_uri (db, canon_uri))
+			break;
 
 		/* process directories immediately */
 		if (rb_uri_is_directory (canon_uri)) {
@@ -308,11 +656,16 @@ rhythmdb_directory_change_cb (GFileMonitor *monitor,
 		/* hmm.. */
 		break;
 	case G_FILE_MONITOR_EVENT_DELETED:
+		/* stop monitoring deleted directories */
+		g_mutex_lock (&db->priv->monitor_mutex);
+		g_hash_table_remove (db->priv->monitored_directories, file);
+		g_mutex_unlock (&db->priv->monitor_mutex);
+
 		entry = rhythmdb_entry_lookup_by_location (db, canon_uri);
 		if (entry != NULL) {
 			g_hash_table_remove (db->priv->changed_files, entry->location);
 			rhythmdb_entry_set_visibility (db, entry, FALSE);
-			rhythmdb_commit (db);
+			queue_monitor_commit (db);
 		}
 		break;
 	case G_FILE_MONITOR_EVENT_MOVED:
@@ -320,6 +673,8 @@ rhythmdb_directory_change_cb (GFileMonitor *monitor,
 			break;
 		}
 
+		move_monitors (db, file, other_file);
+
 		entry = rhythmdb_entry_lookup_by_location (db, other_canon_uri);
 		if (entry != NULL) {
 			rb_debug ("file move target %s already exists in database", other_canon_uri);
@@ -327,7 +682,7 @@ rhythmdb_directory_change_cb (GFileMonitor *monitor,
 			if (entry != NULL) {
 				g_hash_table_remove (db->priv->changed_files, entry->location);
 				rhythmdb_entry_set_visibility (db, entry, FALSE);
-				rhythmdb_commit (db);
+				queue_monitor_commit (db);
 			}
 		} else {
 			entry = rhythmdb_entry_lookup_by_location (db, canon_uri);
@@ -30,6 +30,7 @@
 
 #include <rhythmdb/rhythmdb.h>
 #include <rhythmdb/rb-refstring.h>
+#include <rhythmdb/rhythmdb-dir-index.h>
 #include <metadata/rb-metadata.h>
 
 G_BEGIN_DECLS
@@ -97,6 +98,12 @@ struct _RhythmDBEntry {
 	double bpm;
 	GDate date;
 
+	/* replaygain; a peak of 0 means the track hasn't been analysed */
+	double track_gain;
+	double track_peak;
+	double album_gain;
+	double album_peak;
+
 	/* filesystem */
 	RBRefString *location;
 	RBRefString *mountpoint;
@@ -115,11 +122,24 @@ struct _RhythmDBEntry {
 	gpointer last_played_str;
 	gpointer first_seen_str;
 	gpointer last_seen_str;
+	gpointer sort_keys;
 
 	/* playback error string */
 	RBRefString *playback_error;
 };
 
+/* packed sort keys used by the query model sort functions */
+typedef enum {
+	RHYTHMDB_SORT_KEY_TITLE,
+	RHYTHMDB_SORT_KEY_ALBUM,
+	RHYTHMDB_SORT_KEY_ARTIST,
+	RHYTHMDB_SORT_KEY_COMPOSER,
+	RHYTHMDB_SORT_KEY_GENRE,
+	RHYTHMDB_NUM_SORT_KEYS
+} RhythmDBSortKeyType;
+
+int		rhythmdb_entry_sort_key_compare	(RhythmDBEntry *a, RhythmDBEntry *b, RhythmDBSortKeyType type);
+
 struct _RhythmDBPrivate
 {
 	char *name;
@@ -138,6 +158,8 @@ struct _RhythmDBPrivate
 	GAsyncQueue *restored_queue;
 	GAsyncQueue *delayed_write_queue;
 	GThreadPool *query_thread_pool;
+	GThreadPool *load_thread_pool;
+	GAsyncQueue *load_queue;
 
 	GList *stat_list;
 	GList *outstanding_stats;
@@ -154,11 +176,25 @@ struct _RhythmDBPrivate
 	guint changed_files_id;
 	char **library_locations;
 	GMutex monitor_mutex;
+	GQueue *pending_monitors;
+	guint add_monitors_id;
+	guint max_monitors;
+	gboolean monitor_limit_reached;
+	guint monitor_commit_id;
+	guint monitor_events;
+	gint64 monitor_events_start;
+	RhythmDBDirIndex *dir_index;
+	guint library_walks;
 
 	gboolean dry_run;
 	gboolean no_update;
 
+	/* sort keys replaced while query threads may be reading them */
+	GMutex stale_sort_keys_mutex;
+	GSList *stale_sort_keys;
+
 	GMutex change_mutex;
+	volatile gint commit_generation;	/* incremented on every commit */
 	GHashTable *added_entries;
 	GHashTable *changed_entries;
 	GHashTable *deleted_entries;
@@ -173,6 +209,19 @@ struct _RhythmDBPrivate
 	guint save_count;
 
 	guint event_queue_watch_id;
+	GMutex event_queue_mutex;
+	GCond event_queue_cond;
+	gboolean processing_events;
+	gboolean event_commit_pending;
+
+	/* event queue statistics, updated in the main thread */
+	guint64 events_processed;
+	guint64 event_batches;
+	guint64 event_latency_total;
+	guint64 event_latency_max;
+	guint event_queue_peak;
+	gint event_queue_waits;
+
 	guint commit_timeout_id;
 	guint save_timeout_id;
 
@@ -185,6 +234,12 @@ struct _RhythmDBPrivate
 	gboolean saving;
 	gboolean dirty;
 
+	GMutex journal_mutex;
+	GPtrArray *journal;
+	GHashTable *journal_entries;
+	gboolean journal_enabled;
+	gboolean journal_valid;
+
 	GHashTable *entry_type_map;
 	GMutex entry_type_map_mutex;
 	GMutex entry_type_mutex;
@@ -216,6 +271,7 @@ typedef struct
 
 	GError *error;
 	RhythmDB *db;
+	gint64 queued_time;
 
 	/* STAT */
 	GFileInfo *file_info;
@@ -239,6 +295,18 @@ void rhythmdb_entry_set_internal (RhythmDB *db, RhythmDBEntry *entry,
 				  const GValue *value);
 void rhythmdb_entry_type_foreach (RhythmDB *db, GHFunc func, gpointer data);
 RhythmDBEntry *	rhythmdb_entry_lookup_by_location_refstring (RhythmDB *db, RBRefString *uri);
+void rhythmdb_commit_without_sync (RhythmDB *db);
+
+/* changes made since the last save, in the order they were made.
+ * records with an entry should be saved with the entry's current state;
+ * records with a location mean the entry at that location was removed.
+ */
+typedef struct {
+	RhythmDBEntry *entry;
+	RBRefString *location;
+} RhythmDBJournalRecord;
+
+GPtrArray *	rhythmdb_journal_steal		(RhythmDB *db);
 
 /* from rhythmdb-monitor.c */
 void rhythmdb_init_monitoring (RhythmDB *db);
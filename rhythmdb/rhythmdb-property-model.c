@@ -73,6 +73,7 @@ static void rhythmdb_property_model_get_property (GObject *object,
 					       GValue *value,
 					       GParamSpec *pspec);
 static void rhythmdb_property_model_sync (RhythmDBPropertyModel *model);
+static void rhythmdb_property_model_prop_row_changed (RhythmDBPropertyModel *model, GSequenceIter *ptr);
 static void rhythmdb_property_model_row_inserted_cb (GtkTreeModel *model,
 						     GtkTreePath *path,
 						     GtkTreeIter *iter,
@@ -188,6 +189,8 @@ struct RhythmDBPropertyModelPrivate
 
 	RhythmDBPropertyModelEntry *all;
 
+	/* property rows to emit row-changed for at the next sync */
+	GHashTable *changed_props;
 	guint syncing_id;
 };
 
@@ -505,6 +508,7 @@ rhythmdb_property_model_init (RhythmDBPropertyModel *model)
 
 	model->priv->properties = g_sequence_new (NULL);
 	model->priv->reverse_map = g_hash_table_new (g_str_hash, g_str_equal);
+	model->priv->changed_props = g_hash_table_new (g_direct_hash, g_direct_equal);
 	model->priv->entries = g_hash_table_new (g_direct_hash, g_direct_equal);
 
 	model->priv->all = g_new0 (RhythmDBPropertyModelEntry, 1);
@@ -563,6 +567,7 @@ rhythmdb_property_model_finalize (GObject *object)
 	g_return_if_fail (model->priv != NULL);
 
 	g_hash_table_destroy (model->priv->reverse_map);
+	g_hash_table_destroy (model->priv->changed_props);
 
 	g_sequence_foreach (model->priv->properties, (GFunc)_prop_model_entry_cleanup, NULL);
 	g_sequence_free (model->priv->properties);
@@ -816,10 +821,7 @@ rhythmdb_property_model_insert (RhythmDBPropertyModel *model,
 			property_sort_changed (model, ptr, &iter);
 		}
 
-		path = rhythmdb_property_model_get_path (GTK_TREE_MODEL (model), &iter);
-		gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
-		gtk_tree_path_free (path);
-
+		rhythmdb_property_model_prop_row_changed (model, ptr);
 		return prop;
 	}
 	rb_debug ("adding new property \"%s\"", propstr);
@@ -878,12 +880,12 @@ rhythmdb_property_model_delete_prop (RhythmDBPropertyModel *model,
 	rb_debug ("deleting \"%s\": refcount: %d", propstr, prop->refcount);
 	if (g_atomic_int_dec_and_test (&prop->refcount) == FALSE) {
 		g_assert (ret == FALSE);
-		path = rhythmdb_property_model_get_path (GTK_TREE_MODEL (model), &iter);
-		gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
-		gtk_tree_path_free (path);
+		rhythmdb_property_model_prop_row_changed (model, ptr);
 		return;
 	}
 
+	g_hash_table_remove (model->priv->changed_props, ptr);
+
 	path = rhythmdb_property_model_get_path (GTK_TREE_MODEL (model), &iter);
 	g_signal_emit (G_OBJECT (model), rhythmdb_property_model_signals[PRE_ROW_DELETION], 0);
 	gtk_tree_model_row_deleted (GTK_TREE_MODEL (model), path);
@@ -1420,10 +1422,22 @@ rhythmdb_property_model_enable_drag (RhythmDBPropertyModel *model,
 static gboolean
 rhythmdb_property_model_perform_sync (RhythmDBPropertyModel *model)
 {
+	GHashTableIter hiter;
 	GtkTreeIter iter;
 	GtkTreePath *path;
+	gpointer ptr;
 
 	iter.stamp = model->priv->stamp;
+
+	g_hash_table_iter_init (&hiter, model->priv->changed_props);
+	while (g_hash_table_iter_next (&hiter, &ptr, NULL)) {
+		iter.user_data = ptr;
+		path = rhythmdb_property_model_get_path (GTK_TREE_MODEL (model), &iter);
+		gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
+		gtk_tree_path_free (path);
+	}
+	g_hash_table_remove_all (model->priv->changed_props);
+
 	iter.user_data = model->priv->all;
 	path = rhythmdb_property_model_get_path (GTK_TREE_MODEL (model), &iter);
 	gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
@@ -1442,6 +1456,17 @@ rhythmdb_property_model_sync (RhythmDBPropertyModel *model)
 	model->priv->syncing_id = g_idle_add ((GSourceFunc)rhythmdb_property_model_perform_sync, model);
 }
 
+/* row-changed for existing property rows is deferred until the next sync,
+ * so when many entries with the same property value change at once,
+ * the row is only updated once.
+ */
+static void
+rhythmdb_property_model_prop_row_changed (RhythmDBPropertyModel *model, GSequenceIter *ptr)
+{
+	g_hash_table_add (model->priv->changed_props, ptr);
+	rhythmdb_property_model_sync (model);
+}
+
 /* This should really be standard. */
 #define ENUM_ENTRY(NAME, DESC) { NAME, "" #NAME "", DESC }
 
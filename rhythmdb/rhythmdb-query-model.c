@@ -38,10 +38,16 @@
 #include <gtk/gtk.h>
 
 #include "rhythmdb-query-model.h"
+#include "rhythmdb-private.h"
 #include "rb-debug.h"
 #include "rb-tree-dnd.h"
 #include "rb-util.h"
 
+/* changes to at least this many entries at once are handled by
+ * re-sorting the whole model rather than moving each entry.
+ */
+#define RHYTHMDB_QUERY_MODEL_RESORT_BATCH_SIZE	(32)
+
 struct ReverseSortData
 {
 	GCompareDataFunc	func;
@@ -80,14 +86,15 @@ static void rhythmdb_query_model_do_insert (RhythmDBQueryModel *model,
 					    gint index);
 static void rhythmdb_query_model_entry_added_cb (RhythmDB *db, RhythmDBEntry *entry,
 						 RhythmDBQueryModel *model);
-static void rhythmdb_query_model_entry_changed_cb (RhythmDB *db, RhythmDBEntry *entry,
-						   GPtrArray *changes, RhythmDBQueryModel *model);
+static void rhythmdb_query_model_entries_changed_cb (RhythmDB *db, GPtrArray *entries, GPtrArray *changes,
+						     const RhythmDBPropMask *props, RhythmDBQueryModel *model);
 static void rhythmdb_query_model_entry_deleted_cb (RhythmDB *db, RhythmDBEntry *entry,
 						   RhythmDBQueryModel *model);
 
 static void rhythmdb_query_model_filter_out_entry (RhythmDBQueryModel *model,
 						   RhythmDBEntry *entry);
 static gboolean rhythmdb_query_model_do_reorder (RhythmDBQueryModel *model, RhythmDBEntry *entry);
+static void rhythmdb_query_model_resort (RhythmDBQueryModel *model);
 static gboolean rhythmdb_query_model_emit_reorder (RhythmDBQueryModel *model, gint old_pos, gint new_pos);
 static gboolean rhythmdb_query_model_drag_data_get (RbTreeDragSource *dragsource,
 							  GList *paths,
@@ -168,6 +175,8 @@ static void rhythmdb_query_model_base_entry_prop_changed (RhythmDBQueryModel *ba
 static int rhythmdb_query_model_child_index_to_base_index (RhythmDBQueryModel *model, int index);
 
 static gint _reverse_sorting_func (gpointer a, gpointer b, struct ReverseSortData *model);
+static void rhythmdb_query_model_free_bulk_results (RhythmDBQueryModel *model);
+static void rhythmdb_query_model_insert_bulk_results (RhythmDBQueryModel *model);
 static gboolean rhythmdb_query_model_within_limit (RhythmDBQueryModel *model,
 						   RhythmDBEntry *entry);
 static gboolean rhythmdb_query_model_reapply_query_cb (RhythmDBQueryModel *model);
@@ -219,6 +228,7 @@ struct _RhythmDBQueryModelPrivate
 
 	GPtrArray *query;
 	GPtrArray *original_query;
+	RhythmDBCompiledQuery *compiled_query;
 
 	guint stamp;
 
@@ -234,6 +244,10 @@ struct _RhythmDBQueryModelPrivate
 	GHashTable *limited_reverse_map;
 	GHashTable *hidden_entry_map;
 
+	/* results of a running query, inserted when it completes */
+	GPtrArray *bulk_entries;
+	GHashTable *bulk_map;
+
 	gint pending_update_count;
 
 	gboolean reorder_drag_and_drop;
@@ -552,6 +566,10 @@ rhythmdb_query_model_set_query_internal (RhythmDBQueryModel *model,
 	model->priv->original_query = rhythmdb_query_copy (model->priv->query);
 	rhythmdb_query_preprocess (model->priv->db, model->priv->query);
 
+	/* entries are checked against the query every time they change */
+	rhythmdb_compiled_query_free (model->priv->compiled_query);
+	model->priv->compiled_query = rhythmdb_query_compile (model->priv->db, model->priv->query);
+
 	/* if the query contains time-relative criteria, re-run it periodically.
 	 * currently it's just every minute, but perhaps it could be smarter.
 	 */
@@ -706,8 +724,8 @@ rhythmdb_query_model_constructed (GObject *object)
 				 G_CALLBACK (rhythmdb_query_model_entry_added_cb),
 				 model, 0);
 	g_signal_connect_object (G_OBJECT (model->priv->db),
-				 "entry_changed",
-				 G_CALLBACK (rhythmdb_query_model_entry_changed_cb),
+				 "entries-changed",
+				 G_CALLBACK (rhythmdb_query_model_entries_changed_cb),
 				 model, 0);
 	g_signal_connect_object (G_OBJECT (model->priv->db),
 				 "entry_deleted",
@@ -760,6 +778,8 @@ rhythmdb_query_model_dispose (GObject *object)
 		model->priv->query_reapply_timeout_id = 0;
 	}
 
+	rhythmdb_query_model_free_bulk_results (model);
+
 	G_OBJECT_CLASS (rhythmdb_query_model_parent_class)->dispose (object);
 }
 
@@ -789,6 +809,7 @@ rhythmdb_query_model_finalize (GObject *object)
 		rhythmdb_query_free (model->priv->query);
 	if (model->priv->original_query)
 		rhythmdb_query_free (model->priv->original_query);
+	rhythmdb_compiled_query_free (model->priv->compiled_query);
 
 	if (model->priv->sort_data_destroy && model->priv->sort_data)
 		model->priv->sort_data_destroy (model->priv->sort_data);
@@ -879,7 +900,7 @@ static void
 _copy_contents_foreach_cb (RhythmDBEntry *entry, RhythmDBQueryModel *dest)
 {
 	if (dest->priv->query == NULL ||
-	    rhythmdb_evaluate_query (dest->priv->db, dest->priv->query, entry)) {
+	    rhythmdb_compiled_query_evaluate (dest->priv->compiled_query, entry)) {
 		if (dest->priv->show_hidden || (rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN) == FALSE))
 			rhythmdb_query_model_do_insert (dest, entry, -1);
 	}
@@ -1025,7 +1046,7 @@ rhythmdb_query_model_entry_added_cb (RhythmDB *db,
 	}
 
 	if (model->priv->query != NULL) {
-		insert = rhythmdb_evaluate_query (db, model->priv->query, entry);
+		insert = rhythmdb_compiled_query_evaluate (model->priv->compiled_query, entry);
 	} else {
 		index = GPOINTER_TO_INT (g_hash_table_lookup (model->priv->hidden_entry_map, entry));
 		insert = g_hash_table_remove (model->priv->hidden_entry_map, entry);
@@ -1038,24 +1059,34 @@ rhythmdb_query_model_entry_added_cb (RhythmDB *db,
 	}
 }
 
-static void
-rhythmdb_query_model_entry_changed_cb (RhythmDB *db,
-				       RhythmDBEntry *entry,
-				       GPtrArray *changes,
-				       RhythmDBQueryModel *model)
+/* handles a change to a single entry.  if resort_later is TRUE and the
+ * entry may need to move, this returns TRUE and leaves it to the caller.
+ */
+static gboolean
+rhythmdb_query_model_process_entry_change (RhythmDBQueryModel *model,
+					   RhythmDBEntry *entry,
+					   GPtrArray *changes,
+					   gboolean resort_later)
 {
+	RhythmDB *db = model->priv->db;
 	gboolean hidden = FALSE;
 	int i;
 
 	hidden = (!model->priv->show_hidden && rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN));
 
+	/* the query that found the entry may no longer apply to it,
+	 * so treat it as if it wasn't found at all.
+	 */
+	if (model->priv->bulk_map != NULL)
+		g_hash_table_remove (model->priv->bulk_map, entry);
+
 	if (g_hash_table_lookup (model->priv->reverse_map, entry) == NULL) {
 		if (hidden == FALSE) {
 			/* the changed entry may now satisfy the query
 			 * so we test it */
 			rhythmdb_query_model_entry_added_cb (db, entry, model);
 		}
-		return;
+		return FALSE;
 	}
 
 	if (hidden) {
@@ -1106,7 +1137,7 @@ rhythmdb_query_model_entry_changed_cb (RhythmDB *db,
 		}
 
 		rhythmdb_query_model_filter_out_entry (model, entry);
-		return;
+		return FALSE;
 	}
 
 	/* emit separate change signals for each property
@@ -1132,11 +1163,14 @@ rhythmdb_query_model_entry_changed_cb (RhythmDB *db,
 	}
 
 	if (model->priv->query &&
-	    !rhythmdb_evaluate_query (db, model->priv->query, entry)) {
+	    !rhythmdb_compiled_query_evaluate (model->priv->compiled_query, entry)) {
 		rhythmdb_query_model_filter_out_entry (model, entry);
-		return;
+		return FALSE;
 	}
 
+	if (resort_later)
+		return TRUE;
+
 	/* it may have moved, so we can't just emit a changed entry */
 	if (!rhythmdb_query_model_do_reorder (model, entry)) {
 		/* but if it didn't, we can */
@@ -1151,6 +1185,55 @@ rhythmdb_query_model_entry_changed_cb (RhythmDB *db,
 			gtk_tree_path_free (path);
 		}
 	}
+	return FALSE;
+}
+
+static void
+rhythmdb_query_model_entries_changed_cb (RhythmDB *db,
+					 GPtrArray *entries,
+					 GPtrArray *changes,
+					 const RhythmDBPropMask *props,
+					 RhythmDBQueryModel *model)
+{
+	GPtrArray *moved = NULL;
+	guint i;
+
+	/* moving each changed entry separately costs a reorder signal
+	 * covering the whole model for every entry, so for larger batches,
+	 * re-sort the model once after applying all the changes.
+	 */
+	if (entries->len >= RHYTHMDB_QUERY_MODEL_RESORT_BATCH_SIZE &&
+	    model->priv->sort_func != NULL &&
+	    g_sequence_get_length (model->priv->limited_entries) == 0) {
+		moved = g_ptr_array_new ();
+	}
+
+	for (i = 0; i < entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (entries, i);
+
+		if (rhythmdb_query_model_process_entry_change (model, entry, g_ptr_array_index (changes, i), moved != NULL))
+			g_ptr_array_add (moved, entry);
+	}
+
+	if (moved == NULL)
+		return;
+
+	if (moved->len > 0) {
+		rb_debug ("re-sorting model after %u entries changed", moved->len);
+		rhythmdb_query_model_resort (model);
+
+		for (i = 0; i < moved->len; i++) {
+			GtkTreeIter iter;
+			GtkTreePath *path;
+
+			if (rhythmdb_query_model_entry_to_iter (model, g_ptr_array_index (moved, i), &iter)) {
+				path = rhythmdb_query_model_get_path (GTK_TREE_MODEL (model), &iter);
+				gtk_tree_model_row_changed (GTK_TREE_MODEL (model), path, &iter);
+				gtk_tree_path_free (path);
+			}
+		}
+	}
+	g_ptr_array_free (moved, TRUE);
 }
 
 static void
@@ -1174,6 +1257,8 @@ rhythmdb_query_model_entry_deleted_cb (RhythmDB *db,
 				       RhythmDBEntry *entry,
 				       RhythmDBQueryModel *model)
 {
+	if (model->priv->bulk_map != NULL)
+		g_hash_table_remove (model->priv->bulk_map, entry);
 
 	if (g_hash_table_lookup (model->priv->reverse_map, entry) ||
 	    g_hash_table_lookup (model->priv->limited_reverse_map, entry))
@@ -1205,6 +1290,21 @@ idle_process_update (struct RhythmDBQueryModelUpdate *update)
 	{
 		guint i;
 
+		if (update->model->priv->bulk_entries != NULL) {
+			rb_debug ("collecting %d rows", update->entrydata.entries->len);
+
+			/* the entries' references move to the bulk array */
+			for (i = 0; i < update->entrydata.entries->len; i++ ) {
+				RhythmDBEntry *entry = g_ptr_array_index (update->entrydata.entries, i);
+
+				g_ptr_array_add (update->model->priv->bulk_entries, entry);
+				g_hash_table_insert (update->model->priv->bulk_map, entry, GINT_TO_POINTER (1));
+			}
+
+			g_ptr_array_free (update->entrydata.entries, TRUE);
+			break;
+		}
+
 		rb_debug ("inserting %d rows", update->entrydata.entries->len);
 
 		for (i = 0; i < update->entrydata.entries->len; i++ ) {
@@ -1212,11 +1312,9 @@ idle_process_update (struct RhythmDBQueryModelUpdate *update)
 
 			if (update->model->priv->show_hidden || !rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN)) {
 				RhythmDBQueryModel *base_model = update->model->priv->base_model;
-				if (base_model &&
-				    g_hash_table_lookup (base_model->priv->reverse_map, entry) == NULL)
-					       continue;
-
-				rhythmdb_query_model_do_insert (update->model, entry, -1);
+				if (base_model == NULL ||
+				    g_hash_table_lookup (base_model->priv->reverse_map, entry) != NULL)
+					rhythmdb_query_model_do_insert (update->model, entry, -1);
 			}
 
 			rhythmdb_entry_unref (entry);
@@ -1234,6 +1332,8 @@ idle_process_update (struct RhythmDBQueryModelUpdate *update)
 		break;
 	}
 	case RHYTHMDB_QUERY_MODEL_UPDATE_QUERY_COMPLETE:
+		if (update->model->priv->bulk_entries != NULL)
+			rhythmdb_query_model_insert_bulk_results (update->model);
 		g_signal_emit (G_OBJECT (update->model), rhythmdb_query_model_signals[COMPLETE], 0);
 		break;
 	}
@@ -1662,6 +1762,137 @@ rhythmdb_query_model_do_insert (RhythmDBQueryModel *model,
 	rhythmdb_query_model_update_limited_entries (model);
 }
 
+static void
+rhythmdb_query_model_free_bulk_results (RhythmDBQueryModel *model)
+{
+	if (model->priv->bulk_entries == NULL)
+		return;
+
+	g_ptr_array_foreach (model->priv->bulk_entries, (GFunc) rhythmdb_entry_unref, NULL);
+	g_ptr_array_free (model->priv->bulk_entries, TRUE);
+	g_hash_table_destroy (model->priv->bulk_map);
+	model->priv->bulk_entries = NULL;
+	model->priv->bulk_map = NULL;
+}
+
+static gint
+_bulk_sorting_func (gconstpointer a,
+		    gconstpointer b,
+		    struct ReverseSortData *sort_data)
+{
+	return sort_data->func (*(gpointer *) a, *(gpointer *) b, sort_data->data);
+}
+
+/*
+ * Inserts the results of a completed query.  Rather than doing a sorted
+ * insert for each entry, the results are sorted once and merged with
+ * whatever the model already contains in a single pass, which also
+ * gives us each row's position for the row-inserted signal without
+ * having to look it up.
+ */
+static void
+rhythmdb_query_model_insert_bulk_results (RhythmDBQueryModel *model)
+{
+	RhythmDBQueryModel *base_model = model->priv->base_model;
+	GPtrArray *entries;
+	GHashTable *pending;
+	GCompareDataFunc sort_func = NULL;
+	gpointer sort_data = NULL;
+	struct ReverseSortData reverse_data;
+	struct ReverseSortData array_sort_data;
+	GSequenceIter *ptr;
+	gint position;
+	guint i, j;
+
+	entries = model->priv->bulk_entries;
+	pending = model->priv->bulk_map;
+	model->priv->bulk_entries = NULL;
+	model->priv->bulk_map = NULL;
+
+	/* drop entries that changed or were deleted while the query was
+	 * running, or that have been added to the model since then.
+	 */
+	for (i = 0, j = 0; i < entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (entries, i);
+
+		if (g_hash_table_remove (pending, entry) == FALSE ||
+		    g_hash_table_lookup (model->priv->reverse_map, entry) != NULL ||
+		    (!model->priv->show_hidden && rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN)) ||
+		    (base_model && g_hash_table_lookup (base_model->priv->reverse_map, entry) == NULL)) {
+			rhythmdb_entry_unref (entry);
+			continue;
+		}
+
+		g_ptr_array_index (entries, j++) = entry;
+	}
+	g_ptr_array_set_size (entries, j);
+	g_hash_table_destroy (pending);
+
+	rb_debug ("inserting %d rows from completed query", entries->len);
+
+	if (model->priv->sort_func) {
+		if (model->priv->sort_reverse) {
+			sort_func = (GCompareDataFunc) _reverse_sorting_func;
+			sort_data = &reverse_data;
+			reverse_data.func = model->priv->sort_func;
+			reverse_data.data = model->priv->sort_data;
+		} else {
+			sort_func = model->priv->sort_func;
+			sort_data = model->priv->sort_data;
+		}
+
+		array_sort_data.func = sort_func;
+		array_sort_data.data = sort_data;
+		g_ptr_array_sort_with_data (entries, (GCompareDataFunc) _bulk_sorting_func, &array_sort_data);
+
+		ptr = g_sequence_get_begin_iter (model->priv->entries);
+		position = 0;
+	} else {
+		ptr = g_sequence_get_end_iter (model->priv->entries);
+		position = g_sequence_get_length (model->priv->entries);
+	}
+
+	for (i = 0; i < entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (entries, i);
+		GSequenceIter *new_ptr;
+		GtkTreePath *path;
+		GtkTreeIter iter;
+
+		/* entries that compare equal go after the existing ones, as
+		 * g_sequence_insert_sorted would put them.
+		 */
+		if (sort_func) {
+			while (!g_sequence_iter_is_end (ptr) &&
+			       sort_func (g_sequence_get (ptr), entry, sort_data) <= 0) {
+				ptr = g_sequence_iter_next (ptr);
+				position++;
+			}
+		}
+
+		if (g_hash_table_lookup (model->priv->limited_reverse_map, entry) != NULL)
+			rhythmdb_query_model_remove_from_limited_list (model, entry);
+
+		new_ptr = g_sequence_insert_before (ptr, entry);
+
+		/* the hash now owns the reference from the bulk array */
+		g_hash_table_insert (model->priv->reverse_map, entry, new_ptr);
+
+		model->priv->total_duration += rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_DURATION);
+		model->priv->total_size += rhythmdb_entry_get_uint64 (entry, RHYTHMDB_PROP_FILE_SIZE);
+
+		iter.stamp = model->priv->stamp;
+		iter.user_data = new_ptr;
+		path = gtk_tree_path_new_from_indices (position, -1);
+		gtk_tree_model_row_inserted (GTK_TREE_MODEL (model), path, &iter);
+		gtk_tree_path_free (path);
+		position++;
+	}
+
+	g_ptr_array_free (entries, TRUE);
+
+	rhythmdb_query_model_update_limited_entries (model);
+}
+
 static void
 rhythmdb_query_model_filter_out_entry (RhythmDBQueryModel *model,
 				       RhythmDBEntry *entry)
@@ -2252,7 +2483,27 @@ rhythmdb_query_model_row_drop_position (RbTreeDragDest *drag_dest,
 static void
 rhythmdb_query_model_set_query (RhythmDBQueryResults *results, GPtrArray *query)
 {
+	RhythmDBQueryModel *model = RHYTHMDB_QUERY_MODEL (results);
+
 	g_object_set (G_OBJECT (results), "query", query, NULL);
+
+	/* the collected results are only touched on the main thread */
+	if (rb_is_main_thread () == FALSE)
+		return;
+
+	/* results collected for a previous query that hasn't completed
+	 * yet are inserted now, so they don't wait for this one.
+	 */
+	if (model->priv->bulk_entries != NULL) {
+		rb_debug ("query superseded, inserting %d collected rows", model->priv->bulk_entries->len);
+		rhythmdb_query_model_insert_bulk_results (model);
+	}
+
+	/* collect the query results and insert them all at once when
+	 * the query completes.
+	 */
+	model->priv->bulk_entries = g_ptr_array_new ();
+	model->priv->bulk_map = g_hash_table_new (g_direct_hash, g_direct_equal);
 }
 
 /* Threading: Called from the database query thread for async queries,
@@ -2558,11 +2809,6 @@ rhythmdb_query_model_set_sort_order (RhythmDBQueryModel *model,
 				     GDestroyNotify sort_data_destroy,
 				     gboolean sort_reverse)
 {
-	GSequence *new_entries;
-	GSequenceIter *ptr;
-	int length, i;
-	struct ReverseSortData reverse_data;
-
 	if ((model->priv->sort_func == sort_func) &&
 	    (model->priv->sort_data == sort_data) &&
 	    (model->priv->sort_data_destroy == sort_data_destroy) &&
@@ -2582,11 +2828,31 @@ rhythmdb_query_model_set_sort_order (RhythmDBQueryModel *model,
 	model->priv->sort_data_destroy = sort_data_destroy;
 	model->priv->sort_reverse = sort_reverse;
 
+	rhythmdb_query_model_resort (model);
+}
+
+/* re-sorts all entries in the model using its current sort order */
+static void
+rhythmdb_query_model_resort (RhythmDBQueryModel *model)
+{
+	GCompareDataFunc sort_func;
+	gpointer sort_data;
+	GSequence *new_entries;
+	GSequenceIter *ptr;
+	int length, i;
+	struct ReverseSortData reverse_data;
+
+	if (model->priv->sort_func == NULL)
+		return;
+
 	if (model->priv->sort_reverse) {
-		reverse_data.func = sort_func;
-		reverse_data.data = sort_data;
+		reverse_data.func = model->priv->sort_func;
+		reverse_data.data = model->priv->sort_data;
 		sort_func = (GCompareDataFunc) _reverse_sorting_func;
 		sort_data = &reverse_data;
+	} else {
+		sort_func = model->priv->sort_func;
+		sort_data = model->priv->sort_data;
 	}
 
 	/* create the new sorted entry sequence */
@@ -2680,7 +2946,7 @@ rhythmdb_query_model_base_row_inserted (GtkTreeModel *tree_model,
 	if (!model->priv->show_hidden && rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN))
 		goto out;
 
-	if (rhythmdb_evaluate_query (model->priv->db, model->priv->query, entry)) {
+	if (rhythmdb_compiled_query_evaluate (model->priv->compiled_query, entry)) {
 		/* find the closest previous entry that is in the filter model, and it it after that */
 		prev_entry = rhythmdb_query_model_get_previous_from_entry (base_model, entry);
 		while (prev_entry && g_hash_table_lookup (model->priv->reverse_map, prev_entry) == NULL) {
@@ -2789,9 +3055,7 @@ typedef struct {
 static void
 _reapply_query_foreach_cb (RhythmDBEntry *entry, _ReapplyQueryForeachData *data)
 {
-	if (!rhythmdb_evaluate_query (data->model->priv->db,
-				      data->model->priv->query,
-				      entry)) {
+	if (!rhythmdb_compiled_query_evaluate (data->model->priv->compiled_query, entry)) {
 		data->remove = g_list_prepend (data->remove, entry);
 	}
 }
@@ -2912,27 +3176,7 @@ rhythmdb_query_model_title_sort_func (RhythmDBEntry *a,
 				      RhythmDBEntry *b,
 				      gpointer data)
 {
-	const char *a_val;
-	const char *b_val;
-	gint ret;
-
-	a_val = rhythmdb_entry_get_string (a, RHYTHMDB_PROP_TITLE_SORT_KEY);
-	b_val = rhythmdb_entry_get_string (b, RHYTHMDB_PROP_TITLE_SORT_KEY);
-
-	if (a_val == NULL) {
-		if (b_val == NULL)
-			ret = 0;
-		else
-			ret = -1;
-	} else if (b_val == NULL)
-		ret = 1;
-	else
-		ret = strcmp (a_val, b_val);
-
-	if (ret != 0)
-		return ret;
-	else
-		return rhythmdb_query_model_location_sort_func (a, b, data);
+	return rhythmdb_entry_sort_key_compare (a, b, RHYTHMDB_SORT_KEY_TITLE);
 }
 
 /**
@@ -2951,62 +3195,7 @@ rhythmdb_query_model_album_sort_func (RhythmDBEntry *a,
 				      RhythmDBEntry *b,
 				      gpointer data)
 {
-	const char *a_val;
-	const char *b_val;
-	gulong a_num;
-	gulong b_num;
-	gint ret;
-
-	/* Sort by album name */
-	a_val = rhythmdb_entry_get_string (a, RHYTHMDB_PROP_ALBUM_SORTNAME_SORT_KEY);
-	if (a_val[0] == '\0') {
-		a_val = rhythmdb_entry_get_string (a, RHYTHMDB_PROP_ALBUM_SORT_KEY);
-	}
-	b_val = rhythmdb_entry_get_string (b, RHYTHMDB_PROP_ALBUM_SORTNAME_SORT_KEY);
-	if (b_val[0] == '\0') {
-		b_val = rhythmdb_entry_get_string (b, RHYTHMDB_PROP_ALBUM_SORT_KEY);
-	}
-
-	if (a_val == NULL) {
-		if (b_val == NULL)
-			ret = 0;
-		else
-			ret = -1;
-	} else if (b_val == NULL)
-		ret = 1;
-	else
-		ret = strcmp (a_val, b_val);
-
-	if (ret != 0)
-		return ret;
-
-	/* Then by disc number (assume 1 if non-existent) */
-	a_num = rhythmdb_entry_get_ulong (a, RHYTHMDB_PROP_DISC_NUMBER);
-	b_num = rhythmdb_entry_get_ulong (b, RHYTHMDB_PROP_DISC_NUMBER);
-	a_num = (a_num ? a_num : 1);
-	b_num = (b_num ? b_num : 1);
-	if (a_num != b_num)
-		return (a_num < b_num ? -1 : 1);
-
-	/* by track number (assume 0 if non-existent) */
-	a_num = rhythmdb_entry_get_ulong (a, RHYTHMDB_PROP_TRACK_NUMBER);
-	b_num = rhythmdb_entry_get_ulong (b, RHYTHMDB_PROP_TRACK_NUMBER);
-	if (a_num != b_num)
-		return (a_num < b_num ? -1 : 1);
-
-	/*  by title */
-	a_val = rhythmdb_entry_get_string (a, RHYTHMDB_PROP_TITLE_SORT_KEY);
-	b_val = rhythmdb_entry_get_string (b, RHYTHMDB_PROP_TITLE_SORT_KEY);
-
-	if (a_val == NULL) {
-		if (b_val == NULL)
-			return 0;
-		else
-			return -1;
-	} else if (b_val == NULL)
-		return 1;
-	else
-		return rhythmdb_query_model_location_sort_func (a, b, data);
+	return rhythmdb_entry_sort_key_compare (a, b, RHYTHMDB_SORT_KEY_ALBUM);
 }
 
 /**
@@ -3025,33 +3214,7 @@ rhythmdb_query_model_artist_sort_func (RhythmDBEntry *a,
 				       RhythmDBEntry *b,
 				       gpointer data)
 {
-	const char *a_val;
-	const char *b_val;
-	gint ret;
-
-	a_val = rhythmdb_entry_get_string (a, RHYTHMDB_PROP_ARTIST_SORTNAME_SORT_KEY);
-	if (a_val[0] == '\0') {
-		a_val = rhythmdb_entry_get_string (a, RHYTHMDB_PROP_ARTIST_SORT_KEY);
-	}
-	b_val = rhythmdb_entry_get_string (b, RHYTHMDB_PROP_ARTIST_SORTNAME_SORT_KEY);
-	if (b_val[0] == '\0') {
-		b_val = rhythmdb_entry_get_string (b, RHYTHMDB_PROP_ARTIST_SORT_KEY);
-	}
-
-	if (a_val == NULL) {
-		if (b_val == NULL)
-			ret = 0;
-		else
-			ret = -1;
-	} else if (b_val == NULL)
-		ret = 1;
-	else
-		ret = strcmp (a_val, b_val);
-
-	if (ret != 0)
-		return ret;
-	else
-		return rhythmdb_query_model_album_sort_func (a, b, data);
+	return rhythmdb_entry_sort_key_compare (a, b, RHYTHMDB_SORT_KEY_ARTIST);
 }
 
 /**
@@ -3070,33 +3233,7 @@ rhythmdb_query_model_composer_sort_func (RhythmDBEntry *a,
 				       RhythmDBEntry *b,
 				       gpointer data)
 {
-	const char *a_val;
-	const char *b_val;
-	gint ret;
-
-	a_val = rhythmdb_entry_get_string (a, RHYTHMDB_PROP_COMPOSER_SORTNAME_SORT_KEY);
-	if (a_val[0] == '\0') {
-		a_val = rhythmdb_entry_get_string (a, RHYTHMDB_PROP_COMPOSER_SORT_KEY);
-	}
-	b_val = rhythmdb_entry_get_string (b, RHYTHMDB_PROP_COMPOSER_SORTNAME_SORT_KEY);
-	if (b_val[0] == '\0') {
-		b_val = rhythmdb_entry_get_string (b, RHYTHMDB_PROP_COMPOSER_SORT_KEY);
-	}
-
-	if (a_val == NULL) {
-		if (b_val == NULL)
-			ret = 0;
-		else
-			ret = -1;
-	} else if (b_val == NULL)
-		ret = 1;
-	else
-		ret = strcmp (a_val, b_val);
-
-	if (ret != 0)
-		return ret;
-	else
-		return rhythmdb_query_model_album_sort_func (a, b, data);
+	return rhythmdb_entry_sort_key_compare (a, b, RHYTHMDB_SORT_KEY_COMPOSER);
 }
 
 /**
@@ -3114,27 +3251,7 @@ gint
 rhythmdb_query_model_genre_sort_func (RhythmDBEntry *a, RhythmDBEntry *b,
 				      gpointer data)
 {
-	const char *a_val;
-	const char *b_val;
-	gint ret;
-
-	a_val = rhythmdb_entry_get_string (a, RHYTHMDB_PROP_GENRE_SORT_KEY);
-	b_val = rhythmdb_entry_get_string (b, RHYTHMDB_PROP_GENRE_SORT_KEY);
-
-	if (a_val == NULL) {
-		if (b_val == NULL)
-			ret = 0;
-		else
-			ret = -1;
-	} else if (b_val == NULL)
-		ret = 1;
-	else
-		ret = strcmp (a_val, b_val);
-
-	if (ret != 0)
-		return ret;
-	else
-		return rhythmdb_query_model_artist_sort_func (a, b, data);
+	return rhythmdb_entry_sort_key_compare (a, b, RHYTHMDB_SORT_KEY_GENRE);
 }
 
 /**
@@ -1043,6 +1043,643 @@ rhythmdb_query_to_string (RhythmDB *db, GPtrArray *query)
 	return g_string_free (buf, FALSE);
 }
 
+/**
+ * rhythmdb_query_explain:
+ * @db: a #RhythmDB instance
+ * @query: a query
+ *
+ * Describes how the database backend would run the query: which
+ * index or traversal it would use for each part of the query, how many
+ * entries that is expected to visit, and the order in which the
+ * remaining criteria are checked.  This is only intended for debugging
+ * slow queries.
+ *
+ * Returns: allocated description of the query plan
+ **/
+char *
+rhythmdb_query_explain (RhythmDB *db, GPtrArray *query)
+{
+	RhythmDBClass *klass = RHYTHMDB_GET_CLASS (db);
+	GPtrArray *processed;
+	GString *buf;
+	char *str;
+
+	str = rhythmdb_query_to_string (db, query);
+	buf = g_string_new ("query: ");
+	g_string_append (buf, str);
+	g_string_append_c (buf, '\n');
+	g_free (str);
+
+	if (klass->impl_explain_query != NULL) {
+		processed = rhythmdb_query_copy (query);
+		rhythmdb_query_preprocess (db, processed);
+		str = klass->impl_explain_query (db, processed);
+		g_string_append (buf, str);
+		g_free (str);
+		rhythmdb_query_free (processed);
+	}
+
+	return g_string_free (buf, FALSE);
+}
+
+/*
+ * Compiled queries.
+ *
+ * Evaluating a query directly means looking up the type of each property,
+ * unboxing the query values and going through the generic entry accessors
+ * for every predicate and every entry.  A compiled query does all that
+ * once, producing a flat array of predicates, each with a function
+ * specialised for the type of comparison and the values it compares,
+ * reading the entry fields directly where possible.  Disjunctions are
+ * represented by predicates with no function.
+ */
+
+typedef enum {
+	COMPILED_ACCESS_GENERIC,
+	COMPILED_ACCESS_FIELD,		/* string: RBRefString; numeric: gulong/gdouble */
+	COMPILED_ACCESS_FOLDED_FIELD,	/* folded form of an RBRefString field */
+	COMPILED_ACCESS_LONG_FIELD	/* glong field read as gulong */
+} RhythmDBCompiledAccess;
+
+typedef struct _RhythmDBCompiledPredicate RhythmDBCompiledPredicate;
+
+typedef gboolean (*RhythmDBCompiledPredicateFunc) (RhythmDBCompiledQuery *query,
+						   RhythmDBCompiledPredicate *pred,
+						   RhythmDBEntry *entry);
+
+struct _RhythmDBCompiledPredicate {
+	RhythmDBCompiledPredicateFunc func;
+	RhythmDBQueryType type;
+	RhythmDBPropType propid;
+	RhythmDBCompiledAccess access;
+	goffset offset;
+
+	gulong ulong_val;
+	gdouble double_val;
+	guint64 uint64_val;
+	gboolean boolean_val;
+	gpointer object_val;
+	char *string_val;
+	char **words;
+	RhythmDBCompiledQuery *subquery;
+	GPtrArray *fallback;
+};
+
+struct _RhythmDBCompiledQuery {
+	RhythmDB *db;
+	GArray *predicates;
+};
+
+#define ENTRY_FIELD(entry, type, offset) (G_STRUCT_MEMBER (type, (entry), (offset)))
+
+static gboolean
+compiled_string_field (RhythmDBPropType propid,
+		       goffset *offset,
+		       gboolean *folded)
+{
+	*folded = FALSE;
+	switch (propid) {
+	case RHYTHMDB_PROP_TITLE_FOLDED:
+		*folded = TRUE;
+		/* fall through */
+	case RHYTHMDB_PROP_TITLE:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, title);
+		return TRUE;
+	case RHYTHMDB_PROP_ARTIST_FOLDED:
+		*folded = TRUE;
+		/* fall through */
+	case RHYTHMDB_PROP_ARTIST:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, artist);
+		return TRUE;
+	case RHYTHMDB_PROP_ALBUM_FOLDED:
+		*folded = TRUE;
+		/* fall through */
+	case RHYTHMDB_PROP_ALBUM:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, album);
+		return TRUE;
+	case RHYTHMDB_PROP_GENRE_FOLDED:
+		*folded = TRUE;
+		/* fall through */
+	case RHYTHMDB_PROP_GENRE:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, genre);
+		return TRUE;
+	case RHYTHMDB_PROP_COMPOSER_FOLDED:
+		*folded = TRUE;
+		/* fall through */
+	case RHYTHMDB_PROP_COMPOSER:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, composer);
+		return TRUE;
+	case RHYTHMDB_PROP_ALBUM_ARTIST_FOLDED:
+		*folded = TRUE;
+		/* fall through */
+	case RHYTHMDB_PROP_ALBUM_ARTIST:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, album_artist);
+		return TRUE;
+	case RHYTHMDB_PROP_COMMENT:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, comment);
+		return TRUE;
+	case RHYTHMDB_PROP_LOCATION:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, location);
+		return TRUE;
+	case RHYTHMDB_PROP_MOUNTPOINT:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, mountpoint);
+		return TRUE;
+	case RHYTHMDB_PROP_MEDIA_TYPE:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, media_type);
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+static RhythmDBCompiledAccess
+compiled_numeric_field (RhythmDBPropType propid,
+			goffset *offset)
+{
+	switch (propid) {
+	case RHYTHMDB_PROP_TRACK_NUMBER:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, tracknum);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_DISC_NUMBER:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, discnum);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_DURATION:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, duration);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_BITRATE:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, bitrate);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_MTIME:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, mtime);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_FIRST_SEEN:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, first_seen);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_LAST_SEEN:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, last_seen);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_LAST_PLAYED:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, last_played);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_PLAY_COUNT:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, play_count);
+		return COMPILED_ACCESS_LONG_FIELD;
+	case RHYTHMDB_PROP_RATING:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, rating);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_BPM:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, bpm);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_TRACK_GAIN:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, track_gain);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_TRACK_PEAK:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, track_peak);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_ALBUM_GAIN:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, album_gain);
+		return COMPILED_ACCESS_FIELD;
+	case RHYTHMDB_PROP_ALBUM_PEAK:
+		*offset = G_STRUCT_OFFSET (RhythmDBEntry, album_peak);
+		return COMPILED_ACCESS_FIELD;
+	default:
+		return COMPILED_ACCESS_GENERIC;
+	}
+}
+
+static inline const char *
+compiled_get_string (RhythmDBCompiledPredicate *pred,
+		     RhythmDBEntry *entry)
+{
+	switch (pred->access) {
+	case COMPILED_ACCESS_FIELD:
+		return rb_refstring_get (ENTRY_FIELD (entry, RBRefString *, pred->offset));
+	case COMPILED_ACCESS_FOLDED_FIELD:
+		return rb_refstring_get_folded (ENTRY_FIELD (entry, RBRefString *, pred->offset));
+	default:
+		return rhythmdb_entry_get_string (entry, pred->propid);
+	}
+}
+
+static inline gulong
+compiled_get_ulong (RhythmDBCompiledPredicate *pred,
+		    RhythmDBEntry *entry)
+{
+	switch (pred->access) {
+	case COMPILED_ACCESS_FIELD:
+		return ENTRY_FIELD (entry, gulong, pred->offset);
+	case COMPILED_ACCESS_LONG_FIELD:
+		return ENTRY_FIELD (entry, glong, pred->offset);
+	default:
+		return rhythmdb_entry_get_ulong (entry, pred->propid);
+	}
+}
+
+/* applies a comparison in the same way as the query evaluation in the backend */
+static inline gboolean
+compiled_compare_matches (RhythmDBQueryType type, int cmp)
+{
+	switch (type) {
+	case RHYTHMDB_QUERY_PROP_NOT_EQUAL:
+		return cmp != 0;
+	case RHYTHMDB_QUERY_PROP_GREATER:
+		return cmp >= 0;
+	case RHYTHMDB_QUERY_PROP_LESS:
+		return cmp <= 0;
+	default:
+		return cmp == 0;
+	}
+}
+
+#define COMPILED_CMP(a, b) (((a) > (b)) - ((a) < (b)))
+
+static gboolean
+compiled_string_compare (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	return compiled_compare_matches (pred->type, g_strcmp0 (compiled_get_string (pred, entry), pred->string_val));
+}
+
+static gboolean
+compiled_string_like (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	const char *str = compiled_get_string (pred, entry);
+
+	/* check in case the property is NULL, the value should never be NULL */
+	if (str == NULL)
+		return FALSE;
+
+	return (strstr (str, pred->string_val) != NULL) ^ (pred->type == RHYTHMDB_QUERY_PROP_NOT_LIKE);
+}
+
+static gboolean
+compiled_string_prefix (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	const char *str = compiled_get_string (pred, entry);
+
+	return str != NULL && g_str_has_prefix (str, pred->string_val);
+}
+
+static gboolean
+compiled_string_suffix (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	const char *str = compiled_get_string (pred, entry);
+
+	return str != NULL && g_str_has_suffix (str, pred->string_val);
+}
+
+static gboolean
+compiled_search_match (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	const char *props[5];
+	gboolean islike = TRUE;
+	char **word;
+	int i;
+
+	props[0] = rb_refstring_get_folded (entry->title);
+	props[1] = rb_refstring_get_folded (entry->album);
+	props[2] = rb_refstring_get_folded (entry->artist);
+	props[3] = rb_refstring_get_folded (entry->composer);
+	props[4] = rb_refstring_get_folded (entry->genre);
+
+	for (word = pred->words; word != NULL && *word != NULL; word++) {
+		gboolean found = FALSE;
+
+		for (i = 0; i < G_N_ELEMENTS (props); i++) {
+			if (props[i] != NULL && strstr (props[i], *word) != NULL) {
+				found = TRUE;
+				break;
+			}
+		}
+		if (!found) {
+			islike = FALSE;
+			break;
+		}
+	}
+
+	return islike ^ (pred->type == RHYTHMDB_QUERY_PROP_NOT_LIKE);
+}
+
+static gboolean
+compiled_keyword (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	RBRefString *keyword;
+	gboolean has = FALSE;
+
+	/* keywords may be created after the query is compiled */
+	keyword = rb_refstring_find (pred->string_val);
+	if (keyword != NULL) {
+		has = rhythmdb_entry_keyword_has (query->db, entry, keyword);
+		rb_refstring_unref (keyword);
+	}
+
+	return has ^ (pred->type == RHYTHMDB_QUERY_PROP_NOT_LIKE);
+}
+
+static gboolean
+compiled_ulong_compare (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	gulong value = compiled_get_ulong (pred, entry);
+
+	return compiled_compare_matches (pred->type, COMPILED_CMP (value, pred->ulong_val));
+}
+
+static gboolean
+compiled_double_compare (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	gdouble value;
+
+	if (pred->access == COMPILED_ACCESS_FIELD)
+		value = ENTRY_FIELD (entry, gdouble, pred->offset);
+	else
+		value = rhythmdb_entry_get_double (entry, pred->propid);
+
+	return compiled_compare_matches (pred->type, COMPILED_CMP (value, pred->double_val));
+}
+
+static gboolean
+compiled_uint64_compare (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	guint64 value = rhythmdb_entry_get_uint64 (entry, pred->propid);
+
+	return compiled_compare_matches (pred->type, COMPILED_CMP (value, pred->uint64_val));
+}
+
+static gboolean
+compiled_boolean_compare (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	gboolean value = rhythmdb_entry_get_boolean (entry, pred->propid);
+
+	return compiled_compare_matches (pred->type, COMPILED_CMP (value, pred->boolean_val));
+}
+
+static gboolean
+compiled_object_compare (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	gpointer value;
+
+	if (pred->propid == RHYTHMDB_PROP_TYPE)
+		value = entry->type;
+	else
+		value = rhythmdb_entry_get_object (entry, pred->propid);
+
+	/* like the backend, order objects by address */
+	return compiled_compare_matches (pred->type, COMPILED_CMP ((guintptr) value, (guintptr) pred->object_val));
+}
+
+static gboolean
+compiled_time_within (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	GTimeVal current_time;
+	gulong value;
+
+	value = compiled_get_ulong (pred, entry);
+	g_get_current_time (&current_time);
+
+	if (pred->type == RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN)
+		return value >= (current_time.tv_sec - pred->ulong_val);
+	else
+		return value < (current_time.tv_sec - pred->ulong_val);
+}
+
+static gboolean
+compiled_subquery (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	return rhythmdb_compiled_query_evaluate (pred->subquery, entry);
+}
+
+static gboolean
+compiled_fallback (RhythmDBCompiledQuery *query, RhythmDBCompiledPredicate *pred, RhythmDBEntry *entry)
+{
+	return rhythmdb_evaluate_query (query->db, pred->fallback, entry);
+}
+
+static RhythmDBCompiledQuery *compile_query (RhythmDB *db, GPtrArray *query, gboolean subquery);
+
+static void
+compile_predicate (RhythmDB *db,
+		   RhythmDBQueryData *data,
+		   RhythmDBCompiledPredicate *pred)
+{
+	GType proptype;
+	gboolean folded;
+
+	pred->type = data->type;
+	pred->propid = data->propid;
+
+	if (data->type == RHYTHMDB_QUERY_SUBQUERY) {
+		pred->func = compiled_subquery;
+		pred->subquery = compile_query (db, data->subquery, TRUE);
+		return;
+	}
+
+	proptype = rhythmdb_get_property_type (db, data->propid);
+	switch (data->type) {
+	case RHYTHMDB_QUERY_PROP_LIKE:
+	case RHYTHMDB_QUERY_PROP_NOT_LIKE:
+		if (data->propid == RHYTHMDB_PROP_KEYWORD) {
+			pred->func = compiled_keyword;
+			pred->string_val = g_value_dup_string (data->val);
+			return;
+		} else if (data->propid == RHYTHMDB_PROP_SEARCH_MATCH) {
+			pred->func = compiled_search_match;
+			pred->words = g_strdupv (g_value_get_boxed (data->val));
+			return;
+		} else if (proptype == G_TYPE_STRING) {
+			pred->func = compiled_string_like;
+			break;
+		}
+		/* like the backend, treat this as equality for other types */
+		pred->type = RHYTHMDB_QUERY_PROP_EQUALS;
+		/* fall through */
+	case RHYTHMDB_QUERY_PROP_EQUALS:
+	case RHYTHMDB_QUERY_PROP_NOT_EQUAL:
+	case RHYTHMDB_QUERY_PROP_GREATER:
+	case RHYTHMDB_QUERY_PROP_LESS:
+		switch (proptype) {
+		case G_TYPE_STRING:
+			pred->func = compiled_string_compare;
+			break;
+		case G_TYPE_ULONG:
+			pred->func = compiled_ulong_compare;
+			pred->ulong_val = g_value_get_ulong (data->val);
+			break;
+		case G_TYPE_DOUBLE:
+			pred->func = compiled_double_compare;
+			pred->double_val = g_value_get_double (data->val);
+			break;
+		case G_TYPE_UINT64:
+			pred->func = compiled_uint64_compare;
+			pred->uint64_val = g_value_get_uint64 (data->val);
+			break;
+		case G_TYPE_BOOLEAN:
+			pred->func = compiled_boolean_compare;
+			pred->boolean_val = g_value_get_boolean (data->val);
+			break;
+		case G_TYPE_OBJECT:
+			pred->func = compiled_object_compare;
+			pred->object_val = g_value_get_object (data->val);
+			break;
+		default:
+			break;
+		}
+		break;
+	case RHYTHMDB_QUERY_PROP_PREFIX:
+		pred->func = compiled_string_prefix;
+		break;
+	case RHYTHMDB_QUERY_PROP_SUFFIX:
+		pred->func = compiled_string_suffix;
+		break;
+	case RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN:
+	case RHYTHMDB_QUERY_PROP_CURRENT_TIME_NOT_WITHIN:
+		pred->func = compiled_time_within;
+		pred->ulong_val = g_value_get_ulong (data->val);
+		break;
+	default:
+		break;
+	}
+
+	if (pred->func == NULL) {
+		/* let the backend deal with anything unusual */
+		GPtrArray *single;
+
+		pred->func = compiled_fallback;
+		single = g_ptr_array_new ();
+		g_ptr_array_add (single, data);
+		pred->fallback = rhythmdb_query_copy (single);
+		g_ptr_array_free (single, TRUE);
+		return;
+	}
+
+	if (proptype == G_TYPE_STRING) {
+		if (pred->string_val == NULL)
+			pred->string_val = g_value_dup_string (data->val);
+		if (compiled_string_field (data->propid, &pred->offset, &folded))
+			pred->access = folded ? COMPILED_ACCESS_FOLDED_FIELD : COMPILED_ACCESS_FIELD;
+	} else if (proptype == G_TYPE_ULONG || proptype == G_TYPE_DOUBLE) {
+		pred->access = compiled_numeric_field (data->propid, &pred->offset);
+	}
+}
+
+static RhythmDBCompiledQuery *
+compile_query (RhythmDB *db,
+	       GPtrArray *query,
+	       gboolean subquery)
+{
+	RhythmDBCompiledQuery *compiled;
+	guint len;
+	guint i;
+
+	compiled = g_new0 (RhythmDBCompiledQuery, 1);
+	compiled->db = db;
+	compiled->predicates = g_array_sized_new (FALSE, TRUE, sizeof (RhythmDBCompiledPredicate), query->len);
+
+	/* subqueries ignore an empty final disjunct, top level queries don't */
+	len = query->len;
+	if (subquery && len > 1 &&
+	    ((RhythmDBQueryData *) g_ptr_array_index (query, len - 1))->type == RHYTHMDB_QUERY_DISJUNCTION)
+		len--;
+
+	for (i = 0; i < len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+		RhythmDBCompiledPredicate pred = {0,};
+
+		if (data->type == RHYTHMDB_QUERY_END)
+			continue;
+		if (data->type != RHYTHMDB_QUERY_DISJUNCTION)
+			compile_predicate (db, data, &pred);
+		g_array_append_val (compiled->predicates, pred);
+	}
+
+	return compiled;
+}
+
+/**
+ * rhythmdb_query_compile: (skip)
+ * @db: a #RhythmDB instance
+ * @query: a preprocessed query
+ *
+ * Compiles a query into a form that can be evaluated against entries
+ * much more quickly than the query itself.  This is worthwhile when the
+ * same query is evaluated many times, such as when checking whether
+ * changed entries still belong in a query model.
+ *
+ * Returns: compiled query, to be freed with #rhythmdb_compiled_query_free,
+ * or NULL if @query is NULL
+ */
+RhythmDBCompiledQuery *
+rhythmdb_query_compile (RhythmDB *db, GPtrArray *query)
+{
+	if (query == NULL)
+		return NULL;
+
+	return compile_query (db, query, FALSE);
+}
+
+/**
+ * rhythmdb_compiled_query_evaluate: (skip)
+ * @query: a compiled query
+ * @entry: a #RhythmDBEntry
+ *
+ * Evaluates the given entry against a compiled query.  A NULL
+ * compiled query matches every entry.
+ *
+ * Returns: whether the entry matches the query
+ */
+gboolean
+rhythmdb_compiled_query_evaluate (RhythmDBCompiledQuery *query, RhythmDBEntry *entry)
+{
+	gboolean match = TRUE;
+	guint i;
+
+	if (query == NULL)
+		return TRUE;
+
+	for (i = 0; i < query->predicates->len; i++) {
+		RhythmDBCompiledPredicate *pred;
+
+		pred = &g_array_index (query->predicates, RhythmDBCompiledPredicate, i);
+		if (pred->func == NULL) {
+			/* end of a disjunct */
+			if (match)
+				return TRUE;
+			match = TRUE;
+		} else if (match && pred->func (query, pred, entry) == FALSE) {
+			match = FALSE;
+		}
+	}
+
+	return match;
+}
+
+/**
+ * rhythmdb_compiled_query_free: (skip)
+ * @query: a compiled query
+ *
+ * Frees a compiled query.
+ */
+void
+rhythmdb_compiled_query_free (RhythmDBCompiledQuery *query)
+{
+	guint i;
+
+	if (query == NULL)
+		return;
+
+	for (i = 0; i < query->predicates->len; i++) {
+		RhythmDBCompiledPredicate *pred;
+
+		pred = &g_array_index (query->predicates, RhythmDBCompiledPredicate, i);
+		g_free (pred->string_val);
+		g_strfreev (pred->words);
+		if (pred->subquery != NULL)
+			rhythmdb_compiled_query_free (pred->subquery);
+		if (pred->fallback != NULL)
+			rhythmdb_query_free (pred->fallback);
+	}
+	g_array_free (query->predicates, TRUE);
+	g_free (query);
+}
+
 GType
 rhythmdb_query_get_type (void)
 {
@@ -0,0 +1,821 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <glib/gi18n.h>
+#include <gst/gst.h>
+#include <gst/audio/audio.h>
+
+#include "rhythmdb-replaygain-job.h"
+#include "rhythmdb-private.h"
+#include "rhythmdb-entry-type.h"
+#include "rb-loudness.h"
+#include "rb-debug.h"
+#include "rb-task-progress.h"
+
+#define ANALYSIS_PIPELINE						\
+	"uridecodebin name=decoder ! audioconvert ! "			\
+	"audio/x-raw,format=" GST_AUDIO_NE (F32) ",layout=interleaved ! "	\
+	"fakesink name=sink signal-handoffs=true sync=false"
+
+enum
+{
+	PROP_0,
+	PROP_DB,
+	PROP_WRITE_TAGS,
+	PROP_TASK_LABEL,
+	PROP_TASK_DETAIL,
+	PROP_TASK_PROGRESS,
+	PROP_TASK_OUTCOME,
+	PROP_TASK_NOTIFY,
+	PROP_TASK_CANCELLABLE
+};
+
+enum
+{
+	COMPLETE,
+	LAST_SIGNAL
+};
+
+static void	rhythmdb_replaygain_job_class_init (RhythmDBReplayGainJobClass *klass);
+static void	rhythmdb_replaygain_job_init (RhythmDBReplayGainJob *job);
+static void	rhythmdb_replaygain_job_task_progress_init (RBTaskProgressInterface *iface);
+
+static guint	signals[LAST_SIGNAL] = { 0 };
+
+typedef struct {
+	char *key;			/* NULL for tracks not grouped into an album */
+	RhythmDBEntryType *entry_type;
+	GPtrArray *tracks;
+	int remaining;
+} AlbumGroup;
+
+typedef struct {
+	RhythmDBReplayGainJob *job;
+	AlbumGroup *album;
+	char *uri;
+
+	/* only touched by the analysis thread until the track is done */
+	RBLoudness *meter;
+	guint channels;
+	gboolean failed;
+} TrackAnalysis;
+
+struct _RhythmDBReplayGainJobPrivate
+{
+	RhythmDB	*db;
+	gboolean	write_tags;
+
+	GPtrArray	*entries;
+	GPtrArray	*groups;
+	GHashTable	*albums;
+	GThreadPool	*pool;
+	GCancellable	*cancel;
+
+	int		total;
+	int		processed;
+	gboolean	started;
+	gboolean	complete;
+
+	char		*task_label;
+	gboolean	task_notify;
+};
+
+G_DEFINE_TYPE_EXTENDED (RhythmDBReplayGainJob,
+			rhythmdb_replaygain_job,
+			G_TYPE_OBJECT,
+			0,
+			G_IMPLEMENT_INTERFACE (RB_TYPE_TASK_PROGRESS, rhythmdb_replaygain_job_task_progress_init));
+
+/**
+ * SECTION:rhythmdb-replaygain-job
+ * @short_description: batch loudness analysis job
+ *
+ * Measures the EBU R128 loudness and sample peak of a set of entries,
+ * decoding several files at once on a pool of threads, and stores the
+ * resulting ReplayGain values in the track and album gain and peak
+ * properties.
+ *
+ * Album gain is measured across all the entries in the database that share
+ * the album and album artist (or artist) of an entry added to the job, so
+ * other tracks from the same album are analysed along with it.  Entries
+ * without an album are treated as albums of their own.
+ */
+
+static void
+track_analysis_free (TrackAnalysis *track)
+{
+	rb_loudness_free (track->meter);
+	g_free (track->uri);
+	g_free (track);
+}
+
+static void
+album_group_free (AlbumGroup *album)
+{
+	g_ptr_array_free (album->tracks, TRUE);
+	g_free (album->key);
+	g_free (album);
+}
+
+static AlbumGroup *
+album_group_new (const char *key, RhythmDBEntryType *entry_type)
+{
+	AlbumGroup *album;
+
+	album = g_new0 (AlbumGroup, 1);
+	album->key = g_strdup (key);
+	album->entry_type = entry_type;
+	album->tracks = g_ptr_array_new_with_free_func ((GDestroyNotify) track_analysis_free);
+	return album;
+}
+
+static void
+album_group_add_entry (RhythmDBReplayGainJob *job, AlbumGroup *album, RhythmDBEntry *entry)
+{
+	TrackAnalysis *track;
+
+	track = g_new0 (TrackAnalysis, 1);
+	track->job = job;
+	track->album = album;
+	track->uri = rhythmdb_entry_dup_string (entry, RHYTHMDB_PROP_LOCATION);
+	g_ptr_array_add (album->tracks, track);
+	album->remaining++;
+}
+
+static char *
+album_key (RhythmDBEntry *entry)
+{
+	const char *album;
+	const char *artist;
+
+	album = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_ALBUM);
+	if (album == NULL || album[0] == '\0' || strcmp (album, _("Unknown")) == 0)
+		return NULL;
+
+	artist = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_ALBUM_ARTIST);
+	if (artist == NULL || artist[0] == '\0')
+		artist = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_ARTIST);
+
+	return g_strdup_printf ("%s\t%s", album, artist);
+}
+
+/**
+ * rhythmdb_replaygain_job_new:
+ * @db: the #RhythmDB object
+ * @write_tags: whether to write the results to the files' tags
+ *
+ * Creates a new loudness analysis job.  Before starting the job,
+ * the caller must add one or more entries to analyse.
+ *
+ * Return value: new #RhythmDBReplayGainJob object.
+ */
+RhythmDBReplayGainJob *
+rhythmdb_replaygain_job_new (RhythmDB *db, gboolean write_tags)
+{
+	GObject *obj;
+
+	obj = g_object_new (RHYTHMDB_TYPE_REPLAYGAIN_JOB,
+			    "db", db,
+			    "write-tags", write_tags,
+			    NULL);
+	return RHYTHMDB_REPLAYGAIN_JOB (obj);
+}
+
+/**
+ * rhythmdb_replaygain_job_add_entry:
+ * @job: a #RhythmDBReplayGainJob
+ * @entry: the #RhythmDBEntry to analyse
+ *
+ * Adds an entry to analyse.
+ */
+void
+rhythmdb_replaygain_job_add_entry (RhythmDBReplayGainJob *job, RhythmDBEntry *entry)
+{
+	g_assert (job->priv->started == FALSE);
+
+	g_ptr_array_add (job->priv->entries, rhythmdb_entry_ref (entry));
+}
+
+static void
+set_double (RhythmDB *db, RhythmDBEntry *entry, RhythmDBPropType prop, double value)
+{
+	GValue v = {0,};
+
+	g_value_init (&v, G_TYPE_DOUBLE);
+	g_value_set_double (&v, value);
+	rhythmdb_entry_set (db, entry, prop, &v);
+	g_value_unset (&v);
+}
+
+static void
+finish_album (RhythmDBReplayGainJob *job, AlbumGroup *album)
+{
+	RBLoudness **meters;
+	guint n_meters;
+	double album_gain;
+	double album_peak;
+	gboolean sync;
+	int i;
+
+	if (g_cancellable_is_cancelled (job->priv->cancel))
+		return;
+
+	meters = g_new0 (RBLoudness *, album->tracks->len);
+	n_meters = 0;
+	album_peak = 0.0;
+	for (i = 0; i < album->tracks->len; i++) {
+		TrackAnalysis *track = g_ptr_array_index (album->tracks, i);
+		if (track->failed == FALSE) {
+			meters[n_meters++] = track->meter;
+			album_peak = MAX (album_peak, rb_loudness_get_peak (track->meter));
+		}
+	}
+	album_gain = rb_loudness_to_gain (rb_loudness_get_album_loudness (meters, n_meters));
+	g_free (meters);
+
+	sync = job->priv->write_tags;
+	for (i = 0; i < album->tracks->len; i++) {
+		TrackAnalysis *track = g_ptr_array_index (album->tracks, i);
+		RhythmDBEntry *entry;
+		double gain;
+		double peak;
+
+		if (track->failed)
+			continue;
+
+		/* the entry may have gone away while it was being analysed */
+		entry = rhythmdb_entry_lookup_by_location (job->priv->db, track->uri);
+		if (entry == NULL)
+			continue;
+
+		gain = rb_loudness_to_gain (rb_loudness_get_loudness (track->meter));
+		peak = rb_loudness_get_peak (track->meter);
+		rb_debug ("%s: track gain %.2f dB, peak %.4f", track->uri, gain, peak);
+
+		set_double (job->priv->db, entry, RHYTHMDB_PROP_TRACK_GAIN, gain);
+		set_double (job->priv->db, entry, RHYTHMDB_PROP_TRACK_PEAK, peak);
+		set_double (job->priv->db, entry, RHYTHMDB_PROP_ALBUM_GAIN, album_gain);
+		set_double (job->priv->db, entry, RHYTHMDB_PROP_ALBUM_PEAK, album_peak);
+		if (rhythmdb_entry_can_sync_metadata (entry) == FALSE)
+			sync = FALSE;
+	}
+
+	rb_debug ("album %s: %d tracks, album gain %.2f dB, peak %.4f",
+		  album->key ? album->key : "(none)", n_meters, album_gain, album_peak);
+
+	if (sync) {
+		rhythmdb_commit (job->priv->db);
+	} else {
+		rhythmdb_commit_without_sync (job->priv->db);
+	}
+
+	/* the block loudness data isn't needed any more */
+	for (i = 0; i < album->tracks->len; i++) {
+		TrackAnalysis *track = g_ptr_array_index (album->tracks, i);
+		rb_loudness_free (track->meter);
+		track->meter = NULL;
+	}
+}
+
+static void
+job_complete (RhythmDBReplayGainJob *job)
+{
+	rb_debug ("analysed %d entries", job->priv->processed);
+	if (g_cancellable_is_cancelled (job->priv->cancel) == FALSE)
+		job->priv->complete = TRUE;
+
+	g_object_notify (G_OBJECT (job), "task-outcome");
+	g_signal_emit (job, signals[COMPLETE], 0, job->priv->total);
+
+	/* reference taken in rhythmdb_replaygain_job_start */
+	g_object_unref (job);
+}
+
+static gboolean
+track_done_idle (TrackAnalysis *track)
+{
+	RhythmDBReplayGainJob *job = track->job;
+	AlbumGroup *album = track->album;
+
+	if (track->meter == NULL)
+		track->failed = TRUE;
+
+	job->priv->processed++;
+	if (--album->remaining == 0)
+		finish_album (job, album);
+
+	g_object_notify (G_OBJECT (job), "task-progress");
+	g_object_notify (G_OBJECT (job), "task-detail");
+
+	if (job->priv->processed == job->priv->total)
+		job_complete (job);
+
+	return FALSE;
+}
+
+static gboolean
+job_complete_idle (RhythmDBReplayGainJob *job)
+{
+	job_complete (job);
+	return FALSE;
+}
+
+static void
+handoff_cb (GstElement *sink, GstBuffer *buffer, GstPad *pad, TrackAnalysis *track)
+{
+	GstMapInfo info;
+
+	if (track->meter == NULL) {
+		GstAudioInfo audio_info;
+		GstCaps *caps;
+
+		caps = gst_pad_get_current_caps (pad);
+		if (caps == NULL)
+			return;
+
+		if (gst_audio_info_from_caps (&audio_info, caps)) {
+			track->channels = GST_AUDIO_INFO_CHANNELS (&audio_info);
+			track->meter = rb_loudness_new (GST_AUDIO_INFO_RATE (&audio_info), track->channels);
+		}
+		gst_caps_unref (caps);
+		if (track->meter == NULL)
+			return;
+	}
+
+	if (gst_buffer_map (buffer, &info, GST_MAP_READ)) {
+		rb_loudness_add_frames (track->meter,
+					(const float *) info.data,
+					info.size / (sizeof (float) * track->channels));
+		gst_buffer_unmap (buffer, &info);
+	}
+}
+
+static void
+analyse_track (TrackAnalysis *track, RhythmDBReplayGainJob *job)
+{
+	GstElement *pipeline;
+	GstElement *element;
+	GstBus *bus;
+	GError *error = NULL;
+	gboolean done = FALSE;
+
+	if (g_cancellable_is_cancelled (job->priv->cancel)) {
+		track->failed = TRUE;
+		g_idle_add ((GSourceFunc) track_done_idle, track);
+		return;
+	}
+
+	pipeline = gst_parse_launch (ANALYSIS_PIPELINE, &error);
+	if (pipeline == NULL) {
+		g_warning ("unable to create loudness analysis pipeline: %s", error->message);
+		g_clear_error (&error);
+		track->failed = TRUE;
+		g_idle_add ((GSourceFunc) track_done_idle, track);
+		return;
+	}
+
+	element = gst_bin_get_by_name (GST_BIN (pipeline), "decoder");
+	g_object_set (element, "uri", track->uri, NULL);
+	gst_object_unref (element);
+
+	element = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+	g_signal_connect (element, "handoff", G_CALLBACK (handoff_cb), track);
+	gst_object_unref (element);
+
+	rb_debug ("analysing %s", track->uri);
+	bus = gst_element_get_bus (pipeline);
+	gst_element_set_state (pipeline, GST_STATE_PLAYING);
+	while (done == FALSE) {
+		GstMessage *message;
+
+		message = gst_bus_timed_pop_filtered (bus, 100 * GST_MSECOND, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+		if (message == NULL) {
+			if (g_cancellable_is_cancelled (job->priv->cancel)) {
+				track->failed = TRUE;
+				done = TRUE;
+			}
+			continue;
+		}
+
+		if (GST_MESSAGE_TYPE (message) == GST_MESSAGE_ERROR) {
+			char *debug;
+
+			gst_message_parse_error (message, &error, &debug);
+			rb_debug ("unable to analyse %s: %s (%s)", track->uri, error->message, debug);
+			g_clear_error (&error);
+			g_free (debug);
+			track->failed = TRUE;
+		}
+		gst_message_unref (message);
+		done = TRUE;
+	}
+
+	gst_element_set_state (pipeline, GST_STATE_NULL);
+	gst_object_unref (bus);
+	gst_object_unref (pipeline);
+
+	g_idle_add ((GSourceFunc) track_done_idle, track);
+}
+
+typedef struct {
+	RhythmDBReplayGainJob *job;
+	GHashTable *selected;
+} CollectAlbumData;
+
+static void
+collect_album_entry (RhythmDBEntry *entry, CollectAlbumData *data)
+{
+	RhythmDBReplayGainJob *job = data->job;
+	AlbumGroup *album;
+	char *key;
+
+	/* hidden entries don't count as part of the album, unless
+	 * they were asked for specifically.
+	 */
+	if (rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN) &&
+	    g_hash_table_contains (data->selected, entry) == FALSE)
+		return;
+
+	key = album_key (entry);
+	if (key == NULL)
+		return;
+
+	album = g_hash_table_lookup (job->priv->albums, key);
+	if (album != NULL && album->entry_type == rhythmdb_entry_get_entry_type (entry)) {
+		album_group_add_entry (job, album, entry);
+	}
+	g_free (key);
+}
+
+/**
+ * rhythmdb_replaygain_job_start:
+ * @job: the #RhythmDBReplayGainJob
+ *
+ * Starts the analysis job.  After this method has been called,
+ * no more entries may be added to the job.  May only be called
+ * once for a given job.
+ */
+void
+rhythmdb_replaygain_job_start (RhythmDBReplayGainJob *job)
+{
+	GError *error = NULL;
+	CollectAlbumData data;
+	GHashTable *seen;
+	int i;
+	int j;
+
+	g_assert (job->priv->started == FALSE);
+	job->priv->started = TRUE;
+
+	/* group the entries into albums, then find the rest of each album */
+	seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+	for (i = 0; i < job->priv->entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (job->priv->entries, i);
+		AlbumGroup *album;
+		char *key;
+
+		if (g_hash_table_contains (seen, entry))
+			continue;
+		g_hash_table_add (seen, entry);
+
+		key = album_key (entry);
+		if (key == NULL) {
+			album = album_group_new (NULL, rhythmdb_entry_get_entry_type (entry));
+			album_group_add_entry (job, album, entry);
+			g_ptr_array_add (job->priv->groups, album);
+		} else if (g_hash_table_lookup (job->priv->albums, key) == NULL) {
+			album = album_group_new (key, rhythmdb_entry_get_entry_type (entry));
+			g_hash_table_insert (job->priv->albums, album->key, album);
+			g_ptr_array_add (job->priv->groups, album);
+		}
+		g_free (key);
+	}
+
+	if (g_hash_table_size (job->priv->albums) > 0) {
+		data.job = job;
+		data.selected = seen;
+		rhythmdb_entry_foreach (job->priv->db, (RhythmDBEntryForeachFunc) collect_album_entry, &data);
+	}
+	g_hash_table_destroy (seen);
+
+	for (i = 0; i < job->priv->groups->len; i++) {
+		AlbumGroup *album = g_ptr_array_index (job->priv->groups, i);
+		job->priv->total += album->tracks->len;
+	}
+	rb_debug ("analysing %d entries in %d groups with %d threads",
+		  job->priv->total, job->priv->groups->len, g_get_num_processors ());
+
+	/* reference is released in job_complete */
+	g_object_ref (job);
+	g_object_notify (G_OBJECT (job), "task-progress");
+	g_object_notify (G_OBJECT (job), "task-detail");
+
+	if (job->priv->total == 0) {
+		g_idle_add ((GSourceFunc) job_complete_idle, job);
+		return;
+	}
+
+	job->priv->pool = g_thread_pool_new ((GFunc) analyse_track,
+					     job,
+					     g_get_num_processors (),
+					     FALSE,
+					     &error);
+	if (job->priv->pool == NULL) {
+		g_warning ("unable to create loudness analysis threads: %s", error->message);
+		g_clear_error (&error);
+		g_cancellable_cancel (job->priv->cancel);
+		job->priv->processed = job->priv->total;
+		g_idle_add ((GSourceFunc) job_complete_idle, job);
+		return;
+	}
+
+	/* queue whole albums at a time so finished albums can be committed as we go */
+	for (i = 0; i < job->priv->groups->len; i++) {
+		AlbumGroup *album = g_ptr_array_index (job->priv->groups, i);
+		for (j = 0; j < album->tracks->len; j++) {
+			g_thread_pool_push (job->priv->pool, g_ptr_array_index (album->tracks, j), NULL);
+		}
+	}
+}
+
+/**
+ * rhythmdb_replaygain_job_get_total:
+ * @job: the #RhythmDBReplayGainJob
+ *
+ * Returns the total number of entries that will be analysed by this job,
+ * including other tracks from the albums of the entries added to it.
+ * This is only known once the job has been started.
+ *
+ * Return value: the total number of entries to be analysed
+ */
+int
+rhythmdb_replaygain_job_get_total (RhythmDBReplayGainJob *job)
+{
+	return job->priv->total;
+}
+
+/**
+ * rhythmdb_replaygain_job_get_processed:
+ * @job: the #RhythmDBReplayGainJob
+ *
+ * Returns the number of entries processed by the job so far.
+ *
+ * Return value: the number of entries processed
+ */
+int
+rhythmdb_replaygain_job_get_processed (RhythmDBReplayGainJob *job)
+{
+	return job->priv->processed;
+}
+
+/**
+ * rhythmdb_replaygain_job_cancel:
+ * @job: the #RhythmDBReplayGainJob
+ *
+ * Cancels the analysis job.  Files being decoded are abandoned,
+ * and no further results are stored in the database.
+ */
+void
+rhythmdb_replaygain_job_cancel (RhythmDBReplayGainJob *job)
+{
+	g_cancellable_cancel (job->priv->cancel);
+	g_object_notify (G_OBJECT (job), "task-outcome");
+}
+
+static void
+task_progress_cancel (RBTaskProgress *progress)
+{
+	rhythmdb_replaygain_job_cancel (RHYTHMDB_REPLAYGAIN_JOB (progress));
+}
+
+static void
+rhythmdb_replaygain_job_init (RhythmDBReplayGainJob *job)
+{
+	job->priv = G_TYPE_INSTANCE_GET_PRIVATE (job,
+						 RHYTHMDB_TYPE_REPLAYGAIN_JOB,
+						 RhythmDBReplayGainJobPrivate);
+
+	job->priv->entries = g_ptr_array_new_with_free_func ((GDestroyNotify) rhythmdb_entry_unref);
+	job->priv->groups = g_ptr_array_new_with_free_func ((GDestroyNotify) album_group_free);
+	job->priv->albums = g_hash_table_new (g_str_hash, g_str_equal);
+	job->priv->cancel = g_cancellable_new ();
+	job->priv->task_label = g_strdup (_("Analyzing loudness"));
+}
+
+static void
+impl_set_property (GObject *object,
+		   guint prop_id,
+		   const GValue *value,
+		   GParamSpec *pspec)
+{
+	RhythmDBReplayGainJob *job = RHYTHMDB_REPLAYGAIN_JOB (object);
+
+	switch (prop_id) {
+	case PROP_DB:
+		job->priv->db = RHYTHMDB (g_value_dup_object (value));
+		break;
+	case PROP_WRITE_TAGS:
+		job->priv->write_tags = g_value_get_boolean (value);
+		break;
+	case PROP_TASK_LABEL:
+		g_free (job->priv->task_label);
+		job->priv->task_label = g_value_dup_string (value);
+		break;
+	case PROP_TASK_DETAIL:
+		/* ignore */
+		break;
+	case PROP_TASK_PROGRESS:
+		/* ignore */
+		break;
+	case PROP_TASK_OUTCOME:
+		/* ignore */
+		break;
+	case PROP_TASK_NOTIFY:
+		job->priv->task_notify = g_value_get_boolean (value);
+		break;
+	case PROP_TASK_CANCELLABLE:
+		/* ignore */
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+impl_get_property (GObject *object,
+		   guint prop_id,
+		   GValue *value,
+		   GParamSpec *pspec)
+{
+	RhythmDBReplayGainJob *job = RHYTHMDB_REPLAYGAIN_JOB (object);
+
+	switch (prop_id) {
+	case PROP_DB:
+		g_value_set_object (value, job->priv->db);
+		break;
+	case PROP_WRITE_TAGS:
+		g_value_set_boolean (value, job->priv->write_tags);
+		break;
+	case PROP_TASK_LABEL:
+		g_value_set_string (value, job->priv->task_label);
+		break;
+	case PROP_TASK_DETAIL:
+		if (job->priv->total > 0) {
+			g_value_take_string (value,
+					     g_strdup_printf (_("%d of %d"),
+							      job->priv->processed,
+							      job->priv->total));
+		}
+		break;
+	case PROP_TASK_PROGRESS:
+		if (job->priv->total == 0) {
+			g_value_set_double (value, 0.0);
+		} else {
+			g_value_set_double (value, ((float)job->priv->processed / (float)job->priv->total));
+		}
+		break;
+	case PROP_TASK_OUTCOME:
+		if (job->priv->complete) {
+			g_value_set_enum (value, RB_TASK_OUTCOME_COMPLETE);
+		} else if (g_cancellable_is_cancelled (job->priv->cancel)) {
+			g_value_set_enum (value, RB_TASK_OUTCOME_CANCELLED);
+		} else {
+			g_value_set_enum (value, RB_TASK_OUTCOME_NONE);
+		}
+		break;
+	case PROP_TASK_NOTIFY:
+		g_value_set_boolean (value, job->priv->task_notify);
+		break;
+	case PROP_TASK_CANCELLABLE:
+		g_value_set_boolean (value, TRUE);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+impl_dispose (GObject *object)
+{
+	RhythmDBReplayGainJob *job = RHYTHMDB_REPLAYGAIN_JOB (object);
+
+	/* all the analysis threads are finished once the job is complete */
+	if (job->priv->pool != NULL) {
+		g_thread_pool_free (job->priv->pool, FALSE, TRUE);
+		job->priv->pool = NULL;
+	}
+
+	if (job->priv->db != NULL) {
+		g_object_unref (job->priv->db);
+		job->priv->db = NULL;
+	}
+
+	if (job->priv->cancel != NULL) {
+		g_object_unref (job->priv->cancel);
+		job->priv->cancel = NULL;
+	}
+
+	G_OBJECT_CLASS (rhythmdb_replaygain_job_parent_class)->dispose (object);
+}
+
+static void
+impl_finalize (GObject *object)
+{
+	RhythmDBReplayGainJob *job = RHYTHMDB_REPLAYGAIN_JOB (object);
+
+	g_hash_table_destroy (job->priv->albums);
+	g_ptr_array_free (job->priv->groups, TRUE);
+	g_ptr_array_free (job->priv->entries, TRUE);
+
+	g_free (job->priv->task_label);
+
+	G_OBJECT_CLASS (rhythmdb_replaygain_job_parent_class)->finalize (object);
+}
+
+static void
+rhythmdb_replaygain_job_task_progress_init (RBTaskProgressInterface *interface)
+{
+	interface->cancel = task_progress_cancel;
+}
+
+static void
+rhythmdb_replaygain_job_class_init (RhythmDBReplayGainJobClass *klass)
+{
+	GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+	object_class->set_property = impl_set_property;
+	object_class->get_property = impl_get_property;
+	object_class->dispose = impl_dispose;
+	object_class->finalize = impl_finalize;
+
+	g_object_class_install_property (object_class,
+					 PROP_DB,
+					 g_param_spec_object ("db",
+							      "db",
+							      "RhythmDB object",
+							      RHYTHMDB_TYPE,
+							      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+	g_object_class_install_property (object_class,
+					 PROP_WRITE_TAGS,
+					 g_param_spec_boolean ("write-tags",
+							       "write tags",
+							       "Whether to write the results to the files' tags",
+							       FALSE,
+							       G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY));
+
+	g_object_class_override_property (object_class, PROP_TASK_LABEL, "task-label");
+	g_object_class_override_property (object_class, PROP_TASK_DETAIL, "task-detail");
+	g_object_class_override_property (object_class, PROP_TASK_PROGRESS, "task-progress");
+	g_object_class_override_property (object_class, PROP_TASK_OUTCOME, "task-outcome");
+	g_object_class_override_property (object_class, PROP_TASK_NOTIFY, "task-notify");
+	g_object_class_override_property (object_class, PROP_TASK_CANCELLABLE, "task-cancellable");
+
+	/**
+	 * RhythmDBReplayGainJob::complete:
+	 * @job: the #RhythmDBReplayGainJob
+	 * @total: the number of entries processed
+	 *
+	 * Emitted when the job has finished, or has stopped after being
+	 * cancelled.
+	 */
+	signals[COMPLETE] =
+		g_signal_new ("complete",
+			      G_OBJECT_CLASS_TYPE (object_class),
+			      G_SIGNAL_RUN_LAST,
+			      G_STRUCT_OFFSET (RhythmDBReplayGainJobClass, complete),
+			      NULL, NULL,
+			      NULL,
+			      G_TYPE_NONE,
+			      1, G_TYPE_INT);
+
+	g_type_class_add_private (klass, sizeof (RhythmDBReplayGainJobPrivate));
+}
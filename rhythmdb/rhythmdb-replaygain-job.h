@@ -0,0 +1,75 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+#ifndef RHYTHMDB_REPLAYGAIN_JOB_H
+#define RHYTHMDB_REPLAYGAIN_JOB_H
+
+#include <glib.h>
+#include <glib-object.h>
+
+#include <rhythmdb/rhythmdb.h>
+
+G_BEGIN_DECLS
+
+#define RHYTHMDB_TYPE_REPLAYGAIN_JOB		(rhythmdb_replaygain_job_get_type ())
+#define RHYTHMDB_REPLAYGAIN_JOB(o)		(G_TYPE_CHECK_INSTANCE_CAST ((o), RHYTHMDB_TYPE_REPLAYGAIN_JOB, RhythmDBReplayGainJob))
+#define RHYTHMDB_REPLAYGAIN_JOB_CLASS(k)	(G_TYPE_CHECK_CLASS_CAST((k), RHYTHMDB_TYPE_REPLAYGAIN_JOB, RhythmDBReplayGainJobClass))
+#define RHYTHMDB_IS_REPLAYGAIN_JOB(o)		(G_TYPE_CHECK_INSTANCE_TYPE ((o), RHYTHMDB_TYPE_REPLAYGAIN_JOB))
+#define RHYTHMDB_IS_REPLAYGAIN_JOB_CLASS(k)	(G_TYPE_CHECK_CLASS_TYPE ((k), RHYTHMDB_TYPE_REPLAYGAIN_JOB))
+#define RHYTHMDB_REPLAYGAIN_JOB_GET_CLASS(o)	(G_TYPE_INSTANCE_GET_CLASS ((o), RHYTHMDB_TYPE_REPLAYGAIN_JOB, RhythmDBReplayGainJobClass))
+
+typedef struct _RhythmDBReplayGainJob 		RhythmDBReplayGainJob;
+typedef struct _RhythmDBReplayGainJobClass 	RhythmDBReplayGainJobClass;
+
+typedef struct _RhythmDBReplayGainJobPrivate	RhythmDBReplayGainJobPrivate;
+
+struct _RhythmDBReplayGainJob
+{
+	GObject parent;
+	RhythmDBReplayGainJobPrivate *priv;
+};
+
+struct _RhythmDBReplayGainJobClass
+{
+	GObjectClass parent_class;
+
+	/* signals */
+	void (*complete) (RhythmDBReplayGainJob *job, int total);
+};
+
+GType		rhythmdb_replaygain_job_get_type	(void);
+
+RhythmDBReplayGainJob *rhythmdb_replaygain_job_new	(RhythmDB *db, gboolean write_tags);
+void		rhythmdb_replaygain_job_add_entry	(RhythmDBReplayGainJob *job, RhythmDBEntry *entry);
+void		rhythmdb_replaygain_job_start		(RhythmDBReplayGainJob *job);
+void		rhythmdb_replaygain_job_cancel		(RhythmDBReplayGainJob *job);
+
+int		rhythmdb_replaygain_job_get_total	(RhythmDBReplayGainJob *job);
+int		rhythmdb_replaygain_job_get_processed	(RhythmDBReplayGainJob *job);
+
+G_END_DECLS
+
+#endif /* RHYTHMDB_REPLAYGAIN_JOB_H */
@@ -43,6 +43,7 @@
 #include <glib/gprintf.h>
 #include <glib.h>
 #include <glib/gi18n.h>
+#include <glib/gstdio.h>
 #include <gtk/gtk.h>
 #include <libxml/entities.h>
 #include <libxml/SAX.h>
@@ -67,9 +68,30 @@ typedef struct RhythmDBTreeProperty
 
 #define RHYTHMDB_TREE_PROPERTY_FROM_ENTRY(entry) ((RhythmDBTreeProperty *) entry->data)
 
+typedef struct
+{
+	gdouble value;
+	RhythmDBEntry *entry;
+} RhythmDBTreePropertyIndexItem;
+
+typedef struct
+{
+	RhythmDBPropType propid;
+	GSequence *items;		/* RhythmDBTreePropertyIndexItem, sorted */
+	GHashTable *entries;		/* RhythmDBEntry -> GSequenceIter */
+} RhythmDBTreePropertyIndex;
+
 G_DEFINE_TYPE(RhythmDBTree, rhythmdb_tree, RHYTHMDB_TYPE)
 
 static void rhythmdb_tree_finalize (GObject *object);
+static void rhythmdb_tree_set_property (GObject *object,
+					guint prop_id,
+					const GValue *value,
+					GParamSpec *pspec);
+static void rhythmdb_tree_get_property (GObject *object,
+					guint prop_id,
+					GValue *value,
+					GParamSpec *pspec);
 
 static gboolean rhythmdb_tree_load (RhythmDB *rdb, GCancellable *cancel, GError **error);
 static void rhythmdb_tree_save (RhythmDB *rdb);
@@ -96,6 +118,7 @@ static void rhythmdb_tree_do_full_query (RhythmDB *db, GPtrArray *query,
 					 gboolean *cancel);
 static gboolean rhythmdb_tree_evaluate_query (RhythmDB *adb, GPtrArray *query,
 				       RhythmDBEntry *aentry);
+static char *rhythmdb_tree_explain_query (RhythmDB *adb, GPtrArray *query);
 static void rhythmdb_tree_entry_type_registered (RhythmDB *db,
 						 RhythmDBEntryType *type);
 
@@ -127,7 +150,17 @@ static RhythmDBTreeProperty *get_or_create_genre (RhythmDBTree *db, RhythmDBEntr
 							 RBRefString *name);
 
 static void remove_entry_from_album (RhythmDBTree *db, RhythmDBEntry *entry);
+static void query_stats_invalidate (RhythmDBTree *db);
 static void remove_entry_from_keywords (RhythmDBTree *db, RhythmDBEntry *entry);
+static void property_index_free (RhythmDBTreePropertyIndex *index);
+static void property_index_update_entry (RhythmDBTree *db, RhythmDBEntry *entry, gboolean add);
+
+static gboolean rhythmdb_tree_load_snapshot (RhythmDBTree *db, const char *name, GCancellable *cancel);
+static void rhythmdb_tree_save_snapshot (RhythmDBTree *db, const char *name);
+static char *snapshot_filename (const char *name);
+static void rhythmdb_tree_load_journal (RhythmDBTree *db, const char *name, GCancellable *cancel);
+static gboolean rhythmdb_tree_save_journal (RhythmDBTree *db, const char *name, GPtrArray *journal);
+static char *journal_filename (const char *name);
 
 static GList *split_query_by_disjunctions (RhythmDBTree *db, GPtrArray *query);
 static gboolean evaluate_conjunctive_subquery (RhythmDBTree *db, GPtrArray *query,
@@ -148,7 +181,30 @@ struct RhythmDBTreePrivate
 	GHashTable *unknown_entry_types;
 	gboolean finalizing;
 
+	/* the following are protected by the genres lock */
+	guint n_entries;
+
+	/* folded word -> GHashTable<RhythmDBEntry, count>, built on the
+	 * first search.
+	 */
+	GHashTable *search_index;
+
+	/* propid -> RhythmDBTreePropertyIndex, built on the first query
+	 * constraining the property.
+	 */
+	GHashTable *property_indexes;
+
+	/* tree statistics for query planning, gathered by the first query
+	 * after a commit that added entries to or removed them from albums.
+	 */
+	struct RhythmDBTreeQueryStats *query_stats;
+	gboolean query_stats_dirty;
+
 	guint idle_load_id;
+
+	gboolean use_snapshot;
+	gboolean journal_needs_compaction;
+	guint load_chunk_size;
 };
 
 typedef struct
@@ -168,10 +224,19 @@ typedef struct
 enum
 {
 	PROP_0,
+	PROP_USE_SNAPSHOT,
+	PROP_LOAD_CHUNK_SIZE,
 };
 
 const int RHYTHMDB_TREE_PARSER_INITIAL_BUFFER_SIZE = 512;
 
+#define RHYTHMDB_TREE_JOURNAL_SUFFIX		".journal"
+#define RHYTHMDB_TREE_JOURNAL_COMMIT		"  <commit/>\n"
+/* compact once the journal is a quarter the size of the database */
+#define RHYTHMDB_TREE_JOURNAL_COMPACT_RATIO	4
+
+#define RHYTHMDB_TREE_PARALLEL_LOAD_CHUNK_SIZE	(1024 * 1024)
+
 GQuark
 rhythmdb_tree_error_quark (void)
 {
@@ -189,6 +254,8 @@ rhythmdb_tree_class_init (RhythmDBTreeClass *klass)
 	RhythmDBClass *rhythmdb_class = RHYTHMDB_CLASS (klass);
 
 	object_class->finalize = rhythmdb_tree_finalize;
+	object_class->set_property = rhythmdb_tree_set_property;
+	object_class->get_property = rhythmdb_tree_get_property;
 
 	rhythmdb_class->impl_load = rhythmdb_tree_load;
 	rhythmdb_class->impl_save = rhythmdb_tree_save;
@@ -208,8 +275,38 @@ rhythmdb_tree_class_init (RhythmDBTreeClass *klass)
 	rhythmdb_class->impl_entry_keywords_get = rhythmdb_tree_entry_keywords_get;
 	rhythmdb_class->impl_evaluate_query = rhythmdb_tree_evaluate_query;
 	rhythmdb_class->impl_do_full_query = rhythmdb_tree_do_full_query;
+	rhythmdb_class->impl_explain_query = rhythmdb_tree_explain_query;
 	rhythmdb_class->impl_entry_type_registered = rhythmdb_tree_entry_type_registered;
 
+	/**
+	 * RhythmDBTree:use-snapshot:
+	 *
+	 * If set, the database is also written to a binary snapshot file
+	 * alongside the XML file, and loaded from there when the snapshot
+	 * is up to date.  The XML file is always written.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_USE_SNAPSHOT,
+					 g_param_spec_boolean ("use-snapshot",
+							       "use-snapshot",
+							       "whether to use the binary database snapshot",
+							       TRUE,
+							       G_PARAM_READWRITE));
+
+	/**
+	 * RhythmDBTree:load-chunk-size:
+	 *
+	 * Size of the pieces the database file is split into to load it on
+	 * multiple threads.  Smaller files are loaded on a single thread.
+	 */
+	g_object_class_install_property (object_class,
+					 PROP_LOAD_CHUNK_SIZE,
+					 g_param_spec_uint ("load-chunk-size",
+							    "load-chunk-size",
+							    "size of database file chunks to load in parallel",
+							    1, G_MAXUINT, RHYTHMDB_TREE_PARALLEL_LOAD_CHUNK_SIZE,
+							    G_PARAM_READWRITE));
+
 	g_type_class_add_private (klass, sizeof (RhythmDBTreePrivate));
 }
 
@@ -228,6 +325,57 @@ rhythmdb_tree_init (RhythmDBTree *db)
 						  NULL, (GDestroyNotify)g_hash_table_destroy);
 
 	db->priv->unknown_entry_types = g_hash_table_new (rb_refstring_hash, rb_refstring_equal);
+
+	db->priv->property_indexes = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+							    NULL, (GDestroyNotify) property_index_free);
+
+	db->priv->use_snapshot = TRUE;
+	db->priv->load_chunk_size = RHYTHMDB_TREE_PARALLEL_LOAD_CHUNK_SIZE;
+
+	/* we can't append to a database file we haven't loaded */
+	db->priv->journal_needs_compaction = TRUE;
+}
+
+static void
+rhythmdb_tree_set_property (GObject *object,
+			    guint prop_id,
+			    const GValue *value,
+			    GParamSpec *pspec)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (object);
+
+	switch (prop_id) {
+	case PROP_USE_SNAPSHOT:
+		db->priv->use_snapshot = g_value_get_boolean (value);
+		break;
+	case PROP_LOAD_CHUNK_SIZE:
+		db->priv->load_chunk_size = g_value_get_uint (value);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
+}
+
+static void
+rhythmdb_tree_get_property (GObject *object,
+			    guint prop_id,
+			    GValue *value,
+			    GParamSpec *pspec)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (object);
+
+	switch (prop_id) {
+	case PROP_USE_SNAPSHOT:
+		g_value_set_boolean (value, db->priv->use_snapshot);
+		break;
+	case PROP_LOAD_CHUNK_SIZE:
+		g_value_set_uint (value, db->priv->load_chunk_size);
+		break;
+	default:
+		G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+		break;
+	}
 }
 
 /* must be called with the genres lock held */
@@ -292,6 +440,11 @@ rhythmdb_tree_finalize (GObject *object)
 
 	g_hash_table_destroy (db->priv->genres);
 
+	if (db->priv->search_index != NULL)
+		g_hash_table_destroy (db->priv->search_index);
+	g_hash_table_destroy (db->priv->property_indexes);
+	query_stats_invalidate (db);
+
 	g_hash_table_foreach (db->priv->unknown_entry_types,
 			      (GHFunc) free_unknown_entries,
 			      NULL);
@@ -323,14 +476,36 @@ struct RhythmDBTreeLoadContext
 	gint batch_count;
 	GError **error;
 
+	/* parallel loading: completed entries are collected here rather than
+	 * being added to the database as they're parsed.  when deferred, this
+	 * includes entries of unknown types, so everything from a chunk can be
+	 * added in file order once the chunks before it have been added.
+	 */
+	GArray *loaded_entries;
+	GList *keywords;
+
+	/* journal replay */
+	GStatBuf *journal_base;
+
 	/* updating */
 	guint has_date : 1;
 	guint canonicalise_uris : 1;
 	guint reload_all_metadata : 1;
 	guint update_podcasts : 1;
 	guint update_local_mountpoints : 1;
+	guint journal : 1;
+	guint journal_stale : 1;
+	guint deferred : 1;
 };
 
+typedef struct
+{
+	RhythmDBEntry *entry;
+	GList *keywords;
+	RBRefString *location;		/* journal only: location to remove */
+	RhythmDBUnknownEntry *unknown;	/* deferred only: entry of an unknown type */
+} RhythmDBTreeLoadedEntry;
+
 /* Returns the version as an int, multiplied by 100,
  * eg. "1.4" becomes 140 */
 static int
@@ -346,6 +521,240 @@ version_to_int (const char *version)
 	return (int)roundf(ver * 100);
 }
 
+/* adds an entry read from the database file, merging it with any
+ * existing entry with the same location.  must be called with the
+ * entries lock held.  returns TRUE if the entry itself was added.
+ */
+static gboolean
+rhythmdb_tree_add_loaded_entry (struct RhythmDBTreeLoadContext *ctx,
+				RhythmDBEntry *loaded)
+{
+	gboolean inserted = FALSE;
+
+	rb_assert_locked (&ctx->db->priv->entries_lock);
+
+	if (loaded->location != NULL && rb_refstring_get (loaded->location)[0] != '\0') {
+		RhythmDBEntry *entry;
+
+		entry = g_hash_table_lookup (ctx->db->priv->entries, loaded->location);
+		if (entry == NULL) {
+			rhythmdb_tree_entry_new_internal (RHYTHMDB (ctx->db), loaded);
+			rhythmdb_entry_insert (RHYTHMDB (ctx->db), loaded);
+			inserted = TRUE;
+			if (++ctx->batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
+				rhythmdb_commit (RHYTHMDB (ctx->db));
+				ctx->batch_count = 0;
+			}
+		} else if (loaded->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST &&
+			   entry->type == RHYTHMDB_ENTRY_TYPE_SONG) {
+			rb_debug ("found song entry with duplicate location for Podcast post %s. merging metadata",
+				  rb_refstring_get (loaded->location));
+
+			loaded->play_count += entry->play_count;
+			if (loaded->last_played < entry->last_played)
+				loaded->last_played = entry->last_played;
+
+			/* Remove the song entry,
+			 * deleting requires relinquishing the locks */
+			g_mutex_unlock (&ctx->db->priv->entries_lock);
+			rhythmdb_entry_delete (RHYTHMDB(ctx->db), entry);
+			g_mutex_lock (&ctx->db->priv->entries_lock);
+			rhythmdb_commit (RHYTHMDB (ctx->db));
+
+			/* And add the Podcast entry to the database */
+			rhythmdb_tree_entry_new_internal (RHYTHMDB (ctx->db), loaded);
+			rhythmdb_entry_insert (RHYTHMDB (ctx->db), loaded);
+			inserted = TRUE;
+			if (++ctx->batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
+				rhythmdb_commit (RHYTHMDB (ctx->db));
+				ctx->batch_count = 0;
+			}
+		} else {
+			rb_debug ("found entry with duplicate location %s. merging metadata",
+				  rb_refstring_get (loaded->location));
+
+			/* the merged properties are indexed, so take the entry
+			 * out of the indexes while they change.
+			 */
+			g_mutex_lock (&ctx->db->priv->genres_lock);
+			property_index_update_entry (ctx->db, entry, FALSE);
+
+			entry->play_count += loaded->play_count;
+
+			if (entry->rating < 0.01)
+				entry->rating = loaded->rating;
+			else if (loaded->rating > 0.01)
+				entry->rating = (entry->rating + loaded->rating) / 2;
+
+			if (loaded->last_played > entry->last_played)
+				entry->last_played = loaded->last_played;
+
+			if (loaded->first_seen < entry->first_seen)
+				entry->first_seen = loaded->first_seen;
+
+			if (loaded->last_seen > entry->last_seen)
+				entry->last_seen = loaded->last_seen;
+
+			property_index_update_entry (ctx->db, entry, TRUE);
+			g_mutex_unlock (&ctx->db->priv->genres_lock);
+
+			rhythmdb_entry_unref (loaded);
+		}
+	} else {
+		rb_debug ("found entry without location");
+		rhythmdb_entry_unref (loaded);
+	}
+
+	return inserted;
+}
+
+/* removes an entry of an unregistered type.  must be called with the
+ * entries lock held.
+ */
+static void
+rhythmdb_tree_remove_unknown_entry (RhythmDBTree *db,
+				    RBRefString *location)
+{
+	GHashTableIter iter;
+	gpointer key;
+	gpointer value;
+
+	rb_assert_locked (&db->priv->entries_lock);
+
+	g_hash_table_iter_init (&iter, db->priv->unknown_entry_types);
+	while (g_hash_table_iter_next (&iter, &key, &value)) {
+		GList *entries = value;
+		GList *e;
+
+		for (e = entries; e != NULL; e = e->next) {
+			RhythmDBUnknownEntry *data = e->data;
+			GList *p;
+
+			for (p = data->properties; p != NULL; p = p->next) {
+				RhythmDBUnknownEntryProperty *prop = p->data;
+
+				if (strcmp (rb_refstring_get (prop->name), "location") == 0 &&
+				    rb_refstring_equal (prop->value, location)) {
+					entries = g_list_remove_link (entries, e);
+					free_unknown_entries (key, e, NULL);
+					g_free (data);
+
+					if (entries != NULL)
+						g_hash_table_iter_replace (&iter, entries);
+					else
+						g_hash_table_iter_remove (&iter);
+					return;
+				}
+			}
+		}
+	}
+}
+
+/* adds an entry of an unregistered type, so it can be saved again.  when
+ * @replace is set, it replaces any existing entry with the same location.
+ * must be called with the entries lock held.
+ */
+static void
+rhythmdb_tree_add_unknown_entry (RhythmDBTree *db,
+				 RhythmDBUnknownEntry *unknown,
+				 gboolean replace)
+{
+	GList *entry_list;
+
+	rb_assert_locked (&db->priv->entries_lock);
+
+	if (replace) {
+		GList *p;
+
+		for (p = unknown->properties; p != NULL; p = p->next) {
+			RhythmDBUnknownEntryProperty *prop = p->data;
+
+			if (strcmp (rb_refstring_get (prop->name), "location") == 0) {
+				rhythmdb_tree_remove_unknown_entry (db, prop->value);
+				break;
+			}
+		}
+	}
+
+	entry_list = g_hash_table_lookup (db->priv->unknown_entry_types, unknown->typename);
+	entry_list = g_list_prepend (entry_list, unknown);
+	g_hash_table_insert (db->priv->unknown_entry_types, unknown->typename, entry_list);
+}
+
+/* checks that the journal being loaded was written against the
+ * database file we've loaded.
+ */
+static gboolean
+rhythmdb_tree_journal_matches (struct RhythmDBTreeLoadContext *ctx,
+			       const char **attrs)
+{
+	gboolean version = FALSE;
+	gboolean size = FALSE;
+	gboolean mtime = FALSE;
+	gboolean inode = FALSE;
+
+	for (; *attrs; attrs +=2) {
+		const char *value = *(attrs+1);
+
+		if (!strcmp (*attrs, "version")) {
+			version = (strcmp (value, RHYTHMDB_TREE_XML_VERSION) == 0);
+		} else if (!strcmp (*attrs, "size")) {
+			size = (g_ascii_strtoull (value, NULL, 10) == (guint64) ctx->journal_base->st_size);
+		} else if (!strcmp (*attrs, "mtime")) {
+			mtime = (g_ascii_strtoull (value, NULL, 10) == (guint64) ctx->journal_base->st_mtime);
+		} else if (!strcmp (*attrs, "inode")) {
+			inode = (g_ascii_strtoull (value, NULL, 10) == (guint64) ctx->journal_base->st_ino);
+		}
+	}
+
+	return (version && size && mtime && inode);
+}
+
+/* applies the records from one journal commit.  entries in the journal
+ * replace any existing entry with the same location.
+ */
+static void
+rhythmdb_tree_apply_journal (struct RhythmDBTreeLoadContext *ctx)
+{
+	RhythmDBTree *db = ctx->db;
+	guint i;
+
+	g_mutex_lock (&db->priv->entries_lock);
+	for (i = 0; i < ctx->loaded_entries->len; i++) {
+		RhythmDBTreeLoadedEntry *loaded;
+		RhythmDBEntry *existing;
+		RBRefString *location;
+		GList *l;
+
+		loaded = &g_array_index (ctx->loaded_entries, RhythmDBTreeLoadedEntry, i);
+		location = loaded->entry ? loaded->entry->location : loaded->location;
+
+		existing = NULL;
+		if (location != NULL)
+			existing = g_hash_table_lookup (db->priv->entries, location);
+		if (existing != NULL) {
+			g_mutex_unlock (&db->priv->entries_lock);
+			rhythmdb_entry_delete (RHYTHMDB (db), existing);
+			g_mutex_lock (&db->priv->entries_lock);
+			rhythmdb_commit (RHYTHMDB (db));
+		} else if (location != NULL) {
+			rhythmdb_tree_remove_unknown_entry (db, location);
+		}
+
+		if (loaded->entry != NULL && rhythmdb_tree_add_loaded_entry (ctx, loaded->entry)) {
+			for (l = loaded->keywords; l != NULL; l = l->next) {
+				rhythmdb_entry_keyword_add (RHYTHMDB (db), loaded->entry, l->data);
+			}
+		}
+		g_list_free_full (loaded->keywords, (GDestroyNotify) rb_refstring_unref);
+		if (loaded->location != NULL)
+			rb_refstring_unref (loaded->location);
+	}
+	g_mutex_unlock (&db->priv->entries_lock);
+
+	g_array_set_size (ctx->loaded_entries, 0);
+}
+
 static void
 rhythmdb_tree_parser_start_element (struct RhythmDBTreeLoadContext *ctx,
 				    const char *name,
@@ -421,6 +830,12 @@ rhythmdb_tree_parser_start_element (struct RhythmDBTreeLoadContext *ctx,
 				}
 			}
 
+		} else if (ctx->journal && !strcmp (name, "rhythmdb-journal")) {
+			ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
+			if (rhythmdb_tree_journal_matches (ctx, attrs) == FALSE) {
+				ctx->journal_stale = TRUE;
+				xmlStopParser (ctx->xmlctx);
+			}
 		} else {
 			ctx->in_unknown_elt++;
 		}
@@ -429,7 +844,22 @@ rhythmdb_tree_parser_start_element (struct RhythmDBTreeLoadContext *ctx,
 	}
 	case RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB:
 	{
-		if (!strcmp (name, "entry")) {
+		if (ctx->journal && !strcmp (name, "delete")) {
+			RhythmDBTreeLoadedEntry loaded = {0,};
+
+			for (; *attrs; attrs +=2) {
+				if (!strcmp (*attrs, "location")) {
+					loaded.location = rb_refstring_new (*(attrs+1));
+					g_array_append_val (ctx->loaded_entries, loaded);
+					break;
+				}
+			}
+			/* skip the end element */
+			ctx->in_unknown_elt++;
+		} else if (ctx->journal && !strcmp (name, "commit")) {
+			rhythmdb_tree_apply_journal (ctx);
+			ctx->in_unknown_elt++;
+		} else if (!strcmp (name, "entry")) {
 			RhythmDBEntryType *type = NULL;
 			const char *typename = NULL;
 			for (; *attrs; attrs +=2) {
@@ -492,6 +922,88 @@ rhythmdb_tree_parser_start_element (struct RhythmDBTreeLoadContext *ctx,
 	}
 }
 
+/* handles upgrades from older database versions once all of an entry's
+ * properties have been read.
+ */
+static void
+rhythmdb_tree_parser_finish_entry (struct RhythmDBTreeLoadContext *ctx,
+				   RhythmDBEntry *entry,
+				   gboolean has_date)
+{
+	if (!has_date || ctx->reload_all_metadata) {
+		/* there is no date metadata, so this is from an old version
+		 * reset the last-modified timestamp, so that the file is re-read
+		 */
+		rb_debug ("pre-Date entry found, causing re-read");
+		entry->mtime = 0;
+	}
+	if (entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED) {
+		RhythmDBPodcastFields *podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (entry, RhythmDBPodcastFields);
+		/* Handle upgrades from 0.9.2.
+		 * Previously, last-seen for podcast feeds was the time of the last post,
+		 * and post-time was unused.  Now, we want last-seen to be the time we
+		 * last updated the feed, and post-time to be the time of the last post.
+		 */
+		if (podcast->post_time == 0) {
+			podcast->post_time = entry->last_seen;
+		}
+	}
+	if (entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST) {
+		/* When upgrading Podcasts from 0.11.6 and prior, we need to
+		 * swap mountpoint and location if there is a mountpoint */
+		if (ctx->update_podcasts && entry->mountpoint != NULL) {
+			RBRefString *tmp;
+
+			rb_debug ("pre-Podcast avoidance found, swapping location/mountpoint");
+
+			tmp = entry->location;
+			entry->location = entry->mountpoint;
+			entry->mountpoint = tmp;
+		}
+	}
+	if (entry->type == RHYTHMDB_ENTRY_TYPE_SONG) {
+		/* Since we now care about mountpoints for all local entries, not just
+		 * those on things that actually get mounted and unmounted, we need to
+		 * ensure they're all correct.
+		 */
+		if (ctx->update_local_mountpoints) {
+			const char *loc = rb_refstring_get (entry->location);
+			if (loc == NULL || g_str_has_prefix (loc, "file:///")) {
+				char *nmp;
+				nmp = rb_uri_get_mount_point (loc);
+				if (entry->mountpoint != NULL) {
+					rb_refstring_unref (entry->mountpoint);
+					entry->mountpoint = NULL;
+				}
+
+				if (nmp != NULL) {
+					entry->mountpoint = rb_refstring_new (nmp);
+					g_free (nmp);
+				}
+			}
+		}
+	}
+}
+
+static void
+rhythmdb_tree_parser_set_property (struct RhythmDBTreeLoadContext *ctx,
+				   RhythmDBEntry *entry,
+				   RhythmDBPropType propid,
+				   const char *str)
+{
+	GValue value = {0,};
+
+	if (propid == RHYTHMDB_PROP_LOCATION && ctx->canonicalise_uris) {
+		g_value_init (&value, G_TYPE_STRING);
+		g_value_take_string (&value, rb_canonicalise_uri (str));
+	} else {
+		rhythmdb_read_encoded_property (RHYTHMDB (ctx->db), str, propid, &value);
+	}
+
+	rhythmdb_entry_set_internal (RHYTHMDB (ctx->db), entry, FALSE, propid, &value);
+	g_value_unset (&value);
+}
+
 static void
 rhythmdb_tree_parser_end_element (struct RhythmDBTreeLoadContext *ctx,
 				  const char *name)
@@ -513,121 +1025,20 @@ rhythmdb_tree_parser_end_element (struct RhythmDBTreeLoadContext *ctx,
 		break;
 	case RHYTHMDB_TREE_PARSER_STATE_ENTRY:
 	{
-		if (!ctx->has_date || ctx->reload_all_metadata) {
-			/* there is no date metadata, so this is from an old version
-			 * reset the last-modified timestamp, so that the file is re-read
-			 */
-			rb_debug ("pre-Date entry found, causing re-read");
-			ctx->entry->mtime = 0;
-		}
-		if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED) {
-			RhythmDBPodcastFields *podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (ctx->entry, RhythmDBPodcastFields);
-			/* Handle upgrades from 0.9.2.
-			 * Previously, last-seen for podcast feeds was the time of the last post,
-			 * and post-time was unused.  Now, we want last-seen to be the time we
-			 * last updated the feed, and post-time to be the time of the last post.
-			 */
-			if (podcast->post_time == 0) {
-				podcast->post_time = ctx->entry->last_seen;
-			}
-		}
-		if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST) {
-			/* When upgrading Podcasts from 0.11.6 and prior, we need to
-			 * swap mountpoint and location if there is a mountpoint */
-			if (ctx->update_podcasts && ctx->entry->mountpoint != NULL) {
-				RBRefString *tmp;
-
-				rb_debug ("pre-Podcast avoidance found, swapping location/mountpoint");
-
-				tmp = ctx->entry->location;
-				ctx->entry->location = ctx->entry->mountpoint;
-				ctx->entry->mountpoint = tmp;
-			}
-		}
-		if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_SONG) {
-			/* Since we now care about mountpoints for all local entries, not just
-			 * those on things that actually get mounted and unmounted, we need to
-			 * ensure they're all correct.
-			 */
-			if (ctx->update_local_mountpoints) {
-				const char *loc = rb_refstring_get (ctx->entry->location);
-				if (loc == NULL || g_str_has_prefix (loc, "file:///")) {
-					char *nmp;
-					nmp = rb_uri_get_mount_point (loc);
-					if (ctx->entry->mountpoint != NULL) {
-						rb_refstring_unref (ctx->entry->mountpoint);
-						ctx->entry->mountpoint = NULL;
-					}
-
-					if (nmp != NULL) {
-						ctx->entry->mountpoint = rb_refstring_new (nmp);
-						g_free (nmp);
-					}
-				}
-			}
-		}
+		rhythmdb_tree_parser_finish_entry (ctx, ctx->entry, ctx->has_date);
 
-		if (ctx->entry->location != NULL && rb_refstring_get (ctx->entry->location)[0] != '\0') {
-			RhythmDBEntry *entry;
+		if (ctx->loaded_entries != NULL) {
+			RhythmDBTreeLoadedEntry loaded = {0,};
 
+			loaded.entry = ctx->entry;
+			loaded.keywords = ctx->keywords;
+			loaded.location = NULL;
+			g_array_append_val (ctx->loaded_entries, loaded);
+			ctx->keywords = NULL;
+		} else {
 			g_mutex_lock (&ctx->db->priv->entries_lock);
-			entry = g_hash_table_lookup (ctx->db->priv->entries, ctx->entry->location);
-			if (entry == NULL) {
-				rhythmdb_tree_entry_new_internal (RHYTHMDB (ctx->db), ctx->entry);
-				rhythmdb_entry_insert (RHYTHMDB (ctx->db), ctx->entry);
-				if (++ctx->batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
-					rhythmdb_commit (RHYTHMDB (ctx->db));
-					ctx->batch_count = 0;
-				}
-			} else if (ctx->entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST &&
-				   entry->type == RHYTHMDB_ENTRY_TYPE_SONG) {
-				rb_debug ("found song entry with duplicate location for Podcast post %s. merging metadata",
-					  rb_refstring_get (ctx->entry->location));
-
-				ctx->entry->play_count += entry->play_count;
-				if (ctx->entry->last_played < entry->last_played)
-					ctx->entry->last_played = entry->last_played;
-
-				/* Remove the song entry,
-				 * deleting requires relinquishing the locks */
-				g_mutex_unlock (&ctx->db->priv->entries_lock);
-				rhythmdb_entry_delete (RHYTHMDB(ctx->db), entry);
-				g_mutex_lock (&ctx->db->priv->entries_lock);
-				rhythmdb_commit (RHYTHMDB (ctx->db));
-
-				/* And add the Podcast entry to the database */
-				rhythmdb_tree_entry_new_internal (RHYTHMDB (ctx->db), ctx->entry);
-				rhythmdb_entry_insert (RHYTHMDB (ctx->db), ctx->entry);
-				if (++ctx->batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
-					rhythmdb_commit (RHYTHMDB (ctx->db));
-					ctx->batch_count = 0;
-				}
-			} else {
-				rb_debug ("found entry with duplicate location %s. merging metadata",
-					  rb_refstring_get (ctx->entry->location));
-
-				entry->play_count += ctx->entry->play_count;
-
-				if (entry->rating < 0.01)
-					entry->rating = ctx->entry->rating;
-				else if (ctx->entry->rating > 0.01)
-					entry->rating = (entry->rating + ctx->entry->rating) / 2;
-
-				if (ctx->entry->last_played > entry->last_played)
-					entry->last_played = ctx->entry->last_played;
-
-				if (ctx->entry->first_seen < entry->first_seen)
-					entry->first_seen = ctx->entry->first_seen;
-
-				if (ctx->entry->last_seen > entry->last_seen)
-					entry->last_seen = ctx->entry->last_seen;
-
-				rhythmdb_entry_unref (ctx->entry);
-			}
+			rhythmdb_tree_add_loaded_entry (ctx, ctx->entry);
 			g_mutex_unlock (&ctx->db->priv->entries_lock);
-		} else {
-			rb_debug ("found entry without location");
-			rhythmdb_entry_unref (ctx->entry);
 		}
 		ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
 		ctx->entry = NULL;
@@ -635,16 +1046,19 @@ rhythmdb_tree_parser_end_element (struct RhythmDBTreeLoadContext *ctx,
 	}
 	case RHYTHMDB_TREE_PARSER_STATE_UNKNOWN_ENTRY:
 	{
-		GList *entry_list;
-
 		rb_debug ("finished reading unknown entry");
 		ctx->unknown_entry->properties = g_list_reverse (ctx->unknown_entry->properties);
 
-		g_mutex_lock (&ctx->db->priv->entries_lock);
-		entry_list = g_hash_table_lookup (ctx->db->priv->unknown_entry_types, ctx->unknown_entry->typename);
-		entry_list = g_list_prepend (entry_list, ctx->unknown_entry);
-		g_hash_table_insert (ctx->db->priv->unknown_entry_types, ctx->unknown_entry->typename, entry_list);
-		g_mutex_unlock (&ctx->db->priv->entries_lock);
+		if (ctx->deferred) {
+			RhythmDBTreeLoadedEntry loaded = {0,};
+
+			loaded.unknown = ctx->unknown_entry;
+			g_array_append_val (ctx->loaded_entries, loaded);
+		} else {
+			g_mutex_lock (&ctx->db->priv->entries_lock);
+			rhythmdb_tree_add_unknown_entry (ctx->db, ctx->unknown_entry, ctx->journal);
+			g_mutex_unlock (&ctx->db->priv->entries_lock);
+		}
 
 		ctx->state = RHYTHMDB_TREE_PARSER_STATE_RHYTHMDB;
 		ctx->unknown_entry = NULL;
@@ -652,43 +1066,11 @@ rhythmdb_tree_parser_end_element (struct RhythmDBTreeLoadContext *ctx,
 	}
 	case RHYTHMDB_TREE_PARSER_STATE_ENTRY_PROPERTY:
 	{
-		GValue value = {0,};
-		gboolean set = FALSE;
-		gboolean skip = FALSE;
-
-		/* special case some properties for upgrade handling etc. */
-		switch (ctx->propid) {
-		case RHYTHMDB_PROP_DATE:
+		/* entries without a date are from an old version */
+		if (ctx->propid == RHYTHMDB_PROP_DATE)
 			ctx->has_date = TRUE;
-			break;
-		case RHYTHMDB_PROP_LOCATION:
-			if (ctx->canonicalise_uris) {
-				char *canon = rb_canonicalise_uri (ctx->buf->str);
-
-				g_value_init (&value, G_TYPE_STRING);
-				g_value_take_string (&value, canon);
-				set = TRUE;
-			}
-			break;
-			/* drop replaygain properties */
-		case RHYTHMDB_PROP_TRACK_GAIN:
-		case RHYTHMDB_PROP_TRACK_PEAK:
-		case RHYTHMDB_PROP_ALBUM_GAIN:
-		case RHYTHMDB_PROP_ALBUM_PEAK:
-			skip = TRUE;
-			break;
-		default:
-			break;
-		}
-
-		if (!skip) {
-			if (!set) {
-				rhythmdb_read_encoded_property (RHYTHMDB (ctx->db), ctx->buf->str, ctx->propid, &value);
-			}
 
-			rhythmdb_entry_set_internal (RHYTHMDB (ctx->db), ctx->entry, FALSE, ctx->propid, &value);
-			g_value_unset (&value);
-		}
+		rhythmdb_tree_parser_set_property (ctx, ctx->entry, ctx->propid, ctx->buf->str);
 
 		ctx->state = RHYTHMDB_TREE_PARSER_STATE_ENTRY;
 		break;
@@ -698,8 +1080,12 @@ rhythmdb_tree_parser_end_element (struct RhythmDBTreeLoadContext *ctx,
 		RBRefString *keyword;
 
 		keyword = rb_refstring_new (ctx->buf->str);
-		rhythmdb_entry_keyword_add (RHYTHMDB(ctx->db), ctx->entry, keyword);
-		rb_refstring_unref (keyword);
+		if (ctx->loaded_entries != NULL) {
+			ctx->keywords = g_list_prepend (ctx->keywords, keyword);
+		} else {
+			rhythmdb_entry_keyword_add (RHYTHMDB(ctx->db), ctx->entry, keyword);
+			rb_refstring_unref (keyword);
+		}
 
 		ctx->state = RHYTHMDB_TREE_PARSER_STATE_ENTRY;
 		break;
@@ -749,45 +1135,365 @@ rhythmdb_tree_parser_characters (struct RhythmDBTreeLoadContext *ctx,
 	}
 }
 
-static gboolean
-rhythmdb_tree_load (RhythmDB *rdb,
-		    GCancellable *cancel,
-		    GError **error)
+/* files with fewer chunks than this are parsed sequentially */
+#define RHYTHMDB_TREE_PARALLEL_LOAD_MIN_CHUNKS	4
+
+typedef struct
+{
+	struct RhythmDBTreeLoadContext ctx;
+	const char *root;
+	gsize root_len;
+	const char *data;
+	gsize len;
+	gboolean failed;
+	GError *error;
+} RhythmDBTreeLoadChunk;
+
+static void
+rhythmdb_tree_parse_chunk (RhythmDBTreeLoadChunk *chunk,
+			   xmlSAXHandler *sax_handler)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
 	xmlParserCtxtPtr ctxt;
-	xmlSAXHandlerPtr sax_handler;
-	struct RhythmDBTreeLoadContext *ctx;
-	char *name;
-	GError *local_error;
-	gboolean ret;
+	static const char root_end[] = "</rhythmdb>";
 
-	local_error = NULL;
+	ctxt = xmlCreatePushParserCtxt (sax_handler, &chunk->ctx, NULL, 0, NULL);
+	if (ctxt == NULL) {
+		chunk->failed = TRUE;
+		return;
+	}
+	chunk->ctx.xmlctx = ctxt;
 
-	sax_handler = g_new0 (xmlSAXHandler, 1);
-	ctx = g_new0 (struct RhythmDBTreeLoadContext, 1);
+	/* each chunk is parsed as a complete document consisting of the
+	 * original root element wrapped around a run of entries.
+	 */
+	xmlParseChunk (ctxt, chunk->root, chunk->root_len, 0);
+	xmlParseChunk (ctxt, chunk->data, chunk->len, 0);
+	xmlParseChunk (ctxt, root_end, sizeof (root_end) - 1, 1);
 
-	sax_handler->startElement = (startElementSAXFunc) rhythmdb_tree_parser_start_element;
-	sax_handler->endElement = (endElementSAXFunc) rhythmdb_tree_parser_end_element;
-	sax_handler->characters = (charactersSAXFunc) rhythmdb_tree_parser_characters;
+	if (ctxt->wellFormed == 0)
+		chunk->failed = TRUE;
+	xmlFreeParserCtxt (ctxt);
+}
+
+static void
+rhythmdb_tree_free_loaded_entries (GArray *loaded_entries, guint start)
+{
+	guint i;
+
+	for (i = start; i < loaded_entries->len; i++) {
+		RhythmDBTreeLoadedEntry *loaded;
+
+		loaded = &g_array_index (loaded_entries, RhythmDBTreeLoadedEntry, i);
+		if (loaded->entry != NULL)
+			rhythmdb_entry_unref (loaded->entry);
+		if (loaded->location != NULL)
+			rb_refstring_unref (loaded->location);
+		if (loaded->unknown != NULL) {
+			free_unknown_entries (NULL, g_list_prepend (NULL, loaded->unknown), NULL);
+			g_free (loaded->unknown);
+		}
+		g_list_free_full (loaded->keywords, (GDestroyNotify) rb_refstring_unref);
+	}
+}
+
+/*
+ * Splits the database file into chunks on entry boundaries and builds the
+ * entries for each chunk on a thread pool.  The entries are then added to
+ * the database in file order, so entry IDs, duplicate handling and entries
+ * of unknown types work the same way as they do for sequential loading.
+ * Returns FALSE if the file doesn't look like something we can split up,
+ * in which case it should be parsed sequentially.
+ */
+static gboolean
+rhythmdb_tree_load_parallel (RhythmDBTree *db,
+			     struct RhythmDBTreeLoadContext *ctx,
+			     xmlSAXHandler *sax_handler,
+			     const char *data,
+			     gsize len)
+{
+	static const char root_end[] = "</rhythmdb>";
+	const char *body;
+	const char *body_end;
+	const char *p;
+	xmlParserCtxtPtr ctxt;
+	GPtrArray *chunks;
+	GThreadPool *pool;
+	GError *error = NULL;
+	gboolean stop;
+	guint i;
+	guint j;
+
+	body = g_strstr_len (data, len, "<entry");
+	body_end = g_strrstr_len (data, len, root_end);
+	if (body == NULL || body_end == NULL || body_end < body)
+		return FALSE;
+
+	/* parse the root element here to find out what upgrades are required */
+	ctxt = xmlCreatePushParserCtxt (sax_handler, ctx, NULL, 0, NULL);
+	if (ctxt == NULL)
+		return FALSE;
+	ctx->xmlctx = ctxt;
+	xmlParseChunk (ctxt, data, body - data, 0);
+	xmlParseChunk (ctxt, root_end, sizeof (root_end) - 1, 1);
+	xmlFreeParserCtxt (ctxt);
+	ctx->xmlctx = NULL;
+	if (*ctx->error != NULL || g_cancellable_is_cancelled (ctx->cancel))
+		return TRUE;
+	if (ctx->state != RHYTHMDB_TREE_PARSER_STATE_END) {
+		ctx->state = RHYTHMDB_TREE_PARSER_STATE_START;
+		ctx->in_unknown_elt = 0;
+		return FALSE;
+	}
+
+	chunks = g_ptr_array_new ();
+	for (p = body; p < body_end; ) {
+		RhythmDBTreeLoadChunk *chunk;
+		const char *next = NULL;
+
+		if ((gsize) (body_end - p) > db->priv->load_chunk_size) {
+			next = g_strstr_len (p + db->priv->load_chunk_size,
+					     body_end - (p + db->priv->load_chunk_size),
+					     "<entry");
+		}
+		if (next == NULL)
+			next = body_end;
+
+		chunk = g_new0 (RhythmDBTreeLoadChunk, 1);
+		chunk->root = data;
+		chunk->root_len = body - data;
+		chunk->data = p;
+		chunk->len = next - p;
+
+		chunk->ctx.db = db;
+		chunk->ctx.cancel = ctx->cancel;
+		chunk->ctx.state = RHYTHMDB_TREE_PARSER_STATE_START;
+		chunk->ctx.buf = g_string_sized_new (RHYTHMDB_TREE_PARSER_INITIAL_BUFFER_SIZE);
+		chunk->ctx.error = &chunk->error;
+		chunk->ctx.loaded_entries = g_array_new (FALSE, FALSE, sizeof (RhythmDBTreeLoadedEntry));
+		chunk->ctx.deferred = TRUE;
+
+		g_ptr_array_add (chunks, chunk);
+		p = next;
+	}
+
+	rb_debug ("parsing %d chunks on %d threads", chunks->len, g_get_num_processors ());
+
+	/* libxml2 needs to be initialised before it's used from other threads */
+	xmlInitParser ();
+	pool = g_thread_pool_new ((GFunc) rhythmdb_tree_parse_chunk,
+				  sax_handler,
+				  g_get_num_processors (),
+				  TRUE,
+				  NULL);
+	for (i = 0; i < chunks->len; i++) {
+		g_thread_pool_push (pool, g_ptr_array_index (chunks, i), NULL);
+	}
+	g_thread_pool_free (pool, FALSE, TRUE);
+
+	/* add the entries to the database, stopping where a sequential parse
+	 * would have
+	 */
+	stop = g_cancellable_is_cancelled (ctx->cancel);
+	for (i = 0; i < chunks->len; i++) {
+		RhythmDBTreeLoadChunk *chunk = g_ptr_array_index (chunks, i);
+
+		g_mutex_lock (&db->priv->entries_lock);
+		for (j = 0; stop == FALSE && j < chunk->ctx.loaded_entries->len; j++) {
+			RhythmDBTreeLoadedEntry *loaded;
+			GList *l;
+
+			loaded = &g_array_index (chunk->ctx.loaded_entries, RhythmDBTreeLoadedEntry, j);
+			if (loaded->unknown != NULL) {
+				rhythmdb_tree_add_unknown_entry (db, loaded->unknown, FALSE);
+				continue;
+			}
+
+			/* number entries in file order, as a sequential load would */
+			loaded->entry->id = (guint) g_atomic_int_add (&RHYTHMDB (db)->priv->next_entry_id, 1);
+			if (rhythmdb_tree_add_loaded_entry (ctx, loaded->entry)) {
+				for (l = loaded->keywords; l != NULL; l = l->next) {
+					rhythmdb_entry_keyword_add (RHYTHMDB (db), loaded->entry, l->data);
+				}
+			}
+			g_list_free_full (loaded->keywords, (GDestroyNotify) rb_refstring_unref);
+		}
+		g_mutex_unlock (&db->priv->entries_lock);
+		if (stop) {
+			rhythmdb_tree_free_loaded_entries (chunk->ctx.loaded_entries, j);
+		}
+
+		if (chunk->error != NULL && error == NULL) {
+			error = chunk->error;
+			chunk->error = NULL;
+		}
+		if (chunk->failed || error != NULL) {
+			stop = TRUE;
+		}
+
+		if (chunk->ctx.entry != NULL)
+			rhythmdb_entry_unref (chunk->ctx.entry);
+		if (chunk->ctx.unknown_entry != NULL) {
+			free_unknown_entries (NULL, g_list_prepend (NULL, chunk->ctx.unknown_entry), NULL);
+			g_free (chunk->ctx.unknown_entry);
+		}
+		g_list_free_full (chunk->ctx.keywords, (GDestroyNotify) rb_refstring_unref);
+		g_clear_error (&chunk->error);
+		g_array_free (chunk->ctx.loaded_entries, TRUE);
+		g_string_free (chunk->ctx.buf, TRUE);
+		g_free (chunk);
+	}
+	g_ptr_array_free (chunks, TRUE);
+
+	if (error != NULL)
+		g_propagate_error (ctx->error, error);
+
+	return TRUE;
+}
+
+/*
+ * Replays the change journal written by rhythmdb_tree_save_journal.
+ * Records are only applied once the commit marker following them has
+ * been read, so a partially written update is ignored.
+ */
+static void
+rhythmdb_tree_load_journal (RhythmDBTree *db,
+			    const char *name,
+			    GCancellable *cancel)
+{
+	static const char root_end[] = "</rhythmdb-journal>";
+	struct RhythmDBTreeLoadContext *ctx;
+	xmlSAXHandler sax_handler = {0,};
+	xmlParserCtxtPtr ctxt;
+	GStatBuf base;
+	GError *error = NULL;
+	char *filename;
+	char *contents;
+	gsize length;
+
+	filename = journal_filename (name);
+	if (g_file_get_contents (filename, &contents, &length, NULL) == FALSE) {
+		g_free (filename);
+		return;
+	}
+
+	if (g_stat (name, &base) != 0) {
+		rb_debug ("found journal %s without a database file, ignoring it", filename);
+		g_unlink (filename);
+		g_free (contents);
+		g_free (filename);
+		return;
+	}
+
+	sax_handler.startElement = (startElementSAXFunc) rhythmdb_tree_parser_start_element;
+	sax_handler.endElement = (endElementSAXFunc) rhythmdb_tree_parser_end_element;
+	sax_handler.characters = (charactersSAXFunc) rhythmdb_tree_parser_characters;
 
+	ctx = g_new0 (struct RhythmDBTreeLoadContext, 1);
 	ctx->state = RHYTHMDB_TREE_PARSER_STATE_START;
 	ctx->db = db;
 	ctx->cancel = cancel;
 	ctx->buf = g_string_sized_new (RHYTHMDB_TREE_PARSER_INITIAL_BUFFER_SIZE);
-	ctx->error = &local_error;
+	ctx->error = &error;
+	ctx->loaded_entries = g_array_new (FALSE, FALSE, sizeof (RhythmDBTreeLoadedEntry));
+	ctx->journal = TRUE;
+	ctx->journal_base = &base;
+
+	ctxt = xmlCreatePushParserCtxt (&sax_handler, ctx, NULL, 0, filename);
+	if (ctxt != NULL) {
+		ctx->xmlctx = ctxt;
+		xmlParseChunk (ctxt, contents, length, 0);
+		xmlParseChunk (ctxt, root_end, sizeof (root_end) - 1, 1);
+		xmlFreeParserCtxt (ctxt);
+	}
+
+	if (ctx->batch_count)
+		rhythmdb_commit (RHYTHMDB (db));
+
+	if (ctx->journal_stale) {
+		rb_debug ("journal %s doesn't match the database file, ignoring it", filename);
+		g_unlink (filename);
+	} else if (g_str_has_suffix (contents, RHYTHMDB_TREE_JOURNAL_COMMIT) == FALSE) {
+		/* don't append anything after an incomplete update */
+		rb_debug ("journal %s wasn't completely written", filename);
+		db->priv->journal_needs_compaction = TRUE;
+	}
+
+	if (ctx->entry != NULL)
+		rhythmdb_entry_unref (ctx->entry);
+	g_list_free_full (ctx->keywords, (GDestroyNotify) rb_refstring_unref);
+	rhythmdb_tree_free_loaded_entries (ctx->loaded_entries, 0);
+	g_array_free (ctx->loaded_entries, TRUE);
+	g_string_free (ctx->buf, TRUE);
+	g_clear_error (&error);
+	g_free (ctx);
+	g_free (contents);
+	g_free (filename);
+}
+
+static gboolean
+rhythmdb_tree_load (RhythmDB *rdb,
+		    GCancellable *cancel,
+		    GError **error)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
+	xmlParserCtxtPtr ctxt;
+	xmlSAXHandlerPtr sax_handler;
+	struct RhythmDBTreeLoadContext *ctx;
+	char *name;
+	GError *local_error;
+	gboolean ret;
+
+	local_error = NULL;
 
 	g_object_get (G_OBJECT (db), "name", &name, NULL);
 
+	if (db->priv->use_snapshot && rhythmdb_tree_load_snapshot (db, name, cancel)) {
+		db->priv->journal_needs_compaction = FALSE;
+		rhythmdb_tree_load_journal (db, name, cancel);
+		g_free (name);
+		return TRUE;
+	}
+
+	sax_handler = g_new0 (xmlSAXHandler, 1);
+	ctx = g_new0 (struct RhythmDBTreeLoadContext, 1);
+
+	sax_handler->startElement = (startElementSAXFunc) rhythmdb_tree_parser_start_element;
+	sax_handler->endElement = (endElementSAXFunc) rhythmdb_tree_parser_end_element;
+	sax_handler->characters = (charactersSAXFunc) rhythmdb_tree_parser_characters;
+
+	ctx->state = RHYTHMDB_TREE_PARSER_STATE_START;
+	ctx->db = db;
+	ctx->cancel = cancel;
+	ctx->buf = g_string_sized_new (RHYTHMDB_TREE_PARSER_INITIAL_BUFFER_SIZE);
+	ctx->error = &local_error;
+
 	if (g_file_test (name, G_FILE_TEST_EXISTS)) {
-		ctxt = xmlCreateFileParserCtxt (name);
-		ctx->xmlctx = ctxt;
-		xmlFree (ctxt->sax);
-		ctxt->userData = ctx;
-		ctxt->sax = sax_handler;
-		xmlParseDocument (ctxt);
-		ctxt->sax = NULL;
-		xmlFreeParserCtxt (ctxt);
+		GMappedFile *mapped = NULL;
+		gboolean parsed = FALSE;
+
+		if (g_get_num_processors () > 1) {
+			mapped = g_mapped_file_new (name, FALSE, NULL);
+		}
+		if (mapped != NULL && g_mapped_file_get_length (mapped) / db->priv->load_chunk_size >= RHYTHMDB_TREE_PARALLEL_LOAD_MIN_CHUNKS) {
+			parsed = rhythmdb_tree_load_parallel (db,
+							      ctx,
+							      sax_handler,
+							      g_mapped_file_get_contents (mapped),
+							      g_mapped_file_get_length (mapped));
+		}
+		if (mapped != NULL)
+			g_mapped_file_unref (mapped);
+
+		if (parsed == FALSE) {
+			ctxt = xmlCreateFileParserCtxt (name);
+			ctx->xmlctx = ctxt;
+			xmlFree (ctxt->sax);
+			ctxt->userData = ctx;
+			ctxt->sax = sax_handler;
+			xmlParseDocument (ctxt);
+			ctxt->sax = NULL;
+			xmlFreeParserCtxt (ctxt);
+		}
 
 		if (ctx->batch_count)
 			rhythmdb_commit (RHYTHMDB (ctx->db));
@@ -797,6 +1503,13 @@ rhythmdb_tree_load (RhythmDB *rdb,
 	if (local_error != NULL) {
 		g_propagate_error (error, local_error);
 		ret = FALSE;
+	} else {
+		/* anything upgraded while loading needs to be written out in full */
+		db->priv->journal_needs_compaction = (ctx->canonicalise_uris ||
+						      ctx->reload_all_metadata ||
+						      ctx->update_podcasts ||
+						      ctx->update_local_mountpoints);
+		rhythmdb_tree_load_journal (db, name, cancel);
 	}
 
 	g_string_free (ctx->buf, TRUE);
@@ -1069,6 +1782,18 @@ save_entry (RhythmDBTree *db,
 		case RHYTHMDB_PROP_BPM:
 			save_entry_double(ctx, elt_name, entry->bpm);
 			break;
+		case RHYTHMDB_PROP_TRACK_GAIN:
+			save_entry_double (ctx, elt_name, entry->track_gain);
+			break;
+		case RHYTHMDB_PROP_TRACK_PEAK:
+			save_entry_double (ctx, elt_name, entry->track_peak);
+			break;
+		case RHYTHMDB_PROP_ALBUM_GAIN:
+			save_entry_double (ctx, elt_name, entry->album_gain);
+			break;
+		case RHYTHMDB_PROP_ALBUM_PEAK:
+			save_entry_double (ctx, elt_name, entry->album_peak);
+			break;
 		case RHYTHMDB_PROP_MOUNTPOINT:
 			save_entry_string_if_set (ctx, elt_name, rb_refstring_get (entry->mountpoint));
 			break;
@@ -1178,11 +1903,6 @@ save_entry (RhythmDBTree *db,
 		case RHYTHMDB_PROP_SEARCH_MATCH:
 		case RHYTHMDB_PROP_YEAR:
 		case RHYTHMDB_NUM_PROPERTIES:
-		/* obsolete replaygain properties */
-		case RHYTHMDB_PROP_TRACK_GAIN:
-		case RHYTHMDB_PROP_TRACK_PEAK:
-		case RHYTHMDB_PROP_ALBUM_GAIN:
-		case RHYTHMDB_PROP_ALBUM_PEAK:
 			break;
 		}
 	}
@@ -1246,11 +1966,25 @@ rhythmdb_tree_save (RhythmDB *rdb)
 	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
 	char *name;
 	GString *savepath;
+	GPtrArray *journal;
+	gboolean saved = FALSE;
 	FILE *f;
 	struct RhythmDBTreeSaveContext ctx;
 
 	g_object_get (G_OBJECT (db), "name", &name, NULL);
 
+	journal = rhythmdb_journal_steal (rdb);
+	if (journal != NULL) {
+		if (db->priv->journal_needs_compaction == FALSE)
+			saved = rhythmdb_tree_save_journal (db, name, journal);
+		g_ptr_array_unref (journal);
+
+		if (saved) {
+			g_free (name);
+			return;
+		}
+	}
+
 	savepath = g_string_new (name);
 	g_string_append (savepath, ".tmp");
 
@@ -1290,548 +2024,1810 @@ rhythmdb_tree_save (RhythmDB *rdb)
 		g_free (ctx.error);
 		unlink (savepath->str);
 	} else {
+		char *snapshot;
+
+		/* the old snapshot no longer matches the database */
+		snapshot = snapshot_filename (name);
+		g_unlink (snapshot);
+		g_free (snapshot);
+
 		if (rename (savepath->str, name) < 0) {
 			g_warning ("Couldn't rename %s to %s: %s",
 				   name, savepath->str,
 				   g_strerror (errno));
 			unlink (savepath->str);
+		} else {
+			char *journal_file;
+
+			/* everything in the journal is in the database file now */
+			journal_file = journal_filename (name);
+			g_unlink (journal_file);
+			g_free (journal_file);
+			db->priv->journal_needs_compaction = FALSE;
+
+			if (db->priv->use_snapshot)
+				rhythmdb_tree_save_snapshot (db, name);
+			saved = TRUE;
 		}
 	}
 
 out:
+	/* changes made since the last successful save weren't written,
+	 * so the next save can't just append to the journal.
+	 */
+	if (saved == FALSE)
+		db->priv->journal_needs_compaction = TRUE;
+
 	g_string_free (savepath, TRUE);
 	g_free (name);
 	return;
 }
 
-#undef RHYTHMDB_FWRITE_ENCODED_STR
-#undef RHYTHMDB_FWRITE_STATICSTR
-#undef RHYTHMDB_FPUTC
-#undef RHYTHMDB_FWRITE
+/*
+ * Change journal.
+ *
+ * Rather than rewriting the whole database file each time something
+ * changes, the changes since the last save are appended to a journal
+ * file next to it.  Each save appends the current state of each changed
+ * entry and a delete record for each removed location, followed by a
+ * commit marker.  The journal header records the size, modification time
+ * and inode of the database file it applies to, and the journal is
+ * compacted into a full save once it grows large relative to the database.
+ */
 
-RhythmDB *
-rhythmdb_tree_new (const char *name)
+static char *
+journal_filename (const char *name)
 {
-	RhythmDBTree *db = g_object_new (RHYTHMDB_TYPE_TREE, "name", name, NULL);
-
-	g_return_val_if_fail (db->priv != NULL, NULL);
-
-	return RHYTHMDB (db);
+	return g_strconcat (name, RHYTHMDB_TREE_JOURNAL_SUFFIX, NULL);
 }
 
-/* must be called with the genres_lock held */
-static void
-set_entry_album (RhythmDBTree *db,
-		 RhythmDBEntry *entry,
-		 RhythmDBTreeProperty *artist,
-		 RBRefString *name)
+static gboolean
+rhythmdb_tree_save_journal (RhythmDBTree *db,
+			    const char *name,
+			    GPtrArray *journal)
 {
-	struct RhythmDBTreeProperty *prop;
+	struct RhythmDBTreeSaveContext ctx;
+	GStatBuf base;
+	GStatBuf current;
+	gboolean exists;
+	char *filename;
+	FILE *f;
+	guint i;
 
-	prop = get_or_create_album (db, artist, name);
-	g_hash_table_insert (prop->children, entry, NULL);
-	entry->data = prop;
-}
+	if (journal->len == 0)
+		return TRUE;
 
-static void
-rhythmdb_tree_entry_new (RhythmDB *rdb,
-			 RhythmDBEntry *entry)
-{
-	g_mutex_lock (&RHYTHMDB_TREE(rdb)->priv->entries_lock);
-	rhythmdb_tree_entry_new_internal (rdb, entry);
-	g_mutex_unlock (&RHYTHMDB_TREE(rdb)->priv->entries_lock);
-}
+	/* need a database file to apply the journal to */
+	if (g_stat (name, &base) != 0)
+		return FALSE;
 
-/* must be called with the entry lock held */
-static void
-rhythmdb_tree_entry_new_internal (RhythmDB *rdb, RhythmDBEntry *entry)
-{
-	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
-	RhythmDBTreeProperty *artist;
-	RhythmDBTreeProperty *genre;
+	filename = journal_filename (name);
+	exists = (g_stat (filename, &current) == 0);
+	if (exists && current.st_size > base.st_size / RHYTHMDB_TREE_JOURNAL_COMPACT_RATIO) {
+		rb_debug ("journal is getting large, compacting database");
+		g_free (filename);
+		return FALSE;
+	}
 
-	rb_assert_locked (&db->priv->entries_lock);
-	g_assert (entry != NULL);
+	f = fopen (filename, "a");
+	if (f == NULL) {
+		g_warning ("Can't write to journal %s: %s", filename, g_strerror (errno));
+		g_free (filename);
+		return FALSE;
+	}
 
-	g_return_if_fail (entry->location != NULL);
+	ctx.db = db;
+	ctx.handle = f;
+	ctx.error = NULL;
 
-	if (entry->title == NULL) {
-		g_warning ("Entry %s has missing title", rb_refstring_get (entry->location));
-		entry->title = rb_refstring_new (_("Unknown"));
-	}
-	if (entry->artist == NULL) {
-		g_warning ("Entry %s has missing artist", rb_refstring_get (entry->location));
-		entry->artist = rb_refstring_new (_("Unknown"));
-	}
-	if (entry->album == NULL) {
-		g_warning ("Entry %s has missing album", rb_refstring_get (entry->location));
-		entry->album = rb_refstring_new (_("Unknown"));
-	}
-	if (entry->genre == NULL) {
-		g_warning ("Entry %s has missing genre", rb_refstring_get (entry->location));
-		entry->genre = rb_refstring_new (_("Unknown"));
+	if (exists == FALSE) {
+		char *header;
+
+		header = g_strdup_printf ("<?xml version=\"1.0\" standalone=\"yes\"?>\n"
+					  "<rhythmdb-journal version=\"" RHYTHMDB_TREE_XML_VERSION "\" "
+					  "size=\"%" G_GUINT64_FORMAT "\" "
+					  "mtime=\"%" G_GUINT64_FORMAT "\" "
+					  "inode=\"%" G_GUINT64_FORMAT "\">\n",
+					  (guint64) base.st_size,
+					  (guint64) base.st_mtime,
+					  (guint64) base.st_ino);
+		RHYTHMDB_FWRITE (header, 1, strlen (header), ctx.handle, ctx.error);
+		g_free (header);
 	}
-	if (entry->media_type == NULL) {
-		g_warning ("Entry %s has missing media type", rb_refstring_get (entry->location));
-		entry->media_type = rb_refstring_new ("unknown/unknown");
-	}
-
-	/* Initialize the tree structure. */
-	g_mutex_lock (&db->priv->genres_lock);
-	genre = get_or_create_genre (db, entry->type, entry->genre);
-	artist = get_or_create_artist (db, genre, entry->artist);
-	set_entry_album (db, entry, artist, entry->album);
-	g_mutex_unlock (&db->priv->genres_lock);
 
-	/* this accounts for the initial reference on the entry */
-	g_hash_table_insert (db->priv->entries, entry->location, entry);
-	g_hash_table_insert (db->priv->entry_ids, GINT_TO_POINTER (entry->id), entry);
+	for (i = 0; i < journal->len; i++) {
+		RhythmDBJournalRecord *record = g_ptr_array_index (journal, i);
 
-	entry->flags &= ~RHYTHMDB_ENTRY_TREE_LOADING;
-}
+		if (record->entry != NULL) {
+			gboolean save_to_disk = FALSE;
 
-static RhythmDBTreeProperty *
-rhythmdb_tree_property_new (RhythmDBTree *db)
-{
-	RhythmDBTreeProperty *ret = g_new0 (RhythmDBTreeProperty, 1);
-#ifndef G_DISABLE_ASSERT
-	ret->magic = 0xf00dbeef;
-#endif
-	return ret;
-}
+			if (record->entry->flags & RHYTHMDB_ENTRY_TREE_REMOVED)
+				continue;
 
-static GHashTable *
-get_genres_hash_for_type (RhythmDBTree *db,
-			  RhythmDBEntryType *type)
-{
-	GHashTable *table;
+			g_object_get (record->entry->type, "save-to-disk", &save_to_disk, NULL);
+			if (save_to_disk)
+				save_entry (db, record->entry, &ctx);
+		} else if (record->location != NULL) {
+			xmlChar *encoded;
 
-	table = g_hash_table_lookup (db->priv->genres, type);
-	if (table == NULL) {
-		table = g_hash_table_new_full (rb_refstring_hash,
-					       rb_refstring_equal,
-					       (GDestroyNotify) rb_refstring_unref,
-					       NULL);
-		if (table == NULL) {
-			g_warning ("Out of memory\n");
-			return NULL;
+			encoded = xmlEncodeSpecialChars (NULL, BAD_CAST rb_refstring_get (record->location));
+			RHYTHMDB_FWRITE_STATICSTR ("  <delete location=\"", ctx.handle, ctx.error);
+			RHYTHMDB_FWRITE (encoded, 1, xmlStrlen (encoded), ctx.handle, ctx.error);
+			RHYTHMDB_FWRITE_STATICSTR ("\"/>\n", ctx.handle, ctx.error);
+			g_free (encoded);
 		}
-		g_hash_table_insert (db->priv->genres,
-				     type,
-				     table);
 	}
-	return table;
-}
+	RHYTHMDB_FWRITE_STATICSTR (RHYTHMDB_TREE_JOURNAL_COMMIT, ctx.handle, ctx.error);
 
-typedef void (*RBHFunc)(RhythmDBTree *db, GHashTable *genres, gpointer data);
+	if (ctx.error == NULL && (fflush (f) != 0 || fsync (fileno (f)) != 0))
+		ctx.error = g_strdup (g_strerror (errno));
 
-typedef struct {
-	RhythmDBTree *db;
-	RBHFunc func;
-	gpointer data;
-} GenresIterCtxt;
+	if (fclose (f) < 0 && ctx.error == NULL)
+		ctx.error = g_strdup (g_strerror (errno));
 
-static void
-genres_process_one (gpointer key,
-		    gpointer value,
-		    gpointer user_data)
-{
-	GenresIterCtxt *ctxt = (GenresIterCtxt *)user_data;
-	ctxt->func (ctxt->db, (GHashTable *)value, ctxt->data);
+	if (ctx.error != NULL) {
+		g_warning ("Writing to the journal %s failed: %s", filename, ctx.error);
+		g_free (ctx.error);
+		g_free (filename);
+		return FALSE;
+	}
+
+	rb_debug ("appended %d changes to journal", journal->len);
+	g_free (filename);
+	return TRUE;
 }
 
-static void
-genres_hash_foreach (RhythmDBTree *db, RBHFunc func, gpointer data)
+/*
+ * Binary database snapshot.
+ *
+ * The snapshot is written next to the XML database after each successful
+ * save, and contains the same entries in a form that can be mapped and
+ * turned into entries without parsing anything.  The layout is:
+ *
+ *   header
+ *   guint32 string offsets[n_strings]
+ *   string data (NUL terminated strings), padded to 8 bytes
+ *   entry records[n_records]
+ *   guint32 keyword string indexes[n_keywords]
+ *
+ * All values are stored in host byte order.  The header records the size
+ * and modification time of the XML file written at the same time, so a
+ * snapshot that is older than the XML file (or written by a different
+ * version, or on a different architecture) is ignored and the XML file
+ * is loaded instead.
+ */
+
+#define RHYTHMDB_TREE_SNAPSHOT_MAGIC		"RBDBSNAP"
+#define RHYTHMDB_TREE_SNAPSHOT_VERSION		2
+#define RHYTHMDB_TREE_SNAPSHOT_BYTE_ORDER	0x01020304
+#define RHYTHMDB_TREE_SNAPSHOT_NO_STRING	G_MAXUINT32
+#define RHYTHMDB_TREE_SNAPSHOT_SUFFIX		".snapshot"
+
+#define RHYTHMDB_TREE_SNAPSHOT_ALIGN(x)		(((x) + 7) & ~((guint64) 7))
+
+enum {
+	SNAPSHOT_STRING_LOCATION,
+	SNAPSHOT_STRING_TITLE,
+	SNAPSHOT_STRING_ARTIST,
+	SNAPSHOT_STRING_COMPOSER,
+	SNAPSHOT_STRING_ALBUM,
+	SNAPSHOT_STRING_ALBUM_ARTIST,
+	SNAPSHOT_STRING_GENRE,
+	SNAPSHOT_STRING_COMMENT,
+	SNAPSHOT_STRING_MUSICBRAINZ_TRACKID,
+	SNAPSHOT_STRING_MUSICBRAINZ_ARTISTID,
+	SNAPSHOT_STRING_MUSICBRAINZ_ALBUMID,
+	SNAPSHOT_STRING_MUSICBRAINZ_ALBUMARTISTID,
+	SNAPSHOT_STRING_ARTIST_SORTNAME,
+	SNAPSHOT_STRING_COMPOSER_SORTNAME,
+	SNAPSHOT_STRING_ALBUM_SORTNAME,
+	SNAPSHOT_STRING_ALBUM_ARTIST_SORTNAME,
+	SNAPSHOT_STRING_MOUNTPOINT,
+	SNAPSHOT_STRING_MEDIA_TYPE,
+	SNAPSHOT_STRING_DESCRIPTION,
+	SNAPSHOT_STRING_SUBTITLE,
+	SNAPSHOT_STRING_SUMMARY,
+	SNAPSHOT_STRING_LANG,
+	SNAPSHOT_STRING_COPYRIGHT,
+	SNAPSHOT_STRING_IMAGE,
+	SNAPSHOT_NUM_STRINGS
+};
+
+enum {
+	SNAPSHOT_RECORD_HIDDEN = 1,
+};
+
+typedef struct
 {
-	GenresIterCtxt ctxt;
+	char magic[8];
+	guint32 version;
+	guint32 byte_order;
+	guint32 record_size;
+	guint32 n_strings;
+	guint32 n_records;
+	guint32 n_keywords;
+	guint64 string_data_size;
+	guint64 xml_size;
+	gint64 xml_mtime;
+} RhythmDBTreeSnapshotHeader;
 
-	ctxt.db = db;
-	ctxt.func = func;
-	ctxt.data = data;
-	g_hash_table_foreach (db->priv->genres, genres_process_one, &ctxt);
+typedef struct
+{
+	guint64 file_size;
+	guint64 mtime;
+	guint64 first_seen;
+	guint64 last_seen;
+	guint64 last_played;
+	guint64 post_time;
+	gint64 play_count;
+	double rating;
+	double bpm;
+	double track_gain;
+	double track_peak;
+	double album_gain;
+	double album_peak;
+	guint32 type;
+	guint32 flags;
+	guint32 tracknum;
+	guint32 tracktotal;
+	guint32 discnum;
+	guint32 disctotal;
+	guint32 duration;
+	guint32 bitrate;
+	guint32 date;
+	guint32 status;
+	guint32 keywords;
+	guint32 n_keywords;
+	guint32 strings[SNAPSHOT_NUM_STRINGS];
+} RhythmDBTreeSnapshotRecord;
+
+struct RhythmDBTreeSnapshotSaveContext
+{
+	RhythmDBTree *db;
+	GHashTable *string_map;
+	GHashTable *type_map;
+	GArray *string_offsets;
+	GString *string_data;
+	GArray *records;
+	GArray *keywords;
+};
+
+static char *
+snapshot_filename (const char *name)
+{
+	return g_strconcat (name, RHYTHMDB_TREE_SNAPSHOT_SUFFIX, NULL);
 }
 
-/* must be called with the genres lock held */
-static RhythmDBTreeProperty *
-get_or_create_genre (RhythmDBTree *db,
-		     RhythmDBEntryType *type,
-		     RBRefString *name)
+static guint32
+snapshot_add_string (struct RhythmDBTreeSnapshotSaveContext *ctx,
+		     RBRefString *str)
 {
-	RhythmDBTreeProperty *genre;
-	GHashTable *table;
+	gpointer index;
+	guint32 offset;
+	const char *s;
 
-	rb_assert_locked (&db->priv->genres_lock);
+	if (str == NULL)
+		return RHYTHMDB_TREE_SNAPSHOT_NO_STRING;
 
-	table = get_genres_hash_for_type (db, type);
-	genre = g_hash_table_lookup (table, name);
+	if (g_hash_table_lookup_extended (ctx->string_map, str, NULL, &index))
+		return GPOINTER_TO_UINT (index);
 
-	if (G_UNLIKELY (genre == NULL)) {
-		genre = rhythmdb_tree_property_new (db);
-		genre->children = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
-							 (GDestroyNotify) rb_refstring_unref,
-							 NULL);
-		rb_refstring_ref (name);
-		g_hash_table_insert (table, name, genre);
-		genre->parent = NULL;
-	}
+	s = rb_refstring_get (str);
+	offset = ctx->string_data->len;
+	g_array_append_val (ctx->string_offsets, offset);
+	g_string_append_len (ctx->string_data, s, strlen (s) + 1);
 
-	return genre;
+	index = GUINT_TO_POINTER (ctx->string_offsets->len - 1);
+	g_hash_table_insert (ctx->string_map, rb_refstring_ref (str), index);
+	return GPOINTER_TO_UINT (index);
 }
 
-/* must be called with the genres lock held */
-static RhythmDBTreeProperty *
-get_or_create_artist (RhythmDBTree *db,
-		      RhythmDBTreeProperty *genre,
-		      RBRefString *name)
+static guint32
+snapshot_add_entry_type (struct RhythmDBTreeSnapshotSaveContext *ctx,
+			 RhythmDBEntryType *type)
 {
-	RhythmDBTreeProperty *artist;
-
-	rb_assert_locked (&db->priv->genres_lock);
+	gpointer index;
+	RBRefString *name;
 
-	artist = g_hash_table_lookup (genre->children, name);
+	if (g_hash_table_lookup_extended (ctx->type_map, type, NULL, &index))
+		return GPOINTER_TO_UINT (index);
 
-	if (G_UNLIKELY (artist == NULL)) {
-		artist = rhythmdb_tree_property_new (db);
-		artist->children = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
-							  (GDestroyNotify) rb_refstring_unref,
-							  NULL);
-		rb_refstring_ref (name);
-		g_hash_table_insert (genre->children, name, artist);
-		artist->parent = genre;
-	}
+	name = rb_refstring_new (rhythmdb_entry_type_get_name (type));
+	index = GUINT_TO_POINTER (snapshot_add_string (ctx, name));
+	rb_refstring_unref (name);
 
-	return artist;
+	g_hash_table_insert (ctx->type_map, type, index);
+	return GPOINTER_TO_UINT (index);
 }
 
-/* must be called with the genres lock held */
-static RhythmDBTreeProperty *
-get_or_create_album (RhythmDBTree *db,
-		     RhythmDBTreeProperty *artist,
-		     RBRefString *name)
+/* called with the genres lock held, from rhythmdb_hash_tree_foreach */
+static void
+snapshot_save_entry (RhythmDBTree *db,
+		     RhythmDBEntry *entry,
+		     struct RhythmDBTreeSnapshotSaveContext *ctx)
 {
-	RhythmDBTreeProperty *album;
+	RhythmDBTreeSnapshotRecord rec;
+	RhythmDBPodcastFields *podcast = NULL;
+	GList *keywords, *l;
+	guint i;
 
-	rb_assert_locked (&db->priv->genres_lock);
+	memset (&rec, 0, sizeof (rec));
+	for (i = 0; i < SNAPSHOT_NUM_STRINGS; i++)
+		rec.strings[i] = RHYTHMDB_TREE_SNAPSHOT_NO_STRING;
+
+	rec.type = snapshot_add_entry_type (ctx, entry->type);
+	if (entry->flags & RHYTHMDB_ENTRY_HIDDEN)
+		rec.flags |= SNAPSHOT_RECORD_HIDDEN;
+
+	rec.strings[SNAPSHOT_STRING_LOCATION] = snapshot_add_string (ctx, entry->location);
+	rec.strings[SNAPSHOT_STRING_TITLE] = snapshot_add_string (ctx, entry->title);
+	rec.strings[SNAPSHOT_STRING_ARTIST] = snapshot_add_string (ctx, entry->artist);
+	rec.strings[SNAPSHOT_STRING_COMPOSER] = snapshot_add_string (ctx, entry->composer);
+	rec.strings[SNAPSHOT_STRING_ALBUM] = snapshot_add_string (ctx, entry->album);
+	rec.strings[SNAPSHOT_STRING_ALBUM_ARTIST] = snapshot_add_string (ctx, entry->album_artist);
+	rec.strings[SNAPSHOT_STRING_GENRE] = snapshot_add_string (ctx, entry->genre);
+	rec.strings[SNAPSHOT_STRING_COMMENT] = snapshot_add_string (ctx, entry->comment);
+	rec.strings[SNAPSHOT_STRING_MUSICBRAINZ_TRACKID] = snapshot_add_string (ctx, entry->musicbrainz_trackid);
+	rec.strings[SNAPSHOT_STRING_MUSICBRAINZ_ARTISTID] = snapshot_add_string (ctx, entry->musicbrainz_artistid);
+	rec.strings[SNAPSHOT_STRING_MUSICBRAINZ_ALBUMID] = snapshot_add_string (ctx, entry->musicbrainz_albumid);
+	rec.strings[SNAPSHOT_STRING_MUSICBRAINZ_ALBUMARTISTID] = snapshot_add_string (ctx, entry->musicbrainz_albumartistid);
+	rec.strings[SNAPSHOT_STRING_ARTIST_SORTNAME] = snapshot_add_string (ctx, entry->artist_sortname);
+	rec.strings[SNAPSHOT_STRING_COMPOSER_SORTNAME] = snapshot_add_string (ctx, entry->composer_sortname);
+	rec.strings[SNAPSHOT_STRING_ALBUM_SORTNAME] = snapshot_add_string (ctx, entry->album_sortname);
+	rec.strings[SNAPSHOT_STRING_ALBUM_ARTIST_SORTNAME] = snapshot_add_string (ctx, entry->album_artist_sortname);
+	rec.strings[SNAPSHOT_STRING_MOUNTPOINT] = snapshot_add_string (ctx, entry->mountpoint);
+	rec.strings[SNAPSHOT_STRING_MEDIA_TYPE] = snapshot_add_string (ctx, entry->media_type);
+
+	rec.tracknum = entry->tracknum;
+	rec.tracktotal = entry->tracktotal;
+	rec.discnum = entry->discnum;
+	rec.disctotal = entry->disctotal;
+	rec.duration = entry->duration;
+	rec.bitrate = entry->bitrate;
+	rec.bpm = entry->bpm;
+	rec.track_gain = entry->track_gain;
+	rec.track_peak = entry->track_peak;
+	rec.album_gain = entry->album_gain;
+	rec.album_peak = entry->album_peak;
+	rec.date = g_date_valid (&entry->date) ? g_date_get_julian (&entry->date) : 0;
+	rec.file_size = entry->file_size;
+	rec.mtime = entry->mtime;
+	rec.first_seen = entry->first_seen;
+	rec.last_seen = entry->last_seen;
+	rec.rating = entry->rating;
+	rec.play_count = entry->play_count;
+	rec.last_played = entry->last_played;
 
-	album = g_hash_table_lookup (artist->children, name);
+	if (entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED ||
+	    entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST)
+		podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (entry, RhythmDBPodcastFields);
 
-	if (G_UNLIKELY (album == NULL)) {
-		album = rhythmdb_tree_property_new (db);
-		album->children = g_hash_table_new (g_direct_hash, g_direct_equal);
-		rb_refstring_ref (name);
-		g_hash_table_insert (artist->children, name, album);
-		album->parent = artist;
+	if (podcast != NULL) {
+		rec.strings[SNAPSHOT_STRING_DESCRIPTION] = snapshot_add_string (ctx, podcast->description);
+		rec.strings[SNAPSHOT_STRING_SUBTITLE] = snapshot_add_string (ctx, podcast->subtitle);
+		rec.strings[SNAPSHOT_STRING_SUMMARY] = snapshot_add_string (ctx, podcast->summary);
+		rec.strings[SNAPSHOT_STRING_LANG] = snapshot_add_string (ctx, podcast->lang);
+		rec.strings[SNAPSHOT_STRING_COPYRIGHT] = snapshot_add_string (ctx, podcast->copyright);
+		rec.strings[SNAPSHOT_STRING_IMAGE] = snapshot_add_string (ctx, podcast->image);
+		rec.status = podcast->status;
+		rec.post_time = podcast->post_time;
 	}
 
-	return album;
+	rec.keywords = ctx->keywords->len;
+	keywords = rhythmdb_entry_keywords_get (RHYTHMDB (db), entry);
+	for (l = keywords; l != NULL; l = l->next) {
+		guint32 index = snapshot_add_string (ctx, (RBRefString *) l->data);
+		g_array_append_val (ctx->keywords, index);
+		rec.n_keywords++;
+		rb_refstring_unref ((RBRefString *) l->data);
+	}
+	g_list_free (keywords);
+
+	g_array_append_val (ctx->records, rec);
 }
 
-static gboolean
-remove_child (RhythmDBTreeProperty *parent,
-	      gconstpointer data)
+static void
+snapshot_save_entry_type (const char *name,
+			  RhythmDBEntryType *entry_type,
+			  struct RhythmDBTreeSnapshotSaveContext *ctx)
 {
-	g_assert (g_hash_table_remove (parent->children, data));
-	if (g_hash_table_size (parent->children) <= 0) {
-		return TRUE;
-	}
-	return FALSE;
+	gboolean save_to_disk = FALSE;
+	g_object_get (entry_type, "save-to-disk", &save_to_disk, NULL);
+	if (save_to_disk == FALSE)
+		return;
+
+	rhythmdb_hash_tree_foreach (RHYTHMDB (ctx->db), entry_type,
+				    (RBTreeEntryItFunc) snapshot_save_entry,
+				    NULL, NULL, NULL, ctx);
 }
 
-/* must be called with the genres lock held */
+/* writes the snapshot for the XML database file 'name', which must have just been saved */
 static void
-remove_entry_from_album (RhythmDBTree *db,
-			 RhythmDBEntry *entry)
+rhythmdb_tree_save_snapshot (RhythmDBTree *db, const char *name)
 {
-	GHashTable *table;
+	struct RhythmDBTreeSnapshotSaveContext ctx;
+	RhythmDBTreeSnapshotHeader header;
+	GStatBuf xml_stat;
+	char *filename;
+	char *tmpname;
+	char *error = NULL;
+	guint64 pad;
+	gboolean skip;
+	FILE *f;
 
-	rb_assert_locked (&db->priv->genres_lock);
+	filename = snapshot_filename (name);
 
-	rb_refstring_ref (entry->genre);
-	rb_refstring_ref (entry->artist);
-	rb_refstring_ref (entry->album);
+	/* entries of unregistered types are only kept in the XML file */
+	g_mutex_lock (&db->priv->entries_lock);
+	skip = (g_hash_table_size (db->priv->unknown_entry_types) > 0);
+	g_mutex_unlock (&db->priv->entries_lock);
+	if (skip) {
+		rb_debug ("database contains entries of unknown types, not writing snapshot");
+		g_unlink (filename);
+		g_free (filename);
+		return;
+	}
 
-	table = get_genres_hash_for_type (db, entry->type);
-	if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry), entry)) {
-		if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent,
-				  entry->album)) {
+	if (g_stat (name, &xml_stat) < 0) {
+		g_free (filename);
+		return;
+	}
 
-			if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent->parent,
-					  entry->artist)) {
-				destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent->parent);
-				g_assert (g_hash_table_remove (table, entry->genre));
-			}
-			destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent);
-		}
+	rb_profile_start ("writing database snapshot");
+	ctx.db = db;
+	ctx.string_map = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+						(GDestroyNotify) rb_refstring_unref, NULL);
+	ctx.type_map = g_hash_table_new (g_direct_hash, g_direct_equal);
+	ctx.string_offsets = g_array_new (FALSE, FALSE, sizeof (guint32));
+	ctx.string_data = g_string_sized_new (1024 * 1024);
+	ctx.records = g_array_sized_new (FALSE, FALSE, sizeof (RhythmDBTreeSnapshotRecord),
+					 g_hash_table_size (db->priv->entries));
+	ctx.keywords = g_array_new (FALSE, FALSE, sizeof (guint32));
+
+	rhythmdb_entry_type_foreach (RHYTHMDB (db), (GHFunc) snapshot_save_entry_type, &ctx);
+
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, RHYTHMDB_TREE_SNAPSHOT_MAGIC, sizeof (header.magic));
+	header.version = RHYTHMDB_TREE_SNAPSHOT_VERSION;
+	header.byte_order = RHYTHMDB_TREE_SNAPSHOT_BYTE_ORDER;
+	header.record_size = sizeof (RhythmDBTreeSnapshotRecord);
+	header.n_strings = ctx.string_offsets->len;
+	header.n_records = ctx.records->len;
+	header.n_keywords = ctx.keywords->len;
+	header.string_data_size = ctx.string_data->len;
+	header.xml_size = xml_stat.st_size;
+	header.xml_mtime = xml_stat.st_mtime;
+
+	tmpname = g_strconcat (filename, ".tmp", NULL);
+	f = fopen (tmpname, "w");
+	if (f == NULL) {
+		g_warning ("Can't save database snapshot: %s", g_strerror (errno));
+		goto out;
+	}
 
-		destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry));
+	RHYTHMDB_FWRITE (&header, sizeof (header), 1, f, error);
+	if (header.n_strings > 0)
+		RHYTHMDB_FWRITE (ctx.string_offsets->data, sizeof (guint32), header.n_strings, f, error);
+	if (header.string_data_size > 0)
+		RHYTHMDB_FWRITE (ctx.string_data->str, 1, header.string_data_size, f, error);
+
+	pad = sizeof (header) + (sizeof (guint32) * header.n_strings) + header.string_data_size;
+	for (pad = RHYTHMDB_TREE_SNAPSHOT_ALIGN (pad) - pad; pad > 0; pad--)
+		RHYTHMDB_FPUTC ('\0', f, error);
+
+	if (header.n_records > 0)
+		RHYTHMDB_FWRITE (ctx.records->data, sizeof (RhythmDBTreeSnapshotRecord), header.n_records, f, error);
+	if (header.n_keywords > 0)
+		RHYTHMDB_FWRITE (ctx.keywords->data, sizeof (guint32), header.n_keywords, f, error);
+
+	if (fclose (f) < 0 && error == NULL)
+		error = g_strdup (g_strerror (errno));
+
+	if (error != NULL) {
+		g_warning ("Writing the database snapshot failed: %s", error);
+		g_free (error);
+		unlink (tmpname);
+	} else if (rename (tmpname, filename) < 0) {
+		g_warning ("Couldn't rename %s to %s: %s",
+			   tmpname, filename,
+			   g_strerror (errno));
+		unlink (tmpname);
+	} else {
+		rb_debug ("wrote snapshot with %u entries, %u strings", header.n_records, header.n_strings);
 	}
 
-	rb_refstring_unref (entry->genre);
-	rb_refstring_unref (entry->artist);
-	rb_refstring_unref (entry->album);
+out:
+	g_hash_table_destroy (ctx.string_map);
+	g_hash_table_destroy (ctx.type_map);
+	g_array_free (ctx.string_offsets, TRUE);
+	g_string_free (ctx.string_data, TRUE);
+	g_array_free (ctx.records, TRUE);
+	g_array_free (ctx.keywords, TRUE);
+	g_free (tmpname);
+	g_free (filename);
+	rb_profile_end ("writing database snapshot");
 }
 
-static gboolean
-rhythmdb_tree_entry_set (RhythmDB *adb,
-			 RhythmDBEntry *entry,
-			 guint propid,
-			 const GValue *value)
+struct RhythmDBTreeSnapshotLoadContext
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (adb);
-	RhythmDBEntryType *type;
+	const RhythmDBTreeSnapshotHeader *header;
+	const guint32 *string_offsets;
+	const char *string_data;
+	const RhythmDBTreeSnapshotRecord *records;
+	const guint32 *keywords;
+
+	RBRefString **strings;
+	RhythmDBEntryType **types;
+};
 
-	type = entry->type;
+static RBRefString *
+snapshot_get_string (struct RhythmDBTreeSnapshotLoadContext *ctx,
+		     guint32 index)
+{
+	if (index == RHYTHMDB_TREE_SNAPSHOT_NO_STRING)
+		return NULL;
 
-	/* don't process changes to entries we're loading, we'll get them
-	 * when the entry is complete.  don't process changes for entries that
-	 * have been removed either.
-	 */
-	if (entry->flags & (RHYTHMDB_ENTRY_TREE_LOADING | RHYTHMDB_ENTRY_TREE_REMOVED))
-		return FALSE;
+	if (ctx->strings[index] == NULL)
+		ctx->strings[index] = rb_refstring_new (ctx->string_data + ctx->string_offsets[index]);
 
-	/* Handle special properties */
-	switch (propid)
-	{
-	case RHYTHMDB_PROP_TYPE:
-	{
-		RhythmDBTreeProperty *artist;
-		RhythmDBTreeProperty *genre;
+	return rb_refstring_ref (ctx->strings[index]);
+}
 
-		g_mutex_lock (&db->priv->genres_lock);
-		remove_entry_from_album (db, entry);
+#define SNAPSHOT_SET_STRING(ctx, rec, field, index) do {				\
+	RBRefString *snapshot_str = snapshot_get_string (ctx, (rec)->strings[index]);	\
+	if (snapshot_str != NULL) {							\
+		rb_refstring_unref (field);						\
+		field = snapshot_str;							\
+	}										\
+} while (0)
 
-		entry->type = g_value_get_object (value);
+static gboolean
+snapshot_check_string (const RhythmDBTreeSnapshotHeader *header, guint32 index)
+{
+	return (index == RHYTHMDB_TREE_SNAPSHOT_NO_STRING || index < header->n_strings);
+}
 
-		genre = get_or_create_genre (db, entry->type, entry->genre);
-		artist = get_or_create_artist (db, genre, entry->artist);
-		set_entry_album (db, entry, artist, entry->album);
-		g_mutex_unlock (&db->priv->genres_lock);
+/* checks everything we'll look at while creating entries, so a broken
+ * snapshot can be rejected before anything has been added to the database.
+ */
+static gboolean
+snapshot_validate (RhythmDBTree *db,
+		   struct RhythmDBTreeSnapshotLoadContext *ctx)
+{
+	const RhythmDBTreeSnapshotHeader *header = ctx->header;
+	guint32 i, j;
 
-		return TRUE;
+	for (i = 0; i < header->n_strings; i++) {
+		if (ctx->string_offsets[i] >= header->string_data_size) {
+			rb_debug ("snapshot string %u out of range", i);
+			return FALSE;
+		}
 	}
-	case RHYTHMDB_PROP_LOCATION:
-	{
-		RBRefString *s;
-		/* We have to use the string in the entry itself as the hash key,
-		 * otherwise either we leak it, or the string vanishes when the
-		 * GValue is freed; this means we have to do the entry modification
-		 * here, rather than letting rhythmdb_entry_set_internal do it.
-		 */
-		g_mutex_lock (&db->priv->entries_lock);
-		g_assert (g_hash_table_remove (db->priv->entries, entry->location));
-
-		s = rb_refstring_new (g_value_get_string (value));
-		rb_refstring_unref (entry->location);
-		entry->location = s;
-		g_hash_table_insert (db->priv->entries, entry->location, entry);
-		g_mutex_unlock (&db->priv->entries_lock);
-
-		return TRUE;
+	if (header->n_strings > 0 && ctx->string_data[header->string_data_size - 1] != '\0') {
+		rb_debug ("snapshot string data not terminated");
+		return FALSE;
 	}
-	case RHYTHMDB_PROP_ALBUM:
-	{
-		const char *albumname = g_value_get_string (value);
-
-		if (strcmp (rb_refstring_get (entry->album), albumname)) {
-			RhythmDBTreeProperty *artist;
-			RhythmDBTreeProperty *genre;
 
-			rb_refstring_ref (entry->genre);
-			rb_refstring_ref (entry->artist);
-			rb_refstring_ref (entry->album);
+	for (i = 0; i < header->n_records; i++) {
+		const RhythmDBTreeSnapshotRecord *rec = &ctx->records[i];
 
-			g_mutex_lock (&db->priv->genres_lock);
-			remove_entry_from_album (db, entry);
-			genre = get_or_create_genre (db, type, entry->genre);
-			artist = get_or_create_artist (db, genre, entry->artist);
-			set_entry_album (db, entry, artist, rb_refstring_new (albumname));
-			g_mutex_unlock (&db->priv->genres_lock);
+		if (rec->type >= header->n_strings ||
+		    rec->strings[SNAPSHOT_STRING_LOCATION] >= header->n_strings) {
+			rb_debug ("snapshot record %u has no type or location", i);
+			return FALSE;
+		}
+		for (j = 0; j < SNAPSHOT_NUM_STRINGS; j++) {
+			if (snapshot_check_string (header, rec->strings[j]) == FALSE) {
+				rb_debug ("snapshot record %u has invalid string index", i);
+				return FALSE;
+			}
+		}
+		if ((guint64) rec->keywords + rec->n_keywords > header->n_keywords) {
+			rb_debug ("snapshot record %u has invalid keywords", i);
+			return FALSE;
+		}
 
-			rb_refstring_unref (entry->genre);
-			rb_refstring_unref (entry->artist);
-			rb_refstring_unref (entry->album);
+		/* entries of types that aren't registered yet need to be kept
+		 * around as unknown entries, which only the XML loader does.
+		 */
+		if (ctx->types[rec->type] == NULL) {
+			const char *typename = ctx->string_data + ctx->string_offsets[rec->type];
+			ctx->types[rec->type] = rhythmdb_entry_type_get_by_name (RHYTHMDB (db), typename);
+			if (ctx->types[rec->type] == NULL) {
+				rb_debug ("snapshot contains entries of unknown type %s", typename);
+				return FALSE;
+			}
 		}
-		break;
 	}
-	case RHYTHMDB_PROP_ARTIST:
-	{
-		const char *artistname = g_value_get_string (value);
 
-		if (strcmp (rb_refstring_get (entry->artist), artistname)) {
-			RhythmDBTreeProperty *new_artist;
-			RhythmDBTreeProperty *genre;
+	for (i = 0; i < header->n_keywords; i++) {
+		if (ctx->keywords[i] >= header->n_strings) {
+			rb_debug ("snapshot keyword %u out of range", i);
+			return FALSE;
+		}
+	}
 
-			rb_refstring_ref (entry->genre);
-			rb_refstring_ref (entry->artist);
-			rb_refstring_ref (entry->album);
+	return TRUE;
+}
 
-			g_mutex_lock (&db->priv->genres_lock);
-			remove_entry_from_album (db, entry);
-			genre = get_or_create_genre (db, type, entry->genre);
-			new_artist = get_or_create_artist (db, genre,
-							   rb_refstring_new (artistname));
-			set_entry_album (db, entry, new_artist, entry->album);
-			g_mutex_unlock (&db->priv->genres_lock);
+static RhythmDBEntry *
+snapshot_create_entry (RhythmDBTree *db,
+		       struct RhythmDBTreeSnapshotLoadContext *ctx,
+		       const RhythmDBTreeSnapshotRecord *rec)
+{
+	RhythmDBEntry *entry;
+	RhythmDBPodcastFields *podcast = NULL;
 
-			rb_refstring_unref (entry->genre);
-			rb_refstring_unref (entry->artist);
-			rb_refstring_unref (entry->album);
-		}
-		break;
+	entry = rhythmdb_entry_allocate (RHYTHMDB (db), ctx->types[rec->type]);
+	entry->flags |= RHYTHMDB_ENTRY_TREE_LOADING;
+	if (rec->flags & SNAPSHOT_RECORD_HIDDEN)
+		entry->flags |= RHYTHMDB_ENTRY_HIDDEN;
+
+	SNAPSHOT_SET_STRING (ctx, rec, entry->location, SNAPSHOT_STRING_LOCATION);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->title, SNAPSHOT_STRING_TITLE);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->artist, SNAPSHOT_STRING_ARTIST);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->composer, SNAPSHOT_STRING_COMPOSER);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->album, SNAPSHOT_STRING_ALBUM);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->album_artist, SNAPSHOT_STRING_ALBUM_ARTIST);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->genre, SNAPSHOT_STRING_GENRE);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->comment, SNAPSHOT_STRING_COMMENT);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->musicbrainz_trackid, SNAPSHOT_STRING_MUSICBRAINZ_TRACKID);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->musicbrainz_artistid, SNAPSHOT_STRING_MUSICBRAINZ_ARTISTID);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->musicbrainz_albumid, SNAPSHOT_STRING_MUSICBRAINZ_ALBUMID);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->musicbrainz_albumartistid, SNAPSHOT_STRING_MUSICBRAINZ_ALBUMARTISTID);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->artist_sortname, SNAPSHOT_STRING_ARTIST_SORTNAME);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->composer_sortname, SNAPSHOT_STRING_COMPOSER_SORTNAME);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->album_sortname, SNAPSHOT_STRING_ALBUM_SORTNAME);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->album_artist_sortname, SNAPSHOT_STRING_ALBUM_ARTIST_SORTNAME);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->mountpoint, SNAPSHOT_STRING_MOUNTPOINT);
+	SNAPSHOT_SET_STRING (ctx, rec, entry->media_type, SNAPSHOT_STRING_MEDIA_TYPE);
+
+	entry->tracknum = rec->tracknum;
+	entry->tracktotal = rec->tracktotal;
+	entry->discnum = rec->discnum;
+	entry->disctotal = rec->disctotal;
+	entry->duration = rec->duration;
+	entry->bitrate = rec->bitrate;
+	entry->bpm = rec->bpm;
+	entry->track_gain = rec->track_gain;
+	entry->track_peak = rec->track_peak;
+	entry->album_gain = rec->album_gain;
+	entry->album_peak = rec->album_peak;
+	if (rec->date > 0)
+		g_date_set_julian (&entry->date, rec->date);
+	entry->file_size = rec->file_size;
+	entry->mtime = rec->mtime;
+	entry->first_seen = rec->first_seen;
+	entry->last_seen = rec->last_seen;
+	entry->rating = rec->rating;
+	entry->play_count = rec->play_count;
+	entry->last_played = rec->last_played;
+
+	if (entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_FEED ||
+	    entry->type == RHYTHMDB_ENTRY_TYPE_PODCAST_POST)
+		podcast = RHYTHMDB_ENTRY_GET_TYPE_DATA (entry, RhythmDBPodcastFields);
+
+	if (podcast != NULL) {
+		SNAPSHOT_SET_STRING (ctx, rec, podcast->description, SNAPSHOT_STRING_DESCRIPTION);
+		SNAPSHOT_SET_STRING (ctx, rec, podcast->subtitle, SNAPSHOT_STRING_SUBTITLE);
+		SNAPSHOT_SET_STRING (ctx, rec, podcast->summary, SNAPSHOT_STRING_SUMMARY);
+		SNAPSHOT_SET_STRING (ctx, rec, podcast->lang, SNAPSHOT_STRING_LANG);
+		SNAPSHOT_SET_STRING (ctx, rec, podcast->copyright, SNAPSHOT_STRING_COPYRIGHT);
+		SNAPSHOT_SET_STRING (ctx, rec, podcast->image, SNAPSHOT_STRING_IMAGE);
+		podcast->status = rec->status;
+		podcast->post_time = rec->post_time;
 	}
-	case RHYTHMDB_PROP_GENRE:
-	{
-		const char *genrename = g_value_get_string (value);
 
-		if (strcmp (rb_refstring_get (entry->genre), genrename)) {
-			RhythmDBTreeProperty *new_genre;
-			RhythmDBTreeProperty *new_artist;
+	return entry;
+}
 
-			rb_refstring_ref (entry->genre);
-			rb_refstring_ref (entry->artist);
-			rb_refstring_ref (entry->album);
+#undef SNAPSHOT_SET_STRING
 
-			g_mutex_lock (&db->priv->genres_lock);
-			remove_entry_from_album (db, entry);
-			new_genre = get_or_create_genre (db, type,
-							 rb_refstring_new (genrename));
-			new_artist = get_or_create_artist (db, new_genre, entry->artist);
-			set_entry_album (db, entry, new_artist, entry->album);
-			g_mutex_unlock (&db->priv->genres_lock);
+/* loads the snapshot for the XML database file 'name', if it's up to date.
+ * if this returns FALSE, no entries have been created.
+ */
+static gboolean
+rhythmdb_tree_load_snapshot (RhythmDBTree *db,
+			     const char *name,
+			     GCancellable *cancel)
+{
+	struct RhythmDBTreeSnapshotLoadContext ctx;
+	const RhythmDBTreeSnapshotHeader *header;
+	GMappedFile *mapped;
+	GStatBuf xml_stat;
+	const char *data;
+	char *filename;
+	GError *error = NULL;
+	guint64 offset;
+	guint64 records_offset;
+	guint64 size;
+	guint32 i, k;
+	gint batch_count = 0;
+	gboolean ret = FALSE;
+
+	if (g_stat (name, &xml_stat) < 0)
+		return FALSE;
 
-			rb_refstring_unref (entry->genre);
-			rb_refstring_unref (entry->artist);
-			rb_refstring_unref (entry->album);
+	filename = snapshot_filename (name);
+	if (g_file_test (filename, G_FILE_TEST_EXISTS) == FALSE) {
+		g_free (filename);
+		return FALSE;
+	}
+
+	mapped = g_mapped_file_new (filename, FALSE, &error);
+	if (mapped == NULL) {
+		rb_debug ("unable to map database snapshot %s: %s", filename, error->message);
+		g_clear_error (&error);
+		g_free (filename);
+		return FALSE;
+	}
+
+	memset (&ctx, 0, sizeof (ctx));
+	data = g_mapped_file_get_contents (mapped);
+	size = g_mapped_file_get_length (mapped);
+	if (size < sizeof (RhythmDBTreeSnapshotHeader)) {
+		rb_debug ("database snapshot %s is truncated", filename);
+		goto out;
+	}
+
+	header = (const RhythmDBTreeSnapshotHeader *) data;
+	if (memcmp (header->magic, RHYTHMDB_TREE_SNAPSHOT_MAGIC, sizeof (header->magic)) != 0 ||
+	    header->version != RHYTHMDB_TREE_SNAPSHOT_VERSION ||
+	    header->byte_order != RHYTHMDB_TREE_SNAPSHOT_BYTE_ORDER ||
+	    header->record_size != sizeof (RhythmDBTreeSnapshotRecord)) {
+		rb_debug ("database snapshot %s has the wrong format", filename);
+		goto out;
+	}
+
+	if (header->xml_size != (guint64) xml_stat.st_size ||
+	    header->xml_mtime != (gint64) xml_stat.st_mtime) {
+		rb_debug ("database snapshot %s is out of date", filename);
+		goto out;
+	}
+
+	offset = sizeof (RhythmDBTreeSnapshotHeader);
+	offset += (guint64) header->n_strings * sizeof (guint32);
+	offset += header->string_data_size;
+	records_offset = RHYTHMDB_TREE_SNAPSHOT_ALIGN (offset);
+	offset = records_offset + (guint64) header->n_records * sizeof (RhythmDBTreeSnapshotRecord);
+	offset += (guint64) header->n_keywords * sizeof (guint32);
+	if (offset != size) {
+		rb_debug ("database snapshot %s has the wrong size", filename);
+		goto out;
+	}
+
+	ctx.header = header;
+	ctx.string_offsets = (const guint32 *) (data + sizeof (RhythmDBTreeSnapshotHeader));
+	ctx.string_data = (const char *) (ctx.string_offsets + header->n_strings);
+	ctx.records = (const RhythmDBTreeSnapshotRecord *) (data + records_offset);
+	ctx.keywords = (const guint32 *) (ctx.records + header->n_records);
+	ctx.strings = g_new0 (RBRefString *, header->n_strings);
+	ctx.types = g_new0 (RhythmDBEntryType *, header->n_strings);
+
+	if (snapshot_validate (db, &ctx) == FALSE)
+		goto out;
+
+	rb_debug ("loading %u entries from database snapshot %s", header->n_records, filename);
+	ret = TRUE;
+	g_mutex_lock (&db->priv->entries_lock);
+	for (i = 0; i < header->n_records; i++) {
+		const RhythmDBTreeSnapshotRecord *rec = &ctx.records[i];
+		RhythmDBEntry *entry;
+
+		/* a partial load isn't a loaded database */
+		if (g_cancellable_is_cancelled (cancel)) {
+			ret = FALSE;
+			break;
+		}
+
+		entry = snapshot_create_entry (db, &ctx, rec);
+		if (g_hash_table_lookup (db->priv->entries, entry->location) != NULL) {
+			rb_debug ("found entry with duplicate location %s in snapshot",
+				  rb_refstring_get (entry->location));
+			rhythmdb_entry_unref (entry);
+			continue;
+		}
+
+		for (k = 0; k < rec->n_keywords; k++) {
+			RBRefString *keyword = snapshot_get_string (&ctx, ctx.keywords[rec->keywords + k]);
+			rhythmdb_tree_entry_keyword_add (RHYTHMDB (db), entry, keyword);
+			rb_refstring_unref (keyword);
+		}
+
+		rhythmdb_tree_entry_new_internal (RHYTHMDB (db), entry);
+		rhythmdb_entry_insert (RHYTHMDB (db), entry);
+		if (++batch_count == RHYTHMDB_QUERY_MODEL_SUGGESTED_UPDATE_CHUNK) {
+			rhythmdb_commit (RHYTHMDB (db));
+			batch_count = 0;
 		}
-		break;
 	}
-	default:
-		break;
+	g_mutex_unlock (&db->priv->entries_lock);
+
+	if (batch_count)
+		rhythmdb_commit (RHYTHMDB (db));
+
+out:
+	if (ctx.strings != NULL) {
+		for (i = 0; i < header->n_strings; i++)
+			rb_refstring_unref (ctx.strings[i]);
+		g_free (ctx.strings);
 	}
+	g_free (ctx.types);
+	g_mapped_file_unref (mapped);
+	g_free (filename);
+	return ret;
+}
 
-	return FALSE;
+#undef RHYTHMDB_FWRITE_ENCODED_STR
+#undef RHYTHMDB_FWRITE_STATICSTR
+#undef RHYTHMDB_FPUTC
+#undef RHYTHMDB_FWRITE
+
+RhythmDB *
+rhythmdb_tree_new (const char *name)
+{
+	RhythmDBTree *db = g_object_new (RHYTHMDB_TYPE_TREE, "name", name, NULL);
+
+	g_return_val_if_fail (db->priv != NULL, NULL);
+
+	return RHYTHMDB (db);
 }
 
+/* must be called with the genres_lock held */
 static void
-rhythmdb_tree_entry_delete (RhythmDB *adb,
-			    RhythmDBEntry *entry)
+set_entry_album (RhythmDBTree *db,
+		 RhythmDBEntry *entry,
+		 RhythmDBTreeProperty *artist,
+		 RBRefString *name)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	struct RhythmDBTreeProperty *prop;
 
-	g_mutex_lock (&db->priv->genres_lock);
-	remove_entry_from_album (db, entry);
-	g_mutex_unlock (&db->priv->genres_lock);
+	prop = get_or_create_album (db, artist, name);
+	g_hash_table_insert (prop->children, entry, NULL);
+	entry->data = prop;
 
-	/* remove all keywords */
-	g_mutex_lock (&db->priv->keywords_lock);
-	remove_entry_from_keywords (db, entry);
-	g_mutex_unlock (&db->priv->keywords_lock);
+	db->priv->query_stats_dirty = TRUE;
+}
 
-	g_mutex_lock (&db->priv->entries_lock);
-	g_assert (g_hash_table_remove (db->priv->entries, entry->location));
-	g_assert (g_hash_table_remove (db->priv->entry_ids, GINT_TO_POINTER (entry->id)));
+/*
+ * Search word index.
+ *
+ * Searches match each search word as a substring of one of the folded
+ * title, artist, album, composer or genre strings.  Search words never
+ * contain whitespace, so any match falls entirely within one
+ * whitespace-separated word of the property.  The index maps each such
+ * word to the set of entries containing it, so a search only has to look
+ * at the entries containing some word that contains the search word,
+ * rather than every entry in the database.
+ */
 
-	entry->flags |= RHYTHMDB_ENTRY_TREE_REMOVED;
-	rhythmdb_entry_unref (entry);
-	g_mutex_unlock (&db->priv->entries_lock);
+static const RhythmDBPropType search_index_props[] = {
+	RHYTHMDB_PROP_TITLE_FOLDED,
+	RHYTHMDB_PROP_ALBUM_FOLDED,
+	RHYTHMDB_PROP_ARTIST_FOLDED,
+	RHYTHMDB_PROP_COMPOSER_FOLDED,
+	RHYTHMDB_PROP_GENRE_FOLDED
+};
+
+static gboolean
+search_index_is_separator (gunichar c)
+{
+	switch (g_unichar_type (c)) {
+	case G_UNICODE_CONTROL:
+	case G_UNICODE_SPACE_SEPARATOR:
+	case G_UNICODE_LINE_SEPARATOR:
+	case G_UNICODE_PARAGRAPH_SEPARATOR:
+		return TRUE;
+	default:
+		return FALSE;
+	}
 }
 
-typedef struct {
-	RhythmDB *db;
-	RhythmDBEntryType *type;
-} RbEntryRemovalCtxt;
+static char **
+search_index_split (const char *folded)
+{
+	GPtrArray *words;
+	GString *word;
+	const char *p;
+
+	words = g_ptr_array_new ();
+	word = g_string_sized_new (32);
+	for (p = folded; ; p = g_utf8_next_char (p)) {
+		gunichar c = g_utf8_get_char (p);
+
+		if (c != 0 && search_index_is_separator (c) == FALSE) {
+			g_string_append_unichar (word, c);
+			continue;
+		}
 
-/* must be called with the entries and genres locks held */
-static gboolean
-remove_one_song (gpointer key,
-		 RhythmDBEntry *entry,
-		 RbEntryRemovalCtxt *ctxt)
+		if (word->len > 0) {
+			g_ptr_array_add (words, g_strdup (word->str));
+			g_string_truncate (word, 0);
+		}
+
+		if (c == 0)
+			break;
+	}
+	g_string_free (word, TRUE);
+
+	g_ptr_array_add (words, NULL);
+	return (char **) g_ptr_array_free (words, FALSE);
+}
+
+/* must be called with the genres lock held */
+static void
+search_index_update_string (RhythmDBTree *db,
+			    RhythmDBEntry *entry,
+			    const char *folded,
+			    gboolean add)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE(ctxt->db);
+	char **words;
+	int i;
 
-	rb_assert_locked (&db->priv->entries_lock);
 	rb_assert_locked (&db->priv->genres_lock);
 
-	g_return_val_if_fail (entry != NULL, FALSE);
+	if (folded == NULL)
+		return;
 
-	if (entry->type == ctxt->type) {
-		rhythmdb_emit_entry_deleted (ctxt->db, entry);
-		g_mutex_lock (&db->priv->keywords_lock);
-		remove_entry_from_keywords (db, entry);
-		g_mutex_unlock (&db->priv->keywords_lock);
-		remove_entry_from_album (db, entry);
-		g_hash_table_remove (db->priv->entry_ids, GINT_TO_POINTER (entry->id));
-		entry->flags |= RHYTHMDB_ENTRY_TREE_REMOVED;
-		rhythmdb_entry_unref (entry);
-		return TRUE;
+	words = search_index_split (folded);
+	for (i = 0; words[i] != NULL; i++) {
+		GHashTable *postings;
+		int count;
+
+		postings = g_hash_table_lookup (db->priv->search_index, words[i]);
+		if (add) {
+			if (postings == NULL) {
+				postings = g_hash_table_new (g_direct_hash, g_direct_equal);
+				g_hash_table_insert (db->priv->search_index, g_strdup (words[i]), postings);
+			}
+			count = GPOINTER_TO_INT (g_hash_table_lookup (postings, entry));
+			g_hash_table_insert (postings, entry, GINT_TO_POINTER (count + 1));
+		} else if (postings != NULL) {
+			count = GPOINTER_TO_INT (g_hash_table_lookup (postings, entry));
+			if (count > 1) {
+				g_hash_table_insert (postings, entry, GINT_TO_POINTER (count - 1));
+			} else {
+				g_hash_table_remove (postings, entry);
+				if (g_hash_table_size (postings) == 0)
+					g_hash_table_remove (db->priv->search_index, words[i]);
+			}
+		}
 	}
-	return FALSE;
+	g_strfreev (words);
 }
 
+/* must be called with the genres lock held */
 static void
-rhythmdb_tree_entry_delete_by_type (RhythmDB *adb,
-				    RhythmDBEntryType *type)
+search_index_update_entry (RhythmDBTree *db,
+			   RhythmDBEntry *entry,
+			   gboolean add)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (adb);
-	RbEntryRemovalCtxt ctxt;
+	int i;
 
-	ctxt.db = adb;
-	ctxt.type = type;
-	g_mutex_lock (&db->priv->entries_lock);
-	g_mutex_lock (&db->priv->genres_lock);
-	g_hash_table_foreach_remove (db->priv->entries,
-				     (GHRFunc) remove_one_song, &ctxt);
-	g_mutex_unlock (&db->priv->genres_lock);
-	g_mutex_unlock (&db->priv->entries_lock);
+	if (db->priv->search_index == NULL)
+		return;
+
+	for (i = 0; i < G_N_ELEMENTS (search_index_props); i++) {
+		search_index_update_string (db, entry,
+					    rhythmdb_entry_get_string (entry, search_index_props[i]),
+					    add);
+	}
 }
 
 static void
-destroy_tree_property (RhythmDBTreeProperty *prop)
+search_index_add_album (gpointer name, RhythmDBTreeProperty *album, RhythmDBTree *db)
 {
-#ifndef G_DISABLE_ASSERT
-	prop->magic = 0xf33df33d;
-#endif
-	g_hash_table_destroy (prop->children);
-	g_free (prop);
+	GHashTableIter iter;
+	gpointer entry;
+
+	g_hash_table_iter_init (&iter, album->children);
+	while (g_hash_table_iter_next (&iter, &entry, NULL)) {
+		search_index_update_entry (db, entry, TRUE);
+	}
 }
 
-typedef void (*RhythmDBTreeTraversalFunc) (RhythmDBTree *db, RhythmDBEntry *entry, gpointer data);
-typedef void (*RhythmDBTreeAlbumTraversalFunc) (RhythmDBTree *db, RhythmDBTreeProperty *album, gpointer data);
+static void
+search_index_add_artist (gpointer name, RhythmDBTreeProperty *artist, RhythmDBTree *db)
+{
+	g_hash_table_foreach (artist->children, (GHFunc) search_index_add_album, db);
+}
 
-struct RhythmDBTreeTraversalData
+static void
+search_index_add_genre (gpointer name, RhythmDBTreeProperty *genre, RhythmDBTree *db)
 {
-	RhythmDBTree *db;
-	GPtrArray *query;
-	RhythmDBTreeTraversalFunc func;
-	gpointer data;
-	gboolean *cancel;
+	g_hash_table_foreach (genre->children, (GHFunc) search_index_add_artist, db);
+}
+
+static void
+search_index_add_type (gpointer type, GHashTable *genres, RhythmDBTree *db)
+{
+	g_hash_table_foreach (genres, (GHFunc) search_index_add_genre, db);
+}
+
+/* must be called with the genres lock held */
+static void
+search_index_build (RhythmDBTree *db)
+{
+	rb_assert_locked (&db->priv->genres_lock);
+
+	if (db->priv->search_index != NULL)
+		return;
+
+	rb_debug ("building search index");
+	db->priv->search_index = g_hash_table_new_full (g_str_hash, g_str_equal,
+							g_free, (GDestroyNotify) g_hash_table_destroy);
+	g_hash_table_foreach (db->priv->genres, (GHFunc) search_index_add_type, db);
+	rb_debug ("search index contains %d words for %d entries",
+		  g_hash_table_size (db->priv->search_index),
+		  db->priv->n_entries);
+}
+
+/*
+ * Numeric property indexes.
+ *
+ * Each index holds the entries sorted by the value of one numeric
+ * property, so range queries (as used by automatic playlists: rated at
+ * least 4, played in the last week, and so on) can find the matching
+ * entries without looking at the rest of the database.  The index items
+ * carry their own copy of the value, as entries are re-indexed before the
+ * new property value is stored in them.
+ */
+
+static const RhythmDBPropType property_index_props[] = {
+	RHYTHMDB_PROP_RATING,
+	RHYTHMDB_PROP_PLAY_COUNT,
+	RHYTHMDB_PROP_LAST_PLAYED,
+	RHYTHMDB_PROP_DATE,
+	RHYTHMDB_PROP_BITRATE,
+	RHYTHMDB_PROP_FIRST_SEEN
 };
 
-static gboolean
-rhythmdb_tree_evaluate_query (RhythmDB *adb,
-			      GPtrArray *query,
-			      RhythmDBEntry *entry)
+static void
+property_index_free (RhythmDBTreePropertyIndex *index)
 {
-	RhythmDBTree *db = RHYTHMDB_TREE (adb);
-	guint i;
-	guint last_disjunction;
+	g_hash_table_destroy (index->entries);
+	g_sequence_free (index->items);
+	g_free (index);
+}
 
-	for (i = 0, last_disjunction = 0; i < query->len; i++) {
-		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+static gint
+property_index_item_compare (RhythmDBTreePropertyIndexItem *a,
+			     RhythmDBTreePropertyIndexItem *b,
+			     gpointer unused)
+{
+	if (a->value < b->value)
+		return -1;
+	if (a->value > b->value)
+		return 1;
+	if (a->entry < b->entry)
+		return -1;
+	if (a->entry > b->entry)
+		return 1;
+	return 0;
+}
 
-		if (data->type == RHYTHMDB_QUERY_DISJUNCTION) {
-			if (evaluate_conjunctive_subquery (db, query, last_disjunction, i, entry))
-				return TRUE;
+static gboolean
+property_index_is_indexed (RhythmDBPropType propid)
+{
+	int i;
 
-			last_disjunction = i + 1;
-		}
+	for (i = 0; i < G_N_ELEMENTS (property_index_props); i++) {
+		if (property_index_props[i] == propid)
+			return TRUE;
 	}
-	if (evaluate_conjunctive_subquery (db, query, last_disjunction, query->len, entry))
-		return TRUE;
 	return FALSE;
 }
 
-#define RHYTHMDB_PROPERTY_COMPARE(OP) \
+static gdouble
+property_index_value_from_gvalue (const GValue *value)
+{
+	if (G_VALUE_HOLDS_DOUBLE (value))
+		return g_value_get_double (value);
+	return g_value_get_ulong (value);
+}
+
+static gdouble
+property_index_entry_value (RhythmDBTree *db,
+			    RhythmDBEntry *entry,
+			    RhythmDBPropType propid)
+{
+	if (rhythmdb_get_property_type (RHYTHMDB (db), propid) == G_TYPE_DOUBLE)
+		return rhythmdb_entry_get_double (entry, propid);
+	return rhythmdb_entry_get_ulong (entry, propid);
+}
+
+static void
+property_index_insert (RhythmDBTreePropertyIndex *index,
+		       RhythmDBEntry *entry,
+		       gdouble value)
+{
+	RhythmDBTreePropertyIndexItem *item;
+	GSequenceIter *iter;
+
+	item = g_new0 (RhythmDBTreePropertyIndexItem, 1);
+	item->value = value;
+	item->entry = entry;
+	iter = g_sequence_insert_sorted (index->items, item,
+					 (GCompareDataFunc) property_index_item_compare, NULL);
+	g_hash_table_insert (index->entries, entry, iter);
+}
+
+static void
+property_index_remove (RhythmDBTreePropertyIndex *index,
+		       RhythmDBEntry *entry)
+{
+	GSequenceIter *iter;
+
+	iter = g_hash_table_lookup (index->entries, entry);
+	if (iter != NULL) {
+		g_hash_table_remove (index->entries, entry);
+		g_sequence_remove (iter);
+	}
+}
+
+/* must be called with the genres lock held */
+static void
+property_index_update_entry (RhythmDBTree *db,
+			     RhythmDBEntry *entry,
+			     gboolean add)
+{
+	GHashTableIter iter;
+	gpointer index;
+
+	g_hash_table_iter_init (&iter, db->priv->property_indexes);
+	while (g_hash_table_iter_next (&iter, NULL, &index)) {
+		RhythmDBTreePropertyIndex *pindex = index;
+
+		if (add)
+			property_index_insert (pindex, entry,
+					       property_index_entry_value (db, entry, pindex->propid));
+		else
+			property_index_remove (pindex, entry);
+	}
+}
+
+static void
+property_index_add_album (gpointer name, RhythmDBTreeProperty *album, RhythmDBTreePropertyIndex *index)
+{
+	GHashTableIter iter;
+	gpointer entry;
+
+	g_hash_table_iter_init (&iter, album->children);
+	while (g_hash_table_iter_next (&iter, &entry, NULL)) {
+		RhythmDBTreePropertyIndexItem *item;
+
+		item = g_new0 (RhythmDBTreePropertyIndexItem, 1);
+		item->entry = entry;
+		g_hash_table_insert (index->entries, entry, g_sequence_append (index->items, item));
+	}
+}
+
+static void
+property_index_add_artist (gpointer name, RhythmDBTreeProperty *artist, RhythmDBTreePropertyIndex *index)
+{
+	g_hash_table_foreach (artist->children, (GHFunc) property_index_add_album, index);
+}
+
+static void
+property_index_add_genre (gpointer name, RhythmDBTreeProperty *genre, RhythmDBTreePropertyIndex *index)
+{
+	g_hash_table_foreach (genre->children, (GHFunc) property_index_add_artist, index);
+}
+
+static void
+property_index_add_type (gpointer type, GHashTable *genres, RhythmDBTreePropertyIndex *index)
+{
+	g_hash_table_foreach (genres, (GHFunc) property_index_add_genre, index);
+}
+
+/* must be called with the genres lock held */
+static RhythmDBTreePropertyIndex *
+property_index_get (RhythmDBTree *db,
+		    RhythmDBPropType propid)
+{
+	RhythmDBTreePropertyIndex *index;
+	GSequenceIter *iter;
+
+	rb_assert_locked (&db->priv->genres_lock);
+
+	index = g_hash_table_lookup (db->priv->property_indexes, GINT_TO_POINTER (propid));
+	if (index != NULL)
+		return index;
+
+	rb_debug ("building index for property %s",
+		  (const char *) rhythmdb_nice_elt_name_from_propid (RHYTHMDB (db), propid));
+	index = g_new0 (RhythmDBTreePropertyIndex, 1);
+	index->propid = propid;
+	index->items = g_sequence_new (g_free);
+	index->entries = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+	/* collect the entries, then sort them all at once */
+	g_hash_table_foreach (db->priv->genres, (GHFunc) property_index_add_type, index);
+	for (iter = g_sequence_get_begin_iter (index->items);
+	     !g_sequence_iter_is_end (iter);
+	     iter = g_sequence_iter_next (iter)) {
+		RhythmDBTreePropertyIndexItem *item = g_sequence_get (iter);
+		item->value = property_index_entry_value (db, item->entry, propid);
+	}
+	g_sequence_sort (index->items, (GCompareDataFunc) property_index_item_compare, NULL);
+
+	g_hash_table_insert (db->priv->property_indexes, GINT_TO_POINTER (propid), index);
+	return index;
+}
+
+/* must be called with the genres lock held */
+static void
+update_entry_indexes (RhythmDBTree *db,
+		      RhythmDBEntry *entry,
+		      gboolean add)
+{
+	rb_assert_locked (&db->priv->genres_lock);
+
+	search_index_update_entry (db, entry, add);
+	property_index_update_entry (db, entry, add);
+
+	if (add)
+		db->priv->n_entries++;
+	else
+		db->priv->n_entries--;
+}
+
+static void
+rhythmdb_tree_entry_new (RhythmDB *rdb,
+			 RhythmDBEntry *entry)
+{
+	g_mutex_lock (&RHYTHMDB_TREE(rdb)->priv->entries_lock);
+	rhythmdb_tree_entry_new_internal (rdb, entry);
+	g_mutex_unlock (&RHYTHMDB_TREE(rdb)->priv->entries_lock);
+}
+
+/* must be called with the entry lock held */
+static void
+rhythmdb_tree_entry_new_internal (RhythmDB *rdb, RhythmDBEntry *entry)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (rdb);
+	RhythmDBTreeProperty *artist;
+	RhythmDBTreeProperty *genre;
+
+	rb_assert_locked (&db->priv->entries_lock);
+	g_assert (entry != NULL);
+
+	g_return_if_fail (entry->location != NULL);
+
+	if (entry->title == NULL) {
+		g_warning ("Entry %s has missing title", rb_refstring_get (entry->location));
+		entry->title = rb_refstring_new (_("Unknown"));
+	}
+	if (entry->artist == NULL) {
+		g_warning ("Entry %s has missing artist", rb_refstring_get (entry->location));
+		entry->artist = rb_refstring_new (_("Unknown"));
+	}
+	if (entry->album == NULL) {
+		g_warning ("Entry %s has missing album", rb_refstring_get (entry->location));
+		entry->album = rb_refstring_new (_("Unknown"));
+	}
+	if (entry->genre == NULL) {
+		g_warning ("Entry %s has missing genre", rb_refstring_get (entry->location));
+		entry->genre = rb_refstring_new (_("Unknown"));
+	}
+	if (entry->media_type == NULL) {
+		g_warning ("Entry %s has missing media type", rb_refstring_get (entry->location));
+		entry->media_type = rb_refstring_new ("unknown/unknown");
+	}
+
+	/* Initialize the tree structure. */
+	g_mutex_lock (&db->priv->genres_lock);
+	genre = get_or_create_genre (db, entry->type, entry->genre);
+	artist = get_or_create_artist (db, genre, entry->artist);
+	set_entry_album (db, entry, artist, entry->album);
+	update_entry_indexes (db, entry, TRUE);
+	g_mutex_unlock (&db->priv->genres_lock);
+
+	/* this accounts for the initial reference on the entry */
+	g_hash_table_insert (db->priv->entries, entry->location, entry);
+	g_hash_table_insert (db->priv->entry_ids, GINT_TO_POINTER (entry->id), entry);
+
+	entry->flags &= ~RHYTHMDB_ENTRY_TREE_LOADING;
+}
+
+static RhythmDBTreeProperty *
+rhythmdb_tree_property_new (RhythmDBTree *db)
+{
+	RhythmDBTreeProperty *ret = g_new0 (RhythmDBTreeProperty, 1);
+#ifndef G_DISABLE_ASSERT
+	ret->magic = 0xf00dbeef;
+#endif
+	return ret;
+}
+
+static GHashTable *
+get_genres_hash_for_type (RhythmDBTree *db,
+			  RhythmDBEntryType *type)
+{
+	GHashTable *table;
+
+	table = g_hash_table_lookup (db->priv->genres, type);
+	if (table == NULL) {
+		table = g_hash_table_new_full (rb_refstring_hash,
+					       rb_refstring_equal,
+					       (GDestroyNotify) rb_refstring_unref,
+					       NULL);
+		if (table == NULL) {
+			g_warning ("Out of memory\n");
+			return NULL;
+		}
+		g_hash_table_insert (db->priv->genres,
+				     type,
+				     table);
+	}
+	return table;
+}
+
+typedef void (*RBHFunc)(RhythmDBTree *db, GHashTable *genres, gpointer data);
+
+typedef struct {
+	RhythmDBTree *db;
+	RBHFunc func;
+	gpointer data;
+} GenresIterCtxt;
+
+static void
+genres_process_one (gpointer key,
+		    gpointer value,
+		    gpointer user_data)
+{
+	GenresIterCtxt *ctxt = (GenresIterCtxt *)user_data;
+	ctxt->func (ctxt->db, (GHashTable *)value, ctxt->data);
+}
+
+static void
+genres_hash_foreach (RhythmDBTree *db, RBHFunc func, gpointer data)
+{
+	GenresIterCtxt ctxt;
+
+	ctxt.db = db;
+	ctxt.func = func;
+	ctxt.data = data;
+	g_hash_table_foreach (db->priv->genres, genres_process_one, &ctxt);
+}
+
+/* must be called with the genres lock held */
+static RhythmDBTreeProperty *
+get_or_create_genre (RhythmDBTree *db,
+		     RhythmDBEntryType *type,
+		     RBRefString *name)
+{
+	RhythmDBTreeProperty *genre;
+	GHashTable *table;
+
+	rb_assert_locked (&db->priv->genres_lock);
+
+	table = get_genres_hash_for_type (db, type);
+	genre = g_hash_table_lookup (table, name);
+
+	if (G_UNLIKELY (genre == NULL)) {
+		genre = rhythmdb_tree_property_new (db);
+		genre->children = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
+							 (GDestroyNotify) rb_refstring_unref,
+							 NULL);
+		rb_refstring_ref (name);
+		g_hash_table_insert (table, name, genre);
+		genre->parent = NULL;
+	}
+
+	return genre;
+}
+
+/* must be called with the genres lock held */
+static RhythmDBTreeProperty *
+get_or_create_artist (RhythmDBTree *db,
+		      RhythmDBTreeProperty *genre,
+		      RBRefString *name)
+{
+	RhythmDBTreeProperty *artist;
+
+	rb_assert_locked (&db->priv->genres_lock);
+
+	artist = g_hash_table_lookup (genre->children, name);
+
+	if (G_UNLIKELY (artist == NULL)) {
+		artist = rhythmdb_tree_property_new (db);
+		artist->children = g_hash_table_new_full (rb_refstring_hash, rb_refstring_equal,
+							  (GDestroyNotify) rb_refstring_unref,
+							  NULL);
+		rb_refstring_ref (name);
+		g_hash_table_insert (genre->children, name, artist);
+		artist->parent = genre;
+	}
+
+	return artist;
+}
+
+/* must be called with the genres lock held */
+static RhythmDBTreeProperty *
+get_or_create_album (RhythmDBTree *db,
+		     RhythmDBTreeProperty *artist,
+		     RBRefString *name)
+{
+	RhythmDBTreeProperty *album;
+
+	rb_assert_locked (&db->priv->genres_lock);
+
+	album = g_hash_table_lookup (artist->children, name);
+
+	if (G_UNLIKELY (album == NULL)) {
+		album = rhythmdb_tree_property_new (db);
+		album->children = g_hash_table_new (g_direct_hash, g_direct_equal);
+		rb_refstring_ref (name);
+		g_hash_table_insert (artist->children, name, album);
+		album->parent = artist;
+	}
+
+	return album;
+}
+
+static gboolean
+remove_child (RhythmDBTreeProperty *parent,
+	      gconstpointer data)
+{
+	g_assert (g_hash_table_remove (parent->children, data));
+	if (g_hash_table_size (parent->children) <= 0) {
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/* must be called with the genres lock held */
+static void
+remove_entry_from_album (RhythmDBTree *db,
+			 RhythmDBEntry *entry)
+{
+	GHashTable *table;
+
+	rb_assert_locked (&db->priv->genres_lock);
+
+	rb_refstring_ref (entry->genre);
+	rb_refstring_ref (entry->artist);
+	rb_refstring_ref (entry->album);
+
+	table = get_genres_hash_for_type (db, entry->type);
+	if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry), entry)) {
+		if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent,
+				  entry->album)) {
+
+			if (remove_child (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent->parent,
+					  entry->artist)) {
+				destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent->parent);
+				g_assert (g_hash_table_remove (table, entry->genre));
+			}
+			destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry)->parent);
+		}
+
+		destroy_tree_property (RHYTHMDB_TREE_PROPERTY_FROM_ENTRY (entry));
+	}
+
+	rb_refstring_unref (entry->genre);
+	rb_refstring_unref (entry->artist);
+	rb_refstring_unref (entry->album);
+
+	db->priv->query_stats_dirty = TRUE;
+}
+
+static gboolean
+rhythmdb_tree_entry_set (RhythmDB *adb,
+			 RhythmDBEntry *entry,
+			 guint propid,
+			 const GValue *value)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	RhythmDBEntryType *type;
+
+	type = entry->type;
+
+	/* don't process changes to entries we're loading, we'll get them
+	 * when the entry is complete.  don't process changes for entries that
+	 * have been removed either.
+	 */
+	if (entry->flags & (RHYTHMDB_ENTRY_TREE_LOADING | RHYTHMDB_ENTRY_TREE_REMOVED))
+		return FALSE;
+
+	/* keep the search index up to date */
+	{
+		RhythmDBPropType folded_prop = RHYTHMDB_NUM_PROPERTIES;
+
+		switch (propid) {
+		case RHYTHMDB_PROP_TITLE:
+			folded_prop = RHYTHMDB_PROP_TITLE_FOLDED;
+			break;
+		case RHYTHMDB_PROP_ALBUM:
+			folded_prop = RHYTHMDB_PROP_ALBUM_FOLDED;
+			break;
+		case RHYTHMDB_PROP_ARTIST:
+			folded_prop = RHYTHMDB_PROP_ARTIST_FOLDED;
+			break;
+		case RHYTHMDB_PROP_COMPOSER:
+			folded_prop = RHYTHMDB_PROP_COMPOSER_FOLDED;
+			break;
+		case RHYTHMDB_PROP_GENRE:
+			folded_prop = RHYTHMDB_PROP_GENRE_FOLDED;
+			break;
+		default:
+			break;
+		}
+
+		if (folded_prop != RHYTHMDB_NUM_PROPERTIES) {
+			char *folded;
+
+			g_mutex_lock (&db->priv->genres_lock);
+			if (db->priv->search_index != NULL) {
+				folded = rb_search_fold (g_value_get_string (value));
+				search_index_update_string (db, entry, rhythmdb_entry_get_string (entry, folded_prop), FALSE);
+				search_index_update_string (db, entry, folded, TRUE);
+				g_free (folded);
+			}
+			g_mutex_unlock (&db->priv->genres_lock);
+		}
+	}
+
+	/* keep the property indexes up to date */
+	if (property_index_is_indexed (propid)) {
+		RhythmDBTreePropertyIndex *index;
+
+		g_mutex_lock (&db->priv->genres_lock);
+		index = g_hash_table_lookup (db->priv->property_indexes, GINT_TO_POINTER (propid));
+		if (index != NULL) {
+			property_index_remove (index, entry);
+			property_index_insert (index, entry, property_index_value_from_gvalue (value));
+		}
+		g_mutex_unlock (&db->priv->genres_lock);
+	}
+
+	/* Handle special properties */
+	switch (propid)
+	{
+	case RHYTHMDB_PROP_TYPE:
+	{
+		RhythmDBTreeProperty *artist;
+		RhythmDBTreeProperty *genre;
+
+		g_mutex_lock (&db->priv->genres_lock);
+		remove_entry_from_album (db, entry);
+
+		entry->type = g_value_get_object (value);
+
+		genre = get_or_create_genre (db, entry->type, entry->genre);
+		artist = get_or_create_artist (db, genre, entry->artist);
+		set_entry_album (db, entry, artist, entry->album);
+		g_mutex_unlock (&db->priv->genres_lock);
+
+		return TRUE;
+	}
+	case RHYTHMDB_PROP_LOCATION:
+	{
+		RBRefString *s;
+		/* We have to use the string in the entry itself as the hash key,
+		 * otherwise either we leak it, or the string vanishes when the
+		 * GValue is freed; this means we have to do the entry modification
+		 * here, rather than letting rhythmdb_entry_set_internal do it.
+		 */
+		g_mutex_lock (&db->priv->entries_lock);
+		g_assert (g_hash_table_remove (db->priv->entries, entry->location));
+
+		s = rb_refstring_new (g_value_get_string (value));
+		rb_refstring_unref (entry->location);
+		entry->location = s;
+		g_hash_table_insert (db->priv->entries, entry->location, entry);
+		g_mutex_unlock (&db->priv->entries_lock);
+
+		return TRUE;
+	}
+	case RHYTHMDB_PROP_ALBUM:
+	{
+		const char *albumname = g_value_get_string (value);
+
+		if (strcmp (rb_refstring_get (entry->album), albumname)) {
+			RhythmDBTreeProperty *artist;
+			RhythmDBTreeProperty *genre;
+
+			rb_refstring_ref (entry->genre);
+			rb_refstring_ref (entry->artist);
+			rb_refstring_ref (entry->album);
+
+			g_mutex_lock (&db->priv->genres_lock);
+			remove_entry_from_album (db, entry);
+			genre = get_or_create_genre (db, type, entry->genre);
+			artist = get_or_create_artist (db, genre, entry->artist);
+			set_entry_album (db, entry, artist, rb_refstring_new (albumname));
+			g_mutex_unlock (&db->priv->genres_lock);
+
+			rb_refstring_unref (entry->genre);
+			rb_refstring_unref (entry->artist);
+			rb_refstring_unref (entry->album);
+		}
+		break;
+	}
+	case RHYTHMDB_PROP_ARTIST:
+	{
+		const char *artistname = g_value_get_string (value);
+
+		if (strcmp (rb_refstring_get (entry->artist), artistname)) {
+			RhythmDBTreeProperty *new_artist;
+			RhythmDBTreeProperty *genre;
+
+			rb_refstring_ref (entry->genre);
+			rb_refstring_ref (entry->artist);
+			rb_refstring_ref (entry->album);
+
+			g_mutex_lock (&db->priv->genres_lock);
+			remove_entry_from_album (db, entry);
+			genre = get_or_create_genre (db, type, entry->genre);
+			new_artist = get_or_create_artist (db, genre,
+							   rb_refstring_new (artistname));
+			set_entry_album (db, entry, new_artist, entry->album);
+			g_mutex_unlock (&db->priv->genres_lock);
+
+			rb_refstring_unref (entry->genre);
+			rb_refstring_unref (entry->artist);
+			rb_refstring_unref (entry->album);
+		}
+		break;
+	}
+	case RHYTHMDB_PROP_GENRE:
+	{
+		const char *genrename = g_value_get_string (value);
+
+		if (strcmp (rb_refstring_get (entry->genre), genrename)) {
+			RhythmDBTreeProperty *new_genre;
+			RhythmDBTreeProperty *new_artist;
+
+			rb_refstring_ref (entry->genre);
+			rb_refstring_ref (entry->artist);
+			rb_refstring_ref (entry->album);
+
+			g_mutex_lock (&db->priv->genres_lock);
+			remove_entry_from_album (db, entry);
+			new_genre = get_or_create_genre (db, type,
+							 rb_refstring_new (genrename));
+			new_artist = get_or_create_artist (db, new_genre, entry->artist);
+			set_entry_album (db, entry, new_artist, entry->album);
+			g_mutex_unlock (&db->priv->genres_lock);
+
+			rb_refstring_unref (entry->genre);
+			rb_refstring_unref (entry->artist);
+			rb_refstring_unref (entry->album);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+
+	return FALSE;
+}
+
+static void
+rhythmdb_tree_entry_delete (RhythmDB *adb,
+			    RhythmDBEntry *entry)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+
+	g_mutex_lock (&db->priv->genres_lock);
+	remove_entry_from_album (db, entry);
+	update_entry_indexes (db, entry, FALSE);
+	g_mutex_unlock (&db->priv->genres_lock);
+
+	/* remove all keywords */
+	g_mutex_lock (&db->priv->keywords_lock);
+	remove_entry_from_keywords (db, entry);
+	g_mutex_unlock (&db->priv->keywords_lock);
+
+	g_mutex_lock (&db->priv->entries_lock);
+	g_assert (g_hash_table_remove (db->priv->entries, entry->location));
+	g_assert (g_hash_table_remove (db->priv->entry_ids, GINT_TO_POINTER (entry->id)));
+
+	entry->flags |= RHYTHMDB_ENTRY_TREE_REMOVED;
+	rhythmdb_entry_unref (entry);
+	g_mutex_unlock (&db->priv->entries_lock);
+}
+
+typedef struct {
+	RhythmDB *db;
+	RhythmDBEntryType *type;
+} RbEntryRemovalCtxt;
+
+/* must be called with the entries and genres locks held */
+static gboolean
+remove_one_song (gpointer key,
+		 RhythmDBEntry *entry,
+		 RbEntryRemovalCtxt *ctxt)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE(ctxt->db);
+
+	rb_assert_locked (&db->priv->entries_lock);
+	rb_assert_locked (&db->priv->genres_lock);
+
+	g_return_val_if_fail (entry != NULL, FALSE);
+
+	if (entry->type == ctxt->type) {
+		rhythmdb_emit_entry_deleted (ctxt->db, entry);
+		g_mutex_lock (&db->priv->keywords_lock);
+		remove_entry_from_keywords (db, entry);
+		g_mutex_unlock (&db->priv->keywords_lock);
+		remove_entry_from_album (db, entry);
+		update_entry_indexes (db, entry, FALSE);
+		g_hash_table_remove (db->priv->entry_ids, GINT_TO_POINTER (entry->id));
+		entry->flags |= RHYTHMDB_ENTRY_TREE_REMOVED;
+		rhythmdb_entry_unref (entry);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+static void
+rhythmdb_tree_entry_delete_by_type (RhythmDB *adb,
+				    RhythmDBEntryType *type)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	RbEntryRemovalCtxt ctxt;
+
+	ctxt.db = adb;
+	ctxt.type = type;
+	g_mutex_lock (&db->priv->entries_lock);
+	g_mutex_lock (&db->priv->genres_lock);
+	g_hash_table_foreach_remove (db->priv->entries,
+				     (GHRFunc) remove_one_song, &ctxt);
+	g_mutex_unlock (&db->priv->genres_lock);
+	g_mutex_unlock (&db->priv->entries_lock);
+}
+
+static void
+destroy_tree_property (RhythmDBTreeProperty *prop)
+{
+#ifndef G_DISABLE_ASSERT
+	prop->magic = 0xf33df33d;
+#endif
+	g_hash_table_destroy (prop->children);
+	g_free (prop);
+}
+
+typedef void (*RhythmDBTreeTraversalFunc) (RhythmDBTree *db, RhythmDBEntry *entry, gpointer data);
+typedef void (*RhythmDBTreeAlbumTraversalFunc) (RhythmDBTree *db, RhythmDBTreeProperty *album, gpointer data);
+
+struct RhythmDBTreeTraversalData
+{
+	RhythmDBTree *db;
+	GPtrArray *query;
+	RhythmDBCompiledQuery *compiled;
+	RhythmDBTreeTraversalFunc func;
+	gpointer data;
+	gboolean *cancel;
+};
+
+static gboolean
+rhythmdb_tree_evaluate_query (RhythmDB *adb,
+			      GPtrArray *query,
+			      RhythmDBEntry *entry)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	guint i;
+	guint last_disjunction;
+
+	for (i = 0, last_disjunction = 0; i < query->len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+
+		if (data->type == RHYTHMDB_QUERY_DISJUNCTION) {
+			if (evaluate_conjunctive_subquery (db, query, last_disjunction, i, entry))
+				return TRUE;
+
+			last_disjunction = i + 1;
+		}
+	}
+	if (evaluate_conjunctive_subquery (db, query, last_disjunction, query->len, entry))
+		return TRUE;
+	return FALSE;
+}
+
+#define RHYTHMDB_PROPERTY_COMPARE(OP) \
 			switch (rhythmdb_get_property_type (db, data->propid)) { \
 			case G_TYPE_STRING: \
 				if (g_strcmp0 (rhythmdb_entry_get_string (entry, data->propid), \
@@ -1868,358 +3864,1086 @@ rhythmdb_tree_evaluate_query (RhythmDB *adb,
 				g_assert_not_reached (); \
 			}
 
-static gboolean
-search_match_properties (RhythmDB *db,
-			 RhythmDBEntry *entry,
-			 gchar **words)
+static gboolean
+search_match_properties (RhythmDB *db,
+			 RhythmDBEntry *entry,
+			 gchar **words)
+{
+	const RhythmDBPropType props[] = {
+		RHYTHMDB_PROP_TITLE_FOLDED,
+		RHYTHMDB_PROP_ALBUM_FOLDED,
+		RHYTHMDB_PROP_ARTIST_FOLDED,
+		RHYTHMDB_PROP_COMPOSER_FOLDED,
+		RHYTHMDB_PROP_GENRE_FOLDED
+	};
+	gboolean islike = TRUE;
+	gchar **current;
+	int i;
+
+	for (current = words; *current != NULL; current++) {
+		gboolean word_found = FALSE;
+
+		for (i = 0; i < G_N_ELEMENTS (props); i++) {
+			const char *entry_string = rhythmdb_entry_get_string (entry, props[i]);
+			if (entry_string && (strstr (entry_string, *current) != NULL)) {
+				/* the word was found, go to the next one */
+				word_found = TRUE;
+				break;
+			}
+		}
+		if (!word_found) {
+			/* the word wasn't in any of the properties*/
+			islike = FALSE;
+			break;
+		}
+	}
+
+	return islike;
+}
+
+static gboolean
+evaluate_conjunctive_subquery (RhythmDBTree *dbtree,
+			       GPtrArray *query,
+			       guint base,
+			       guint max,
+			       RhythmDBEntry *entry)
+
+{
+	RhythmDB *db = (RhythmDB *) dbtree;
+	guint i;
+/* Optimization possibility - we may get here without actually having
+ * anything in the query.  It would be faster to instead just merge
+ * the child hash table into the query result hash.
+ */
+	for (i = base; i < max; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+
+		switch (data->type) {
+		case RHYTHMDB_QUERY_SUBQUERY:
+		{
+			gboolean matched = FALSE;
+			GList *conjunctions = split_query_by_disjunctions (dbtree, data->subquery);
+			GList *tem;
+
+			if (conjunctions == NULL)
+				matched = TRUE;
+
+			for (tem = conjunctions; tem; tem = tem->next) {
+				GPtrArray *subquery = tem->data;
+				if (!matched && evaluate_conjunctive_subquery (dbtree, subquery,
+									       0, subquery->len,
+									       entry)) {
+					matched = TRUE;
+				}
+				g_ptr_array_free (tem->data, TRUE);
+			}
+			g_list_free (conjunctions);
+			if (!matched)
+				return FALSE;
+		}
+		break;
+		case RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN:
+		case RHYTHMDB_QUERY_PROP_CURRENT_TIME_NOT_WITHIN:
+		{
+			gulong relative_time;
+			GTimeVal current_time;
+
+			g_assert (rhythmdb_get_property_type (db, data->propid) == G_TYPE_ULONG);
+
+			relative_time = g_value_get_ulong (data->val);
+			g_get_current_time  (&current_time);
+
+			if (data->type == RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN) {
+				if (!(rhythmdb_entry_get_ulong (entry, data->propid) >= (current_time.tv_sec - relative_time)))
+					return FALSE;
+			} else {
+				if (!(rhythmdb_entry_get_ulong (entry, data->propid) < (current_time.tv_sec - relative_time)))
+					return FALSE;
+			}
+			break;
+		}
+		case RHYTHMDB_QUERY_PROP_PREFIX:
+		case RHYTHMDB_QUERY_PROP_SUFFIX:
+		{
+			const char *value_s;
+			const char *entry_s;
+
+			g_assert (rhythmdb_get_property_type (db, data->propid) == G_TYPE_STRING);
+
+			value_s = g_value_get_string (data->val);
+			entry_s = rhythmdb_entry_get_string (entry, data->propid);
+
+			if (data->type == RHYTHMDB_QUERY_PROP_PREFIX && !g_str_has_prefix (entry_s, value_s))
+				return FALSE;
+			if (data->type == RHYTHMDB_QUERY_PROP_SUFFIX && !g_str_has_suffix (entry_s, value_s))
+				return FALSE;
+
+			break;
+		}
+		case RHYTHMDB_QUERY_PROP_LIKE:
+		case RHYTHMDB_QUERY_PROP_NOT_LIKE:
+		{
+			if (data->propid == RHYTHMDB_PROP_KEYWORD) {
+				const char *str;
+				RBRefString *keyword;
+				gboolean has;
+
+				str = g_value_get_string (data->val);
+				keyword = rb_refstring_find (str);
+				if (keyword != NULL) {
+					has = rhythmdb_tree_entry_keyword_has (db, entry, keyword);
+				} else {
+					has = FALSE;
+				}
+				if ((data->type == RHYTHMDB_QUERY_PROP_LIKE) ^ has)
+					return FALSE;
+				else
+					continue;
+				break;
+			} else if (rhythmdb_get_property_type (db, data->propid) == G_TYPE_STRING) {
+				gboolean islike;
+
+				if (data->propid == RHYTHMDB_PROP_SEARCH_MATCH) {
+					/* this is a special property, that should match several things */
+					islike = search_match_properties (db, entry, g_value_get_boxed (data->val));
+
+				} else {
+					const gchar *value_string = g_value_get_string (data->val);
+					const char *entry_string = rhythmdb_entry_get_string (entry, data->propid);
+
+					/* check in case the property is NULL, the value should never be NULL */
+					if (entry_string == NULL)
+						return FALSE;
+
+					islike = (strstr (entry_string, value_string) != NULL);
+				}
+
+				if ((data->type == RHYTHMDB_QUERY_PROP_LIKE) ^ islike)
+					return FALSE;
+				else
+					continue;
+				break;
+			}
+			/* Fall through */
+		}
+		case RHYTHMDB_QUERY_PROP_EQUALS:
+			RHYTHMDB_PROPERTY_COMPARE (!=)
+			break;
+		case RHYTHMDB_QUERY_PROP_NOT_EQUAL:
+			RHYTHMDB_PROPERTY_COMPARE (==)
+			break;
+		case RHYTHMDB_QUERY_PROP_GREATER:
+			RHYTHMDB_PROPERTY_COMPARE (<)
+			break;
+		case RHYTHMDB_QUERY_PROP_LESS:
+			RHYTHMDB_PROPERTY_COMPARE (>)
+			break;
+		case RHYTHMDB_QUERY_END:
+		case RHYTHMDB_QUERY_DISJUNCTION:
+		case RHYTHMDB_QUERY_PROP_YEAR_EQUALS:
+		case RHYTHMDB_QUERY_PROP_YEAR_NOT_EQUAL:
+		case RHYTHMDB_QUERY_PROP_YEAR_LESS:
+		case RHYTHMDB_QUERY_PROP_YEAR_GREATER:
+			g_assert_not_reached ();
+			break;
+		}
+	}
+	return TRUE;
+}
+
+static void
+do_conjunction (RhythmDBEntry *entry,
+		gpointer unused,
+		struct RhythmDBTreeTraversalData *data)
+{
+	if (G_UNLIKELY (*data->cancel))
+		return;
+	/* Finally, we actually evaluate the query! */
+	if (rhythmdb_compiled_query_evaluate (data->compiled, entry)) {
+		data->func (data->db, entry, data->data);
+	}
+}
+
+static void
+conjunctive_query_songs (const char *name,
+			 RhythmDBTreeProperty *album,
+			 struct RhythmDBTreeTraversalData *data)
+{
+	if (G_UNLIKELY (*data->cancel))
+		return;
+	g_hash_table_foreach (album->children, (GHFunc) do_conjunction, data);
+}
+
+static GPtrArray *
+clone_remove_ptr_array_index (GPtrArray *arr,
+			      guint index)
+{
+	GPtrArray *ret = g_ptr_array_new ();
+	guint i;
+	for (i = 0; i < arr->len; i++)
+		if (i != index)
+			g_ptr_array_add (ret, g_ptr_array_index (arr, i));
+
+	return ret;
+}
+
+static void
+conjunctive_query_albums (const char *name,
+			  RhythmDBTreeProperty *artist,
+			  struct RhythmDBTreeTraversalData *data)
+{
+	guint i;
+	int album_query_idx = -1;
+
+	if (G_UNLIKELY (*data->cancel))
+		return;
+
+	for (i = 0; i < data->query->len; i++) {
+		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, i);
+		if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS
+		    && qdata->propid == RHYTHMDB_PROP_ALBUM) {
+			if (album_query_idx > 0)
+				return;
+			album_query_idx = i;
+
+		}
+	}
+
+	if (album_query_idx >= 0) {
+		RhythmDBTreeProperty *album;
+		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, album_query_idx);
+		RBRefString *albumname = rb_refstring_new (g_value_get_string (qdata->val));
+		GPtrArray *oldquery = data->query;
+
+		data->query = clone_remove_ptr_array_index (data->query, album_query_idx);
+
+		album = g_hash_table_lookup (artist->children, albumname);
+
+		if (album != NULL) {
+			conjunctive_query_songs (rb_refstring_get (albumname), album, data);
+		}
+		g_ptr_array_free (data->query, TRUE);
+		data->query = oldquery;
+		return;
+	}
+
+	g_hash_table_foreach (artist->children, (GHFunc) conjunctive_query_songs, data);
+}
+
+static void
+conjunctive_query_artists (const char *name,
+			   RhythmDBTreeProperty *genre,
+			   struct RhythmDBTreeTraversalData *data)
+{
+	guint i;
+	int artist_query_idx = -1;
+
+	if (G_UNLIKELY (*data->cancel))
+		return;
+
+	for (i = 0; i < data->query->len; i++) {
+		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, i);
+		if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS
+		    && qdata->propid == RHYTHMDB_PROP_ARTIST) {
+			if (artist_query_idx > 0)
+				return;
+			artist_query_idx = i;
+
+		}
+	}
+
+	if (artist_query_idx >= 0) {
+		RhythmDBTreeProperty *artist;
+		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, artist_query_idx);
+		RBRefString *artistname = rb_refstring_new (g_value_get_string (qdata->val));
+		GPtrArray *oldquery = data->query;
+
+		data->query = clone_remove_ptr_array_index (data->query, artist_query_idx);
+
+		artist = g_hash_table_lookup (genre->children, artistname);
+		if (artist != NULL) {
+			conjunctive_query_albums (rb_refstring_get (artistname), artist, data);
+		}
+		g_ptr_array_free (data->query, TRUE);
+		data->query = oldquery;
+		return;
+	}
+
+	g_hash_table_foreach (genre->children, (GHFunc) conjunctive_query_albums, data);
+}
+
+static void
+conjunctive_query_genre (RhythmDBTree *db,
+			 GHashTable *genres,
+			 struct RhythmDBTreeTraversalData *data)
 {
-	const RhythmDBPropType props[] = {
-		RHYTHMDB_PROP_TITLE_FOLDED,
-		RHYTHMDB_PROP_ALBUM_FOLDED,
-		RHYTHMDB_PROP_ARTIST_FOLDED,
-		RHYTHMDB_PROP_COMPOSER_FOLDED,
-		RHYTHMDB_PROP_GENRE_FOLDED
-	};
-	gboolean islike = TRUE;
-	gchar **current;
-	int i;
+	int genre_query_idx = -1;
+	guint i;
 
-	for (current = words; *current != NULL; current++) {
-		gboolean word_found = FALSE;
+	if (G_UNLIKELY (*data->cancel))
+		return;
+
+	for (i = 0; i < data->query->len; i++) {
+		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, i);
+		if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS
+		    && qdata->propid == RHYTHMDB_PROP_GENRE) {
+			/* A song can't currently have two genres.  So
+			 * if we get a conjunctive query for that, we
+			 * know the result must be the empty set. */
+			if (genre_query_idx > 0)
+				return;
+			genre_query_idx = i;
 
-		for (i = 0; i < G_N_ELEMENTS (props); i++) {
-			const char *entry_string = rhythmdb_entry_get_string (entry, props[i]);
-			if (entry_string && (strstr (entry_string, *current) != NULL)) {
-				/* the word was found, go to the next one */
-				word_found = TRUE;
-				break;
-			}
 		}
-		if (!word_found) {
-			/* the word wasn't in any of the properties*/
-			islike = FALSE;
-			break;
+	}
+
+	if (genre_query_idx >= 0) {
+		RhythmDBTreeProperty *genre;
+		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, genre_query_idx);
+		RBRefString *genrename = rb_refstring_new (g_value_get_string (qdata->val));
+		GPtrArray *oldquery = data->query;
+
+		data->query = clone_remove_ptr_array_index (data->query, genre_query_idx);
+
+		genre = g_hash_table_lookup (genres, genrename);
+		if (genre != NULL) {
+			conjunctive_query_artists (rb_refstring_get (genrename), genre, data);
 		}
+		g_ptr_array_free (data->query, TRUE);
+		data->query = oldquery;
+		return;
 	}
 
-	return islike;
+	g_hash_table_foreach (genres, (GHFunc) conjunctive_query_artists, data);
 }
 
-static gboolean
-evaluate_conjunctive_subquery (RhythmDBTree *dbtree,
-			       GPtrArray *query,
-			       guint base,
-			       guint max,
-			       RhythmDBEntry *entry)
-
+static void
+search_index_collect_words (RhythmDBTree *db,
+			    GPtrArray *query,
+			    GPtrArray *words)
 {
-	RhythmDB *db = (RhythmDB *) dbtree;
 	guint i;
-/* Optimization possibility - we may get here without actually having
- * anything in the query.  It would be faster to instead just merge
- * the child hash table into the query result hash.
- */
-	for (i = base; i < max; i++) {
+	int j;
+
+	for (i = 0; i < query->len; i++) {
 		RhythmDBQueryData *data = g_ptr_array_index (query, i);
 
 		switch (data->type) {
 		case RHYTHMDB_QUERY_SUBQUERY:
 		{
-			gboolean matched = FALSE;
-			GList *conjunctions = split_query_by_disjunctions (dbtree, data->subquery);
-			GList *tem;
-
-			if (conjunctions == NULL)
-				matched = TRUE;
+			GList *conjunctions, *tem;
 
-			for (tem = conjunctions; tem; tem = tem->next) {
-				GPtrArray *subquery = tem->data;
-				if (!matched && evaluate_conjunctive_subquery (dbtree, subquery,
-									       0, subquery->len,
-									       entry)) {
-					matched = TRUE;
-				}
+			/* only a subquery that must match as a whole constrains the result */
+			conjunctions = split_query_by_disjunctions (db, data->subquery);
+			if (conjunctions != NULL && conjunctions->next == NULL)
+				search_index_collect_words (db, conjunctions->data, words);
+			for (tem = conjunctions; tem; tem = tem->next)
 				g_ptr_array_free (tem->data, TRUE);
-			}
 			g_list_free (conjunctions);
-			if (!matched)
-				return FALSE;
+			break;
 		}
-		break;
-		case RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN:
-		case RHYTHMDB_QUERY_PROP_CURRENT_TIME_NOT_WITHIN:
-		{
-			gulong relative_time;
-			GTimeVal current_time;
+		case RHYTHMDB_QUERY_PROP_LIKE:
+			if (data->propid == RHYTHMDB_PROP_SEARCH_MATCH) {
+				char **match = g_value_get_boxed (data->val);
 
-			g_assert (rhythmdb_get_property_type (db, data->propid) == G_TYPE_ULONG);
+				for (j = 0; match != NULL && match[j] != NULL; j++) {
+					char **split = search_index_split (match[j]);
+					char **w;
 
-			relative_time = g_value_get_ulong (data->val);
-			g_get_current_time  (&current_time);
+					for (w = split; *w != NULL; w++)
+						g_ptr_array_add (words, *w);
+					g_free (split);
+				}
+				break;
+			}
 
-			if (data->type == RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN) {
-				if (!(rhythmdb_entry_get_ulong (entry, data->propid) >= (current_time.tv_sec - relative_time)))
-					return FALSE;
-			} else {
-				if (!(rhythmdb_entry_get_ulong (entry, data->propid) < (current_time.tv_sec - relative_time)))
-					return FALSE;
+			for (j = 0; j < G_N_ELEMENTS (search_index_props); j++) {
+				if (data->propid == search_index_props[j]) {
+					char **split = search_index_split (g_value_get_string (data->val));
+					char **w;
+
+					for (w = split; *w != NULL; w++)
+						g_ptr_array_add (words, *w);
+					g_free (split);
+					break;
+				}
 			}
 			break;
+		default:
+			break;
 		}
-		case RHYTHMDB_QUERY_PROP_PREFIX:
-		case RHYTHMDB_QUERY_PROP_SUFFIX:
-		{
-			const char *value_s;
-			const char *entry_s;
+	}
+}
 
-			g_assert (rhythmdb_get_property_type (db, data->propid) == G_TYPE_STRING);
+/* must be called with the genres lock held */
+static guint
+search_index_count (RhythmDBTree *db,
+		    const char *word)
+{
+	GHashTableIter iter;
+	gpointer token;
+	gpointer postings;
+	guint count = 0;
+
+	g_hash_table_iter_init (&iter, db->priv->search_index);
+	while (g_hash_table_iter_next (&iter, &token, &postings)) {
+		if (strstr (token, word) != NULL)
+			count += g_hash_table_size (postings);
+	}
+	return count;
+}
 
-			value_s = g_value_get_string (data->val);
-			entry_s = rhythmdb_entry_get_string (entry, data->propid);
+/*
+ * Finds the indexed search word in the query matching the fewest entries.
+ * Returns the number of entries containing the word, or G_MAXUINT if the
+ * query doesn't search for any words.  The search index is built if
+ * @build is set; otherwise G_MAXUINT is returned if it doesn't exist yet.
+ *
+ * must be called with the genres lock held
+ */
+static guint
+search_index_plan (RhythmDBTree *db,
+		   GPtrArray *query,
+		   gboolean build,
+		   char **best)
+{
+	GPtrArray *words;
+	guint best_count = G_MAXUINT;
+	guint i;
 
-			if (data->type == RHYTHMDB_QUERY_PROP_PREFIX && !g_str_has_prefix (entry_s, value_s))
-				return FALSE;
-			if (data->type == RHYTHMDB_QUERY_PROP_SUFFIX && !g_str_has_suffix (entry_s, value_s))
-				return FALSE;
+	rb_assert_locked (&db->priv->genres_lock);
+
+	if (build == FALSE && db->priv->search_index == NULL)
+		return G_MAXUINT;
+
+	words = g_ptr_array_new_with_free_func (g_free);
+	search_index_collect_words (db, query, words);
+	if (words->len == 0) {
+		g_ptr_array_free (words, TRUE);
+		return G_MAXUINT;
+	}
+
+	search_index_build (db);
+
+	*best = NULL;
+	for (i = 0; i < words->len; i++) {
+		const char *word = g_ptr_array_index (words, i);
+		guint count;
+
+		count = search_index_count (db, word);
+		if (*best == NULL || count < best_count) {
+			g_free (*best);
+			*best = g_strdup (word);
+			best_count = count;
+		}
+	}
 
+	g_ptr_array_free (words, TRUE);
+	return best_count;
+}
+
+/* must be called with the genres lock held */
+static void
+search_index_run (RhythmDBTree *db,
+		  const char *word,
+		  struct RhythmDBTreeTraversalData *data)
+{
+	GHashTable *seen;
+	GHashTableIter iter;
+	gpointer token;
+	gpointer postings;
+
+	seen = g_hash_table_new (g_direct_hash, g_direct_equal);
+	g_hash_table_iter_init (&iter, db->priv->search_index);
+	while (g_hash_table_iter_next (&iter, &token, &postings)) {
+		GHashTableIter piter;
+		gpointer entry;
+
+		if (G_UNLIKELY (*data->cancel))
 			break;
+		if (strstr (token, word) == NULL)
+			continue;
+
+		g_hash_table_iter_init (&piter, postings);
+		while (g_hash_table_iter_next (&piter, &entry, NULL)) {
+			if (g_hash_table_lookup (seen, entry))
+				continue;
+			g_hash_table_insert (seen, entry, entry);
+			do_conjunction (entry, NULL, data);
 		}
-		case RHYTHMDB_QUERY_PROP_LIKE:
-		case RHYTHMDB_QUERY_PROP_NOT_LIKE:
-		{
-			if (data->propid == RHYTHMDB_PROP_KEYWORD) {
-				const char *str;
-				RBRefString *keyword;
-				gboolean has;
+	}
+	g_hash_table_destroy (seen);
+}
 
-				str = g_value_get_string (data->val);
-				keyword = rb_refstring_find (str);
-				if (keyword != NULL) {
-					has = rhythmdb_tree_entry_keyword_has (db, entry, keyword);
-				} else {
-					has = FALSE;
-				}
-				if ((data->type == RHYTHMDB_QUERY_PROP_LIKE) ^ has)
-					return FALSE;
-				else
-					continue;
+/* property value range, including min and excluding max */
+typedef struct
+{
+	RhythmDBPropType propid;
+	gdouble min;
+	gdouble max;
+} RhythmDBTreePropertyRange;
+
+static void
+property_index_init_ranges (RhythmDBTreePropertyRange *ranges)
+{
+	int i;
+
+	for (i = 0; i < G_N_ELEMENTS (property_index_props); i++) {
+		ranges[i].propid = property_index_props[i];
+		ranges[i].min = -INFINITY;
+		ranges[i].max = INFINITY;
+	}
+}
+
+static void
+property_index_collect_ranges (RhythmDBTree *db,
+			       GPtrArray *query,
+			       RhythmDBTreePropertyRange *ranges)
+{
+	GTimeVal current_time;
+	guint i;
+	int j;
+
+	g_get_current_time (&current_time);
+
+	for (i = 0; i < query->len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+		RhythmDBTreePropertyRange *range = NULL;
+		gdouble value;
+
+		if (data->type == RHYTHMDB_QUERY_SUBQUERY) {
+			GList *conjunctions, *tem;
+
+			/* only a subquery that must match as a whole constrains the result */
+			conjunctions = split_query_by_disjunctions (db, data->subquery);
+			if (conjunctions != NULL && conjunctions->next == NULL)
+				property_index_collect_ranges (db, conjunctions->data, ranges);
+			for (tem = conjunctions; tem; tem = tem->next)
+				g_ptr_array_free (tem->data, TRUE);
+			g_list_free (conjunctions);
+			continue;
+		}
+
+		for (j = 0; j < G_N_ELEMENTS (property_index_props); j++) {
+			if (ranges[j].propid == data->propid) {
+				range = &ranges[j];
 				break;
-			} else if (rhythmdb_get_property_type (db, data->propid) == G_TYPE_STRING) {
-				gboolean islike;
+			}
+		}
+		if (range == NULL || data->val == NULL)
+			continue;
+		if (!G_VALUE_HOLDS_ULONG (data->val) && !G_VALUE_HOLDS_DOUBLE (data->val))
+			continue;
 
-				if (data->propid == RHYTHMDB_PROP_SEARCH_MATCH) {
-					/* this is a special property, that should match several things */
-					islike = search_match_properties (db, entry, g_value_get_boxed (data->val));
+		value = property_index_value_from_gvalue (data->val);
+		switch (data->type) {
+		case RHYTHMDB_QUERY_PROP_EQUALS:
+			range->min = MAX (range->min, value);
+			range->max = MIN (range->max, nextafter (value, INFINITY));
+			break;
+		case RHYTHMDB_QUERY_PROP_GREATER:
+			range->min = MAX (range->min, value);
+			break;
+		case RHYTHMDB_QUERY_PROP_LESS:
+			range->max = MIN (range->max, nextafter (value, INFINITY));
+			break;
+		case RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN:
+			if (value <= current_time.tv_sec)
+				range->min = MAX (range->min, current_time.tv_sec - value);
+			break;
+		case RHYTHMDB_QUERY_PROP_CURRENT_TIME_NOT_WITHIN:
+			if (value <= current_time.tv_sec)
+				range->max = MIN (range->max, current_time.tv_sec - value);
+			break;
+		default:
+			break;
+		}
+	}
+}
 
-				} else {
-					const gchar *value_string = g_value_get_string (data->val);
-					const char *entry_string = rhythmdb_entry_get_string (entry, data->propid);
+/* must be called with the genres lock held */
+static GSequenceIter *
+property_index_lookup (RhythmDBTreePropertyIndex *index,
+		       gdouble value)
+{
+	RhythmDBTreePropertyIndexItem probe;
 
-					/* check in case the property is NULL, the value should never be NULL */
-					if (entry_string == NULL)
-						return FALSE;
+	/* a NULL entry sorts before every entry with the same value */
+	probe.value = value;
+	probe.entry = NULL;
+	return g_sequence_search (index->items, &probe,
+				  (GCompareDataFunc) property_index_item_compare, NULL);
+}
+
+/* must be called with the genres lock held */
+static guint
+property_index_count (RhythmDBTreePropertyIndex *index,
+		      RhythmDBTreePropertyRange *range)
+{
+	if (range->min >= range->max)
+		return 0;
+
+	return g_sequence_iter_get_position (property_index_lookup (index, range->max)) -
+		g_sequence_iter_get_position (property_index_lookup (index, range->min));
+}
+
+/*
+ * Finds the indexed property range in the query matching the fewest
+ * entries.  Returns the number of entries in the range, or G_MAXUINT if
+ * the query doesn't constrain any indexed properties.  Indexes for the
+ * constrained properties are built if @build is set; otherwise only the
+ * existing ones are considered.
+ *
+ * must be called with the genres lock held
+ */
+static guint
+property_index_plan (RhythmDBTree *db,
+		     GPtrArray *query,
+		     gboolean build,
+		     RhythmDBTreePropertyRange *best)
+{
+	RhythmDBTreePropertyRange ranges[G_N_ELEMENTS (property_index_props)];
+	guint best_count = G_MAXUINT;
+	int i;
+
+	rb_assert_locked (&db->priv->genres_lock);
+
+	property_index_init_ranges (ranges);
+	property_index_collect_ranges (db, query, ranges);
+
+	for (i = 0; i < G_N_ELEMENTS (property_index_props); i++) {
+		RhythmDBTreePropertyIndex *index;
+		guint count;
 
-					islike = (strstr (entry_string, value_string) != NULL);
-				}
+		if (ranges[i].min == -INFINITY && ranges[i].max == INFINITY)
+			continue;
 
-				if ((data->type == RHYTHMDB_QUERY_PROP_LIKE) ^ islike)
-					return FALSE;
-				else
-					continue;
-				break;
-			}
-			/* Fall through */
+		if (build) {
+			index = property_index_get (db, ranges[i].propid);
+		} else {
+			index = g_hash_table_lookup (db->priv->property_indexes, GINT_TO_POINTER (ranges[i].propid));
+			if (index == NULL)
+				continue;
 		}
-		case RHYTHMDB_QUERY_PROP_EQUALS:
-			RHYTHMDB_PROPERTY_COMPARE (!=)
-			break;
-		case RHYTHMDB_QUERY_PROP_NOT_EQUAL:
-			RHYTHMDB_PROPERTY_COMPARE (==)
-			break;
-		case RHYTHMDB_QUERY_PROP_GREATER:
-			RHYTHMDB_PROPERTY_COMPARE (<)
-			break;
-		case RHYTHMDB_QUERY_PROP_LESS:
-			RHYTHMDB_PROPERTY_COMPARE (>)
-			break;
-		case RHYTHMDB_QUERY_END:
-		case RHYTHMDB_QUERY_DISJUNCTION:
-		case RHYTHMDB_QUERY_PROP_YEAR_EQUALS:
-		case RHYTHMDB_QUERY_PROP_YEAR_NOT_EQUAL:
-		case RHYTHMDB_QUERY_PROP_YEAR_LESS:
-		case RHYTHMDB_QUERY_PROP_YEAR_GREATER:
-			g_assert_not_reached ();
-			break;
+		count = property_index_count (index, &ranges[i]);
+
+		if (count < best_count) {
+			*best = ranges[i];
+			best_count = count;
 		}
 	}
-	return TRUE;
+
+	return best_count;
 }
 
+/* must be called with the genres lock held */
 static void
-do_conjunction (RhythmDBEntry *entry,
-		gpointer unused,
-		struct RhythmDBTreeTraversalData *data)
+property_index_run (RhythmDBTree *db,
+		    RhythmDBTreePropertyRange *range,
+		    struct RhythmDBTreeTraversalData *data)
 {
-	if (G_UNLIKELY (*data->cancel))
+	RhythmDBTreePropertyIndex *index;
+	GSequenceIter *iter;
+	GSequenceIter *end;
+
+	if (range->min >= range->max)
 		return;
-	/* Finally, we actually evaluate the query! */
-	if (evaluate_conjunctive_subquery (data->db, data->query, 0, data->query->len,
-					   entry)) {
-		data->func (data->db, entry, data->data);
+
+	index = property_index_get (db, range->propid);
+	iter = property_index_lookup (index, range->min);
+	end = property_index_lookup (index, range->max);
+	for (; iter != end; iter = g_sequence_iter_next (iter)) {
+		RhythmDBTreePropertyIndexItem *item = g_sequence_get (iter);
+
+		if (G_UNLIKELY (*data->cancel))
+			break;
+		do_conjunction (item->entry, NULL, data);
 	}
 }
 
+/*
+ * Query planning.
+ *
+ * Each conjunction is planned before it is run: the predicates are
+ * reordered so the ones that are cheap to evaluate and likely to reject
+ * an entry come first, and the access path visiting the fewest entries
+ * is chosen from the genre/artist/album tree and the search and property
+ * indexes.  Selectivity estimates come from the sizes of the tree levels
+ * and from the indexes where they exist.
+ */
+
+typedef enum
+{
+	QUERY_PLAN_TREE,
+	QUERY_PLAN_SEARCH_INDEX,
+	QUERY_PLAN_PROPERTY_INDEX
+} RhythmDBTreeQueryPlanPath;
+
+typedef struct
+{
+	RhythmDBTreeQueryPlanPath path;
+	guint estimate;			/* number of entries visited */
+	char *word;			/* for QUERY_PLAN_SEARCH_INDEX */
+	RhythmDBTreePropertyRange range;	/* for QUERY_PLAN_PROPERTY_INDEX */
+} RhythmDBTreeQueryPlan;
+
+typedef struct RhythmDBTreeQueryStats
+{
+	guint n_entries;
+	guint n_genres;
+	guint n_artists;
+	guint n_albums;
+	GHashTable *type_entries;	/* RhythmDBEntryType -> number of entries */
+	gint generation;		/* commit the statistics were gathered after */
+} RhythmDBTreeQueryStats;
+
+typedef struct
+{
+	RhythmDBQueryData *data;
+	gdouble rank;
+	guint position;
+} RhythmDBTreePredicateRank;
+
+/* must be called with the genres lock held */
 static void
-conjunctive_query_songs (const char *name,
-			 RhythmDBTreeProperty *album,
-			 struct RhythmDBTreeTraversalData *data)
+query_stats_invalidate (RhythmDBTree *db)
 {
-	if (G_UNLIKELY (*data->cancel))
+	if (db->priv->query_stats == NULL)
 		return;
-	g_hash_table_foreach (album->children, (GHFunc) do_conjunction, data);
+
+	g_hash_table_destroy (db->priv->query_stats->type_entries);
+	g_free (db->priv->query_stats);
+	db->priv->query_stats = NULL;
 }
 
-static GPtrArray *
-clone_remove_ptr_array_index (GPtrArray *arr,
-			      guint index)
+/*
+ * Returns statistics describing the album tree.  Gathering these means
+ * walking every album, so they're only gathered again once entries have
+ * been added to or removed from albums and the changes have been committed.
+ * A batch of changes, such as a chunk of the database being loaded, only
+ * causes them to be gathered once.
+ *
+ * must be called with the genres lock held
+ */
+static RhythmDBTreeQueryStats *
+query_stats_get (RhythmDBTree *db)
 {
-	GPtrArray *ret = g_ptr_array_new ();
-	guint i;
-	for (i = 0; i < arr->len; i++)
-		if (i != index)
-			g_ptr_array_add (ret, g_ptr_array_index (arr, i));
+	RhythmDBTreeQueryStats *stats;
+	GHashTableIter types;
+	gpointer type;
+	gpointer genres;
+	gint generation;
 
-	return ret;
-}
+	rb_assert_locked (&db->priv->genres_lock);
 
-static void
-conjunctive_query_albums (const char *name,
-			  RhythmDBTreeProperty *artist,
-			  struct RhythmDBTreeTraversalData *data)
-{
-	guint i;
-	int album_query_idx = -1;
+	generation = g_atomic_int_get (&RHYTHMDB (db)->priv->commit_generation);
+	stats = db->priv->query_stats;
+	if (stats != NULL &&
+	    (db->priv->query_stats_dirty == FALSE || stats->generation == generation)) {
+		stats->n_entries = db->priv->n_entries;
+		return stats;
+	}
+	query_stats_invalidate (db);
 
-	if (G_UNLIKELY (*data->cancel))
-		return;
+	stats = g_new0 (RhythmDBTreeQueryStats, 1);
+	stats->n_entries = db->priv->n_entries;
+	stats->generation = generation;
+	db->priv->query_stats_dirty = FALSE;
+	stats->type_entries = g_hash_table_new (g_direct_hash, g_direct_equal);
 
-	for (i = 0; i < data->query->len; i++) {
-		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, i);
-		if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS
-		    && qdata->propid == RHYTHMDB_PROP_ALBUM) {
-			if (album_query_idx > 0)
-				return;
-			album_query_idx = i;
+	g_hash_table_iter_init (&types, db->priv->genres);
+	while (g_hash_table_iter_next (&types, &type, &genres)) {
+		GHashTableIter giter;
+		RhythmDBTreeProperty *genre;
+		guint count = 0;
+
+		stats->n_genres += g_hash_table_size (genres);
+		g_hash_table_iter_init (&giter, genres);
+		while (g_hash_table_iter_next (&giter, NULL, (gpointer *) &genre)) {
+			GHashTableIter aiter;
+			RhythmDBTreeProperty *artist;
+
+			stats->n_artists += g_hash_table_size (genre->children);
+			g_hash_table_iter_init (&aiter, genre->children);
+			while (g_hash_table_iter_next (&aiter, NULL, (gpointer *) &artist)) {
+				GHashTableIter aliter;
+				RhythmDBTreeProperty *album;
 
+				stats->n_albums += g_hash_table_size (artist->children);
+				g_hash_table_iter_init (&aliter, artist->children);
+				while (g_hash_table_iter_next (&aliter, NULL, (gpointer *) &album)) {
+					count += g_hash_table_size (album->children);
+				}
+			}
 		}
+		g_hash_table_insert (stats->type_entries, type, GUINT_TO_POINTER (count));
 	}
 
-	if (album_query_idx >= 0) {
-		RhythmDBTreeProperty *album;
-		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, album_query_idx);
-		RBRefString *albumname = rb_refstring_new (g_value_get_string (qdata->val));
-		GPtrArray *oldquery = data->query;
+	db->priv->query_stats = stats;
+	return stats;
+}
 
-		data->query = clone_remove_ptr_array_index (data->query, album_query_idx);
+static gdouble
+estimate_ratio (guint count, guint total)
+{
+	if (total == 0)
+		return 1.0;
+	return MIN (1.0, (gdouble) count / total);
+}
 
-		album = g_hash_table_lookup (artist->children, albumname);
+/* must be called with the genres lock held */
+static gdouble
+estimate_selectivity (RhythmDBTree *db,
+		      RhythmDBTreeQueryStats *stats,
+		      RhythmDBQueryData *data)
+{
+	RhythmDBTreePropertyIndex *index;
+
+	index = g_hash_table_lookup (db->priv->property_indexes, GINT_TO_POINTER (data->propid));
+	if (index != NULL && data->type != RHYTHMDB_QUERY_SUBQUERY) {
+		RhythmDBTreePropertyRange ranges[G_N_ELEMENTS (property_index_props)];
+		RhythmDBTreePropertyRange *range = NULL;
+		GPtrArray *single;
+		int i;
+
+		/* the index can tell us exactly how many entries match */
+		property_index_init_ranges (ranges);
+		single = g_ptr_array_new ();
+		g_ptr_array_add (single, data);
+		property_index_collect_ranges (db, single, ranges);
+		g_ptr_array_free (single, TRUE);
+
+		for (i = 0; i < G_N_ELEMENTS (property_index_props); i++) {
+			if (ranges[i].propid == data->propid)
+				range = &ranges[i];
+		}
 
-		if (album != NULL) {
-			conjunctive_query_songs (rb_refstring_get (albumname), album, data);
+		if (range->min != -INFINITY || range->max != INFINITY)
+			return estimate_ratio (property_index_count (index, range),
+					       g_sequence_get_length (index->items));
+	}
+
+	switch (data->type) {
+	case RHYTHMDB_QUERY_PROP_EQUALS:
+		switch (data->propid) {
+		case RHYTHMDB_PROP_TYPE:
+			return estimate_ratio (GPOINTER_TO_UINT (g_hash_table_lookup (stats->type_entries,
+										      g_value_get_object (data->val))),
+					       stats->n_entries);
+		case RHYTHMDB_PROP_GENRE:
+			return estimate_ratio (1, stats->n_genres);
+		case RHYTHMDB_PROP_ARTIST:
+			return estimate_ratio (1, stats->n_artists);
+		case RHYTHMDB_PROP_ALBUM:
+			return estimate_ratio (1, stats->n_albums);
+		default:
+			return 0.1;
 		}
-		g_ptr_array_free (data->query, TRUE);
-		data->query = oldquery;
-		return;
+	case RHYTHMDB_QUERY_PROP_NOT_EQUAL:
+		return 0.9;
+	case RHYTHMDB_QUERY_PROP_LIKE:
+	case RHYTHMDB_QUERY_PROP_PREFIX:
+	case RHYTHMDB_QUERY_PROP_SUFFIX:
+		return 0.1;
+	case RHYTHMDB_QUERY_PROP_NOT_LIKE:
+		return 0.9;
+	default:
+		return 0.5;
 	}
+}
 
-	g_hash_table_foreach (artist->children, (GHFunc) conjunctive_query_songs, data);
+static gdouble
+estimate_cost (RhythmDBTree *db,
+	       RhythmDBQueryData *data)
+{
+	switch (data->type) {
+	case RHYTHMDB_QUERY_SUBQUERY:
+		return 20.0;
+	case RHYTHMDB_QUERY_PROP_LIKE:
+	case RHYTHMDB_QUERY_PROP_NOT_LIKE:
+		if (data->propid == RHYTHMDB_PROP_SEARCH_MATCH)
+			return 10.0 * MAX (1, g_strv_length (g_value_get_boxed (data->val)));
+		if (data->propid == RHYTHMDB_PROP_KEYWORD)
+			return 2.0;
+		return 4.0;
+	case RHYTHMDB_QUERY_PROP_PREFIX:
+	case RHYTHMDB_QUERY_PROP_SUFFIX:
+	case RHYTHMDB_QUERY_PROP_CURRENT_TIME_WITHIN:
+	case RHYTHMDB_QUERY_PROP_CURRENT_TIME_NOT_WITHIN:
+		return 3.0;
+	default:
+		if (rhythmdb_get_property_type (RHYTHMDB (db), data->propid) == G_TYPE_STRING)
+			return 2.0;
+		return 1.0;
+	}
+}
+
+static gint
+predicate_rank_compare (RhythmDBTreePredicateRank *a,
+			RhythmDBTreePredicateRank *b)
+{
+	if (a->rank > b->rank)
+		return -1;
+	if (a->rank < b->rank)
+		return 1;
+	return (gint) a->position - (gint) b->position;
 }
 
+/*
+ * Orders the predicates in a conjunction so those rejecting the most
+ * entries per unit of evaluation cost come first.
+ *
+ * must be called with the genres lock held
+ */
 static void
-conjunctive_query_artists (const char *name,
-			   RhythmDBTreeProperty *genre,
-			   struct RhythmDBTreeTraversalData *data)
+reorder_predicates (RhythmDBTree *db,
+		    RhythmDBTreeQueryStats *stats,
+		    GPtrArray *query)
 {
+	RhythmDBTreePredicateRank *ranks;
 	guint i;
-	int artist_query_idx = -1;
 
-	if (G_UNLIKELY (*data->cancel))
+	if (query->len < 2)
 		return;
 
-	for (i = 0; i < data->query->len; i++) {
-		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, i);
-		if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS
-		    && qdata->propid == RHYTHMDB_PROP_ARTIST) {
-			if (artist_query_idx > 0)
-				return;
-			artist_query_idx = i;
+	ranks = g_new0 (RhythmDBTreePredicateRank, query->len);
+	for (i = 0; i < query->len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
 
-		}
+		ranks[i].data = data;
+		ranks[i].rank = (1.0 - estimate_selectivity (db, stats, data)) / estimate_cost (db, data);
+		ranks[i].position = i;
 	}
 
-	if (artist_query_idx >= 0) {
-		RhythmDBTreeProperty *artist;
-		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, artist_query_idx);
-		RBRefString *artistname = rb_refstring_new (g_value_get_string (qdata->val));
-		GPtrArray *oldquery = data->query;
+	qsort (ranks, query->len, sizeof (RhythmDBTreePredicateRank),
+	       (int (*)(const void *, const void *)) predicate_rank_compare);
 
-		data->query = clone_remove_ptr_array_index (data->query, artist_query_idx);
+	for (i = 0; i < query->len; i++)
+		query->pdata[i] = ranks[i].data;
+	g_free (ranks);
+}
 
-		artist = g_hash_table_lookup (genre->children, artistname);
-		if (artist != NULL) {
-			conjunctive_query_albums (rb_refstring_get (artistname), artist, data);
+/*
+ * Estimates the number of entries visited when traversing the tree,
+ * making use of the type, genre, artist and album constraints in the query.
+ */
+static guint
+estimate_tree_traversal (RhythmDBTree *db,
+			 RhythmDBTreeQueryStats *stats,
+			 GPtrArray *query)
+{
+	gdouble estimate = stats->n_entries;
+	guint i;
+
+	for (i = 0; i < query->len; i++) {
+		RhythmDBQueryData *data = g_ptr_array_index (query, i);
+
+		if (data->type != RHYTHMDB_QUERY_PROP_EQUALS)
+			continue;
+
+		switch (data->propid) {
+		case RHYTHMDB_PROP_TYPE:
+		case RHYTHMDB_PROP_GENRE:
+		case RHYTHMDB_PROP_ARTIST:
+		case RHYTHMDB_PROP_ALBUM:
+			estimate *= estimate_selectivity (db, stats, data);
+			break;
+		default:
+			break;
 		}
-		g_ptr_array_free (data->query, TRUE);
-		data->query = oldquery;
-		return;
 	}
 
-	g_hash_table_foreach (genre->children, (GHFunc) conjunctive_query_albums, data);
+	return (guint) ceil (estimate);
 }
 
+/*
+ * Plans a conjunction.  If @build_indexes is set, any index the query
+ * could use is built first, so it can be considered; otherwise the plan
+ * only uses the indexes that already exist.
+ *
+ * must be called with the genres lock held
+ */
 static void
-conjunctive_query_genre (RhythmDBTree *db,
-			 GHashTable *genres,
-			 struct RhythmDBTreeTraversalData *data)
+plan_conjunction (RhythmDBTree *db,
+		  GPtrArray *query,
+		  gboolean build_indexes,
+		  RhythmDBTreeQueryPlan *plan)
 {
-	int genre_query_idx = -1;
-	guint i;
+	RhythmDBTreeQueryStats *stats;
+	RhythmDBTreePropertyRange range;
+	char *word = NULL;
+	guint search_count;
+	guint property_count;
 
-	if (G_UNLIKELY (*data->cancel))
-		return;
+	rb_assert_locked (&db->priv->genres_lock);
 
-	for (i = 0; i < data->query->len; i++) {
-		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, i);
-		if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS
-		    && qdata->propid == RHYTHMDB_PROP_GENRE) {
-			/* A song can't currently have two genres.  So
-			 * if we get a conjunctive query for that, we
-			 * know the result must be the empty set. */
-			if (genre_query_idx > 0)
-				return;
-			genre_query_idx = i;
+	stats = query_stats_get (db);
 
-		}
+	/* this can build indexes the query can use, so it has to come first */
+	search_count = search_index_plan (db, query, build_indexes, &word);
+	property_count = property_index_plan (db, query, build_indexes, &range);
+
+	reorder_predicates (db, stats, query);
+
+	memset (plan, 0, sizeof (RhythmDBTreeQueryPlan));
+	plan->path = QUERY_PLAN_TREE;
+	plan->estimate = estimate_tree_traversal (db, stats, query);
+
+	/* index lookups cost more per entry than walking the tree,
+	 * so only use them when they cut the work down substantially.
+	 */
+	if (search_count <= property_count && search_count < plan->estimate / 2) {
+		plan->path = QUERY_PLAN_SEARCH_INDEX;
+		plan->estimate = search_count;
+		plan->word = word;
+		word = NULL;
+	} else if (property_count < search_count && property_count < plan->estimate / 2) {
+		plan->path = QUERY_PLAN_PROPERTY_INDEX;
+		plan->estimate = property_count;
+		plan->range = range;
 	}
 
-	if (genre_query_idx >= 0) {
-		RhythmDBTreeProperty *genre;
-		RhythmDBQueryData *qdata = g_ptr_array_index (data->query, genre_query_idx);
-		RBRefString *genrename = rb_refstring_new (g_value_get_string (qdata->val));
-		GPtrArray *oldquery = data->query;
+	g_free (word);
+}
 
-		data->query = clone_remove_ptr_array_index (data->query, genre_query_idx);
+static void
+query_plan_clear (RhythmDBTreeQueryPlan *plan)
+{
+	g_free (plan->word);
+	plan->word = NULL;
+}
 
-		genre = g_hash_table_lookup (genres, genrename);
-		if (genre != NULL) {
-			conjunctive_query_artists (rb_refstring_get (genrename), genre, data);
-		}
-		g_ptr_array_free (data->query, TRUE);
-		data->query = oldquery;
-		return;
+static char *
+query_plan_to_string (RhythmDBTree *db,
+		      GPtrArray *query,
+		      RhythmDBTreeQueryPlan *plan)
+{
+	GString *buf;
+	char *filter;
+
+	buf = g_string_new ("");
+	switch (plan->path) {
+	case QUERY_PLAN_TREE:
+		g_string_append_printf (buf, "tree traversal, ~%u of %u entries",
+					plan->estimate, db->priv->n_entries);
+		break;
+	case QUERY_PLAN_SEARCH_INDEX:
+		g_string_append_printf (buf, "search index for \"%s\", ~%u of %u entries",
+					plan->word, plan->estimate, db->priv->n_entries);
+		break;
+	case QUERY_PLAN_PROPERTY_INDEX:
+		g_string_append_printf (buf, "%s index in [%g, %g), %u of %u entries",
+					(const char *) rhythmdb_nice_elt_name_from_propid (RHYTHMDB (db), plan->range.propid),
+					plan->range.min, plan->range.max,
+					plan->estimate, db->priv->n_entries);
+		break;
 	}
 
-	g_hash_table_foreach (genres, (GHFunc) conjunctive_query_artists, data);
+	filter = rhythmdb_query_to_string (RHYTHMDB (db), query);
+	g_string_append_printf (buf, "; filter %s", filter);
+	g_free (filter);
+
+	return g_string_free (buf, FALSE);
 }
 
 static void
@@ -2229,17 +4953,33 @@ conjunctive_query (RhythmDBTree *db,
 		   gpointer data,
 		   gboolean *cancel)
 {
+	RhythmDBTreeQueryPlan plan;
 	int type_query_idx = -1;
 	guint i;
 	struct RhythmDBTreeTraversalData *traversal_data;
 
+	g_mutex_lock (&db->priv->genres_lock);
+	plan_conjunction (db, query, TRUE, &plan);
+	if (rb_debug_here ()) {
+		char *str = query_plan_to_string (db, query, &plan);
+		rb_debug ("query plan: %s", str);
+		g_free (str);
+	}
+
 	for (i = 0; i < query->len; i++) {
 		RhythmDBQueryData *qdata = g_ptr_array_index (query, i);
 		if (qdata->type == RHYTHMDB_QUERY_PROP_EQUALS
 		    && qdata->propid == RHYTHMDB_PROP_TYPE) {
 			/* A song can't have two types. */
-			if (type_query_idx > 0)
-				return;
+			if (type_query_idx >= 0) {
+				RhythmDBQueryData *tdata = g_ptr_array_index (query, type_query_idx);
+				if (g_value_get_object (tdata->val) != g_value_get_object (qdata->val)) {
+					g_mutex_unlock (&db->priv->genres_lock);
+					query_plan_clear (&plan);
+					return;
+				}
+				continue;
+			}
 			type_query_idx = i;
 		}
 	}
@@ -2247,17 +4987,22 @@ conjunctive_query (RhythmDBTree *db,
 	traversal_data = g_new (struct RhythmDBTreeTraversalData, 1);
 	traversal_data->db = db;
 	traversal_data->query = query;
+	/* compiled before the tree traversal removes the predicates it handles */
+	traversal_data->compiled = rhythmdb_query_compile (RHYTHMDB (db), query);
 	traversal_data->func = func;
 	traversal_data->data = data;
 	traversal_data->cancel = cancel;
 
-	g_mutex_lock (&db->priv->genres_lock);
-	if (type_query_idx >= 0) {
+	if (plan.path == QUERY_PLAN_SEARCH_INDEX) {
+		search_index_run (db, plan.word, traversal_data);
+	} else if (plan.path == QUERY_PLAN_PROPERTY_INDEX) {
+		property_index_run (db, &plan.range, traversal_data);
+	} else if (type_query_idx >= 0) {
 		GHashTable *genres;
 		RhythmDBEntryType *etype;
 		RhythmDBQueryData *qdata = g_ptr_array_index (query, type_query_idx);
 
-		g_ptr_array_remove_index_fast (query, type_query_idx);
+		g_ptr_array_remove_index (query, type_query_idx);
 
 		etype = g_value_get_object (qdata->val);
 		genres = get_genres_hash_for_type (db, etype);
@@ -2274,9 +5019,42 @@ conjunctive_query (RhythmDBTree *db,
 	}
 	g_mutex_unlock (&db->priv->genres_lock);
 
+	query_plan_clear (&plan);
+	rhythmdb_compiled_query_free (traversal_data->compiled);
 	g_free (traversal_data);
 }
 
+static char *
+rhythmdb_tree_explain_query (RhythmDB *adb,
+			     GPtrArray *query)
+{
+	RhythmDBTree *db = RHYTHMDB_TREE (adb);
+	GList *conjunctions, *tem;
+	GString *buf;
+	int n = 0;
+
+	buf = g_string_new ("");
+	conjunctions = split_query_by_disjunctions (db, query);
+	for (tem = conjunctions; tem; tem = tem->next) {
+		RhythmDBTreeQueryPlan plan;
+		char *str;
+
+		/* explaining a query shouldn't change how it would be run */
+		g_mutex_lock (&db->priv->genres_lock);
+		plan_conjunction (db, tem->data, FALSE, &plan);
+		str = query_plan_to_string (db, tem->data, &plan);
+		g_mutex_unlock (&db->priv->genres_lock);
+
+		g_string_append_printf (buf, "conjunction %d: %s\n", ++n, str);
+		g_free (str);
+		query_plan_clear (&plan);
+		g_ptr_array_free (tem->data, TRUE);
+	}
+	g_list_free (conjunctions);
+
+	return g_string_free (buf, FALSE);
+}
+
 static GList *
 split_query_by_disjunctions (RhythmDBTree *db,
 			     GPtrArray *query)
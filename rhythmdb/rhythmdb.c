@@ -212,6 +212,30 @@ struct media_type_filter {
  */
 #define REALLY_SMALL_FILE_SIZE	(4096)
 
+/* beyond this, saving the whole database is cheaper than tracking changes */
+#define RHYTHMDB_JOURNAL_MAX_RECORDS	(50000)
+
+/* the most files a load thread sends to a metadata helper in one request */
+#define RHYTHMDB_LOAD_BATCH_SIZE	(16)
+
+/* how many file info queries the startup rescan has outstanding at once,
+ * and how many results it passes back to the main thread at a time.
+ */
+#define RHYTHMDB_STAT_THREADS		(8)
+#define RHYTHMDB_STAT_BATCH_SIZE	(64)
+
+/* the longest the main thread spends processing events before
+ * returning to the main loop (in microseconds).
+ */
+#define RHYTHMDB_EVENT_TIME_SLICE	(10 * 1000)
+
+/* threads producing stat and metadata events wait when the event queue
+ * reaches the high water mark, until the main thread has brought it
+ * back down to the low water mark.
+ */
+#define RHYTHMDB_EVENT_QUEUE_HIGH_WATER	(2000)
+#define RHYTHMDB_EVENT_QUEUE_LOW_WATER	(500)
+
 
 typedef struct
 {
@@ -266,8 +290,12 @@ static void rhythmdb_thread_create (RhythmDB *db,
 				    gpointer data);
 static void rhythmdb_read_enter (RhythmDB *db);
 static void rhythmdb_read_leave (RhythmDB *db);
+static void rhythmdb_free_stale_sort_keys (RhythmDB *db);
 static void rhythmdb_process_one_event (RhythmDBEvent *event, RhythmDB *db);
+static void rhythmdb_process_events (RhythmDBEvent *event, RhythmDB *db);
 static gpointer action_thread_main (RhythmDB *db);
+static void load_thread_main (gpointer unused, RhythmDB *db);
+static void rhythmdb_sync_metadata_workers (RhythmDB *db);
 static gpointer query_thread_main (RhythmDBQueryThreadData *data);
 static void rhythmdb_entry_set_mount_point (RhythmDB *db,
  					    RhythmDBEntry *entry,
@@ -291,6 +319,7 @@ static void rhythmdb_add_to_stat_list (RhythmDB *db,
 				       RhythmDBEntryType *ignore_type,
 				       RhythmDBEntryType *error_type);
 static void free_entry_changes (GSList *entry_changes);
+static void rhythmdb_journal_record_free (RhythmDBJournalRecord *record);
 static RhythmDBEntry *rhythmdb_add_import_error_entry (RhythmDB *db, RhythmDBEvent *event, RhythmDBEntryType *error_entry_type);
 
 static void perform_next_mount (RhythmDB *db);
@@ -307,6 +336,7 @@ enum
 {
 	ENTRY_ADDED,
 	ENTRY_CHANGED,
+	ENTRIES_CHANGED,
 	ENTRY_DELETED,
 	ENTRY_KEYWORD_ADDED,
 	ENTRY_KEYWORD_REMOVED,
@@ -423,6 +453,29 @@ rhythmdb_class_init (RhythmDBClass *klass)
 			      G_TYPE_NONE, 2,
 			      RHYTHMDB_TYPE_ENTRY, G_TYPE_PTR_ARRAY);
 
+	/**
+	 * RhythmDB::entries-changed:
+	 * @db: the #RhythmDB
+	 * @entries: (element-type RB.RhythmDBEntry): a #GPtrArray of the changed #RhythmDBEntry structures
+	 * @changes: (element-type GPtrArray): a #GPtrArray containing a #GPtrArray of
+	 *   #RhythmDBEntryChange structures for each entry in @entries
+	 * @props: (type gpointer): the set of properties changed on any of the entries
+	 *
+	 * Emitted once for each group of entries changed together, before
+	 * #RhythmDB::entry-changed is emitted for each of them.  Handlers
+	 * that can process several changes at once more cheaply than one
+	 * at a time should use this instead of #RhythmDB::entry-changed.
+	 */
+	rhythmdb_signals[ENTRIES_CHANGED] =
+		g_signal_new ("entries-changed",
+			      RHYTHMDB_TYPE,
+			      G_SIGNAL_RUN_LAST,
+			      G_STRUCT_OFFSET (RhythmDBClass, entries_changed),
+			      NULL, NULL,
+			      NULL,
+			      G_TYPE_NONE, 3,
+			      G_TYPE_PTR_ARRAY, G_TYPE_PTR_ARRAY, G_TYPE_POINTER);
+
 	/**
 	 * RhythmDB::entry-keyword-added:
 	 * @db: the #RhythmDB
@@ -618,9 +671,44 @@ rhythmdb_class_init (RhythmDBClass *klass)
 	g_type_class_add_private (klass, sizeof (RhythmDBPrivate));
 }
 
+/* called by threads before adding bulk work to the event queue,
+ * so they can't get too far ahead of the main thread.
+ */
+static void
+rhythmdb_event_queue_wait (RhythmDB *db)
+{
+	if (rb_is_main_thread ())
+		return;
+
+	if (g_async_queue_length (db->priv->event_queue) < RHYTHMDB_EVENT_QUEUE_HIGH_WATER)
+		return;
+
+	g_atomic_int_inc (&db->priv->event_queue_waits);
+	g_mutex_lock (&db->priv->event_queue_mutex);
+	while (g_async_queue_length (db->priv->event_queue) > RHYTHMDB_EVENT_QUEUE_LOW_WATER &&
+	       g_cancellable_is_cancelled (db->priv->exiting) == FALSE) {
+		/* wake up now and then in case the main thread stops processing events */
+		g_cond_wait_until (&db->priv->event_queue_cond,
+				   &db->priv->event_queue_mutex,
+				   g_get_monotonic_time () + (G_TIME_SPAN_SECOND / 10));
+	}
+	g_mutex_unlock (&db->priv->event_queue_mutex);
+}
+
 static void
 rhythmdb_push_event (RhythmDB *db, RhythmDBEvent *event)
 {
+	switch (event->type) {
+	case RHYTHMDB_EVENT_STAT:
+	case RHYTHMDB_EVENT_METADATA_LOAD:
+	case RHYTHMDB_EVENT_METADATA_CACHE:
+		rhythmdb_event_queue_wait (db);
+		break;
+	default:
+		break;
+	}
+
+	event->queued_time = g_get_monotonic_time ();
 	g_async_queue_push (db->priv->event_queue, event);
 	g_main_context_wakeup (g_main_context_default ());
 }
@@ -663,6 +751,18 @@ metadata_field_from_prop (RhythmDBPropType prop,
 	case RHYTHMDB_PROP_BPM:
 		*field = RB_METADATA_FIELD_BPM;
 		return TRUE;
+	case RHYTHMDB_PROP_TRACK_GAIN:
+		*field = RB_METADATA_FIELD_TRACK_GAIN;
+		return TRUE;
+	case RHYTHMDB_PROP_TRACK_PEAK:
+		*field = RB_METADATA_FIELD_TRACK_PEAK;
+		return TRUE;
+	case RHYTHMDB_PROP_ALBUM_GAIN:
+		*field = RB_METADATA_FIELD_ALBUM_GAIN;
+		return TRUE;
+	case RHYTHMDB_PROP_ALBUM_PEAK:
+		*field = RB_METADATA_FIELD_ALBUM_PEAK;
+		return TRUE;
 	case RHYTHMDB_PROP_MUSICBRAINZ_TRACKID:
 		*field = RB_METADATA_FIELD_MUSICBRAINZ_TRACKID;
 		return TRUE;
@@ -703,6 +803,7 @@ rhythmdb_init (RhythmDB *db)
 {
 	guint i;
 	GEnumClass *prop_class;
+	char *path;
 
 	db->priv = RHYTHMDB_GET_PRIVATE (db);
 
@@ -714,7 +815,7 @@ rhythmdb_init (RhythmDB *db)
 	db->priv->delayed_write_queue = g_async_queue_new ();
 	db->priv->event_queue_watch_id = rb_async_queue_watch_new (db->priv->event_queue,
 								   G_PRIORITY_LOW,		/* really? */
-								   (RBAsyncQueueWatchFunc) rhythmdb_process_one_event,
+								   (RBAsyncQueueWatchFunc) rhythmdb_process_events,
 								   db,
 								   NULL,
 								   NULL);
@@ -725,6 +826,13 @@ rhythmdb_init (RhythmDB *db)
 							 NULL,
 							 -1, FALSE, NULL);
 
+	/* metadata loads run in parallel, one per metadata helper process */
+	db->priv->load_queue = g_async_queue_new ();
+	db->priv->load_thread_pool = g_thread_pool_new ((GFunc)load_thread_main,
+							db,
+							1, FALSE, NULL);
+	rhythmdb_sync_metadata_workers (db);
+
 	db->priv->metadata = rb_metadata_new ();
 
 	prop_class = g_type_class_ref (RHYTHMDB_TYPE_PROP_TYPE);
@@ -763,11 +871,20 @@ rhythmdb_init (RhythmDB *db)
 	db->priv->saving = FALSE;
 	db->priv->dirty = FALSE;
 
+	db->priv->journal = g_ptr_array_new_with_free_func ((GDestroyNotify) rhythmdb_journal_record_free);
+	db->priv->journal_entries = g_hash_table_new (NULL, NULL);
+	db->priv->journal_enabled = TRUE;
+	db->priv->journal_valid = TRUE;
+
 	db->priv->empty_string = rb_refstring_new ("");
 	db->priv->octet_stream_str = rb_refstring_new ("application/octet-stream");
 
 	db->priv->next_entry_id = 1;
 
+	path = g_build_filename (rb_user_cache_dir (), "library-directories", NULL);
+	db->priv->dir_index = rhythmdb_dir_index_new (path);
+	g_free (path);
+
 	rhythmdb_init_monitoring (db);
 
 	rhythmdb_dbus_register (db);
@@ -811,43 +928,36 @@ rhythmdb_ignore_media_type (const char *media_type)
 typedef struct {
 	RhythmDB *db;
 	GList *stat_list;
+	GTimer *timer;
 } RhythmDBStatThreadData;
 
-static gpointer
-stat_thread_main (RhythmDBStatThreadData *data)
+static void
+stat_thread_query_batch (GPtrArray *batch, RhythmDBStatThreadData *data)
 {
-	GList *i;
+	RhythmDB *db = data->db;
 	GError *error = NULL;
-	RhythmDBEvent *result;
-
-	data->db->priv->stat_thread_count = g_list_length (data->stat_list);
-	data->db->priv->stat_thread_done = 0;
+	int done;
+	guint i;
 
-	rb_debug ("entering stat thread: %d to process", data->db->priv->stat_thread_count);
-	for (i = data->stat_list; i != NULL; i = i->next) {
-		RhythmDBEvent *event = (RhythmDBEvent *)i->data;
+	for (i = 0; i < batch->len; i++) {
+		RhythmDBEvent *event = g_ptr_array_index (batch, i);
 		GFile *file;
 
 		/* if we've been cancelled, just free the event.  this will
 		 * clean up the list and then we'll exit the thread.
 		 */
-		if (g_cancellable_is_cancelled (data->db->priv->exiting)) {
-			rhythmdb_event_free (data->db, event);
+		if (g_cancellable_is_cancelled (db->priv->exiting)) {
+			rhythmdb_event_free (db, event);
+			g_ptr_array_index (batch, i) = NULL;
 			continue;
 		}
 
-		if (data->db->priv->stat_thread_done > 0 &&
-		    data->db->priv->stat_thread_done % 1000 == 0) {
-			rb_debug ("%d file info queries done",
-				  data->db->priv->stat_thread_done);
-		}
-
 		file = g_file_new_for_uri (rb_refstring_get (event->uri));
 		event->real_uri = rb_refstring_ref (event->uri);		/* what? */
 		event->file_info = g_file_query_info (file,
 						      G_FILE_ATTRIBUTE_TIME_MODIFIED,	/* anything else? */
 						      G_FILE_QUERY_INFO_NONE,
-						      data->db->priv->exiting,
+						      db->priv->exiting,
 						      &error);
 		if (error != NULL) {
 			event->error = make_access_failed_error (rb_refstring_get (event->uri), error);
@@ -858,17 +968,81 @@ stat_thread_main (RhythmDBStatThreadData *data)
 				event->file_info = NULL;
 			}
 		}
-
-		g_async_queue_push (data->db->priv->event_queue, event);
 		g_object_unref (file);
-		g_atomic_int_inc (&data->db->priv->stat_thread_done);
 	}
 
+	/* hand the whole batch over at once, so the main thread
+	 * only has to wake up once for it.
+	 */
+	rhythmdb_event_queue_wait (db);
+	g_async_queue_lock (db->priv->event_queue);
+	for (i = 0; i < batch->len; i++) {
+		RhythmDBEvent *event = g_ptr_array_index (batch, i);
+		if (event != NULL) {
+			event->queued_time = g_get_monotonic_time ();
+			g_async_queue_push_unlocked (db->priv->event_queue, event);
+		}
+	}
+	g_async_queue_unlock (db->priv->event_queue);
+	g_main_context_wakeup (g_main_context_default ());
+
+	done = g_atomic_int_add (&db->priv->stat_thread_done, batch->len) + batch->len;
+	if (done / 1000 != (done - (int) batch->len) / 1000) {
+		rb_debug ("%d file info queries done, %.0f files/sec",
+			  done, done / g_timer_elapsed (data->timer, NULL));
+	}
+
+	g_ptr_array_free (batch, TRUE);
+}
+
+static gpointer
+stat_thread_main (RhythmDBStatThreadData *data)
+{
+	GThreadPool *pool;
+	GPtrArray *batch = NULL;
+	GList *i;
+	RhythmDBEvent *result;
+	double elapsed;
+
+	data->db->priv->stat_thread_count = g_list_length (data->stat_list);
+	data->db->priv->stat_thread_done = 0;
+	data->timer = g_timer_new ();
+
+	rb_debug ("entering stat thread: %d to process", data->db->priv->stat_thread_count);
+
+	/* file info queries are mostly waiting for the disk or the network,
+	 * so keep several of them going at once.
+	 */
+	pool = g_thread_pool_new ((GFunc) stat_thread_query_batch,
+				  data,
+				  RHYTHMDB_STAT_THREADS,
+				  FALSE,
+				  NULL);
+	for (i = data->stat_list; i != NULL; i = i->next) {
+		if (batch == NULL)
+			batch = g_ptr_array_sized_new (RHYTHMDB_STAT_BATCH_SIZE);
+
+		g_ptr_array_add (batch, i->data);
+		if (batch->len == RHYTHMDB_STAT_BATCH_SIZE) {
+			g_thread_pool_push (pool, batch, NULL);
+			batch = NULL;
+		}
+	}
+	if (batch != NULL)
+		g_thread_pool_push (pool, batch, NULL);
+	g_thread_pool_free (pool, FALSE, TRUE);
+
 	g_list_free (data->stat_list);
 
 	data->db->priv->stat_thread_running = FALSE;
 
-	rb_debug ("exiting stat thread");
+	elapsed = g_timer_elapsed (data->timer, NULL);
+	rb_debug ("exiting stat thread: %d file info queries in %.1f seconds (%.0f files/sec)",
+		  data->db->priv->stat_thread_done,
+		  elapsed,
+		  elapsed > 0.0 ? data->db->priv->stat_thread_done / elapsed : 0.0);
+	g_timer_destroy (data->timer);
+
 	result = g_slice_new0 (RhythmDBEvent);
 	result->db = data->db;			/* need to unref? */
 	result->type = RHYTHMDB_EVENT_THREAD_EXITED;
@@ -1041,6 +1215,11 @@ rhythmdb_shutdown (RhythmDB *db)
 
 	g_cancellable_cancel (db->priv->exiting);
 
+	/* release any threads waiting for the event queue to drain */
+	g_mutex_lock (&db->priv->event_queue_mutex);
+	g_cond_broadcast (&db->priv->event_queue_cond);
+	g_mutex_unlock (&db->priv->event_queue_mutex);
+
 	/* force the action thread to wake up and exit */
 	action = g_slice_new0 (RhythmDBAction);
 	action->type = RHYTHMDB_ACTION_QUIT;
@@ -1059,6 +1238,16 @@ rhythmdb_shutdown (RhythmDB *db)
 		rhythmdb_event_free (db, result);
 	}
 
+	/* the action thread has exited, so nothing else will be queued
+	 * for the load threads; wait for them to finish what they have.
+	 */
+	if (db->priv->load_thread_pool != NULL) {
+		g_thread_pool_free (db->priv->load_thread_pool, FALSE, TRUE);
+		db->priv->load_thread_pool = NULL;
+	}
+	while ((result = g_async_queue_try_pop (db->priv->load_queue)) != NULL)
+		rhythmdb_event_free (db, result);
+
 	/* FIXME */
 	while ((result = g_async_queue_try_pop (db->priv->event_queue)) != NULL)
 		rhythmdb_event_free (db, result);
@@ -1068,6 +1257,8 @@ rhythmdb_shutdown (RhythmDB *db)
 	while ((action = g_async_queue_try_pop (db->priv->action_queue)) != NULL) {
 		rhythmdb_action_free (db, action);
 	}
+
+	rhythmdb_dir_index_save (db->priv->dir_index);
 }
 
 static void
@@ -1141,8 +1332,12 @@ rhythmdb_finalize (GObject *object)
 	rhythmdb_finalize_monitoring (db);
 	g_strfreev (db->priv->library_locations);
 	db->priv->library_locations = NULL;
+	rhythmdb_dir_index_free (db->priv->dir_index);
 
 	g_thread_pool_free (db->priv->query_thread_pool, FALSE, TRUE);
+	if (db->priv->load_thread_pool != NULL)
+		g_thread_pool_free (db->priv->load_thread_pool, FALSE, TRUE);
+	g_async_queue_unref (db->priv->load_queue);
 	g_async_queue_unref (db->priv->action_queue);
 	g_async_queue_unref (db->priv->event_queue);
 	g_async_queue_unref (db->priv->restored_queue);
@@ -1156,6 +1351,11 @@ rhythmdb_finalize (GObject *object)
 	g_hash_table_destroy (db->priv->deleted_entries);
 	g_hash_table_destroy (db->priv->changed_entries);
 
+	g_hash_table_destroy (db->priv->journal_entries);
+	g_ptr_array_unref (db->priv->journal);
+
+	rhythmdb_free_stale_sort_keys (db);
+
 	rb_refstring_unref (db->priv->empty_string);
 	rb_refstring_unref (db->priv->octet_stream_str);
 
@@ -1266,6 +1466,8 @@ rhythmdb_read_leave (RhythmDB *db)
 		g_signal_emit (G_OBJECT (db), rhythmdb_signals[READ_ONLY],
 			       0, FALSE);
 
+		rhythmdb_free_stale_sort_keys (db);
+
 		/* move any delayed writes back to the main event queue */
 		if (g_async_queue_length (db->priv->delayed_write_queue) > 0) {
 			RhythmDBEvent *event;
@@ -1350,21 +1552,45 @@ rhythmdb_emit_entry_signals_idle (RhythmDB *db)
 
 	g_mutex_unlock (&db->priv->change_mutex);
 
-	/* emit changed entries */
+	/* emit changed entries, first all together, then individually */
 	if (changed_entries != NULL) {
+		GPtrArray *emit_entries;
+		GPtrArray *emit_changes;
+		RhythmDBPropMask props;
+		guint i;
+
+		memset (&props, 0, sizeof (props));
+		emit_entries = g_ptr_array_new_full (g_hash_table_size (changed_entries), NULL);
+		emit_changes = g_ptr_array_new_full (g_hash_table_size (changed_entries),
+						     (GDestroyNotify) g_ptr_array_unref);
+
 		g_hash_table_iter_init (&iter, changed_entries);
 		while (g_hash_table_iter_next (&iter, (gpointer *)&entry, (gpointer *)&entry_changes)) {
-			GPtrArray *emit_changes;
+			GPtrArray *changes;
 			GSList *c;
 
-			emit_changes = g_ptr_array_new_full (g_slist_length (entry_changes), NULL);
+			changes = g_ptr_array_new_full (g_slist_length (entry_changes), NULL);
 			for (c = entry_changes; c != NULL; c = c->next) {
-				g_ptr_array_add (emit_changes, c->data); 
+				RhythmDBEntryChange *change = c->data;
+
+				g_ptr_array_add (changes, change);
+				props.bits[change->prop / 32] |= (1U << (change->prop % 32));
 			}
-			g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_CHANGED], 0, entry, emit_changes);
-			g_ptr_array_unref (emit_changes);
-			g_hash_table_iter_remove (&iter);
+			g_ptr_array_add (emit_entries, entry);
+			g_ptr_array_add (emit_changes, changes);
 		}
+
+		g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRIES_CHANGED], 0, emit_entries, emit_changes, &props);
+
+		for (i = 0; i < emit_entries->len; i++) {
+			g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_CHANGED], 0,
+				       g_ptr_array_index (emit_entries, i),
+				       g_ptr_array_index (emit_changes, i));
+		}
+
+		g_ptr_array_unref (emit_entries);
+		g_ptr_array_unref (emit_changes);
+		g_hash_table_remove_all (changed_entries);
 	}
 
 	/* emit added entries */
@@ -1389,6 +1615,143 @@ rhythmdb_emit_entry_signals_idle (RhythmDB *db)
 	return FALSE;
 }
 
+static void
+rhythmdb_journal_record_free (RhythmDBJournalRecord *record)
+{
+	if (record->entry != NULL)
+		rhythmdb_entry_unref (record->entry);
+	if (record->location != NULL)
+		rb_refstring_unref (record->location);
+	g_slice_free (RhythmDBJournalRecord, record);
+}
+
+static void
+rhythmdb_journal_clear (RhythmDB *db)
+{
+	g_hash_table_remove_all (db->priv->journal_entries);
+	g_ptr_array_set_size (db->priv->journal, 0);
+}
+
+static void
+rhythmdb_journal_add_record (RhythmDB *db, RhythmDBJournalRecord *record)
+{
+	rb_assert_locked (&db->priv->journal_mutex);
+
+	g_ptr_array_add (db->priv->journal, record);
+	if (db->priv->journal->len > RHYTHMDB_JOURNAL_MAX_RECORDS) {
+		rb_debug ("too many changes since the last save; the next save will be a full save");
+		rhythmdb_journal_clear (db);
+		db->priv->journal_valid = FALSE;
+	}
+}
+
+/*
+ * Records that an entry has changed (or been added) since the database
+ * was last saved.  Only the most recent record for an entry is kept, so
+ * it's always ordered after any removals that affect its location.
+ */
+static void
+rhythmdb_journal_entry_changed (RhythmDB *db, RhythmDBEntry *entry)
+{
+	RhythmDBJournalRecord *record;
+
+	g_mutex_lock (&db->priv->journal_mutex);
+	if (db->priv->journal_enabled && db->priv->journal_valid) {
+		record = g_hash_table_lookup (db->priv->journal_entries, entry);
+		if (record != NULL) {
+			if (record == g_ptr_array_index (db->priv->journal, db->priv->journal->len - 1)) {
+				g_mutex_unlock (&db->priv->journal_mutex);
+				return;
+			}
+
+			/* leave the old record in place, but empty */
+			rhythmdb_entry_unref (record->entry);
+			record->entry = NULL;
+		}
+
+		record = g_slice_new0 (RhythmDBJournalRecord);
+		record->entry = rhythmdb_entry_ref (entry);
+		g_hash_table_insert (db->priv->journal_entries, entry, record);
+		rhythmdb_journal_add_record (db, record);
+	}
+	g_mutex_unlock (&db->priv->journal_mutex);
+}
+
+static void
+rhythmdb_journal_location_removed (RhythmDB *db, RBRefString *location)
+{
+	RhythmDBJournalRecord *record;
+
+	if (location == NULL)
+		return;
+
+	g_mutex_lock (&db->priv->journal_mutex);
+	if (db->priv->journal_enabled && db->priv->journal_valid) {
+		record = g_slice_new0 (RhythmDBJournalRecord);
+		record->location = rb_refstring_ref (location);
+		rhythmdb_journal_add_record (db, record);
+	}
+	g_mutex_unlock (&db->priv->journal_mutex);
+}
+
+static void
+rhythmdb_journal_entry_deleted (RhythmDB *db, RhythmDBEntry *entry)
+{
+	RhythmDBJournalRecord *record;
+
+	g_mutex_lock (&db->priv->journal_mutex);
+	record = g_hash_table_lookup (db->priv->journal_entries, entry);
+	if (record != NULL) {
+		rhythmdb_entry_unref (record->entry);
+		record->entry = NULL;
+		g_hash_table_remove (db->priv->journal_entries, entry);
+	}
+	g_mutex_unlock (&db->priv->journal_mutex);
+
+	rhythmdb_journal_location_removed (db, entry->location);
+}
+
+/**
+ * rhythmdb_journal_steal:
+ * @db: the #RhythmDB
+ *
+ * Takes the list of changes made since the last call, for use by
+ * backends that can save changes incrementally.  If the list is
+ * incomplete (because it grew too large or because some change
+ * could not be recorded), NULL is returned and the backend must save
+ * the whole database.
+ *
+ * Return value: (transfer full): a #GPtrArray of #RhythmDBJournalRecord, or NULL
+ */
+GPtrArray *
+rhythmdb_journal_steal (RhythmDB *db)
+{
+	GPtrArray *journal = NULL;
+
+	g_mutex_lock (&db->priv->journal_mutex);
+	if (db->priv->journal_valid) {
+		journal = db->priv->journal;
+		db->priv->journal = g_ptr_array_new_with_free_func ((GDestroyNotify) rhythmdb_journal_record_free);
+		g_hash_table_remove_all (db->priv->journal_entries);
+	} else {
+		rhythmdb_journal_clear (db);
+		db->priv->journal_valid = TRUE;
+	}
+	g_mutex_unlock (&db->priv->journal_mutex);
+
+	return journal;
+}
+
+/* discards the list of changes, forcing the next save to write the whole database */
+static void
+rhythmdb_journal_invalidate (RhythmDB *db)
+{
+	g_mutex_lock (&db->priv->journal_mutex);
+	rhythmdb_journal_clear (db);
+	db->priv->journal_valid = FALSE;
+	g_mutex_unlock (&db->priv->journal_mutex);
+}
+
 static gboolean
 process_added_entries_cb (RhythmDBEntry *entry,
 			  GThread *thread,
@@ -1454,6 +1817,7 @@ process_added_entries_cb (RhythmDBEntry *entry,
 
 	g_assert ((entry->flags & RHYTHMDB_ENTRY_INSERTED) == 0);
 	entry->flags |= RHYTHMDB_ENTRY_INSERTED;
+	rhythmdb_journal_entry_changed (db, entry);
 
 	rhythmdb_entry_ref (entry);
 	db->priv->added_entries_to_emit = g_list_prepend (db->priv->added_entries_to_emit, entry);
@@ -1548,6 +1912,7 @@ rhythmdb_commit_internal (RhythmDB *db,
 			  GThread *thread)
 {
 	g_mutex_lock (&db->priv->change_mutex);
+	g_atomic_int_inc (&db->priv->commit_generation);
 
 	if (sync_changes) {
 		g_hash_table_foreach (db->priv->changed_entries, (GHFunc) sync_entry_changed, db);
@@ -1567,6 +1932,18 @@ rhythmdb_commit_internal (RhythmDB *db,
 	g_mutex_unlock (&db->priv->change_mutex);
 }
 
+/* commits changes made while processing events.  while a batch of
+ * events is being processed, this is deferred until the end of the batch.
+ */
+static void
+rhythmdb_event_commit (RhythmDB *db)
+{
+	if (db->priv->processing_events)
+		db->priv->event_commit_pending = TRUE;
+	else
+		rhythmdb_commit_internal (db, FALSE, g_thread_self ());
+}
+
 typedef struct {
 	RhythmDB *db;
 	gboolean sync;
@@ -1611,6 +1988,17 @@ rhythmdb_commit (RhythmDB *db)
 	rhythmdb_commit_internal (db, TRUE, g_thread_self ());
 }
 
+/*
+ * Like rhythmdb_commit, but doesn't write changed metadata back to the
+ * files.  Used for properties that are derived from the files themselves,
+ * when the user hasn't asked for them to be written out.
+ */
+void
+rhythmdb_commit_without_sync (RhythmDB *db)
+{
+	rhythmdb_commit_internal (db, FALSE, g_thread_self ());
+}
+
 /**
  * rhythmdb_error_quark:
  *
@@ -1855,11 +2243,229 @@ rhythmdb_entry_ref (RhythmDBEntry *entry)
 	return entry;
 }
 
+/*
+ * Packed sort keys concatenate everything a query model sort function
+ * compares (collation keys, disc and track numbers, location) into a
+ * single byte string, so comparing two entries is a single memcmp.
+ * They're built when first needed and cached on the entry until one of
+ * the properties they include changes.
+ */
+typedef struct {
+	gsize length;
+	guchar data[1];
+} RhythmDBPackedSortKey;
+
+static void
+pack_sort_key_string (GByteArray *key, const char *str)
+{
+	/* collation keys and locations never contain nul bytes, so a nul
+	 * terminator makes a string sort before any longer string it is
+	 * a prefix of, the same as strcmp does.
+	 */
+	if (str != NULL)
+		g_byte_array_append (key, (const guint8 *) str, strlen (str));
+	g_byte_array_append (key, (const guint8 *) "", 1);
+}
+
+static void
+pack_sort_key_ulong (GByteArray *key, gulong value)
+{
+	guint64 be;
+
+	be = GUINT64_TO_BE ((guint64) value);
+	g_byte_array_append (key, (const guint8 *) &be, sizeof (be));
+}
+
+static void
+pack_sort_key_sortname (GByteArray *key,
+			RhythmDBEntry *entry,
+			RhythmDBPropType sortname_prop,
+			RhythmDBPropType prop)
+{
+	const char *str;
+
+	str = rhythmdb_entry_get_string (entry, sortname_prop);
+	if (str == NULL || str[0] == '\0')
+		str = rhythmdb_entry_get_string (entry, prop);
+	pack_sort_key_string (key, str);
+}
+
+static void
+pack_sort_key (GByteArray *key, RhythmDBEntry *entry, RhythmDBSortKeyType type)
+{
+	gulong discnum;
+
+	switch (type) {
+	case RHYTHMDB_SORT_KEY_TITLE:
+		pack_sort_key_string (key, rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_TITLE_SORT_KEY));
+		break;
+
+	case RHYTHMDB_SORT_KEY_ALBUM:
+		pack_sort_key_sortname (key, entry,
+					RHYTHMDB_PROP_ALBUM_SORTNAME_SORT_KEY,
+					RHYTHMDB_PROP_ALBUM_SORT_KEY);
+
+		/* assume disc 1 if there's no disc number */
+		discnum = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_DISC_NUMBER);
+		pack_sort_key_ulong (key, discnum ? discnum : 1);
+		pack_sort_key_ulong (key, rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_TRACK_NUMBER));
+		pack_sort_key_string (key, rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_TITLE_SORT_KEY));
+		break;
+
+	case RHYTHMDB_SORT_KEY_ARTIST:
+		pack_sort_key_sortname (key, entry,
+					RHYTHMDB_PROP_ARTIST_SORTNAME_SORT_KEY,
+					RHYTHMDB_PROP_ARTIST_SORT_KEY);
+		pack_sort_key (key, entry, RHYTHMDB_SORT_KEY_ALBUM);
+		return;
+
+	case RHYTHMDB_SORT_KEY_COMPOSER:
+		pack_sort_key_sortname (key, entry,
+					RHYTHMDB_PROP_COMPOSER_SORTNAME_SORT_KEY,
+					RHYTHMDB_PROP_COMPOSER_SORT_KEY);
+		pack_sort_key (key, entry, RHYTHMDB_SORT_KEY_ALBUM);
+		return;
+
+	case RHYTHMDB_SORT_KEY_GENRE:
+		pack_sort_key_string (key, rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_GENRE_SORT_KEY));
+		pack_sort_key (key, entry, RHYTHMDB_SORT_KEY_ARTIST);
+		return;
+
+	default:
+		g_assert_not_reached ();
+	}
+
+	/* everything ends with the location as a tie breaker */
+	pack_sort_key_string (key, rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_LOCATION));
+}
+
+static RhythmDBPackedSortKey *
+rhythmdb_entry_get_packed_sort_key (RhythmDBEntry *entry, RhythmDBSortKeyType type)
+{
+	RhythmDBPackedSortKey **keys;
+	RhythmDBPackedSortKey *key;
+
+	keys = g_atomic_pointer_get (&entry->sort_keys);
+	if (keys == NULL) {
+		RhythmDBPackedSortKey **newkeys;
+
+		newkeys = g_new0 (RhythmDBPackedSortKey *, RHYTHMDB_NUM_SORT_KEYS);
+		if (g_atomic_pointer_compare_and_exchange (&entry->sort_keys, NULL, newkeys)) {
+			keys = newkeys;
+		} else {
+			g_free (newkeys);
+			keys = g_atomic_pointer_get (&entry->sort_keys);
+		}
+	}
+
+	key = g_atomic_pointer_get (&keys[type]);
+	if (key == NULL) {
+		RhythmDBPackedSortKey *newkey;
+		GByteArray *data;
+
+		data = g_byte_array_new ();
+		pack_sort_key (data, entry, type);
+
+		newkey = g_malloc (sizeof (RhythmDBPackedSortKey) + data->len);
+		newkey->length = data->len;
+		memcpy (newkey->data, data->data, data->len);
+		g_byte_array_free (data, TRUE);
+
+		if (g_atomic_pointer_compare_and_exchange (&keys[type], NULL, newkey)) {
+			key = newkey;
+		} else {
+			g_free (newkey);
+			key = g_atomic_pointer_get (&keys[type]);
+		}
+	}
+
+	return key;
+}
+
+static void
+free_sort_keys (RhythmDBPackedSortKey **keys)
+{
+	int i;
+
+	for (i = 0; i < RHYTHMDB_NUM_SORT_KEYS; i++)
+		g_free (keys[i]);
+	g_free (keys);
+}
+
+static void
+rhythmdb_free_stale_sort_keys (RhythmDB *db)
+{
+	GSList *stale;
+
+	g_mutex_lock (&db->priv->stale_sort_keys_mutex);
+	stale = db->priv->stale_sort_keys;
+	db->priv->stale_sort_keys = NULL;
+	g_mutex_unlock (&db->priv->stale_sort_keys_mutex);
+
+	g_slist_free_full (stale, (GDestroyNotify) free_sort_keys);
+}
+
+static void
+rhythmdb_entry_clear_sort_keys (RhythmDB *db, RhythmDBEntry *entry)
+{
+	RhythmDBPackedSortKey **keys;
+
+	keys = g_atomic_pointer_get (&entry->sort_keys);
+	if (keys == NULL ||
+	    g_atomic_pointer_compare_and_exchange (&entry->sort_keys, keys, NULL) == FALSE)
+		return;
+
+	/* query threads may still be comparing using the old keys, so they
+	 * can only be freed once no queries are running.
+	 */
+	g_mutex_lock (&db->priv->stale_sort_keys_mutex);
+	db->priv->stale_sort_keys = g_slist_prepend (db->priv->stale_sort_keys, keys);
+	g_mutex_unlock (&db->priv->stale_sort_keys_mutex);
+
+	if (rhythmdb_get_readonly (db) == FALSE)
+		rhythmdb_free_stale_sort_keys (db);
+}
+
+/**
+ * rhythmdb_entry_sort_key_compare:
+ * @a: a #RhythmDBEntry
+ * @b: a #RhythmDBEntry
+ * @type: the sort order to compare in
+ *
+ * Compares two entries using their packed sort keys, building and
+ * caching the keys if required.
+ *
+ * This should only be used by RhythmDB itself and the query model.
+ *
+ * Returns: result of sort comparison between a and b.
+ */
+int
+rhythmdb_entry_sort_key_compare (RhythmDBEntry *a, RhythmDBEntry *b, RhythmDBSortKeyType type)
+{
+	RhythmDBPackedSortKey *a_key;
+	RhythmDBPackedSortKey *b_key;
+	int ret;
+
+	a_key = rhythmdb_entry_get_packed_sort_key (a, type);
+	b_key = rhythmdb_entry_get_packed_sort_key (b, type);
+
+	ret = memcmp (a_key->data, b_key->data, MIN (a_key->length, b_key->length));
+	if (ret != 0)
+		return ret;
+	else if (a_key->length != b_key->length)
+		return (a_key->length < b_key->length ? -1 : 1);
+	else
+		return 0;
+}
+
 static void
 rhythmdb_entry_finalize (RhythmDBEntry *entry)
 {
 	rhythmdb_entry_pre_destroy (entry);
 
+	if (entry->sort_keys != NULL)
+		free_sort_keys (entry->sort_keys);
+
 	rb_refstring_unref (entry->location);
 	rb_refstring_unref (entry->playback_error);
 	rb_refstring_unref (entry->title);
@@ -1925,6 +2531,21 @@ set_metadata_string_with_default (RhythmDB *db,
 	g_value_unset (&val);
 }
 
+static void
+set_metadata_double (RhythmDB *db,
+		     RBMetaData *metadata,
+		     RhythmDBEntry *entry,
+		     RBMetaDataField field,
+		     RhythmDBPropType prop)
+{
+	GValue val = {0, };
+
+	if (rb_metadata_get (metadata, field, &val)) {
+		rhythmdb_entry_set_internal (db, entry, TRUE, prop, &val);
+		g_value_unset (&val);
+	}
+}
+
 static void
 set_props_from_metadata (RhythmDB *db,
 			 RhythmDBEntry *entry,
@@ -2080,6 +2701,12 @@ set_props_from_metadata (RhythmDB *db,
 		g_value_unset (&val);
 	}
 
+	/* replaygain */
+	set_metadata_double (db, metadata, entry, RB_METADATA_FIELD_TRACK_GAIN, RHYTHMDB_PROP_TRACK_GAIN);
+	set_metadata_double (db, metadata, entry, RB_METADATA_FIELD_TRACK_PEAK, RHYTHMDB_PROP_TRACK_PEAK);
+	set_metadata_double (db, metadata, entry, RB_METADATA_FIELD_ALBUM_GAIN, RHYTHMDB_PROP_ALBUM_GAIN);
+	set_metadata_double (db, metadata, entry, RB_METADATA_FIELD_ALBUM_PEAK, RHYTHMDB_PROP_ALBUM_PEAK);
+
 	/* album */
 	set_metadata_string_with_default (db, metadata, entry,
 					  RB_METADATA_FIELD_ALBUM,
@@ -2473,7 +3100,7 @@ rhythmdb_process_metadata_cache (RhythmDB *db, RhythmDBEvent *event)
 	if (monitor && event->entry_type == RHYTHMDB_ENTRY_TYPE_SONG)
 		rhythmdb_monitor_uri_path (db, rb_refstring_get (entry->location), NULL);
 
-	rhythmdb_commit_internal (db, FALSE, g_thread_self ());
+	rhythmdb_event_commit (db);
 
 	return TRUE;
 }
@@ -2589,7 +3216,7 @@ rhythmdb_process_metadata_load (RhythmDB *db, RhythmDBEvent *event)
 	if (monitor && event->entry_type == RHYTHMDB_ENTRY_TYPE_SONG)
 		rhythmdb_monitor_uri_path (db, rb_refstring_get (entry->location), NULL);
 
-	rhythmdb_commit_internal (db, FALSE, g_thread_self ());
+	rhythmdb_event_commit (db);
 
 	return TRUE;
 }
@@ -2677,6 +3304,54 @@ rhythmdb_process_one_event (RhythmDBEvent *event, RhythmDB *db)
 		rhythmdb_event_free (db, event);
 }
 
+static void
+rhythmdb_process_events (RhythmDBEvent *event, RhythmDB *db)
+{
+	gint64 start;
+	gint64 now;
+	guint length;
+
+	/* process events until the queue is empty or we run out of time,
+	 * then commit the changes made by all of them at once.
+	 */
+	length = g_async_queue_length (db->priv->event_queue) + 1;
+	if (length > db->priv->event_queue_peak)
+		db->priv->event_queue_peak = length;
+
+	start = g_get_monotonic_time ();
+	now = start;
+	db->priv->processing_events = TRUE;
+	do {
+		if (event->queued_time != 0 && now > event->queued_time) {
+			guint64 latency = now - event->queued_time;
+
+			db->priv->event_latency_total += latency;
+			if (latency > db->priv->event_latency_max)
+				db->priv->event_latency_max = latency;
+		}
+		db->priv->events_processed++;
+
+		rhythmdb_process_one_event (event, db);
+
+		now = g_get_monotonic_time ();
+		if (now - start >= RHYTHMDB_EVENT_TIME_SLICE)
+			break;
+	} while ((event = g_async_queue_try_pop (db->priv->event_queue)) != NULL);
+	db->priv->processing_events = FALSE;
+	db->priv->event_batches++;
+
+	if (db->priv->event_commit_pending) {
+		db->priv->event_commit_pending = FALSE;
+		rhythmdb_commit_internal (db, FALSE, g_thread_self ());
+	}
+
+	if (g_async_queue_length (db->priv->event_queue) <= RHYTHMDB_EVENT_QUEUE_LOW_WATER) {
+		g_mutex_lock (&db->priv->event_queue_mutex);
+		g_cond_broadcast (&db->priv->event_queue_cond);
+		g_mutex_unlock (&db->priv->event_queue_mutex);
+	}
+}
+
 
 static void
 rhythmdb_file_info_query (RhythmDB *db, GFile *file, RhythmDBEvent *event)
@@ -2853,16 +3528,79 @@ rhythmdb_execute_load (RhythmDB *db,
 		}
 
 		if (valid == FALSE) {
-			event->metadata = rb_metadata_new ();
-			rb_metadata_load (event->metadata,
-					  rb_refstring_get (event->real_uri),
-					  &event->error);
+			/* reading the file is the slow part, so hand it
+			 * off to the load threads and move on to the next action.
+			 * the events go on a queue of their own so each load
+			 * thread can pick up several at once.
+			 */
+			g_async_queue_push (db->priv->load_queue, event);
+			g_thread_pool_push (db->priv->load_thread_pool, GINT_TO_POINTER (1), NULL);
+			return;
 		}
 	}
 
 	rhythmdb_push_event (db, event);
 }
 
+static void
+load_thread_result_cb (RBMetaData *md, guint index, GError *error, RhythmDBEvent **events)
+{
+	RhythmDBEvent *event = events[index];
+
+	event->error = error;
+	rhythmdb_push_event (event->db, event);
+}
+
+static void
+load_thread_main (gpointer unused, RhythmDB *db)
+{
+	RhythmDBEvent *events[RHYTHMDB_LOAD_BATCH_SIZE];
+	RBMetaData *metadata[RHYTHMDB_LOAD_BATCH_SIZE];
+	const char *uris[RHYTHMDB_LOAD_BATCH_SIZE];
+	RhythmDBEvent *event;
+	guint limit;
+	guint n = 0;
+
+	/* take a fair share of the queued loads, so the other load
+	 * threads still have something to do.
+	 */
+	limit = g_async_queue_length (db->priv->load_queue) / rb_metadata_get_max_services ();
+	limit = CLAMP (limit, 1, RHYTHMDB_LOAD_BATCH_SIZE);
+
+	while (n < limit && (event = g_async_queue_try_pop (db->priv->load_queue)) != NULL) {
+		if (g_cancellable_is_cancelled (db->priv->exiting)) {
+			rhythmdb_event_free (db, event);
+			continue;
+		}
+
+		event->metadata = rb_metadata_new ();
+		events[n] = event;
+		metadata[n] = event->metadata;
+		uris[n] = rb_refstring_get (event->real_uri);
+		n++;
+	}
+
+	/* another load thread may have already taken everything */
+	if (n == 0)
+		return;
+
+	rb_metadata_load_many (metadata, uris, n, (RBMetaDataLoadCallback) load_thread_result_cb, events);
+}
+
+static void
+rhythmdb_sync_metadata_workers (RhythmDB *db)
+{
+	int workers;
+
+	workers = g_settings_get_int (db->priv->settings, "metadata-workers");
+	rb_metadata_set_max_services (MAX (workers, 0));
+
+	rb_debug ("using %d metadata helper processes", rb_metadata_get_max_services ());
+	g_thread_pool_set_max_threads (db->priv->load_thread_pool,
+				       rb_metadata_get_max_services (),
+				       NULL);
+}
+
 static void
 rhythmdb_execute_enum_dir (RhythmDB *db,
 			   RhythmDBAction *action)
@@ -3241,6 +3979,12 @@ rhythmdb_load_thread_main (RhythmDB *db)
 
 	rb_profile_start ("loading db");
 	g_mutex_lock (&db->priv->saving_mutex);
+
+	/* entries read from the database don't need to be saved again */
+	g_mutex_lock (&db->priv->journal_mutex);
+	db->priv->journal_enabled = FALSE;
+	g_mutex_unlock (&db->priv->journal_mutex);
+
 	if (klass->impl_load (db, db->priv->exiting, &error) == FALSE) {
 		rb_debug ("db load failed: disabling saving");
 		db->priv->can_save = FALSE;
@@ -3249,6 +3993,10 @@ rhythmdb_load_thread_main (RhythmDB *db)
 			g_idle_add ((GSourceFunc) rhythmdb_load_error_cb, error);
 		}
 	}
+
+	g_mutex_lock (&db->priv->journal_mutex);
+	db->priv->journal_enabled = TRUE;
+	g_mutex_unlock (&db->priv->journal_mutex);
 	g_mutex_unlock (&db->priv->saving_mutex);
 
 	rb_list_deep_free (db->priv->active_mounts);
@@ -3542,6 +4290,12 @@ rhythmdb_entry_set_internal (RhythmDB *db,
 		return;
 	}
 
+	if (entry->flags & RHYTHMDB_ENTRY_INSERTED) {
+		if (propid == RHYTHMDB_PROP_LOCATION)
+			rhythmdb_journal_location_removed (db, entry->location);
+		rhythmdb_journal_entry_changed (db, entry);
+	}
+
 	handled = klass->impl_entry_set (db, entry, propid, value);
 
 	if (!handled) {
@@ -3614,16 +4368,16 @@ rhythmdb_entry_set_internal (RhythmDB *db,
 			break;
 		}
 		case RHYTHMDB_PROP_TRACK_GAIN:
-			g_warning ("RHYTHMDB_PROP_TRACK_GAIN no longer supported");
+			entry->track_gain = g_value_get_double (value);
 			break;
 		case RHYTHMDB_PROP_TRACK_PEAK:
-			g_warning ("RHYTHMDB_PROP_TRACK_PEAK no longer supported");
+			entry->track_peak = g_value_get_double (value);
 			break;
 		case RHYTHMDB_PROP_ALBUM_GAIN:
-			g_warning ("RHYTHMDB_PROP_ALBUM_GAIN no longer supported");
+			entry->album_gain = g_value_get_double (value);
 			break;
 		case RHYTHMDB_PROP_ALBUM_PEAK:
-			g_warning ("RHYTHMDB_PROP_ALBUM_PEAK no longer supported");
+			entry->album_peak = g_value_get_double (value);
 			break;
 		case RHYTHMDB_PROP_LOCATION:
 			rb_refstring_unref (entry->location);
@@ -3776,6 +4530,25 @@ rhythmdb_entry_set_internal (RhythmDB *db,
 		}
 	}
 
+	/* drop cached sort keys that include the property */
+	switch (propid) {
+	case RHYTHMDB_PROP_TITLE:
+	case RHYTHMDB_PROP_ALBUM:
+	case RHYTHMDB_PROP_ARTIST:
+	case RHYTHMDB_PROP_GENRE:
+	case RHYTHMDB_PROP_COMPOSER:
+	case RHYTHMDB_PROP_ALBUM_SORTNAME:
+	case RHYTHMDB_PROP_ARTIST_SORTNAME:
+	case RHYTHMDB_PROP_COMPOSER_SORTNAME:
+	case RHYTHMDB_PROP_TRACK_NUMBER:
+	case RHYTHMDB_PROP_DISC_NUMBER:
+	case RHYTHMDB_PROP_LOCATION:
+		rhythmdb_entry_clear_sort_keys (db, entry);
+		break;
+	default:
+		break;
+	}
+
 	if (value == &conv_value) {
 		g_value_unset (&conv_value);
 	}
@@ -3915,6 +4688,7 @@ rhythmdb_entry_delete (RhythmDB *db,
 	rhythmdb_entry_ref (entry);
 
 	klass->impl_entry_delete (db, entry);
+	rhythmdb_journal_entry_deleted (db, entry);
 
 	g_mutex_lock (&db->priv->change_mutex);
 	g_hash_table_insert (db->priv->deleted_entries, entry, g_thread_self ());
@@ -3980,6 +4754,8 @@ rhythmdb_entry_delete_by_type (RhythmDB *db,
 	RhythmDBClass *klass = RHYTHMDB_GET_CLASS (db);
 
 	if (klass->impl_entry_delete_by_type) {
+		/* too many changes to bother recording individually */
+		rhythmdb_journal_invalidate (db);
 		klass->impl_entry_delete_by_type (db, type);
 	} else {
 		g_warning ("delete_by_type not implemented");
@@ -4593,17 +5369,6 @@ rhythmdb_entry_gather_metadata (RhythmDB *db,
 			continue;
 		}
 
-		/* skip deprecated properties */
-		switch (prop) {
-		case RHYTHMDB_PROP_TRACK_GAIN:
-		case RHYTHMDB_PROP_TRACK_PEAK:
-		case RHYTHMDB_PROP_ALBUM_GAIN:
-		case RHYTHMDB_PROP_ALBUM_PEAK:
-			continue;
-		default:
-			break;
-		}
-
 		g_value_init (&value, value_type);
 		rhythmdb_entry_get (db, entry, prop, &value);
 		name = (char *)rhythmdb_nice_elt_name_from_propid (db, prop);
@@ -4873,6 +5638,9 @@ db_settings_changed_cb (GSettings *settings, const char *key, RhythmDB *db)
 {
 	if (g_strcmp0 (key, "locations") == 0 || g_strcmp0 (key, "monitor-library") == 0) {
 		rhythmdb_sync_library_location (db);
+	} else if (g_strcmp0 (key, "metadata-workers") == 0) {
+		if (db->priv->load_thread_pool != NULL)
+			rhythmdb_sync_metadata_workers (db);
 	}
 }
 
@@ -5296,17 +6064,13 @@ rhythmdb_entry_get_double (RhythmDBEntry *entry,
 
 	switch (propid) {
 	case RHYTHMDB_PROP_TRACK_GAIN:
-		g_warning ("RHYTHMDB_PROP_TRACK_GAIN no longer supported");
-		return 0.0;
+		return entry->track_gain;
 	case RHYTHMDB_PROP_TRACK_PEAK:
-		g_warning ("RHYTHMDB_PROP_TRACK_PEAK no longer supported");
-		return 1.0;
+		return entry->track_peak;
 	case RHYTHMDB_PROP_ALBUM_GAIN:
-		g_warning ("RHYTHMDB_PROP_ALBUM_GAIN no longer supported");
-		return 0.0;
+		return entry->album_gain;
 	case RHYTHMDB_PROP_ALBUM_PEAK:
-		g_warning ("RHYTHMDB_PROP_ALBUM_PEAK no longer supported");
-		return 1.0;
+		return entry->album_peak;
 	case RHYTHMDB_PROP_RATING:
 		return entry->rating;
 	case RHYTHMDB_PROP_BPM:
@@ -5338,6 +6102,8 @@ rhythmdb_entry_keyword_add	(RhythmDB *db,
 
 	ret = klass->impl_entry_keyword_add (db, entry, keyword);
 	if (!ret) {
+		if (entry->flags & RHYTHMDB_ENTRY_INSERTED)
+			rhythmdb_journal_entry_changed (db, entry);
 		g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_KEYWORD_ADDED], 0, entry, keyword);
 	}
 	return ret;
@@ -5363,6 +6129,8 @@ rhythmdb_entry_keyword_remove	(RhythmDB *db,
 
 	ret = klass->impl_entry_keyword_remove (db, entry, keyword);
 	if (ret) {
+		if (entry->flags & RHYTHMDB_ENTRY_INSERTED)
+			rhythmdb_journal_entry_changed (db, entry);
 		g_signal_emit (G_OBJECT (db), rhythmdb_signals[ENTRY_KEYWORD_REMOVED], 0, entry, keyword);
 	}
 	return ret;
@@ -5525,6 +6293,24 @@ rhythmdb_entry_change_get_type (void)
 	return type;
 }
 
+/**
+ * rhythmdb_prop_mask_contains:
+ * @mask: a #RhythmDBPropMask
+ * @propid: a property ID
+ *
+ * Checks whether a property is included in a property set,
+ * such as the one passed to #RhythmDB::entries-changed.
+ *
+ * Return value: %TRUE if @propid is in @mask
+ */
+gboolean
+rhythmdb_prop_mask_contains (const RhythmDBPropMask *mask, RhythmDBPropType propid)
+{
+	g_return_val_if_fail (propid >= 0 && propid < RHYTHMDB_NUM_PROPERTIES, FALSE);
+
+	return (mask->bits[propid / 32] & (1U << (propid % 32))) != 0;
+}
+
 /**
  * rhythmdb_entry_is_lossless:
  * @entry: a #RhythmDBEntry
@@ -114,10 +114,10 @@ typedef enum
 	RHYTHMDB_PROP_LAST_PLAYED,
 	RHYTHMDB_PROP_BITRATE,
 	RHYTHMDB_PROP_DATE,
-	RHYTHMDB_PROP_TRACK_GAIN,			/* obsolete */
-	RHYTHMDB_PROP_TRACK_PEAK,			/* obsolete */
-	RHYTHMDB_PROP_ALBUM_GAIN,			/* obsolete */
-	RHYTHMDB_PROP_ALBUM_PEAK,			/* obsolete */
+	RHYTHMDB_PROP_TRACK_GAIN,
+	RHYTHMDB_PROP_TRACK_PEAK,
+	RHYTHMDB_PROP_ALBUM_GAIN,
+	RHYTHMDB_PROP_ALBUM_PEAK,
 	RHYTHMDB_PROP_MEDIA_TYPE,
 	RHYTHMDB_PROP_TITLE_SORT_KEY,
 	RHYTHMDB_PROP_GENRE_SORT_KEY,
@@ -221,6 +221,13 @@ typedef struct {
 	GValue new;
 } RhythmDBEntryChange;
 
+/* a set of properties, as passed to RhythmDB::entries-changed */
+typedef struct {
+	guint32 bits[(RHYTHMDB_NUM_PROPERTIES + 31) / 32];
+} RhythmDBPropMask;
+
+gboolean rhythmdb_prop_mask_contains	(const RhythmDBPropMask *mask, RhythmDBPropType propid);
+
 const char *rhythmdb_entry_get_string	(RhythmDBEntry *entry, RhythmDBPropType propid);
 RBRefString *rhythmdb_entry_get_refstring (RhythmDBEntry *entry, RhythmDBPropType propid);
 char *rhythmdb_entry_dup_string	(RhythmDBEntry *entry, RhythmDBPropType propid);
@@ -304,6 +311,8 @@ struct _RhythmDBClass
 						 RhythmDBQueryResults *results,
 						 gboolean *cancel);
 
+	char *		(*impl_explain_query)	(RhythmDB *db, RhythmDBQuery *query);
+
 	void		(*impl_entry_type_registered) (RhythmDB *db,
 						       RhythmDBEntryType *type);
 
@@ -318,6 +327,9 @@ struct _RhythmDBClass
 							 RBRefString *keyword);
 	GList*		(*impl_entry_keywords_get)	(RhythmDB *db,
 							 RhythmDBEntry *entry);
+
+	/* added signals go at the end to keep the class layout */
+	void	(*entries_changed)	(RhythmDB *db, GPtrArray *entries, GPtrArray *changes, const RhythmDBPropMask *props);
 };
 
 GType		rhythmdb_get_type	(void);
@@ -367,6 +379,13 @@ RhythmDBEntry * rhythmdb_entry_lookup_from_string (RhythmDB *db, const char *str
 gboolean	rhythmdb_evaluate_query		(RhythmDB *db, RhythmDBQuery *query,
 						 RhythmDBEntry *entry);
 
+typedef struct _RhythmDBCompiledQuery RhythmDBCompiledQuery;
+
+RhythmDBCompiledQuery *rhythmdb_query_compile	(RhythmDB *db, RhythmDBQuery *query);
+gboolean	rhythmdb_compiled_query_evaluate (RhythmDBCompiledQuery *query,
+						 RhythmDBEntry *entry);
+void		rhythmdb_compiled_query_free	(RhythmDBCompiledQuery *query);
+
 void		rhythmdb_entry_foreach		(RhythmDB *db,
 						 RhythmDBEntryForeachFunc func,
 						 gpointer data);
@@ -449,6 +468,7 @@ void		rhythmdb_query_serialize		(RhythmDB *db, RhythmDBQuery *query,
 RhythmDBQuery *	rhythmdb_query_deserialize		(RhythmDB *db, xmlNodePtr parent);
 
 char *		rhythmdb_query_to_string		(RhythmDB *db, RhythmDBQuery *query);
+char *		rhythmdb_query_explain			(RhythmDB *db, RhythmDBQuery *query);
 
 gboolean	rhythmdb_query_is_time_relative		(RhythmDB *db, RhythmDBQuery *query);
 
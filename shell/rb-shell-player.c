@@ -71,6 +71,8 @@
 #include "rb-dialog.h"
 #include "rb-debug.h"
 #include "rb-player.h"
+#include "rb-player-gst-tee.h"
+#include "rb-player-gst-analysis.h"
 #include "rb-header.h"
 #include "totem-pl-parser.h"
 #include "rb-metadata.h"
@@ -217,10 +219,13 @@ struct RBShellPlayerPrivate
 	RBPlayer *active_player;
 	RBPlayer *default_player;
 	GHashTable *custom_players; /* RhythmDBEntryType* -> RBPlayer* */
+	RBPlayerGstAnalysis *analysis;
 
 	guint elapsed;
 	gint64 track_transition_time;
+	gint64 predecode_time;
 	RhythmDBEntry *playing_entry;
+	RhythmDBEntry *predecoded_for;
 	gboolean playing_entry_eos;
 
 	RBPlayOrder *play_order;
@@ -594,6 +599,22 @@ rb_shell_player_get_playing_source (RBShellPlayer *player)
 	return player->priv->current_playing_source;
 }
 
+/**
+ * rb_shell_player_get_analysis:
+ * @player: the #RBShellPlayer
+ *
+ * Retrieves the shared spectrum and level analysis of the player output,
+ * for visualisations and level meters.  This is only available if the
+ * player backend supports adding output branches.
+ *
+ * Return value: (transfer none): the #RBPlayerGstAnalysis, or %NULL
+ */
+RBPlayerGstAnalysis *
+rb_shell_player_get_analysis (RBShellPlayer *player)
+{
+	return player->priv->analysis;
+}
+
 /**
  * rb_shell_player_get_active_source:
  * @player: the #RBShellPlayer
@@ -939,6 +960,10 @@ player_settings_changed_cb (GSettings *settings, const char *key, RBShellPlayer
 		rb_debug ("track transition time changed");
 		newtime = g_settings_get_double (player->priv->settings, "transition-time");
 		player->priv->track_transition_time = newtime * RB_PLAYER_SECOND;
+	} else if (g_strcmp0 (key, "predecode-time") == 0) {
+		double newtime;
+		newtime = g_settings_get_double (player->priv->settings, "predecode-time");
+		player->priv->predecode_time = newtime * RB_PLAYER_SECOND;
 	}
 }
 
@@ -2154,6 +2179,10 @@ rb_shell_player_stop (RBShellPlayer *player)
 		rhythmdb_entry_unref (player->priv->playing_entry);
 		player->priv->playing_entry = NULL;
 	}
+	if (player->priv->predecoded_for != NULL) {
+		rhythmdb_entry_unref (player->priv->predecoded_for);
+		player->priv->predecoded_for = NULL;
+	}
 
 	rb_shell_player_set_playing_source (player, NULL);
 	rb_shell_player_sync_with_source (player);
@@ -2562,6 +2591,72 @@ error_cb (RBPlayer *mmplayer,
 	}
 }
 
+static RhythmDBEntry *
+peek_next_entry (RBShellPlayer *player)
+{
+	RhythmDBEntry *entry = NULL;
+	RBPlayOrder *porder;
+
+	/* same order of precedence as rb_shell_player_do_next_internal,
+	 * but without advancing anything.
+	 */
+	if (player->priv->queue_play_order != NULL &&
+	    player->priv->current_playing_source != RB_SOURCE (player->priv->queue_source)) {
+		entry = rb_play_order_get_next (player->priv->queue_play_order);
+		if (entry != NULL)
+			return entry;
+	}
+
+	if (player->priv->current_playing_source != NULL) {
+		g_object_get (player->priv->current_playing_source, "play-order", &porder, NULL);
+		if (porder != NULL) {
+			entry = rb_play_order_get_next (porder);
+			g_object_unref (porder);
+		}
+	}
+
+	return entry;
+}
+
+/*
+ * opens the entry that's likely to play next without playing it, so the
+ * player can start decoding it.  when the transition actually happens,
+ * opening the same location again picks up the stream that's already
+ * decoding.  if the play order picks something else by then, the player
+ * discards it.
+ */
+static void
+rb_shell_player_predecode_next (RBShellPlayer *player)
+{
+	RhythmDBEntry *entry;
+	GError *error = NULL;
+	char *location;
+
+	if (player->priv->source == NULL || rb_source_try_playlist (player->priv->source))
+		return;
+
+	entry = peek_next_entry (player);
+	if (entry == NULL)
+		return;
+
+	/* entries played by a different player can't be opened in this one */
+	if (g_hash_table_lookup (player->priv->custom_players, rhythmdb_entry_get_entry_type (entry)) != NULL) {
+		rhythmdb_entry_unref (entry);
+		return;
+	}
+
+	location = rhythmdb_entry_get_playback_uri (entry);
+	if (location != NULL) {
+		rb_debug ("opening %s in advance", location);
+		if (rb_player_open_ahead (player->priv->active_player, location, rhythmdb_entry_ref (entry), (GDestroyNotify) rhythmdb_entry_unref, &error) == FALSE) {
+			rb_debug ("unable to open %s in advance: %s", location, error->message);
+			g_clear_error (&error);
+		}
+		g_free (location);
+	}
+	rhythmdb_entry_unref (entry);
+}
+
 static void
 tick_cb (RBPlayer *mmplayer,
 	 RhythmDBEntry *entry,
@@ -2621,6 +2716,19 @@ tick_cb (RBPlayer *mmplayer,
 		}
 	}
 
+	/* open the next entry early enough for it to decode ahead */
+	if (remaining_check > 0 &&
+	    player->priv->predecode_time > 0 &&
+	    player->priv->predecoded_for != entry &&
+	    duration > 0 &&
+	    elapsed > 0 &&
+	    ((duration - elapsed) <= remaining_check + player->priv->predecode_time)) {
+		if (player->priv->predecoded_for != NULL)
+			rhythmdb_entry_unref (player->priv->predecoded_for);
+		player->priv->predecoded_for = rhythmdb_entry_ref (entry);
+		rb_shell_player_predecode_next (player);
+	}
+
 	/*
 	 * just pretending we got an EOS will do exactly what we want
 	 * here.  if we don't want to crossfade, we'll just leave the stream
@@ -3068,6 +3176,7 @@ rb_shell_player_constructed (GObject *object)
 	gtk_application_set_accels_for_action (GTK_APPLICATION (app), "app.play-shuffle(true)", play_shuffle_accels);
 
 	player_settings_changed_cb (player->priv->settings, "transition-time", player);
+	player_settings_changed_cb (player->priv->settings, "predecode-time", player);
 	player_settings_changed_cb (player->priv->settings, "play-order", player);
 
 	action = g_action_map_lookup_action (G_ACTION_MAP (app), "play-previous");
@@ -3392,6 +3501,30 @@ rb_shell_player_init (RBShellPlayer *player)
 
 	rb_shell_player_signal_connect_player(player, player->priv->default_player);
 
+	/* only the crossfading backend has a configurable mixer */
+	if (g_object_class_find_property (G_OBJECT_GET_CLASS (player->priv->default_player), "native-rate-mixing") != NULL) {
+		g_settings_bind (player->priv->settings, "native-rate-mixing",
+				 player->priv->default_player, "native-rate-mixing",
+				 G_SETTINGS_BIND_GET);
+		g_settings_bind (player->priv->settings, "resample-quality",
+				 player->priv->default_player, "resample-quality",
+				 G_SETTINGS_BIND_GET);
+		g_settings_bind (player->priv->settings, "predecode-time",
+				 player->priv->default_player, "predecode-time",
+				 G_SETTINGS_BIND_GET);
+	}
+
+	/* one analysis of the output, shared by everything that wants it */
+	if (RB_IS_PLAYER_GST_TEE (player->priv->default_player)) {
+		player->priv->analysis = rb_player_gst_analysis_new (player->priv->default_player);
+		g_settings_bind (player->priv->settings, "analysis-frame-rate",
+				 player->priv->analysis, "frame-rate",
+				 G_SETTINGS_BIND_GET);
+		g_settings_bind (player->priv->settings, "analysis-export",
+				 player->priv->analysis, "export-shm",
+				 G_SETTINGS_BIND_GET);
+	}
+
 	{
 		GVolumeMonitor *monitor = g_volume_monitor_get ();
 		g_signal_connect (G_OBJECT (monitor),
@@ -3509,6 +3642,11 @@ rb_shell_player_dispose (GObject *object)
 		g_source_remove (player->priv->do_next_idle_id);
 		player->priv->do_next_idle_id = 0;
 	}
+	if (player->priv->predecoded_for != NULL) {
+		rhythmdb_entry_unref (player->priv->predecoded_for);
+		player->priv->predecoded_for = NULL;
+	}
+	g_clear_object (&player->priv->analysis);
 	if (player->priv->error_idle_id != 0) {
 		g_source_remove (player->priv->error_idle_id);
 		player->priv->error_idle_id = 0;
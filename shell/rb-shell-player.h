@@ -31,6 +31,7 @@
 #include <sources/rb-source.h>
 #include <rhythmdb/rhythmdb.h>
 #include <backends/rb-player.h>
+#include <backends/rb-player-gst-analysis.h>
 
 #ifndef __RB_SHELL_PLAYER_H
 #define __RB_SHELL_PLAYER_H
@@ -100,6 +101,8 @@ void			rb_shell_player_set_playing_source (RBShellPlayer *player,
 RBSource *		rb_shell_player_get_playing_source (RBShellPlayer *player);
 RBSource *		rb_shell_player_get_active_source (RBShellPlayer *player);
 
+RBPlayerGstAnalysis *	rb_shell_player_get_analysis	(RBShellPlayer *player);
+
 void			rb_shell_player_jump_to_current (RBShellPlayer *player);
 
 void			rb_shell_player_play_entry	(RBShellPlayer *player,
@@ -0,0 +1,229 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+
+#include "config.h"
+
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <locale.h>
+
+#include "rb-debug.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+
+#include "rhythmdb.h"
+#include "rhythmdb-tree.h"
+#include "rhythmdb-metadata-cache.h"
+
+#define DEFAULT_ENTRIES		20000
+
+static void
+set_string (RhythmDB *db, RhythmDBEntry *entry, RhythmDBPropType prop, const char *str)
+{
+	GValue v = G_VALUE_INIT;
+
+	g_value_init (&v, G_TYPE_STRING);
+	g_value_set_string (&v, str);
+	rhythmdb_entry_set (db, entry, prop, &v);
+	g_value_unset (&v);
+}
+
+static void
+set_ulong (RhythmDB *db, RhythmDBEntry *entry, RhythmDBPropType prop, gulong value)
+{
+	GValue v = G_VALUE_INIT;
+
+	g_value_init (&v, G_TYPE_ULONG);
+	g_value_set_ulong (&v, value);
+	rhythmdb_entry_set (db, entry, prop, &v);
+	g_value_unset (&v);
+}
+
+static GPtrArray *
+create_entries (RhythmDB *db, int count)
+{
+	GPtrArray *entries;
+	int i;
+
+	entries = g_ptr_array_new_with_free_func ((GDestroyNotify) rhythmdb_entry_unref);
+	for (i = 0; i < count; i++) {
+		RhythmDBEntry *entry;
+		char *uri;
+		char *str;
+
+		uri = g_strdup_printf ("file:///music/artist %d/album %d/%02d track.mp3", i / 200, i / 12, i % 12);
+		entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, uri);
+		g_free (uri);
+
+		str = g_strdup_printf ("track %d", i);
+		set_string (db, entry, RHYTHMDB_PROP_TITLE, str);
+		g_free (str);
+		str = g_strdup_printf ("artist %d", i / 200);
+		set_string (db, entry, RHYTHMDB_PROP_ARTIST, str);
+		g_free (str);
+		str = g_strdup_printf ("album %d", i / 12);
+		set_string (db, entry, RHYTHMDB_PROP_ALBUM, str);
+		g_free (str);
+		set_string (db, entry, RHYTHMDB_PROP_GENRE, "Rock");
+		set_ulong (db, entry, RHYTHMDB_PROP_TRACK_NUMBER, (i % 12) + 1);
+		set_ulong (db, entry, RHYTHMDB_PROP_DURATION, 180 + (i % 120));
+		set_ulong (db, entry, RHYTHMDB_PROP_BITRATE, 256);
+
+		g_ptr_array_add (entries, rhythmdb_entry_ref (entry));
+	}
+	rhythmdb_commit (db);
+	return entries;
+}
+
+static void
+free_cached_metadata (GArray *metadata)
+{
+	RhythmDBEntryChange *fields = (RhythmDBEntryChange *)metadata->data;
+	int i;
+
+	for (i = 0; i < metadata->len; i++) {
+		g_value_unset (&fields[i].new);
+	}
+	g_free (fields);
+	metadata->data = NULL;
+	metadata->len = 0;
+}
+
+static gboolean
+keep_all_cb (const char *key, gpointer data)
+{
+	return TRUE;
+}
+
+static void
+report (const char *desc, GTimer *timer, int count)
+{
+	double elapsed = g_timer_elapsed (timer, NULL);
+	g_print ("%s: %.3f seconds (%.2f us per entry)\n", desc, elapsed, (elapsed * 1000000.0) / count);
+}
+
+int
+main (int argc, char **argv)
+{
+	RhythmDB *db;
+	RhythmDBMetadataCache *cache;
+	GPtrArray *entries;
+	GTimer *timer;
+	GError *error = NULL;
+	char *tmpdir;
+	char *path;
+	GStatBuf st;
+	int count;
+	int i;
+
+	count = (argc > 1) ? atoi (argv[1]) : DEFAULT_ENTRIES;
+	if (count <= 0)
+		count = DEFAULT_ENTRIES;
+
+	/* keep the cache out of the user's real cache directory */
+	tmpdir = g_dir_make_tmp ("bench-metadata-cache-XXXXXX", &error);
+	if (tmpdir == NULL) {
+		g_printerr ("unable to create temporary directory: %s\n", error->message);
+		return 1;
+	}
+	g_setenv ("XDG_CACHE_HOME", tmpdir, TRUE);
+
+	rb_threads_init ();
+	setlocale (LC_ALL, NULL);
+	gtk_init (&argc, &argv);
+	rb_debug_init (FALSE);
+	rb_refstring_system_init ();
+	rb_file_helpers_init (TRUE);
+
+	db = rhythmdb_tree_new ("test");
+	entries = create_entries (db, count);
+	timer = g_timer_new ();
+
+	cache = rhythmdb_metadata_cache_get (db, "bench");
+	g_timer_start (timer);
+	for (i = 0; i < entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (entries, i);
+		rhythmdb_metadata_cache_store (cache, rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_LOCATION), entry);
+	}
+	g_timer_stop (timer);
+	report ("store", timer, count);
+	g_object_unref (cache);
+
+	path = g_build_filename (rb_user_cache_dir (), "metadata", "bench.cache", NULL);
+	if (g_stat (path, &st) == 0)
+		g_print ("cache file size: %" G_GINT64_FORMAT " bytes\n", (gint64) st.st_size);
+
+	g_timer_start (timer);
+	cache = rhythmdb_metadata_cache_get (db, "bench");
+	g_timer_stop (timer);
+	report ("open", timer, count);
+
+	g_timer_start (timer);
+	for (i = 0; i < entries->len; i++) {
+		RhythmDBEntry *entry = g_ptr_array_index (entries, i);
+		GArray metadata = { NULL, 0 };
+
+		if (rhythmdb_metadata_cache_load (cache, rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_LOCATION), &metadata) == FALSE) {
+			g_printerr ("entry %d missing from cache\n", i);
+		}
+		free_cached_metadata (&metadata);
+	}
+	g_timer_stop (timer);
+	report ("load", timer, count);
+
+	g_timer_start (timer);
+	rhythmdb_metadata_cache_purge (cache, "file:///music/artist 1", 60, keep_all_cb, NULL, NULL);
+	g_timer_stop (timer);
+	report ("purge (prefix)", timer, count);
+
+	g_timer_start (timer);
+	rhythmdb_metadata_cache_purge (cache, "file://", 60, keep_all_cb, NULL, NULL);
+	g_timer_stop (timer);
+	report ("purge (all)", timer, count);
+
+	g_object_unref (cache);
+	g_timer_destroy (timer);
+	g_ptr_array_free (entries, TRUE);
+
+	g_unlink (path);
+	g_free (path);
+	path = g_build_filename (rb_user_cache_dir (), "metadata", NULL);
+	g_rmdir (path);
+	g_free (path);
+	g_rmdir (rb_user_cache_dir ());
+	g_rmdir (tmpdir);
+	g_free (tmpdir);
+
+	rhythmdb_shutdown (db);
+	g_object_unref (db);
+
+	rb_file_helpers_shutdown ();
+	rb_refstring_system_shutdown ();
+	return 0;
+}
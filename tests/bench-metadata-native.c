@@ -0,0 +1,109 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/* compares reading files with the native parsers against GstDiscoverer.
+ * usage: bench-metadata-native FILE...
+ */
+
+#include "config.h"
+
+#include <locale.h>
+
+#include <gio/gio.h>
+#include <gst/gst.h>
+#include <gst/pbutils/pbutils.h>
+
+#include "rb-debug.h"
+#include "rb-metadata-native.h"
+
+static void
+report (const char *desc, GTimer *timer, int count)
+{
+	double elapsed = g_timer_elapsed (timer, NULL);
+	g_print ("%s: %.3f seconds (%.2f ms per file)\n", desc, elapsed, (elapsed * 1000.0) / count);
+}
+
+int
+main (int argc, char **argv)
+{
+	GstDiscoverer *discoverer;
+	GPtrArray *uris;
+	GTimer *timer;
+	GError *error = NULL;
+	int native = 0;
+	int i;
+
+	setlocale (LC_ALL, NULL);
+	gst_init (&argc, &argv);
+	rb_debug_init (FALSE);
+
+	if (argc < 2) {
+		g_printerr ("usage: %s FILE...\n", argv[0]);
+		return 1;
+	}
+
+	uris = g_ptr_array_new_with_free_func (g_free);
+	for (i = 1; i < argc; i++) {
+		GFile *file = g_file_new_for_commandline_arg (argv[i]);
+		g_ptr_array_add (uris, g_file_get_uri (file));
+		g_object_unref (file);
+	}
+
+	timer = g_timer_new ();
+	for (i = 0; i < uris->len; i++) {
+		RBMetaDataNativeInfo info;
+
+		if (rb_metadata_native_load (g_ptr_array_index (uris, i), &info)) {
+			rb_metadata_native_info_clear (&info);
+			native++;
+		}
+	}
+	g_timer_stop (timer);
+	report ("native", timer, uris->len);
+	g_print ("read %d of %u files natively\n", native, uris->len);
+
+	discoverer = gst_discoverer_new (30 * GST_SECOND, &error);
+	if (discoverer == NULL) {
+		g_printerr ("unable to create discoverer: %s\n", error->message);
+		return 1;
+	}
+
+	g_timer_start (timer);
+	for (i = 0; i < uris->len; i++) {
+		GstDiscovererInfo *info;
+
+		info = gst_discoverer_discover_uri (discoverer, g_ptr_array_index (uris, i), NULL);
+		if (info != NULL)
+			g_object_unref (info);
+	}
+	g_timer_stop (timer);
+	report ("discoverer", timer, uris->len);
+
+	g_object_unref (discoverer);
+	g_timer_destroy (timer);
+	g_ptr_array_free (uris, TRUE);
+	return 0;
+}
@@ -0,0 +1,201 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+/*
+ * Measures how many refstrings can be interned and released per second
+ * by several threads at once, using the sharded refstring table and a
+ * copy of the single-lock table it replaced.
+ */
+
+#include "config.h"
+
+#include <glib.h>
+#include <string.h>
+
+#include "rb-refstring.h"
+
+#define N_STRINGS	10000
+#define N_OPERATIONS	1000000
+
+static char *strings[N_STRINGS];
+
+/* the old refstring table, protected by a single lock */
+
+typedef struct {
+	gint refcount;
+	char value[1];
+} SingleLockString;
+
+static GHashTable *single_lock_table;
+static GMutex single_lock_mutex;
+
+static gpointer
+single_lock_new (const char *init)
+{
+	SingleLockString *ret;
+
+	g_mutex_lock (&single_lock_mutex);
+	ret = g_hash_table_lookup (single_lock_table, init);
+	if (ret) {
+		g_atomic_int_inc (&ret->refcount);
+		g_mutex_unlock (&single_lock_mutex);
+		return ret;
+	}
+
+	ret = g_malloc (sizeof (SingleLockString) + strlen (init));
+	strcpy (ret->value, init);
+	g_atomic_int_set (&ret->refcount, 1);
+	g_hash_table_insert (single_lock_table, ret->value, ret);
+	g_mutex_unlock (&single_lock_mutex);
+	return ret;
+}
+
+static void
+single_lock_unref (gpointer p)
+{
+	SingleLockString *str = p;
+
+	/* the old code dropped the reference before taking the lock,
+	 * which could free a string another thread had just found; taking
+	 * the lock first keeps the comparison honest without crashing */
+	g_mutex_lock (&single_lock_mutex);
+	if (g_atomic_int_dec_and_test (&str->refcount))
+		g_hash_table_remove (single_lock_table, str->value);
+	g_mutex_unlock (&single_lock_mutex);
+}
+
+static gpointer
+sharded_new (const char *init)
+{
+	return rb_refstring_new (init);
+}
+
+static void
+sharded_unref (gpointer p)
+{
+	rb_refstring_unref (p);
+}
+
+typedef struct {
+	const char *name;
+	gpointer (*intern) (const char *str);
+	void (*unref) (gpointer str);
+} BenchImpl;
+
+static const BenchImpl impls[] = {
+	{ "single lock", single_lock_new, single_lock_unref },
+	{ "sharded", sharded_new, sharded_unref },
+};
+
+typedef struct {
+	const BenchImpl *impl;
+	guint seed;
+	guint operations;
+} BenchThread;
+
+static gpointer
+bench_thread (BenchThread *thread)
+{
+	GRand *rand;
+	guint i;
+
+	rand = g_rand_new_with_seed (thread->seed);
+	for (i = 0; i < thread->operations; i++) {
+		gpointer str;
+
+		str = thread->impl->intern (strings[g_rand_int_range (rand, 0, N_STRINGS)]);
+		thread->impl->unref (str);
+	}
+	g_rand_free (rand);
+
+	return NULL;
+}
+
+static void
+bench_impl (const BenchImpl *impl, int n_threads)
+{
+	BenchThread *threads;
+	GThread **handles;
+	gpointer held[N_STRINGS / 2];
+	GTimer *timer;
+	double elapsed;
+	int i;
+
+	/* keep half the strings alive, so both the lookup and the
+	 * create/free paths get exercised */
+	for (i = 0; i < N_STRINGS / 2; i++)
+		held[i] = impl->intern (strings[i * 2]);
+
+	threads = g_new0 (BenchThread, n_threads);
+	handles = g_new0 (GThread *, n_threads);
+
+	timer = g_timer_new ();
+	for (i = 0; i < n_threads; i++) {
+		threads[i].impl = impl;
+		threads[i].seed = i + 1;
+		threads[i].operations = N_OPERATIONS / n_threads;
+		handles[i] = g_thread_new ("bench-refstring", (GThreadFunc) bench_thread, &threads[i]);
+	}
+	for (i = 0; i < n_threads; i++)
+		g_thread_join (handles[i]);
+	g_timer_stop (timer);
+	elapsed = g_timer_elapsed (timer, NULL);
+
+	g_print ("%s, %d threads: %.3f seconds, %.0f operations per second\n",
+		 impl->name, n_threads, elapsed, N_OPERATIONS / elapsed);
+
+	for (i = 0; i < N_STRINGS / 2; i++)
+		impl->unref (held[i]);
+
+	g_timer_destroy (timer);
+	g_free (handles);
+	g_free (threads);
+}
+
+int
+main (int argc, char **argv)
+{
+	int n_threads;
+	guint i;
+
+	rb_refstring_system_init ();
+	single_lock_table = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+
+	for (i = 0; i < N_STRINGS; i++)
+		strings[i] = g_strdup_printf ("Artist number %d", i);
+
+	for (n_threads = 1; n_threads <= 8; n_threads *= 2) {
+		for (i = 0; i < G_N_ELEMENTS (impls); i++)
+			bench_impl (&impls[i], n_threads);
+	}
+
+	for (i = 0; i < N_STRINGS; i++)
+		g_free (strings[i]);
+	g_hash_table_destroy (single_lock_table);
+	rb_refstring_system_shutdown ();
+
+	return 0;
+}
@@ -30,6 +30,7 @@
 #include "config.h"
 
 #include <gtk/gtk.h>
+#include <glib/gstdio.h>
 #include <string.h>
 #include <locale.h>
 
@@ -83,12 +84,56 @@ static void wait_for_signal (void)
 }
 
 
+static void
+delete_all_entries (RhythmDB *db)
+{
+	rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_SONG);
+	rhythmdb_entry_delete_by_type (db, rhythmdb_entry_type_get_by_name (db, "iradio"));
+	rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_PODCAST_FEED);
+	rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_PODCAST_POST);
+	rhythmdb_commit (db);
+}
+
+static void
+bench_loads (RhythmDB *db, gboolean use_snapshot, const char *desc)
+{
+	GTimer *timer;
+	double total = 0.0;
+	int i;
+
+	g_object_set (G_OBJECT (db), "use-snapshot", use_snapshot, NULL);
+
+	timer = g_timer_new ();
+	rb_profile_start (desc);
+	for (i = 1; i <= 10; i++) {
+		set_waiting_signal (G_OBJECT (db), "load-complete");
+		g_timer_start (timer);
+		rhythmdb_load (db);
+		wait_for_signal ();
+		g_timer_stop (timer);
+		total += g_timer_elapsed (timer, NULL);
+
+		g_print ("%s: load %d took %.3f seconds (%" G_GINT64_FORMAT " entries)\n",
+			 desc, i, g_timer_elapsed (timer, NULL), rhythmdb_entry_count (db));
+		delete_all_entries (db);
+	}
+	rb_profile_end (desc);
+
+	g_print ("%s: average load time %.3f seconds\n", desc, total / 10);
+	g_timer_destroy (timer);
+}
+
 int 
 main (int argc, char **argv)
 {
 	RhythmDB *db;
 	char *name;
-	int i;
+	char *tmpdir;
+	char *contents;
+	char *copy;
+	char *snapshot;
+	gsize length;
+	GError *error = NULL;
 
 	if (argc < 2) {
 		name = g_build_filename (rb_user_data_dir(), "rhythmdb.xml", NULL);
@@ -106,30 +151,45 @@ main (int argc, char **argv)
 	rb_refstring_system_init ();
 	rb_file_helpers_init (TRUE);
 
-	db = rhythmdb_tree_new ("test");
-	g_object_set (G_OBJECT (db), "name", name, NULL);
+	/* work on a copy of the database, as we need to save it to create the snapshot */
+	tmpdir = g_dir_make_tmp ("bench-rhythmdb-load-XXXXXX", &error);
+	if (tmpdir == NULL || !g_file_get_contents (name, &contents, &length, &error)) {
+		g_printerr ("unable to copy %s: %s\n", name, error->message);
+		return 1;
+	}
+	copy = g_build_filename (tmpdir, "rhythmdb.xml", NULL);
+	if (!g_file_set_contents (copy, contents, length, &error)) {
+		g_printerr ("unable to copy %s: %s\n", name, error->message);
+		return 1;
+	}
+	g_free (contents);
 	g_free (name);
 
-	for (i = 1; i <= 10; i++) {
-		int j;
-		rb_profile_start ("10 rhythmdb loads");
-		for (j = 1; j <= 10; j++) {
-			set_waiting_signal (G_OBJECT (db), "load-complete");
-			rhythmdb_load (db);
-			wait_for_signal ();
-
-			rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_SONG);
-			rhythmdb_entry_delete_by_type (db, rhythmdb_entry_type_get_by_name (db, "iradio"));
-			rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_PODCAST_FEED);
-			rhythmdb_entry_delete_by_type (db, RHYTHMDB_ENTRY_TYPE_PODCAST_POST);
-		}
-		rb_profile_end ("10 rhythmdb loads");
-		g_print ("completed %d loads\n", i * 10);
-	}
+	db = rhythmdb_tree_new ("test");
+	g_object_set (G_OBJECT (db), "name", copy, NULL);
+
+	/* load from XML and save once to write the snapshot */
+	g_object_set (G_OBJECT (db), "use-snapshot", TRUE, NULL);
+	set_waiting_signal (G_OBJECT (db), "load-complete");
+	rhythmdb_load (db);
+	wait_for_signal ();
+	rhythmdb_save (db);
+	delete_all_entries (db);
+
+	bench_loads (db, FALSE, "XML loads");
+	bench_loads (db, TRUE, "snapshot loads");
 
 	rhythmdb_shutdown (db);
 	g_object_unref (G_OBJECT (db));
 	db = NULL;
+
+	snapshot = g_strconcat (copy, ".snapshot", NULL);
+	g_unlink (snapshot);
+	g_unlink (copy);
+	g_rmdir (tmpdir);
+	g_free (snapshot);
+	g_free (copy);
+	g_free (tmpdir);
 	
 	rb_file_helpers_shutdown ();
         rb_refstring_system_shutdown ();
@@ -28,6 +28,7 @@
 #include "config.h"
 
 #include <string.h>
+#include <glib/gstdio.h>
 
 #include <check.h>
 #include <gtk/gtk.h>
@@ -100,6 +101,93 @@ START_TEST (test_rb_check_dir_has_space)
 }
 END_TEST
 
+typedef struct {
+	GMainLoop *loop;
+	int count;
+} CountFilesData;
+
+static gboolean
+count_files_cb (GFile *file, GFileInfo *info, CountFilesData *data)
+{
+	if (g_file_info_get_file_type (info) == G_FILE_TYPE_REGULAR)
+		data->count++;
+	return TRUE;
+}
+
+static void
+count_files_done_cb (CountFilesData *data)
+{
+	g_main_loop_quit (data->loop);
+}
+
+START_TEST (test_rb_uri_handle_recursively_async)
+{
+	CountFilesData data;
+	char *root;
+	char *uri;
+	int i, j, k;
+
+	init_once (TRUE);
+
+	/* more directories than get enumerated at once, a few levels deep */
+	root = g_dir_make_tmp ("rb-test-recurse-XXXXXX", NULL);
+	fail_unless (root != NULL);
+	for (i = 0; i < 12; i++) {
+		for (j = 0; j < 3; j++) {
+			char *dir;
+
+			dir = g_strdup_printf ("%s/%d/%d", root, i, j);
+			fail_unless (g_mkdir_with_parents (dir, 0700) == 0);
+			for (k = 0; k < 5; k++) {
+				char *path;
+
+				path = g_strdup_printf ("%s/%d.mp3", dir, k);
+				fail_unless (g_file_set_contents (path, "x", 1, NULL));
+				g_free (path);
+			}
+			g_free (dir);
+		}
+	}
+
+	data.loop = g_main_loop_new (NULL, FALSE);
+	data.count = 0;
+	uri = g_filename_to_uri (root, NULL, NULL);
+	rb_uri_handle_recursively_async (uri,
+					 NULL,
+					 (RBUriRecurseFunc) count_files_cb,
+					 &data,
+					 (GDestroyNotify) count_files_done_cb);
+	g_main_loop_run (data.loop);
+	fail_unless (data.count == 12 * 3 * 5, "found %d files", data.count);
+
+	for (i = 0; i < 12; i++) {
+		char *dir;
+
+		for (j = 0; j < 3; j++) {
+			dir = g_strdup_printf ("%s/%d/%d", root, i, j);
+			for (k = 0; k < 5; k++) {
+				char *path;
+
+				path = g_strdup_printf ("%s/%d.mp3", dir, k);
+				g_unlink (path);
+				g_free (path);
+			}
+			g_rmdir (dir);
+			g_free (dir);
+		}
+
+		dir = g_strdup_printf ("%s/%d", root, i);
+		g_rmdir (dir);
+		g_free (dir);
+	}
+	fail_unless (g_rmdir (root) == 0, "test directory not removed");
+
+	g_main_loop_unref (data.loop);
+	g_free (uri);
+	g_free (root);
+}
+END_TEST
+
 static Suite *
 rb_file_helpers_suite ()
 {
@@ -110,6 +198,7 @@ rb_file_helpers_suite ()
 
 	tcase_add_test (tc_chain, test_rb_uri_get_short_path_name);
 	tcase_add_test (tc_chain, test_rb_check_dir_has_space);
+	tcase_add_test (tc_chain, test_rb_uri_handle_recursively_async);
 
 	return s;
 }
@@ -0,0 +1,567 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+
+#include "config.h"
+
+#include <check.h>
+#include <gtk/gtk.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <tdb.h>
+
+#include "test-utils.h"
+
+#include "rb-debug.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+
+#include "rhythmdb.h"
+#include "rhythmdb-tree.h"
+#include "rhythmdb-metadata-cache.h"
+
+#define CACHE_HEADER_SIZE	(12)
+
+static char *
+cache_file (const char *name, const char *suffix)
+{
+	char *filename;
+	char *path;
+
+	filename = g_strdup_printf ("%s%s", name, suffix);
+	path = g_build_filename (rb_user_cache_dir (), "metadata", filename, NULL);
+	g_free (filename);
+	return path;
+}
+
+static gint64
+cache_file_size (const char *name)
+{
+	GStatBuf st;
+	char *path;
+	gint64 size = -1;
+
+	path = cache_file (name, ".cache");
+	if (g_stat (path, &st) == 0)
+		size = st.st_size;
+	g_free (path);
+	return size;
+}
+
+static RhythmDBEntry *
+create_entry (const char *uri, const char *title)
+{
+	RhythmDBEntry *entry;
+
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_SONG, uri);
+	fail_unless (entry != NULL, "failed to create entry");
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, title);
+	rhythmdb_commit (db);
+	return entry;
+}
+
+static void
+set_entry_title (RhythmDBEntry *entry, const char *title)
+{
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, title);
+	rhythmdb_commit (db);
+}
+
+static RhythmDBMetadataCache *
+reopen_cache (RhythmDBMetadataCache *cache, const char *name)
+{
+	g_object_unref (cache);
+	return rhythmdb_metadata_cache_get (db, name);
+}
+
+static void
+free_cached_metadata (GArray *metadata)
+{
+	RhythmDBEntryChange *fields = (RhythmDBEntryChange *)metadata->data;
+	int i;
+
+	for (i = 0; i < metadata->len; i++) {
+		g_value_unset (&fields[i].new);
+	}
+	g_free (fields);
+	metadata->data = NULL;
+	metadata->len = 0;
+}
+
+static GValue *
+find_cached_value (GArray *metadata, RhythmDBPropType prop)
+{
+	RhythmDBEntryChange *fields = (RhythmDBEntryChange *)metadata->data;
+	int i;
+
+	for (i = 0; i < metadata->len; i++) {
+		if (fields[i].prop == prop)
+			return &fields[i].new;
+	}
+	return NULL;
+}
+
+/* returns the cached title for @key, or NULL if the key isn't cached */
+static char *
+load_title (RhythmDBMetadataCache *cache, const char *key)
+{
+	GArray metadata = { NULL, 0 };
+	GValue *v;
+	char *title;
+
+	if (rhythmdb_metadata_cache_load (cache, key, &metadata) == FALSE)
+		return NULL;
+
+	v = find_cached_value (&metadata, RHYTHMDB_PROP_TITLE);
+	fail_unless (v != NULL, "no title cached for %s", key);
+	title = g_value_dup_string (v);
+	free_cached_metadata (&metadata);
+	return title;
+}
+
+static void
+check_title (RhythmDBMetadataCache *cache, const char *key, const char *expected)
+{
+	char *title;
+
+	title = load_title (cache, key);
+	if (expected == NULL) {
+		fail_unless (title == NULL, "%s still cached", key);
+	} else {
+		fail_unless (title != NULL, "%s not cached", key);
+		fail_unless (strcmp (title, expected) == 0, "wrong title for %s: %s", key, title);
+	}
+	g_free (title);
+}
+
+static gboolean
+keep_none_cb (const char *key, gpointer data)
+{
+	return FALSE;
+}
+
+START_TEST (test_metadata_cache_round_trip)
+{
+	RhythmDBMetadataCache *cache;
+	RhythmDBEntry *entry;
+	GArray metadata = { NULL, 0 };
+	GValue *v;
+	GValue gain = {0,};
+
+	entry = create_entry ("file:///music/sin.mp3", "Sin");
+	set_entry_string (db, entry, RHYTHMDB_PROP_ARTIST, "Nine Inch Nails");
+	set_entry_ulong (db, entry, RHYTHMDB_PROP_TRACK_NUMBER, 9);
+	set_entry_ulong (db, entry, RHYTHMDB_PROP_DURATION, 246);
+	g_value_init (&gain, G_TYPE_DOUBLE);
+	g_value_set_double (&gain, -6.5);
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_TRACK_GAIN, &gain);
+	g_value_unset (&gain);
+	rhythmdb_commit (db);
+
+	cache = rhythmdb_metadata_cache_get (db, "round-trip");
+	fail_if (rhythmdb_metadata_cache_load (cache, "file:///music/sin.mp3", &metadata), "found metadata before storing it");
+	rhythmdb_metadata_cache_store (cache, "file:///music/sin.mp3", entry);
+
+	fail_unless (rhythmdb_metadata_cache_load (cache, "file:///music/sin.mp3", &metadata), "stored metadata not found");
+	v = find_cached_value (&metadata, RHYTHMDB_PROP_TITLE);
+	fail_unless (v != NULL && strcmp (g_value_get_string (v), "Sin") == 0, "title not cached");
+	v = find_cached_value (&metadata, RHYTHMDB_PROP_ARTIST);
+	fail_unless (v != NULL && strcmp (g_value_get_string (v), "Nine Inch Nails") == 0, "artist not cached");
+	v = find_cached_value (&metadata, RHYTHMDB_PROP_TRACK_NUMBER);
+	fail_unless (v != NULL && g_value_get_ulong (v) == 9, "track number not cached");
+	v = find_cached_value (&metadata, RHYTHMDB_PROP_DURATION);
+	fail_unless (v != NULL && g_value_get_ulong (v) == 246, "duration not cached");
+	v = find_cached_value (&metadata, RHYTHMDB_PROP_TRACK_GAIN);
+	fail_unless (v != NULL && g_value_get_double (v) == -6.5, "track gain not cached");
+
+	/* empty strings aren't worth storing */
+	fail_unless (find_cached_value (&metadata, RHYTHMDB_PROP_ALBUM) == NULL, "empty album cached");
+	free_cached_metadata (&metadata);
+
+	fail_if (rhythmdb_metadata_cache_load (cache, "file:///music/other.mp3", &metadata), "found metadata for another key");
+
+	g_object_unref (cache);
+	rhythmdb_entry_unref (entry);
+}
+END_TEST
+
+START_TEST (test_metadata_cache_reopen)
+{
+	RhythmDBMetadataCache *cache;
+	RhythmDBEntry *a;
+	RhythmDBEntry *b;
+
+	a = create_entry ("file:///music/a.mp3", "A");
+	b = create_entry ("file:///music/b.mp3", "B");
+
+	cache = rhythmdb_metadata_cache_get (db, "reopen");
+	rhythmdb_metadata_cache_store (cache, "a", a);
+	cache = reopen_cache (cache, "reopen");
+	check_title (cache, "a", "A");
+
+	/* records appended after reopening replace the ones read from the file */
+	set_entry_title (a, "A2");
+	rhythmdb_metadata_cache_store (cache, "a", a);
+	rhythmdb_metadata_cache_store (cache, "b", b);
+	cache = reopen_cache (cache, "reopen");
+	check_title (cache, "a", "A2");
+	check_title (cache, "b", "B");
+
+	g_object_unref (cache);
+	rhythmdb_entry_unref (a);
+	rhythmdb_entry_unref (b);
+}
+END_TEST
+
+START_TEST (test_metadata_cache_delete)
+{
+	RhythmDBMetadataCache *cache;
+	RhythmDBEntry *a;
+	RhythmDBEntry *b;
+
+	a = create_entry ("file:///music/a.mp3", "A");
+	b = create_entry ("file:///music/b.mp3", "B");
+
+	cache = rhythmdb_metadata_cache_get (db, "delete");
+	rhythmdb_metadata_cache_store (cache, "old:a", a);
+	rhythmdb_metadata_cache_store (cache, "new:b", b);
+
+	/* the first purge marks the record missing, the next deletes it once it's old enough */
+	rhythmdb_metadata_cache_purge (cache, "old:", 0, keep_none_cb, NULL, NULL);
+	g_usleep (G_USEC_PER_SEC + G_USEC_PER_SEC / 10);
+	cache = reopen_cache (cache, "delete");
+	rhythmdb_metadata_cache_purge (cache, "old:", 0, keep_none_cb, NULL, NULL);
+	check_title (cache, "old:a", NULL);
+	check_title (cache, "new:b", "B");
+
+	/* the tombstone keeps it deleted when the file is read again */
+	cache = reopen_cache (cache, "delete");
+	check_title (cache, "old:a", NULL);
+	check_title (cache, "new:b", "B");
+
+	/* and a later record brings it back */
+	rhythmdb_metadata_cache_store (cache, "old:a", a);
+	cache = reopen_cache (cache, "delete");
+	check_title (cache, "old:a", "A");
+
+	g_object_unref (cache);
+	rhythmdb_entry_unref (a);
+	rhythmdb_entry_unref (b);
+}
+END_TEST
+
+START_TEST (test_metadata_cache_torn_tail)
+{
+	RhythmDBMetadataCache *cache;
+	RhythmDBEntry *a;
+	RhythmDBEntry *b;
+	RhythmDBEntry *c;
+	gint64 size;
+	char *path;
+	int fd;
+
+	a = create_entry ("file:///music/a.mp3", "A");
+	b = create_entry ("file:///music/b.mp3", "B");
+	c = create_entry ("file:///music/c.mp3", "C");
+
+	cache = rhythmdb_metadata_cache_get (db, "torn");
+	rhythmdb_metadata_cache_store (cache, "a", a);
+	rhythmdb_metadata_cache_store (cache, "b", b);
+	g_object_unref (cache);
+
+	/* cut the last record short, as if the write was interrupted */
+	path = cache_file ("torn", ".cache");
+	size = cache_file_size ("torn");
+	fail_unless (truncate (path, size - 3) == 0, "failed to truncate cache file");
+
+	cache = rhythmdb_metadata_cache_get (db, "torn");
+	check_title (cache, "a", "A");
+	check_title (cache, "b", NULL);
+
+	/* new records follow on from the last complete one */
+	rhythmdb_metadata_cache_store (cache, "c", c);
+	cache = reopen_cache (cache, "torn");
+	check_title (cache, "a", "A");
+	check_title (cache, "c", "C");
+	g_object_unref (cache);
+
+	/* a record claiming to run past the end of the file is ignored too */
+	size = cache_file_size ("torn");
+	fd = open (path, O_WRONLY | O_APPEND);
+	fail_unless (fd != -1, "failed to open cache file");
+	fail_unless (write (fd, "\xff\xff\xff\x7f" "d", 5) == 5, "failed to damage cache file");
+	close (fd);
+
+	cache = rhythmdb_metadata_cache_get (db, "torn");
+	check_title (cache, "a", "A");
+	check_title (cache, "c", "C");
+	fail_unless (cache_file_size ("torn") == size, "damaged tail not removed");
+
+	g_object_unref (cache);
+	g_free (path);
+	rhythmdb_entry_unref (a);
+	rhythmdb_entry_unref (b);
+	rhythmdb_entry_unref (c);
+}
+END_TEST
+
+START_TEST (test_metadata_cache_compaction)
+{
+	RhythmDBMetadataCache *cache;
+	RhythmDBEntry *a;
+	RhythmDBEntry *b;
+	char *title;
+	gint64 size;
+	int i;
+
+	a = create_entry ("file:///music/a.mp3", "A");
+	b = create_entry ("file:///music/b.mp3", "B");
+
+	/* replace one record until most of the file is dead */
+	cache = rhythmdb_metadata_cache_get (db, "compact");
+	rhythmdb_metadata_cache_store (cache, "b", b);
+	title = g_malloc (1001);
+	for (i = 0; i < 1200; i++) {
+		memset (title, 'a' + (i % 26), 1000);
+		title[1000] = '\0';
+		set_entry_title (a, title);
+		rhythmdb_metadata_cache_store (cache, "a", a);
+	}
+	g_object_unref (cache);
+	size = cache_file_size ("compact");
+	fail_unless (size > 1024 * 1024, "cache file too small to compact: %" G_GINT64_FORMAT, size);
+
+	cache = rhythmdb_metadata_cache_get (db, "compact");
+	size = cache_file_size ("compact");
+	fail_unless (size < 4096, "cache file not compacted: %" G_GINT64_FORMAT, size);
+	check_title (cache, "a", title);
+	check_title (cache, "b", "B");
+
+	/* the compacted file can be appended to and read back */
+	rhythmdb_metadata_cache_store (cache, "b", a);
+	cache = reopen_cache (cache, "compact");
+	check_title (cache, "b", title);
+
+	g_object_unref (cache);
+	g_free (title);
+	rhythmdb_entry_unref (a);
+	rhythmdb_entry_unref (b);
+}
+END_TEST
+
+/* writes a cache file in the format used by earlier versions */
+static void
+write_tdb_cache (const char *name)
+{
+	struct tdb_context *tdb;
+	GVariant *value;
+	TDB_DATA key;
+	TDB_DATA data;
+	char *cachedir;
+	char *path;
+
+	path = cache_file (name, ".tdb");
+	cachedir = g_path_get_dirname (path);
+	g_mkdir_with_parents (cachedir, 0700);
+	g_free (cachedir);
+	tdb = tdb_open (path, 0, TDB_INCOMPATIBLE_HASH, O_RDWR | O_CREAT, 0600);
+	fail_unless (tdb != NULL, "failed to create tdb file");
+
+	value = g_variant_new_parsed ("(@t 0, @a{sv} {'title': <'Sin'>, 'track-number': <@t 9>, 'duration': <@t 246>})");
+	g_variant_ref_sink (value);
+	key.dptr = (unsigned char *) "file:///music/sin.mp3";
+	key.dsize = strlen ((const char *) key.dptr);
+	data.dptr = (unsigned char *) g_variant_get_data (value);
+	data.dsize = g_variant_get_size (value);
+	fail_unless (tdb_store (tdb, key, data, TDB_INSERT) == 0, "failed to store tdb record");
+
+	g_variant_unref (value);
+	tdb_close (tdb);
+	g_free (path);
+}
+
+static void
+check_migrated (RhythmDBMetadataCache *cache)
+{
+	GArray metadata = { NULL, 0 };
+	GValue *v;
+
+	fail_unless (rhythmdb_metadata_cache_load (cache, "file:///music/sin.mp3", &metadata), "record not migrated");
+	v = find_cached_value (&metadata, RHYTHMDB_PROP_TITLE);
+	fail_unless (v != NULL && strcmp (g_value_get_string (v), "Sin") == 0, "title not migrated");
+	v = find_cached_value (&metadata, RHYTHMDB_PROP_TRACK_NUMBER);
+	fail_unless (v != NULL && g_value_get_ulong (v) == 9, "track number not migrated");
+	v = find_cached_value (&metadata, RHYTHMDB_PROP_DURATION);
+	fail_unless (v != NULL && g_value_get_ulong (v) == 246, "duration not migrated");
+	free_cached_metadata (&metadata);
+}
+
+START_TEST (test_metadata_cache_migrate_tdb)
+{
+	RhythmDBMetadataCache *cache;
+	char *tdbpath;
+
+	write_tdb_cache ("migrate");
+	tdbpath = cache_file ("migrate", ".tdb");
+
+	cache = rhythmdb_metadata_cache_get (db, "migrate");
+	check_migrated (cache);
+	fail_if (g_file_test (tdbpath, G_FILE_TEST_EXISTS), "tdb file not removed after migration");
+	fail_unless (cache_file_size ("migrate") > CACHE_HEADER_SIZE, "migrated records not written");
+
+	/* the migrated records are read back from the new file */
+	cache = reopen_cache (cache, "migrate");
+	check_migrated (cache);
+
+	g_object_unref (cache);
+	g_free (tdbpath);
+}
+END_TEST
+
+START_TEST (test_metadata_cache_migrate_tdb_failure)
+{
+	RhythmDBMetadataCache *cache;
+	char *cachedir;
+	char *tdbpath;
+	gboolean writable;
+
+	write_tdb_cache ("migrate-fail");
+	tdbpath = cache_file ("migrate-fail", ".tdb");
+
+	/* the new file can't be written, so the old one has to stay */
+	cachedir = g_build_filename (rb_user_cache_dir (), "metadata", NULL);
+	g_chmod (cachedir, 0500);
+	writable = (access (cachedir, W_OK) == 0);
+	if (writable == FALSE) {
+		cache = rhythmdb_metadata_cache_get (db, "migrate-fail");
+		fail_unless (g_file_test (tdbpath, G_FILE_TEST_EXISTS), "tdb file removed without a new cache file");
+		g_object_unref (cache);
+	} else {
+		/* permissions don't apply to us */
+		rb_debug ("unable to make the cache directory read-only");
+	}
+	g_chmod (cachedir, 0700);
+
+	/* and it's migrated the next time */
+	cache = rhythmdb_metadata_cache_get (db, "migrate-fail");
+	check_migrated (cache);
+	fail_if (g_file_test (tdbpath, G_FILE_TEST_EXISTS), "tdb file not removed after migration");
+
+	g_object_unref (cache);
+	g_free (cachedir);
+	g_free (tdbpath);
+}
+END_TEST
+
+static void
+remove_dir (const char *path)
+{
+	GDir *dir;
+	const char *name;
+
+	dir = g_dir_open (path, 0, NULL);
+	if (dir != NULL) {
+		while ((name = g_dir_read_name (dir)) != NULL) {
+			char *child = g_build_filename (path, name, NULL);
+			if (g_file_test (child, G_FILE_TEST_IS_DIR))
+				remove_dir (child);
+			else
+				g_unlink (child);
+			g_free (child);
+		}
+		g_dir_close (dir);
+	}
+	g_rmdir (path);
+}
+
+static Suite *
+metadata_cache_suite (void)
+{
+	Suite *s = suite_create ("rhythmdb-metadata-cache");
+	TCase *tc_chain = tcase_create ("rhythmdb-metadata-cache-core");
+
+	suite_add_tcase (s, tc_chain);
+	tcase_add_checked_fixture (tc_chain, test_rhythmdb_setup, test_rhythmdb_shutdown);
+	tcase_set_timeout (tc_chain, 30);
+
+	tcase_add_test (tc_chain, test_metadata_cache_round_trip);
+	tcase_add_test (tc_chain, test_metadata_cache_reopen);
+	tcase_add_test (tc_chain, test_metadata_cache_delete);
+	tcase_add_test (tc_chain, test_metadata_cache_torn_tail);
+	tcase_add_test (tc_chain, test_metadata_cache_compaction);
+	tcase_add_test (tc_chain, test_metadata_cache_migrate_tdb);
+	tcase_add_test (tc_chain, test_metadata_cache_migrate_tdb_failure);
+
+	return s;
+}
+
+int
+main (int argc, char **argv)
+{
+	int ret;
+	SRunner *sr;
+	Suite *s;
+	char *tmpdir;
+
+	/* keep the cache files out of the user's real cache directory */
+	tmpdir = g_dir_make_tmp ("test-metadata-cache-XXXXXX", NULL);
+	if (tmpdir == NULL) {
+		g_print ("unable to create temporary directory\n");
+		return 1;
+	}
+	g_setenv ("XDG_CACHE_HOME", tmpdir, TRUE);
+
+	g_log_set_always_fatal (G_LOG_LEVEL_WARNING | G_LOG_LEVEL_CRITICAL);
+
+	rb_profile_start ("rhythmdb metadata cache test suite");
+
+	rb_threads_init ();
+	rb_debug_init (TRUE);
+	rb_refstring_system_init ();
+	rb_file_helpers_init (TRUE);
+
+	/* setup tests */
+	s = metadata_cache_suite ();
+	sr = srunner_create (s);
+
+	init_setup (sr, argc, argv);
+	init_once (FALSE);
+
+	srunner_run_all (sr, CK_NORMAL);
+	ret = srunner_ntests_failed (sr);
+	srunner_free (sr);
+
+	rb_file_helpers_shutdown ();
+	rb_refstring_system_shutdown ();
+
+	rb_profile_end ("rhythmdb metadata cache test suite");
+
+	remove_dir (tmpdir);
+	g_free (tmpdir);
+	return ret;
+}
@@ -0,0 +1,665 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include <check.h>
+#include <gst/gst.h>
+#include <locale.h>
+#include "rb-metadata.h"
+#include "rb-metadata-native.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+#include "rb-debug.h"
+
+/* these build just enough of each format for the native parser to read,
+ * so none of them can actually be played.
+ */
+
+static char *test_dir = NULL;
+
+static void
+append_be16 (GByteArray *data, guint16 value)
+{
+	guint8 buf[2];
+
+	GST_WRITE_UINT16_BE (buf, value);
+	g_byte_array_append (data, buf, sizeof (buf));
+}
+
+static void
+append_be32 (GByteArray *data, guint32 value)
+{
+	guint8 buf[4];
+
+	GST_WRITE_UINT32_BE (buf, value);
+	g_byte_array_append (data, buf, sizeof (buf));
+}
+
+static void
+append_le16 (GByteArray *data, guint16 value)
+{
+	guint8 buf[2];
+
+	GST_WRITE_UINT16_LE (buf, value);
+	g_byte_array_append (data, buf, sizeof (buf));
+}
+
+static void
+append_le32 (GByteArray *data, guint32 value)
+{
+	guint8 buf[4];
+
+	GST_WRITE_UINT32_LE (buf, value);
+	g_byte_array_append (data, buf, sizeof (buf));
+}
+
+static void
+append_le64 (GByteArray *data, guint64 value)
+{
+	guint8 buf[8];
+
+	GST_WRITE_UINT64_LE (buf, value);
+	g_byte_array_append (data, buf, sizeof (buf));
+}
+
+static void
+append_string (GByteArray *data, const char *str)
+{
+	g_byte_array_append (data, (const guint8 *) str, strlen (str));
+}
+
+static void
+append_zeroes (GByteArray *data, guint count)
+{
+	guint len = data->len;
+
+	g_byte_array_set_size (data, len + count);
+	memset (data->data + len, 0, count);
+}
+
+static char *
+write_test_file (const char *name, const guint8 *data, gsize length)
+{
+	char *path;
+	char *uri;
+
+	path = g_build_filename (test_dir, name, NULL);
+	fail_unless (g_file_set_contents (path, (const char *) data, length, NULL), "unable to write test file");
+	uri = g_filename_to_uri (path, NULL, NULL);
+	g_free (path);
+	return uri;
+}
+
+static void
+remove_test_file (char *uri)
+{
+	char *path;
+
+	path = g_filename_from_uri (uri, NULL, NULL);
+	g_unlink (path);
+	g_free (path);
+	g_free (uri);
+}
+
+static gboolean
+load_native (const guint8 *data, gsize length, RBMetaDataNativeInfo *info)
+{
+	gboolean ret;
+	char *uri;
+
+	uri = write_test_file ("native", data, length);
+	ret = rb_metadata_native_load (uri, info);
+	remove_test_file (uri);
+	return ret;
+}
+
+static void
+check_title (RBMetaDataNativeInfo *info, const char *expected)
+{
+	char *title = NULL;
+
+	fail_unless (gst_tag_list_get_string (info->tags, GST_TAG_TITLE, &title), "no title");
+	fail_unless (strcmp (title, expected) == 0, "wrong title %s", title);
+	g_free (title);
+}
+
+static void
+check_fails (GByteArray *data, gsize length, const char *what)
+{
+	RBMetaDataNativeInfo info;
+
+	fail_if (load_native (data->data, length, &info), "read %s file", what);
+	fail_unless (info.media_type == NULL && info.tags == NULL, "%s file left stream info behind", what);
+}
+
+/* MP3 */
+
+#define MP3_FRAME_SIZE		(417)		/* 128kbps, 44.1kHz, no padding */
+
+static GByteArray *
+build_mp3 (gboolean id3v2, gboolean xing, gboolean id3v1)
+{
+	GByteArray *data;
+	guint i;
+
+	data = g_byte_array_new ();
+	if (id3v2) {
+		/* ID3v2.3 tag with a title frame and some padding */
+		append_string (data, "ID3");
+		append_be16 (data, 0x0300);
+		append_zeroes (data, 1);
+		append_be32 (data, 25);
+		append_string (data, "TIT2");
+		append_be32 (data, 5);
+		append_be16 (data, 0);
+		append_zeroes (data, 1);
+		append_string (data, "Test");
+		append_zeroes (data, 10);
+	}
+
+	for (i = 0; i < 3; i++) {
+		guint start = data->len;
+
+		/* mpeg 1 layer 3, stereo */
+		append_be32 (data, 0xfffb9000);
+		append_zeroes (data, 32);
+		if (i == 0 && xing) {
+			append_string (data, "Xing");
+			append_be32 (data, 0x3);
+			append_be32 (data, 100);
+			append_be32 (data, 100 * MP3_FRAME_SIZE);
+		}
+		append_zeroes (data, MP3_FRAME_SIZE - (data->len - start));
+	}
+
+	if (id3v1) {
+		guint start = data->len;
+
+		append_string (data, "TAG");
+		append_string (data, "Old Title");
+		append_zeroes (data, 128 - (data->len - start));
+	}
+	return data;
+}
+
+START_TEST (test_rb_metadata_native_mp3)
+{
+	RBMetaDataNativeInfo info;
+	GByteArray *data;
+
+	/* VBR header gives the duration */
+	data = build_mp3 (TRUE, TRUE, FALSE);
+	fail_unless (load_native (data->data, data->len, &info), "unable to read mp3 file");
+	fail_unless (strcmp (info.media_type, "audio/mpeg") == 0, "wrong media type %s", info.media_type);
+	fail_unless (info.duration == gst_util_uint64_scale (100 * 1152, GST_SECOND, 44100), "wrong duration");
+	check_title (&info, "Test");
+	rb_metadata_native_info_clear (&info);
+
+	/* truncated within the tag, and right after the first frame */
+	check_fails (data, 20, "truncated");
+	check_fails (data, 35 + MP3_FRAME_SIZE, "truncated");
+
+	/* no tag at the start, so the frames must start right away */
+	data->data[0] = 'X';
+	check_fails (data, data->len, "mislabelled");
+
+	/* corrupt tag size */
+	data->data[0] = 'I';
+	data->data[8] = 0x80;
+	check_fails (data, data->len, "corrupt");
+	g_byte_array_unref (data);
+
+	/* CBR, ID3v1 tag at the end */
+	data = build_mp3 (FALSE, FALSE, TRUE);
+	fail_unless (load_native (data->data, data->len, &info), "unable to read mp3 file");
+	fail_unless (info.duration == gst_util_uint64_scale (3 * MP3_FRAME_SIZE, 8 * GST_SECOND, 128000), "wrong duration");
+	fail_unless (info.bitrate == 128000, "wrong bitrate %u", info.bitrate);
+	check_title (&info, "Old Title");
+	rb_metadata_native_info_clear (&info);
+
+	/* corrupt second frame header */
+	data->data[MP3_FRAME_SIZE + 2] = 0xf0;
+	check_fails (data, data->len, "corrupt");
+	g_byte_array_unref (data);
+}
+END_TEST
+
+/* FLAC */
+
+static void
+append_vorbis_comments (GByteArray *data, const char *title)
+{
+	char *comment;
+
+	comment = g_strdup_printf ("TITLE=%s", title);
+	append_le32 (data, 4);
+	append_string (data, "test");
+	append_le32 (data, 1);
+	append_le32 (data, strlen (comment));
+	append_string (data, comment);
+	g_free (comment);
+}
+
+static GByteArray *
+build_flac (void)
+{
+	GByteArray *data;
+	guint start;
+
+	data = g_byte_array_new ();
+	append_string (data, "fLaC");
+
+	/* STREAMINFO: 44.1kHz, stereo, 16 bits, 441000 samples */
+	append_be32 (data, 34);
+	append_be16 (data, 4096);
+	append_be16 (data, 4096);
+	append_zeroes (data, 6);
+	append_be32 (data, (44100 << 12) | (1 << 9) | (15 << 4));
+	append_be32 (data, 441000);
+	append_zeroes (data, 16);
+
+	/* last block: VORBIS_COMMENT */
+	start = data->len;
+	append_be32 (data, 0);
+	append_vorbis_comments (data, "Flac Title");
+	GST_WRITE_UINT32_BE (data->data + start, 0x84000000 | (data->len - start - 4));
+
+	append_zeroes (data, 1000);
+	return data;
+}
+
+START_TEST (test_rb_metadata_native_flac)
+{
+	RBMetaDataNativeInfo info;
+	GByteArray *data;
+
+	data = build_flac ();
+	fail_unless (load_native (data->data, data->len, &info), "unable to read flac file");
+	fail_unless (strcmp (info.media_type, "audio/x-flac") == 0, "wrong media type %s", info.media_type);
+	fail_unless (info.duration == 10 * GST_SECOND, "wrong duration");
+	fail_unless (info.bitrate == 800, "wrong bitrate %u", info.bitrate);
+	check_title (&info, "Flac Title");
+	rb_metadata_native_info_clear (&info);
+
+	/* truncated in STREAMINFO and in the comments */
+	check_fails (data, 20, "truncated");
+	check_fails (data, 50, "truncated");
+
+	/* invalid block type */
+	data->data[4] = 0x7f;
+	check_fails (data, data->len, "corrupt");
+
+	/* no STREAMINFO */
+	data->data[4] = 0x01;
+	check_fails (data, data->len, "corrupt");
+	g_byte_array_unref (data);
+}
+END_TEST
+
+/* Ogg */
+
+static void
+append_ogg_page (GByteArray *data, guint32 serial, guint32 sequence, guint64 granule, const guint8 *packet, guint length)
+{
+	g_assert (length < 255);
+
+	append_string (data, "OggS");
+	append_zeroes (data, 1);
+	g_byte_array_append (data, (const guint8 *) (sequence == 0 ? "\002" : "\000"), 1);
+	append_le64 (data, granule);
+	append_le32 (data, serial);
+	append_le32 (data, sequence);
+	append_le32 (data, 0);		/* not checked */
+	g_byte_array_append (data, (const guint8 *) "\001", 1);
+	append_zeroes (data, 1);
+	data->data[data->len - 1] = length;
+	g_byte_array_append (data, packet, length);
+}
+
+static GByteArray *
+build_ogg (guint32 second_serial)
+{
+	GByteArray *data;
+	GByteArray *packet;
+
+	data = g_byte_array_new ();
+
+	/* vorbis identification header: stereo, 44.1kHz, 128kbps nominal */
+	packet = g_byte_array_new ();
+	append_string (packet, "\001vorbis");
+	append_le32 (packet, 0);
+	g_byte_array_append (packet, (const guint8 *) "\002", 1);
+	append_le32 (packet, 44100);
+	append_le32 (packet, 0);
+	append_le32 (packet, 128000);
+	append_le32 (packet, 0);
+	g_byte_array_append (packet, (const guint8 *) "\270\001", 2);
+	append_ogg_page (data, 1234, 0, 0, packet->data, packet->len);
+	g_byte_array_unref (packet);
+
+	packet = g_byte_array_new ();
+	append_string (packet, "\003vorbis");
+	append_vorbis_comments (packet, "Ogg Title");
+	g_byte_array_append (packet, (const guint8 *) "\001", 1);
+	append_ogg_page (data, second_serial, 1, 0, packet->data, packet->len);
+	g_byte_array_unref (packet);
+
+	/* last page, 10 seconds in */
+	packet = g_byte_array_new ();
+	append_zeroes (packet, 100);
+	append_ogg_page (data, 1234, 2, 441000, packet->data, packet->len);
+	g_byte_array_unref (packet);
+
+	return data;
+}
+
+START_TEST (test_rb_metadata_native_ogg)
+{
+	RBMetaDataNativeInfo info;
+	GByteArray *data;
+
+	data = build_ogg (1234);
+	fail_unless (load_native (data->data, data->len, &info), "unable to read ogg file");
+	fail_unless (strcmp (info.media_type, "audio/x-vorbis") == 0, "wrong media type %s", info.media_type);
+	fail_unless (info.duration == 10 * GST_SECOND, "wrong duration");
+	fail_unless (info.bitrate == 128000, "wrong bitrate %u", info.bitrate);
+	check_title (&info, "Ogg Title");
+	rb_metadata_native_info_clear (&info);
+
+	/* truncated in the first page and in the comments */
+	check_fails (data, 20, "truncated");
+	check_fails (data, 80, "truncated");
+
+	/* corrupt page header */
+	data->data[4] = 1;
+	check_fails (data, data->len, "corrupt");
+	g_byte_array_unref (data);
+
+	/* more than one logical stream */
+	data = build_ogg (5678);
+	check_fails (data, data->len, "multiplexed");
+	g_byte_array_unref (data);
+}
+END_TEST
+
+/* MP4 */
+
+static guint
+mp4_box_start (GByteArray *data, const char *type)
+{
+	guint start = data->len;
+
+	append_be32 (data, 0);
+	append_string (data, type);
+	return start;
+}
+
+static void
+mp4_box_end (GByteArray *data, guint start)
+{
+	GST_WRITE_UINT32_BE (data->data + start, data->len - start);
+}
+
+static void
+mp4_hdlr (GByteArray *data, const char *handler)
+{
+	guint box;
+
+	box = mp4_box_start (data, "hdlr");
+	append_zeroes (data, 8);
+	append_string (data, handler);
+	append_zeroes (data, 13);
+	mp4_box_end (data, box);
+}
+
+static void
+mp4_item (GByteArray *data, const char *type, guint32 data_class, const guint8 *value, gsize length)
+{
+	guint item;
+	guint box;
+
+	item = mp4_box_start (data, type);
+	box = mp4_box_start (data, "data");
+	append_be32 (data, data_class);
+	append_be32 (data, 0);
+	g_byte_array_append (data, value, length);
+	mp4_box_end (data, box);
+	mp4_box_end (data, item);
+}
+
+static GByteArray *
+build_mp4 (const char *handler)
+{
+	GByteArray *data;
+	guint moov, trak, mdia, minf, stbl, udta, meta, ilst;
+	guint box;
+
+	data = g_byte_array_new ();
+	box = mp4_box_start (data, "ftyp");
+	append_string (data, "M4A ");
+	append_be32 (data, 0);
+	mp4_box_end (data, box);
+
+	moov = mp4_box_start (data, "moov");
+
+	box = mp4_box_start (data, "mvhd");
+	append_zeroes (data, 12);
+	append_be32 (data, 1000);
+	append_be32 (data, 10000);
+	append_zeroes (data, 80);
+	mp4_box_end (data, box);
+
+	trak = mp4_box_start (data, "trak");
+	mdia = mp4_box_start (data, "mdia");
+	box = mp4_box_start (data, "mdhd");
+	append_zeroes (data, 12);
+	append_be32 (data, 44100);
+	append_be32 (data, 441000);
+	append_zeroes (data, 4);
+	mp4_box_end (data, box);
+	mp4_hdlr (data, handler);
+	minf = mp4_box_start (data, "minf");
+	stbl = mp4_box_start (data, "stbl");
+	box = mp4_box_start (data, "stsd");
+	append_be32 (data, 0);
+	append_be32 (data, 1);
+	append_be32 (data, 16);
+	append_string (data, "mp4a");
+	append_zeroes (data, 8);
+	mp4_box_end (data, box);
+	mp4_box_end (data, stbl);
+	mp4_box_end (data, minf);
+	mp4_box_end (data, mdia);
+	mp4_box_end (data, trak);
+
+	udta = mp4_box_start (data, "udta");
+	meta = mp4_box_start (data, "meta");
+	append_be32 (data, 0);
+	mp4_hdlr (data, "mdir");
+	ilst = mp4_box_start (data, "ilst");
+	mp4_item (data, "\251nam", 1, (const guint8 *) "MP4 Title", 9);
+	mp4_item (data, "trkn", 0, (const guint8 *) "\000\000\000\003\000\014\000\000", 8);
+	mp4_box_end (data, ilst);
+	mp4_box_end (data, meta);
+	mp4_box_end (data, udta);
+
+	mp4_box_end (data, moov);
+
+	box = mp4_box_start (data, "mdat");
+	append_zeroes (data, 1000);
+	mp4_box_end (data, box);
+	return data;
+}
+
+START_TEST (test_rb_metadata_native_mp4)
+{
+	RBMetaDataNativeInfo info;
+	GByteArray *data;
+	guint track;
+
+	data = build_mp4 ("soun");
+	fail_unless (load_native (data->data, data->len, &info), "unable to read mp4 file");
+	fail_unless (strcmp (info.media_type, "audio/x-aac") == 0, "wrong media type %s", info.media_type);
+	fail_unless (info.duration == 10 * GST_SECOND, "wrong duration");
+	fail_unless (info.bitrate == 800, "wrong bitrate %u", info.bitrate);
+	check_title (&info, "MP4 Title");
+	fail_unless (gst_tag_list_get_uint (info.tags, GST_TAG_TRACK_NUMBER, &track) && track == 3, "wrong track number");
+	fail_unless (gst_tag_list_get_uint (info.tags, GST_TAG_TRACK_COUNT, &track) && track == 12, "wrong track count");
+	rb_metadata_native_info_clear (&info);
+
+	/* truncated in ftyp, and in the middle of moov */
+	check_fails (data, 12, "truncated");
+	check_fails (data, 100, "truncated");
+
+	/* box smaller than its own header */
+	GST_WRITE_UINT32_BE (data->data + 16, 4);
+	check_fails (data, data->len, "corrupt");
+	g_byte_array_unref (data);
+
+	/* video goes to the demuxers */
+	data = build_mp4 ("vide");
+	check_fails (data, data->len, "video");
+	g_byte_array_unref (data);
+}
+END_TEST
+
+/* files the native parser doesn't handle still get read through GStreamer */
+
+START_TEST (test_rb_metadata_native_fallback)
+{
+	RBMetaData *md;
+	GByteArray *data;
+	GError *error = NULL;
+	GValue v = G_VALUE_INIT;
+	RBMetaDataNativeInfo info;
+	GstElementFactory *factory;
+	char *uri;
+
+	factory = gst_element_factory_find ("wavparse");
+	if (factory == NULL) {
+		rb_debug ("no wav parser available, not testing fallback");
+		return;
+	}
+	gst_object_unref (factory);
+
+	/* two seconds of 16 bit mono silence at 8kHz */
+	data = g_byte_array_new ();
+	append_string (data, "RIFF");
+	append_le32 (data, 36 + 32000);
+	append_string (data, "WAVEfmt ");
+	append_le32 (data, 16);
+	append_le16 (data, 1);
+	append_le16 (data, 1);
+	append_le32 (data, 8000);
+	append_le32 (data, 16000);
+	append_le16 (data, 2);
+	append_le16 (data, 16);
+	append_string (data, "data");
+	append_le32 (data, 32000);
+	append_zeroes (data, 32000);
+
+	uri = write_test_file ("fallback.wav", data->data, data->len);
+	g_byte_array_unref (data);
+	fail_if (rb_metadata_native_load (uri, &info), "native parser read a wav file");
+
+	md = rb_metadata_new ();
+	rb_metadata_load (md, uri, &error);
+	fail_unless (error == NULL, "unable to read wav file: %s", error ? error->message : "");
+	fail_unless (rb_metadata_has_audio (md), "no audio found in wav file");
+	fail_unless (rb_metadata_get (md, RB_METADATA_FIELD_DURATION, &v), "no duration for wav file");
+	fail_unless (g_value_get_ulong (&v) == 2, "wrong duration %lu", g_value_get_ulong (&v));
+	g_value_unset (&v);
+	g_object_unref (md);
+
+	remove_test_file (uri);
+}
+END_TEST
+
+static void
+setup (void)
+{
+	test_dir = g_dir_make_tmp ("rb-test-metadata-native-XXXXXX", NULL);
+	fail_unless (test_dir != NULL, "unable to create test directory");
+}
+
+static void
+teardown (void)
+{
+	g_rmdir (test_dir);
+	g_free (test_dir);
+	test_dir = NULL;
+}
+
+static Suite *
+rb_metadata_native_suite ()
+{
+	Suite *s = suite_create ("rb-metadata-native");
+	TCase *tc_chain = tcase_create ("rb-metadata-native-core");
+
+	suite_add_tcase (s, tc_chain);
+	tcase_add_checked_fixture (tc_chain, setup, teardown);
+
+	tcase_add_test (tc_chain, test_rb_metadata_native_mp3);
+	tcase_add_test (tc_chain, test_rb_metadata_native_flac);
+	tcase_add_test (tc_chain, test_rb_metadata_native_ogg);
+	tcase_add_test (tc_chain, test_rb_metadata_native_mp4);
+	tcase_add_test (tc_chain, test_rb_metadata_native_fallback);
+
+	return s;
+}
+
+int
+main (int argc, char **argv)
+{
+	int ret;
+	SRunner *sr;
+	Suite *s;
+
+	rb_profile_start ("rb-metadata-native test suite");
+	rb_threads_init ();
+	setlocale (LC_ALL, NULL);
+	rb_debug_init (TRUE);
+	rb_file_helpers_init (TRUE);
+	gst_init (&argc, &argv);
+
+	/* setup tests */
+	s = rb_metadata_native_suite ();
+	sr = srunner_create (s);
+
+	srunner_run_all (sr, CK_NORMAL);
+	ret = srunner_ntests_failed (sr);
+	srunner_free (sr);
+
+	rb_file_helpers_shutdown ();
+
+	rb_profile_end ("rb-metadata-native test suite");
+	return ret;
+}
@@ -0,0 +1,388 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+
+#include <check.h>
+#include <gtk/gtk.h>
+#include <locale.h>
+#include "test-utils.h"
+#include "rb-metadata.h"
+#include "rb-metadata-dbus.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+#include "rb-debug.h"
+
+static gpointer
+acquire_thread (gint *acquired)
+{
+	RBMetaDataService *service;
+
+	service = _rb_metadata_acquire_service ();
+	g_atomic_int_set (acquired, 1);
+	return service;
+}
+
+START_TEST (test_rb_metadata_service_pool)
+{
+	RBMetaDataService *a;
+	RBMetaDataService *b;
+	RBMetaDataService *c;
+	GThread *thread;
+	gint acquired = 0;
+
+	rb_metadata_set_max_services (0);
+	fail_unless (rb_metadata_get_max_services () == g_get_num_processors (), "default pool size isn't one per processor");
+
+	/* each request gets its own helper until the pool is full */
+	rb_metadata_set_max_services (2);
+	a = _rb_metadata_acquire_service ();
+	b = _rb_metadata_acquire_service ();
+	fail_unless (a != NULL && b != NULL && a != b, "requests share a helper");
+	fail_unless (_rb_metadata_get_n_services () == 2, "wrong number of helpers");
+
+	/* then requests wait for a helper to become idle, and reuse it */
+	thread = g_thread_new ("acquire", (GThreadFunc) acquire_thread, &acquired);
+	g_usleep (G_USEC_PER_SEC / 10);
+	fail_if (g_atomic_int_get (&acquired), "request didn't wait for an idle helper");
+
+	_rb_metadata_release_service (a);
+	c = g_thread_join (thread);
+	fail_unless (c == a, "waiting request didn't reuse the idle helper");
+	fail_unless (_rb_metadata_get_n_services () == 2, "pool grew past its limit");
+
+	/* lowering the limit removes helpers as they become idle */
+	rb_metadata_set_max_services (1);
+	_rb_metadata_release_service (b);
+	fail_unless (_rb_metadata_get_n_services () == 1, "pool didn't shrink");
+	_rb_metadata_release_service (c);
+	fail_unless (_rb_metadata_get_n_services () == 1, "pool shrank past its limit");
+
+	/* raising it lets requests start new helpers again */
+	rb_metadata_set_max_services (2);
+	a = _rb_metadata_acquire_service ();
+	b = _rb_metadata_acquire_service ();
+	fail_unless (a != b, "requests share a helper");
+	fail_unless (_rb_metadata_get_n_services () == 2, "pool didn't grow");
+	_rb_metadata_release_service (a);
+	_rb_metadata_release_service (b);
+}
+END_TEST
+
+/* a metadata helper running on a thread of its own, which makes up results
+ * and drops the connection when asked to read a file named 'crash'.
+ */
+typedef struct {
+	GMainContext *context;
+	GMainLoop *loop;
+	GDBusServer *server;
+	GDBusNodeInfo *node_info;
+	GList *connections;
+	char *address;
+	GMutex lock;
+	GCond cond;
+	gint loads;
+} FakeMetadataService;
+
+static GVariant *
+fake_load_result (const char *uri)
+{
+	const char *none[] = { NULL };
+	GVariantBuilder *metadata;
+	GVariant *result;
+	char *title;
+
+	title = g_path_get_basename (uri);
+	metadata = g_variant_builder_new (G_VARIANT_TYPE ("a{iv}"));
+	g_variant_builder_add (metadata, "{iv}", RB_METADATA_FIELD_TITLE, g_variant_new_string (title));
+	result = g_variant_new ("(^as^asbbbsbisa{iv})",
+				none, none,
+				TRUE, FALSE, FALSE,
+				"audio/x-rb-test",
+				TRUE, 0, "",
+				metadata);
+	g_variant_builder_unref (metadata);
+	g_free (title);
+	return result;
+}
+
+static void
+fake_method_call (GDBusConnection *connection,
+		  const char *sender,
+		  const char *object_path,
+		  const char *interface_name,
+		  const char *method_name,
+		  GVariant *parameters,
+		  GDBusMethodInvocation *invocation,
+		  FakeMetadataService *fake)
+{
+	if (g_strcmp0 (method_name, "ping") == 0) {
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(b)", TRUE));
+	} else if (g_strcmp0 (method_name, "getSaveableTypes") == 0) {
+		const char *none[] = { NULL };
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(^as)", none));
+	} else if (g_strcmp0 (method_name, "load") == 0) {
+		const char *uri;
+
+		g_atomic_int_inc (&fake->loads);
+		g_variant_get (parameters, "(&s)", &uri);
+		g_dbus_method_invocation_return_value (invocation, fake_load_result (uri));
+	} else if (g_strcmp0 (method_name, "loadMany") == 0) {
+		const char **uris;
+		guint32 i;
+
+		g_variant_get (parameters, "(^a&s)", &uris);
+		for (i = 0; uris[i] != NULL; i++) {
+			if (strstr (uris[i], "crash") != NULL) {
+				g_dbus_connection_flush_sync (connection, NULL, NULL);
+				g_dbus_connection_close_sync (connection, NULL, NULL);
+				g_object_unref (invocation);
+				g_free (uris);
+				return;
+			}
+
+			g_dbus_connection_emit_signal (connection,
+						       NULL,
+						       RB_METADATA_DBUS_OBJECT_PATH,
+						       RB_METADATA_DBUS_INTERFACE,
+						       "loaded",
+						       g_variant_new ("(u@(asasbbbsbisa{iv}))", i, fake_load_result (uris[i])),
+						       NULL);
+		}
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(u)", i));
+		g_free (uris);
+	} else {
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
+						       "unknown method %s", method_name);
+	}
+}
+
+static const GDBusInterfaceVTable fake_vtable = {
+	(GDBusInterfaceMethodCallFunc) fake_method_call,
+	NULL,
+	NULL
+};
+
+static gboolean
+fake_new_connection_cb (GDBusServer *server, GDBusConnection *connection, FakeMetadataService *fake)
+{
+	g_dbus_connection_register_object (connection,
+					   RB_METADATA_DBUS_OBJECT_PATH,
+					   g_dbus_node_info_lookup_interface (fake->node_info, RB_METADATA_DBUS_INTERFACE),
+					   &fake_vtable,
+					   fake,
+					   NULL,
+					   NULL);
+	fake->connections = g_list_prepend (fake->connections, g_object_ref (connection));
+	return TRUE;
+}
+
+static gpointer
+fake_service_thread (FakeMetadataService *fake)
+{
+	char *guid;
+
+	g_main_context_push_thread_default (fake->context);
+
+	guid = g_dbus_generate_guid ();
+	fake->server = g_dbus_server_new_sync ("unix:tmpdir=/tmp", G_DBUS_SERVER_FLAGS_NONE, guid, NULL, NULL, NULL);
+	g_free (guid);
+	if (fake->server != NULL) {
+		g_signal_connect (fake->server, "new-connection", G_CALLBACK (fake_new_connection_cb), fake);
+		g_dbus_server_start (fake->server);
+	}
+
+	g_mutex_lock (&fake->lock);
+	fake->address = g_strdup (fake->server ? g_dbus_server_get_client_address (fake->server) : "");
+	g_cond_signal (&fake->cond);
+	g_mutex_unlock (&fake->lock);
+
+	if (fake->server != NULL) {
+		g_main_loop_run (fake->loop);
+		g_dbus_server_stop (fake->server);
+		g_object_unref (fake->server);
+	}
+	g_list_free_full (fake->connections, g_object_unref);
+
+	g_main_context_pop_thread_default (fake->context);
+	return NULL;
+}
+
+typedef struct {
+	guint calls[4];
+	char *media_type[4];
+	char *title[4];
+} LoadManyResults;
+
+static void
+load_many_cb (RBMetaData *md, guint index, GError *error, LoadManyResults *results)
+{
+	GValue v = {0,};
+
+	results->calls[index]++;
+	results->media_type[index] = g_strdup (rb_metadata_get_media_type (md));
+	if (rb_metadata_get (md, RB_METADATA_FIELD_TITLE, &v)) {
+		results->title[index] = g_value_dup_string (&v);
+		g_value_unset (&v);
+	}
+	g_clear_error (&error);
+}
+
+static void
+load_many (const char **uris, guint n_uris, LoadManyResults *results)
+{
+	RBMetaData *md[4];
+	guint i;
+
+	memset (results, 0, sizeof (*results));
+	for (i = 0; i < n_uris; i++)
+		md[i] = rb_metadata_new ();
+
+	rb_metadata_load_many (md, uris, n_uris, (RBMetaDataLoadCallback) load_many_cb, results);
+
+	for (i = 0; i < n_uris; i++) {
+		fail_unless (results->calls[i] == 1, "callback called %u times for %s", results->calls[i], uris[i]);
+		g_object_unref (md[i]);
+	}
+}
+
+static void
+free_load_many_results (LoadManyResults *results)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS (results->calls); i++) {
+		g_free (results->media_type[i]);
+		g_free (results->title[i]);
+	}
+}
+
+START_TEST (test_rb_metadata_load_many)
+{
+	const char *uris[] = { "file:///test/a.ogg", "file:///test/b.ogg", "file:///test/crash.ogg", "file:///test/d.ogg" };
+	FakeMetadataService fake = {0,};
+	LoadManyResults results;
+	GThread *thread;
+	guint i;
+
+	fake.context = g_main_context_new ();
+	fake.loop = g_main_loop_new (fake.context, FALSE);
+	fake.node_info = g_dbus_node_info_new_for_xml (rb_metadata_iface_xml, NULL);
+	g_mutex_init (&fake.lock);
+	g_cond_init (&fake.cond);
+
+	thread = g_thread_new ("fake-metadata", (GThreadFunc) fake_service_thread, &fake);
+	g_mutex_lock (&fake.lock);
+	while (fake.address == NULL)
+		g_cond_wait (&fake.cond, &fake.lock);
+	g_mutex_unlock (&fake.lock);
+	fail_unless (fake.address[0] != '\0', "unable to start fake metadata service");
+
+	/* the client only looks at this the first time it needs a helper */
+	g_setenv ("RB_DBUS_METADATA_ADDRESS", fake.address, TRUE);
+	rb_metadata_set_max_services (1);
+
+	/* everything comes back from the one request */
+	load_many (uris, 2, &results);
+	for (i = 0; i < 2; i++) {
+		char *title = g_path_get_basename (uris[i]);
+
+		fail_unless (g_strcmp0 (results.media_type[i], "audio/x-rb-test") == 0, "wrong media type for %s", uris[i]);
+		fail_unless (g_strcmp0 (results.title[i], title) == 0, "wrong title for %s", uris[i]);
+		g_free (title);
+	}
+	fail_unless (g_atomic_int_get (&fake.loads) == 0, "batch fell back to single loads");
+	free_load_many_results (&results);
+
+	/* when the helper goes away, the results it did send are kept and
+	 * the rest are loaded one at a time, by a new helper
+	 */
+	load_many (uris, 4, &results);
+	fail_unless (g_strcmp0 (results.media_type[0], "audio/x-rb-test") == 0, "lost result sent before the crash");
+	fail_unless (g_strcmp0 (results.media_type[1], "audio/x-rb-test") == 0, "lost result sent before the crash");
+	fail_if (g_strcmp0 (results.media_type[2], "audio/x-rb-test") == 0, "result for the crashing file from the batch");
+	fail_if (g_strcmp0 (results.media_type[3], "audio/x-rb-test") == 0, "result after the crash from the batch");
+	free_load_many_results (&results);
+
+	g_unsetenv ("RB_DBUS_METADATA_ADDRESS");
+	g_main_loop_quit (fake.loop);
+	g_thread_join (thread);
+	g_main_loop_unref (fake.loop);
+	g_main_context_unref (fake.context);
+	g_dbus_node_info_unref (fake.node_info);
+	g_mutex_clear (&fake.lock);
+	g_cond_clear (&fake.cond);
+	g_free (fake.address);
+}
+END_TEST
+
+static Suite *
+rb_metadata_suite ()
+{
+	Suite *s = suite_create ("rb-metadata");
+	TCase *tc_chain = tcase_create ("rb-metadata-core");
+
+	suite_add_tcase (s, tc_chain);
+
+	tcase_set_timeout (tc_chain, 30);
+	tcase_add_test (tc_chain, test_rb_metadata_service_pool);
+	tcase_add_test (tc_chain, test_rb_metadata_load_many);
+
+	return s;
+}
+
+int
+main (int argc, char **argv)
+{
+	int ret;
+	SRunner *sr;
+	Suite *s;
+
+	rb_profile_start ("rb-metadata test suite");
+	rb_threads_init ();
+	setlocale (LC_ALL, NULL);
+	rb_debug_init (TRUE);
+	rb_file_helpers_init (TRUE);
+
+	/* setup tests */
+	s = rb_metadata_suite ();
+	sr = srunner_create (s);
+
+	init_setup (sr, argc, argv);
+	init_once (FALSE);
+
+	srunner_run_all (sr, CK_NORMAL);
+	ret = srunner_ntests_failed (sr);
+	srunner_free (sr);
+
+	rb_file_helpers_shutdown ();
+
+	rb_profile_end ("rb-metadata test suite");
+	return ret;
+}
@@ -0,0 +1,445 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: t; c-basic-offset: 8 -*-
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  The Rhythmbox authors hereby grant permission for non-GPL compatible
+ *  GStreamer plugins to be used and distributed together with GStreamer
+ *  and Rhythmbox. This permission is above and beyond the permissions granted
+ *  by the GPL license by which Rhythmbox is covered. If you modify this code
+ *  you may extend this exception to your version of the code, but you are not
+ *  obligated to do so. If you do not wish to do so, delete this exception
+ *  statement from your version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301  USA.
+ *
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include <check.h>
+#include <gtk/gtk.h>
+#include <gst/gst.h>
+#include <gst/base/gstbasesink.h>
+#include <locale.h>
+#include "test-utils.h"
+#include "rb-player.h"
+#include "rb-player-gst-tee.h"
+#include "rb-player-gst-analysis.h"
+#include "rb-file-helpers.h"
+#include "rb-util.h"
+#include "rb-debug.h"
+
+/* the tests run without audio hardware, so we register a fakesink that
+ * autoaudiosink will pick ahead of any real audio sink.  it syncs to the
+ * clock, so streams play in real time as they would on a real sink.
+ */
+
+static void
+test_audio_sink_class_init (gpointer klass, gpointer data)
+{
+	gst_element_class_set_static_metadata (GST_ELEMENT_CLASS (klass),
+					       "Test audio sink",
+					       "Sink/Audio",
+					       "Discards audio in real time",
+					       "Rhythmbox tests");
+}
+
+static void
+test_audio_sink_init (GTypeInstance *instance, gpointer klass)
+{
+	gst_base_sink_set_sync (GST_BASE_SINK (instance), TRUE);
+}
+
+static gboolean
+register_test_audio_sink (void)
+{
+	GstElementFactory *factory;
+	GstPluginFeature *loaded;
+	GTypeQuery query;
+	GType type;
+
+	factory = gst_element_factory_find ("fakesink");
+	if (factory == NULL)
+		return FALSE;
+
+	loaded = gst_plugin_feature_load (GST_PLUGIN_FEATURE (factory));
+	gst_object_unref (factory);
+	if (loaded == NULL)
+		return FALSE;
+
+	g_type_query (gst_element_factory_get_element_type (GST_ELEMENT_FACTORY (loaded)), &query);
+	type = g_type_register_static_simple (query.type,
+					      "RBTestAudioSink",
+					      query.class_size,
+					      test_audio_sink_class_init,
+					      query.instance_size,
+					      (GInstanceInitFunc) test_audio_sink_init,
+					      0);
+	gst_object_unref (loaded);
+
+	return gst_element_register (NULL, "rbtestaudiosink", GST_RANK_PRIMARY + 100, type);
+}
+
+typedef struct {
+	GMainLoop *loop;
+	const char *tick_stream;
+	guint timeout_id;
+} PlayerTestData;
+
+static char *
+make_test_file (const char *dir, const char *name, int buffers)
+{
+	GstElement *pipeline;
+	GstBus *bus;
+	GstMessage *message;
+	char *path;
+	char *desc;
+	char *uri;
+
+	path = g_build_filename (dir, name, NULL);
+	desc = g_strdup_printf ("audiotestsrc num-buffers=%d ! audioconvert ! wavenc ! filesink location=\"%s\"", buffers, path);
+	pipeline = gst_parse_launch (desc, NULL);
+	g_free (desc);
+	fail_unless (pipeline != NULL, "unable to create test file pipeline");
+
+	gst_element_set_state (pipeline, GST_STATE_PLAYING);
+	bus = gst_element_get_bus (pipeline);
+	message = gst_bus_timed_pop_filtered (bus, GST_CLOCK_TIME_NONE, GST_MESSAGE_EOS | GST_MESSAGE_ERROR);
+	fail_unless (GST_MESSAGE_TYPE (message) == GST_MESSAGE_EOS, "unable to write test file");
+	gst_message_unref (message);
+	gst_object_unref (bus);
+	gst_element_set_state (pipeline, GST_STATE_NULL);
+	gst_object_unref (pipeline);
+
+	uri = g_filename_to_uri (path, NULL, NULL);
+	g_free (path);
+	return uri;
+}
+
+static void
+tick_cb (RBPlayer *player, gpointer stream_data, gint64 elapsed, gint64 duration, PlayerTestData *data)
+{
+	data->tick_stream = stream_data;
+	g_main_loop_quit (data->loop);
+}
+
+static gboolean
+timeout_cb (PlayerTestData *data)
+{
+	data->timeout_id = 0;
+	g_main_loop_quit (data->loop);
+	return FALSE;
+}
+
+static void
+run_loop (PlayerTestData *data, guint ms)
+{
+	data->timeout_id = g_timeout_add (ms, (GSourceFunc) timeout_cb, data);
+	g_main_loop_run (data->loop);
+	if (data->timeout_id != 0) {
+		g_source_remove (data->timeout_id);
+		data->timeout_id = 0;
+	}
+}
+
+static const char *
+wait_for_tick (PlayerTestData *data)
+{
+	data->tick_stream = NULL;
+	run_loop (data, 10000);
+	return data->tick_stream;
+}
+
+START_TEST (test_rb_player_open_ahead_pause)
+{
+	PlayerTestData data;
+	RBPlayer *player;
+	GError *error = NULL;
+	char *dir;
+	char *uri_a;
+	char *uri_b;
+	char *path;
+
+	dir = g_dir_make_tmp ("rb-test-player-XXXXXX", NULL);
+	fail_unless (dir != NULL, "unable to create test directory");
+	uri_a = make_test_file (dir, "a.wav", 150);
+	uri_b = make_test_file (dir, "b.wav", 150);
+
+	memset (&data, 0, sizeof (data));
+	data.loop = g_main_loop_new (NULL, FALSE);
+
+	player = rb_player_new (TRUE, &error);
+	fail_unless (player != NULL, "unable to create player");
+	g_signal_connect (player, "tick", G_CALLBACK (tick_cb), &data);
+
+	fail_unless (rb_player_open (player, uri_a, "a", NULL, &error), "unable to open first stream");
+	fail_unless (rb_player_play (player, RB_PLAYER_PLAY_REPLACE, 0, &error), "unable to play");
+	fail_unless (g_strcmp0 (wait_for_tick (&data), "a") == 0, "first stream not playing");
+
+	/* pause, then open the next stream ahead, as the shell player does near the end of a track */
+	rb_player_pause (player);
+	run_loop (&data, 500);
+	fail_unless (rb_player_open_ahead (player, uri_b, "b", NULL, &error), "unable to open stream ahead");
+	run_loop (&data, 1000);
+	fail_if (rb_player_playing (player), "opening ahead started playback");
+
+	/* resuming should continue the paused stream, not start the one opened ahead */
+	fail_unless (rb_player_play (player, RB_PLAYER_PLAY_REPLACE, 0, &error), "unable to resume");
+	fail_unless (g_strcmp0 (wait_for_tick (&data), "a") == 0, "resuming didn't continue the paused stream");
+
+	/* opening it properly makes it the stream to play */
+	fail_unless (rb_player_open (player, uri_b, "b", NULL, &error), "unable to open second stream");
+	fail_unless (rb_player_play (player, RB_PLAYER_PLAY_REPLACE, 0, &error), "unable to play second stream");
+	run_loop (&data, 500);
+	fail_unless (g_strcmp0 (wait_for_tick (&data), "b") == 0, "second stream not playing");
+
+	rb_player_close (player, NULL, NULL);
+
+	g_object_unref (player);
+	g_main_loop_unref (data.loop);
+
+	path = g_build_filename (dir, "a.wav", NULL);
+	g_unlink (path);
+	g_free (path);
+	path = g_build_filename (dir, "b.wav", NULL);
+	g_unlink (path);
+	g_free (path);
+	g_rmdir (dir);
+
+	g_free (uri_a);
+	g_free (uri_b);
+	g_free (dir);
+}
+END_TEST
+
+typedef struct {
+	int frames;
+	int inserted;
+	int removed;
+} AnalysisTestData;
+
+static void
+analysis_frame_cb (RBPlayerGstAnalysis *analysis, RBAudioAnalysisFrame *frame, AnalysisTestData *data)
+{
+	data->frames++;
+}
+
+static void
+tee_inserted_cb (RBPlayerGstTee *player, GstElement *element, AnalysisTestData *data)
+{
+	if (g_str_has_prefix (GST_OBJECT_NAME (element), "analysisbin"))
+		data->inserted++;
+}
+
+static void
+tee_pre_remove_cb (RBPlayerGstTee *player, GstElement *element, AnalysisTestData *data)
+{
+	if (g_str_has_prefix (GST_OBJECT_NAME (element), "analysisbin"))
+		data->removed++;
+}
+
+/* runs the main loop for a while, or until @count is non-zero */
+static void
+run_until (guint ms, int *count)
+{
+	gint64 end = g_get_monotonic_time () + ms * 1000;
+
+	while (g_get_monotonic_time () < end && (count == NULL || *count == 0)) {
+		if (g_main_context_iteration (NULL, FALSE) == FALSE)
+			g_usleep (G_USEC_PER_SEC / 100);
+	}
+}
+
+static gint
+read_shm_write_count (const char *path)
+{
+	RBPlayerGstAnalysisShmHeader *header;
+	char *contents;
+	gsize length;
+	gint count;
+
+	fail_unless (g_file_get_contents (path, &contents, &length, NULL), "unable to read analysis ring");
+	fail_unless (length == sizeof (RBPlayerGstAnalysisShmHeader) + RB_PLAYER_GST_ANALYSIS_SHM_SLOTS * sizeof (RBAudioAnalysisFrame),
+		     "analysis ring is the wrong size");
+
+	header = (RBPlayerGstAnalysisShmHeader *) contents;
+	fail_unless (header->magic == RB_PLAYER_GST_ANALYSIS_SHM_MAGIC, "bad analysis ring magic");
+	fail_unless (header->version == RB_PLAYER_GST_ANALYSIS_SHM_VERSION, "bad analysis ring version");
+	fail_unless (header->header_size == sizeof (RBPlayerGstAnalysisShmHeader), "bad analysis ring header size");
+	fail_unless (header->frame_size == sizeof (RBAudioAnalysisFrame), "bad analysis ring frame size");
+	fail_unless (header->n_slots == RB_PLAYER_GST_ANALYSIS_SHM_SLOTS, "bad analysis ring slot count");
+	fail_unless (header->frame_rate == 30, "bad analysis ring frame rate");
+	count = header->write_count;
+
+	g_free (contents);
+	return count;
+}
+
+START_TEST (test_rb_player_gst_analysis)
+{
+	AnalysisTestData data;
+	RBPlayerGstAnalysis *analysis;
+	RBPlayer *player;
+	GError *error = NULL;
+	char *shm_path;
+	char *dir;
+	char *uri;
+	char *path;
+	gint count;
+
+	dir = g_dir_make_tmp ("rb-test-player-XXXXXX", NULL);
+	fail_unless (dir != NULL, "unable to create test directory");
+	uri = make_test_file (dir, "a.wav", 600);
+
+	memset (&data, 0, sizeof (data));
+	player = rb_player_new (TRUE, &error);
+	fail_unless (player != NULL, "unable to create player");
+	fail_unless (RB_IS_PLAYER_GST_TEE (player), "player doesn't support tees");
+	g_signal_connect (player, "tee-inserted", G_CALLBACK (tee_inserted_cb), &data);
+	g_signal_connect (player, "tee-pre-remove", G_CALLBACK (tee_pre_remove_cb), &data);
+
+	analysis = rb_player_gst_analysis_new (player);
+	g_signal_connect (analysis, "frame", G_CALLBACK (analysis_frame_cb), &data);
+
+	fail_unless (rb_player_open (player, uri, "a", NULL, &error), "unable to open stream");
+	fail_unless (rb_player_play (player, RB_PLAYER_PLAY_REPLACE, 0, &error), "unable to play");
+
+	/* nothing is analysed without consumers */
+	run_until (500, NULL);
+	fail_unless (data.inserted == 0 && data.frames == 0, "analysing output without consumers");
+
+	/* more consumers share the one branch */
+	rb_player_gst_analysis_add_consumer (analysis);
+	rb_player_gst_analysis_add_consumer (analysis);
+	run_until (5000, &data.frames);
+	fail_unless (data.frames > 0, "no analysis frames");
+	fail_unless (data.inserted == 1, "analysis branch attached %d times", data.inserted);
+
+	rb_player_gst_analysis_remove_consumer (analysis);
+	data.frames = 0;
+	run_until (5000, &data.frames);
+	fail_unless (data.frames > 0, "analysis stopped with a consumer left");
+	fail_unless (data.removed == 0, "analysis branch detached with a consumer left");
+
+	/* the branch goes away with the last consumer */
+	rb_player_gst_analysis_remove_consumer (analysis);
+	run_until (2000, &data.removed);
+	fail_unless (data.removed == 1, "analysis branch not detached");
+	data.frames = 0;
+	run_until (500, NULL);
+	fail_unless (data.frames == 0, "analysis frames without consumers");
+
+	/* the shared memory ring keeps it attached, without emitting frames */
+	fail_unless (rb_player_gst_analysis_get_shm_path (analysis) == NULL, "ring enabled by default");
+	data.inserted = 0;
+	data.removed = 0;
+	g_object_set (analysis, "export-shm", TRUE, NULL);
+	shm_path = g_strdup (rb_player_gst_analysis_get_shm_path (analysis));
+	fail_unless (shm_path != NULL, "no analysis ring");
+	fail_unless (g_str_has_prefix (shm_path, g_get_user_runtime_dir ()), "analysis ring not in the runtime directory");
+	run_until (1000, NULL);
+	fail_unless (data.inserted == 1, "analysis branch not attached for the ring");
+	count = read_shm_write_count (shm_path);
+	fail_unless (count > 0, "no frames written to the ring");
+	run_until (500, NULL);
+	fail_unless (read_shm_write_count (shm_path) > count, "ring not updated");
+	fail_unless (data.frames == 0, "analysis frames without consumers");
+
+	g_object_set (analysis, "export-shm", FALSE, NULL);
+	fail_unless (rb_player_gst_analysis_get_shm_path (analysis) == NULL, "ring still enabled");
+	fail_if (g_file_test (shm_path, G_FILE_TEST_EXISTS), "ring file not removed");
+	run_until (2000, &data.removed);
+	fail_unless (data.removed == 1, "analysis branch not detached after the ring");
+	g_free (shm_path);
+
+	rb_player_close (player, NULL, NULL);
+	g_object_unref (analysis);
+	g_object_unref (player);
+
+	path = g_filename_from_uri (uri, NULL, NULL);
+	g_unlink (path);
+	g_free (path);
+	g_free (uri);
+	g_rmdir (dir);
+	g_free (dir);
+}
+END_TEST
+
+static Suite *
+rb_player_suite ()
+{
+	Suite *s = suite_create ("rb-player");
+	TCase *tc_chain = tcase_create ("rb-player-core");
+
+	suite_add_tcase (s, tc_chain);
+
+	tcase_set_timeout (tc_chain, 30);
+	tcase_add_test (tc_chain, test_rb_player_open_ahead_pause);
+	tcase_add_test (tc_chain, test_rb_player_gst_analysis);
+
+	return s;
+}
+
+int
+main (int argc, char **argv)
+{
+	int ret;
+	SRunner *sr;
+	Suite *s;
+	char *runtime_dir;
+
+	/* keep the analysis ring out of the real runtime directory */
+	runtime_dir = g_dir_make_tmp ("rb-test-runtime-XXXXXX", NULL);
+	if (runtime_dir != NULL)
+		g_setenv ("XDG_RUNTIME_DIR", runtime_dir, TRUE);
+
+	rb_profile_start ("rb-player test suite");
+	rb_threads_init ();
+	setlocale (LC_ALL, NULL);
+	rb_debug_init (TRUE);
+	rb_file_helpers_init (TRUE);
+	gst_init (&argc, &argv);
+
+	if (register_test_audio_sink () == FALSE) {
+		/* automake reports this as a skipped test, not a pass */
+		g_print ("unable to set up a test audio sink, skipping\n");
+		if (runtime_dir != NULL)
+			g_rmdir (runtime_dir);
+		return 77;
+	}
+
+	/* setup tests */
+	s = rb_player_suite ();
+	sr = srunner_create (s);
+
+	init_setup (sr, argc, argv);
+	init_once (FALSE);
+
+	srunner_run_all (sr, CK_NORMAL);
+	ret = srunner_ntests_failed (sr);
+	srunner_free (sr);
+
+	rb_file_helpers_shutdown ();
+
+	if (runtime_dir != NULL) {
+		g_rmdir (runtime_dir);
+		g_free (runtime_dir);
+	}
+
+	rb_profile_end ("rb-player test suite");
+	return ret;
+}
@@ -28,12 +28,16 @@
 #include "config.h"
 
 #include <string.h>
+#include <math.h>
 #include <glib-object.h>
 
 #include <check.h>
 #include "test-utils.h"
 #include "rb-util.h"
 #include "rb-string-value-map.h"
+#include "rb-loudness.h"
+#include "rb-waveform.h"
+#include "rb-audio-analyser.h"
 #include "rb-debug.h"
 
 START_TEST (test_rb_string_value_map)
@@ -82,6 +86,152 @@ START_TEST (test_rb_string_value_map)
 }
 END_TEST
 
+static void
+add_sine (RBLoudness *meter, guint rate, double amplitude, guint seconds)
+{
+	float *buf;
+	guint i;
+
+	buf = g_new (float, rate * 2);
+	for (i = 0; i < rate; i++) {
+		buf[i*2] = buf[i*2 + 1] = amplitude * sin (2.0 * G_PI * 1000.0 * i / rate);
+	}
+	for (i = 0; i < seconds; i++) {
+		rb_loudness_add_frames (meter, buf, rate);
+	}
+	g_free (buf);
+}
+
+START_TEST (test_rb_loudness)
+{
+	RBLoudness *meters[2];
+	float silence[4800 * 2] = {0, };
+	double amplitude;
+	int i;
+
+	/* EBU Tech 3341 case 1: a 1kHz stereo sine at -23dBFS measures -23 LUFS */
+	amplitude = pow (10.0, -23.0 / 20.0);
+	meters[0] = rb_loudness_new (48000, 2);
+	add_sine (meters[0], 48000, amplitude, 20);
+	fail_unless (fabs (rb_loudness_get_loudness (meters[0]) + 23.0) < 0.1, "wrong integrated loudness");
+	fail_unless (fabs (rb_loudness_get_peak (meters[0]) - amplitude) < 0.001, "wrong sample peak");
+	fail_unless (fabs (rb_loudness_to_gain (rb_loudness_get_loudness (meters[0])) - 5.0) < 0.1, "wrong gain");
+
+	/* silence is gated out */
+	meters[1] = rb_loudness_new (44100, 2);
+	add_sine (meters[1], 44100, amplitude, 10);
+	for (i = 0; i < 100; i++) {
+		rb_loudness_add_frames (meters[1], silence, 4800);
+	}
+	fail_unless (fabs (rb_loudness_get_loudness (meters[1]) + 23.0) < 0.1, "silence not gated out");
+	fail_unless (fabs (rb_loudness_get_album_loudness (meters, 2) + 23.0) < 0.1, "wrong album loudness");
+	rb_loudness_free (meters[1]);
+
+	meters[1] = rb_loudness_new (48000, 2);
+	rb_loudness_add_frames (meters[1], silence, 4800);
+	fail_unless (isinf (rb_loudness_get_loudness (meters[1])), "silence has loudness");
+	fail_unless (rb_loudness_to_gain (rb_loudness_get_loudness (meters[1])) == 0.0, "silence has gain");
+
+	rb_loudness_free (meters[0]);
+	rb_loudness_free (meters[1]);
+}
+END_TEST
+
+START_TEST (test_rb_waveform)
+{
+	RBWaveform *waveform;
+	GBytes *envelope;
+	float *buf;
+	float peak, rms;
+	guint i;
+
+	/* one second of a half scale sine followed by one second of silence */
+	buf = g_new0 (float, 44100 * 2);
+	for (i = 0; i < 44100; i++) {
+		buf[i] = 0.5 * sin (2.0 * G_PI * 1000.0 * i / 44100);
+	}
+	waveform = rb_waveform_new (44100, 1);
+	rb_waveform_add_frames (waveform, buf, 44100 * 2);
+	g_free (buf);
+
+	envelope = rb_waveform_get_envelope (waveform, 4);
+	fail_unless (envelope != NULL, "no envelope");
+	fail_unless (rb_waveform_envelope_get_n_bins (envelope) == 4, "wrong number of bins");
+
+	fail_unless (rb_waveform_envelope_get_range (envelope, 0.0, 0.5, &peak, &rms), "range not covered");
+	fail_unless (fabs (peak - 0.5) < 0.01, "wrong peak");
+	fail_unless (fabs (rms - 0.5 / sqrt (2.0)) < 0.01, "wrong rms");
+
+	fail_unless (rb_waveform_envelope_get_range (envelope, 0.5, 1.0, &peak, &rms), "range not covered");
+	fail_unless (peak == 0.0 && rms == 0.0, "silence has a level");
+
+	fail_unless (rb_waveform_envelope_get_range (envelope, 0.4, 0.6, &peak, &rms), "range not covered");
+	fail_unless (fabs (peak - 0.5) < 0.01, "range didn't include the loud bin");
+
+	fail_if (rb_waveform_envelope_get_range (envelope, 1.0, 1.5, &peak, &rms), "range past the end is covered");
+	g_bytes_unref (envelope);
+
+	/* short streams spread over all the bins */
+	envelope = rb_waveform_get_envelope (waveform, 100);
+	fail_unless (rb_waveform_envelope_get_n_bins (envelope) == 100, "wrong number of bins");
+	g_bytes_unref (envelope);
+	rb_waveform_free (waveform);
+
+	waveform = rb_waveform_new (44100, 2);
+	fail_unless (rb_waveform_get_envelope (waveform, 4) == NULL, "envelope with no audio");
+	rb_waveform_free (waveform);
+}
+END_TEST
+
+static void
+count_analysis_frame (RBAudioAnalysisFrame *frame, gsize offset, RBAudioAnalysisFrame *last)
+{
+	last->position++;
+	last->channels = frame->channels;
+	last->n_bands = frame->n_bands;
+	memcpy (last->peak, frame->peak, sizeof (frame->peak));
+	memcpy (last->rms, frame->rms, sizeof (frame->rms));
+	memcpy (last->bands, frame->bands, sizeof (frame->bands));
+}
+
+START_TEST (test_rb_audio_analyser)
+{
+	RBAudioAnalyser *analyser;
+	RBAudioAnalysisFrame last = {0, };
+	double freq;
+	float *buf;
+	guint i;
+
+	/* 25 frames per second, 32 bands */
+	analyser = rb_audio_analyser_new (48000, 2, 32, 1920);
+	for (i = 1; i < 32; i++) {
+		fail_unless (rb_audio_analyser_get_band_frequency (analyser, i) >
+			     rb_audio_analyser_get_band_frequency (analyser, i - 1), "band frequencies not increasing");
+	}
+
+	/* one second of a half scale sine in the middle of band 16 */
+	freq = rb_audio_analyser_get_band_frequency (analyser, 16);
+	buf = g_new (float, 48000 * 2);
+	for (i = 0; i < 48000; i++) {
+		buf[i*2] = buf[i*2 + 1] = 0.5 * sin (2.0 * G_PI * freq * i / 48000);
+	}
+	rb_audio_analyser_add_frames (analyser, buf, 1000, (RBAudioAnalyserFunc) count_analysis_frame, &last);
+	fail_unless (last.position == 0, "analysis frame completed early");
+	rb_audio_analyser_add_frames (analyser, buf + 2000, 47000, (RBAudioAnalyserFunc) count_analysis_frame, &last);
+	g_free (buf);
+
+	fail_unless (last.position == 25, "wrong number of analysis frames");
+	fail_unless (last.channels == 2 && last.n_bands == 32, "wrong frame layout");
+	fail_unless (fabs (last.peak[0] - 0.5) < 0.01 && fabs (last.peak[1] - 0.5) < 0.01, "wrong peak");
+	fail_unless (fabs (last.rms[0] - 0.5 / sqrt (2.0)) < 0.01, "wrong rms");
+	fail_unless (fabs (last.bands[16] + 6.02) < 1.0, "wrong level in the sine's band");
+	fail_unless (last.bands[4] < -60.0 && last.bands[28] < -60.0, "sine leaked into distant bands");
+	fail_unless (last.bands[32] == RB_AUDIO_ANALYSIS_FLOOR, "unused band has a level");
+
+	rb_audio_analyser_free (analyser);
+}
+END_TEST
+
 static Suite *
 rb_file_helpers_suite ()
 {
@@ -91,6 +241,9 @@ rb_file_helpers_suite ()
 	suite_add_tcase (s, tc_chain);
 
 	tcase_add_test (tc_chain, test_rb_string_value_map);
+	tcase_add_test (tc_chain, test_rb_loudness);
+	tcase_add_test (tc_chain, test_rb_waveform);
+	tcase_add_test (tc_chain, test_rb_audio_analyser);
 
 	return s;
 }
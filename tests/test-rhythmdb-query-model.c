@@ -286,6 +286,126 @@ START_TEST (test_hidden_chain_filter)
 }
 END_TEST
 
+static RhythmDBEntry *
+create_sort_entry (const char *location, const char *album, gulong disc, gulong track, const char *title)
+{
+	RhythmDBEntry *entry;
+
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, location);
+	set_entry_string (db, entry, RHYTHMDB_PROP_ARTIST, "Artist");
+	set_entry_string (db, entry, RHYTHMDB_PROP_ALBUM, album);
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, title);
+	set_entry_ulong (db, entry, RHYTHMDB_PROP_DISC_NUMBER, disc);
+	set_entry_ulong (db, entry, RHYTHMDB_PROP_TRACK_NUMBER, track);
+	return entry;
+}
+
+START_TEST (test_sort_keys)
+{
+	RhythmDBEntry *a;
+	RhythmDBEntry *b;
+	RhythmDBEntry *c;
+
+	start_test_case ();
+
+	a = create_sort_entry ("file:///a.ogg", "Album", 1, 2, "Zebra");
+	b = create_sort_entry ("file:///b.ogg", "Album", 0, 10, "Apple");
+	c = create_sort_entry ("file:///c.ogg", "Album Two", 1, 1, "Apple");
+	rhythmdb_commit (db);
+
+	/* a missing disc number sorts as disc 1, and track numbers compare numerically */
+	fail_unless (rhythmdb_query_model_album_sort_func (a, b, NULL) < 0, "tracks sorted incorrectly");
+	fail_unless (rhythmdb_query_model_album_sort_func (b, a, NULL) > 0, "tracks sorted incorrectly");
+	fail_unless (rhythmdb_query_model_album_sort_func (a, a, NULL) == 0, "entry not equal to itself");
+
+	/* an album name sorts before longer names it is a prefix of */
+	fail_unless (rhythmdb_query_model_album_sort_func (b, c, NULL) < 0, "albums sorted incorrectly");
+	fail_unless (rhythmdb_query_model_artist_sort_func (b, c, NULL) < 0, "albums sorted incorrectly");
+
+	/* title, then location */
+	fail_unless (rhythmdb_query_model_title_sort_func (b, a, NULL) < 0, "titles sorted incorrectly");
+	fail_unless (rhythmdb_query_model_title_sort_func (b, c, NULL) < 0, "locations sorted incorrectly");
+
+	end_step ();
+
+	/* changing a property must update the cached keys */
+	set_entry_ulong (db, b, RHYTHMDB_PROP_TRACK_NUMBER, 1);
+	set_entry_string (db, a, RHYTHMDB_PROP_TITLE, "Aardvark");
+	rhythmdb_commit (db);
+
+	fail_unless (rhythmdb_query_model_album_sort_func (a, b, NULL) > 0, "track number change ignored");
+	fail_unless (rhythmdb_query_model_title_sort_func (a, b, NULL) < 0, "title change ignored");
+
+	rhythmdb_entry_delete (db, a);
+	rhythmdb_entry_delete (db, b);
+	rhythmdb_entry_delete (db, c);
+	rhythmdb_commit (db);
+
+	end_test_case ();
+}
+END_TEST
+
+static RhythmDBEntry *
+get_model_entry (RhythmDBQueryModel *model, int index)
+{
+	GtkTreePath *path;
+	RhythmDBEntry *entry;
+
+	path = gtk_tree_path_new_from_indices (index, -1);
+	entry = rhythmdb_query_model_tree_path_to_entry (model, path);
+	gtk_tree_path_free (path);
+	if (entry != NULL)
+		rhythmdb_entry_unref (entry);
+	return entry;
+}
+
+START_TEST (test_bulk_query_results)
+{
+	RhythmDBQueryModel *model;
+	RhythmDBEntry *a;
+	RhythmDBEntry *b;
+	RhythmDBEntry *c;
+	RhythmDBEntry *d;
+	GPtrArray *query;
+
+	start_test_case ();
+
+	c = create_sort_entry ("file:///c.ogg", "Album", 1, 3, "Three");
+	a = create_sort_entry ("file:///a.ogg", "Album", 1, 1, "One");
+	d = create_sort_entry ("file:///d.ogg", "Other", 1, 1, "Other");
+	b = create_sort_entry ("file:///b.ogg", "Album", 1, 2, "Two");
+	rhythmdb_commit (db);
+
+	model = rhythmdb_query_model_new_empty (db);
+	g_object_set (model, "sort-func", rhythmdb_query_model_album_sort_func, NULL);
+
+	/* already in the model before the query runs */
+	rhythmdb_query_model_add_entry (model, b, -1);
+
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ALBUM, "Album",
+				      RHYTHMDB_QUERY_END);
+	rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (model), query);
+	rhythmdb_query_free (query);
+
+	fail_unless (gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL) == 3, "wrong number of results");
+	fail_unless (get_model_entry (model, 0) == a, "results sorted incorrectly");
+	fail_unless (get_model_entry (model, 1) == b, "results sorted incorrectly");
+	fail_unless (get_model_entry (model, 2) == c, "results sorted incorrectly");
+
+	g_object_unref (model);
+
+	rhythmdb_entry_delete (db, a);
+	rhythmdb_entry_delete (db, b);
+	rhythmdb_entry_delete (db, c);
+	rhythmdb_entry_delete (db, d);
+	rhythmdb_commit (db);
+
+	end_test_case ();
+}
+END_TEST
+
 static Suite *
 rhythmdb_query_model_suite (void)
 {
@@ -300,6 +420,8 @@ rhythmdb_query_model_suite (void)
 
 	/* test core functionality */
 	tcase_add_test (tc_chain, test_rhythmdb_db_queries);
+	tcase_add_test (tc_chain, test_sort_keys);
+	tcase_add_test (tc_chain, test_bulk_query_results);
 
 	/* tests for breakable bug fixes */
 	tcase_add_test (tc_bugs, test_hidden_chain_filter);
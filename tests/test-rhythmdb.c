@@ -29,8 +29,10 @@
 
 #include <check.h>
 #include <gtk/gtk.h>
+#include <glib/gstdio.h>
 #include <string.h>
 #include <glib/gi18n.h>
+#include <utime.h>
 
 #include "test-utils.h"
 
@@ -40,6 +42,8 @@
 
 #include "rhythmdb.h"
 #include "rhythmdb-tree.h"
+#include "rhythmdb-private.h"
+#include "rhythmdb-dir-index.h"
 #include "rhythmdb-query-model.h"
 #include "rb-podcast-entry-types.h"
 
@@ -472,6 +476,611 @@ START_TEST (test_rhythmdb_modify_after_delete)
 }
 END_TEST
 
+static void
+set_mtime (const char *path, time_t mtime)
+{
+	struct utimbuf t;
+
+	t.actime = mtime;
+	t.modtime = mtime;
+	fail_unless (g_utime (path, &t) == 0, "failed to set modification time of %s", path);
+}
+
+START_TEST (test_rhythmdb_snapshot)
+{
+	RhythmDBEntry *entry;
+	RhythmDB *loaded;
+	RBRefString *keyword;
+	GStatBuf xml_stat;
+	char *garbage;
+	char *tmpdir;
+	char *name;
+	char *snapshot;
+
+	tmpdir = g_dir_make_tmp ("test-rhythmdb-XXXXXX", NULL);
+	fail_unless (tmpdir != NULL, "failed to create temporary directory");
+	name = g_build_filename (tmpdir, "rhythmdb.xml", NULL);
+	snapshot = g_strconcat (name, ".snapshot", NULL);
+	g_object_set (G_OBJECT (db), "name", name, NULL);
+
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///whee.ogg");
+	fail_unless (entry != NULL, "failed to create entry");
+	set_entry_string (db, entry, RHYTHMDB_PROP_GENRE, "Rock");
+	set_entry_string (db, entry, RHYTHMDB_PROP_ARTIST, "Nine Inch Nails");
+	set_entry_string (db, entry, RHYTHMDB_PROP_ALBUM, "Pretty Hate Machine");
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, "Sin");
+	set_entry_ulong (db, entry, RHYTHMDB_PROP_TRACK_NUMBER, 9);
+	set_entry_ulong (db, entry, RHYTHMDB_PROP_PLAY_COUNT, 42);
+	set_entry_hidden (db, entry, TRUE);
+	keyword = rb_refstring_new ("industrial");
+	rhythmdb_entry_keyword_add (db, entry, keyword);
+	rhythmdb_commit (db);
+
+	rhythmdb_save (db);
+	fail_unless (g_file_test (snapshot, G_FILE_TEST_EXISTS), "snapshot not written");
+
+	/* replace the xml file with garbage of the same size and mtime, so
+	 * the entries can only come from the snapshot.
+	 */
+	fail_unless (g_stat (name, &xml_stat) == 0, "failed to stat %s", name);
+	garbage = g_strnfill (xml_stat.st_size, 'x');
+	fail_unless (g_file_set_contents (name, garbage, xml_stat.st_size, NULL), "failed to overwrite %s", name);
+	g_free (garbage);
+	set_mtime (name, xml_stat.st_mtime);
+
+	/* load it into a separate database */
+	loaded = rhythmdb_tree_new ("test");
+	g_object_set (G_OBJECT (loaded), "name", name, NULL);
+	set_waiting_signal (G_OBJECT (loaded), "load-complete");
+	rhythmdb_load (loaded);
+	wait_for_signal ();
+
+	entry = rhythmdb_entry_lookup_by_location (loaded, "file:///whee.ogg");
+	fail_unless (entry != NULL, "entry not loaded from snapshot");
+	fail_unless (rhythmdb_entry_get_entry_type (entry) == RHYTHMDB_ENTRY_TYPE_IGNORE, "wrong entry type");
+	fail_unless (strcmp (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_ARTIST), "Nine Inch Nails") == 0,
+		     "ARTIST loaded incorrectly");
+	fail_unless (strcmp (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_TITLE), "Sin") == 0,
+		     "TITLE loaded incorrectly");
+	fail_unless (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_TRACK_NUMBER) == 9, "TRACK_NUMBER loaded incorrectly");
+	fail_unless (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_PLAY_COUNT) == 42, "PLAY_COUNT loaded incorrectly");
+	fail_unless (rhythmdb_entry_get_boolean (entry, RHYTHMDB_PROP_HIDDEN), "HIDDEN loaded incorrectly");
+	fail_unless (rhythmdb_entry_keyword_has (loaded, entry, keyword), "keyword not loaded");
+
+	rhythmdb_shutdown (loaded);
+	g_object_unref (loaded);
+	rb_refstring_unref (keyword);
+
+	g_unlink (snapshot);
+	g_unlink (name);
+	g_rmdir (tmpdir);
+	g_free (snapshot);
+	g_free (name);
+	g_free (tmpdir);
+}
+END_TEST
+
+/* writes a database with @count entries, where the entry at @duplicate has
+ * the same location as entry 5, and the entry at @broken isn't well formed.
+ */
+static void
+write_parallel_load_db (const char *name, int count, int duplicate, int broken)
+{
+	GString *str;
+	int i;
+
+	str = g_string_new ("<?xml version=\"1.0\" standalone=\"yes\"?>\n<rhythmdb version=\"2.0\">\n");
+	for (i = 0; i < count; i++) {
+		if (i % 10 == 3) {
+			g_string_append_printf (str,
+						"  <entry type=\"test-unknown-type\">\n"
+						"    <location>file:///parallel/unknown-%d.ogg</location>\n"
+						"  </entry>\n",
+						i);
+		}
+		g_string_append_printf (str,
+					"  <entry type=\"ignore\">\n"
+					"    <title>Track %d</title%s>\n"
+					"    <location>file:///parallel/%d.ogg</location>\n"
+					"    <play-count>%d</play-count>\n"
+					"    <date>0</date>\n"
+					"  </entry>\n",
+					i, (i == broken) ? "l" : "",
+					(i == duplicate) ? 5 : i,
+					i);
+	}
+	g_string_append (str, "</rhythmdb>\n");
+
+	fail_unless (g_file_set_contents (name, str->str, str->len, NULL), "failed to write database");
+	g_string_free (str, TRUE);
+}
+
+static RhythmDBEntry *
+lookup_parallel_load_entry (int i)
+{
+	RhythmDBEntry *entry;
+	char *uri;
+
+	uri = g_strdup_printf ("file:///parallel/%d.ogg", i);
+	entry = rhythmdb_entry_lookup_by_location (db, uri);
+	g_free (uri);
+	return entry;
+}
+
+START_TEST (test_rhythmdb_parallel_load)
+{
+	RhythmDBEntry *entry;
+	gulong last_id;
+	char *tmpdir;
+	char *name;
+	int i;
+
+	tmpdir = g_dir_make_tmp ("test-rhythmdb-XXXXXX", NULL);
+	fail_unless (tmpdir != NULL, "failed to create temporary directory");
+	name = g_build_filename (tmpdir, "rhythmdb.xml", NULL);
+	write_parallel_load_db (name, 40, 25, -1);
+
+	/* split the file into lots of small chunks */
+	g_object_set (G_OBJECT (db), "name", name, "use-snapshot", FALSE, "load-chunk-size", 256, NULL);
+	set_waiting_signal (G_OBJECT (db), "load-complete");
+	rhythmdb_load (db);
+	wait_for_signal ();
+
+	/* entries are numbered in file order */
+	last_id = 0;
+	for (i = 0; i < 40; i++) {
+		if (i == 25)
+			continue;
+
+		entry = lookup_parallel_load_entry (i);
+		fail_unless (entry != NULL, "entry %d not loaded", i);
+		fail_unless (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_ENTRY_ID) > last_id, "entry %d loaded out of order", i);
+		last_id = rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_ENTRY_ID);
+	}
+
+	/* the later entry with the same location is merged into the first */
+	entry = lookup_parallel_load_entry (5);
+	fail_unless (strcmp (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_TITLE), "Track 5") == 0, "duplicate entry replaced the first");
+	fail_unless (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_PLAY_COUNT) == 30, "duplicate entry not merged");
+	fail_unless (lookup_parallel_load_entry (25) == NULL, "duplicate entry loaded");
+
+	g_unlink (name);
+	g_free (name);
+	g_rmdir (tmpdir);
+	g_free (tmpdir);
+}
+END_TEST
+
+START_TEST (test_rhythmdb_parallel_load_error)
+{
+	char *tmpdir;
+	char *name;
+	int i;
+
+	tmpdir = g_dir_make_tmp ("test-rhythmdb-XXXXXX", NULL);
+	fail_unless (tmpdir != NULL, "failed to create temporary directory");
+	name = g_build_filename (tmpdir, "rhythmdb.xml", NULL);
+	write_parallel_load_db (name, 40, -1, 20);
+
+	g_object_set (G_OBJECT (db), "name", name, "use-snapshot", FALSE, "load-chunk-size", 256, NULL);
+	set_waiting_signal (G_OBJECT (db), "load-complete");
+	rhythmdb_load (db);
+	wait_for_signal ();
+
+	/* the load stops at the broken entry, even though the chunks after
+	 * it were parsed successfully
+	 */
+	for (i = 0; i < 20; i++) {
+		fail_unless (lookup_parallel_load_entry (i) != NULL, "entry %d before the error not loaded", i);
+	}
+	for (i = 20; i < 40; i++) {
+		fail_unless (lookup_parallel_load_entry (i) == NULL, "entry %d after the error loaded", i);
+	}
+
+	g_unlink (name);
+	g_free (name);
+	g_rmdir (tmpdir);
+	g_free (tmpdir);
+}
+END_TEST
+
+static GList *
+query_play_count_index (RhythmDBQueryType type, gulong play_count, gboolean check_plan)
+{
+	RhythmDBQueryModel *model;
+	RhythmDBQuery *query;
+	GtkTreeIter iter;
+	GList *found = NULL;
+	char *plan;
+
+	query = rhythmdb_query_parse (db,
+				      type, RHYTHMDB_PROP_PLAY_COUNT, play_count,
+				      RHYTHMDB_QUERY_END);
+	model = rhythmdb_query_model_new_empty (db);
+	g_object_set (G_OBJECT (model), "show-hidden", TRUE, NULL);
+	set_waiting_signal (G_OBJECT (model), "complete");
+	rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (model), query);
+	wait_for_signal ();
+
+	if (check_plan) {
+		plan = rhythmdb_query_explain (db, query);
+		fail_unless (strstr (plan, "play-count index") != NULL, "property index not used: %s", plan);
+		g_free (plan);
+	}
+
+	if (gtk_tree_model_get_iter_first (GTK_TREE_MODEL (model), &iter)) {
+		do {
+			found = g_list_prepend (found, rhythmdb_query_model_iter_to_entry (model, &iter));
+		} while (gtk_tree_model_iter_next (GTK_TREE_MODEL (model), &iter));
+	}
+	g_object_unref (model);
+	rhythmdb_query_free (query);
+	return found;
+}
+
+START_TEST (test_rhythmdb_load_merge_index)
+{
+	RhythmDBEntry *entry;
+	GList *found;
+	char *tmpdir;
+	char *name;
+
+	tmpdir = g_dir_make_tmp ("test-rhythmdb-XXXXXX", NULL);
+	fail_unless (tmpdir != NULL, "failed to create temporary directory");
+	name = g_build_filename (tmpdir, "rhythmdb.xml", NULL);
+	write_parallel_load_db (name, 10, -1, -1);
+
+	/* index the play counts before the database loads a duplicate of this entry */
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///parallel/5.ogg");
+	fail_unless (entry != NULL, "failed to create entry");
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, "Track 5");
+	set_entry_ulong (db, entry, RHYTHMDB_PROP_PLAY_COUNT, 20);
+	rhythmdb_commit (db);
+	found = query_play_count_index (RHYTHMDB_QUERY_PROP_EQUALS, 20, FALSE);
+	fail_unless (g_list_length (found) == 1, "entry not found before loading");
+	g_list_free_full (found, (GDestroyNotify) rhythmdb_entry_unref);
+
+	g_object_set (G_OBJECT (db), "name", name, "use-snapshot", FALSE, NULL);
+	set_waiting_signal (G_OBJECT (db), "load-complete");
+	rhythmdb_load (db);
+	wait_for_signal ();
+
+	fail_unless (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_PLAY_COUNT) == 25, "duplicate entry not merged");
+
+	/* the index has the merged play count, not the one from before */
+	found = query_play_count_index (RHYTHMDB_QUERY_PROP_EQUALS, 25, TRUE);
+	fail_unless (g_list_length (found) == 1 && found->data == entry, "merged play count not indexed");
+	g_list_free_full (found, (GDestroyNotify) rhythmdb_entry_unref);
+	found = query_play_count_index (RHYTHMDB_QUERY_PROP_EQUALS, 20, TRUE);
+	fail_unless (found == NULL, "old play count still indexed");
+	found = query_play_count_index (RHYTHMDB_QUERY_PROP_GREATER, 10, TRUE);
+	fail_unless (g_list_length (found) == 1 && found->data == entry, "merged entry missing from range query");
+	g_list_free_full (found, (GDestroyNotify) rhythmdb_entry_unref);
+
+	g_unlink (name);
+	g_free (name);
+	g_rmdir (tmpdir);
+	g_free (tmpdir);
+}
+END_TEST
+
+START_TEST (test_rhythmdb_journal)
+{
+	RhythmDBEntry *entry;
+	RhythmDB *loaded;
+	char *tmpdir;
+	char *name;
+	char *journal;
+	char *snapshot;
+
+	tmpdir = g_dir_make_tmp ("test-rhythmdb-XXXXXX", NULL);
+	fail_unless (tmpdir != NULL, "failed to create temporary directory");
+	name = g_build_filename (tmpdir, "rhythmdb.xml", NULL);
+	journal = g_strconcat (name, ".journal", NULL);
+	snapshot = g_strconcat (name, ".snapshot", NULL);
+	g_object_set (G_OBJECT (db), "name", name, NULL);
+
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///whee.ogg");
+	fail_unless (entry != NULL, "failed to create entry");
+	set_entry_string (db, entry, RHYTHMDB_PROP_TITLE, "Sin");
+	set_entry_ulong (db, entry, RHYTHMDB_PROP_PLAY_COUNT, 1);
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///gone.ogg");
+	fail_unless (entry != NULL, "failed to create entry");
+	rhythmdb_commit (db);
+
+	/* the first save writes the whole database */
+	rhythmdb_save (db);
+	fail_unless (g_file_test (name, G_FILE_TEST_EXISTS), "database not written");
+	fail_unless (g_file_test (journal, G_FILE_TEST_EXISTS) == FALSE, "journal written by full save");
+
+	/* later saves append changes to the journal */
+	entry = rhythmdb_entry_lookup_by_location (db, "file:///whee.ogg");
+	set_entry_ulong (db, entry, RHYTHMDB_PROP_PLAY_COUNT, 2);
+	entry = rhythmdb_entry_lookup_by_location (db, "file:///gone.ogg");
+	rhythmdb_entry_delete (db, entry);
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///new.ogg");
+	fail_unless (entry != NULL, "failed to create entry");
+	rhythmdb_commit (db);
+
+	rhythmdb_save (db);
+	fail_unless (g_file_test (journal, G_FILE_TEST_EXISTS), "journal not written");
+
+	/* load the database and journal into a separate database */
+	loaded = rhythmdb_tree_new ("test");
+	g_object_set (G_OBJECT (loaded), "name", name, NULL);
+	set_waiting_signal (G_OBJECT (loaded), "load-complete");
+	rhythmdb_load (loaded);
+	wait_for_signal ();
+
+	entry = rhythmdb_entry_lookup_by_location (loaded, "file:///whee.ogg");
+	fail_unless (entry != NULL, "entry not loaded");
+	fail_unless (strcmp (rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_TITLE), "Sin") == 0,
+		     "TITLE loaded incorrectly");
+	fail_unless (rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_PLAY_COUNT) == 2, "journal change not applied");
+	fail_unless (rhythmdb_entry_lookup_by_location (loaded, "file:///gone.ogg") == NULL, "journal delete not applied");
+	fail_unless (rhythmdb_entry_lookup_by_location (loaded, "file:///new.ogg") != NULL, "journal addition not applied");
+
+	rhythmdb_shutdown (loaded);
+	g_object_unref (loaded);
+
+	g_unlink (journal);
+	g_unlink (snapshot);
+	g_unlink (name);
+	g_rmdir (tmpdir);
+	g_free (journal);
+	g_free (snapshot);
+	g_free (name);
+	g_free (tmpdir);
+}
+END_TEST
+
+static RhythmDBEntry *
+create_search_entry (const char *location, const char *artist, const char *title)
+{
+	RhythmDBEntry *entry;
+	GValue val = {0,};
+
+	entry = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, location);
+	fail_unless (entry != NULL, "failed to create entry");
+
+	g_value_init (&val, G_TYPE_STRING);
+	g_value_set_static_string (&val, artist);
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_ARTIST, &val);
+	g_value_unset (&val);
+
+	g_value_init (&val, G_TYPE_STRING);
+	g_value_set_static_string (&val, title);
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_TITLE, &val);
+	g_value_unset (&val);
+
+	return entry;
+}
+
+static int
+count_search_matches (const char *search)
+{
+	RhythmDBQueryModel *model;
+	int count;
+
+	model = rhythmdb_query_model_new_empty (db);
+	g_object_set (G_OBJECT (model), "show-hidden", TRUE, NULL);
+	set_waiting_signal (G_OBJECT (model), "complete");
+	rhythmdb_do_full_query (db, RHYTHMDB_QUERY_RESULTS (model),
+				RHYTHMDB_QUERY_PROP_EQUALS,
+				RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+				RHYTHMDB_QUERY_PROP_LIKE,
+				RHYTHMDB_PROP_SEARCH_MATCH, search,
+				RHYTHMDB_QUERY_END);
+	wait_for_signal ();
+	count = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL);
+	g_object_unref (model);
+	return count;
+}
+
+START_TEST (test_rhythmdb_search_index)
+{
+	RhythmDBEntry *entry;
+	GValue val = {0,};
+
+	create_search_entry ("file:///sin.ogg", "Nine Inch Nails", "Sin");
+	entry = create_search_entry ("file:///hate.ogg", "Nine Inch Nails", "Head Like A Hole");
+	create_search_entry ("file:///other.ogg", "Evanescence", "Bring Me To Life");
+	rhythmdb_commit (db);
+
+	fail_unless (count_search_matches ("inch") == 2, "substring search incorrect");
+	fail_unless (count_search_matches ("nine hole") == 1, "multiple word search incorrect");
+	fail_unless (count_search_matches ("LIFE") == 1, "search not case insensitive");
+	fail_unless (count_search_matches ("zebra") == 0, "search matched missing word");
+
+	/* the index must follow changes to entries */
+	g_value_init (&val, G_TYPE_STRING);
+	g_value_set_static_string (&val, "Zebra Crossing");
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_TITLE, &val);
+	g_value_unset (&val);
+	rhythmdb_commit (db);
+
+	fail_unless (count_search_matches ("zebra") == 1, "changed title not found");
+	fail_unless (count_search_matches ("hole") == 0, "old title still found");
+
+	rhythmdb_entry_delete (db, entry);
+	rhythmdb_commit (db);
+
+	fail_unless (count_search_matches ("zebra") == 0, "deleted entry still found");
+	fail_unless (count_search_matches ("inch") == 1, "search after delete incorrect");
+}
+END_TEST
+
+static int
+count_play_count_matches (RhythmDBQueryType type, gulong play_count)
+{
+	RhythmDBQueryModel *model;
+	int count;
+
+	model = rhythmdb_query_model_new_empty (db);
+	g_object_set (G_OBJECT (model), "show-hidden", TRUE, NULL);
+	set_waiting_signal (G_OBJECT (model), "complete");
+	rhythmdb_do_full_query (db, RHYTHMDB_QUERY_RESULTS (model),
+				RHYTHMDB_QUERY_PROP_EQUALS,
+				RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+				type,
+				RHYTHMDB_PROP_PLAY_COUNT, play_count,
+				RHYTHMDB_QUERY_END);
+	wait_for_signal ();
+	count = gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL);
+	g_object_unref (model);
+	return count;
+}
+
+START_TEST (test_rhythmdb_property_index)
+{
+	RhythmDBEntry *entries[5];
+	RhythmDBQuery *query;
+	GValue val = {0,};
+	char *plan;
+	int i;
+
+	for (i = 0; i < G_N_ELEMENTS (entries); i++) {
+		char *uri;
+
+		uri = g_strdup_printf ("file:///%d.ogg", i);
+		entries[i] = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, uri);
+		fail_unless (entries[i] != NULL, "failed to create entry");
+		g_free (uri);
+
+		g_value_init (&val, G_TYPE_ULONG);
+		g_value_set_ulong (&val, i * 10);
+		rhythmdb_entry_set (db, entries[i], RHYTHMDB_PROP_PLAY_COUNT, &val);
+		g_value_unset (&val);
+	}
+	rhythmdb_commit (db);
+
+	/* explaining the query doesn't build the index */
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 40,
+				      RHYTHMDB_QUERY_END);
+	plan = rhythmdb_query_explain (db, query);
+	fail_unless (strstr (plan, "tree traversal") != NULL, "index used before being built: %s", plan);
+	g_free (plan);
+	plan = rhythmdb_query_explain (db, query);
+	fail_unless (strstr (plan, "tree traversal") != NULL, "index built by explaining a query: %s", plan);
+	g_free (plan);
+
+	fail_unless (count_play_count_matches (RHYTHMDB_QUERY_PROP_EQUALS, 20) == 1, "equality query incorrect");
+	fail_unless (count_play_count_matches (RHYTHMDB_QUERY_PROP_GREATER, 30) == 2, "greater-than query incorrect");
+	fail_unless (count_play_count_matches (RHYTHMDB_QUERY_PROP_LESS, 10) == 2, "less-than query incorrect");
+	fail_unless (count_play_count_matches (RHYTHMDB_QUERY_PROP_EQUALS, 25) == 0, "missing value found");
+
+	/* running a query does */
+	plan = rhythmdb_query_explain (db, query);
+	fail_unless (strstr (plan, "play-count index") != NULL, "property index not used: %s", plan);
+	g_free (plan);
+	rhythmdb_query_free (query);
+
+	/* the index must follow changes to entries */
+	g_value_init (&val, G_TYPE_ULONG);
+	g_value_set_ulong (&val, 25);
+	rhythmdb_entry_set (db, entries[0], RHYTHMDB_PROP_PLAY_COUNT, &val);
+	g_value_unset (&val);
+	rhythmdb_commit (db);
+
+	fail_unless (count_play_count_matches (RHYTHMDB_QUERY_PROP_EQUALS, 25) == 1, "changed value not found");
+	fail_unless (count_play_count_matches (RHYTHMDB_QUERY_PROP_LESS, 10) == 1, "old value still found");
+
+	rhythmdb_entry_delete (db, entries[4]);
+	rhythmdb_commit (db);
+
+	fail_unless (count_play_count_matches (RHYTHMDB_QUERY_PROP_GREATER, 30) == 1, "deleted entry still found");
+}
+END_TEST
+
+static void
+check_compiled_query (RhythmDBEntry *entry, gboolean expected, RhythmDBQuery *query)
+{
+	RhythmDBCompiledQuery *compiled;
+	char *str;
+
+	rhythmdb_query_preprocess (db, query);
+	compiled = rhythmdb_query_compile (db, query);
+	str = rhythmdb_query_to_string (db, query);
+
+	fail_unless (rhythmdb_evaluate_query (db, query, entry) == expected,
+		     "query %s evaluated incorrectly", str);
+	fail_unless (rhythmdb_compiled_query_evaluate (compiled, entry) == expected,
+		     "compiled query %s evaluated incorrectly", str);
+
+	g_free (str);
+	rhythmdb_compiled_query_free (compiled);
+	rhythmdb_query_free (query);
+}
+
+START_TEST (test_rhythmdb_compiled_query)
+{
+	RhythmDBEntry *entry;
+	GValue val = {0,};
+
+	entry = create_search_entry ("file:///sin.ogg", "Nine Inch Nails", "Sin");
+
+	g_value_init (&val, G_TYPE_ULONG);
+	g_value_set_ulong (&val, 3);
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_PLAY_COUNT, &val);
+	g_value_unset (&val);
+
+	g_value_init (&val, G_TYPE_DOUBLE);
+	g_value_set_double (&val, 4.0);
+	rhythmdb_entry_set (db, entry, RHYTHMDB_PROP_RATING, &val);
+	g_value_unset (&val);
+	rhythmdb_commit (db);
+
+	check_compiled_query (entry, TRUE,
+			      rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_IGNORE,
+						    RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ARTIST, "Nine Inch Nails",
+						    RHYTHMDB_QUERY_END));
+	check_compiled_query (entry, FALSE,
+			      rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_NOT_EQUAL, RHYTHMDB_PROP_ARTIST, "Nine Inch Nails",
+						    RHYTHMDB_QUERY_END));
+	check_compiled_query (entry, TRUE,
+			      rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_TITLE, "Si",
+						    RHYTHMDB_QUERY_PROP_PREFIX, RHYTHMDB_PROP_ARTIST, "Nine",
+						    RHYTHMDB_QUERY_END));
+	check_compiled_query (entry, TRUE,
+			      rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 3,
+						    RHYTHMDB_QUERY_PROP_LESS, RHYTHMDB_PROP_RATING, 4.0,
+						    RHYTHMDB_QUERY_END));
+	check_compiled_query (entry, FALSE,
+			      rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_PLAY_COUNT, (gulong) 4,
+						    RHYTHMDB_QUERY_END));
+	check_compiled_query (entry, TRUE,
+			      rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ARTIST, "Evanescence",
+						    RHYTHMDB_QUERY_DISJUNCTION,
+						    RHYTHMDB_QUERY_PROP_LIKE, RHYTHMDB_PROP_SEARCH_MATCH, "inch sin",
+						    RHYTHMDB_QUERY_END));
+	check_compiled_query (entry, FALSE,
+			      rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_NOT_LIKE, RHYTHMDB_PROP_SEARCH_MATCH, "nails",
+						    RHYTHMDB_QUERY_END));
+
+	/* objects are ordered the same way the backend orders them */
+	check_compiled_query (entry, (gpointer) RHYTHMDB_ENTRY_TYPE_IGNORE >= (gpointer) RHYTHMDB_ENTRY_TYPE_SONG,
+			      rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_GREATER, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						    RHYTHMDB_QUERY_END));
+	check_compiled_query (entry, (gpointer) RHYTHMDB_ENTRY_TYPE_IGNORE <= (gpointer) RHYTHMDB_ENTRY_TYPE_SONG,
+			      rhythmdb_query_parse (db,
+						    RHYTHMDB_QUERY_PROP_LESS, RHYTHMDB_PROP_TYPE, RHYTHMDB_ENTRY_TYPE_SONG,
+						    RHYTHMDB_QUERY_END));
+
+	/* a NULL query matches everything */
+	fail_unless (rhythmdb_query_compile (db, NULL) == NULL, "NULL query compiled");
+	fail_unless (rhythmdb_compiled_query_evaluate (NULL, entry), "NULL compiled query didn't match");
+}
+END_TEST
+
 static void
 commit_change_merge_cb (RhythmDB *db, RhythmDBEntry *entry, GArray *changes, gpointer ok)
 {
@@ -508,6 +1117,310 @@ START_TEST (test_rhythmdb_commit_change_merging)
 }
 END_TEST
 
+static void
+entries_changed_cb (RhythmDB *db, GPtrArray *entries, GPtrArray *changes, const RhythmDBPropMask *props, gpointer data)
+{
+	fail_unless (entries->len == 2, "changed entries not batched");
+	fail_unless (changes->len == entries->len, "change lists don't match entries");
+	fail_unless (rhythmdb_prop_mask_contains (props, RHYTHMDB_PROP_GENRE), "changed property missing from mask");
+	fail_unless (rhythmdb_prop_mask_contains (props, RHYTHMDB_PROP_ARTIST), "changed property missing from mask");
+	fail_if (rhythmdb_prop_mask_contains (props, RHYTHMDB_PROP_TITLE), "unchanged property in mask");
+}
+
+START_TEST (test_rhythmdb_entries_changed)
+{
+	RhythmDBEntry *a;
+	RhythmDBEntry *b;
+	RhythmDBEntry *resort[40];
+	RhythmDBQueryModel *model;
+	GPtrArray *query;
+	GValue val = {0,};
+	int i;
+
+	a = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///a.ogg");
+	b = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, "file:///b.ogg");
+	fail_unless (a != NULL && b != NULL, "failed to create entries");
+	rhythmdb_commit (db);
+
+	g_value_init (&val, G_TYPE_STRING);
+	g_value_set_static_string (&val, "Anything");
+	rhythmdb_entry_set (db, a, RHYTHMDB_PROP_GENRE, &val);
+	rhythmdb_entry_set (db, b, RHYTHMDB_PROP_ARTIST, &val);
+	g_value_unset (&val);
+
+	g_signal_connect (G_OBJECT (db), "entries-changed", G_CALLBACK (entries_changed_cb), NULL);
+	set_waiting_signal (G_OBJECT (db), "entries-changed");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+	g_signal_handlers_disconnect_by_func (G_OBJECT (db), G_CALLBACK (entries_changed_cb), NULL);
+
+	/* a large batch of sort key changes re-sorts the model in one go */
+	for (i = 0; i < G_N_ELEMENTS (resort); i++) {
+		char *uri = g_strdup_printf ("file:///resort-%d.ogg", i);
+
+		resort[i] = rhythmdb_entry_new (db, RHYTHMDB_ENTRY_TYPE_IGNORE, uri);
+		set_entry_string (db, resort[i], RHYTHMDB_PROP_ALBUM, "Resort");
+		set_entry_ulong (db, resort[i], RHYTHMDB_PROP_TRACK_NUMBER, i + 1);
+		g_free (uri);
+	}
+	rhythmdb_commit (db);
+
+	model = rhythmdb_query_model_new_empty (db);
+	g_object_set (model, "sort-func", rhythmdb_query_model_album_sort_func, NULL);
+	query = rhythmdb_query_parse (db,
+				      RHYTHMDB_QUERY_PROP_EQUALS, RHYTHMDB_PROP_ALBUM, "Resort",
+				      RHYTHMDB_QUERY_END);
+	rhythmdb_do_full_query_parsed (db, RHYTHMDB_QUERY_RESULTS (model), query);
+	rhythmdb_query_free (query);
+	fail_unless (gtk_tree_model_iter_n_children (GTK_TREE_MODEL (model), NULL) == G_N_ELEMENTS (resort),
+		     "wrong number of results");
+
+	for (i = 0; i < G_N_ELEMENTS (resort); i++)
+		set_entry_ulong (db, resort[i], RHYTHMDB_PROP_TRACK_NUMBER, G_N_ELEMENTS (resort) - i);
+	set_waiting_signal (G_OBJECT (db), "entries-changed");
+	rhythmdb_commit (db);
+	wait_for_signal ();
+
+	for (i = 0; i < G_N_ELEMENTS (resort); i++) {
+		GtkTreePath *path;
+		RhythmDBEntry *entry;
+
+		path = gtk_tree_path_new_from_indices (i, -1);
+		entry = rhythmdb_query_model_tree_path_to_entry (model, path);
+		gtk_tree_path_free (path);
+		fail_unless (entry == resort[G_N_ELEMENTS (resort) - 1 - i], "model not re-sorted at row %d", i);
+		rhythmdb_entry_unref (entry);
+	}
+	g_object_unref (model);
+}
+END_TEST
+
+START_TEST (test_rhythmdb_dir_index)
+{
+	RhythmDBDirIndex *index;
+	const char *subdirs[] = { "Albums", "Singles", NULL };
+	const char *uri = "file:///home/user/Music";
+	char **found;
+	char *tmpdir;
+	char *path;
+
+	tmpdir = g_dir_make_tmp ("test-rhythmdb-XXXXXX", NULL);
+	fail_unless (tmpdir != NULL, "failed to create temporary directory");
+	path = g_build_filename (tmpdir, "library-directories", NULL);
+
+	index = rhythmdb_dir_index_new (path);
+	fail_unless (rhythmdb_dir_index_get_subdirs (index, uri, 1000) == NULL, "empty index has listing");
+	rhythmdb_dir_index_set_listing (index, uri, 1000, subdirs);
+	rhythmdb_dir_index_save (index);
+	rhythmdb_dir_index_free (index);
+
+	index = rhythmdb_dir_index_new (path);
+	found = rhythmdb_dir_index_get_subdirs (index, uri, 1000);
+	fail_unless (found != NULL, "listing not loaded");
+	fail_unless (g_strv_length (found) == 2, "wrong number of subdirectories");
+	fail_unless (strcmp (found[0], "Albums") == 0 && strcmp (found[1], "Singles") == 0,
+		     "subdirectories loaded incorrectly");
+	g_strfreev (found);
+	fail_unless (rhythmdb_dir_index_get_subdirs (index, uri, 1001) == NULL, "listing used after directory changed");
+
+	/* directories that were only just modified may still be changing */
+	rhythmdb_dir_index_set_listing (index, uri, time (NULL), subdirs);
+	fail_unless (rhythmdb_dir_index_get_subdirs (index, uri, time (NULL)) == NULL, "listing recorded for unsettled directory");
+	rhythmdb_dir_index_free (index);
+
+	g_unlink (path);
+	g_rmdir (tmpdir);
+	g_free (path);
+	g_free (tmpdir);
+}
+END_TEST
+
+static gboolean
+is_monitored (const char *path)
+{
+	GFile *file;
+	gboolean monitored;
+
+	file = g_file_new_for_path (path);
+	monitored = (g_hash_table_lookup (db->priv->monitored_directories, file) != NULL);
+	g_object_unref (file);
+	return monitored;
+}
+
+static void
+run_library_walk (const char *path)
+{
+	rhythmdb_stop_monitoring (db);
+	g_strfreev (db->priv->library_locations);
+	db->priv->library_locations = g_new0 (char *, 2);
+	db->priv->library_locations[0] = g_filename_to_uri (path, NULL, NULL);
+
+	rhythmdb_start_monitoring (db);
+	while (db->priv->library_walks > 0 || db->priv->add_monitors_id != 0)
+		g_main_context_iteration (NULL, TRUE);
+}
+
+START_TEST (test_rhythmdb_library_walk_skip)
+{
+	const time_t old = 1000000000;
+	char *root;
+	char *root_uri;
+	char *a, *x, *b, *c;
+	char **subdirs;
+
+	root = g_dir_make_tmp ("test-rhythmdb-XXXXXX", NULL);
+	fail_unless (root != NULL, "failed to create temporary directory");
+	root_uri = g_filename_to_uri (root, NULL, NULL);
+	a = g_build_filename (root, "a", NULL);
+	x = g_build_filename (a, "x", NULL);
+	b = g_build_filename (root, "b", NULL);
+	c = g_build_filename (root, "c", NULL);
+
+	fail_unless (g_mkdir_with_parents (x, 0700) == 0, "failed to create %s", x);
+	fail_unless (g_mkdir (b, 0700) == 0, "failed to create %s", b);
+	set_mtime (x, old);
+	set_mtime (a, old);
+	set_mtime (b, old);
+	set_mtime (root, old);
+
+	/* the first walk enumerates everything and records the listings */
+	run_library_walk (root);
+	fail_unless (is_monitored (root) && is_monitored (a) && is_monitored (x) && is_monitored (b),
+		     "directories not found by first walk");
+	subdirs = rhythmdb_dir_index_get_subdirs (db->priv->dir_index, root_uri, old);
+	fail_unless (subdirs != NULL, "listing not recorded");
+	fail_unless (g_strv_length (subdirs) == 2, "wrong number of subdirectories recorded");
+	g_strfreev (subdirs);
+
+	/* a directory appearing without the parent's modification time
+	 * changing isn't seen, but the recorded subdirectories are still walked.
+	 */
+	fail_unless (g_mkdir (c, 0700) == 0, "failed to create %s", c);
+	set_mtime (root, old);
+	run_library_walk (root);
+	fail_unless (is_monitored (a) && is_monitored (x) && is_monitored (b),
+		     "recorded subdirectories not walked");
+	fail_if (is_monitored (c), "unchanged directory enumerated");
+
+	/* once it changes, it's enumerated again */
+	set_mtime (root, time (NULL) - 10);
+	run_library_walk (root);
+	fail_unless (is_monitored (c), "changed directory not enumerated");
+	fail_unless (is_monitored (x), "subdirectory of changed directory not walked");
+
+	rhythmdb_stop_monitoring (db);
+	g_strfreev (db->priv->library_locations);
+	db->priv->library_locations = NULL;
+
+	g_rmdir (x);
+	g_rmdir (a);
+	g_rmdir (b);
+	g_rmdir (c);
+	g_rmdir (root);
+	g_free (a);
+	g_free (x);
+	g_free (b);
+	g_free (c);
+	g_free (root_uri);
+	g_free (root);
+}
+END_TEST
+
+START_TEST (test_rhythmdb_monitor_limit)
+{
+	GLogLevelFlags fatal;
+	char *root;
+	char *path;
+	int i;
+
+	root = g_dir_make_tmp ("test-rhythmdb-XXXXXX", NULL);
+	fail_unless (root != NULL, "failed to create temporary directory");
+	for (i = 0; i < 4; i++) {
+		path = g_strdup_printf ("%s/%d", root, i);
+		fail_unless (g_mkdir (path, 0700) == 0, "failed to create %s", path);
+		g_free (path);
+	}
+
+	/* reaching the limit prints a warning */
+	db->priv->max_monitors = 2;
+	fatal = g_log_set_always_fatal (G_LOG_LEVEL_CRITICAL);
+	run_library_walk (root);
+	g_log_set_always_fatal (fatal);
+
+	fail_unless (g_hash_table_size (db->priv->monitored_directories) == 2,
+		     "monitored %u directories", g_hash_table_size (db->priv->monitored_directories));
+	fail_unless (db->priv->monitor_limit_reached, "monitor limit not reached");
+	fail_unless (is_monitored (root), "library location not monitored");
+
+	rhythmdb_stop_monitoring (db);
+	fail_if (db->priv->monitor_limit_reached, "monitor limit not reset");
+	g_strfreev (db->priv->library_locations);
+	db->priv->library_locations = NULL;
+
+	for (i = 0; i < 4; i++) {
+		path = g_strdup_printf ("%s/%d", root, i);
+		g_rmdir (path);
+		g_free (path);
+	}
+	g_rmdir (root);
+	g_free (root);
+}
+END_TEST
+
+START_TEST (test_rhythmdb_monitor_move)
+{
+	GFileMonitor *monitor;
+	GFile *root_file;
+	GFile *from;
+	GFile *to;
+	char *root;
+	char *a, *x, *b, *y;
+
+	root = g_dir_make_tmp ("test-rhythmdb-XXXXXX", NULL);
+	fail_unless (root != NULL, "failed to create temporary directory");
+	a = g_build_filename (root, "a", NULL);
+	x = g_build_filename (a, "x", NULL);
+	b = g_build_filename (root, "b", NULL);
+	y = g_build_filename (b, "x", NULL);
+	fail_unless (g_mkdir_with_parents (x, 0700) == 0, "failed to create %s", x);
+
+	run_library_walk (root);
+	fail_unless (is_monitored (a) && is_monitored (x), "directories not monitored");
+
+	/* deliver the move event directly rather than waiting for the file monitor */
+	fail_unless (g_rename (a, b) == 0, "failed to rename %s", a);
+	root_file = g_file_new_for_path (root);
+	from = g_file_new_for_path (a);
+	to = g_file_new_for_path (b);
+	monitor = g_hash_table_lookup (db->priv->monitored_directories, root_file);
+	fail_unless (monitor != NULL, "library location not monitored");
+	g_signal_emit_by_name (monitor, "changed", from, to, G_FILE_MONITOR_EVENT_MOVED);
+	while (db->priv->add_monitors_id != 0)
+		g_main_context_iteration (NULL, TRUE);
+
+	fail_if (is_monitored (a), "moved directory still monitored at the old location");
+	fail_if (is_monitored (x), "moved subdirectory still monitored at the old location");
+	fail_unless (is_monitored (b), "moved directory not monitored");
+	fail_unless (is_monitored (y), "moved subdirectory not monitored");
+
+	rhythmdb_stop_monitoring (db);
+	g_strfreev (db->priv->library_locations);
+	db->priv->library_locations = NULL;
+
+	g_object_unref (root_file);
+	g_object_unref (from);
+	g_object_unref (to);
+	g_rmdir (y);
+	g_rmdir (b);
+	g_rmdir (root);
+	g_free (a);
+	g_free (x);
+	g_free (b);
+	g_free (y);
+	g_free (root);
+}
+END_TEST
+
 static Suite *
 rhythmdb_suite (void)
 {
@@ -526,18 +1439,31 @@ rhythmdb_suite (void)
 	tcase_add_test (tc_chain, test_rhythmdb_multiple);
 	tcase_add_test (tc_chain, test_rhythmdb_mirroring);
 	tcase_add_test (tc_chain, test_rhythmdb_keywords);
+	tcase_add_test (tc_chain, test_rhythmdb_search_index);
+	tcase_add_test (tc_chain, test_rhythmdb_property_index);
+	tcase_add_test (tc_chain, test_rhythmdb_compiled_query);
 	/*tcase_add_test (tc_chain, test_rhythmdb_signals);*/
 	/*tcase_add_test (tc_chain, test_rhythmdb_query);*/
 	/* FIXME: add some keywords to the deserialisation tests */
 	tcase_add_test (tc_chain, test_rhythmdb_deserialisation1);
 	tcase_add_test (tc_chain, test_rhythmdb_deserialisation2);
 	tcase_add_test (tc_chain, test_rhythmdb_deserialisation3);
+	tcase_add_test (tc_chain, test_rhythmdb_snapshot);
+	tcase_add_test (tc_chain, test_rhythmdb_journal);
+	tcase_add_test (tc_chain, test_rhythmdb_parallel_load);
+	tcase_add_test (tc_chain, test_rhythmdb_parallel_load_error);
+	tcase_add_test (tc_chain, test_rhythmdb_load_merge_index);
+	tcase_add_test (tc_chain, test_rhythmdb_dir_index);
+	tcase_add_test (tc_chain, test_rhythmdb_library_walk_skip);
+	tcase_add_test (tc_chain, test_rhythmdb_monitor_limit);
+	tcase_add_test (tc_chain, test_rhythmdb_monitor_move);
 	/*tcase_add_test (tc_chain, test_rhythmdb_serialisation);*/
 
 	/* tests for breakable bug fixes */
 	tcase_add_test (tc_chain, test_rhythmdb_podcast_upgrade);
 	tcase_add_test (tc_chain, test_rhythmdb_modify_after_delete);
 	tcase_add_test (tc_chain, test_rhythmdb_commit_change_merging);
+	tcase_add_test (tc_chain, test_rhythmdb_entries_changed);
 
 	return s;
 }
@@ -46,6 +46,8 @@
 #include "rb-fading-image.h"
 #include "rb-file-helpers.h"
 #include "rb-ext-db.h"
+#include "rb-waveform-cache.h"
+#include "rb-waveform.h"
 
 #define LABEL_SELECT_PADDING	20
 
@@ -58,6 +60,10 @@
  * position slider indicating the playback position.  It translates slider
  * move and drag events into seek requests for the player backend.
  *
+ * When the playing track is a local file, the slider is drawn over a waveform
+ * of the track, taken from the #RBWaveformCache.  Tracks are analysed in the
+ * background the first time they are played.
+ *
  * For shoutcast-style streams, the title/artist/album display is supplemented
  * by metadata extracted from the stream.  See #RBStreamingSource for more information
  * on how the metadata is reported.
@@ -90,6 +96,7 @@ static void slider_changed_callback (GtkWidget *widget, RBHeader *header);
 static gboolean slider_scroll_callback (GtkWidget *widget, GdkEventScroll *event, RBHeader *header);
 static gboolean slider_focus_out_callback (GtkWidget *widget, GdkEvent *event, RBHeader *header);
 static void time_button_clicked_cb (GtkWidget *button, RBHeader *header);
+static gboolean slider_draw_callback (GtkWidget *widget, cairo_t *cr, RBHeader *header);
 
 static void rb_header_elapsed_changed_cb (RBShellPlayer *player, gint64 elapsed, RBHeader *header);
 static void rb_header_extra_metadata_cb (RhythmDB *db, RhythmDBEntry *entry, const char *property_name, const GValue *metadata, RBHeader *header);
@@ -109,6 +116,8 @@ struct RBHeaderPrivate
 	RhythmDB *db;
 	RhythmDBEntry *entry;
 	RBExtDB *art_store;
+	RBWaveformCache *waveform_cache;
+	GBytes *envelope;
 
 	RBShellPlayer *shell_player;
 	RBSource *playing_source;
@@ -329,6 +338,10 @@ rb_header_constructed (GObject *object)
 				 "focus-out-event",
 				 G_CALLBACK (slider_focus_out_callback),
 				 header, 0);
+	g_signal_connect_object (G_OBJECT (header->priv->scale),
+				 "draw",
+				 G_CALLBACK (slider_draw_callback),
+				 header, 0);
 	gtk_scale_set_draw_value (GTK_SCALE (header->priv->scale), FALSE);
 	gtk_widget_set_size_request (header->priv->scale, 150, -1);
 
@@ -392,6 +405,8 @@ rb_header_constructed (GObject *object)
 				 G_CALLBACK (time_button_clicked_cb),
 				 header, 0);
 
+	header->priv->waveform_cache = rb_waveform_cache_new ();
+
 	/* image display */
 	header->priv->art_store = rb_ext_db_new ("album-art");
 	g_signal_connect (header->priv->art_store,
@@ -456,6 +471,12 @@ rb_header_dispose (GObject *object)
 		header->priv->art_store = NULL;
 	}
 
+	g_clear_object (&header->priv->waveform_cache);
+	if (header->priv->envelope != NULL) {
+		g_bytes_unref (header->priv->envelope);
+		header->priv->envelope = NULL;
+	}
+
 	g_clear_object (&header->priv->song);
 	g_clear_object (&header->priv->details);
 	g_clear_object (&header->priv->not_playing);
@@ -517,6 +538,21 @@ art_added_cb (RBExtDB *db, RBExtDBKey *key, const char *filename, GValue *data,
 	art_cb (key, key, filename, data, header);
 }
 
+static void
+envelope_cb (const char *uri, GBytes *envelope, RBHeader *header)
+{
+	if (header->priv->entry == NULL || envelope == NULL)
+		return;
+
+	if (g_strcmp0 (uri, rhythmdb_entry_get_string (header->priv->entry, RHYTHMDB_PROP_LOCATION)) != 0)
+		return;
+
+	if (header->priv->envelope != NULL)
+		g_bytes_unref (header->priv->envelope);
+	header->priv->envelope = g_bytes_ref (envelope);
+	gtk_widget_queue_draw (header->priv->scale);
+}
+
 static void
 playback_status_changed_cb (RBSource *source, RBHeader *header)
 {
@@ -536,12 +572,27 @@ rb_header_playing_song_changed_cb (RBShellPlayer *player, RhythmDBEntry *entry,
 
 	header->priv->entry = entry;
 	header->priv->elapsed_time = 0;
+	if (header->priv->envelope != NULL) {
+		g_bytes_unref (header->priv->envelope);
+		header->priv->envelope = NULL;
+	}
 	if (header->priv->entry) {
 		RBExtDBKey *key;
+		const char *location;
 
 		header->priv->duration = rhythmdb_entry_get_ulong (header->priv->entry,
 								   RHYTHMDB_PROP_DURATION);
 
+		location = rhythmdb_entry_get_string (entry, RHYTHMDB_PROP_LOCATION);
+		if (header->priv->duration > 0 && rb_uri_is_local (location)) {
+			rb_waveform_cache_request (header->priv->waveform_cache,
+						   location,
+						   rhythmdb_entry_get_ulong (entry, RHYTHMDB_PROP_MTIME),
+						   (RBWaveformCacheCallback) envelope_cb,
+						   g_object_ref (header),
+						   g_object_unref);
+		}
+
 		if (header->priv->art_key == NULL ||
 		    rhythmdb_entry_matches_ext_db_key (header->priv->db, entry, header->priv->art_key) == FALSE) {
 			rb_fading_image_start (RB_FADING_IMAGE (header->priv->image), 2000);
@@ -1176,6 +1227,74 @@ slider_focus_out_callback (GtkWidget *widget, GdkEvent *event, RBHeader *header)
 	return FALSE;
 }
 
+static void
+add_envelope_columns (RBHeader *header, cairo_t *cr, GdkRectangle *rect, int height, int first, int last, gboolean rms)
+{
+	int x;
+
+	for (x = first; x < last; x++) {
+		float peak;
+		float level;
+
+		if (rb_waveform_envelope_get_range (header->priv->envelope,
+						    (double) x / rect->width,
+						    (double) (x + 1) / rect->width,
+						    &peak, &level) == FALSE)
+			continue;
+
+		if (rms == FALSE)
+			level = peak;
+		cairo_rectangle (cr, rect->x + x, (height - level * height) / 2.0, 1, level * height);
+	}
+}
+
+static gboolean
+slider_draw_callback (GtkWidget *widget, cairo_t *cr, RBHeader *header)
+{
+	GtkStyleContext *context;
+	GdkRectangle rect;
+	GdkRGBA color;
+	double upper;
+	int played;
+	int height;
+
+	if (header->priv->envelope == NULL)
+		return FALSE;
+
+	gtk_range_get_range_rect (GTK_RANGE (widget), &rect);
+	upper = gtk_adjustment_get_upper (header->priv->adjustment);
+	if (rect.width <= 0 || upper <= 0.0)
+		return FALSE;
+
+	height = gtk_widget_get_allocated_height (widget);
+	played = (int) (rect.width * gtk_adjustment_get_value (header->priv->adjustment) / upper);
+	played = CLAMP (played, 0, rect.width);
+
+	context = gtk_widget_get_style_context (widget);
+	gtk_style_context_get_color (context, gtk_widget_get_state_flags (widget), &color);
+
+	/* draw the waveform under the slider, with the part that has
+	 * already been played drawn more strongly than the rest.
+	 */
+	cairo_save (cr);
+	add_envelope_columns (header, cr, &rect, height, played, rect.width, FALSE);
+	cairo_set_source_rgba (cr, color.red, color.green, color.blue, color.alpha * 0.15);
+	cairo_fill (cr);
+	add_envelope_columns (header, cr, &rect, height, played, rect.width, TRUE);
+	cairo_set_source_rgba (cr, color.red, color.green, color.blue, color.alpha * 0.25);
+	cairo_fill (cr);
+
+	add_envelope_columns (header, cr, &rect, height, 0, played, FALSE);
+	cairo_set_source_rgba (cr, color.red, color.green, color.blue, color.alpha * 0.3);
+	cairo_fill (cr);
+	add_envelope_columns (header, cr, &rect, height, 0, played, TRUE);
+	cairo_set_source_rgba (cr, color.red, color.green, color.blue, color.alpha * 0.5);
+	cairo_fill (cr);
+	cairo_restore (cr);
+
+	return FALSE;
+}
+
 static void
 rb_header_update_elapsed (RBHeader *header)
 {